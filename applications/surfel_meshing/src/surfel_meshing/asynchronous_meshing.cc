@@ -36,6 +36,7 @@
 #include "surfel_meshing/cuda_surfels_cpu.h"
 #include "surfel_meshing/surfel_meshing_render_window.h"
 #include "surfel_meshing/surfel_meshing.h"
+#include "surfel_meshing/surfel_recording.h"
 
 namespace vis {
 
@@ -43,41 +44,50 @@ AsynchronousMeshing::AsynchronousMeshing(
     SurfelMeshing* surfel_meshing,
     CUDASurfelsCPU* cuda_surfels_cpu_buffers,
     bool log_timings,
+    bool output_mesh_deltas,
+    SurfelRecordingWriter* surfel_recorder,
     const shared_ptr<SurfelMeshingRenderWindow>& render_window)
     : surfel_meshing_(surfel_meshing),
       cuda_surfels_cpu_buffers_(cuda_surfels_cpu_buffers),
       log_timings_(log_timings),
+      output_mesh_deltas_(output_mesh_deltas),
+      surfel_recorder_(surfel_recorder),
       render_window_(render_window) {
   output_mesh_ = nullptr;
-  all_work_done_ = false;
+  have_output_delta_ = false;
+  if (output_mesh_deltas_) {
+    surfel_meshing_->SetMeshDeltaTracking(true);
+  }
+  idle_ = false;
+  have_triangulation_focus_ = false;
   
   triangulation_thread_exit_requested_ = false;
-  new_input_surfels_available_ = false;
   triangulation_thread_.reset(new thread(bind(&AsynchronousMeshing::ThreadMain, this)));
 }
 
 void AsynchronousMeshing::ThreadMain() {
   while (true) {
-    // Wait until there is a change to the surfels.
-    // ### Input data lock start ###
-    unique_lock<mutex> input_data_lock(input_data_mutex_);
-    while (!new_input_surfels_available_ && !triangulation_thread_exit_requested_) {
-      all_work_done_ = true;
-      // all_work_done_condition_.notify_all();
-      new_input_surfels_available_condition_.wait(input_data_lock);
-    }
-    
-    // Exit if requested.
+    // Get the latest surfels, or wait until there are new ones. The wait
+    // uses a timeout since the notification is sent without holding
+    // wake_up_mutex_ (such that the fusion side never blocks), so it may get
+    // lost if it is sent just before the wait starts. If the triangulation
+    // budget left surfels for later, continue with those instead of waiting.
     if (triangulation_thread_exit_requested_) {
       return;
     }
-    
-    // Swap pointers in the shared buffer to get exclusive access to the latest
-    // input.
-    cuda_surfels_cpu_buffers_->WaitForLockAndSwapBuffers();
-    new_input_surfels_available_ = false;
-    input_data_lock.unlock();
-    // ### Input data lock end ###
+    bool have_new_input = cuda_surfels_cpu_buffers_->AcquireLatestBuffers();
+    if (!have_new_input && surfel_meshing_->remesh_backlog_size() == 0) {
+      idle_ = true;
+      if (!cuda_surfels_cpu_buffers_->has_new_snapshot()) {
+        unique_lock<mutex> wake_up_lock(wake_up_mutex_);
+        wake_up_condition_.wait_for(wake_up_lock, chrono::milliseconds(2), [&]{
+          return cuda_surfels_cpu_buffers_->has_new_snapshot() ||
+                 triangulation_thread_exit_requested_;
+        });
+      }
+      idle_ = false;
+      continue;
+    }
     
     
     ConditionalTimer sync_timer_1("Sync1");
@@ -87,19 +97,33 @@ void AsynchronousMeshing::ThreadMain() {
     start_time_mutex_.unlock();
     
     // Convert buffers to CPU surfels.
-    surfel_meshing_->IntegrateCUDABuffers(
-        cuda_surfels_cpu_buffers_->read_buffers().frame_index,
-        *cuda_surfels_cpu_buffers_);
+    if (have_new_input) {
+      surfel_meshing_->IntegrateCUDABuffers(
+          cuda_surfels_cpu_buffers_->read_buffers().frame_index,
+          *cuda_surfels_cpu_buffers_);
+    }
     
     float sync_seconds_1 = sync_timer_1.Stop(false);
     
+    if (surfel_recorder_ && have_new_input) {
+      surfel_recorder_->WriteSnapshot(cuda_surfels_cpu_buffers_->read_buffers());
+    }
+    
     
     // Check remeshing.
     ConditionalTimer check_remeshing_timer("CheckRemeshing()");
-    surfel_meshing_->CheckRemeshing();
+    if (have_new_input) {
+      surfel_meshing_->CheckRemeshing();
+    }
     float remeshing_seconds = check_remeshing_timer.Stop();
     
-    // Triangulate.
+    // Triangulate, prioritizing the surfels close to the latest camera
+    // position if it was set.
+    focus_mutex_.lock();
+    if (have_triangulation_focus_) {
+      surfel_meshing_->SetTriangulationFocus(triangulation_focus_);
+    }
+    focus_mutex_.unlock();
     ConditionalTimer triangulate_timer("Triangulate()");
     surfel_meshing_->Triangulate();
     float meshing_seconds = triangulate_timer.Stop();
@@ -108,14 +132,27 @@ void AsynchronousMeshing::ThreadMain() {
     // Output
     ConditionalTimer sync_timer_2("Sync2");
     
-    shared_ptr<Mesh3fCu8> new_output_mesh(new Mesh3fCu8());
-    surfel_meshing_->ConvertToMesh3fCu8(new_output_mesh.get(), true);
-    
-    unique_lock<mutex> output_lock(output_mutex_);
-    output_made_for_surfel_frame_index_ = cuda_surfels_cpu_buffers_->read_buffers().frame_index;
-    output_made_with_surfel_count_ = cuda_surfels_cpu_buffers_->read_buffers().surfel_count;
-    output_mesh_ = new_output_mesh;
-    output_lock.unlock();
+    if (output_mesh_deltas_) {
+      // Only output the changes, which is much cheaper than converting the
+      // whole mesh for large meshes.
+      surfel_meshing_->OutputMeshDelta(&iteration_delta_);
+      
+      unique_lock<mutex> output_lock(output_mutex_);
+      output_made_for_surfel_frame_index_ = cuda_surfels_cpu_buffers_->read_buffers().frame_index;
+      output_made_with_surfel_count_ = cuda_surfels_cpu_buffers_->read_buffers().surfel_count;
+      output_delta_.Append(iteration_delta_);
+      have_output_delta_ = true;
+      output_lock.unlock();
+    } else {
+      shared_ptr<Mesh3fCu8> new_output_mesh(new Mesh3fCu8());
+      surfel_meshing_->ConvertToMesh3fCu8(new_output_mesh.get(), true);
+      
+      unique_lock<mutex> output_lock(output_mutex_);
+      output_made_for_surfel_frame_index_ = cuda_surfels_cpu_buffers_->read_buffers().frame_index;
+      output_made_with_surfel_count_ = cuda_surfels_cpu_buffers_->read_buffers().surfel_count;
+      output_mesh_ = new_output_mesh;
+      output_lock.unlock();
+    }
     
     chrono::steady_clock::time_point end_time = chrono::steady_clock::now();
     start_time_mutex_.lock();
@@ -131,29 +168,31 @@ void AsynchronousMeshing::ThreadMain() {
       timings_log_ << "-synchronization " << (1000 * (sync_seconds_1 + sync_seconds_2)) << endl;
       timings_log_ << "-triangle_count " << surfel_meshing_->triangle_count() << endl;
       timings_log_ << "-deleted_triangle_count " << surfel_meshing_->deleted_triangle_count() << endl;
+      timings_log_ << "-remesh_backlog " << surfel_meshing_->remesh_backlog_size() << endl;
+      if (output_mesh_deltas_) {
+        timings_log_ << "-output_delta_size " << iteration_delta_.slots.size() << endl;
+      }
+      const OctreeNodePool& node_pool = surfel_meshing_->octree().node_pool();
+      timings_log_ << "-octree_live_nodes " << node_pool.live_node_count() << endl;
+      timings_log_ << "-octree_peak_nodes " << node_pool.peak_node_count() << endl;
+      timings_log_ << "-octree_node_bytes " << node_pool.allocated_bytes() << endl;
     }
   }
 }
 
 void AsynchronousMeshing::NotifyAboutNewInputSurfels() {
-  unique_lock<mutex> input_data_lock(input_data_mutex_);
-  new_input_surfels_available_ = true;
-  all_work_done_ = false;
-  input_data_lock.unlock();
-  new_input_surfels_available_condition_.notify_all();
+  wake_up_condition_.notify_one();
 }
 
-void AsynchronousMeshing::NotifyAboutNewInputSurfelsAlreadyLocked() {
-  new_input_surfels_available_ = true;
-  all_work_done_ = false;
-  new_input_surfels_available_condition_.notify_all();
+void AsynchronousMeshing::SetTriangulationFocus(const Vec3f& position) {
+  unique_lock<mutex> lock(focus_mutex_);
+  have_triangulation_focus_ = true;
+  triangulation_focus_ = position;
 }
 
 void AsynchronousMeshing::RequestExitAndWaitForIt() {
-  unique_lock<mutex> input_data_lock(input_data_mutex_);
   triangulation_thread_exit_requested_ = true;
-  input_data_lock.unlock();
-  new_input_surfels_available_condition_.notify_all();
+  wake_up_condition_.notify_one();
   
   triangulation_thread_->join();
   
@@ -165,12 +204,10 @@ void AsynchronousMeshing::RequestExitAndWaitForIt() {
   }
 }
 
-void AsynchronousMeshing::LockInputData() {
-  input_data_mutex_.lock();
-}
-
-void AsynchronousMeshing::UnlockInputData() {
-  input_data_mutex_.unlock();
+bool AsynchronousMeshing::all_work_done() const {
+  // Check for new input first: if the thread is idle afterwards, it did not
+  // acquire that input in between (it sets idle_ to false before acquiring).
+  return !cuda_surfels_cpu_buffers_->has_new_snapshot() && idle_;
 }
 
 void AsynchronousMeshing::GetOutput(
@@ -186,4 +223,26 @@ void AsynchronousMeshing::GetOutput(
   output_mesh_ = nullptr;
 }
 
+bool AsynchronousMeshing::GetOutputDelta(
+    u32* output_frame_index,
+    u32* output_surfel_count,
+    TriangleListDelta* output_delta) {
+  unique_lock<mutex> output_lock(output_mutex_);
+  
+  if (!have_output_delta_) {
+    return false;
+  }
+  
+  *output_frame_index = output_made_for_surfel_frame_index_;
+  *output_surfel_count = output_made_with_surfel_count_;
+  // Swap to keep the allocated memory on both sides.
+  std::swap(*output_delta, output_delta_);
+  output_delta_.Clear();
+  output_delta_.slot_count = output_delta->slot_count;
+  output_delta_.triangle_count = output_delta->triangle_count;
+  
+  have_output_delta_ = false;
+  return true;
+}
+
 }
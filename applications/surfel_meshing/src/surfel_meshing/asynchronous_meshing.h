@@ -36,42 +36,48 @@
 #include <sstream>
 #include <thread>
 
+#include <libvis/eigen.h>
 #include <libvis/libvis.h>
 #include <libvis/mesh.h>
 
+#include "surfel_meshing/triangle_list_delta.h"
+
 namespace vis {
 
 class CUDASurfelsCPU;
 class SurfelMeshing;
 class SurfelMeshingRenderWindow;
+class SurfelRecordingWriter;
 
 // Manages the surfel meshing thread.
 class AsynchronousMeshing {
  public:
-  // Starts the meshing thread.
+  // Starts the meshing thread. If output_mesh_deltas is true, the thread
+  // outputs the changes to the triangle list after each iteration (to be
+  // retrieved with GetOutputDelta()) instead of the full mesh (to be retrieved
+  // with GetOutput()). If surfel_recorder is non-null, the thread writes each
+  // surfel buffer snapshot that it receives to it.
   AsynchronousMeshing(
       SurfelMeshing* surfel_meshing,
       CUDASurfelsCPU* cuda_surfels_cpu_buffers,
       bool log_timings,
+      bool output_mesh_deltas,
+      SurfelRecordingWriter* surfel_recorder,
       const shared_ptr<SurfelMeshingRenderWindow>& render_window);
   
-  // Notifies the thread about new input.
+  // Wakes up the thread after new surfels were published with
+  // CUDASurfelsCPU::PublishWriteBuffers(). Does not block.
   void NotifyAboutNewInputSurfels();
   
-  // Notifies the thread about new input (while the mutex is locked using
-  // LockInputData()).
-  void NotifyAboutNewInputSurfelsAlreadyLocked();
+  // Sets the position around which the thread triangulates first if the
+  // SurfelMeshing has a triangulation budget. Usually called with the latest
+  // camera position.
+  void SetTriangulationFocus(const Vec3f& position);
   
   // Requests the thread to exit and waits until it actually exits. It will
   // still finish the last iteration it started when this is called.
   void RequestExitAndWaitForIt();
   
-  // Locks the input_data_mutex_.
-  void LockInputData();
-  
-  // Unlocks the input_data_mutex_.
-  void UnlockInputData();
-  
   // Gets the output mesh (and frame index, surfel count). If no new output is
   // available, the retured pointer is null.
   void GetOutput(
@@ -79,6 +85,15 @@ class AsynchronousMeshing {
       u32* output_surfel_count,
       shared_ptr<Mesh3fCu8>* output_mesh);
   
+  // Gets the changes to the triangle list since the last call (and frame
+  // index, surfel count) if output_mesh_deltas was set in the constructor.
+  // The deltas of all iterations since the last call are combined. Returns
+  // false if there was no new output.
+  bool GetOutputDelta(
+      u32* output_frame_index,
+      u32* output_surfel_count,
+      TriangleListDelta* output_delta);
+  
   // Returns the duration of the latest meshing iteration.
   inline float latest_triangulation_duration() const {
     return latest_triangulation_duration_;
@@ -91,10 +106,9 @@ class AsynchronousMeshing {
   }
   
   // Returns whether all work is done, i.e., the thread does not currently run
-  // a meshing iteration and there is also no new input.
-  inline bool all_work_done() const {
-    return all_work_done_;
-  }
+  // a meshing iteration, there is no new input, and no surfels were left for
+  // later due to the triangulation budget.
+  bool all_work_done() const;
   
  private:
   // Main function for the meshing thread.
@@ -104,6 +118,8 @@ class AsynchronousMeshing {
   SurfelMeshing* surfel_meshing_;
   CUDASurfelsCPU* cuda_surfels_cpu_buffers_;
   bool log_timings_;
+  bool output_mesh_deltas_;
+  SurfelRecordingWriter* surfel_recorder_;
   ostringstream timings_log_;
   shared_ptr<SurfelMeshingRenderWindow> render_window_;
   
@@ -115,16 +131,27 @@ class AsynchronousMeshing {
   // The triangulated mesh (only the indices are valid, the vertices are given
   // by the surfels).
   shared_ptr<Mesh3fCu8> output_mesh_;
+  // The accumulated triangle list changes, if output_mesh_deltas_ is set.
+  TriangleListDelta output_delta_;
+  bool have_output_delta_;
+  // Temporary delta of a single iteration, stored here to avoid re-allocation.
+  TriangleListDelta iteration_delta_;
+  
+  // Only used for sleeping while there is no new input. The surfels
+  // themselves are handed over without locking by cuda_surfels_cpu_buffers_.
+  mutex wake_up_mutex_;
+  condition_variable wake_up_condition_;
   
-  mutex input_data_mutex_;
-  condition_variable new_input_surfels_available_condition_;
-  atomic<bool> new_input_surfels_available_;
+  mutex focus_mutex_;
+  bool have_triangulation_focus_;
+  Vec3f triangulation_focus_;
   
   mutable mutex start_time_mutex_;
   chrono::steady_clock::time_point start_time_;
   atomic<float> latest_triangulation_duration_;
   
-  atomic<bool> all_work_done_;
+  // True while the thread waits for new input.
+  atomic<bool> idle_;
   
   atomic<bool> triangulation_thread_exit_requested_;
   unique_ptr<thread> triangulation_thread_;
@@ -0,0 +1,1046 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+// Headless batch version of the SurfelMeshing application. It runs the same
+// pipeline as main.cc (depth preprocessing, surfel fusion, meshing, and export)
+// on the CPU, without creating any windows or OpenGL / CUDA contexts, such
+// that it can run on machines without a display or GPU. The processing stages
+// run in parallel on different frames. At the end, the timings of all
+// processing stages are written in a tab-separated format.
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <libvis/command_line_parser.h>
+#include <libvis/depth_median_filter.h>
+#include <libvis/libvis.h>
+#include <libvis/mesh.h>
+#include <libvis/point_cloud.h>
+#include <libvis/rgbd_sequence_file.h>
+#include <libvis/rgbd_video.h>
+#include <libvis/rgbd_video_io_tum_dataset.h>
+#include <libvis/rgbd_video_prefetcher.h>
+#include <libvis/sophus.h>
+
+#include "surfel_meshing/cpu_surfel_reconstruction.h"
+#include "surfel_meshing/cuda_surfels_cpu.h"
+#include "surfel_meshing/depth_processing.h"
+#include "surfel_meshing/frame_pipeline.h"
+#include "surfel_meshing/surfel_meshing.h"
+#include "surfel_meshing/surfel_recording.h"
+
+using namespace vis;
+
+
+// Accumulates wall-clock timings of processing stages. The stages are listed
+// in the order in which they were first added. Add() may be called from
+// several threads.
+class StageTimings {
+ public:
+  void Add(const string& stage, double milliseconds) {
+    unique_lock<mutex> lock(mutex_);
+    auto it = stage_indices_.find(stage);
+    if (it == stage_indices_.end()) {
+      it = stage_indices_.insert(make_pair(stage, stages_.size())).first;
+      stages_.emplace_back();
+      stages_.back().name = stage;
+    }
+    
+    Stage* s = &stages_[it->second];
+    s->min_ms = (s->count == 0) ? milliseconds : std::min(s->min_ms, milliseconds);
+    s->max_ms = (s->count == 0) ? milliseconds : std::max(s->max_ms, milliseconds);
+    s->total_ms += milliseconds;
+    ++ s->count;
+  }
+  
+  // Writes one line per stage with tab-separated columns, preceded by a header
+  // line with the column names.
+  void Write(std::ostream* stream) const {
+    *stream << "stage\tcount\ttotal_ms\tmean_ms\tmin_ms\tmax_ms" << std::endl;
+    *stream << std::fixed << std::setprecision(3);
+    for (const Stage& s : stages_) {
+      *stream << s.name << "\t" << s.count << "\t" << s.total_ms << "\t"
+              << (s.total_ms / s.count) << "\t" << s.min_ms << "\t"
+              << s.max_ms << std::endl;
+    }
+  }
+  
+ private:
+  struct Stage {
+    string name;
+    usize count = 0;
+    double total_ms = 0;
+    double min_ms = 0;
+    double max_ms = 0;
+  };
+  
+  mutex mutex_;
+  vector<Stage> stages_;
+  unordered_map<string, usize> stage_indices_;
+};
+
+// Returns the time in milliseconds which passed since start.
+double MillisecondsSince(const chrono::steady_clock::time_point& start) {
+  return 1e-6 * chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+
+// Images of a frame, passed from the loading stage to the depth preprocessing
+// stage.
+struct LoadedFrame {
+  usize frame_index;
+  shared_ptr<Image<u16>> depth_image;
+  
+  // Only set for the frames which are integrated.
+  shared_ptr<Image<Vec3u8>> color_image;
+};
+
+// Results of the depth preprocessing of a frame, passed from the depth
+// preprocessing stage to the surfel fusion stage, which returns the buffers
+// for re-use afterwards.
+struct PreprocessingBuffers {
+  PreprocessingBuffers(int width, int height)
+      : filtered_depth_A(width, height),
+        filtered_depth_B(width, height),
+        normals(width, height),
+        radii(width, height) {}
+  
+  usize frame_index;
+  shared_ptr<Image<Vec3u8>> color_image;
+  
+  // The preprocessed depth image is in filtered_depth_A.
+  Image<u16> filtered_depth_A;
+  Image<u16> filtered_depth_B;
+  Image<Vec2f> normals;
+  Image<float> radii;
+};
+
+
+// Saves the reconstructed mesh. If the path ends with ".ply", the mesh is
+// streamed to a binary PLY file directly from the SurfelMeshing's surfel and
+// triangle arrays. Otherwise, it is converted to a Mesh3fCu8 and saved as an
+// OBJ file.
+bool SaveMesh(
+    CPUSurfelReconstruction& reconstruction,
+    SurfelMeshing& surfel_meshing,
+    const std::string& export_mesh_path) {
+  CHECK_EQ(surfel_meshing.surfels().size(), reconstruction.surfels_size());
+  
+  vector<float> position_buffer;
+  vector<u8> color_buffer;
+  reconstruction.ExportVertices(&position_buffer, &color_buffer);
+  
+  bool success;
+  if (boost::algorithm::ends_with(export_mesh_path, ".ply")) {
+    // The color buffer is indexed by surfel, like the surfels in
+    // surfel_meshing, so it can be passed on directly.
+    success = surfel_meshing.WriteMeshAsPLY(export_mesh_path.c_str(), color_buffer.data());
+  } else {
+    shared_ptr<Mesh3fCu8> mesh(new Mesh3fCu8());
+    
+    // Also use the positions from the surfel_meshing such that positions
+    // and the mesh are from a consistent state.
+    surfel_meshing.ConvertToMesh3fCu8(mesh.get());
+    
+    usize index = 0;
+    CHECK_EQ(mesh->vertices()->size(), reconstruction.surfel_count());
+    for (usize i = 0; i < reconstruction.surfels_size(); ++ i) {
+      if (std::isnan(position_buffer[3 * i + 0])) {
+        continue;
+      }
+      
+      Point3fC3u8* point = &(*mesh->vertices_mutable())->at(index);
+      point->color() = Vec3u8(color_buffer[3 * i + 0],
+                              color_buffer[3 * i + 1],
+                              color_buffer[3 * i + 2]);
+      ++ index;
+    }
+    CHECK_EQ(index, mesh->vertices()->size());
+    
+    success = mesh->WriteAsOBJ(export_mesh_path.c_str());
+  }
+  
+  if (success) {
+    LOG(INFO) << "Wrote " << export_mesh_path << ".";
+  } else {
+    LOG(ERROR) << "Writing the mesh failed.";
+  }
+  return success;
+}
+
+
+// Saves the reconstructed surfels as a point cloud with normals in binary PLY
+// format.
+bool SavePointCloudAsPLY(
+    SurfelMeshing& surfel_meshing,
+    const std::string& export_point_cloud_path) {
+  if (!surfel_meshing.WritePointCloudAsPLY(export_point_cloud_path.c_str())) {
+    LOG(ERROR) << "Writing the point cloud failed.";
+    return false;
+  }
+  LOG(INFO) << "Wrote " << export_point_cloud_path << ".";
+  return true;
+}
+
+
+int main(int argc, char** argv) {
+  chrono::steady_clock::time_point program_start_time = chrono::steady_clock::now();
+  
+  LIBVIS_APPLICATION();
+  
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+  
+  
+  // ### Parse parameters ###
+  
+  // NOTE: The parameters below have the same names and defaults as in main.cc.
+  //       Visualization and debug parameters are not supported.
+  CommandLineParser cmd_parser(argc, argv);
+  
+  // Dataset playback parameters.
+  float depth_scaling = 5000;  // The default is for TUM RGB-D datasets.
+  cmd_parser.NamedParameter(
+      "--depth_scaling", &depth_scaling, /*required*/ false,
+      "Input depth scaling: input_depth = depth_scaling * depth_in_meters. The default is for TUM RGB-D benchmark datasets.");
+  
+  int start_frame = 0;
+  cmd_parser.NamedParameter(
+      "--start_frame", &start_frame, /*required*/ false,
+      "First frame of the video to process.");
+  
+  int end_frame = numeric_limits<int>::max();
+  cmd_parser.NamedParameter(
+      "--end_frame", &end_frame, /*required*/ false,
+      "If the video is longer, processing stops after end_frame.");
+  
+  int pyramid_level = 0;
+  cmd_parser.NamedParameter(
+      "--pyramid_level", &pyramid_level, /*required*/ false,
+      "Specify the scale-space pyramid level to use. 0 uses the original sized images, 1 uses half the original resolution, etc.");
+  
+  bool invert_quaternions = cmd_parser.Flag(
+      "--invert_quaternions",
+      "Invert the quaternions loaded from the poses file.");
+  
+  int prefetch_frame_count = 8;
+  cmd_parser.NamedParameter(
+      "--prefetch_frame_count", &prefetch_frame_count, /*required*/ false,
+      "Number of frames after the frames required for the current frame whose images are loaded ahead of time in the background.");
+  
+  int prefetch_threads = 2;
+  cmd_parser.NamedParameter(
+      "--prefetch_threads", &prefetch_threads, /*required*/ false,
+      "Number of threads used for loading images in the background. With 0, the images are loaded when they are required.");
+  
+  int prefetch_max_memory_mb = 1024;
+  cmd_parser.NamedParameter(
+      "--prefetch_max_memory_mb", &prefetch_max_memory_mb, /*required*/ false,
+      "Maximum memory in MiB for loaded images. Loading ahead of time stops if this is reached.");
+  
+  int pipeline_queue_size = 2;
+  cmd_parser.NamedParameter(
+      "--pipeline_queue_size", &pipeline_queue_size, /*required*/ false,
+      "Maximum number of frames waiting between two processing stages (loading, depth preprocessing, surfel fusion, meshing), which run in parallel on different frames. Larger values even out variations in the stage runtimes, but require more memory.");
+  
+  // Surfel reconstruction parameters.
+  int max_surfel_count = 20 * 1000 * 1000;  // 20 million.
+  cmd_parser.NamedParameter(
+      "--max_surfel_count", &max_surfel_count, /*required*/ false,
+      "Maximum number of surfels. Determines the memory requirements.");
+  
+  float sensor_noise_factor = 0.05f;
+  cmd_parser.NamedParameter(
+      "--sensor_noise_factor", &sensor_noise_factor, /*required*/ false,
+      "Sensor noise range extent as \"factor times the measured depth\". The real measurement is assumed to be in [(1 - sensor_noise_factor) * depth, (1 + sensor_noise_factor) * depth].");
+  
+  float max_surfel_confidence = 5.0f;
+  cmd_parser.NamedParameter(
+      "--max_surfel_confidence", &max_surfel_confidence, /*required*/ false,
+      "Maximum value for the surfel confidence. Higher values enable more denoising, lower values faster adaptation to changes.");
+  
+  float regularizer_weight = 10.0f;
+  cmd_parser.NamedParameter(
+      "--regularizer_weight", &regularizer_weight, /*required*/ false,
+      "Weight for the regularization term (w_{reg} in the paper).");
+  
+  float normal_compatibility_threshold_deg = 40;
+  cmd_parser.NamedParameter(
+      "--normal_compatibility_threshold_deg", &normal_compatibility_threshold_deg, /*required*/ false,
+      "Angle threshold (in degrees) for considering a measurement normal and a surfel normal to be compatible.");
+  
+  int regularization_frame_window_size = 30;
+  cmd_parser.NamedParameter(
+      "--regularization_frame_window_size", &regularization_frame_window_size, /*required*/ false,
+      "Number of frames for which the regularization of a surfel is continued after it goes out of view.");
+  
+  bool do_blending = !cmd_parser.Flag(
+      "--disable_blending",
+      "Disable observation boundary blending.");
+  
+  int measurement_blending_radius = 12;
+  cmd_parser.NamedParameter(
+      "--measurement_blending_radius", &measurement_blending_radius, /*required*/ false,
+      "Radius for measurement blending in pixels.");
+  
+  int regularization_iterations_per_integration_iteration = 1;
+  cmd_parser.NamedParameter(
+      "--regularization_iterations_per_integration_iteration",
+      &regularization_iterations_per_integration_iteration, /*required*/ false,
+      "Number of regularization (gradient descent) iterations performed per depth integration iteration. Set this to zero to disable regularization.");
+  
+  float radius_factor_for_regularization_neighbors = 2;
+  cmd_parser.NamedParameter(
+      "--radius_factor_for_regularization_neighbors", &radius_factor_for_regularization_neighbors, /*required*/ false,
+      "Factor on the surfel radius for how far regularization neighbors can be away from a surfel.");
+  
+  int surfel_integration_active_window_size = numeric_limits<int>::max();
+  cmd_parser.NamedParameter(
+      "--surfel_integration_active_window_size", &surfel_integration_active_window_size, /*required*/ false,
+      "Number of frames which need to pass before a surfel becomes inactive. If there are no loop closures, set this to a value larger than the dataset frame count to disable surfel deactivation.");
+  
+  int reconstruction_threads = 0;
+  cmd_parser.NamedParameter(
+      "--reconstruction_threads", &reconstruction_threads, /*required*/ false,
+      "Number of threads used for the surfel fusion. Defaults to the number of hardware threads.");
+  
+  // Meshing parameters.
+  float max_angle_between_normals_deg = 90.0f;
+  cmd_parser.NamedParameter(
+      "--max_angle_between_normals_deg", &max_angle_between_normals_deg, /*required*/ false,
+      "Maximum angle between normals of surfels that are connected by triangulation.");
+  const float max_angle_between_normals = M_PI / 180.0f * max_angle_between_normals_deg;
+  
+  float min_triangle_angle_deg = 10.0f;
+  cmd_parser.NamedParameter(
+      "--min_triangle_angle_deg", &min_triangle_angle_deg, /*required*/ false,
+      "The meshing algorithm attempts to keep triangle angles larger than this.");
+  const float min_triangle_angle = M_PI / 180.0 * min_triangle_angle_deg;
+  
+  float max_triangle_angle_deg = 170.0f;
+  cmd_parser.NamedParameter(
+      "--max_triangle_angle_deg", &max_triangle_angle_deg, /*required*/ false,
+      "The meshing algorithm attempts to keep triangle angles smaller than this.");
+  const float max_triangle_angle = M_PI / 180.0 * max_triangle_angle_deg;
+  
+  float max_neighbor_search_range_increase_factor = 2.0f;
+  cmd_parser.NamedParameter(
+      "--max_neighbor_search_range_increase_factor", &max_neighbor_search_range_increase_factor, /*required*/ false,
+      "Maximum factor by which the surfel neighbor search range can be increased if the front neighbors are far away.");
+  
+  float long_edge_tolerance_factor = 1.5f;
+  cmd_parser.NamedParameter(
+      "--long_edge_tolerance_factor", &long_edge_tolerance_factor, /*required*/ false,
+      "Tolerance factor over 'max_neighbor_search_range_increase_factor * surfel_radius' for deciding whether to remesh a triangle with long edges.");
+  
+  int triangulation_threads = 1;
+  cmd_parser.NamedParameter(
+      "--triangulation_threads", &triangulation_threads, /*required*/ false,
+      "Number of threads used for triangulation. Should only affect the runtime (and the order in which surfels are triangulated).");
+  
+  float triangulation_budget_ms = 0;
+  cmd_parser.NamedParameter(
+      "--triangulation_budget_ms", &triangulation_budget_ms, /*required*/ false,
+      "If positive, limits the time for triangulating in each meshing iteration. Queued surfels close to the camera are triangulated first, the rest is carried over to the next iteration (and finished after the last frame). Makes the intermediate meshes depend on the timing.");
+  
+  int meshing_interval = 1;
+  cmd_parser.NamedParameter(
+      "--meshing_interval", &meshing_interval, /*required*/ false,
+      "Performs the meshing only every meshing_interval frames (and for the last frame). Larger values reduce the total runtime since fewer intermediate meshes are computed.");
+  
+  bool full_retriangulation_at_end = cmd_parser.Flag(
+      "--full_retriangulation_at_end",
+      "Performs a full retriangulation in the end (before the mesh is saved).");
+  
+  int compaction_moves_per_frame = 0;
+  cmd_parser.NamedParameter(
+      "--compaction_moves_per_frame", &compaction_moves_per_frame, /*required*/ false,
+      "If positive, reclaims the entries of merged surfels and deleted triangles by moving surfels and triangles from the end of their arrays into them, with at most this many moves per frame (for each array). This keeps the arrays, and the loops over them, from growing with the number of deleted entries.");
+  
+  float compaction_min_merged_fraction = 0.1f;
+  cmd_parser.NamedParameter(
+      "--compaction_min_merged_fraction", &compaction_min_merged_fraction, /*required*/ false,
+      "Surfels are only compacted if at least this fraction of the surfel entries belongs to merged surfels.");
+  
+  // Depth preprocessing parameters.
+  float max_depth = 3.0f;
+  cmd_parser.NamedParameter(
+      "--max_depth", &max_depth, /*required*/ false,
+      "Maximum input depth in meters.");
+  
+  float depth_valid_region_radius = 333;
+  cmd_parser.NamedParameter(
+      "--depth_valid_region_radius", &depth_valid_region_radius, /*required*/ false,
+      "Radius of a circle (centered on the image center) with valid depth. Everything outside the circle is considered to be invalid. Used to discard biased depth at the corners of Kinect v1 depth images.");
+  
+  float observation_angle_threshold_deg = 85;
+  cmd_parser.NamedParameter(
+      "--observation_angle_threshold_deg", &observation_angle_threshold_deg, /*required*/ false,
+      "If the angle between the inverse observation direction and the measured surface normal is larger than this setting, the surface is discarded.");
+  
+  int depth_erosion_radius = 2;
+  cmd_parser.NamedParameter(
+      "--depth_erosion_radius", &depth_erosion_radius, /*required*/ false,
+      "Radius for depth map erosion (in [0, 3]). Useful to combat foreground fattening artifacts.");
+  
+  int median_filter_and_densify_iterations = 0;
+  cmd_parser.NamedParameter(
+      "--median_filter_and_densify_iterations", &median_filter_and_densify_iterations, /*required*/ false,
+      "Number of iterations of median filtering with hole filling. Disabled by default. Can be useful for noisy time-of-flight data.");
+  
+  int outlier_filtering_frame_count = 8;
+  cmd_parser.NamedParameter(
+      "--outlier_filtering_frame_count", &outlier_filtering_frame_count, /*required*/ false,
+      "Number of other depth frames to use for outlier filtering of a depth frame. Supported values: 2, 4, 6, 8. Should be reduced if using low-frequency input.");
+  
+  int outlier_filtering_required_inliers = -1;
+  cmd_parser.NamedParameter(
+      "--outlier_filtering_required_inliers", &outlier_filtering_required_inliers, /*required*/ false,
+      "Number of required inliers for accepting a depth value in outlier filtering. With the default value of -1, all other frames (outlier_filtering_frame_count) must be inliers.");
+  
+  float bilateral_filter_sigma_xy = 3;
+  cmd_parser.NamedParameter(
+      "--bilateral_filter_sigma_xy", &bilateral_filter_sigma_xy, /*required*/ false,
+      "sigma_xy for depth bilateral filtering, in pixels.");
+  
+  float bilateral_filter_radius_factor = 2.0f;
+  cmd_parser.NamedParameter(
+      "--bilateral_filter_radius_factor", &bilateral_filter_radius_factor, /*required*/ false,
+      "Factor on bilateral_filter_sigma_xy to define the kernel radius for depth bilateral filtering.");
+  
+  float bilateral_filter_sigma_depth_factor = 0.05;
+  cmd_parser.NamedParameter(
+      "--bilateral_filter_sigma_depth_factor", &bilateral_filter_sigma_depth_factor, /*required*/ false,
+      "Factor on the depth to compute sigma_depth for depth bilateral filtering.");
+  
+  float outlier_filtering_depth_tolerance_factor = 0.02f;
+  cmd_parser.NamedParameter(
+      "--outlier_filtering_depth_tolerance_factor", &outlier_filtering_depth_tolerance_factor, /*required*/ false,
+      "Factor on the depth to define the size of the inlier region for outlier filtering.");
+  
+  float point_radius_extension_factor = 1.5f;
+  cmd_parser.NamedParameter(
+      "--point_radius_extension_factor", &point_radius_extension_factor, /*required*/ false,
+      "Factor by which a point's radius is extended beyond the distance to its farthest neighbor.");
+  
+  float point_radius_clamp_factor = numeric_limits<float>::infinity();
+  cmd_parser.NamedParameter(
+      "--point_radius_clamp_factor", &point_radius_clamp_factor, /*required*/ false,
+      "Factor by which a point's radius can be larger than the distance to its closest neighbor (times sqrt(2)). Larger radii are clamped to this distance.");
+  
+  int depth_preprocessing_threads = DefaultDepthProcessingThreadCount();
+  cmd_parser.NamedParameter(
+      "--depth_preprocessing_threads", &depth_preprocessing_threads, /*required*/ false,
+      "Number of threads used for depth preprocessing. Defaults to the number of hardware threads.");
+  
+  // Octree parameters.
+  int max_surfels_per_node = 50;
+  cmd_parser.NamedParameter(
+      "--max_surfels_per_node", &max_surfels_per_node, /*required*/ false,
+      "Maximum number of surfels per octree node. Should only affect the runtime.");
+  
+  // File export parameters.
+  std::string export_mesh_path;
+  cmd_parser.NamedParameter(
+      "--export_mesh", &export_mesh_path, /*required*/ false,
+      "Save the final mesh to the given path. Paths ending in .ply are written as"
+      " binary PLY files, which is much faster than the OBJ format used"
+      " otherwise.");
+  
+  std::string export_point_cloud_path;
+  cmd_parser.NamedParameter(
+      "--export_point_cloud", &export_point_cloud_path, /*required*/ false,
+      "Save the final (surfel) point cloud to the given path (as a PLY file).");
+  
+  std::string timings_path;
+  cmd_parser.NamedParameter(
+      "--write_timings", &timings_path, /*required*/ false,
+      "Write the per-stage timings to the given file instead of to stdout.");
+  
+  std::string record_surfels_path;
+  cmd_parser.NamedParameter(
+      "--record_surfels", &record_surfels_path, /*required*/ false,
+      "Record the surfels which are passed to the meshing to the given file. The"
+      " recording can be replayed with SurfelMeshingReplay to benchmark the"
+      " meshing on its own.");
+  
+  // Required input paths.
+  string dataset_folder_path;
+  cmd_parser.SequentialParameter(
+      &dataset_folder_path, "dataset_folder_path", true,
+      "Path to the dataset in TUM RGB-D format, or to an RGB-D sequence file created with SurfelMeshingConvertDataset.");
+  
+  string trajectory_filename;
+  cmd_parser.SequentialParameter(
+      &trajectory_filename, "trajectory_filename", false,
+      "Filename of the trajectory file in TUM RGB-D format within the dataset_folder_path (for example, 'trajectory.txt'). Required for TUM RGB-D datasets, not used for RGB-D sequence files.");
+  
+  if (!cmd_parser.CheckParameters()) {
+    return EXIT_FAILURE;
+  }
+  
+  if (meshing_interval < 1) {
+    LOG(ERROR) << "--meshing_interval must be at least 1.";
+    return EXIT_FAILURE;
+  }
+  if (pipeline_queue_size < 1) {
+    LOG(ERROR) << "--pipeline_queue_size must be at least 1.";
+    return EXIT_FAILURE;
+  }
+  if (pyramid_level > 0 && median_filter_and_densify_iterations > 0) {
+    LOG(ERROR) << "Simultaneous downscaling and median filtering of depth maps is not implemented.";
+    return EXIT_FAILURE;
+  }
+  
+  
+  // ### Initialization ###
+  
+  StageTimings timings;
+  
+  // Load the dataset index. The images are loaded on demand in the main loop.
+  RGBDVideo<Vec3u8, u16> rgbd_video;
+  
+  bool dataset_read;
+  if (boost::filesystem::is_regular_file(dataset_folder_path)) {
+    dataset_read = ReadRGBDSequenceFile(dataset_folder_path.c_str(), &rgbd_video);
+  } else if (trajectory_filename.empty()) {
+    LOG(ERROR) << "The trajectory_filename must be given for TUM RGB-D datasets.";
+    return EXIT_FAILURE;
+  } else {
+    dataset_read = ReadTUMRGBDDatasetAssociatedAndCalibrated(dataset_folder_path.c_str(), trajectory_filename.c_str(), &rgbd_video);
+  }
+  if (!dataset_read) {
+    LOG(ERROR) << "Could not read dataset.";
+    return EXIT_FAILURE;
+  }
+  CHECK_EQ(rgbd_video.depth_frames_mutable()->size(), rgbd_video.color_frames_mutable()->size());
+  LOG(INFO) << "Read dataset with " << rgbd_video.frame_count() << " frames";
+  
+  if (invert_quaternions) {
+    for (usize frame_index = 0; frame_index < rgbd_video.frame_count(); ++ frame_index) {
+      SE3f global_T_frame = rgbd_video.color_frame_mutable(frame_index)->global_T_frame();
+      global_T_frame.setQuaternion(global_T_frame.unit_quaternion().inverse());
+      rgbd_video.color_frame_mutable(frame_index)->SetGlobalTFrame(global_T_frame);
+      
+      global_T_frame = rgbd_video.depth_frame_mutable(frame_index)->global_T_frame();
+      global_T_frame.setQuaternion(global_T_frame.unit_quaternion().inverse());
+      rgbd_video.depth_frame_mutable(frame_index)->SetGlobalTFrame(global_T_frame.inverse());
+    }
+  }
+  
+  // Check that the RGB-D dataset uses the same intrinsics for color and depth.
+  if (!AreCamerasEqual(*rgbd_video.color_camera(), *rgbd_video.depth_camera())) {
+    LOG(ERROR) << "The color and depth camera of the RGB-D video must be equal.";
+    return EXIT_FAILURE;
+  }
+  
+  // If end_frame is non-zero, remove all frames which would extend beyond
+  // this length.
+  if (end_frame > 0 &&
+      rgbd_video.color_frames_mutable()->size() > static_cast<usize>(end_frame)) {
+    rgbd_video.color_frames_mutable()->resize(end_frame);
+    rgbd_video.depth_frames_mutable()->resize(end_frame);
+  }
+  
+  if (rgbd_video.frame_count() <= static_cast<usize>(start_frame + outlier_filtering_frame_count)) {
+    LOG(ERROR) << "The video is too short for the given --start_frame and --outlier_filtering_frame_count.";
+    return EXIT_FAILURE;
+  }
+  
+  // Get potentially scaled depth camera as pinhole camera, determine input size.
+  const Camera& generic_depth_camera = *rgbd_video.depth_camera();
+  unique_ptr<Camera> scaled_camera(generic_depth_camera.Scaled(1.0f / powf(2, pyramid_level)));
+  
+  CHECK_EQ(scaled_camera->type_int(), static_cast<int>(Camera::Type::kPinholeCamera4f));
+  const PinholeCamera4f& depth_camera = reinterpret_cast<const PinholeCamera4f&>(*scaled_camera);
+  
+  int width = depth_camera.width();
+  int height = depth_camera.height();
+  
+  // Start loading images in the background.
+  RGBDVideoPrefetcher<Vec3u8, u16> prefetcher(
+      &rgbd_video, prefetch_threads, prefetch_max_memory_mb * 1024ull * 1024ull);
+  
+  // Allocate reconstruction objects.
+  CPUSurfelReconstruction reconstruction(
+      max_surfel_count, depth_camera, reconstruction_threads);
+  CUDASurfelsCPU cpu_surfels_buffers(max_surfel_count);
+  SurfelMeshing surfel_meshing(
+      max_surfels_per_node,
+      max_angle_between_normals,
+      min_triangle_angle,
+      max_triangle_angle,
+      max_neighbor_search_range_increase_factor,
+      long_edge_tolerance_factor,
+      regularization_frame_window_size,
+      /*render_window*/ nullptr);
+  surfel_meshing.SetTriangulationThreadCount(triangulation_threads);
+  surfel_meshing.SetTriangulationBudget(0.001 * triangulation_budget_ms);
+  
+  SurfelRecordingWriter surfel_recorder;
+  if (!record_surfels_path.empty() &&
+      !surfel_recorder.Open(record_surfels_path, SurfelRecordingEncoding::kZlib)) {
+    return EXIT_FAILURE;
+  }
+  
+  timings.Add("startup", MillisecondsSince(program_start_time));
+  
+  
+  // ### Main loop ###
+  
+  // The frames are processed by a pipeline of four stages, which run in
+  // parallel on different frames:
+  // - loading: Waits for the images of a frame to be loaded and downscales or
+  //   median-filters the depth image.
+  // - preprocessing: Preprocesses the depth image of a frame as soon as the
+  //   neighboring depth images for outlier filtering are loaded.
+  // - fusion: Integrates the preprocessed frame into the surfels and transfers
+  //   the surfels into the write buffers of cpu_surfels_buffers and publishes
+  //   them.
+  // - meshing: Acquires the published surfels from cpu_surfels_buffers and
+  //   updates the mesh. Only then, the fusion stage may publish the next
+  //   surfels, which is signaled with the free_surfel_write_buffers queue.
+  //   Publishing would never wait, but it would supersede surfels that were
+  //   not acquired yet, which would make the mesh depend on the timing.
+  // All stages process the frames in order, so the results do not depend on
+  // the timing of the stages.
+  const usize end_frame_index = rgbd_video.frame_count() - outlier_filtering_frame_count / 2;
+  const usize first_integrated_frame_index = start_frame + outlier_filtering_frame_count / 2;
+  usize processed_frame_count = 0;
+  usize reclaimed_surfel_entry_count = 0;
+  
+  FramePipeline pipeline;
+  FramePipelineQueue<LoadedFrame>* loaded_frames =
+      pipeline.AddQueue<LoadedFrame>("loaded_frames", pipeline_queue_size);
+  FramePipelineQueue<PreprocessingBuffers*>* preprocessed_frames =
+      pipeline.AddQueue<PreprocessingBuffers*>("preprocessed_frames", pipeline_queue_size);
+  FramePipelineQueue<usize>* transferred_frames =
+      pipeline.AddQueue<usize>("transferred_frames", 1);
+  
+  // Buffers are returned to the previous stages through these queues. One
+  // preprocessing buffer is in use by the preprocessing stage, one by the
+  // fusion stage, and the others can wait in the preprocessed_frames queue.
+  vector<unique_ptr<PreprocessingBuffers>> preprocessing_buffers(pipeline_queue_size + 2);
+  FramePipelineQueue<PreprocessingBuffers*>* free_preprocessing_buffers =
+      pipeline.AddQueue<PreprocessingBuffers*>("free_preprocessing_buffers", preprocessing_buffers.size());
+  for (unique_ptr<PreprocessingBuffers>& buffers : preprocessing_buffers) {
+    buffers.reset(new PreprocessingBuffers(width, height));
+    PreprocessingBuffers* buffers_pointer = buffers.get();
+    CHECK(free_preprocessing_buffers->Push(std::move(buffers_pointer)));
+  }
+  FramePipelineQueue<bool>* free_surfel_write_buffers =
+      pipeline.AddQueue<bool>("free_surfel_write_buffers", 1);
+  CHECK(free_surfel_write_buffers->Push(true));
+  
+  
+  // ### Input data loading ###
+  
+  pipeline.AddStage("loading", {loaded_frames}, [&](FramePipelineStage* stage) {
+    for (usize frame_index = start_frame; frame_index < rgbd_video.frame_count(); ++ frame_index) {
+      // Wait for the images of this frame to be loaded, and request the
+      // following frames to be loaded in the background. The loading stage
+      // thus measures the time spent waiting for image loading (and
+      // downscaling or median filtering).
+      chrono::steady_clock::time_point loading_start_time = chrono::steady_clock::now();
+      prefetcher.Prefetch(frame_index, frame_index + 1 + prefetch_frame_count);
+      prefetcher.WaitForFrame(frame_index);
+      
+      LoadedFrame frame;
+      frame.frame_index = frame_index;
+      ImageFramePtr<u16, SE3f> depth_frame = rgbd_video.depth_frame_mutable(frame_index);
+      if (pyramid_level == 0) {
+        frame.depth_image = depth_frame->GetImage();
+        if (median_filter_and_densify_iterations > 0) {
+          chrono::steady_clock::time_point median_filter_start_time = chrono::steady_clock::now();
+          for (int iteration = 0; iteration < median_filter_and_densify_iterations; ++ iteration) {
+            shared_ptr<Image<u16>> filtered_image(new Image<u16>());
+            MedianFilterAndDensifyDepthMap(*frame.depth_image, filtered_image.get(), depth_preprocessing_threads);
+            frame.depth_image = filtered_image;
+          }
+          timings.Add("loading.median_filter", MillisecondsSince(median_filter_start_time));
+        }
+      } else {
+        frame.depth_image.reset(new Image<u16>(width, height));
+        depth_frame->GetImage()->DownscaleUsingMedianWhileExcluding(0, width, height, frame.depth_image.get());
+      }
+      
+      if (frame_index >= first_integrated_frame_index && frame_index < end_frame_index) {
+        ImageFramePtr<Vec3u8, SE3f> color_frame = rgbd_video.color_frame_mutable(frame_index);
+        if (pyramid_level == 0) {
+          frame.color_image = color_frame->GetImage();
+        } else {
+          frame.color_image = ImagePyramid(color_frame.get(), pyramid_level).GetOrComputeResult();
+        }
+      }
+      
+      // From here on, the images are referenced by the LoadedFrame only, so
+      // the prefetcher can drop them from its memory budget.
+      prefetcher.Release(frame_index);
+      timings.Add("loading", MillisecondsSince(loading_start_time));
+      
+      if (!stage->Push(loaded_frames, std::move(frame))) {
+        return;
+      }
+    }
+  });
+  
+  
+  // ### Depth pre-processing ###
+  
+  pipeline.AddStage("preprocessing", {loaded_frames, preprocessed_frames, free_preprocessing_buffers}, [&](FramePipelineStage* stage) {
+    // The loaded frames which are still required for outlier filtering.
+    unordered_map<usize, LoadedFrame> loaded_frame_window;
+    
+    LoadedFrame loaded_frame;
+    while (stage->Pop(loaded_frames, &loaded_frame)) {
+      usize loaded_frame_index = loaded_frame.frame_index;
+      loaded_frame_window[loaded_frame_index] = std::move(loaded_frame);
+      
+      // If the loaded frame completes the outlier filtering window of a
+      // frame, preprocess that frame.
+      if (loaded_frame_index < first_integrated_frame_index + outlier_filtering_frame_count / 2) {
+        continue;
+      }
+      usize frame_index = loaded_frame_index - outlier_filtering_frame_count / 2;
+      
+      PreprocessingBuffers* buffers;
+      if (!stage->Pop(free_preprocessing_buffers, &buffers)) {
+        return;
+      }
+      
+      chrono::steady_clock::time_point preprocessing_start_time = chrono::steady_clock::now();
+      ImageFramePtr<u16, SE3f> input_depth_frame = rgbd_video.depth_frame_mutable(frame_index);
+      const Image<u16>& input_depth = *loaded_frame_window.at(frame_index).depth_image;
+      
+      BilateralFilteringAndDepthCutoff(
+          bilateral_filter_sigma_xy,
+          bilateral_filter_sigma_depth_factor,
+          /*value_to_ignore*/ 0,
+          bilateral_filter_radius_factor,
+          depth_scaling * max_depth,
+          depth_valid_region_radius,
+          input_depth,
+          &buffers->filtered_depth_A,
+          depth_preprocessing_threads);
+      
+      // Scale the poses to match the depth scaling.
+      SE3f scaled_frame_T_global = input_depth_frame->frame_T_global();
+      scaled_frame_T_global.translation() = depth_scaling * scaled_frame_T_global.translation();
+      vector<const Image<u16>*> other_depth_images(outlier_filtering_frame_count);
+      vector<SE3f, Eigen::aligned_allocator<SE3f>> others_T_reference(outlier_filtering_frame_count);
+      for (int i = 0; i < outlier_filtering_frame_count; ++ i) {
+        int offset = i % (outlier_filtering_frame_count / 2) + 1;
+        int other_frame_index = (i < outlier_filtering_frame_count / 2) ? (frame_index - offset) : (frame_index + offset);
+        
+        other_depth_images[i] = loaded_frame_window.at(other_frame_index).depth_image.get();
+        SE3f global_T_other = rgbd_video.depth_frame_mutable(other_frame_index)->global_T_frame();
+        global_T_other.translation() = depth_scaling * global_T_other.translation();
+        others_T_reference[i] = (scaled_frame_T_global * global_T_other).inverse();
+      }
+      if (outlier_filtering_required_inliers == -1 ||
+          outlier_filtering_required_inliers == outlier_filtering_frame_count) {
+        OutlierDepthMapFusion(
+            outlier_filtering_depth_tolerance_factor,
+            buffers->filtered_depth_A,
+            depth_camera,
+            outlier_filtering_frame_count,
+            other_depth_images.data(),
+            others_T_reference.data(),
+            &buffers->filtered_depth_B,
+            depth_preprocessing_threads);
+      } else {
+        OutlierDepthMapFusion(
+            outlier_filtering_required_inliers,
+            outlier_filtering_depth_tolerance_factor,
+            buffers->filtered_depth_A,
+            depth_camera,
+            outlier_filtering_frame_count,
+            other_depth_images.data(),
+            others_T_reference.data(),
+            &buffers->filtered_depth_B,
+            depth_preprocessing_threads);
+      }
+      
+      if (depth_erosion_radius > 0) {
+        ErodeDepthMap(depth_erosion_radius, buffers->filtered_depth_B, &buffers->filtered_depth_A, depth_preprocessing_threads);
+      } else {
+        CopyWithoutBorder(buffers->filtered_depth_B, &buffers->filtered_depth_A, depth_preprocessing_threads);
+      }
+      
+      ComputeNormalsAndDropBadPixels(
+          observation_angle_threshold_deg,
+          depth_scaling,
+          depth_camera,
+          buffers->filtered_depth_A,
+          &buffers->filtered_depth_B,
+          &buffers->normals,
+          depth_preprocessing_threads);
+      
+      ComputePointRadiiAndRemoveIsolatedPixels(
+          point_radius_extension_factor,
+          point_radius_clamp_factor,
+          depth_scaling,
+          depth_camera,
+          buffers->filtered_depth_B,
+          &buffers->radii,
+          &buffers->filtered_depth_A,
+          depth_preprocessing_threads);
+      
+      buffers->frame_index = frame_index;
+      buffers->color_image = loaded_frame_window.at(frame_index).color_image;
+      timings.Add("preprocessing", MillisecondsSince(preprocessing_start_time));
+      
+      // The first frame of the window is not required for the following
+      // frames anymore.
+      loaded_frame_window.erase(frame_index - outlier_filtering_frame_count / 2);
+      
+      if (!stage->Push(preprocessed_frames, std::move(buffers))) {
+        return;
+      }
+    }
+  });
+  
+  
+  // ### Surfel reconstruction ###
+  
+  pipeline.AddStage("fusion", {preprocessed_frames, free_preprocessing_buffers, transferred_frames, free_surfel_write_buffers}, [&](FramePipelineStage* stage) {
+    PreprocessingBuffers* buffers;
+    while (stage->Pop(preprocessed_frames, &buffers)) {
+      usize frame_index = buffers->frame_index;
+      
+      chrono::steady_clock::time_point fusion_start_time = chrono::steady_clock::now();
+      reconstruction.Integrate(
+          frame_index,
+          depth_scaling,
+          &buffers->filtered_depth_A,
+          buffers->normals,
+          buffers->radii,
+          *buffers->color_image,
+          rgbd_video.depth_frame_mutable(frame_index)->global_T_frame(),
+          sensor_noise_factor,
+          max_surfel_confidence,
+          regularizer_weight,
+          regularization_frame_window_size,
+          do_blending,
+          measurement_blending_radius,
+          regularization_iterations_per_integration_iteration,
+          radius_factor_for_regularization_neighbors,
+          normal_compatibility_threshold_deg,
+          surfel_integration_active_window_size);
+      timings.Add("fusion", MillisecondsSince(fusion_start_time));
+      
+      float data_association;
+      float surfel_merging;
+      float measurement_blending;
+      float integration;
+      float neighbor_update;
+      float new_surfel_creation;
+      float regularization;
+      reconstruction.GetTimings(
+          &data_association,
+          &surfel_merging,
+          &measurement_blending,
+          &integration,
+          &neighbor_update,
+          &new_surfel_creation,
+          &regularization);
+      timings.Add("fusion.data_association", data_association);
+      timings.Add("fusion.surfel_merging", surfel_merging);
+      timings.Add("fusion.measurement_blending", measurement_blending);
+      timings.Add("fusion.integration", integration);
+      timings.Add("fusion.neighbor_update", neighbor_update);
+      timings.Add("fusion.new_surfel_creation", new_surfel_creation);
+      timings.Add("fusion.regularization", regularization);
+      
+      // Return the buffers for the next frames. This fails after the
+      // preprocessing stage returned, which does not matter.
+      buffers->color_image.reset();
+      stage->Push(free_preprocessing_buffers, std::move(buffers));
+      
+      bool is_last_frame = frame_index == end_frame_index - 1;
+      if (processed_frame_count % meshing_interval == 0 || is_last_frame) {
+        bool write_buffers_free;
+        if (!stage->Pop(free_surfel_write_buffers, &write_buffers_free)) {
+          return;
+        }
+        
+        if (compaction_moves_per_frame > 0) {
+          chrono::steady_clock::time_point compaction_start_time = chrono::steady_clock::now();
+          reclaimed_surfel_entry_count += reconstruction.CompactSurfels(compaction_moves_per_frame, compaction_min_merged_fraction);
+          timings.Add("fusion.compaction", MillisecondsSince(compaction_start_time));
+        }
+        
+        chrono::steady_clock::time_point transfer_start_time = chrono::steady_clock::now();
+        reconstruction.TransferAllToCPU(frame_index, &cpu_surfels_buffers);
+        cpu_surfels_buffers.PublishWriteBuffers();
+        timings.Add("surfel_transfer", MillisecondsSince(transfer_start_time));
+        
+        if (!stage->Push(transferred_frames, usize(frame_index))) {
+          return;
+        }
+      }
+      
+      constexpr int kStatsLogInterval = 200;
+      if (frame_index % kStatsLogInterval == 0) {
+        LOG(INFO) << "[frame " << frame_index << "] #surfels: " << reconstruction.surfel_count();
+      }
+      ++ processed_frame_count;
+    }
+  });
+  
+  
+  // ### Surfel meshing ###
+  
+  pipeline.AddStage("meshing", {transferred_frames, free_surfel_write_buffers}, [&](FramePipelineStage* stage) {
+    usize frame_index;
+    while (stage->Pop(transferred_frames, &frame_index)) {
+      chrono::steady_clock::time_point meshing_start_time = chrono::steady_clock::now();
+      CHECK(cpu_surfels_buffers.AcquireLatestBuffers());
+      // The fusion stage may publish the next surfels now. This fails after
+      // the fusion stage returned, which does not matter.
+      stage->Push(free_surfel_write_buffers, true);
+      surfel_meshing.IntegrateCUDABuffers(frame_index, cpu_surfels_buffers);
+      timings.Add("meshing.surfel_update", MillisecondsSince(meshing_start_time));
+      
+      // The read buffers stay valid until the next acquisition, which is done
+      // by this stage only.
+      if (surfel_recorder.is_open()) {
+        chrono::steady_clock::time_point recording_start_time = chrono::steady_clock::now();
+        surfel_recorder.WriteSnapshot(cpu_surfels_buffers.read_buffers());
+        timings.Add("meshing.recording", MillisecondsSince(recording_start_time));
+      }
+      
+      chrono::steady_clock::time_point remeshing_start_time = chrono::steady_clock::now();
+      surfel_meshing.CheckRemeshing();
+      timings.Add("meshing.remeshing", MillisecondsSince(remeshing_start_time));
+      
+      chrono::steady_clock::time_point triangulation_start_time = chrono::steady_clock::now();
+      surfel_meshing.SetTriangulationFocus(rgbd_video.depth_frame_mutable(frame_index)->global_T_frame().translation());
+      surfel_meshing.Triangulate();
+      timings.Add("meshing.triangulation", MillisecondsSince(triangulation_start_time));
+      
+      if (compaction_moves_per_frame > 0) {
+        chrono::steady_clock::time_point compaction_start_time = chrono::steady_clock::now();
+        surfel_meshing.CompactTriangles(compaction_moves_per_frame);
+        timings.Add("meshing.compaction", MillisecondsSince(compaction_start_time));
+      }
+    }
+  });
+  
+  pipeline.Start();
+  pipeline.Wait();
+  pipeline.LogStatistics();
+  LOG(INFO) << "Surfel hand-off: " << cpu_surfels_buffers.published_snapshot_count() << " snapshots published, "
+            << cpu_surfels_buffers.dropped_snapshot_count() << " superseded, handoff latency mean "
+            << cpu_surfels_buffers.mean_handoff_latency_ms() << " ms, max "
+            << cpu_surfels_buffers.max_handoff_latency_ms() << " ms";
+  
+  // Finish the triangulation which was left over due to the budget.
+  if (surfel_meshing.remesh_backlog_size() > 0) {
+    LOG(INFO) << "Finishing the triangulation of " << surfel_meshing.remesh_backlog_size() << " queued surfels ...";
+    surfel_meshing.SetTriangulationBudget(0);
+    surfel_meshing.Triangulate();
+  }
+  
+  bool recording_success = true;
+  if (surfel_recorder.is_open()) {
+    recording_success = surfel_recorder.Close();
+    if (recording_success) {
+      LOG(INFO) << "Wrote " << record_surfels_path << ".";
+    }
+  }
+  
+  
+  // ### Save results ###
+  
+  if (full_retriangulation_at_end) {
+    chrono::steady_clock::time_point retriangulation_start_time = chrono::steady_clock::now();
+    surfel_meshing.FullRetriangulation();
+    timings.Add("meshing.full_retriangulation", MillisecondsSince(retriangulation_start_time));
+  }
+  
+  LOG(INFO) << "Processed " << processed_frame_count << " frames, #surfels: "
+            << reconstruction.surfel_count() << ", #triangles: "
+            << surfel_meshing.triangle_count();
+  if (compaction_moves_per_frame > 0) {
+    // Bytes per surfel entry in the reconstruction and the meshing.
+    const usize surfel_entry_bytes = kSurfelAttributeCount * sizeof(float) + sizeof(Surfel);
+    const usize triangle_entry_bytes = sizeof(SurfelTriangle) + sizeof(SurfelTriangleCornerSlots);
+    LOG(INFO) << "Compaction: reclaimed " << reclaimed_surfel_entry_count << " surfel entries ("
+              << (reclaimed_surfel_entry_count * surfel_entry_bytes / (1024.0 * 1024.0)) << " MiB, "
+              << surfel_meshing.moved_surfel_count() << " surfels moved) and "
+              << surfel_meshing.reclaimed_triangle_entry_count() << " triangle entries ("
+              << (surfel_meshing.reclaimed_triangle_entry_count() * triangle_entry_bytes / (1024.0 * 1024.0)) << " MiB), "
+              << surfel_meshing.merged_surfel_count() << " merged surfel and "
+              << surfel_meshing.free_triangle_entry_count() << " free triangle entries left";
+  }
+  LOG(INFO) << "Image loading: " << prefetcher.hit_count() << " hits, "
+            << prefetcher.miss_count() << " misses, "
+            << prefetcher.eviction_count() << " evictions, peak memory "
+            << (prefetcher.peak_loaded_bytes() / (1024.0 * 1024.0)) << " MiB";
+  
+  bool export_success = true;
+  if (!export_mesh_path.empty()) {
+    chrono::steady_clock::time_point export_start_time = chrono::steady_clock::now();
+    export_success &= SaveMesh(reconstruction, surfel_meshing, export_mesh_path);
+    timings.Add("export.mesh", MillisecondsSince(export_start_time));
+  }
+  if (!export_point_cloud_path.empty()) {
+    chrono::steady_clock::time_point export_start_time = chrono::steady_clock::now();
+    export_success &= SavePointCloudAsPLY(surfel_meshing, export_point_cloud_path);
+    timings.Add("export.point_cloud", MillisecondsSince(export_start_time));
+  }
+  
+  timings.Add("total", MillisecondsSince(program_start_time));
+  
+  // Write the timings.
+  if (timings_path.empty()) {
+    timings.Write(&std::cout);
+  } else {
+    std::ofstream timings_file(timings_path, std::ios::out);
+    timings.Write(&timings_file);
+    if (!timings_file) {
+      LOG(ERROR) << "Writing the timings to " << timings_path << " failed.";
+      return EXIT_FAILURE;
+    }
+  }
+  
+  return (export_success && recording_success) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,92 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+// Converts a dataset in TUM RGB-D format (as read by the SurfelMeshing
+// application) to a single RGB-D sequence file, which can be passed to
+// SurfelMeshing and SurfelMeshingBatch instead of the dataset folder. The poses
+// are interpolated from the trajectory as when reading the dataset directly.
+
+#include <glog/logging.h>
+#include <libvis/command_line_parser.h>
+#include <libvis/libvis.h>
+#include <libvis/rgbd_sequence_file.h>
+#include <libvis/rgbd_video.h>
+#include <libvis/rgbd_video_io_tum_dataset.h>
+
+using namespace vis;
+
+int main(int argc, char** argv) {
+  LIBVIS_APPLICATION();
+  
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+  
+  CommandLineParser cmd_parser(argc, argv);
+  
+  bool compress = cmd_parser.Flag(
+      "--compress",
+      "Compress the images with zlib. This makes the file smaller, but the images cannot be accessed directly in the file mapping.");
+  
+  string dataset_folder_path;
+  cmd_parser.SequentialParameter(
+      &dataset_folder_path, "dataset_folder_path", true,
+      "Path to the dataset in TUM RGB-D format.");
+  
+  string trajectory_filename;
+  cmd_parser.SequentialParameter(
+      &trajectory_filename, "trajectory_filename", true,
+      "Filename of the trajectory file in TUM RGB-D format within the dataset_folder_path (for example, 'trajectory.txt').");
+  
+  string output_path;
+  cmd_parser.SequentialParameter(
+      &output_path, "output_path", true,
+      "Path of the RGB-D sequence file to write.");
+  
+  if (!cmd_parser.CheckParameters()) {
+    return EXIT_FAILURE;
+  }
+  
+  RGBDVideo<Vec3u8, u16> rgbd_video;
+  if (!ReadTUMRGBDDatasetAssociatedAndCalibrated(dataset_folder_path.c_str(), trajectory_filename.c_str(), &rgbd_video)) {
+    LOG(ERROR) << "Could not read dataset.";
+    return EXIT_FAILURE;
+  }
+  LOG(INFO) << "Read dataset with " << rgbd_video.frame_count() << " frames";
+  
+  if (!WriteRGBDSequenceFile(
+      output_path.c_str(),
+      compress ? RGBDSequenceFileEncoding::kZlib : RGBDSequenceFileEncoding::kRaw,
+      &rgbd_video)) {
+    LOG(ERROR) << "Could not write the RGB-D sequence file.";
+    return EXIT_FAILURE;
+  }
+  LOG(INFO) << "Wrote " << output_path;
+  
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <cstring>
+
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+
+#include "surfel_meshing/surfel_attributes.h"
+
+namespace vis {
+
+// Accessor for surfels in the packed layout of surfel_attributes.h stored in
+// CPU memory, with one row of pitch elements per attribute. Corresponds to the
+// CUDABuffer_<float> which is used for the surfels in the CUDA kernels. The u32
+// and color attributes are stored in the bits of the floats.
+class CPUSurfelBuffer {
+ public:
+  CPUSurfelBuffer(float* data, usize pitch)
+      : data_(data), pitch_(pitch) {}
+  
+  inline float& operator()(int attribute, u32 surfel_index) const {
+    return data_[attribute * pitch_ + surfel_index];
+  }
+  
+  inline u32 GetU32(int attribute, u32 surfel_index) const {
+    u32 value;
+    memcpy(&value, &(*this)(attribute, surfel_index), sizeof(u32));
+    return value;
+  }
+  
+  inline void SetU32(int attribute, u32 surfel_index, u32 value) const {
+    memcpy(&(*this)(attribute, surfel_index), &value, sizeof(u32));
+  }
+  
+  // Returns the (r, g, b, neighbor detach request flag) bytes.
+  inline u8* color(u32 surfel_index) const {
+    return reinterpret_cast<u8*>(&(*this)(kSurfelColor, surfel_index));
+  }
+  
+  inline Vec3f position(u32 surfel_index) const {
+    return Vec3f((*this)(kSurfelX, surfel_index),
+                 (*this)(kSurfelY, surfel_index),
+                 (*this)(kSurfelZ, surfel_index));
+  }
+  
+  inline Vec3f smooth_position(u32 surfel_index) const {
+    return Vec3f((*this)(kSurfelSmoothX, surfel_index),
+                 (*this)(kSurfelSmoothY, surfel_index),
+                 (*this)(kSurfelSmoothZ, surfel_index));
+  }
+  
+  inline Vec3f normal(u32 surfel_index) const {
+    return Vec3f((*this)(kSurfelNormalX, surfel_index),
+                 (*this)(kSurfelNormalY, surfel_index),
+                 (*this)(kSurfelNormalZ, surfel_index));
+  }
+  
+  inline float* data() const { return data_; }
+  inline usize pitch() const { return pitch_; }
+  
+ private:
+  float* data_;
+  usize pitch_;
+};
+
+}
@@ -0,0 +1,1543 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "surfel_meshing/cpu_surfel_reconstruction.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#include <glog/logging.h>
+
+#include "surfel_meshing/cpu_surfel_buffer.h"
+#include "surfel_meshing/surfel.h"
+#include "surfel_meshing/surfel_fusion_constants.h"
+
+namespace vis {
+
+namespace {
+
+// Number of surfels which are processed by a thread at a time.
+constexpr usize kSurfelChunkSize = 4096;
+
+// Number of image rows which are processed by a thread at a time.
+constexpr usize kRowChunkSize = 8;
+
+constexpr u32 kInvalidSurfelIndex = Surfel::kInvalidIndex;
+
+// Attributes which are transferred to the CPU buffers, in the order of
+// CUDASurfelReconstruction::TransferAllToCPU().
+constexpr int kTransferredAttributes[kTransferredSurfelAttributeCount] = {
+    kSurfelSmoothX, kSurfelSmoothY, kSurfelSmoothZ,
+    kSurfelRadiusSquared,
+    kSurfelNormalX, kSurfelNormalY, kSurfelNormalZ,
+    kSurfelLastUpdateStamp};
+
+inline u32 FloatBits(float value) {
+  u32 bits;
+  memcpy(&bits, &value, sizeof(float));
+  return bits;
+}
+
+inline float BitsToFloat(u32 bits) {
+  float value;
+  memcpy(&value, &bits, sizeof(float));
+  return value;
+}
+
+// Float to integer conversions which saturate like the conversions in CUDA
+// (instead of being undefined for values outside of the integer range).
+inline u16 SaturateToU16(float value) {
+  if (!(value > 0)) {
+    return 0;
+  } else if (value >= 65535) {
+    return 65535;
+  }
+  return static_cast<u16>(value);
+}
+
+inline u8 SaturateToU8(float value) {
+  if (!(value > 0)) {
+    return 0;
+  } else if (value >= 255) {
+    return 255;
+  }
+  return static_cast<u8>(value);
+}
+
+inline void AtomicMin(std::atomic<u32>* value, u32 candidate) {
+  u32 current = value->load(std::memory_order_relaxed);
+  while (candidate < current &&
+         !value->compare_exchange_weak(current, candidate, std::memory_order_relaxed)) {}
+}
+
+inline void AtomicAdd(std::atomic<float>* value, float summand) {
+  float current = value->load(std::memory_order_relaxed);
+  while (!value->compare_exchange_weak(current, current + summand, std::memory_order_relaxed)) {}
+}
+
+inline float MillisecondsSince(const std::chrono::steady_clock::time_point& start) {
+  return std::chrono::duration<float, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+inline bool IsSurfelActiveForIntegration(
+    const CPUSurfelBuffer& surfels,
+    u32 surfel_index,
+    u32 frame_index,
+    int surfel_integration_active_window_size) {
+  // See IsSurfelActiveForIntegration() in cuda_surfel_reconstruction.cu.
+  return static_cast<int>(surfels.GetU32(kSurfelLastUpdateStamp, surfel_index)) >
+             static_cast<int>(frame_index) - surfel_integration_active_window_size;
+}
+
+// Rigid transformation in the form used by the loops below.
+struct RigidTransform {
+  explicit RigidTransform(const SE3f& transformation)
+      : rotation(transformation.rotationMatrix()),
+        translation(transformation.translation()) {}
+  
+  inline Vec3f operator*(const Vec3f& point) const {
+    return rotation * point + translation;
+  }
+  
+  inline Vec3f Rotate(const Vec3f& direction) const {
+    return rotation * direction;
+  }
+  
+  Mat3f rotation;
+  Vec3f translation;
+};
+
+// Projection and unprojection with the depth camera, using the same formulas
+// as the CUDA kernels.
+struct CameraProjection {
+  explicit CameraProjection(const PinholeCamera4f& camera)
+      : width(camera.width()),
+        height(camera.height()) {
+    fx = camera.parameters()[0];
+    fy = camera.parameters()[1];
+    cx = camera.parameters()[2];
+    cy = camera.parameters()[3];
+    
+    // Unprojection intrinsics for pixel center convention.
+    fx_inv = 1.0f / fx;
+    fy_inv = 1.0f / fy;
+    cx_inv = -(cx - 0.5f) / fx;
+    cy_inv = -(cy - 0.5f) / fy;
+  }
+  
+  // Returns false if the point is behind the camera or does not project into
+  // the image.
+  inline bool Project(const Vec3f& local_position, Vec2f* pixel_pos, int* px, int* py) const {
+    if (local_position.z() <= 0) {
+      return false;
+    }
+    *pixel_pos = Vec2f(fx * (local_position.x() / local_position.z()) + cx,
+                       fy * (local_position.y() / local_position.z()) + cy);
+    // Comparing before the conversion to int is equivalent to the checks in
+    // the CUDA kernels, but avoids undefined conversions of large values.
+    if (!(pixel_pos->x() >= 0 && pixel_pos->y() >= 0 &&
+          pixel_pos->x() < width && pixel_pos->y() < height)) {
+      return false;
+    }
+    *px = static_cast<int>(pixel_pos->x());
+    *py = static_cast<int>(pixel_pos->y());
+    return true;
+  }
+  
+  // Determines the pixel next to the side of pixel (px, py) that pixel_pos is
+  // closest to, which the surfels are associated to in addition to the pixel
+  // they project to. Returns false if this pixel is not used.
+  inline bool GetSecondPixel(const Vec2f& pixel_pos, int px, int py, int* offset_x, int* offset_y) const {
+    float x_frac = pixel_pos.x() - px;
+    float y_frac = pixel_pos.y() - py;
+    if (x_frac < y_frac) {
+      // Surfel is within the bottom-left triangle half of the pixel.
+      if (x_frac < 1 - y_frac) {
+        // Surfel is on the left side of the pixel.
+        *offset_x = px - 1;
+        *offset_y = py;
+        return px > 1;
+      } else {
+        // Surfel is on the bottom side of the pixel.
+        *offset_x = px;
+        *offset_y = py + 1;
+        return py < height - 1;
+      }
+    } else {
+      // Surfel is within the top-right triangle half of the pixel.
+      if (x_frac < 1 - y_frac) {
+        // Surfel is on the top side of the pixel.
+        *offset_x = px;
+        *offset_y = py - 1;
+        return py > 0;
+      } else {
+        // Surfel is on the right side of the pixel.
+        *offset_x = px + 1;
+        *offset_y = py;
+        return px < width - 1;
+      }
+    }
+  }
+  
+  inline Vec3f Unproject(int x, int y, float depth) const {
+    return Vec3f(depth * (fx_inv * x + cx_inv),
+                 depth * (fy_inv * y + cy_inv),
+                 depth);
+  }
+  
+  int width;
+  int height;
+  float fx, fy, cx, cy;
+  float fx_inv, fy_inv, cx_inv, cy_inv;
+};
+
+// Returns the local normal for a normals buffer entry.
+inline Vec3f MeasurementNormal(const Vec2f& normal_xy) {
+  return Vec3f(normal_xy.x(), normal_xy.y(), -sqrtf(std::max(0.f, 1 - normal_xy.x() * normal_xy.x() - normal_xy.y() * normal_xy.y())));
+}
+
+}  // namespace
+
+
+CPUSurfelReconstruction::CPUSurfelReconstruction(
+    usize max_surfel_count,
+    const PinholeCamera4f& depth_camera,
+    int thread_count)
+    : transferred_surfel_count_(0),
+      surfel_count_(0),
+      merge_count_(0),
+      max_surfel_count_(max_surfel_count),
+      depth_camera_(depth_camera),
+      width_(depth_camera.width()),
+      height_(depth_camera.height()),
+      data_association_time_(0),
+      surfel_merging_time_(0),
+      measurement_blending_time_(0),
+      integration_time_(0),
+      neighbor_update_time_(0),
+      new_surfel_creation_time_(0),
+      regularization_time_(0),
+      thread_pool_(thread_count) {
+  surfels_.reset(new float[kSurfelAttributeCount * max_surfel_count_]);
+  
+  const usize pixel_count = width_ * height_;
+  supporting_surfels_.reset(new std::atomic<u32>[pixel_count]);
+  supporting_surfel_counts_.reset(new std::atomic<u32>[pixel_count]);
+  supporting_surfel_depth_sums_.reset(new std::atomic<float>[pixel_count]);
+  conflicting_surfels_.reset(new std::atomic<u32>[pixel_count]);
+  first_surfel_depth_.reset(new std::atomic<u32>[pixel_count]);
+  
+  distance_map_.resize(pixel_count);
+  surfel_depth_average_deltas_.resize(pixel_count);
+  new_distance_map_.resize(pixel_count);
+  new_surfel_depth_average_deltas_.resize(pixel_count);
+  blending_update_flags_.resize(pixel_count);
+  
+  new_surfel_flags_.resize(pixel_count);
+  new_surfel_indices_.resize(pixel_count);
+  new_surfel_row_offsets_.resize(height_ + 1);
+  
+  transferred_surfels_.reset(new float[kTransferredSurfelAttributeCount * max_surfel_count_]);
+}
+
+void CPUSurfelReconstruction::Integrate(
+    u32 frame_index,
+    float depth_scaling,
+    Image<u16>* depth_buffer,
+    const Image<Vec2f>& normals_buffer,
+    const Image<float>& radius_buffer,
+    const Image<Vec3u8>& color_buffer,
+    const SE3f& global_T_local,
+    float sensor_noise_factor,
+    float max_surfel_confidence,
+    float regularizer_weight,
+    int regularization_frame_window_size,
+    bool do_blending,
+    int measurement_blending_radius,
+    int regularization_iterations_per_integration_iteration,
+    float radius_factor_for_regularization_neighbors,
+    float normal_compatibility_threshold_deg,
+    int surfel_integration_active_window_size) {
+  CHECK_EQ(depth_buffer->width(), static_cast<u32>(width_));
+  CHECK_EQ(depth_buffer->height(), static_cast<u32>(height_));
+  
+  const SE3f local_T_global = global_T_local.inverse();
+  
+  auto stage_start = std::chrono::steady_clock::now();
+  
+  thread_pool_.ParallelFor(0, width_ * height_, kRowChunkSize * width_, [&](usize begin, usize end) {
+    const u32 infinity_bits = FloatBits(numeric_limits<float>::infinity());
+    for (usize pixel = begin; pixel < end; ++ pixel) {
+      supporting_surfels_[pixel].store(kInvalidSurfelIndex, std::memory_order_relaxed);
+      supporting_surfel_counts_[pixel].store(0, std::memory_order_relaxed);
+      supporting_surfel_depth_sums_[pixel].store(0, std::memory_order_relaxed);
+      conflicting_surfels_[pixel].store(kInvalidSurfelIndex, std::memory_order_relaxed);
+      first_surfel_depth_[pixel].store(infinity_bits, std::memory_order_relaxed);
+    }
+  });
+  
+  RenderMinDepth(
+      frame_index,
+      surfel_integration_active_window_size,
+      local_T_global);
+  
+  AssociateSurfels(
+      frame_index,
+      surfel_integration_active_window_size,
+      sensor_noise_factor,
+      normal_compatibility_threshold_deg,
+      local_T_global,
+      1.0f / depth_scaling,
+      *depth_buffer,
+      normals_buffer,
+      radius_buffer);
+  
+  data_association_time_ = MillisecondsSince(stage_start);
+  stage_start = std::chrono::steady_clock::now();
+  
+  MergeSurfels(
+      sensor_noise_factor,
+      normal_compatibility_threshold_deg,
+      local_T_global,
+      1.0f / depth_scaling,
+      *depth_buffer,
+      normals_buffer,
+      radius_buffer);
+  
+  surfel_merging_time_ = MillisecondsSince(stage_start);
+  stage_start = std::chrono::steady_clock::now();
+  
+  // NOTE: This can change the supporting surfels for the affected pixels, in
+  //       principle they should be adapted afterwards but this is not done.
+  if (do_blending) {
+    BlendMeasurements(
+        measurement_blending_radius,
+        1.0f / depth_scaling,
+        depth_buffer);
+  }
+  
+  measurement_blending_time_ = MillisecondsSince(stage_start);
+  stage_start = std::chrono::steady_clock::now();
+  
+  IntegrateMeasurements(
+      frame_index,
+      surfel_integration_active_window_size,
+      max_surfel_confidence,
+      sensor_noise_factor,
+      normal_compatibility_threshold_deg,
+      global_T_local,
+      depth_scaling,
+      *depth_buffer,
+      normals_buffer,
+      radius_buffer,
+      color_buffer);
+  
+  integration_time_ = MillisecondsSince(stage_start);
+  stage_start = std::chrono::steady_clock::now();
+  
+  UpdateNeighbors(
+      frame_index,
+      surfel_integration_active_window_size,
+      radius_factor_for_regularization_neighbors,
+      local_T_global,
+      sensor_noise_factor,
+      1.0f / depth_scaling,
+      *depth_buffer,
+      radius_buffer);
+  
+  neighbor_update_time_ = MillisecondsSince(stage_start);
+  stage_start = std::chrono::steady_clock::now();
+  
+  CreateNewSurfels(
+      frame_index,
+      global_T_local,
+      depth_scaling,
+      radius_factor_for_regularization_neighbors,
+      *depth_buffer,
+      normals_buffer,
+      radius_buffer,
+      color_buffer);
+  
+  new_surfel_creation_time_ = MillisecondsSince(stage_start);
+  stage_start = std::chrono::steady_clock::now();
+  
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  if (regularization_iterations_per_integration_iteration == 0) {
+    regularization_.Regularize(
+        /*disable_denoising*/ true,
+        frame_index,
+        radius_factor_for_regularization_neighbors,
+        regularizer_weight,
+        regularization_frame_window_size,
+        surfel_count_,
+        surfels,
+        &thread_pool_);
+  } else {
+    for (int i = 0; i < regularization_iterations_per_integration_iteration; ++ i) {
+      regularization_.Regularize(
+          /*disable_denoising*/ false,
+          frame_index,
+          radius_factor_for_regularization_neighbors,
+          regularizer_weight,
+          regularization_frame_window_size,
+          surfel_count_,
+          surfels,
+          &thread_pool_);
+    }
+  }
+  
+  regularization_time_ = MillisecondsSince(stage_start);
+}
+
+void CPUSurfelReconstruction::Regularize(
+    u32 frame_index,
+    float regularizer_weight,
+    float radius_factor_for_regularization_neighbors,
+    int regularization_frame_window_size) {
+  regularization_.Regularize(
+      /*disable_denoising*/ false,
+      frame_index,
+      radius_factor_for_regularization_neighbors,
+      regularizer_weight,
+      regularization_frame_window_size,
+      surfel_count_,
+      CPUSurfelBuffer(surfels_.get(), max_surfel_count_),
+      &thread_pool_);
+}
+
+void CPUSurfelReconstruction::TransferAllToCPU(
+    u32 frame_index,
+    CUDASurfelsCPU* buffers) {
+  CUDASurfelBuffersCPU* buffer = buffers->write_buffers();
+  
+  buffer->frame_index = frame_index;
+  buffer->surfel_count = surfel_count_;
+  
+  u8* destinations[kTransferredSurfelAttributeCount] = {
+      reinterpret_cast<u8*>(buffer->surfel_x_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_y_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_z_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_radius_squared_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_normal_x_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_normal_y_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_normal_z_buffer),
+      reinterpret_cast<u8*>(buffer->surfel_last_update_stamp_buffer)};
+  
+  // Copy the attributes and determine the surfels which changed since the last
+  // transfer, such that the CPU side only needs to update those. Each chunk
+  // collects its changed surfels separately, so concatenating the lists in
+  // chunk order yields increasing indices.
+  const usize chunk_count = (surfel_count_ + kSurfelChunkSize - 1) / kSurfelChunkSize;
+  changed_surfel_indices_per_chunk_.resize(chunk_count);
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    u8 changed[kSurfelChunkSize];
+    for (usize i = begin; i < end; ++ i) {
+      changed[i - begin] = (i >= transferred_surfel_count_) ? 1 : 0;
+    }
+    
+    for (int a = 0; a < kTransferredSurfelAttributeCount; ++ a) {
+      const float* values = surfel_attribute(kTransferredAttributes[a]);
+      float* transferred_values = transferred_surfels_.get() + a * max_surfel_count_;
+      for (usize i = begin; i < end; ++ i) {
+        // Compare the bits such that this works for the u32 attribute as well.
+        changed[i - begin] |= (FloatBits(values[i]) != FloatBits(transferred_values[i])) ? 1 : 0;
+      }
+      memcpy(transferred_values + begin, values + begin, (end - begin) * sizeof(float));
+      memcpy(destinations[a] + begin * sizeof(float), values + begin, (end - begin) * sizeof(float));
+    }
+    
+    vector<u32>* chunk_indices = &changed_surfel_indices_per_chunk_[begin / kSurfelChunkSize];
+    chunk_indices->clear();
+    for (usize i = begin; i < end; ++ i) {
+      if (changed[i - begin]) {
+        chunk_indices->push_back(i);
+      }
+    }
+  });
+  transferred_surfel_count_ = surfel_count_;
+  
+  changed_surfel_indices_.clear();
+  for (const vector<u32>& chunk_indices : changed_surfel_indices_per_chunk_) {
+    changed_surfel_indices_.insert(changed_surfel_indices_.end(), chunk_indices.begin(), chunk_indices.end());
+  }
+  buffers->SetChangedSurfels(changed_surfel_indices_.data(), changed_surfel_indices_.size());
+  buffers->SetSurfelMoves(surfel_moves_.data(), surfel_moves_.size());
+  surfel_moves_.clear();
+}
+
+u32 CPUSurfelReconstruction::CompactSurfels(u32 max_moves, float min_merged_fraction) {
+  if (merge_count_ == 0 || merge_count_ < min_merged_fraction * surfel_count_) {
+    return 0;
+  }
+  
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  auto is_merged = [&](u32 surfel_index) {
+    return surfels(kSurfelRadiusSquared, surfel_index) < 0;
+  };
+  
+  // Pair the first merged entries with the last live surfels. The entries
+  // from new_count on are dropped afterwards.
+  const u32 old_count = surfel_count_;
+  const usize first_move = surfel_moves_.size();
+  u32 new_count = old_count;
+  u32 hole = 0;
+  while (true) {
+    while (new_count > 0 && is_merged(new_count - 1)) {
+      -- new_count;
+    }
+    if (surfel_moves_.size() - first_move >= max_moves) {
+      break;
+    }
+    while (hole < new_count && !is_merged(hole)) {
+      ++ hole;
+    }
+    if (hole >= new_count) {
+      break;
+    }
+    -- new_count;
+    surfel_moves_.emplace_back(new_count, hole);
+    ++ hole;
+  }
+  if (new_count == old_count) {
+    return 0;
+  }
+  
+  // Remap the neighbor indices while the merged entries can still be told
+  // apart from the holes which will be filled.
+  compaction_destinations_.assign(old_count - new_count, kInvalidSurfelIndex);
+  for (usize i = first_move; i < surfel_moves_.size(); ++ i) {
+    compaction_destinations_[surfel_moves_[i].from - new_count] = surfel_moves_[i].to;
+  }
+  thread_pool_.ParallelFor(0, old_count, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (is_merged(surfel_index)) {
+        continue;
+      }
+      for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+        u32 neighbor_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+        if (neighbor_index == kInvalidSurfelIndex) {
+          continue;
+        }
+        u32 new_neighbor_index =
+            (neighbor_index >= new_count) ? compaction_destinations_[neighbor_index - new_count] :
+            (is_merged(neighbor_index) ? kInvalidSurfelIndex : neighbor_index);
+        if (new_neighbor_index != neighbor_index) {
+          surfels.SetU32(kSurfelNeighbor0 + n, surfel_index, new_neighbor_index);
+        }
+      }
+    }
+  });
+  
+  // Move the surfels. The values as of the last transfer move along, such that
+  // the moved surfels are only reported as changed if they did change. Surfels
+  // which were not transferred yet are reported as changed in their new entry.
+  for (usize i = first_move; i < surfel_moves_.size(); ++ i) {
+    const SurfelMove& move = surfel_moves_[i];
+    for (int a = 0; a < kSurfelAttributeCount; ++ a) {
+      surfels(a, move.to) = surfels(a, move.from);
+    }
+    if (move.from < transferred_surfel_count_) {
+      for (int a = 0; a < kTransferredSurfelAttributeCount; ++ a) {
+        float* transferred_values = transferred_surfels_.get() + a * max_surfel_count_;
+        transferred_values[move.to] = transferred_values[move.from];
+      }
+    } else if (move.to < transferred_surfel_count_) {
+      transferred_surfels_[move.to] = BitsToFloat(~FloatBits(surfel_attribute(kTransferredAttributes[0])[move.to]));
+    }
+  }
+  
+  const u32 reclaimed_count = old_count - new_count;
+  transferred_surfel_count_ = std::min(transferred_surfel_count_, new_count);
+  merge_count_ -= reclaimed_count;
+  surfel_count_ = new_count;
+  return reclaimed_count;
+}
+
+void CPUSurfelReconstruction::ExportVertices(
+    vector<float>* position_buffer,
+    vector<u8>* color_buffer) {
+  position_buffer->resize(3 * surfel_count_);
+  color_buffer->resize(3 * surfel_count_);
+  
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      bool merged = surfels(kSurfelRadiusSquared, surfel_index) < 0;
+      
+      float* position_ptr = position_buffer->data() + 3 * surfel_index;
+      position_ptr[0] = merged ? numeric_limits<float>::quiet_NaN() : surfels(kSurfelSmoothX, surfel_index);
+      position_ptr[1] = merged ? numeric_limits<float>::quiet_NaN() : surfels(kSurfelSmoothY, surfel_index);
+      position_ptr[2] = merged ? numeric_limits<float>::quiet_NaN() : surfels(kSurfelSmoothZ, surfel_index);
+      
+      const u8* color = surfels.color(surfel_index);
+      u8* color_ptr = color_buffer->data() + 3 * surfel_index;
+      color_ptr[0] = color[0];
+      color_ptr[1] = color[1];
+      color_ptr[2] = color[2];
+    }
+  });
+}
+
+void CPUSurfelReconstruction::GetTimings(
+    float* data_association,
+    float* surfel_merging,
+    float* measurement_blending,
+    float* integration,
+    float* neighbor_update,
+    float* new_surfel_creation,
+    float* regularization) {
+  *data_association = data_association_time_;
+  *surfel_merging = surfel_merging_time_;
+  *measurement_blending = measurement_blending_time_;
+  *integration = integration_time_;
+  *neighbor_update = neighbor_update_time_;
+  *new_surfel_creation = new_surfel_creation_time_;
+  *regularization = regularization_time_;
+}
+
+void CPUSurfelReconstruction::RenderMinDepth(
+    u32 frame_index,
+    int surfel_integration_active_window_size,
+    const SE3f& local_T_global) {
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  const RigidTransform local_T_global_transform(local_T_global);
+  const CameraProjection camera(depth_camera_);
+  
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (!IsSurfelActiveForIntegration(surfels, surfel_index, frame_index, surfel_integration_active_window_size)) {
+        continue;
+      }
+      
+      Vec3f local_position = local_T_global_transform * surfels.position(surfel_index);
+      Vec2f pixel_pos;
+      int px, py;
+      if (!camera.Project(local_position, &pixel_pos, &px, &py)) {
+        continue;
+      }
+      
+      // Should behave properly as long as all the floats are positive.
+      const u32 depth_bits = FloatBits(local_position.z());
+      AtomicMin(&first_surfel_depth_[px + py * width_], depth_bits);
+      
+      int offset_x, offset_y;
+      if (camera.GetSecondPixel(pixel_pos, px, py, &offset_x, &offset_y)) {
+        AtomicMin(&first_surfel_depth_[offset_x + offset_y * width_], depth_bits);
+      }
+    }
+  });
+}
+
+void CPUSurfelReconstruction::AssociateSurfels(
+    u32 frame_index,
+    int surfel_integration_active_window_size,
+    float sensor_noise_factor,
+    float normal_compatibility_threshold_deg,
+    const SE3f& local_T_global,
+    float depth_correction_factor,
+    const Image<u16>& depth_buffer,
+    const Image<Vec2f>& normals_buffer,
+    const Image<float>& radius_buffer) {
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  const RigidTransform local_T_global_transform(local_T_global);
+  const CameraProjection camera(depth_camera_);
+  const float cos_normal_compatibility_threshold = cosf(M_PI / 180.0f * normal_compatibility_threshold_deg);
+  
+  // See ConsiderSurfelAssociationToPixel() in cuda_surfel_reconstruction.cu.
+  auto consider_surfel_association_to_pixel = [&](int x, int y, const Vec3f& cam_space_surfel_pos, u32 surfel_index) {
+    const usize pixel = x + y * width_;
+    
+    // Check whether the surfel falls on a depth pixel.
+    float measurement_depth = depth_correction_factor * depth_buffer(x, y);
+    if (measurement_depth <= 0) {
+      return;
+    }
+    
+    // Check if this or another surfel is conflicting.
+    const float first_surfel_depth_value = BitsToFloat(first_surfel_depth_[pixel].load(std::memory_order_relaxed));
+    if (first_surfel_depth_value < (1 - sensor_noise_factor) * measurement_depth) {
+      // This or another surfel is conflicting.
+      if (first_surfel_depth_value == cam_space_surfel_pos.z()) {
+        // This surfel is conflicting.
+        AtomicMin(&conflicting_surfels_[pixel], surfel_index);
+      }
+      return;
+    }
+    
+    // Determine the depth from which on surfels are considered to be occluded.
+    float occlusion_depth = (1 + sensor_noise_factor) * measurement_depth;
+    if (kProtectSlightlyOccludedSurfels) {
+      if (first_surfel_depth_value < occlusion_depth) {
+        occlusion_depth = (1 + kOcclusionDepthFactor) * first_surfel_depth_value;
+      }
+    }
+    
+    // Check if this surfel is occluded.
+    if (cam_space_surfel_pos.z() > occlusion_depth) {
+      return;
+    }
+    
+    // Check whether the surfel normal looks towards the camera (instead of away from it).
+    float surfel_distance = cam_space_surfel_pos.norm();
+    Vec3f local_surfel_normal = local_T_global_transform.Rotate(surfels.normal(surfel_index));
+    float dot_angle = (1.0f / surfel_distance) * cam_space_surfel_pos.dot(local_surfel_normal);
+    if (dot_angle > kSurfelNormalToViewingDirThreshold) {
+      return;
+    }
+    
+    // Check whether the surfel normal is compatible with the measurement normal.
+    if (measurement_depth < cam_space_surfel_pos.z()) {
+      Vec3f local_normal = MeasurementNormal(normals_buffer(x, y));
+      if (local_surfel_normal.dot(local_normal) < cos_normal_compatibility_threshold) {
+        return;
+      }
+    }
+    
+    // Check whether the observation scale is compatible with the surfel scale.
+    const float surfel_radius_squared = surfels(kSurfelRadiusSquared, surfel_index);
+    if (surfel_radius_squared <= 0) {
+      return;
+    }
+    if (kCheckScaleCompatibilityForIntegration) {
+      const float observation_radius_squared = radius_buffer(x, y);
+      if (observation_radius_squared / surfel_radius_squared > kMaxObservationRadiusFactorForIntegration * kMaxObservationRadiusFactorForIntegration) {
+        // Avoid creation of a new surfel here in case there is no other
+        // conflicting surfel. Since the conflicting surfel index is a minimum,
+        // this only changes the entry if it was kInvalidIndex before.
+        AtomicMin(&conflicting_surfels_[pixel], kInvalidSurfelIndex - 1);
+        return;
+      }
+    }
+    
+    AtomicMin(&supporting_surfels_[pixel], surfel_index);
+    supporting_surfel_counts_[pixel].fetch_add(1, std::memory_order_relaxed);
+    AtomicAdd(&supporting_surfel_depth_sums_[pixel], cam_space_surfel_pos.z());
+  };
+  
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (!IsSurfelActiveForIntegration(surfels, surfel_index, frame_index, surfel_integration_active_window_size)) {
+        continue;
+      }
+      
+      Vec3f local_position = local_T_global_transform * surfels.position(surfel_index);
+      Vec2f pixel_pos;
+      int px, py;
+      if (!camera.Project(local_position, &pixel_pos, &px, &py)) {
+        continue;
+      }
+      
+      consider_surfel_association_to_pixel(px, py, local_position, surfel_index);
+      
+      int offset_x, offset_y;
+      if (camera.GetSecondPixel(pixel_pos, px, py, &offset_x, &offset_y)) {
+        consider_surfel_association_to_pixel(offset_x, offset_y, local_position, surfel_index);
+      }
+    }
+  });
+}
+
+void CPUSurfelReconstruction::MergeSurfels(
+    float sensor_noise_factor,
+    float normal_compatibility_threshold_deg,
+    const SE3f& local_T_global,
+    float depth_correction_factor,
+    const Image<u16>& depth_buffer,
+    const Image<Vec2f>& normals_buffer,
+    const Image<float>& radius_buffer) {
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  const RigidTransform local_T_global_transform(local_T_global);
+  const CameraProjection camera(depth_camera_);
+  const float cos_normal_compatibility_threshold = cosf(M_PI / 180.0f * normal_compatibility_threshold_deg);
+  
+  // See ConsiderSurfelMergeAtPixel() in cuda_surfel_reconstruction.cu.
+  auto consider_surfel_merge_at_pixel = [&](int x, int y, const Vec3f& cam_space_surfel_pos, const Vec3f& global_surfel_pos, u32 surfel_index) {
+    const usize pixel = x + y * width_;
+    
+    // Check whether the surfel falls on a depth pixel.
+    float measurement_depth = depth_correction_factor * depth_buffer(x, y);
+    if (measurement_depth <= 0) {
+      return false;
+    }
+    
+    // Check if this or another surfel is conflicting.
+    const float first_surfel_depth_value = BitsToFloat(first_surfel_depth_[pixel].load(std::memory_order_relaxed));
+    if (first_surfel_depth_value < (1 - sensor_noise_factor) * measurement_depth) {
+      // This or another surfel is conflicting.
+      if (first_surfel_depth_value == cam_space_surfel_pos.z()) {
+        // This surfel is conflicting.
+        AtomicMin(&conflicting_surfels_[pixel], surfel_index);
+      }
+      return false;
+    }
+    
+    // Determine the depth from which on surfels are considered to be occluded.
+    float occlusion_depth = (1 + sensor_noise_factor) * measurement_depth;
+    if (kProtectSlightlyOccludedSurfels) {
+      if (first_surfel_depth_value < occlusion_depth) {
+        occlusion_depth = (1 + kOcclusionDepthFactor) * first_surfel_depth_value;
+      }
+    }
+    
+    // Check if this surfel is occluded.
+    if (cam_space_surfel_pos.z() > occlusion_depth) {
+      return false;
+    }
+    
+    // Check whether the surfel normal looks towards the camera (instead of away from it).
+    float surfel_distance = cam_space_surfel_pos.norm();
+    Vec3f global_surfel_normal = surfels.normal(surfel_index);
+    Vec3f local_surfel_normal = local_T_global_transform.Rotate(global_surfel_normal);
+    float dot_angle = (1.0f / surfel_distance) * cam_space_surfel_pos.dot(local_surfel_normal);
+    if (dot_angle > kSurfelNormalToViewingDirThreshold) {
+      return false;
+    }
+    
+    // Check whether the surfel normal is compatible with the measurement normal.
+    if (measurement_depth < cam_space_surfel_pos.z()) {
+      Vec3f local_normal = MeasurementNormal(normals_buffer(x, y));
+      if (local_surfel_normal.dot(local_normal) < cos_normal_compatibility_threshold) {
+        return false;
+      }
+    }
+    
+    // Check whether the observation scale is compatible with the surfel scale.
+    const float surfel_radius_squared = surfels(kSurfelRadiusSquared, surfel_index);
+    if (kCheckScaleCompatibilityForIntegration) {
+      const float observation_radius_squared = radius_buffer(x, y);
+      if (observation_radius_squared / surfel_radius_squared > kMaxObservationRadiusFactorForIntegration * kMaxObservationRadiusFactorForIntegration) {
+        return false;
+      }
+    }
+    
+    // Never merge the supported surfel.
+    u32 supported_surfel = supporting_surfels_[pixel].load(std::memory_order_relaxed);
+    if (supported_surfel == surfel_index || supported_surfel == kInvalidSurfelIndex) {
+      return false;
+    }
+    
+    // Compare the surfel to the supported surfel. Merge only if very similar.
+    // Radius:
+    const float other_radius_squared = surfels(kSurfelRadiusSquared, supported_surfel);
+    float radius_diff = surfel_radius_squared / other_radius_squared;
+    constexpr float kRadiusDiffThreshold = 1.2f;
+    constexpr float kRadiusDiffThresholdSq = kRadiusDiffThreshold * kRadiusDiffThreshold;
+    if (radius_diff > kRadiusDiffThresholdSq || radius_diff < 1 / kRadiusDiffThresholdSq) {
+      return false;
+    }
+    
+    // Distance:
+    float distance_squared = (global_surfel_pos - surfels.position(supported_surfel)).squaredNorm();
+    constexpr float kDistanceThresholdFactor = 0.5f * (0.25f * 0.25f);
+    if (distance_squared > kDistanceThresholdFactor * (surfel_radius_squared + other_radius_squared)) {
+      return false;
+    }
+    
+    // Normal:
+    dot_angle = global_surfel_normal.dot(surfels.normal(supported_surfel));
+    constexpr float kCosNormalMergeThreshold = 0.93969f;  // 20 degrees
+    if (dot_angle < kCosNormalMergeThreshold) {
+      return false;
+    }
+    
+    return true;
+  };
+  
+  // Decide about all merges first and apply them afterwards, such that the
+  // decisions do not see the merges of other threads.
+  merge_flags_.resize(surfel_count_);
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      bool merge = false;
+      if (surfels(kSurfelRadiusSquared, surfel_index) >= 0) {
+        Vec3f global_position = surfels.position(surfel_index);
+        Vec3f local_position = local_T_global_transform * global_position;
+        Vec2f pixel_pos;
+        int px, py;
+        if (camera.Project(local_position, &pixel_pos, &px, &py)) {
+          merge = consider_surfel_merge_at_pixel(px, py, local_position, global_position, surfel_index);
+        }
+      }
+      merge_flags_[surfel_index] = merge ? 1 : 0;
+    }
+  });
+  
+  std::atomic<u32> num_merges(0);
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    u32 chunk_merges = 0;
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (merge_flags_[surfel_index]) {
+        surfels.SetU32(kSurfelLastUpdateStamp, surfel_index, 0);
+        surfels(kSurfelRadiusSquared, surfel_index) = -1;
+        surfels.color(surfel_index)[3] = 1;  // Set neighbor detach request flag
+        ++ chunk_merges;
+      }
+    }
+    num_merges += chunk_merges;
+  });
+  merge_count_ += num_merges;
+}
+
+void CPUSurfelReconstruction::BlendMeasurements(
+    int measurement_blending_radius,
+    float depth_correction_factor,
+    Image<u16>* depth_buffer) {
+  const float depth_scaling = 1.0f / depth_correction_factor;
+  constexpr int kBorder = 1;
+  
+  auto surfel_depth_average = [&](usize pixel) {
+    return supporting_surfel_depth_sums_[pixel].load(std::memory_order_relaxed) /
+           supporting_surfel_counts_[pixel].load(std::memory_order_relaxed);
+  };
+  auto has_supporting_surfel = [&](usize pixel) {
+    return supporting_surfels_[pixel].load(std::memory_order_relaxed) != kInvalidSurfelIndex;
+  };
+  
+  // Find pixels with distance == 1, having a depth measurement next to the
+  // measurement border, and supporting surfels. The depth map is only read
+  // here and updated in the next pass.
+  thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+    for (int y = y_begin; y < static_cast<int>(y_end); ++ y) {
+      for (int x = 0; x < width_; ++ x) {
+        const usize pixel = x + y * width_;
+        distance_map_[pixel] = 0;
+        new_distance_map_[pixel] = 0;
+        
+        if (x < kBorder || y < kBorder || x >= width_ - kBorder || y >= height_ - kBorder) {
+          continue;
+        }
+        // Only consider pixels with valid measurement depth and supporting surfels.
+        if ((*depth_buffer)(x, y) == 0 || !has_supporting_surfel(pixel)) {
+          continue;
+        }
+        
+        bool measurement_border_pixel = false;
+        bool surfel_border_pixel = false;
+        for (int wy = y - 1, wy_end = y + 1; wy <= wy_end; ++ wy) {
+          for (int wx = x - 1, wx_end = x + 1; wx <= wx_end; ++ wx) {
+            if ((*depth_buffer)(wx, wy) == 0) {
+              measurement_border_pixel = true;
+            } else if (!has_supporting_surfel(wx + wy * width_)) {
+              surfel_border_pixel = true;
+            }
+          }
+        }
+        
+        if (surfel_border_pixel) {
+          new_distance_map_[pixel] = 1;
+          new_surfel_depth_average_deltas_[pixel] = surfel_depth_average(pixel) - (*depth_buffer)(x, y) / depth_scaling;
+        }
+        
+        if (measurement_border_pixel) {
+          distance_map_[pixel] = 1;
+          surfel_depth_average_deltas_[pixel] = surfel_depth_average(pixel) - (*depth_buffer)(x, y) / depth_scaling;
+        } else {
+          distance_map_[pixel] = 255;  // unknown distance
+        }
+      }
+    }
+  });
+  
+  thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+    for (int y = y_begin; y < static_cast<int>(y_end); ++ y) {
+      for (int x = 0; x < width_; ++ x) {
+        const usize pixel = x + y * width_;
+        if (distance_map_[pixel] == 1) {
+          (*depth_buffer)(x, y) = SaturateToU16(depth_scaling * surfel_depth_average(pixel) + 0.5f);
+        }
+      }
+    }
+  });
+  
+  // Find pixels with distances in [2, measurement_blending_radius] and average
+  // surfel depths. Each iteration first computes the averages based on the
+  // distance maps of the previous iteration, and then updates the distance
+  // maps and the depth map.
+  const float interpolation_factor_term = 1.0f / (measurement_blending_radius - 1.0f);
+  for (int iteration = 2; iteration < measurement_blending_radius; ++ iteration) {
+    thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+      for (int y = std::max<int>(kBorder, y_begin); y < std::min<int>(height_ - kBorder, y_end); ++ y) {
+        for (int x = kBorder; x < width_ - kBorder; ++ x) {
+          const usize pixel = x + y * width_;
+          u8 update_flags = 0;
+          
+          if (distance_map_[pixel] == 255) {  // unknown distance
+            float delta_sum = 0;
+            int count = 0;
+            for (int wy = y - 1, wy_end = y + 1; wy <= wy_end; ++ wy) {
+              for (int wx = x - 1, wx_end = x + 1; wx <= wx_end; ++ wx) {
+                if (distance_map_[wx + wy * width_] == iteration - 1) {
+                  delta_sum += surfel_depth_average_deltas_[wx + wy * width_];
+                  ++ count;
+                }
+              }
+            }
+            if (count > 0) {
+              // The delta of this pixel is not read by others in this pass
+              // since its distance is unknown.
+              surfel_depth_average_deltas_[pixel] = delta_sum / count;
+              update_flags |= 1;
+            }
+          }
+          
+          if (!has_supporting_surfel(pixel) && new_distance_map_[pixel] == 0) {
+            float delta_sum = 0;
+            int count = 0;
+            for (int wy = y - 1, wy_end = y + 1; wy <= wy_end; ++ wy) {
+              for (int wx = x - 1, wx_end = x + 1; wx <= wx_end; ++ wx) {
+                if (new_distance_map_[wx + wy * width_] == iteration - 1) {
+                  delta_sum += new_surfel_depth_average_deltas_[wx + wy * width_];
+                  ++ count;
+                }
+              }
+            }
+            if (count > 0) {
+              new_surfel_depth_average_deltas_[pixel] = delta_sum / count;
+              update_flags |= 2;
+            }
+          }
+          
+          blending_update_flags_[pixel] = update_flags;
+        }
+      }
+    });
+    
+    const float interpolation_factor = (iteration - 1) * interpolation_factor_term;
+    thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+      for (int y = std::max<int>(kBorder, y_begin); y < std::min<int>(height_ - kBorder, y_end); ++ y) {
+        for (int x = kBorder; x < width_ - kBorder; ++ x) {
+          const usize pixel = x + y * width_;
+          const u8 update_flags = blending_update_flags_[pixel];
+          u16& depth = (*depth_buffer)(x, y);
+          
+          if (update_flags & 1) {
+            distance_map_[pixel] = iteration;
+            depth = SaturateToU16(depth + depth_scaling * (1 - interpolation_factor) * surfel_depth_average_deltas_[pixel] + 0.5f);
+          }
+          
+          if ((update_flags & 2) && depth != 0) {
+            new_distance_map_[pixel] = iteration;
+            depth = SaturateToU16(depth + depth_scaling * (1 - interpolation_factor) * new_surfel_depth_average_deltas_[pixel] + 0.5f);
+          }
+        }
+      }
+    });
+  }
+}
+
+void CPUSurfelReconstruction::IntegrateMeasurements(
+    u32 frame_index,
+    int surfel_integration_active_window_size,
+    float max_surfel_confidence,
+    float sensor_noise_factor,
+    float normal_compatibility_threshold_deg,
+    const SE3f& global_T_local,
+    float depth_scaling,
+    const Image<u16>& depth_buffer,
+    const Image<Vec2f>& normals_buffer,
+    const Image<float>& radius_buffer,
+    const Image<Vec3u8>& color_buffer) {
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  const RigidTransform local_T_global_transform(global_T_local.inverse());
+  const RigidTransform global_T_local_transform(global_T_local);
+  const CameraProjection camera(depth_camera_);
+  const float cos_normal_compatibility_threshold = cosf(M_PI / 180.0f * normal_compatibility_threshold_deg);
+  const float depth_correction_factor = 1.0f / depth_scaling;
+  
+  // See IntegrateOrConflictSurfel() in cuda_surfel_reconstruction.cu. Each
+  // surfel is only modified by the thread which processes it, so in contrast
+  // to the CUDA version, no locking is required.
+  auto integrate_or_conflict_surfel = [&](int x, int y, const Vec3f& cam_space_surfel_pos, u32 surfel_index) {
+    const usize pixel = x + y * width_;
+    
+    // Check whether the surfel falls on a depth pixel.
+    float measurement_depth = depth_correction_factor * depth_buffer(x, y);
+    if (measurement_depth <= 0) {
+      return;
+    }
+    
+    // Check if this or another surfel is conflicting.
+    bool conflicting = false;
+    const float first_surfel_depth_value = BitsToFloat(first_surfel_depth_[pixel].load(std::memory_order_relaxed));
+    if (first_surfel_depth_value < (1 - sensor_noise_factor) * measurement_depth) {
+      // This or another surfel is conflicting.
+      if (first_surfel_depth_value == cam_space_surfel_pos.z() &&
+          conflicting_surfels_[pixel].load(std::memory_order_relaxed) == surfel_index) {
+        // This surfel is conflicting with the measurement.
+        conflicting = true;
+      } else {
+        return;
+      }
+    }
+    
+    if (!conflicting) {
+      // Determine the depth from which on surfels are considered to be occluded.
+      float occlusion_depth = (1 + sensor_noise_factor) * measurement_depth;
+      if (kProtectSlightlyOccludedSurfels && first_surfel_depth_value < occlusion_depth) {
+        occlusion_depth = (1 + kOcclusionDepthFactor) * first_surfel_depth_value;
+      }
+      
+      // Check whether this surfel is occluded.
+      if (cam_space_surfel_pos.z() > occlusion_depth) {
+        return;
+      }
+    }
+    
+    // Read data.
+    float depth = depth_correction_factor * depth_buffer(x, y);
+    Vec3f global_position = global_T_local_transform * camera.Unproject(x, y, depth);
+    Vec3f global_normal = global_T_local_transform.Rotate(MeasurementNormal(normals_buffer(x, y)));
+    const Vec3u8& color = color_buffer(x, y);
+    
+    if (conflicting) {
+      // Handle the conflict.
+      float confidence = surfels(kSurfelConfidence, surfel_index);
+      confidence -= 1;
+      if (confidence <= 0) {
+        // Delete the old surfel by replacing it with a new one.
+        surfels(kSurfelX, surfel_index) = global_position.x();
+        surfels(kSurfelY, surfel_index) = global_position.y();
+        surfels(kSurfelZ, surfel_index) = global_position.z();
+        
+        surfels(kSurfelSmoothX, surfel_index) = global_position.x();
+        surfels(kSurfelSmoothY, surfel_index) = global_position.y();
+        surfels(kSurfelSmoothZ, surfel_index) = global_position.z();
+        
+        surfels(kSurfelNormalX, surfel_index) = global_normal.x();
+        surfels(kSurfelNormalY, surfel_index) = global_normal.y();
+        surfels(kSurfelNormalZ, surfel_index) = global_normal.z();
+        
+        u8* surfel_color = surfels.color(surfel_index);
+        surfel_color[0] = color.x();
+        surfel_color[1] = color.y();
+        surfel_color[2] = color.z();
+        surfel_color[3] = 1;  // Sets the neighbor detach request flag.
+        
+        surfels(kSurfelRadiusSquared, surfel_index) = radius_buffer(x, y);
+        
+        for (int i = 0; i < kSurfelNeighborCount; ++ i) {
+          surfels.SetU32(kSurfelNeighbor0 + i, surfel_index, kInvalidSurfelIndex);
+        }
+        
+        surfels(kSurfelConfidence, surfel_index) = 1;
+        surfels.SetU32(kSurfelCreationStamp, surfel_index, frame_index);
+        surfels.SetU32(kSurfelLastUpdateStamp, surfel_index, frame_index);
+      } else {
+        surfels(kSurfelConfidence, surfel_index) = confidence;
+      }
+      return;
+    }
+    
+    // The measurement supports the surfel. Determine whether they belong to the
+    // same surface (then the measurement should be integrated into the surfel),
+    // or to different surfaces (then the measurement must not be integrated).
+    
+    // Check whether the surfel normal looks towards the camera (instead of away from it).
+    float surfel_distance = cam_space_surfel_pos.norm();
+    Vec3f global_surfel_normal = surfels.normal(surfel_index);
+    Vec3f local_surfel_normal = local_T_global_transform.Rotate(global_surfel_normal);
+    float dot_angle = (1.0f / surfel_distance) * cam_space_surfel_pos.dot(local_surfel_normal);
+    if (dot_angle > kSurfelNormalToViewingDirThreshold) {
+      return;
+    }
+    
+    // Check whether the surfel normal is compatible with the measurement normal.
+    if (measurement_depth < cam_space_surfel_pos.z()) {
+      if (global_surfel_normal.dot(global_normal) < cos_normal_compatibility_threshold) {
+        return;
+      }
+    }
+    
+    // Check whether the observation scale is compatible with the surfel scale.
+    const float surfel_radius_squared = surfels(kSurfelRadiusSquared, surfel_index);
+    if (surfel_radius_squared < 0) {
+      return;
+    }
+    if (kCheckScaleCompatibilityForIntegration) {
+      const float observation_radius_squared = radius_buffer(x, y);
+      if (observation_radius_squared / surfel_radius_squared > kMaxObservationRadiusFactorForIntegration * kMaxObservationRadiusFactorForIntegration) {
+        return;
+      }
+    }
+    
+    // If the surfel has been created (i.e., replaced) in this iteration, do not
+    // integrate the data, since the association is probably not valid anymore.
+    // Also, the neighbor detach request flag should be kept in that case.
+    if (surfels.GetU32(kSurfelCreationStamp, surfel_index) >= frame_index) {
+      return;
+    }
+    
+    // Integrate.
+    const float weight = 1.0f / std::max<u32>(1, supporting_surfel_counts_[pixel].load(std::memory_order_relaxed));
+    
+    const float confidence = surfels(kSurfelConfidence, surfel_index);
+    surfels(kSurfelConfidence, surfel_index) =
+        (confidence + weight < max_surfel_confidence) ?
+        (confidence + weight) :
+        max_surfel_confidence;
+    float normalization_factor = 1.0f / (confidence + weight);
+    
+    surfels(kSurfelX, surfel_index) = (confidence * surfels(kSurfelX, surfel_index) + weight * global_position.x()) * normalization_factor;
+    surfels(kSurfelY, surfel_index) = (confidence * surfels(kSurfelY, surfel_index) + weight * global_position.y()) * normalization_factor;
+    surfels(kSurfelZ, surfel_index) = (confidence * surfels(kSurfelZ, surfel_index) + weight * global_position.z()) * normalization_factor;
+    
+    Vec3f new_normal = confidence * global_surfel_normal + weight * global_normal;
+    float normal_normalization = 1.0f / sqrtf(new_normal.squaredNorm());
+    surfels(kSurfelNormalX, surfel_index) = normal_normalization * new_normal.x();
+    surfels(kSurfelNormalY, surfel_index) = normal_normalization * new_normal.y();
+    surfels(kSurfelNormalZ, surfel_index) = normal_normalization * new_normal.z();
+    
+    surfels(kSurfelRadiusSquared, surfel_index) = std::min(surfel_radius_squared, radius_buffer(x, y));
+    
+    u8* surfel_color = surfels.color(surfel_index);
+    for (int c = 0; c < 3; ++ c) {
+      surfel_color[c] = SaturateToU8((confidence * surfel_color[c] + weight * color(c)) * normalization_factor + 0.5f);
+    }
+    surfel_color[3] = 0;  // NOTE: Unsets the neighbor detach request flag
+    
+    surfels.SetU32(kSurfelLastUpdateStamp, surfel_index, frame_index);
+  };
+  
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (!IsSurfelActiveForIntegration(surfels, surfel_index, frame_index, surfel_integration_active_window_size)) {
+        continue;
+      }
+      
+      Vec3f local_position = local_T_global_transform * surfels.position(surfel_index);
+      Vec2f pixel_pos;
+      int px, py;
+      if (!camera.Project(local_position, &pixel_pos, &px, &py)) {
+        continue;
+      }
+      if (surfels(kSurfelRadiusSquared, surfel_index) < 0) {
+        continue;
+      }
+      
+      integrate_or_conflict_surfel(px, py, local_position, surfel_index);
+      
+      // TODO: use half integration weight if the surfel is associated to two pixels?
+      int offset_x, offset_y;
+      if (camera.GetSecondPixel(pixel_pos, px, py, &offset_x, &offset_y)) {
+        integrate_or_conflict_surfel(offset_x, offset_y, local_position, surfel_index);
+      }
+    }
+  });
+}
+
+void CPUSurfelReconstruction::UpdateNeighbors(
+    u32 frame_index,
+    int surfel_integration_active_window_size,
+    float radius_factor_for_regularization_neighbors,
+    const SE3f& local_T_global,
+    float sensor_noise_factor,
+    float depth_correction_factor,
+    const Image<u16>& depth_buffer,
+    const Image<float>& radius_buffer) {
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  const RigidTransform local_T_global_transform(local_T_global);
+  const CameraProjection camera(depth_camera_);
+  const float radius_factor_for_regularization_neighbors_squared =
+      radius_factor_for_regularization_neighbors * radius_factor_for_regularization_neighbors;
+  
+  // See UpdateNeighborsCUDAKernel() in cuda_surfel_reconstruction.cu.
+  auto update_neighbors = [&](u32 surfel_index) {
+    if (!IsSurfelActiveForIntegration(surfels, surfel_index, frame_index, surfel_integration_active_window_size)) {
+      return;
+    }
+    
+    // Project the surfel into the image.
+    Vec3f global_position = surfels.position(surfel_index);
+    Vec3f cam_space_surfel_pos = local_T_global_transform * global_position;
+    if (cam_space_surfel_pos.z() <= 0) {
+      return;
+    }
+    
+    Vec2f pixel_pos(camera.fx * (cam_space_surfel_pos.x() / cam_space_surfel_pos.z()) + camera.cx,
+                    camera.fy * (cam_space_surfel_pos.y() / cam_space_surfel_pos.z()) + camera.cy);
+    
+    // Use 1 pixel border.
+    constexpr int kBorder = 1;
+    if (!(pixel_pos.x() >= kBorder && pixel_pos.y() >= kBorder &&
+          pixel_pos.x() < width_ - kBorder && pixel_pos.y() < height_ - kBorder)) {
+      return;
+    }
+    int x = static_cast<int>(pixel_pos.x());
+    int y = static_cast<int>(pixel_pos.y());
+    
+    // Is the surfel occluded?
+    float measurement_depth = depth_correction_factor * depth_buffer(x, y);
+    float occlusion_depth = (1 + sensor_noise_factor) * measurement_depth;
+    if (kProtectSlightlyOccludedSurfels) {
+      const float first_surfel_depth_value = BitsToFloat(first_surfel_depth_[x + y * width_].load(std::memory_order_relaxed));
+      if (first_surfel_depth_value < occlusion_depth) {
+        occlusion_depth = (1 + kOcclusionDepthFactor) * first_surfel_depth_value;
+      }
+    }
+    if (cam_space_surfel_pos.z() > occlusion_depth) {
+      return;
+    }
+    
+    // Check whether the surfel normal looks towards the camera (instead of away from it).
+    float surfel_distance = cam_space_surfel_pos.norm();
+    Vec3f global_normal = surfels.normal(surfel_index);
+    Vec3f local_surfel_normal = local_T_global_transform.Rotate(global_normal);
+    float dot_angle = (1.0f / surfel_distance) * cam_space_surfel_pos.dot(local_surfel_normal);
+    if (dot_angle > kSurfelNormalToViewingDirThreshold) {
+      return;
+    }
+    
+    const float radius_squared = surfels(kSurfelRadiusSquared, surfel_index);
+    if (radius_squared < 0) {
+      return;
+    }
+    if (kCheckScaleCompatibilityForNeighborAssignment) {
+      const float observation_radius_squared = radius_buffer(x, y);
+      if (observation_radius_squared / radius_squared > kMaxObservationRadiusFactorForIntegration * kMaxObservationRadiusFactorForIntegration) {
+        return;
+      }
+    }
+    
+    // We think that the surfel is visible, update its neighbors.
+    
+    // Compute distances to existing neighbors.
+    float neighbor_distances_squared[kSurfelNeighborCount];
+    u32 neighbor_surfel_indices[kSurfelNeighborCount];
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      neighbor_surfel_indices[n] = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+      if (neighbor_surfel_indices[n] == kInvalidSurfelIndex) {
+        neighbor_distances_squared[n] = numeric_limits<float>::infinity();
+      } else {
+        neighbor_distances_squared[n] = (global_position - surfels.position(neighbor_surfel_indices[n])).squaredNorm();
+      }
+    }
+    
+    constexpr int kDirectionsX[4] = {-1, 1, 0, 0};
+    constexpr int kDirectionsY[4] = {0, 0, -1, 1};
+    for (int direction = 0; direction < 4; ++ direction) {
+      u32 neighbor_index = supporting_surfels_[(x + kDirectionsX[direction]) + (y + kDirectionsY[direction]) * width_].load(std::memory_order_relaxed);
+      if (neighbor_index == kInvalidSurfelIndex ||
+          neighbor_index == surfel_index) {
+        continue;
+      }
+      
+      // Check for closeness.
+      float distance_squared = (surfels.position(neighbor_index) - global_position).squaredNorm();
+      if (distance_squared > radius_factor_for_regularization_neighbors_squared * radius_squared) {
+        continue;
+      }
+      
+      // Check for compatible normal.
+      if (global_normal.dot(surfels.normal(neighbor_index)) <= 0) {
+        continue;
+      }
+      
+      // Check whether it is already a neighbor, or find the best insertion slot.
+      int best_n = -1;
+      float best_distance_squared = -1;
+      for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+        if (neighbor_index == neighbor_surfel_indices[n]) {
+          best_n = -1;
+          break;
+        } else if (neighbor_distances_squared[n] > best_distance_squared) {
+          best_n = n;
+          best_distance_squared = neighbor_distances_squared[n];
+        }
+      }
+      
+      if (best_n >= 0 && distance_squared < best_distance_squared) {
+        neighbor_surfel_indices[best_n] = neighbor_index;
+        neighbor_distances_squared[best_n] = distance_squared;
+      }
+    }
+    
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      surfels.SetU32(kSurfelNeighbor0 + n, surfel_index, neighbor_surfel_indices[n]);
+    }
+  };
+  
+  // Each surfel only changes its own neighbor entries here, so removing the
+  // neighbors with the detach request flag (see
+  // UpdateNeighborsCUDARemoveReplacedNeighborsKernel()) can be done in the
+  // same loop.
+  thread_pool_.ParallelFor(0, surfel_count_, kSurfelChunkSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      update_neighbors(surfel_index);
+      
+      for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+        u32 neighbor_surfel_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+        if (neighbor_surfel_index != kInvalidSurfelIndex &&
+            surfels.color(neighbor_surfel_index)[3] == 1) {
+          // This neighbor has the neighbor detach request flag set. Remove it.
+          surfels.SetU32(kSurfelNeighbor0 + n, surfel_index, kInvalidSurfelIndex);
+        }
+      }
+    }
+  });
+}
+
+void CPUSurfelReconstruction::CreateNewSurfels(
+    u32 frame_index,
+    const SE3f& global_T_local,
+    float depth_scaling,
+    float radius_factor_for_regularization_neighbors,
+    const Image<u16>& depth_buffer,
+    const Image<Vec2f>& normals_buffer,
+    const Image<float>& radius_buffer,
+    const Image<Vec3u8>& color_buffer) {
+  const CPUSurfelBuffer surfels(surfels_.get(), max_surfel_count_);
+  const RigidTransform global_T_local_transform(global_T_local);
+  const CameraProjection camera(depth_camera_);
+  const float inv_depth_scaling = 1.0f / depth_scaling;
+  const float radius_factor_for_regularization_neighbors_squared =
+      radius_factor_for_regularization_neighbors * radius_factor_for_regularization_neighbors;
+  
+  // Mark the pixels for which a new surfel is created, and count them per row.
+  thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+    for (int y = y_begin; y < static_cast<int>(y_end); ++ y) {
+      u32 row_count = 0;
+      for (int x = 0; x < width_; ++ x) {
+        const usize pixel = x + y * width_;
+        // TODO: Is this border necessary here, or should it rather be integrated into the depth map erosion?
+        constexpr int kBorder = 1;
+        bool new_surfel = x >= kBorder &&
+                          y >= kBorder &&
+                          x < width_ - kBorder &&
+                          y < height_ - kBorder &&
+                          depth_buffer(x, y) > 0 &&
+                          supporting_surfels_[pixel].load(std::memory_order_relaxed) == kInvalidSurfelIndex &&
+                          conflicting_surfels_[pixel].load(std::memory_order_relaxed) == kInvalidSurfelIndex;
+        new_surfel_flags_[pixel] = new_surfel ? 1 : 0;
+        row_count += new_surfel ? 1 : 0;
+      }
+      new_surfel_row_offsets_[y + 1] = row_count;
+    }
+  });
+  
+  // The new surfels are numbered in row-major pixel order, like with the
+  // exclusive prefix sum in the CUDA version.
+  new_surfel_row_offsets_[0] = 0;
+  for (int y = 0; y < height_; ++ y) {
+    new_surfel_row_offsets_[y + 1] += new_surfel_row_offsets_[y];
+  }
+  const u32 new_surfel_count = new_surfel_row_offsets_[height_];
+  CHECK_LE(surfel_count_ + static_cast<usize>(new_surfel_count), max_surfel_count_)
+      << "Maximum surfel count exceeded.";
+  
+  thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+    for (int y = y_begin; y < static_cast<int>(y_end); ++ y) {
+      u32 new_surfel_index = new_surfel_row_offsets_[y];
+      for (int x = 0; x < width_; ++ x) {
+        const usize pixel = x + y * width_;
+        new_surfel_indices_[pixel] = new_surfel_index;
+        new_surfel_index += new_surfel_flags_[pixel];
+      }
+    }
+  });
+  
+  // Now that the indices are known, the actual surfel creation is done.
+  thread_pool_.ParallelFor(0, height_, kRowChunkSize, [&](usize y_begin, usize y_end) {
+    for (int y = y_begin; y < static_cast<int>(y_end); ++ y) {
+      for (int x = 0; x < width_; ++ x) {
+        const usize pixel = x + y * width_;
+        if (new_surfel_flags_[pixel] != 1) {
+          continue;
+        }
+        
+        u32 surfel_index = surfel_count_ + new_surfel_indices_[pixel];
+        
+        float depth = inv_depth_scaling * depth_buffer(x, y);
+        Vec3f global_position = global_T_local_transform * camera.Unproject(x, y, depth);
+        
+        surfels(kSurfelX, surfel_index) = global_position.x();
+        surfels(kSurfelY, surfel_index) = global_position.y();
+        surfels(kSurfelZ, surfel_index) = global_position.z();
+        
+        Vec3f global_normal = global_T_local_transform.Rotate(MeasurementNormal(normals_buffer(x, y)));
+        surfels(kSurfelNormalX, surfel_index) = global_normal.x();
+        surfels(kSurfelNormalY, surfel_index) = global_normal.y();
+        surfels(kSurfelNormalZ, surfel_index) = global_normal.z();
+        
+        const Vec3u8& color = color_buffer(x, y);
+        u8* surfel_color = surfels.color(surfel_index);
+        surfel_color[0] = color.x();
+        surfel_color[1] = color.y();
+        surfel_color[2] = color.z();
+        surfel_color[3] = 0;
+        
+        surfels(kSurfelConfidence, surfel_index) = 1;
+        surfels.SetU32(kSurfelCreationStamp, surfel_index, frame_index);
+        surfels.SetU32(kSurfelLastUpdateStamp, surfel_index, frame_index);
+        
+        const float radius_squared = radius_buffer(x, y);
+        surfels(kSurfelRadiusSquared, surfel_index) = radius_squared;
+        
+        // Determine initial neighbors.
+        Vec3f neighbor_position_sum = Vec3f::Zero();
+        int existing_neighbor_count_plus_1 = 1;
+        constexpr int kDirectionsX[4] = {-1, 1, 0, 0};
+        constexpr int kDirectionsY[4] = {0, 0, -1, 1};
+        for (int direction = 0; direction < 4; ++ direction) {
+          const usize neighbor_pixel = (x + kDirectionsX[direction]) + (y + kDirectionsY[direction]) * width_;
+          u32 neighbor_index = supporting_surfels_[neighbor_pixel].load(std::memory_order_relaxed);
+          
+          if (neighbor_index != kInvalidSurfelIndex) {
+            float distance_squared = (surfels.position(neighbor_index) - global_position).squaredNorm();
+            if (distance_squared > radius_factor_for_regularization_neighbors_squared * radius_squared) {
+              neighbor_index = kInvalidSurfelIndex;
+            } else {
+              neighbor_position_sum += surfels.smooth_position(neighbor_index);
+              ++ existing_neighbor_count_plus_1;
+            }
+          } else if (new_surfel_flags_[neighbor_pixel] == 1) {
+            float other_depth = inv_depth_scaling * depth_buffer(x + kDirectionsX[direction], y + kDirectionsY[direction]);
+            float approximate_distance_squared = (depth - other_depth) * (depth - other_depth);
+            if (approximate_distance_squared <= radius_factor_for_regularization_neighbors_squared * radius_squared) {
+              neighbor_index = surfel_count_ + new_surfel_indices_[neighbor_pixel];
+            }
+          }
+          
+          surfels.SetU32(kSurfelNeighbor0 + direction, surfel_index, neighbor_index);
+        }
+        
+        // Try to get a better initialization for the regularized surfel position.
+        surfels(kSurfelSmoothX, surfel_index) = (global_position.x() + neighbor_position_sum.x()) / existing_neighbor_count_plus_1;
+        surfels(kSurfelSmoothY, surfel_index) = (global_position.y() + neighbor_position_sum.y()) / existing_neighbor_count_plus_1;
+        surfels(kSurfelSmoothZ, surfel_index) = (global_position.z() + neighbor_position_sum.z()) / existing_neighbor_count_plus_1;
+      }
+    }
+  });
+  
+  surfel_count_ += new_surfel_count;
+}
+
+}
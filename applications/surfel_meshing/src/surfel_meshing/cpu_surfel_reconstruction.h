@@ -0,0 +1,291 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+#include "surfel_meshing/cpu_surfel_regularization.h"
+#include "surfel_meshing/cuda_surfels_cpu.h"
+#include "surfel_meshing/surfel_attributes.h"
+#include "surfel_meshing/thread_pool.h"
+
+namespace vis {
+
+// CPU implementation of CUDASurfelReconstruction, for running the surfel
+// fusion on machines without a GPU. The surfels are stored in the same packed
+// layout as on the GPU (one row per attribute, see surfel_attributes.h), and
+// each step of Integrate() computes the same result as the CUDA kernel of the
+// same name in cuda_surfel_reconstruction.cu. The steps are parallelized over
+// surfels or image rows with a ThreadPool, and the regularization is done by
+// CPUSurfelRegularization.
+// 
+// Where the CUDA kernels let concurrent threads race for a pixel, the CPU
+// version resolves this deterministically:
+// - The supporting and conflicting surfel of a pixel is the one with the
+//   smallest index among the candidates (the GPU keeps an arbitrary one).
+// - Surfel merging first decides for all surfels and then applies the merges,
+//   such that the decisions do not depend on merges done in parallel.
+// - Measurement blending reads the distance maps of the previous iteration
+//   only.
+// As a result, the surfels do not depend on the thread count, with the only
+// exception of the per-pixel surfel depth sums used for measurement blending,
+// which are accumulated in arbitrary order.
+// 
+// The input images must have the size of the depth camera. The normals image
+// corresponds to the float2 normals buffer of the CUDA version, and the radius
+// image contains squared radii like the CUDA radius buffer.
+class CPUSurfelReconstruction {
+ public:
+  // Constructor, allocates the surfel and image buffers. A thread_count <= 0
+  // selects the number of hardware threads.
+  CPUSurfelReconstruction(
+      usize max_surfel_count,
+      const PinholeCamera4f& depth_camera,
+      int thread_count);
+  
+  // Performs integration of a depth map into the surfel cloud. See
+  // CUDASurfelReconstruction::Integrate(). If do_blending is true, the depth
+  // map is modified like in the CUDA version.
+  void Integrate(
+      u32 frame_index,
+      float depth_scaling,
+      Image<u16>* depth_buffer,
+      const Image<Vec2f>& normals_buffer,
+      const Image<float>& radius_buffer,
+      const Image<Vec3u8>& color_buffer,
+      const SE3f& global_T_local,
+      float sensor_noise_factor,
+      float max_surfel_confidence,
+      float regularizer_weight,
+      int regularization_frame_window_size,
+      bool do_blending,
+      int measurement_blending_radius,
+      int regularization_iterations_per_integration_iteration,
+      float radius_factor_for_regularization_neighbors,
+      float normal_compatibility_threshold_deg,
+      int surfel_integration_active_window_size);
+  
+  // Performs an extra (gradient descent) regularization iteration. Normally
+  // this does not need to be called explicitly since Integrate() already does
+  // it.
+  void Regularize(
+      u32 frame_index,
+      float regularizer_weight,
+      float radius_factor_for_regularization_neighbors,
+      int regularization_frame_window_size);
+  
+  // Transfers all surfels into the write buffers of the CPU buffers used by
+  // the meshing, which must be published with
+  // CUDASurfelsCPU::PublishWriteBuffers() afterwards. Also determines which
+  // surfels changed since the previous transfer and passes their indices to
+  // CUDASurfelsCPU::SetChangedSurfels().
+  void TransferAllToCPU(
+      u32 frame_index,
+      CUDASurfelsCPU* buffers);
+  
+  // Reclaims the entries of merged surfels by moving live surfels from the end
+  // of the surfel buffer into them, such that surfels_size() shrinks. Does
+  // nothing unless at least min_merged_fraction of the entries are merged
+  // surfels. At most max_moves surfels are moved per call, which bounds the
+  // pause; merged entries at the end of the buffer are dropped without a move.
+  // The neighbor indices are remapped, and the moves are passed to the
+  // meshing with the next TransferAllToCPU() (see
+  // CUDASurfelsCPU::SetSurfelMoves()). Returns the number of reclaimed
+  // entries.
+  u32 CompactSurfels(u32 max_moves, float min_merged_fraction);
+  
+  // Exports surfel positions and colors to separate buffers with 3 entries per
+  // surfel entry. The positions of merged surfels are set to NaN.
+  void ExportVertices(
+      vector<float>* position_buffer,
+      vector<u8>* color_buffer);
+  
+  // Returns the timings in milliseconds for the last call to Integrate().
+  void GetTimings(
+      float* data_association,
+      float* surfel_merging,
+      float* measurement_blending,
+      float* integration,
+      float* neighbor_update,
+      float* new_surfel_creation,
+      float* regularization);
+  
+  // Returns the current surfel count.
+  inline u32 surfel_count() const { return surfel_count_ - merge_count_; }
+  
+  // Returns the number of surfel entries in use.
+  inline u32 surfels_size() const { return surfel_count_; }
+  
+  // Returns the row of the given attribute in the surfel buffer, containing
+  // surfels_size() valid entries. The u32 and color attributes are stored in
+  // the bits of the floats, like on the GPU.
+  inline const float* surfel_attribute(int attribute) const {
+    return surfels_.get() + attribute * max_surfel_count_;
+  }
+  
+  // Returns the number of threads used.
+  inline int thread_count() const { return thread_pool_.thread_count(); }
+  
+ private:
+  void RenderMinDepth(
+      u32 frame_index,
+      int surfel_integration_active_window_size,
+      const SE3f& local_T_global);
+  
+  void AssociateSurfels(
+      u32 frame_index,
+      int surfel_integration_active_window_size,
+      float sensor_noise_factor,
+      float normal_compatibility_threshold_deg,
+      const SE3f& local_T_global,
+      float depth_correction_factor,
+      const Image<u16>& depth_buffer,
+      const Image<Vec2f>& normals_buffer,
+      const Image<float>& radius_buffer);
+  
+  void MergeSurfels(
+      float sensor_noise_factor,
+      float normal_compatibility_threshold_deg,
+      const SE3f& local_T_global,
+      float depth_correction_factor,
+      const Image<u16>& depth_buffer,
+      const Image<Vec2f>& normals_buffer,
+      const Image<float>& radius_buffer);
+  
+  void BlendMeasurements(
+      int measurement_blending_radius,
+      float depth_correction_factor,
+      Image<u16>* depth_buffer);
+  
+  void IntegrateMeasurements(
+      u32 frame_index,
+      int surfel_integration_active_window_size,
+      float max_surfel_confidence,
+      float sensor_noise_factor,
+      float normal_compatibility_threshold_deg,
+      const SE3f& global_T_local,
+      float depth_scaling,
+      const Image<u16>& depth_buffer,
+      const Image<Vec2f>& normals_buffer,
+      const Image<float>& radius_buffer,
+      const Image<Vec3u8>& color_buffer);
+  
+  void UpdateNeighbors(
+      u32 frame_index,
+      int surfel_integration_active_window_size,
+      float radius_factor_for_regularization_neighbors,
+      const SE3f& local_T_global,
+      float sensor_noise_factor,
+      float depth_correction_factor,
+      const Image<u16>& depth_buffer,
+      const Image<float>& radius_buffer);
+  
+  void CreateNewSurfels(
+      u32 frame_index,
+      const SE3f& global_T_local,
+      float depth_scaling,
+      float radius_factor_for_regularization_neighbors,
+      const Image<u16>& depth_buffer,
+      const Image<Vec2f>& normals_buffer,
+      const Image<float>& radius_buffer,
+      const Image<Vec3u8>& color_buffer);
+  
+  // Packed surfel attributes, with a row pitch of max_surfel_count_ elements.
+  // Allocated without initialization since only the first surfel_count_
+  // entries of each row are used.
+  unique_ptr<float[]> surfels_;
+  
+  // Per-pixel buffers of the data association. These are written
+  // concurrently by the surfel threads and are therefore atomic.
+  unique_ptr<std::atomic<u32>[]> supporting_surfels_;
+  unique_ptr<std::atomic<u32>[]> supporting_surfel_counts_;
+  unique_ptr<std::atomic<float>[]> supporting_surfel_depth_sums_;
+  unique_ptr<std::atomic<u32>[]> conflicting_surfels_;
+  // Stores the bits of positive floats, which compare like the floats.
+  unique_ptr<std::atomic<u32>[]> first_surfel_depth_;
+  
+  // Per-pixel buffers of the measurement blending.
+  vector<u8> distance_map_;
+  vector<float> surfel_depth_average_deltas_;
+  vector<u8> new_distance_map_;
+  vector<float> new_surfel_depth_average_deltas_;
+  vector<u8> blending_update_flags_;
+  
+  // Per-pixel buffers of the new surfel creation.
+  vector<u8> new_surfel_flags_;
+  vector<u32> new_surfel_indices_;
+  vector<u32> new_surfel_row_offsets_;
+  
+  // Per-surfel merge decisions.
+  vector<u8> merge_flags_;
+  
+  // Surfel attribute values as of the last transfer to the CPU (in the order
+  // of CUDASurfelReconstruction::TransferAllToCPU()), and per-chunk lists of
+  // changed surfels.
+  unique_ptr<float[]> transferred_surfels_;
+  u32 transferred_surfel_count_;
+  vector<vector<u32>> changed_surfel_indices_per_chunk_;
+  vector<u32> changed_surfel_indices_;
+  
+  // Surfel moves done by CompactSurfels() since the last transfer, and the
+  // destinations of the dropped tail entries (Surfel::kInvalidIndex for the
+  // merged ones) used for remapping the neighbors.
+  vector<SurfelMove> surfel_moves_;
+  vector<u32> compaction_destinations_;
+  
+  u32 surfel_count_;
+  u32 merge_count_;
+  usize max_surfel_count_;
+  
+  PinholeCamera4f depth_camera_;
+  int width_;
+  int height_;
+  
+  float data_association_time_;
+  float surfel_merging_time_;
+  float measurement_blending_time_;
+  float integration_time_;
+  float neighbor_update_time_;
+  float new_surfel_creation_time_;
+  float regularization_time_;
+  
+  CPUSurfelRegularization regularization_;
+  ThreadPool thread_pool_;
+};
+
+}
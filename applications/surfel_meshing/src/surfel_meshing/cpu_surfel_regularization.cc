@@ -0,0 +1,271 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "surfel_meshing/cpu_surfel_regularization.h"
+
+#include <cmath>
+
+#include "surfel_meshing/surfel.h"
+
+namespace vis {
+
+namespace {
+
+// Number of consecutive surfels in a block of the gradient accumulation. The
+// surfels created for the same frame get consecutive indices in pixel order,
+// so this should be large compared to the image width to keep the number of
+// far contributions low.
+constexpr usize kRegularizationBlockSize = 4096;
+
+constexpr u32 kInvalidSurfelIndex = Surfel::kInvalidIndex;
+
+inline bool IsSurfelInRegularizationWindow(
+    const CPUSurfelBuffer& surfels,
+    u32 surfel_index,
+    u32 frame_index,
+    int regularization_frame_window_size) {
+  return !(static_cast<int>(surfels.GetU32(kSurfelLastUpdateStamp, surfel_index)) <
+           static_cast<int>(frame_index - regularization_frame_window_size));
+}
+
+}  // namespace
+
+
+void CPUSurfelRegularization::Regularize(
+    bool disable_denoising,
+    u32 frame_index,
+    float radius_factor_for_regularization_neighbors,
+    float regularizer_weight,
+    int regularization_frame_window_size,
+    u32 surfel_count,
+    const CPUSurfelBuffer& surfels,
+    ThreadPool* thread_pool) {
+  if (surfel_count == 0) {
+    return;
+  }
+  
+  if (disable_denoising) {
+    // Only copy the raw surfel positions to the smoothed position fields.
+    thread_pool->ParallelFor(0, surfel_count, kRegularizationBlockSize, [&](usize begin, usize end) {
+      for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+        if (!IsSurfelInRegularizationWindow(surfels, surfel_index, frame_index, regularization_frame_window_size)) {
+          continue;
+        }
+        surfels(kSurfelSmoothX, surfel_index) = surfels(kSurfelX, surfel_index);
+        surfels(kSurfelSmoothY, surfel_index) = surfels(kSurfelY, surfel_index);
+        surfels(kSurfelSmoothZ, surfel_index) = surfels(kSurfelZ, surfel_index);
+      }
+    });
+    return;
+  }
+  
+  thread_pool->ParallelFor(0, surfel_count, kRegularizationBlockSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      surfels(kSurfelGradientX, surfel_index) = 0;
+      surfels(kSurfelGradientY, surfel_index) = 0;
+      surfels(kSurfelGradientZ, surfel_index) = 0;
+      surfels(kSurfelGradientCount, surfel_index) = 0;
+    }
+  });
+  
+  // Accumulate the gradient terms for the neighbors, processing the blocks of
+  // each colour in parallel.
+  const usize block_count = (surfel_count + kRegularizationBlockSize - 1) / kRegularizationBlockSize;
+  far_contributions_.resize(block_count);
+  const float radius_factor_for_regularization_neighbors_squared =
+      radius_factor_for_regularization_neighbors * radius_factor_for_regularization_neighbors;
+  for (usize colour = 0; colour < 3 && colour < block_count; ++ colour) {
+    const usize colour_block_count = (block_count - colour + 2) / 3;
+    thread_pool->ParallelFor(0, colour_block_count, 1, [&](usize begin, usize end) {
+      for (usize i = begin; i < end; ++ i) {
+        AccumulateNeighborGradients(
+            colour + 3 * i,
+            frame_index,
+            radius_factor_for_regularization_neighbors_squared,
+            regularizer_weight,
+            regularization_frame_window_size,
+            surfel_count,
+            surfels);
+      }
+    });
+  }
+  for (const vector<GradientContribution>& contributions : far_contributions_) {
+    for (const GradientContribution& contribution : contributions) {
+      surfels(kSurfelGradientX, contribution.surfel_index) += contribution.gradient_x;
+      surfels(kSurfelGradientY, contribution.surfel_index) += contribution.gradient_y;
+      surfels(kSurfelGradientZ, contribution.surfel_index) += contribution.gradient_z;
+      surfels(kSurfelGradientCount, contribution.surfel_index) += contribution.gradient_count;
+    }
+  }
+  
+  // See RegularizeSurfelsCUDAKernel(). The new smooth positions are written
+  // to the gradient fields first since the smooth positions are still read by
+  // the neighbors, and moved to the smooth position fields afterwards.
+  thread_pool->ParallelFor(0, surfel_count, kRegularizationBlockSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (!IsSurfelInRegularizationWindow(surfels, surfel_index, frame_index, regularization_frame_window_size)) {
+        continue;
+      }
+      
+      Vec3f measured_position = surfels.position(surfel_index);
+      Vec3f smooth_position = surfels.smooth_position(surfel_index);
+      Vec3f normal = surfels.normal(surfel_index);
+      
+      // Data term and neighbor-induced gradient terms
+      constexpr float data_term_factor = 2;
+      Vec3f gradient = data_term_factor * (smooth_position - measured_position) +
+                       Vec3f(surfels(kSurfelGradientX, surfel_index),
+                             surfels(kSurfelGradientY, surfel_index),
+                             surfels(kSurfelGradientZ, surfel_index));
+      
+      // Regularization gradient terms
+      int neighbor_count = 0;
+      Vec3f regularization_gradient = Vec3f::Zero();
+      for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+        u32 neighbor_surfel_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+        if (neighbor_surfel_index == kInvalidSurfelIndex) {
+          continue;
+        }
+        
+        ++ neighbor_count;
+        
+        Vec3f this_to_neighbor = surfels.smooth_position(neighbor_surfel_index) - smooth_position;
+        regularization_gradient -= normal.dot(this_to_neighbor) * normal;
+      }
+      
+      if (neighbor_count > 0) {
+        // Apply constant factor to regularization gradient term
+        float factor = 2 * regularizer_weight / neighbor_count;
+        gradient += factor * regularization_gradient;
+      }
+      
+      const float residual_terms_weight_sum = 1 + regularizer_weight + surfels(kSurfelGradientCount, surfel_index);
+      const float kStepSizeFactor = 0.5f / residual_terms_weight_sum;
+      
+      // Avoid divergence by limiting the step length to a multiple of the surfel
+      // radius (multiple with this factor here).
+      constexpr float kMaxStepLengthFactor = 1.0f;
+      float max_step_length = kMaxStepLengthFactor * sqrtf(surfels(kSurfelRadiusSquared, surfel_index));
+      float step_length = kStepSizeFactor * gradient.norm();
+      float step_factor = kStepSizeFactor;
+      if (step_length > max_step_length) {
+        step_factor = max_step_length / step_length * kStepSizeFactor;
+      }
+      
+      surfels(kSurfelGradientX, surfel_index) = smooth_position.x() - step_factor * gradient.x();
+      surfels(kSurfelGradientY, surfel_index) = smooth_position.y() - step_factor * gradient.y();
+      surfels(kSurfelGradientZ, surfel_index) = smooth_position.z() - step_factor * gradient.z();
+    }
+  });
+  
+  thread_pool->ParallelFor(0, surfel_count, kRegularizationBlockSize, [&](usize begin, usize end) {
+    for (u32 surfel_index = begin; surfel_index < end; ++ surfel_index) {
+      if (!IsSurfelInRegularizationWindow(surfels, surfel_index, frame_index, regularization_frame_window_size)) {
+        continue;
+      }
+      surfels(kSurfelSmoothX, surfel_index) = surfels(kSurfelGradientX, surfel_index);
+      surfels(kSurfelSmoothY, surfel_index) = surfels(kSurfelGradientY, surfel_index);
+      surfels(kSurfelSmoothZ, surfel_index) = surfels(kSurfelGradientZ, surfel_index);
+    }
+  });
+}
+
+void CPUSurfelRegularization::AccumulateNeighborGradients(
+    usize block_index,
+    u32 frame_index,
+    float radius_factor_for_regularization_neighbors_squared,
+    float regularizer_weight,
+    int regularization_frame_window_size,
+    u32 surfel_count,
+    const CPUSurfelBuffer& surfels) {
+  // Surfels in [near_begin, near_end) are only written by this block during
+  // the current colour.
+  const u32 block_begin = block_index * kRegularizationBlockSize;
+  const u32 block_end = std::min<usize>(surfel_count, block_begin + kRegularizationBlockSize);
+  const u32 near_begin = (block_index > 0) ? (block_begin - kRegularizationBlockSize) : 0;
+  const u32 near_end = std::min<usize>(surfel_count, block_end + kRegularizationBlockSize);
+  
+  vector<GradientContribution>* far_contributions = &far_contributions_[block_index];
+  far_contributions->clear();
+  
+  // See RegularizeSurfelsCUDAAccumulateNeighborGradientsKernel().
+  for (u32 surfel_index = block_begin; surfel_index < block_end; ++ surfel_index) {
+    // Count neighbors.
+    int neighbor_count = 0;
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      u32 neighbor_surfel_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+      if (neighbor_surfel_index != kInvalidSurfelIndex &&
+          IsSurfelInRegularizationWindow(surfels, neighbor_surfel_index, frame_index, regularization_frame_window_size)) {
+        ++ neighbor_count;
+      }
+    }
+    if (neighbor_count == 0) {
+      continue;
+    }
+    
+    Vec3f smooth_position = surfels.smooth_position(surfel_index);
+    Vec3f normal = surfels.normal(surfel_index);
+    const float surfel_radius_squared = surfels(kSurfelRadiusSquared, surfel_index);
+    
+    float factor = 2 * regularizer_weight / neighbor_count;
+    float gradient_count = regularizer_weight / neighbor_count;
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      u32 neighbor_surfel_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+      if (neighbor_surfel_index == kInvalidSurfelIndex ||
+          !IsSurfelInRegularizationWindow(surfels, neighbor_surfel_index, frame_index, regularization_frame_window_size)) {
+        continue;
+      }
+      
+      Vec3f this_to_neighbor = surfels.smooth_position(neighbor_surfel_index) - smooth_position;
+      float factor_times_normal_dot_difference = factor * normal.dot(this_to_neighbor);
+      
+      if (neighbor_surfel_index >= near_begin && neighbor_surfel_index < near_end) {
+        surfels(kSurfelGradientX, neighbor_surfel_index) += factor_times_normal_dot_difference * normal.x();
+        surfels(kSurfelGradientY, neighbor_surfel_index) += factor_times_normal_dot_difference * normal.y();
+        surfels(kSurfelGradientZ, neighbor_surfel_index) += factor_times_normal_dot_difference * normal.z();
+        surfels(kSurfelGradientCount, neighbor_surfel_index) += gradient_count;
+      } else {
+        GradientContribution contribution;
+        contribution.surfel_index = neighbor_surfel_index;
+        contribution.gradient_x = factor_times_normal_dot_difference * normal.x();
+        contribution.gradient_y = factor_times_normal_dot_difference * normal.y();
+        contribution.gradient_z = factor_times_normal_dot_difference * normal.z();
+        contribution.gradient_count = gradient_count;
+        far_contributions->push_back(contribution);
+      }
+      
+      // If the neighbor is too far away, remove it.
+      if (this_to_neighbor.squaredNorm() > radius_factor_for_regularization_neighbors_squared * surfel_radius_squared) {
+        surfels.SetU32(kSurfelNeighbor0 + n, surfel_index, kInvalidSurfelIndex);
+      }
+    }
+  }
+}
+
+}
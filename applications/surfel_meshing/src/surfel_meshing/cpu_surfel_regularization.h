@@ -0,0 +1,93 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <vector>
+
+#include <libvis/libvis.h>
+
+#include "surfel_meshing/cpu_surfel_buffer.h"
+#include "surfel_meshing/thread_pool.h"
+
+namespace vis {
+
+// Multi-threaded CPU implementation of the surfel regularization (see
+// RegularizeSurfelsCUDA()), which operates on surfels in the packed layout of
+// surfel_attributes.h using the kSurfelNeighbor0..3 entries as neighbor table.
+// 
+// The gradient accumulation step scatters contributions from each surfel into
+// its neighbors. To do this without atomics, the surfels are split into blocks
+// of consecutive indices which are processed in three colours: blocks b,
+// b + 3, b + 6, ... are processed in parallel and only write to their own and
+// the two adjacent blocks, such that no two threads write to the same surfel.
+// Since neighbors are mostly created from adjacent pixels, most neighbors are
+// within these blocks. Contributions to neighbors outside of them are stored
+// per block and added afterwards. The summation order thus only depends on the
+// neighbor table, such that the results do not depend on the thread count.
+class CPUSurfelRegularization {
+ public:
+  // Performs one regularization iteration on the first surfel_count surfels.
+  // If disable_denoising is true, the positions of the surfels within the
+  // regularization window are copied to their smooth positions instead.
+  // Invalidates neighbor entries which are too far away from the surfel, like
+  // the CUDA version.
+  void Regularize(
+      bool disable_denoising,
+      u32 frame_index,
+      float radius_factor_for_regularization_neighbors,
+      float regularizer_weight,
+      int regularization_frame_window_size,
+      u32 surfel_count,
+      const CPUSurfelBuffer& surfels,
+      ThreadPool* thread_pool);
+  
+ private:
+  struct GradientContribution {
+    u32 surfel_index;
+    float gradient_x;
+    float gradient_y;
+    float gradient_z;
+    float gradient_count;
+  };
+  
+  void AccumulateNeighborGradients(
+      usize block_index,
+      u32 frame_index,
+      float radius_factor_for_regularization_neighbors_squared,
+      float regularizer_weight,
+      int regularization_frame_window_size,
+      u32 surfel_count,
+      const CPUSurfelBuffer& surfels);
+  
+  // Contributions of each block to surfels outside of the adjacent blocks.
+  vector<vector<GradientContribution>> far_contributions_;
+};
+
+}
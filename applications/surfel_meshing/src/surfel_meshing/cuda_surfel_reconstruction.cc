@@ -40,6 +40,9 @@
 
 namespace vis {
 
+// Copy of Surfel::kInvalidIndex which can be passed by reference.
+constexpr u32 kInvalidSurfelIndex = Surfel::kInvalidIndex;
+
 CUDASurfelReconstruction::CUDASurfelReconstruction(
     usize max_surfel_count,
     const PinholeCamera4f& depth_camera,
@@ -73,6 +76,17 @@ CUDASurfelReconstruction::CUDASurfelReconstruction(
   new_surfels_temp_storage_ = nullptr;
   new_surfels_temp_storage_bytes_ = 0;
   
+  transferred_surfels_.reset(new CUDABuffer<float>(kTransferredSurfelAttributeCount, max_surfel_count));
+  changed_surfel_flags_.reset(new CUDABuffer<u8>(1, max_surfel_count));
+  changed_surfel_indices_.reset(new CUDABuffer<u32>(1, max_surfel_count));
+  changed_surfel_count_.reset(new CUDABuffer<u32>(1, 1));
+  changed_surfels_temp_storage_ = nullptr;
+  changed_surfels_temp_storage_bytes_ = 0;
+  transferred_surfel_count_ = 0;
+  
+  compaction_moves_.reset(new CUDABuffer<u32>(1, 2 * max_surfel_count));
+  compaction_tail_destinations_.reset(new CUDABuffer<u32>(1, max_surfel_count));
+  
   cudaEventCreate(&data_association_start_event_);
   cudaEventCreate(&data_association_end_event_);
   cudaEventCreate(&surfel_merging_start_event_);
@@ -91,6 +105,7 @@ CUDASurfelReconstruction::CUDASurfelReconstruction(
 
 CUDASurfelReconstruction::~CUDASurfelReconstruction() {
   cudaFree(new_surfels_temp_storage_);
+  cudaFree(changed_surfels_temp_storage_);
   
   cudaEventDestroy(data_association_start_event_);
   cudaEventDestroy(data_association_end_event_);
@@ -355,6 +370,108 @@ void CUDASurfelReconstruction::TransferAllToCPU(
   surfels_->DownloadPartAsync(kSurfelNormalZ * surfels_->ToCUDA().pitch(), surfel_count_ * sizeof(float), stream, buffer->surfel_normal_z_buffer);
   
   surfels_->DownloadPartAsync(kSurfelLastUpdateStamp * surfels_->ToCUDA().pitch(), surfel_count_ * sizeof(u32), stream, reinterpret_cast<float*>(buffer->surfel_last_update_stamp_buffer));
+  
+  // Determine the surfels which changed since the last transfer, such that the
+  // CPU side only needs to update those.
+  DetermineChangedSurfelsCUDA(
+      stream,
+      surfel_count_,
+      transferred_surfel_count_,
+      *surfels_,
+      transferred_surfels_.get(),
+      &changed_surfels_temp_storage_,
+      &changed_surfels_temp_storage_bytes_,
+      changed_surfel_flags_.get(),
+      changed_surfel_indices_.get(),
+      changed_surfel_count_.get());
+  transferred_surfel_count_ = surfel_count_;
+  
+  u32 changed_surfel_count;
+  changed_surfel_count_->DownloadAsync(stream, &changed_surfel_count);
+  cudaStreamSynchronize(stream);
+  changed_surfel_indices_cpu_.resize(changed_surfel_count);
+  if (changed_surfel_count > 0) {
+    changed_surfel_indices_->DownloadPartAsync(0, changed_surfel_count * sizeof(u32), stream, changed_surfel_indices_cpu_.data());
+    cudaStreamSynchronize(stream);
+  }
+  buffers->SetChangedSurfels(changed_surfel_indices_cpu_.data(), changed_surfel_count);
+  buffers->SetSurfelMoves(surfel_moves_.data(), surfel_moves_.size());
+  surfel_moves_.clear();
+}
+
+u32 CUDASurfelReconstruction::CompactSurfels(cudaStream_t stream, u32 max_moves, float min_merged_fraction) {
+  if (merge_count_ == 0 || merge_count_ < min_merged_fraction * surfel_count_) {
+    return 0;
+  }
+  
+  // Merged surfels are marked by a negative radius. Only this attribute is
+  // needed to plan the moves.
+  const u32 old_count = surfel_count_;
+  compaction_radii_squared_.resize(old_count);
+  surfels_->DownloadPartAsync(kSurfelRadiusSquared * surfels_->ToCUDA().pitch(), old_count * sizeof(float), stream, compaction_radii_squared_.data());
+  cudaStreamSynchronize(stream);
+  auto is_merged = [&](u32 surfel_index) {
+    return compaction_radii_squared_[surfel_index] < 0;
+  };
+  
+  // Pair the first merged entries with the last live surfels. The entries
+  // from new_count on are dropped afterwards.
+  const usize first_move = surfel_moves_.size();
+  u32 new_count = old_count;
+  u32 hole = 0;
+  while (true) {
+    while (new_count > 0 && is_merged(new_count - 1)) {
+      -- new_count;
+    }
+    if (surfel_moves_.size() - first_move >= max_moves) {
+      break;
+    }
+    while (hole < new_count && !is_merged(hole)) {
+      ++ hole;
+    }
+    if (hole >= new_count) {
+      break;
+    }
+    -- new_count;
+    surfel_moves_.emplace_back(new_count, hole);
+    ++ hole;
+  }
+  if (new_count == old_count) {
+    return 0;
+  }
+  
+  const u32 move_count = surfel_moves_.size() - first_move;
+  compaction_destinations_.assign(old_count - new_count, kInvalidSurfelIndex);
+  for (usize i = first_move; i < surfel_moves_.size(); ++ i) {
+    compaction_destinations_[surfel_moves_[i].from - new_count] = surfel_moves_[i].to;
+  }
+  
+  // The moves are uploaded as (from, to) pairs of u32.
+  static_assert(sizeof(SurfelMove) == 2 * sizeof(u32), "SurfelMove must consist of two u32");
+  if (move_count > 0) {
+    compaction_moves_->UploadPartAsync(0, move_count * sizeof(SurfelMove), stream, reinterpret_cast<const u32*>(surfel_moves_.data() + first_move));
+  }
+  compaction_tail_destinations_->UploadPartAsync(0, compaction_destinations_.size() * sizeof(u32), stream, compaction_destinations_.data());
+  
+  CompactSurfelsCUDA(
+      stream,
+      old_count,
+      new_count,
+      move_count,
+      *compaction_moves_,
+      *compaction_tail_destinations_,
+      transferred_surfel_count_,
+      surfels_.get(),
+      transferred_surfels_.get());
+  
+  // The host vectors are reused by the next call, so the uploads must be done.
+  cudaStreamSynchronize(stream);
+  
+  const u32 reclaimed_count = old_count - new_count;
+  transferred_surfel_count_ = std::min(transferred_surfel_count_, new_count);
+  merge_count_ -= reclaimed_count;
+  surfel_count_ = new_count;
+  return reclaimed_count;
 }
 
 void CUDASurfelReconstruction::UpdateVisualizationBuffers(
@@ -36,41 +36,21 @@
 
 #include <cub/block/block_reduce.cuh>
 #include <cub/device/device_scan.cuh>
+#include <cub/device/device_select.cuh>
+#include <cub/iterator/counting_input_iterator.cuh>
 #include <libvis/point_cloud.h>
 #include <math_constants.h>
 
 #include "surfel_meshing/cuda_matrix.cuh"
 #include "surfel_meshing/cuda_util.cuh"
 #include "surfel_meshing/surfel.h"
+#include "surfel_meshing/surfel_fusion_constants.h"
 
 // Uncomment this to run CUDA kernels sequentially for debugging.
 // #define CUDA_SEQUENTIAL_CHECKS
 
 namespace vis {
 
-// This threshold is not exposed as a program argument since I am not sure
-// whether any other value than 0 would be useful.
-constexpr float kSurfelNormalToViewingDirThreshold = 0;
-
-// For a surfel with a given radius, the observation radius can be up to this
-// factor worse (larger) while the observation is still integrated into the
-// surfel. Observations with larger radii than that are discarded.
-// TODO: Expose as a program argument?
-constexpr float kMaxObservationRadiusFactorForIntegration = 1.5f;
-
-// Not exposed as a program argument since it did not seem to work well.
-constexpr bool kCheckScaleCompatibilityForIntegration = false;
-
-// Not exposed as a program argument since disabling it might not make sense.
-constexpr bool kCheckScaleCompatibilityForNeighborAssignment = true;
-
-// If this is set to true, slightly occluded surfels will be protected better,
-// but the surfel integration will be unable to merge duplicate surfaces after
-// loop closures.
-constexpr bool kProtectSlightlyOccludedSurfels = false;
-constexpr float kOcclusionDepthFactor = 0.01f;
-
-
 __forceinline__ __device__ bool IsSurfelActiveForIntegration(
     u32 surfel_index,
     const CUDABuffer_<float>& surfels,
@@ -2626,6 +2606,216 @@ void ExportVerticesCUDA(
   CHECK_CUDA_NO_ERROR();
 }
 
+// Stores the value in the transferred_surfels row and returns whether it
+// differs from the previous value there. Compares the bits such that this works
+// for the u32 attributes as well.
+__forceinline__ __device__ bool UpdateTransferredSurfelAttribute(
+    int attribute,
+    int transferred_attribute,
+    unsigned int surfel_index,
+    const CUDABuffer_<float>& surfels,
+    CUDABuffer_<float>* transferred_surfels) {
+  float value = surfels(attribute, surfel_index);
+  float* transferred_value = &(*transferred_surfels)(transferred_attribute, surfel_index);
+  bool changed = __float_as_int(value) != __float_as_int(*transferred_value);
+  *transferred_value = value;
+  return changed;
+}
+
+__global__ void DetermineChangedSurfelsCUDAKernel(
+    u32 surfel_count,
+    u32 last_surfel_count,
+    CUDABuffer_<float> surfels,
+    CUDABuffer_<float> transferred_surfels,
+    u8* changed_surfel_flags) {
+  unsigned int surfel_index = blockIdx.x * blockDim.x + threadIdx.x;
+  
+  if (surfel_index < surfel_count) {
+    // Use | instead of || such that all values get updated.
+    bool changed = surfel_index >= last_surfel_count;
+    changed |= UpdateTransferredSurfelAttribute(kSurfelSmoothX, 0, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelSmoothY, 1, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelSmoothZ, 2, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelRadiusSquared, 3, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelNormalX, 4, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelNormalY, 5, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelNormalZ, 6, surfel_index, surfels, &transferred_surfels);
+    changed |= UpdateTransferredSurfelAttribute(kSurfelLastUpdateStamp, 7, surfel_index, surfels, &transferred_surfels);
+    changed_surfel_flags[surfel_index] = changed ? 1 : 0;
+  }
+}
+
+void DetermineChangedSurfelsCUDA(
+    cudaStream_t stream,
+    u32 surfel_count,
+    u32 last_surfel_count,
+    const CUDABuffer<float>& surfels,
+    CUDABuffer<float>* transferred_surfels,
+    void** changed_surfels_temp_storage,
+    usize* changed_surfels_temp_storage_bytes,
+    CUDABuffer<u8>* changed_surfel_flags,
+    CUDABuffer<u32>* changed_surfel_indices,
+    CUDABuffer<u32>* changed_surfel_count) {
+  #ifdef CUDA_SEQUENTIAL_CHECKS
+    cudaDeviceSynchronize();
+  #endif
+  CHECK_CUDA_NO_ERROR();
+  
+  if (surfel_count == 0) {
+    changed_surfel_count->Clear(0, stream);
+    return;
+  }
+  
+  constexpr int kBlockWidth = 1024;
+  dim3 grid_dim(GetBlockCount(surfel_count, kBlockWidth));
+  dim3 block_dim(kBlockWidth);
+  
+  DetermineChangedSurfelsCUDAKernel
+  <<<grid_dim, block_dim, 0, stream>>>(
+      surfel_count,
+      last_surfel_count,
+      surfels.ToCUDA(),
+      transferred_surfels->ToCUDA(),
+      changed_surfel_flags->ToCUDA().address());
+  #ifdef CUDA_SEQUENTIAL_CHECKS
+    cudaDeviceSynchronize();
+  #endif
+  CHECK_CUDA_NO_ERROR();
+  
+  // Compact the indices of the changed surfels with CUB. The temporary storage
+  // is allocated for the maximum surfel count on the first call.
+  cub::CountingInputIterator<u32> surfel_index_iterator(0);
+  if (*changed_surfels_temp_storage_bytes == 0) {
+    cub::DeviceSelect::Flagged(
+        *changed_surfels_temp_storage,
+        *changed_surfels_temp_storage_bytes,
+        surfel_index_iterator,
+        changed_surfel_flags->ToCUDA().address(),
+        changed_surfel_indices->ToCUDA().address(),
+        changed_surfel_count->ToCUDA().address(),
+        changed_surfel_flags->width(),
+        stream);
+    
+    cudaMalloc(changed_surfels_temp_storage, *changed_surfels_temp_storage_bytes);
+  }
+  
+  cub::DeviceSelect::Flagged(
+      *changed_surfels_temp_storage,
+      *changed_surfels_temp_storage_bytes,
+      surfel_index_iterator,
+      changed_surfel_flags->ToCUDA().address(),
+      changed_surfel_indices->ToCUDA().address(),
+      changed_surfel_count->ToCUDA().address(),
+      surfel_count,
+      stream);
+  #ifdef CUDA_SEQUENTIAL_CHECKS
+    cudaDeviceSynchronize();
+  #endif
+  CHECK_CUDA_NO_ERROR();
+}
+
+__global__ void CompactSurfelsCUDARemapNeighborsKernel(
+    u32 old_surfel_count,
+    u32 new_surfel_count,
+    const u32* tail_destinations,
+    CUDABuffer_<float> surfels) {
+  unsigned int surfel_index = blockIdx.x * blockDim.x + threadIdx.x;
+  
+  if (surfel_index < old_surfel_count && surfels(kSurfelRadiusSquared, surfel_index) >= 0) {
+    for (int direction = 0; direction < kSurfelNeighborCount; ++ direction) {
+      u32* neighbor_index = reinterpret_cast<u32*>(&surfels(kSurfelNeighbor0 + direction, surfel_index));
+      if (*neighbor_index == Surfel::kInvalidIndex) {
+        continue;
+      }
+      if (*neighbor_index >= new_surfel_count) {
+        *neighbor_index = tail_destinations[*neighbor_index - new_surfel_count];
+      } else if (surfels(kSurfelRadiusSquared, *neighbor_index) < 0) {
+        *neighbor_index = Surfel::kInvalidIndex;
+      }
+    }
+  }
+}
+
+__global__ void CompactSurfelsCUDAMoveKernel(
+    u32 move_count,
+    const u32* moves,
+    u32 transferred_surfel_count,
+    CUDABuffer_<float> surfels,
+    CUDABuffer_<float> transferred_surfels) {
+  unsigned int move_index = blockIdx.x * blockDim.x + threadIdx.x;
+  
+  if (move_index < move_count) {
+    u32 from = moves[2 * move_index + 0];
+    u32 to = moves[2 * move_index + 1];
+    
+    for (int attribute = 0; attribute < kSurfelAttributeCount; ++ attribute) {
+      surfels(attribute, to) = surfels(attribute, from);
+    }
+    
+    // Keep the values as of the last transfer with the surfel, such that it is
+    // only reported as changed if it did change. If it was not transferred yet,
+    // make the comparison in DetermineChangedSurfelsCUDAKernel() fail for its
+    // new entry.
+    if (from < transferred_surfel_count) {
+      for (int attribute = 0; attribute < kTransferredSurfelAttributeCount; ++ attribute) {
+        transferred_surfels(attribute, to) = transferred_surfels(attribute, from);
+      }
+    } else if (to < transferred_surfel_count) {
+      transferred_surfels(0, to) = __int_as_float(~__float_as_int(surfels(kSurfelSmoothX, to)));
+    }
+  }
+}
+
+void CompactSurfelsCUDA(
+    cudaStream_t stream,
+    u32 old_surfel_count,
+    u32 new_surfel_count,
+    u32 move_count,
+    const CUDABuffer<u32>& moves,
+    const CUDABuffer<u32>& tail_destinations,
+    u32 transferred_surfel_count,
+    CUDABuffer<float>* surfels,
+    CUDABuffer<float>* transferred_surfels) {
+  #ifdef CUDA_SEQUENTIAL_CHECKS
+    cudaDeviceSynchronize();
+  #endif
+  CHECK_CUDA_NO_ERROR();
+  
+  constexpr int kBlockWidth = 1024;
+  dim3 block_dim(kBlockWidth);
+  
+  // The neighbors must be remapped before the moves, since afterwards the
+  // filled entries cannot be told apart from the merged ones anymore.
+  dim3 remap_grid_dim(GetBlockCount(old_surfel_count, kBlockWidth));
+  CompactSurfelsCUDARemapNeighborsKernel
+  <<<remap_grid_dim, block_dim, 0, stream>>>(
+      old_surfel_count,
+      new_surfel_count,
+      tail_destinations.ToCUDA().address(),
+      surfels->ToCUDA());
+  #ifdef CUDA_SEQUENTIAL_CHECKS
+    cudaDeviceSynchronize();
+  #endif
+  CHECK_CUDA_NO_ERROR();
+  
+  if (move_count == 0) {
+    return;
+  }
+  
+  dim3 move_grid_dim(GetBlockCount(move_count, kBlockWidth));
+  CompactSurfelsCUDAMoveKernel
+  <<<move_grid_dim, block_dim, 0, stream>>>(
+      move_count,
+      moves.ToCUDA().address(),
+      transferred_surfel_count,
+      surfels->ToCUDA(),
+      transferred_surfels->ToCUDA());
+  #ifdef CUDA_SEQUENTIAL_CHECKS
+    cudaDeviceSynchronize();
+  #endif
+  CHECK_CUDA_NO_ERROR();
+}
+
 __global__ void DebugPrintSurfelCUDAKernel(
     usize surfel_index,
     CUDABuffer_<float> surfels) {
@@ -38,49 +38,9 @@
 
 #include <libvis/cuda/cuda_buffer.h>
 
-namespace vis {
-
-// The surfel structure is stored in a large buffer. It is organized
-// such that each row stores one attribute and each column stores the
-// attribute values for one surfel.
-
-// TODO: The attributes are quite wasteful memory-wise. I would guess that some
-//       attributes could be packed without any apparent negative consequences.
-//       For example, the normals could be stored with (much) less precision,
-//       perhaps 10 bit per component to fit into a 32 bit value?
-
-// float attributes:
-constexpr int kSurfelX = 0;
-constexpr int kSurfelY = 1;
-constexpr int kSurfelZ = 2;
-constexpr int kSurfelSmoothX = 3;
-constexpr int kSurfelSmoothY = 4;
-constexpr int kSurfelSmoothZ = 5;
-constexpr int kSurfelConfidence = 6;
-constexpr int kSurfelRadiusSquared = 7;
-constexpr int kSurfelNormalX = 8;
-constexpr int kSurfelNormalY = 9;
-constexpr int kSurfelNormalZ = 10;
-constexpr int kSurfelGradientX = 11;
-constexpr int kSurfelGradientY = 12;
-constexpr int kSurfelGradientZ = 13;
-constexpr int kSurfelAccumX = 14;
-constexpr int kSurfelAccumY = 15;
-constexpr int kSurfelAccumZ = 16;
-
-// u32 attributes:
-constexpr int kSurfelCreationStamp = 17;
-constexpr int kSurfelLastUpdateStamp = 18;
-constexpr int kSurfelNeighbor0 = 19;  // and 20, 21, 22 for the other neighbors.
-// (not an attribute itself):
-constexpr int kSurfelNeighborCount = 4;
-constexpr int kSurfelGradientCount = 23;
-
-// Vec4u8 attributes:
-constexpr int kSurfelColor = 24;  // (r, g, b, neighbor detach request flag)
-
-constexpr int kSurfelAttributeCount = 25;
+#include "surfel_meshing/surfel_attributes.h"
 
+namespace vis {
 
 void CreateNewSurfelsCUDA(
     cudaStream_t stream,
@@ -250,6 +210,43 @@ void ExportVerticesCUDA(
     CUDABuffer<float>* position_buffer,
     CUDABuffer<u8>* color_buffer);
 
+// Compares the surfel attributes which are transferred to the CPU with their
+// values stored in transferred_surfels at the previous call, and updates the
+// stored values. Surfels with index >= last_surfel_count are treated as
+// changed. Writes the indices of the changed surfels in increasing order to
+// changed_surfel_indices and their number to changed_surfel_count (both in
+// device memory).
+void DetermineChangedSurfelsCUDA(
+    cudaStream_t stream,
+    u32 surfel_count,
+    u32 last_surfel_count,
+    const CUDABuffer<float>& surfels,
+    CUDABuffer<float>* transferred_surfels,
+    void** changed_surfels_temp_storage,
+    usize* changed_surfels_temp_storage_bytes,
+    CUDABuffer<u8>* changed_surfel_flags,
+    CUDABuffer<u32>* changed_surfel_indices,
+    CUDABuffer<u32>* changed_surfel_count);
+
+// Applies the surfel moves planned by CUDASurfelReconstruction::CompactSurfels().
+// First remaps the neighbor indices of all non-merged surfels in
+// [0, old_surfel_count): indices >= new_surfel_count are looked up in
+// tail_destinations, and indices of merged surfels become Surfel::kInvalidIndex.
+// Then copies all attributes for each (from, to) pair in moves. The entries
+// of transferred_surfels below transferred_surfel_count are updated such that
+// DetermineChangedSurfelsCUDA() reports exactly the moved surfels which did
+// change, or were not transferred before.
+void CompactSurfelsCUDA(
+    cudaStream_t stream,
+    u32 old_surfel_count,
+    u32 new_surfel_count,
+    u32 move_count,
+    const CUDABuffer<u32>& moves,
+    const CUDABuffer<u32>& tail_destinations,
+    u32 transferred_surfel_count,
+    CUDABuffer<float>* surfels,
+    CUDABuffer<float>* transferred_surfels);
+
 void DebugPrintSurfelCUDA(
     cudaStream_t stream,
     usize surfel_index,
@@ -86,13 +86,26 @@ class CUDASurfelReconstruction {
       float radius_factor_for_regularization_neighbors,
       int regularization_frame_window_size);
   
-  // Transfers all surfels to the CPU. The "buffers" object must be locked with
-  // LockWriteBuffers() when this is called.
+  // Transfers all surfels into the write buffers of the "buffers" object on
+  // the CPU, which must be published with CUDASurfelsCPU::PublishWriteBuffers()
+  // afterwards. Also determines which surfels changed since the previous
+  // transfer and passes their indices to CUDASurfelsCPU::SetChangedSurfels(),
+  // and passes the moves done by CompactSurfels() since then to
+  // CUDASurfelsCPU::SetSurfelMoves().
   void TransferAllToCPU(
       cudaStream_t stream,
       u32 frame_index,
       CUDASurfelsCPU* buffers);
   
+  // Fills the entries of merged surfels with up to max_moves surfels from the
+  // end of the surfel buffer and shrinks it accordingly, in the same way as
+  // CPUSurfelReconstruction::CompactSurfels(). Does nothing unless merged
+  // surfels make up at least min_merged_fraction of the used entries. The
+  // moves are planned on the CPU from a download of the surfel radii, which
+  // synchronizes the stream, and are then applied on the GPU. Returns the
+  // number of entries that were reclaimed.
+  u32 CompactSurfels(cudaStream_t stream, u32 max_moves, float min_merged_fraction);
+  
   // Updates the visualization (vertex, index) buffers based on the surfels.
   void UpdateVisualizationBuffers(
       cudaStream_t stream,
@@ -146,6 +159,25 @@ private:
   void* new_surfels_temp_storage_;
   usize new_surfels_temp_storage_bytes_;
   
+  // Surfel attribute values as of the last transfer to the CPU, and buffers
+  // for determining the changed surfels.
+  CUDABufferPtr<float> transferred_surfels_;
+  CUDABufferPtr<u8> changed_surfel_flags_;
+  CUDABufferPtr<u32> changed_surfel_indices_;
+  CUDABufferPtr<u32> changed_surfel_count_;
+  void* changed_surfels_temp_storage_;
+  usize changed_surfels_temp_storage_bytes_;
+  u32 transferred_surfel_count_;
+  vector<u32> changed_surfel_indices_cpu_;
+  
+  // Surfel moves done by CompactSurfels() since the last transfer, and buffers
+  // for planning them on the CPU and applying them on the GPU.
+  vector<SurfelMove> surfel_moves_;
+  vector<float> compaction_radii_squared_;
+  vector<u32> compaction_destinations_;
+  CUDABufferPtr<u32> compaction_moves_;
+  CUDABufferPtr<u32> compaction_tail_destinations_;
+  
   u32 surfel_count_;
   u32 merge_count_;
   usize max_surfel_count_;
@@ -29,13 +29,65 @@
 
 #pragma once
 
-#include <mutex>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <iterator>
+#include <unordered_map>
+#include <vector>
 
+#include <glog/logging.h>
 #include <libvis/eigen.h>
 #include <libvis/libvis.h>
 
 namespace vis {
 
+// Describes that the surfel in the entry with index from was moved to the
+// entry with index to, as done when compacting the surfel buffer. The previous
+// surfel in the entry to (a merged one) is overwritten. The entry from is not
+// used afterwards, unless another surfel is moved into it later.
+struct SurfelMove {
+  inline SurfelMove() {}
+  
+  inline SurfelMove(u32 from_, u32 to_)
+      : from(from_), to(to_) {}
+  
+  u32 from;
+  u32 to;
+};
+
+// Refers to the surfel moves of one published snapshot within a list of moves
+// of several snapshots: those moves end before the index end in the list.
+struct SurfelMoveBatch {
+  inline SurfelMoveBatch() {}
+  
+  inline SurfelMoveBatch(u64 sequence_number_, usize end_)
+      : sequence_number(sequence_number_), end(end_) {}
+  
+  u64 sequence_number;
+  usize end;
+};
+
+// Value used by ComposeSurfelMoves() for entries which were vacated.
+constexpr u32 kVacatedSurfelEntry = std::numeric_limits<u32>::max();
+
+// Determines the combined effect of a sequence of surfel moves. For each entry
+// which is involved in the moves, *original_entries maps its index to the index
+// of the entry which the surfel in it had before the moves, or to
+// kVacatedSurfelEntry if the entry does not contain a moved surfel afterwards.
+inline void ComposeSurfelMoves(
+    const std::vector<SurfelMove>& moves,
+    std::unordered_map<u32, u32>* original_entries) {
+  original_entries->clear();
+  for (const SurfelMove& move : moves) {
+    auto it = original_entries->find(move.from);
+    u32 original_entry = (it == original_entries->end()) ? move.from : it->second;
+    (*original_entries)[move.to] = original_entry;
+    (*original_entries)[move.from] = kVacatedSurfelEntry;
+  }
+}
+
 // Contains CPU buffers for surfel attributes.
 struct CUDASurfelBuffersCPU {
   CUDASurfelBuffersCPU(usize max_surfel_count) {
@@ -47,6 +99,8 @@ struct CUDASurfelBuffersCPU {
     surfel_normal_y_buffer = new float[max_surfel_count];
     surfel_normal_z_buffer = new float[max_surfel_count];
     surfel_last_update_stamp_buffer = new u32[max_surfel_count];
+    all_surfels_changed = true;
+    sequence_number = 0;
   }
   
   ~CUDASurfelBuffersCPU() {
@@ -70,57 +124,343 @@ struct CUDASurfelBuffersCPU {
   float* surfel_normal_y_buffer;
   float* surfel_normal_z_buffer;
   u32* surfel_last_update_stamp_buffer;
+  
+  // If false, changed_surfel_indices lists (in increasing order) the indices of
+  // all surfels whose attributes may differ from the buffers that the read side
+  // received last. Surfels with other indices below that previous surfel_count
+  // are unchanged. If true, all surfels must be assumed to have changed.
+  bool all_surfels_changed;
+  std::vector<u32> changed_surfel_indices;
+  
+  // The surfel moves (see SurfelMove) which were done since the buffers that
+  // the read side received last, in the order in which they were done. The
+  // surfel_count, the attributes, and changed_surfel_indices refer to the
+  // entries after these moves.
+  std::vector<SurfelMove> surfel_moves;
+  
+  // Splits surfel_moves into the moves of the individual snapshots, in the
+  // order of their sequence numbers. Set by CUDASurfelsCPU::PublishWriteBuffers()
+  // and only used within CUDASurfelsCPU.
+  std::vector<SurfelMoveBatch> surfel_move_batches;
+  
+  // Set by CUDASurfelsCPU::PublishWriteBuffers(): the number of the snapshot
+  // (starting from 1) and the time at which it was published.
+  u64 sequence_number;
+  chrono::steady_clock::time_point publish_time;
 };
 
 
-// Holds two sets of buffers:
-// - The write buffers are locked by the CUDA integration thread while
-//   transferring data into them.
-// - The triangulation thread locks the write buffers and exchanges the pointers
-//   to then get lock-free access to the read buffers afterwards.
+// Hands the surfels over from the surfel reconstruction (the write side) to the
+// meshing (the read side), which usually run in different threads. Three sets
+// of buffers are used as a lock-free triple buffer: the write side owns the
+// write buffers and the read side owns the read buffers, while the third set
+// holds the latest published snapshot. Publishing exchanges the write buffers
+// with the latest snapshot, and acquiring exchanges the read buffers with it,
+// such that neither side ever waits for the other. If a snapshot is published
+// before the read side acquired the previous one, the previous one is
+// superseded (dropped). The lists of changed surfels of dropped snapshots are
+// merged into the following snapshots, such that they always refer to the
+// snapshot that the read side acquired last.
 // 
-// NOTE: For synchronous meshing mode, memory could be saved by allocating one set of buffers only.
+// Usage on the write side: write to write_buffers(), call SetChangedSurfels()
+// and SetSurfelMoves() (both optional), then call PublishWriteBuffers(). Usage
+// on the read side: call AcquireLatestBuffers(), then read from
+// read_buffers().
 class CUDASurfelsCPU {
  friend class CUDASurfelReconstruction;
  friend class SurfelMeshing;
  public:
   CUDASurfelsCPU(usize max_surfel_count)
-      : write_buffers_(new CUDASurfelBuffersCPU(max_surfel_count)),
-        read_buffers_(new CUDASurfelBuffersCPU(max_surfel_count)) {
-    debug_wrote_data_ = false;
+      : write_index_(0),
+        latest_(1),
+        read_index_(2),
+        write_changes_set_(false),
+        write_moves_set_(false),
+        next_sequence_number_(1),
+        acquired_sequence_number_(0),
+        published_count_(0),
+        dropped_count_(0),
+        acquired_count_(0),
+        handoff_latency_total_ns_(0),
+        handoff_latency_max_ns_(0) {
+    for (int i = 0; i < 3; ++ i) {
+      buffers_[i] = new CUDASurfelBuffersCPU(max_surfel_count);
+    }
   }
   
   ~CUDASurfelsCPU() {
-    delete write_buffers_;
-    delete read_buffers_;
+    for (int i = 0; i < 3; ++ i) {
+      delete buffers_[i];
+    }
   }
   
-  void LockWriteBuffers() {
-    write_buffers_lock_.lock();
+  // Sets the indices (in increasing order) of the surfels which changed in the
+  // write buffers since the previous call to PublishWriteBuffers(). Must be
+  // called before PublishWriteBuffers(). If it is not called, all surfels are
+  // assumed to have changed.
+  void SetChangedSurfels(const u32* indices, usize count) {
+    CUDASurfelBuffersCPU* buffer = buffers_[write_index_];
+    buffer->all_surfels_changed = false;
+    buffer->changed_surfel_indices.assign(indices, indices + count);
+    write_changes_set_ = true;
+  }
+  
+  // Marks all surfels in the write buffers as changed. This is also the
+  // default if SetChangedSurfels() is not called.
+  void SetAllSurfelsChanged() {
+    write_changes_set_ = false;
+  }
+  
+  // Sets the surfel moves which were done since the previous call to
+  // PublishWriteBuffers(), in the order in which they were done. Must be
+  // called before PublishWriteBuffers(). If it is not called, no surfels were
+  // moved. The changed surfels refer to the entries after the moves; the moved
+  // surfels do not need to be listed as changed unless their attributes
+  // changed as well.
+  void SetSurfelMoves(const SurfelMove* moves, usize count) {
+    buffers_[write_index_]->surfel_moves.assign(moves, moves + count);
+    write_moves_set_ = true;
+  }
+  
+  // Publishes the write buffers as the latest snapshot, which supersedes the
+  // previous snapshot if the read side did not acquire that yet. Afterwards,
+  // write_buffers() returns other buffers (whose contents are outdated). Never
+  // waits for the read side.
+  void PublishWriteBuffers() {
+    CUDASurfelBuffersCPU* buffer = buffers_[write_index_];
+    if (!write_changes_set_) {
+      buffer->all_surfels_changed = true;
+      buffer->changed_surfel_indices.clear();
+    }
+    write_changes_set_ = false;
+    if (!write_moves_set_) {
+      buffer->surfel_moves.clear();
+    }
+    write_moves_set_ = false;
+    
+    // Remember the changes of this snapshot, and add the changes of the
+    // previous snapshots which the read side may not have acquired. The
+    // changed surfels of the previous snapshots are kept up to date with the
+    // surfel moves, such that they always refer to the latest entries.
+    u64 acquired_sequence_number = acquired_sequence_number_.load(std::memory_order_acquire);
+    while (!pending_changes_.empty() &&
+           pending_changes_.front().sequence_number <= acquired_sequence_number) {
+      pending_changes_.pop_front();
+    }
+    if (!buffer->surfel_moves.empty()) {
+      for (PendingChanges& changes : pending_changes_) {
+        if (!changes.all_surfels_changed) {
+          MoveIndices(buffer->surfel_moves, buffer->surfel_count, &changes.indices);
+        }
+      }
+    }
+    pending_changes_.emplace_back();
+    PendingChanges* changes = &pending_changes_.back();
+    changes->sequence_number = next_sequence_number_;
+    changes->all_surfels_changed = buffer->all_surfels_changed;
+    changes->indices = buffer->changed_surfel_indices;
+    changes->moves = buffer->surfel_moves;
+    for (usize i = 0; i + 1 < pending_changes_.size() && !buffer->all_surfels_changed; ++ i) {
+      if (pending_changes_[i].all_surfels_changed) {
+        buffer->all_surfels_changed = true;
+        buffer->changed_surfel_indices.clear();
+      } else {
+        MergeIndices(pending_changes_[i].indices, &buffer->changed_surfel_indices);
+      }
+    }
+    
+    // The read side must also do the surfel moves of the previous snapshots.
+    usize previous_move_count = 0;
+    for (usize i = 0; i + 1 < pending_changes_.size(); ++ i) {
+      previous_move_count += pending_changes_[i].moves.size();
+    }
+    if (previous_move_count > 0) {
+      buffer->surfel_moves.clear();
+      for (const PendingChanges& pending : pending_changes_) {
+        buffer->surfel_moves.insert(buffer->surfel_moves.end(), pending.moves.begin(), pending.moves.end());
+      }
+    }
+    
+    // The read side may acquire the previous snapshot while this one is being
+    // prepared, in which case it must not do its moves again. Label the moves
+    // with their snapshots, such that AcquireLatestBuffers() can drop them.
+    buffer->surfel_move_batches.clear();
+    usize move_end = 0;
+    for (const PendingChanges& pending : pending_changes_) {
+      move_end += pending.moves.size();
+      buffer->surfel_move_batches.emplace_back(pending.sequence_number, move_end);
+    }
+    
+    // If the read side does not keep up, merge the oldest entries to bound the
+    // history. The merged entry is kept until its newer snapshot was acquired,
+    // which may only cause some unchanged surfels to be listed. The moves keep
+    // the newer sequence number, which is safe since the read side can only
+    // acquire the latest snapshot meanwhile, which is never merged here.
+    constexpr usize kMaxPendingChanges = 4;
+    if (pending_changes_.size() > kMaxPendingChanges) {
+      PendingChanges* oldest = &pending_changes_[0];
+      PendingChanges* second = &pending_changes_[1];
+      second->all_surfels_changed |= oldest->all_surfels_changed;
+      if (second->all_surfels_changed) {
+        second->indices.clear();
+      } else {
+        MergeIndices(oldest->indices, &second->indices);
+      }
+      second->moves.insert(second->moves.begin(), oldest->moves.begin(), oldest->moves.end());
+      pending_changes_.pop_front();
+    }
+    
+    buffer->sequence_number = next_sequence_number_;
+    buffer->publish_time = chrono::steady_clock::now();
+    ++ next_sequence_number_;
+    
+    u8 previous_latest = latest_.exchange(write_index_ | kFreshBit, std::memory_order_acq_rel);
+    write_index_ = previous_latest & kIndexMask;
+    published_count_.fetch_add(1, std::memory_order_relaxed);
+    if (previous_latest & kFreshBit) {
+      dropped_count_.fetch_add(1, std::memory_order_relaxed);
+    }
   }
   
-  void UnlockWriteBuffers() {
-    debug_wrote_data_ = true;
-    write_buffers_lock_.unlock();
+  // Returns whether a snapshot was published which the read side did not
+  // acquire yet. May be called from any thread.
+  inline bool has_new_snapshot() const {
+    return latest_.load(std::memory_order_acquire) & kFreshBit;
   }
   
-  void WaitForLockAndSwapBuffers() {
-    unique_lock<mutex> lock(write_buffers_lock_);
-    if (!debug_wrote_data_) {
-      LOG(FATAL) << "Trying to swap the CUDASurfelsCPU buffers, but no data was written. Possible multi-threading bug!";
+  // Makes the latest published snapshot available in read_buffers(). Returns
+  // false (and leaves the read buffers unchanged) if no new snapshot was
+  // published since the last call. Never waits for the write side.
+  bool AcquireLatestBuffers() {
+    if (!has_new_snapshot()) {
+      return false;
     }
-    std::swap(write_buffers_, read_buffers_);
-    debug_wrote_data_ = false;
+    u8 previous_latest = latest_.exchange(read_index_, std::memory_order_acq_rel);
+    read_index_ = previous_latest & kIndexMask;
+    
+    // Drop the surfel moves of snapshots that were acquired before (see
+    // PublishWriteBuffers()).
+    CUDASurfelBuffersCPU* buffer = buffers_[read_index_];
+    u64 previous_sequence_number = acquired_sequence_number_.load(std::memory_order_relaxed);
+    usize received_move_count = 0;
+    usize received_batch_count = 0;
+    for (const SurfelMoveBatch& batch : buffer->surfel_move_batches) {
+      if (batch.sequence_number > previous_sequence_number) {
+        break;
+      }
+      received_move_count = batch.end;
+      ++ received_batch_count;
+    }
+    if (received_batch_count > 0) {
+      buffer->surfel_moves.erase(buffer->surfel_moves.begin(), buffer->surfel_moves.begin() + received_move_count);
+      buffer->surfel_move_batches.erase(buffer->surfel_move_batches.begin(), buffer->surfel_move_batches.begin() + received_batch_count);
+      for (SurfelMoveBatch& batch : buffer->surfel_move_batches) {
+        batch.end -= received_move_count;
+      }
+    }
+    
+    acquired_sequence_number_.store(buffer->sequence_number, std::memory_order_release);
+    
+    u64 latency_ns = chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now() - buffer->publish_time).count();
+    handoff_latency_total_ns_.fetch_add(latency_ns, std::memory_order_relaxed);
+    if (latency_ns > handoff_latency_max_ns_.load(std::memory_order_relaxed)) {
+      handoff_latency_max_ns_.store(latency_ns, std::memory_order_relaxed);
+    }
+    acquired_count_.fetch_add(1, std::memory_order_relaxed);
+    return true;
   }
   
-  CUDASurfelBuffersCPU* write_buffers() { return write_buffers_; }
-  const CUDASurfelBuffersCPU& read_buffers() const { return *read_buffers_; }
+  // Returns the buffers owned by the write side.
+  CUDASurfelBuffersCPU* write_buffers() { return buffers_[write_index_]; }
+  
+  // Returns the buffers owned by the read side, which contain the snapshot
+  // acquired last.
+  const CUDASurfelBuffersCPU& read_buffers() const { return *buffers_[read_index_]; }
+  
+  // Statistics, which may be read from any thread.
+  inline u64 published_snapshot_count() const { return published_count_.load(std::memory_order_relaxed); }
+  inline u64 dropped_snapshot_count() const { return dropped_count_.load(std::memory_order_relaxed); }
+  inline u64 acquired_snapshot_count() const { return acquired_count_.load(std::memory_order_relaxed); }
+  
+  // Returns the mean and maximum time between publishing and acquiring the
+  // acquired snapshots, in milliseconds.
+  inline double mean_handoff_latency_ms() const {
+    u64 count = acquired_snapshot_count();
+    return (count == 0) ? 0 : (1e-6 * handoff_latency_total_ns_.load(std::memory_order_relaxed) / count);
+  }
+  inline double max_handoff_latency_ms() const {
+    return 1e-6 * handoff_latency_max_ns_.load(std::memory_order_relaxed);
+  }
   
  private:
-  bool debug_wrote_data_;
-  std::mutex write_buffers_lock_;
-  CUDASurfelBuffersCPU* write_buffers_;
-  CUDASurfelBuffersCPU* read_buffers_;
+  struct PendingChanges {
+    u64 sequence_number;
+    bool all_surfels_changed;
+    std::vector<u32> indices;
+    std::vector<SurfelMove> moves;
+  };
+  
+  // Updates the increasing list of changed surfel indices for the given surfel
+  // moves: the surfels which were moved are listed with their new indices
+  // (additionally to their old ones, which is not necessary, but harmless).
+  // Indices which are not below the new surfel_count are dropped.
+  void MoveIndices(const std::vector<SurfelMove>& moves, usize surfel_count, std::vector<u32>* indices) {
+    ComposeSurfelMoves(moves, &original_entries_);
+    moved_indices_.clear();
+    for (const std::pair<const u32, u32>& entry : original_entries_) {
+      if (entry.second != kVacatedSurfelEntry && entry.first < surfel_count &&
+          std::binary_search(indices->begin(), indices->end(), entry.second)) {
+        moved_indices_.push_back(entry.first);
+      }
+    }
+    indices->erase(std::lower_bound(indices->begin(), indices->end(), surfel_count), indices->end());
+    if (!moved_indices_.empty()) {
+      std::sort(moved_indices_.begin(), moved_indices_.end());
+      MergeIndices(moved_indices_, indices);
+    }
+  }
+  
+  // Sets *indices to the union of the two increasing index lists.
+  void MergeIndices(const std::vector<u32>& other, std::vector<u32>* indices) {
+    merged_indices_.clear();
+    std::set_union(indices->begin(), indices->end(),
+                   other.begin(), other.end(),
+                   std::back_inserter(merged_indices_));
+    indices->swap(merged_indices_);
+  }
+  
+  // The latest_ value consists of a buffer index and a flag which is set while
+  // the snapshot in these buffers was not acquired yet.
+  static constexpr u8 kIndexMask = 3;
+  static constexpr u8 kFreshBit = 4;
+  
+  CUDASurfelBuffersCPU* buffers_[3];
+  
+  // Only accessed by the write side.
+  u8 write_index_;
+  // Shared between both sides.
+  std::atomic<u8> latest_;
+  // Only accessed by the read side.
+  u8 read_index_;
+  
+  // Write side state for the lists of changed surfels and surfel moves.
+  bool write_changes_set_;
+  bool write_moves_set_;
+  u64 next_sequence_number_;
+  std::deque<PendingChanges> pending_changes_;
+  std::vector<u32> merged_indices_;
+  std::vector<u32> moved_indices_;
+  std::unordered_map<u32, u32> original_entries_;
+  
+  // Sequence number of the snapshot which the read side acquired last.
+  std::atomic<u64> acquired_sequence_number_;
+  
+  std::atomic<u64> published_count_;
+  std::atomic<u64> dropped_count_;
+  std::atomic<u64> acquired_count_;
+  std::atomic<u64> handoff_latency_total_ns_;
+  std::atomic<u64> handoff_latency_max_ns_;
 };
 
 }
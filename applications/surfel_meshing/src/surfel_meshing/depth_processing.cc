@@ -0,0 +1,903 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "surfel_meshing/depth_processing.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+namespace vis {
+
+namespace {
+
+// Number of image rows which are processed by a thread at a time.
+constexpr int kRowsPerBand = 8;
+
+// Calls process_rows(y_begin, y_end) for all bands of kRowsPerBand rows of an
+// image with the given height. The bands are distributed dynamically over
+// thread_count threads (including the calling thread).
+template <typename ProcessRows>
+void ParallelForRowBands(int height, int thread_count, const ProcessRows& process_rows) {
+  int band_count = (height + kRowsPerBand - 1) / kRowsPerBand;
+  std::atomic<int> next_band(0);
+  
+  auto process_bands = [&]() {
+    while (true) {
+      int band = next_band++;
+      if (band >= band_count) {
+        break;
+      }
+      int y_begin = band * kRowsPerBand;
+      process_rows(y_begin, std::min(y_begin + kRowsPerBand, height));
+    }
+  };
+  
+  int additional_thread_count = std::max(0, std::min(thread_count, band_count) - 1);
+  std::vector<std::thread> threads;
+  threads.reserve(additional_thread_count);
+  for (int t = 0; t < additional_thread_count; ++ t) {
+    threads.emplace_back(process_bands);
+  }
+  process_bands();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+// Unprojection intrinsics for the pixel center convention, computed like in
+// cuda_depth_processing.cu.
+struct UnprojectionIntrinsics {
+  explicit UnprojectionIntrinsics(const PinholeCamera4f& camera) {
+    const float fx = camera.parameters()[0];
+    const float fy = camera.parameters()[1];
+    const float cx = camera.parameters()[2];
+    const float cy = camera.parameters()[3];
+    
+    fx_inv = 1.0f / fx;
+    fy_inv = 1.0f / fy;
+    cx_inv = -(cx - 0.5f) / fx;
+    cy_inv = -(cy - 0.5f) / fy;
+  }
+  
+  inline Vec3f Unproject(int x, int y, float depth) const {
+    return Vec3f(depth * (fx_inv * x + cx_inv),
+                 depth * (fy_inv * y + cy_inv),
+                 depth);
+  }
+  
+  float fx_inv;
+  float fy_inv;
+  float cx_inv;
+  float cy_inv;
+};
+
+// Returns the depth at (x, y), or 0 if the pixel is outside of the image.
+inline u16 DepthOrZero(const Image<u16>& depth, int x, int y) {
+  if (x < 0 || y < 0 ||
+      x >= static_cast<int>(depth.width()) || y >= static_cast<int>(depth.height())) {
+    return 0;
+  }
+  return depth(x, y);
+}
+
+#if defined(__SSE2__)
+// Loads 4 consecutive u16 values and converts them to float.
+inline __m128 LoadU16x4AsFloat(const u16* values) {
+  __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(values));
+  return _mm_cvtepi32_ps(_mm_unpacklo_epi16(packed, _mm_setzero_si128()));
+}
+
+// Returns the sum of the 4 elements.
+inline float HorizontalSum(__m128 v) {
+  __m128 shuffled = _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1));
+  __m128 sums = _mm_add_ps(v, shuffled);
+  shuffled = _mm_movehl_ps(shuffled, sums);
+  sums = _mm_add_ss(sums, shuffled);
+  return _mm_cvtss_f32(sums);
+}
+
+// Computes exp(x) for x <= 0 with a relative error in the order of 1e-7 (the
+// polynomial approximation from the Cephes library). Values below -87 are
+// clamped, such that the result is never smaller than about 1.6e-38.
+inline __m128 ExpForNonPositive(__m128 x) {
+  x = _mm_max_ps(x, _mm_set1_ps(-87.0f));
+  
+  // exp(x) = 2^n * exp(r) with n = round(x / ln(2)) and r = x - n * ln(2).
+  __m128 n = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(1.44269504088896341f)), _mm_set1_ps(0.5f));
+  __m128 truncated = _mm_cvtepi32_ps(_mm_cvttps_epi32(n));
+  n = _mm_sub_ps(truncated, _mm_and_ps(_mm_cmpgt_ps(truncated, n), _mm_set1_ps(1.0f)));  // floor
+  
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(0.693359375f)));
+  x = _mm_sub_ps(x, _mm_mul_ps(n, _mm_set1_ps(-2.12194440e-4f)));
+  
+  __m128 y = _mm_set1_ps(1.9875691500e-4f);
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.3981999507e-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(8.3334519073e-3f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(4.1665795894e-2f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(1.6666665459e-1f));
+  y = _mm_add_ps(_mm_mul_ps(y, x), _mm_set1_ps(5.0000001201e-1f));
+  y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(y, _mm_mul_ps(x, x)), x), _mm_set1_ps(1.0f));
+  
+  __m128i exponent = _mm_slli_epi32(_mm_add_epi32(_mm_cvttps_epi32(n), _mm_set1_epi32(127)), 23);
+  return _mm_mul_ps(y, _mm_castsi128_ps(exponent));
+}
+#endif
+
+// Implements both variants of OutlierDepthMapFusion().
+void OutlierDepthMapFusionImpl(
+    int required_count,
+    float tolerance,
+    const Image<u16>& input_depth,
+    const PinholeCamera4f& depth_camera,
+    int other_count,
+    const Image<u16>** other_depths,
+    const SE3f* others_T_reference,
+    Image<u16>* output_depth,
+    int thread_count) {
+  output_depth->SetSize(input_depth.size());
+  
+  const int width = input_depth.width();
+  const int height = input_depth.height();
+  for (int other_index = 0; other_index < other_count; ++ other_index) {
+    CHECK_EQ(other_depths[other_index]->width(), input_depth.width());
+    CHECK_EQ(other_depths[other_index]->height(), input_depth.height());
+  }
+  
+  const float max_tolerance_factor = 1 + tolerance;
+  const float min_tolerance_factor = 1 - tolerance;
+  
+  // Projection intrinsics for pixel corner convention.
+  const float fx = depth_camera.parameters()[0];
+  const float fy = depth_camera.parameters()[1];
+  const float cx = depth_camera.parameters()[2];
+  const float cy = depth_camera.parameters()[3];
+  
+  const UnprojectionIntrinsics intrinsics(depth_camera);
+  
+  std::vector<Eigen::Matrix<float, 3, 4>> others_TR_reference(other_count);
+  for (int other_index = 0; other_index < other_count; ++ other_index) {
+    others_TR_reference[other_index] = others_T_reference[other_index].matrix3x4();
+  }
+  
+  // Checks whether the reference point, given in the other frame's
+  // coordinates, is consistent with the other depth map.
+  auto check_other_depth = [&](int other_index, float other_x, float other_y, float other_z) {
+    if (other_z <= 0) {
+      return false;
+    }
+    
+    // TODO: for pixel_pos.x or .y in ]-1, 0] this will also treat the pixel as in the image
+    int px = static_cast<int>(fx * (other_x / other_z) + cx);
+    int py = static_cast<int>(fy * (other_y / other_z) + cy);
+    if (px < 0 || py < 0 ||
+        px >= width || py >= height) {
+      return false;
+    }
+    
+    u16 other_depth_value = (*other_depths[other_index])(px, py);
+    return !(other_depth_value <= 0 ||
+             other_depth_value > max_tolerance_factor * other_z ||
+             other_depth_value < min_tolerance_factor * other_z);
+  };
+  
+  // Processes a single pixel with a non-zero depth value.
+  auto process_pixel = [&](int x, int y, u16 depth_value) {
+    Vec3f reference_point = intrinsics.Unproject(x, y, depth_value);
+    
+    int ok_count = 0;
+    for (int other_index = 0; other_index < other_count; ++ other_index) {
+      if (ok_count + (other_count - other_index) < required_count) {
+        break;
+      }
+      const Eigen::Matrix<float, 3, 4>& T = others_TR_reference[other_index];
+      float other_x = T(0, 0) * reference_point.x() + T(0, 1) * reference_point.y() + T(0, 2) * reference_point.z() + T(0, 3);
+      float other_y = T(1, 0) * reference_point.x() + T(1, 1) * reference_point.y() + T(1, 2) * reference_point.z() + T(1, 3);
+      float other_z = T(2, 0) * reference_point.x() + T(2, 1) * reference_point.y() + T(2, 2) * reference_point.z() + T(2, 3);
+      if (check_other_depth(other_index, other_x, other_y, other_z)) {
+        ++ ok_count;
+      }
+    }
+    return (ok_count >= required_count) ? depth_value : static_cast<u16>(0);
+  };
+  
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      const u16* in_row = input_depth.row(y);
+      u16* out_row = output_depth->row(y);
+      int x = 0;
+      
+#if defined(__SSE2__)
+      // Transform blocks of 4 pixels at a time. The lookups in the other depth
+      // maps are done per pixel.
+      const __m128 y_factor = _mm_set1_ps(intrinsics.fy_inv * y + intrinsics.cy_inv);
+      float other_x[4];
+      float other_y[4];
+      float other_z[4];
+      int ok_count[4];
+      for (; x + 4 <= width; x += 4) {
+        __m128i packed = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in_row + x));
+        int zero_mask = _mm_movemask_epi8(_mm_cmpeq_epi16(packed, _mm_setzero_si128())) & 0xff;
+        if (zero_mask == 0xff) {
+          // All depths are zero.
+          _mm_storel_epi64(reinterpret_cast<__m128i*>(out_row + x), _mm_setzero_si128());
+          continue;
+        }
+        
+        __m128 depth = _mm_cvtepi32_ps(_mm_unpacklo_epi16(packed, _mm_setzero_si128()));
+        __m128 pixel_x = _mm_set_ps(x + 3, x + 2, x + 1, x);
+        __m128 point_x = _mm_mul_ps(depth, _mm_add_ps(_mm_mul_ps(_mm_set1_ps(intrinsics.fx_inv), pixel_x), _mm_set1_ps(intrinsics.cx_inv)));
+        __m128 point_y = _mm_mul_ps(depth, y_factor);
+        __m128 point_z = depth;
+        
+        for (int i = 0; i < 4; ++ i) {
+          ok_count[i] = 0;
+        }
+        for (int other_index = 0; other_index < other_count; ++ other_index) {
+          const Eigen::Matrix<float, 3, 4>& T = others_TR_reference[other_index];
+          #define TRANSFORM_ROW(row) \
+              _mm_add_ps(_mm_add_ps(_mm_add_ps( \
+                  _mm_mul_ps(_mm_set1_ps(T(row, 0)), point_x), \
+                  _mm_mul_ps(_mm_set1_ps(T(row, 1)), point_y)), \
+                  _mm_mul_ps(_mm_set1_ps(T(row, 2)), point_z)), \
+                  _mm_set1_ps(T(row, 3)))
+          _mm_storeu_ps(other_x, TRANSFORM_ROW(0));
+          _mm_storeu_ps(other_y, TRANSFORM_ROW(1));
+          _mm_storeu_ps(other_z, TRANSFORM_ROW(2));
+          #undef TRANSFORM_ROW
+          
+          for (int i = 0; i < 4; ++ i) {
+            if (in_row[x + i] != 0 &&
+                check_other_depth(other_index, other_x[i], other_y[i], other_z[i])) {
+              ++ ok_count[i];
+            }
+          }
+        }
+        
+        for (int i = 0; i < 4; ++ i) {
+          out_row[x + i] = (ok_count[i] >= required_count) ? in_row[x + i] : 0;
+        }
+      }
+#endif
+      
+      for (; x < width; ++ x) {
+        out_row[x] = (in_row[x] == 0) ? 0 : process_pixel(x, y, in_row[x]);
+      }
+    }
+  });
+}
+
+// Computes the normal and the output depth of ComputeNormalsAndDropBadPixels()
+// for a single pixel.
+inline void ComputeNormalAtPixel(
+    int x, int y,
+    float normal_dot_threshold,
+    float inv_depth_scaling,
+    const UnprojectionIntrinsics& intrinsics,
+    const Image<u16>& in_depth,
+    u16* out_depth,
+    Vec2f* out_normal) {
+  u16 center_depth = in_depth(x, y);
+  u16 right_depth = DepthOrZero(in_depth, x + 1, y);
+  u16 left_depth = DepthOrZero(in_depth, x - 1, y);
+  u16 bottom_depth = DepthOrZero(in_depth, x, y + 1);
+  u16 top_depth = DepthOrZero(in_depth, x, y - 1);
+  if (center_depth == 0 || right_depth == 0 || left_depth == 0 || bottom_depth == 0 || top_depth == 0) {
+    *out_depth = 0;
+    *out_normal = Vec2f::Zero();
+    return;
+  }
+  
+  Vec3f left_point = intrinsics.Unproject(x - 1, y, inv_depth_scaling * left_depth);
+  Vec3f top_point = intrinsics.Unproject(x, y - 1, inv_depth_scaling * top_depth);
+  Vec3f right_point = intrinsics.Unproject(x + 1, y, inv_depth_scaling * right_depth);
+  Vec3f bottom_point = intrinsics.Unproject(x, y + 1, inv_depth_scaling * bottom_depth);
+  
+  Vec3f normal = (right_point - left_point).cross(top_point - bottom_point);
+  
+  float length = normal.norm();
+  if (!(length > 1e-6f)) {
+    normal = Vec3f(0, 0, -1);  // avoid NaNs
+  } else {
+    normal *= ((intrinsics.fy_inv < 0) ? -1.0f : 1.0f) / length;  // Account for negative fy in ICL-NUIM data
+  }
+  
+  *out_normal = Vec2f(normal.x(), normal.y());
+  
+  // Discard depth if the normal points too far away from the viewing direction.
+  Vec3f viewing_direction(intrinsics.fx_inv * x + intrinsics.cx_inv, intrinsics.fy_inv * y + intrinsics.cy_inv, 1);
+  viewing_direction *= 1.0f / viewing_direction.norm();
+  *out_depth = (viewing_direction.dot(normal) >= normal_dot_threshold) ? 0 : center_depth;
+}
+
+// Computes the squared radius and the output depth of
+// ComputePointRadiiAndRemoveIsolatedPixels() for a single pixel with non-zero
+// depth.
+inline void ComputeRadiusAtPixel(
+    int x, int y,
+    float point_radius_extension_factor_squared,
+    float clamp_factor_term,
+    float inv_depth_scaling,
+    const UnprojectionIntrinsics& intrinsics,
+    const Image<u16>& depth_buffer,
+    float* radius_squared_out,
+    u16* out_depth) {
+  Vec3f local_position = intrinsics.Unproject(x, y, inv_depth_scaling * depth_buffer(x, y));
+  
+  int neighbor_count = 0;
+  float radius_squared = 0;
+  float min_neighbor_distance_squared = std::numeric_limits<float>::infinity();
+  for (int dy = y - 1, end_dy = y + 2; dy < end_dy; ++ dy) {
+    for (int dx = x - 1, end_dx = x + 2; dx < end_dx; ++ dx) {
+      float ddepth = inv_depth_scaling * DepthOrZero(depth_buffer, dx, dy);
+      if ((dx == x && dy == y) ||
+          ddepth <= 0) {
+        continue;
+      }
+      ++ neighbor_count;
+      
+      float distance_squared = (intrinsics.Unproject(dx, dy, ddepth) - local_position).squaredNorm();
+      radius_squared = std::max(radius_squared, distance_squared);
+      min_neighbor_distance_squared = std::min(min_neighbor_distance_squared, distance_squared);
+    }
+  }
+  
+  radius_squared *= point_radius_extension_factor_squared;
+  radius_squared = std::min(radius_squared, clamp_factor_term * min_neighbor_distance_squared);
+  
+  // See ComputePointRadiiAndRemoveIsolatedPixelsCUDAKernel().
+  constexpr int kMinNeighborPixelsForRadiusComputation = 8;
+  
+  *radius_squared_out = radius_squared;
+  *out_depth = (neighbor_count < kMinNeighborPixelsForRadiusComputation) ? 0 : depth_buffer(x, y);
+}
+
+}  // namespace
+
+int DefaultDepthProcessingThreadCount() {
+  return std::max<int>(1, std::thread::hardware_concurrency());
+}
+
+void BilateralFilteringAndDepthCutoff(
+    float sigma_xy,
+    float sigma_value_factor,
+    u16 value_to_ignore,
+    float radius_factor,
+    u16 max_depth,
+    float depth_valid_region_radius,
+    const Image<u16>& input_depth,
+    Image<u16>* output_depth,
+    int thread_count) {
+  output_depth->SetSize(input_depth.size());
+  
+  const int width = input_depth.width();
+  const int height = input_depth.height();
+  const int image_half_width = width / 2;
+  const int image_half_height = height / 2;
+  const float depth_valid_region_radius_squared = depth_valid_region_radius * depth_valid_region_radius;
+  
+  const int radius = radius_factor * sigma_xy + 0.5f;
+  const int radius_squared = radius * radius;
+  const float denom_xy = 2.0f * sigma_xy * sigma_xy;
+  
+  // Precompute the spatial part of the filter weight exponent for the offsets
+  // in the filter window. For each window row, only the range of columns
+  // which intersects the filter circle is stored, padded to a multiple of 4
+  // entries for vectorization. Padding entries get a zero mask entry.
+  const int window_size = 2 * radius + 1;
+  const int window_stride = 4 * ((window_size + 3) / 4);
+  std::vector<int> row_begin(window_size);
+  std::vector<int> row_length(window_size);
+  std::vector<float> spatial_exponents(window_size * window_stride, 0);
+  std::vector<float> window_mask(window_size * window_stride, 0);
+  for (int wy = 0; wy < window_size; ++ wy) {
+    int dy = wy - radius;
+    int half_extent = 0;
+    while ((half_extent + 1) * (half_extent + 1) + dy * dy <= radius_squared) {
+      ++ half_extent;
+    }
+    row_begin[wy] = radius - half_extent;
+    row_length[wy] = 4 * ((2 * half_extent + 1 + 3) / 4);
+    for (int i = 0; i < 2 * half_extent + 1; ++ i) {
+      int dx = i - half_extent;
+      spatial_exponents[wy * window_stride + i] = -(dx * dx + dy * dy) / denom_xy;
+      window_mask[wy * window_stride + i] = 1;
+    }
+  }
+  
+  // Create a float copy of the input which is padded with value_to_ignore,
+  // such that the filter window never needs to be clipped.
+  const int padded_width = width + 2 * radius + 4;
+  const int padded_height = height + 2 * radius;
+  std::vector<float> padded_depth(padded_width * padded_height, value_to_ignore);
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      const u16* in_row = input_depth.row(y);
+      float* padded_row = padded_depth.data() + (y + radius) * padded_width + radius;
+      for (int x = 0; x < width; ++ x) {
+        padded_row[x] = in_row[x];
+      }
+    }
+  });
+  
+  const float ignored_value = value_to_ignore;
+  
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      const u16* in_row = input_depth.row(y);
+      u16* out_row = output_depth->row(y);
+      
+      for (int x = 0; x < width; ++ x) {
+        int center_dx = x - image_half_width;
+        int center_dy = y - image_half_height;
+        float center_distance_squared = center_dx * center_dx + center_dy * center_dy;
+        if (center_distance_squared > depth_valid_region_radius_squared) {
+          out_row[x] = value_to_ignore;
+          continue;
+        }
+        
+        // Depth cutoff.
+        u16 center_value = in_row[x];
+        if (center_value == value_to_ignore || center_value > max_depth) {
+          out_row[x] = value_to_ignore;
+          continue;
+        }
+        
+        // Bilateral filtering.
+        const float adapted_sigma_value = center_value * sigma_value_factor;
+        const float value_exponent_factor = -1.0f / (2.0f * adapted_sigma_value * adapted_sigma_value);
+        const float center = center_value;
+        
+        float sum = 0;
+        float weight = 0;
+        
+#if defined(__SSE2__)
+        __m128 sum_vec = _mm_setzero_ps();
+        __m128 weight_vec = _mm_setzero_ps();
+        const __m128 center_vec = _mm_set1_ps(center);
+        const __m128 factor_vec = _mm_set1_ps(value_exponent_factor);
+        const __m128 ignored_vec = _mm_set1_ps(ignored_value);
+        for (int wy = 0; wy < window_size; ++ wy) {
+          const float* samples = padded_depth.data() + (y + wy) * padded_width + x + row_begin[wy];
+          const float* exponents = spatial_exponents.data() + wy * window_stride;
+          const float* mask = window_mask.data() + wy * window_stride;
+          for (int wx = 0; wx < row_length[wy]; wx += 4) {
+            __m128 sample = _mm_loadu_ps(samples + wx);
+            __m128 value_distance = _mm_sub_ps(center_vec, sample);
+            __m128 exponent = _mm_add_ps(
+                _mm_loadu_ps(exponents + wx),
+                _mm_mul_ps(_mm_mul_ps(value_distance, value_distance), factor_vec));
+            __m128 w = _mm_mul_ps(ExpForNonPositive(exponent), _mm_loadu_ps(mask + wx));
+            w = _mm_and_ps(w, _mm_cmpneq_ps(sample, ignored_vec));
+            sum_vec = _mm_add_ps(sum_vec, _mm_mul_ps(w, sample));
+            weight_vec = _mm_add_ps(weight_vec, w);
+          }
+        }
+        sum = HorizontalSum(sum_vec);
+        weight = HorizontalSum(weight_vec);
+#else
+        for (int wy = 0; wy < window_size; ++ wy) {
+          const float* samples = padded_depth.data() + (y + wy) * padded_width + x + row_begin[wy];
+          const float* exponents = spatial_exponents.data() + wy * window_stride;
+          const float* mask = window_mask.data() + wy * window_stride;
+          for (int wx = 0; wx < row_length[wy]; ++ wx) {
+            float sample = samples[wx];
+            if (mask[wx] == 0 || sample == ignored_value) {
+              continue;
+            }
+            float value_distance = center - sample;
+            float w = expf(exponents[wx] + value_distance * value_distance * value_exponent_factor);
+            sum += w * sample;
+            weight += w;
+          }
+        }
+#endif
+        
+        out_row[x] = (weight == 0) ? value_to_ignore : static_cast<u16>(sum / weight + 0.5f);
+      }
+    }
+  });
+}
+
+void OutlierDepthMapFusion(
+    float tolerance,
+    const Image<u16>& input_depth,
+    const PinholeCamera4f& depth_camera,
+    int other_count,
+    const Image<u16>** other_depths,
+    const SE3f* others_T_reference,
+    Image<u16>* output_depth,
+    int thread_count) {
+  OutlierDepthMapFusionImpl(
+      other_count, tolerance, input_depth, depth_camera, other_count,
+      other_depths, others_T_reference, output_depth, thread_count);
+}
+
+void OutlierDepthMapFusion(
+    int required_count,
+    float tolerance,
+    const Image<u16>& input_depth,
+    const PinholeCamera4f& depth_camera,
+    int other_count,
+    const Image<u16>** other_depths,
+    const SE3f* others_T_reference,
+    Image<u16>* output_depth,
+    int thread_count) {
+  OutlierDepthMapFusionImpl(
+      required_count, tolerance, input_depth, depth_camera, other_count,
+      other_depths, others_T_reference, output_depth, thread_count);
+}
+
+void ErodeDepthMap(
+    int radius,
+    const Image<u16>& input_depth,
+    Image<u16>* output_depth,
+    int thread_count) {
+  CHECK_GE(radius, 1);
+  output_depth->SetSize(input_depth.size());
+  
+  const int width = input_depth.width();
+  const int height = input_depth.height();
+  
+  // The erosion is separated into a vertical pass, which determines for each
+  // pixel whether the column of 2 * radius + 1 pixels centered on it is valid
+  // (stored as 0xffff or 0 in column_valid), and a horizontal pass over the
+  // result.
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    std::vector<u16> column_valid(width);
+    
+    for (int y = y_begin; y < y_end; ++ y) {
+      u16* out_row = output_depth->row(y);
+      if (y < radius || y >= height - radius || width <= 2 * radius) {
+        memset(out_row, 0, width * sizeof(u16));
+        continue;
+      }
+      
+      int x = 0;
+#if defined(__SSE2__)
+      for (; x + 8 <= width; x += 8) {
+        __m128i valid = _mm_set1_epi16(-1);
+        for (int sample_y = y - radius; sample_y <= y + radius; ++ sample_y) {
+          __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(input_depth.row(sample_y) + x));
+          valid = _mm_andnot_si128(_mm_cmpeq_epi16(values, _mm_setzero_si128()), valid);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(column_valid.data() + x), valid);
+      }
+#endif
+      for (; x < width; ++ x) {
+        bool valid = true;
+        for (int sample_y = y - radius; sample_y <= y + radius; ++ sample_y) {
+          valid &= input_depth(x, sample_y) != 0;
+        }
+        column_valid[x] = valid ? 0xffff : 0;
+      }
+      
+      const u16* in_row = input_depth.row(y);
+      for (x = 0; x < radius; ++ x) {
+        out_row[x] = 0;
+      }
+#if defined(__SSE2__)
+      for (; x + 8 <= width - radius; x += 8) {
+        __m128i result = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in_row + x));
+        for (int sample_x = x - radius; sample_x <= x + radius; ++ sample_x) {
+          result = _mm_and_si128(result, _mm_loadu_si128(reinterpret_cast<const __m128i*>(column_valid.data() + sample_x)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out_row + x), result);
+      }
+#endif
+      for (; x < width - radius; ++ x) {
+        u16 result = in_row[x];
+        for (int sample_x = x - radius; sample_x <= x + radius; ++ sample_x) {
+          result &= column_valid[sample_x];
+        }
+        out_row[x] = result;
+      }
+      for (; x < width; ++ x) {
+        out_row[x] = 0;
+      }
+    }
+  });
+}
+
+void CopyWithoutBorder(
+    const Image<u16>& input_depth,
+    Image<u16>* output_depth,
+    int thread_count) {
+  constexpr int kBorderSize = 1;
+  
+  output_depth->SetSize(input_depth.size());
+  
+  const int width = input_depth.width();
+  const int height = input_depth.height();
+  
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      u16* out_row = output_depth->row(y);
+      if (y < kBorderSize || y >= height - kBorderSize || width <= 2 * kBorderSize) {
+        memset(out_row, 0, width * sizeof(u16));
+        continue;
+      }
+      
+      memcpy(out_row + kBorderSize,
+             input_depth.row(y) + kBorderSize,
+             (width - 2 * kBorderSize) * sizeof(u16));
+      for (int x = 0; x < kBorderSize; ++ x) {
+        out_row[x] = 0;
+        out_row[width - 1 - x] = 0;
+      }
+    }
+  });
+}
+
+void ComputeNormalsAndDropBadPixels(
+    float observation_angle_threshold_deg,
+    float depth_scaling,
+    const PinholeCamera4f& depth_camera,
+    const Image<u16>& in_depth,
+    Image<u16>* out_depth,
+    Image<Vec2f>* out_normals,
+    int thread_count) {
+  out_depth->SetSize(in_depth.size());
+  out_normals->SetSize(in_depth.size());
+  
+  const int width = in_depth.width();
+  const int height = in_depth.height();
+  
+  const float normal_dot_threshold = -1 * cosf(M_PI / 180.f * observation_angle_threshold_deg);
+  const float inv_depth_scaling = 1.0f / depth_scaling;
+  const UnprojectionIntrinsics intrinsics(depth_camera);
+  
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      u16* out_depth_row = out_depth->row(y);
+      Vec2f* out_normals_row = out_normals->row(y);
+      int x = 0;
+      
+#if defined(__SSE2__)
+      if (y >= 1 && y < height - 1) {
+        // Handle the first column separately, since its left neighbor is
+        // outside of the image.
+        for (; x < std::min(1, width); ++ x) {
+          ComputeNormalAtPixel(x, y, normal_dot_threshold, inv_depth_scaling, intrinsics, in_depth, &out_depth_row[x], &out_normals_row[x]);
+        }
+        
+        const u16* center_row = in_depth.row(y);
+        const u16* top_row = in_depth.row(y - 1);
+        const u16* bottom_row = in_depth.row(y + 1);
+        
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 inv_depth_scaling_vec = _mm_set1_ps(inv_depth_scaling);
+        const __m128 fx_inv = _mm_set1_ps(intrinsics.fx_inv);
+        const __m128 cx_inv = _mm_set1_ps(intrinsics.cx_inv);
+        const __m128 y_factor = _mm_set1_ps(intrinsics.fy_inv * y + intrinsics.cy_inv);
+        const __m128 top_y_factor = _mm_set1_ps(intrinsics.fy_inv * (y - 1) + intrinsics.cy_inv);
+        const __m128 bottom_y_factor = _mm_set1_ps(intrinsics.fy_inv * (y + 1) + intrinsics.cy_inv);
+        const __m128 normal_sign = _mm_set1_ps((intrinsics.fy_inv < 0) ? -1.0f : 1.0f);
+        
+        for (; x + 4 <= width - 1; x += 4) {
+          __m128 center_depth = LoadU16x4AsFloat(center_row + x);
+          __m128 left_depth = _mm_mul_ps(inv_depth_scaling_vec, LoadU16x4AsFloat(center_row + x - 1));
+          __m128 right_depth = _mm_mul_ps(inv_depth_scaling_vec, LoadU16x4AsFloat(center_row + x + 1));
+          __m128 top_depth = _mm_mul_ps(inv_depth_scaling_vec, LoadU16x4AsFloat(top_row + x));
+          __m128 bottom_depth = _mm_mul_ps(inv_depth_scaling_vec, LoadU16x4AsFloat(bottom_row + x));
+          
+          __m128 valid = _mm_and_ps(
+              _mm_and_ps(_mm_cmpneq_ps(center_depth, zero), _mm_cmpneq_ps(left_depth, zero)),
+              _mm_and_ps(_mm_and_ps(_mm_cmpneq_ps(right_depth, zero), _mm_cmpneq_ps(top_depth, zero)),
+                         _mm_cmpneq_ps(bottom_depth, zero)));
+          int valid_mask = _mm_movemask_ps(valid);
+          if (valid_mask == 0) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out_depth_row + x), _mm_setzero_si128());
+            _mm_storeu_ps(out_normals_row[x].data(), zero);
+            _mm_storeu_ps(out_normals_row[x + 2].data(), zero);
+            continue;
+          }
+          
+          __m128 pixel_x = _mm_set_ps(x + 3, x + 2, x + 1, x);
+          __m128 x_factor = _mm_add_ps(_mm_mul_ps(fx_inv, pixel_x), cx_inv);
+          __m128 left_x_factor = _mm_add_ps(_mm_mul_ps(fx_inv, _mm_sub_ps(pixel_x, _mm_set1_ps(1))), cx_inv);
+          __m128 right_x_factor = _mm_add_ps(_mm_mul_ps(fx_inv, _mm_add_ps(pixel_x, _mm_set1_ps(1))), cx_inv);
+          
+          // left_to_right and bottom_to_top vectors.
+          __m128 lr_x = _mm_sub_ps(_mm_mul_ps(right_depth, right_x_factor), _mm_mul_ps(left_depth, left_x_factor));
+          __m128 lr_y = _mm_sub_ps(_mm_mul_ps(right_depth, y_factor), _mm_mul_ps(left_depth, y_factor));
+          __m128 lr_z = _mm_sub_ps(right_depth, left_depth);
+          __m128 bt_x = _mm_sub_ps(_mm_mul_ps(top_depth, x_factor), _mm_mul_ps(bottom_depth, x_factor));
+          __m128 bt_y = _mm_sub_ps(_mm_mul_ps(top_depth, top_y_factor), _mm_mul_ps(bottom_depth, bottom_y_factor));
+          __m128 bt_z = _mm_sub_ps(top_depth, bottom_depth);
+          
+          __m128 normal_x = _mm_sub_ps(_mm_mul_ps(lr_y, bt_z), _mm_mul_ps(bt_y, lr_z));
+          __m128 normal_y = _mm_sub_ps(_mm_mul_ps(bt_x, lr_z), _mm_mul_ps(lr_x, bt_z));
+          __m128 normal_z = _mm_sub_ps(_mm_mul_ps(lr_x, bt_y), _mm_mul_ps(bt_x, lr_y));
+          
+          __m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+              _mm_mul_ps(normal_x, normal_x), _mm_mul_ps(normal_y, normal_y)), _mm_mul_ps(normal_z, normal_z)));
+          __m128 length_ok = _mm_cmpgt_ps(length, _mm_set1_ps(1e-6f));
+          __m128 inv_length = _mm_div_ps(normal_sign, length);
+          // Use (0, 0, -1) for too short normals to avoid NaNs, and zero
+          // normals for invalid pixels.
+          normal_x = _mm_and_ps(_mm_and_ps(_mm_mul_ps(normal_x, inv_length), length_ok), valid);
+          normal_y = _mm_and_ps(_mm_and_ps(_mm_mul_ps(normal_y, inv_length), length_ok), valid);
+          normal_z = _mm_or_ps(_mm_and_ps(_mm_mul_ps(normal_z, inv_length), length_ok),
+                               _mm_andnot_ps(length_ok, _mm_set1_ps(-1)));
+          
+          _mm_storeu_ps(out_normals_row[x].data(), _mm_unpacklo_ps(normal_x, normal_y));
+          _mm_storeu_ps(out_normals_row[x + 2].data(), _mm_unpackhi_ps(normal_x, normal_y));
+          
+          // Discard depth if the normal points too far away from the viewing direction.
+          __m128 inv_dir_length = _mm_div_ps(_mm_set1_ps(1), _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(
+              _mm_mul_ps(x_factor, x_factor), _mm_mul_ps(y_factor, y_factor)), _mm_set1_ps(1))));
+          __m128 dot = _mm_add_ps(_mm_add_ps(
+              _mm_mul_ps(_mm_mul_ps(inv_dir_length, x_factor), normal_x),
+              _mm_mul_ps(_mm_mul_ps(inv_dir_length, y_factor), normal_y)),
+              _mm_mul_ps(inv_dir_length, normal_z));
+          int keep_mask = valid_mask & ~_mm_movemask_ps(_mm_cmpge_ps(dot, _mm_set1_ps(normal_dot_threshold)));
+          for (int i = 0; i < 4; ++ i) {
+            out_depth_row[x + i] = (keep_mask & (1 << i)) ? center_row[x + i] : 0;
+          }
+        }
+      }
+#endif
+      
+      for (; x < width; ++ x) {
+        ComputeNormalAtPixel(x, y, normal_dot_threshold, inv_depth_scaling, intrinsics, in_depth, &out_depth_row[x], &out_normals_row[x]);
+      }
+    }
+  });
+}
+
+void ComputePointRadiiAndRemoveIsolatedPixels(
+    float point_radius_extension_factor,
+    float point_radius_clamp_factor,
+    float depth_scaling,
+    const PinholeCamera4f& depth_camera,
+    const Image<u16>& depth_buffer,
+    Image<float>* radius_buffer,
+    Image<u16>* out_depth,
+    int thread_count) {
+  radius_buffer->SetSize(depth_buffer.size());
+  out_depth->SetSize(depth_buffer.size());
+  
+  const int width = depth_buffer.width();
+  const int height = depth_buffer.height();
+  
+  const float point_radius_extension_factor_squared = point_radius_extension_factor * point_radius_extension_factor;
+  const float clamp_factor_term = point_radius_clamp_factor * point_radius_clamp_factor * sqrtf(2) * sqrtf(2);
+  const float inv_depth_scaling = 1.0f / depth_scaling;
+  const UnprojectionIntrinsics intrinsics(depth_camera);
+  
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      const u16* center_row = depth_buffer.row(y);
+      float* radius_row = radius_buffer->row(y);
+      u16* out_depth_row = out_depth->row(y);
+      int x = 0;
+      
+#if defined(__SSE2__)
+      if (y >= 1 && y < height - 1) {
+        // Handle the first column separately, since its left neighbors are
+        // outside of the image.
+        for (; x < std::min(1, width); ++ x) {
+          if (center_row[x] == 0) {
+            out_depth_row[x] = 0;
+          } else {
+            ComputeRadiusAtPixel(x, y, point_radius_extension_factor_squared, clamp_factor_term, inv_depth_scaling, intrinsics, depth_buffer, &radius_row[x], &out_depth_row[x]);
+          }
+        }
+        
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 inv_depth_scaling_vec = _mm_set1_ps(inv_depth_scaling);
+        const __m128 fx_inv = _mm_set1_ps(intrinsics.fx_inv);
+        const __m128 cx_inv = _mm_set1_ps(intrinsics.cx_inv);
+        
+        for (; x + 4 <= width - 1; x += 4) {
+          __m128 center_value = LoadU16x4AsFloat(center_row + x);
+          int center_valid_mask = _mm_movemask_ps(_mm_cmpneq_ps(center_value, zero));
+          if (center_valid_mask == 0) {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(out_depth_row + x), _mm_setzero_si128());
+            continue;
+          }
+          
+          __m128 pixel_x = _mm_set_ps(x + 3, x + 2, x + 1, x);
+          __m128 depth = _mm_mul_ps(inv_depth_scaling_vec, center_value);
+          __m128 local_x = _mm_mul_ps(depth, _mm_add_ps(_mm_mul_ps(fx_inv, pixel_x), cx_inv));
+          __m128 local_y = _mm_mul_ps(depth, _mm_set1_ps(intrinsics.fy_inv * y + intrinsics.cy_inv));
+          
+          __m128i neighbor_count = _mm_setzero_si128();
+          __m128 radius_squared = zero;
+          __m128 min_neighbor_distance_squared = _mm_set1_ps(std::numeric_limits<float>::infinity());
+          for (int dy = -1; dy <= 1; ++ dy) {
+            const u16* neighbor_row = depth_buffer.row(y + dy);
+            const __m128 neighbor_y_factor = _mm_set1_ps(intrinsics.fy_inv * (y + dy) + intrinsics.cy_inv);
+            for (int dx = -1; dx <= 1; ++ dx) {
+              if (dx == 0 && dy == 0) {
+                continue;
+              }
+              
+              __m128 ddepth = _mm_mul_ps(inv_depth_scaling_vec, LoadU16x4AsFloat(neighbor_row + x + dx));
+              __m128 valid = _mm_cmpgt_ps(ddepth, zero);
+              neighbor_count = _mm_sub_epi32(neighbor_count, _mm_castps_si128(valid));
+              
+              __m128 neighbor_x_factor = _mm_add_ps(_mm_mul_ps(fx_inv, _mm_add_ps(pixel_x, _mm_set1_ps(dx))), cx_inv);
+              __m128 offset_x = _mm_sub_ps(_mm_mul_ps(ddepth, neighbor_x_factor), local_x);
+              __m128 offset_y = _mm_sub_ps(_mm_mul_ps(ddepth, neighbor_y_factor), local_y);
+              __m128 offset_z = _mm_sub_ps(ddepth, depth);
+              __m128 distance_squared = _mm_add_ps(_mm_add_ps(
+                  _mm_mul_ps(offset_x, offset_x), _mm_mul_ps(offset_y, offset_y)), _mm_mul_ps(offset_z, offset_z));
+              
+              radius_squared = _mm_max_ps(radius_squared, _mm_and_ps(valid, distance_squared));
+              min_neighbor_distance_squared = _mm_min_ps(
+                  min_neighbor_distance_squared,
+                  _mm_or_ps(_mm_and_ps(valid, distance_squared),
+                            _mm_andnot_ps(valid, _mm_set1_ps(std::numeric_limits<float>::infinity()))));
+            }
+          }
+          
+          radius_squared = _mm_mul_ps(radius_squared, _mm_set1_ps(point_radius_extension_factor_squared));
+          radius_squared = _mm_min_ps(radius_squared, _mm_mul_ps(_mm_set1_ps(clamp_factor_term), min_neighbor_distance_squared));
+          
+          // See ComputePointRadiiAndRemoveIsolatedPixelsCUDAKernel().
+          constexpr int kMinNeighborPixelsForRadiusComputation = 8;
+          int keep_mask = center_valid_mask & _mm_movemask_ps(_mm_castsi128_ps(
+              _mm_cmpgt_epi32(neighbor_count, _mm_set1_epi32(kMinNeighborPixelsForRadiusComputation - 1))));
+          
+          float radii_squared[4];
+          _mm_storeu_ps(radii_squared, radius_squared);
+          for (int i = 0; i < 4; ++ i) {
+            if (center_valid_mask & (1 << i)) {
+              radius_row[x + i] = radii_squared[i];
+            }
+            out_depth_row[x + i] = (keep_mask & (1 << i)) ? center_row[x + i] : 0;
+          }
+        }
+      }
+#endif
+      
+      for (; x < width; ++ x) {
+        if (center_row[x] == 0) {
+          out_depth_row[x] = 0;
+        } else {
+          ComputeRadiusAtPixel(x, y, point_radius_extension_factor_squared, clamp_factor_term, inv_depth_scaling, intrinsics, depth_buffer, &radius_row[x], &out_depth_row[x]);
+        }
+      }
+    }
+  });
+}
+
+}
@@ -0,0 +1,131 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <libvis/camera.h>
+#include <libvis/eigen.h>
+#include <libvis/image.h>
+#include <libvis/libvis.h>
+#include <libvis/sophus.h>
+
+namespace vis {
+
+// CPU implementations of the depth preprocessing steps in
+// cuda_depth_processing.cuh. Each function computes the same result as the
+// CUDA function of the same name (without the "CUDA" suffix), up to floating
+// point rounding differences. The images are processed in bands of rows which
+// are distributed over thread_count threads, and the inner loops are
+// vectorized with SSE2 if it is enabled at compile time.
+// 
+// In contrast to the CUDA kernels, the functions below do not read outside of
+// the image if there are valid depth values at the image border. Such pixels
+// are treated as having invalid neighbors outside of the image.
+// 
+// The output images are resized to the size of the input image if necessary.
+// They must not be the same as an input image.
+
+// Returns the default thread count for the functions below.
+int DefaultDepthProcessingThreadCount();
+
+// See BilateralFilteringAndDepthCutoffCUDA().
+void BilateralFilteringAndDepthCutoff(
+    float sigma_xy,
+    float sigma_value_factor,
+    u16 value_to_ignore,
+    float radius_factor,
+    u16 max_depth,
+    float depth_valid_region_radius,
+    const Image<u16>& input_depth,
+    Image<u16>* output_depth,
+    int thread_count);
+
+// See OutlierDepthMapFusionCUDA(). other_depths and others_T_reference must
+// have other_count entries. An input depth value is kept only if it is
+// observed in all other depth maps.
+void OutlierDepthMapFusion(
+    float tolerance,
+    const Image<u16>& input_depth,
+    const PinholeCamera4f& depth_camera,
+    int other_count,
+    const Image<u16>** other_depths,
+    const SE3f* others_T_reference,
+    Image<u16>* output_depth,
+    int thread_count);
+
+// Variant of OutlierDepthMapFusion() which keeps an input depth value if it is
+// observed in at least required_count of the other depth maps.
+void OutlierDepthMapFusion(
+    int required_count,
+    float tolerance,
+    const Image<u16>& input_depth,
+    const PinholeCamera4f& depth_camera,
+    int other_count,
+    const Image<u16>** other_depths,
+    const SE3f* others_T_reference,
+    Image<u16>* output_depth,
+    int thread_count);
+
+// See ErodeDepthMapCUDA(). Supports any radius >= 1.
+void ErodeDepthMap(
+    int radius,
+    const Image<u16>& input_depth,
+    Image<u16>* output_depth,
+    int thread_count);
+
+// See CopyWithoutBorderCUDA().
+void CopyWithoutBorder(
+    const Image<u16>& input_depth,
+    Image<u16>* output_depth,
+    int thread_count);
+
+// See ComputeNormalsAndDropBadPixelsCUDA(). The normals are stored as (x, y)
+// pairs like in the CUDA version, i.e., the z component is implicit.
+void ComputeNormalsAndDropBadPixels(
+    float observation_angle_threshold_deg,
+    float depth_scaling,
+    const PinholeCamera4f& depth_camera,
+    const Image<u16>& in_depth,
+    Image<u16>* out_depth,
+    Image<Vec2f>* out_normals,
+    int thread_count);
+
+// See ComputePointRadiiAndRemoveIsolatedPixelsCUDA(). Like in the CUDA version,
+// the squared radius is only written for pixels with valid input depth.
+void ComputePointRadiiAndRemoveIsolatedPixels(
+    float point_radius_extension_factor,
+    float point_radius_clamp_factor,
+    float depth_scaling,
+    const PinholeCamera4f& depth_camera,
+    const Image<u16>& depth_buffer,
+    Image<float>* radius_buffer,
+    Image<u16>* out_depth,
+    int thread_count);
+
+}
@@ -0,0 +1,165 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "surfel_meshing/frame_pipeline.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace vis {
+
+FramePipelineQueueBase::FramePipelineQueueBase(const std::string& name, usize capacity)
+    : closed_(false),
+      push_count_(0),
+      depth_sum_(0),
+      max_depth_(0),
+      name_(name),
+      capacity_(capacity) {
+  CHECK_GE(capacity, 1u);
+}
+
+void FramePipelineQueueBase::Close() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  closed_ = true;
+  lock.unlock();
+  not_empty_condition_.notify_all();
+  not_full_condition_.notify_all();
+}
+
+usize FramePipelineQueueBase::push_count() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return push_count_;
+}
+
+double FramePipelineQueueBase::mean_depth() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return (push_count_ == 0) ? 0 : (depth_sum_ / static_cast<double>(push_count_));
+}
+
+usize FramePipelineQueueBase::max_depth() const {
+  std::unique_lock<std::mutex> lock(mutex_);
+  return max_depth_;
+}
+
+void FramePipelineQueueBase::RecordPush(usize depth) {
+  ++ push_count_;
+  depth_sum_ += depth;
+  max_depth_ = std::max(max_depth_, depth);
+}
+
+
+FramePipelineStage::FramePipelineStage(
+    const std::string& name,
+    const std::vector<FramePipelineQueueBase*>& queues,
+    const std::function<void(FramePipelineStage*)>& function)
+    : run_seconds_(0),
+      input_wait_seconds_(0),
+      output_wait_seconds_(0),
+      name_(name),
+      queues_(queues),
+      function_(function) {}
+
+void FramePipelineStage::ThreadMain() {
+  std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+  function_(this);
+  end_time_ = std::chrono::steady_clock::now();
+  run_seconds_ = std::chrono::duration<double>(end_time_ - start_time).count();
+  
+  for (FramePipelineQueueBase* queue : queues_) {
+    queue->Close();
+  }
+}
+
+double FramePipelineStage::SecondsSince(const std::chrono::steady_clock::time_point& start_time) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+}
+
+
+FramePipeline::FramePipeline()
+    : wall_seconds_(0),
+      started_(false) {}
+
+FramePipeline::~FramePipeline() {
+  CloseQueues();
+  Wait();
+}
+
+void FramePipeline::AddStage(
+    const std::string& name,
+    const std::vector<FramePipelineQueueBase*>& queues,
+    const std::function<void(FramePipelineStage*)>& function) {
+  CHECK(!started_) << "Stages must be added before starting the pipeline.";
+  stages_.emplace_back(new FramePipelineStage(name, queues, function));
+}
+
+void FramePipeline::Start() {
+  CHECK(!started_);
+  started_ = true;
+  start_time_ = std::chrono::steady_clock::now();
+  for (const std::unique_ptr<FramePipelineStage>& stage : stages_) {
+    stage->thread_ = std::thread(&FramePipelineStage::ThreadMain, stage.get());
+  }
+}
+
+void FramePipeline::CloseQueues() {
+  for (const std::unique_ptr<FramePipelineQueueBase>& queue : queues_) {
+    queue->Close();
+  }
+}
+
+void FramePipeline::Wait() {
+  for (const std::unique_ptr<FramePipelineStage>& stage : stages_) {
+    if (stage->thread_.joinable()) {
+      stage->thread_.join();
+      wall_seconds_ = std::max(
+          wall_seconds_,
+          std::chrono::duration<double>(stage->end_time_ - start_time_).count());
+    }
+  }
+}
+
+void FramePipeline::LogStatistics() const {
+  constexpr double kSecondsToMilliseconds = 1000;
+  for (const std::unique_ptr<FramePipelineStage>& stage : stages_) {
+    LOG(INFO) << "Pipeline stage " << stage->name() << ": occupancy "
+              << (100 * stage->busy_seconds() / std::max(wall_seconds_, 1e-9)) << "%, busy "
+              << (kSecondsToMilliseconds * stage->busy_seconds()) << " ms, waiting for input "
+              << (kSecondsToMilliseconds * stage->input_wait_seconds()) << " ms, waiting for output "
+              << (kSecondsToMilliseconds * stage->output_wait_seconds()) << " ms";
+  }
+  for (const std::unique_ptr<FramePipelineQueueBase>& queue : queues_) {
+    LOG(INFO) << "Pipeline queue " << queue->name() << ": capacity "
+              << queue->capacity() << ", " << queue->push_count()
+              << " items, mean depth " << queue->mean_depth()
+              << ", max depth " << queue->max_depth();
+  }
+}
+
+}
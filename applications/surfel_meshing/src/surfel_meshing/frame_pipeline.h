@@ -0,0 +1,284 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// Type-independent part of FramePipelineQueue, which allows the pipeline to
+// close queues and to report their statistics.
+class FramePipelineQueueBase {
+ public:
+  FramePipelineQueueBase(const std::string& name, usize capacity);
+  
+  virtual ~FramePipelineQueueBase() = default;
+  
+  // Closes the queue. Afterwards, pushing fails, and popping fails once all
+  // remaining items have been popped. Wakes up all threads waiting for the
+  // queue.
+  void Close();
+  
+  // Returns the number of items which were pushed.
+  usize push_count() const;
+  
+  // Returns the average number of items in the queue right after an item was
+  // pushed. A value close to the capacity indicates that the consuming stage
+  // is the bottleneck, a value close to 1 that the producing stage is.
+  double mean_depth() const;
+  
+  // Returns the largest number of items which were in the queue at once.
+  usize max_depth() const;
+  
+  inline const std::string& name() const { return name_; }
+  inline usize capacity() const { return capacity_; }
+  
+ protected:
+  // Updates the statistics after an item was pushed. Must be called with
+  // mutex_ locked.
+  void RecordPush(usize depth);
+  
+  mutable std::mutex mutex_;
+  std::condition_variable not_empty_condition_;
+  std::condition_variable not_full_condition_;
+  bool closed_;
+  
+  usize push_count_;
+  u64 depth_sum_;
+  usize max_depth_;
+  
+  std::string name_;
+  usize capacity_;
+};
+
+// A first-in, first-out queue with a bounded capacity for passing items between
+// the stages of a FramePipeline. Pushing blocks while the queue is full, which
+// keeps a fast stage from running arbitrarily far ahead of a slow one, and
+// popping blocks while it is empty. Can be used from any number of threads.
+template <typename T>
+class FramePipelineQueue : public FramePipelineQueueBase {
+ public:
+  FramePipelineQueue(const std::string& name, usize capacity)
+      : FramePipelineQueueBase(name, capacity) {}
+  
+  // Waits until there is space in the queue and appends the item. Returns
+  // false (and drops the item) if the queue is closed.
+  bool Push(T&& item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!closed_ && items_.size() >= capacity_) {
+      not_full_condition_.wait(lock);
+    }
+    if (closed_) {
+      return false;
+    }
+    items_.push_back(std::move(item));
+    RecordPush(items_.size());
+    lock.unlock();
+    not_empty_condition_.notify_one();
+    return true;
+  }
+  
+  // Waits until there is an item in the queue and removes it. Returns false if
+  // the queue is closed and empty.
+  bool Pop(T* item) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (!closed_ && items_.empty()) {
+      not_empty_condition_.wait(lock);
+    }
+    if (items_.empty()) {
+      return false;
+    }
+    *item = std::move(items_.front());
+    items_.pop_front();
+    lock.unlock();
+    not_full_condition_.notify_one();
+    return true;
+  }
+  
+ private:
+  std::deque<T> items_;
+};
+
+
+// A stage of a FramePipeline, which runs a function on its own thread. The
+// function should access the queues through Push() and Pop() of the stage,
+// such that the stage can measure how long it waits for them.
+class FramePipelineStage {
+ friend class FramePipeline;
+ public:
+  // Pops an item from a queue which the stage consumes. See
+  // FramePipelineQueue::Pop().
+  template <typename T>
+  bool Pop(FramePipelineQueue<T>* queue, T* item) {
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    bool result = queue->Pop(item);
+    input_wait_seconds_ += SecondsSince(start_time);
+    return result;
+  }
+  
+  // Pushes an item to a queue which the stage produces. See
+  // FramePipelineQueue::Push().
+  template <typename T>
+  bool Push(FramePipelineQueue<T>* queue, T&& item) {
+    std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+    bool result = queue->Push(std::move(item));
+    output_wait_seconds_ += SecondsSince(start_time);
+    return result;
+  }
+  
+  // Returns the time in seconds for which the function ran, without the time
+  // spent waiting for queues.
+  inline double busy_seconds() const { return run_seconds_ - input_wait_seconds_ - output_wait_seconds_; }
+  
+  // Returns the time in seconds which the function spent waiting for items
+  // from the previous stages.
+  inline double input_wait_seconds() const { return input_wait_seconds_; }
+  
+  // Returns the time in seconds which the function spent waiting for space in
+  // the queues of the following stages.
+  inline double output_wait_seconds() const { return output_wait_seconds_; }
+  
+  inline const std::string& name() const { return name_; }
+  
+ private:
+  FramePipelineStage(
+      const std::string& name,
+      const std::vector<FramePipelineQueueBase*>& queues,
+      const std::function<void(FramePipelineStage*)>& function);
+  
+  void ThreadMain();
+  
+  static double SecondsSince(const std::chrono::steady_clock::time_point& start_time);
+  
+  std::chrono::steady_clock::time_point end_time_;
+  double run_seconds_;
+  double input_wait_seconds_;
+  double output_wait_seconds_;
+  
+  std::string name_;
+  std::vector<FramePipelineQueueBase*> queues_;
+  std::function<void(FramePipelineStage*)> function_;
+  std::thread thread_;
+};
+
+
+// Runs processing stages for a sequence of frames in parallel, with bounded
+// queues between the stages. While one stage processes a frame, the previous
+// stages can already work on the following frames. Each stage function
+// typically loops over the frames, popping its input from the queues of the
+// previous stages and pushing its output to the queues of the following ones.
+// Queues can also point backwards to return buffers for re-use.
+// 
+// When a stage function returns, all queues which it was registered with are
+// closed. Thus, after the first stage returned, the following stages finish the
+// remaining items and return in turn, and if a stage stops early, the others
+// stop as well since they cannot push or pop anymore. Pushing to a backward
+// queue thus fails once the stage which pops from it returned, which usually
+// should not stop the pushing stage.
+// 
+// Example:
+//   FramePipeline pipeline;
+//   FramePipelineQueue<int>* queue = pipeline.AddQueue<int>("numbers", 4);
+//   pipeline.AddStage("producer", {queue}, [&](FramePipelineStage* stage) {
+//     for (int i = 0; i < 100; ++ i) {
+//       if (!stage->Push(queue, int(i))) { return; }
+//     }
+//   });
+//   pipeline.AddStage("consumer", {queue}, [&](FramePipelineStage* stage) {
+//     int number;
+//     while (stage->Pop(queue, &number)) { ... }
+//   });
+//   pipeline.Start();
+//   pipeline.Wait();
+//   pipeline.LogStatistics();
+class FramePipeline {
+ public:
+  FramePipeline();
+  
+  // Closes all queues and waits for the stages to return.
+  ~FramePipeline();
+  
+  // Creates a queue with the given capacity (which must be at least 1). The
+  // queue is owned by the pipeline.
+  template <typename T>
+  FramePipelineQueue<T>* AddQueue(const std::string& name, usize capacity) {
+    FramePipelineQueue<T>* queue = new FramePipelineQueue<T>(name, capacity);
+    queues_.emplace_back(queue);
+    return queue;
+  }
+  
+  // Adds a stage which runs function on its own thread once Start() is called.
+  // queues must contain all queues which the function pushes to or pops from.
+  // They are closed when the function returns.
+  void AddStage(
+      const std::string& name,
+      const std::vector<FramePipelineQueueBase*>& queues,
+      const std::function<void(FramePipelineStage*)>& function);
+  
+  // Starts the threads of all stages.
+  void Start();
+  
+  // Closes all queues, which makes the stages return once they try to access
+  // one. Use this to stop the pipeline early.
+  void CloseQueues();
+  
+  // Waits for all stages to return.
+  void Wait();
+  
+  // Logs the time which each stage spent busy and waiting, and the depths of
+  // the queues. Must be called after Wait().
+  void LogStatistics() const;
+  
+  // Returns the time in seconds from Start() until the last stage returned.
+  inline double wall_seconds() const { return wall_seconds_; }
+  
+  inline const std::vector<std::unique_ptr<FramePipelineStage>>& stages() const { return stages_; }
+  inline const std::vector<std::unique_ptr<FramePipelineQueueBase>>& queues() const { return queues_; }
+  
+ private:
+  std::chrono::steady_clock::time_point start_time_;
+  double wall_seconds_;
+  bool started_;
+  
+  std::vector<std::unique_ptr<FramePipelineStage>> stages_;
+  std::vector<std::unique_ptr<FramePipelineQueueBase>> queues_;
+};
+
+}
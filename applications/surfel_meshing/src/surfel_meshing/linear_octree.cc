@@ -0,0 +1,481 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include "surfel_meshing/linear_octree.h"
+
+#include <algorithm>
+#include <cmath>
+
+#include <glog/logging.h>
+
+#include "surfel_meshing/octree_leaf_scan.h"
+
+namespace vis {
+
+namespace {
+// Spreads the lower 21 bits of value such that there are two zero bits
+// between each pair of adjacent bits.
+inline u64 SpreadMortonBits21(u64 value) {
+  value &= 0x1fffffull;
+  value = (value | (value << 32)) & 0x1f00000000ffffull;
+  value = (value | (value << 16)) & 0x1f0000ff0000ffull;
+  value = (value | (value << 8)) & 0x100f00f00f00f00full;
+  value = (value | (value << 4)) & 0x10c30c30c30c30c3ull;
+  value = (value | (value << 2)) & 0x1249249249249249ull;
+  return value;
+}
+
+// Inverse of SpreadMortonBits21(): gathers every third bit of value, starting
+// with the lowest bit.
+inline u32 CompactMortonBits21(u64 value) {
+  value &= 0x1249249249249249ull;
+  value = (value | (value >> 2)) & 0x10c30c30c30c30c3ull;
+  value = (value | (value >> 4)) & 0x100f00f00f00f00full;
+  value = (value | (value >> 8)) & 0x1f0000ff0000ffull;
+  value = (value | (value >> 16)) & 0x1f00000000ffffull;
+  value = (value | (value >> 32)) & 0x1fffffull;
+  return static_cast<u32>(value);
+}
+
+// Interleaves the bits of the grid coordinates. The bit order matches the
+// child ordering of OctreeNode (x in the lowest bit).
+inline u64 ComputeMortonKey(u32 x, u32 y, u32 z) {
+  return SpreadMortonBits21(x) |
+         (SpreadMortonBits21(y) << 1) |
+         (SpreadMortonBits21(z) << 2);
+}
+
+// Recursive neighbor search in the implicit octree given by the sorted keys.
+template <bool include_completed_surfels, bool include_free_surfels, typename SurfelAccess>
+struct LinearOctreeSearch {
+  inline LinearOctreeSearch(
+      const u64* keys,
+      const u32* surfel_indices,
+      bool has_removed_entries,
+      const Vec3f& grid_min,
+      float cell_extent,
+      usize max_surfels_per_node,
+      const Vec3f& position,
+      NeighborCollector* results,
+      const SurfelAccess& surfels)
+      : keys(keys),
+        surfel_indices(surfel_indices),
+        has_removed_entries(has_removed_entries),
+        grid_min(grid_min),
+        cell_extent(cell_extent),
+        max_surfels_per_node(max_surfels_per_node),
+        position(position),
+        results(results),
+        surfels(surfels) {}
+  
+  // Searches the entries [begin, end). These must be the entries of an
+  // (implicit) octree node. The search continues with the smallest node which
+  // contains all of them, thus skipping levels on which only one child is
+  // occupied.
+  void SearchNode(usize begin, usize end) {
+    u64 differing_bits = keys[begin] ^ keys[end - 1];
+    if (differing_bits == 0 || end - begin <= max_surfels_per_node) {
+      ScanEntries(begin, end);
+      return;
+    }
+    
+    // Determine the level of the smallest node containing the entries, and
+    // its minimum grid cell.
+    int level = (63 - __builtin_clzll(differing_bits)) / 3 + 1;
+    u64 key_base = keys[begin] & ~((1ull << (3 * level)) - 1);
+    u32 x = CompactMortonBits21(key_base);
+    u32 y = CompactMortonBits21(key_base >> 1);
+    u32 z = CompactMortonBits21(key_base >> 2);
+    
+    int child_level = level - 1;
+    u32 child_size = 1u << child_level;
+    u64 child_key_span = 1ull << (3 * child_level);
+    
+    // Compute the distances to the children which intersect the search
+    // sphere, locate their entry ranges (skipping empty children) and sort them
+    // by distance. The child boxes are enlarged by one grid cell to account for
+    // rounding in the key computation.
+    float child_distances_squared[8];
+    usize child_begin[8];
+    usize child_end[8];
+    int child_count = 0;
+    usize search_begin = begin;
+    for (int child_index = 0; child_index < 8; ++ child_index) {
+      u32 child_x = x + ((child_index & (1 << 0)) ? child_size : 0);
+      u32 child_y = y + ((child_index & (1 << 1)) ? child_size : 0);
+      u32 child_z = z + ((child_index & (1 << 2)) ? child_size : 0);
+      Vec3f child_min = grid_min + cell_extent * Vec3f(child_x - 1.f, child_y - 1.f, child_z - 1.f);
+      Vec3f child_max = grid_min + cell_extent * Vec3f(child_x + child_size + 1.f, child_y + child_size + 1.f, child_z + child_size + 1.f);
+      float distance_squared =
+          (position - position.cwiseMax(child_min).cwiseMin(child_max)).squaredNorm();
+      if (distance_squared > results->threshold()) {
+        continue;
+      }
+      
+      u64 child_key_base = key_base + child_index * child_key_span;
+      usize range_begin = std::lower_bound(keys + search_begin, keys + end, child_key_base) - keys;
+      usize range_end = std::lower_bound(keys + range_begin, keys + end, child_key_base + child_key_span) - keys;
+      search_begin = range_end;
+      if (range_begin == range_end) {
+        continue;
+      }
+      
+      int insert_index = child_count;
+      while (insert_index > 0 && child_distances_squared[insert_index - 1] > distance_squared) {
+        child_distances_squared[insert_index] = child_distances_squared[insert_index - 1];
+        child_begin[insert_index] = child_begin[insert_index - 1];
+        child_end[insert_index] = child_end[insert_index - 1];
+        -- insert_index;
+      }
+      child_distances_squared[insert_index] = distance_squared;
+      child_begin[insert_index] = range_begin;
+      child_end[insert_index] = range_end;
+      ++ child_count;
+    }
+    
+    for (int i = 0; i < child_count; ++ i) {
+      // The maximum distance may have decreased in the meantime.
+      if (child_distances_squared[i] > results->threshold() ||
+          (results->full() && child_distances_squared[i] >= results->threshold())) {
+        break;
+      }
+      SearchNode(child_begin[i], child_end[i]);
+    }
+  }
+  
+  void ScanEntries(usize begin, usize end) {
+    if (!has_removed_entries) {
+      AddSurfelsToResults<include_completed_surfels, include_free_surfels>(
+          surfel_indices + begin, end - begin, position, results, surfels);
+      return;
+    }
+    
+    // Skip the removed entries.
+    constexpr int kBufferSize = 8 * kLeafScanBlockSize;
+    u32 buffer[kBufferSize];
+    int buffer_count = 0;
+    for (usize i = begin; i < end; ++ i) {
+      if (surfel_indices[i] == LinearOctree::kRemovedIndex) {
+        continue;
+      }
+      buffer[buffer_count] = surfel_indices[i];
+      ++ buffer_count;
+      if (buffer_count == kBufferSize) {
+        AddSurfelsToResults<include_completed_surfels, include_free_surfels>(
+            buffer, buffer_count, position, results, surfels);
+        buffer_count = 0;
+      }
+    }
+    AddSurfelsToResults<include_completed_surfels, include_free_surfels>(
+        buffer, buffer_count, position, results, surfels);
+  }
+  
+  const u64* keys;
+  const u32* surfel_indices;
+  bool has_removed_entries;
+  Vec3f grid_min;
+  float cell_extent;
+  usize max_surfels_per_node;
+  Vec3f position;
+  NeighborCollector* results;
+  const SurfelAccess& surfels;
+};
+
+template <bool include_completed_surfels, bool include_free_surfels, typename SurfelAccess>
+void SearchLinearOctree(
+    const vector<u64>& keys,
+    const vector<u32>& surfel_indices,
+    bool has_removed_entries,
+    const vector<u32>& pending_surfels,
+    const Vec3f& grid_min,
+    float cell_extent,
+    usize max_surfels_per_node,
+    const Vec3f& position,
+    NeighborCollector* results,
+    const SurfelAccess& surfels) {
+  // The pending surfels are searched by brute force.
+  AddSurfelsToResults<include_completed_surfels, include_free_surfels>(
+      pending_surfels.data(), pending_surfels.size(), position, results, surfels);
+  
+  if (!keys.empty()) {
+    LinearOctreeSearch<include_completed_surfels, include_free_surfels, SurfelAccess> search(
+        keys.data(), surfel_indices.data(), has_removed_entries, grid_min,
+        cell_extent, max_surfels_per_node, position, results, surfels);
+    search.SearchNode(0, keys.size());
+  }
+}
+}  // namespace
+
+
+constexpr u32 LinearOctree::kRemovedIndex;
+constexpr u64 LinearOctree::kNoKey;
+constexpr u64 LinearOctree::kPendingKey;
+constexpr usize LinearOctree::kMaxLazyChangeCount;
+
+LinearOctree::LinearOctree(
+    usize max_surfels_per_node,
+    std::vector<Surfel>* surfels,
+    const SurfelArrays* surfel_arrays,
+    float finest_cell_extent) {
+  removed_count_ = 0;
+  grid_min_ = Vec3f::Zero();
+  cell_extent_ = finest_cell_extent;
+  grid_initialized_ = false;
+  max_surfels_per_node_ = max_surfels_per_node;
+  surfels_ = surfels;
+  surfel_arrays_ = surfel_arrays;
+}
+
+void LinearOctree::AddSurfel(u32 surfel_index, Surfel* /*surfel*/) {
+  if (surfel_index >= surfel_keys_.size()) {
+    surfel_keys_.resize(surfel_index + 1, kNoKey);
+    surfel_pending_index_.resize(surfel_index + 1);
+  }
+  
+  surfel_keys_[surfel_index] = kPendingKey;
+  surfel_pending_index_[surfel_index] = pending_surfels_.size();
+  pending_surfels_.push_back(surfel_index);
+}
+
+void LinearOctree::RemoveSurfel(u32 surfel_index) {
+  u64 key = surfel_keys_[surfel_index];
+  if (key == kPendingKey) {
+    RemovePendingSurfel(surfel_index);
+  } else if (key != kNoKey) {
+    RemoveSortedEntry(key, surfel_index);
+  } else {
+    LOG(ERROR) << "RemoveSurfel() called for a surfel which is not in the octree: " << surfel_index;
+    return;
+  }
+  surfel_keys_[surfel_index] = kNoKey;
+}
+
+void LinearOctree::MoveSurfelImpl(u32 surfel_index, const Vec3f& new_pos) {
+  u64 key = surfel_keys_[surfel_index];
+  if (key == kPendingKey) {
+    // The key is only computed once the surfel gets merged.
+    return;
+  }
+  
+  u32 x, y, z;
+  if (ComputeGridCoordinates(new_pos, &x, &y, &z) &&
+      ComputeMortonKey(x, y, z) == key) {
+    // The surfel stays within its grid cell.
+    return;
+  }
+  
+  RemoveSortedEntry(key, surfel_index);
+  surfel_keys_[surfel_index] = kPendingKey;
+  surfel_pending_index_[surfel_index] = pending_surfels_.size();
+  pending_surfels_.push_back(surfel_index);
+}
+
+void LinearOctree::MergePendingSurfels() {
+  if (pending_surfels_.empty() && removed_count_ == 0) {
+    return;
+  }
+  
+  // Make sure that the grid contains all pending surfels. Surfels with
+  // non-finite positions are clamped to the grid instead.
+  for (u32 surfel_index : pending_surfels_) {
+    const Vec3f& position = surfels_->at(surfel_index).position();
+    if (!position.allFinite()) {
+      continue;
+    }
+    if (!grid_initialized_) {
+      grid_min_ = position - Vec3f::Constant(cell_extent_ * (1 << (kLevelCount - 1)));
+      grid_initialized_ = true;
+    }
+    u32 x, y, z;
+    if (!ComputeGridCoordinates(position, &x, &y, &z)) {
+      ExtendGridForPosition(position);
+    }
+  }
+  
+  // Sort the pending surfels.
+  pending_entries_.resize(pending_surfels_.size());
+  for (usize i = 0, size = pending_surfels_.size(); i < size; ++ i) {
+    u32 surfel_index = pending_surfels_[i];
+    pending_entries_[i] = make_pair(ComputeKey(surfels_->at(surfel_index).position()), surfel_index);
+  }
+  std::sort(pending_entries_.begin(), pending_entries_.end());
+  
+  // Merge them with the sorted entries, dropping removed entries.
+  merged_keys_.resize(keys_.size() - removed_count_ + pending_entries_.size());
+  merged_surfel_indices_.resize(merged_keys_.size());
+  usize output_index = 0;
+  usize pending_index = 0;
+  for (usize i = 0, size = keys_.size(); i < size; ++ i) {
+    if (surfel_indices_[i] == kRemovedIndex) {
+      continue;
+    }
+    while (pending_index < pending_entries_.size() &&
+           pending_entries_[pending_index].first < keys_[i]) {
+      merged_keys_[output_index] = pending_entries_[pending_index].first;
+      merged_surfel_indices_[output_index] = pending_entries_[pending_index].second;
+      surfel_keys_[pending_entries_[pending_index].second] = pending_entries_[pending_index].first;
+      ++ output_index;
+      ++ pending_index;
+    }
+    merged_keys_[output_index] = keys_[i];
+    merged_surfel_indices_[output_index] = surfel_indices_[i];
+    ++ output_index;
+  }
+  for (; pending_index < pending_entries_.size(); ++ pending_index) {
+    merged_keys_[output_index] = pending_entries_[pending_index].first;
+    merged_surfel_indices_[output_index] = pending_entries_[pending_index].second;
+    surfel_keys_[pending_entries_[pending_index].second] = pending_entries_[pending_index].first;
+    ++ output_index;
+  }
+  
+  keys_.swap(merged_keys_);
+  surfel_indices_.swap(merged_surfel_indices_);
+  removed_count_ = 0;
+  pending_surfels_.clear();
+}
+
+template <bool include_completed_surfels, bool include_free_surfels>
+int LinearOctree::FindNearestSurfelsWithinRadius(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) {
+  if (pending_surfels_.size() > kMaxLazyChangeCount ||
+      removed_count_ > std::max(kMaxLazyChangeCount, keys_.size() / 8)) {
+    MergePendingSurfels();
+  }
+  return FindNearestSurfelsWithinRadiusPassive<include_completed_surfels, include_free_surfels>(position, radius_squared, max_result_count, result_distances_squared, result_indices, sort_results);
+}
+
+template int LinearOctree::FindNearestSurfelsWithinRadius<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+template int LinearOctree::FindNearestSurfelsWithinRadius<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+template int LinearOctree::FindNearestSurfelsWithinRadius<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+template int LinearOctree::FindNearestSurfelsWithinRadius<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+
+template <bool include_completed_surfels, bool include_free_surfels>
+int LinearOctree::FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const {
+  NeighborCollector results(max_result_count, radius_squared, result_distances_squared, result_indices, sort_results);
+  
+  if (surfel_arrays_) {
+    SearchLinearOctree<include_completed_surfels, include_free_surfels>(
+        keys_, surfel_indices_, removed_count_ > 0, pending_surfels_, grid_min_,
+        cell_extent_, max_surfels_per_node_, position, &results,
+        SurfelArraysAccess(*surfel_arrays_));
+  } else {
+    SearchLinearOctree<include_completed_surfels, include_free_surfels>(
+        keys_, surfel_indices_, removed_count_ > 0, pending_surfels_, grid_min_,
+        cell_extent_, max_surfels_per_node_, position, &results,
+        SurfelObjectAccess(surfels_->data()));
+  }
+  
+  return results.size();
+}
+
+template int LinearOctree::FindNearestSurfelsWithinRadiusPassive<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int LinearOctree::FindNearestSurfelsWithinRadiusPassive<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int LinearOctree::FindNearestSurfelsWithinRadiusPassive<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int LinearOctree::FindNearestSurfelsWithinRadiusPassive<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+
+void LinearOctree::RemoveSortedEntry(u64 key, u32 surfel_index) {
+  for (usize i = std::lower_bound(keys_.begin(), keys_.end(), key) - keys_.begin(), size = keys_.size();
+       i < size && keys_[i] == key; ++ i) {
+    if (surfel_indices_[i] == surfel_index) {
+      surfel_indices_[i] = kRemovedIndex;
+      ++ removed_count_;
+      return;
+    }
+  }
+  LOG(ERROR) << "Did not find the entry of surfel " << surfel_index << " in the linear octree.";
+}
+
+void LinearOctree::RemovePendingSurfel(u32 surfel_index) {
+  u32 pending_index = surfel_pending_index_[surfel_index];
+  if (pending_index != pending_surfels_.size() - 1) {
+    u32 moved_surfel_index = pending_surfels_.back();
+    pending_surfels_[pending_index] = moved_surfel_index;
+    surfel_pending_index_[moved_surfel_index] = pending_index;
+  }
+  pending_surfels_.pop_back();
+}
+
+bool LinearOctree::ComputeGridCoordinates(const Vec3f& position, u32* x, u32* y, u32* z) const {
+  constexpr u32 kGridSize = 1u << kLevelCount;
+  float cell_extent_inv = 1.0f / cell_extent_;
+  u32* coordinates[3] = {x, y, z};
+  bool inside = true;
+  for (int d = 0; d < 3; ++ d) {
+    float grid_coordinate = (position.coeff(d) - grid_min_.coeff(d)) * cell_extent_inv;
+    if (!(grid_coordinate >= 0)) {  // Also catches NaN.
+      *coordinates[d] = 0;
+      inside = false;
+    } else if (grid_coordinate >= kGridSize) {
+      *coordinates[d] = kGridSize - 1;
+      inside = false;
+    } else {
+      *coordinates[d] = grid_coordinate;  // Round down in cast to int.
+    }
+  }
+  return inside;
+}
+
+u64 LinearOctree::ComputeKey(const Vec3f& position) const {
+  u32 x, y, z;
+  ComputeGridCoordinates(position, &x, &y, &z);
+  return ComputeMortonKey(x, y, z);
+}
+
+void LinearOctree::ExtendGridForPosition(const Vec3f& position) {
+  // Double the cell extent around the grid center until the position is
+  // contained.
+  Vec3f grid_center = grid_min_ + Vec3f::Constant(cell_extent_ * (1 << (kLevelCount - 1)));
+  u32 x, y, z;
+  do {
+    cell_extent_ *= 2;
+    grid_min_ = grid_center - Vec3f::Constant(cell_extent_ * (1 << (kLevelCount - 1)));
+  } while (!ComputeGridCoordinates(position, &x, &y, &z) &&
+           std::isfinite(cell_extent_));
+  
+  // Re-compute the keys of the sorted surfels and sort them again.
+  pending_entries_.clear();
+  for (usize i = 0, size = keys_.size(); i < size; ++ i) {
+    u32 surfel_index = surfel_indices_[i];
+    if (surfel_index != kRemovedIndex) {
+      pending_entries_.push_back(make_pair(ComputeKey(surfels_->at(surfel_index).position()), surfel_index));
+    }
+  }
+  std::sort(pending_entries_.begin(), pending_entries_.end());
+  
+  keys_.resize(pending_entries_.size());
+  surfel_indices_.resize(pending_entries_.size());
+  for (usize i = 0, size = pending_entries_.size(); i < size; ++ i) {
+    keys_[i] = pending_entries_[i].first;
+    surfel_indices_[i] = pending_entries_[i].second;
+    surfel_keys_[surfel_indices_[i]] = keys_[i];
+  }
+  removed_count_ = 0;
+}
+
+}
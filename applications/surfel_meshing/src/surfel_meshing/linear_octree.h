@@ -0,0 +1,215 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#pragma once
+
+#include <glog/logging.h>
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+
+#include "surfel_meshing/surfel.h"
+#include "surfel_meshing/surfel_arrays.h"
+
+namespace vis {
+
+// Linear octree over the surfels, as an alternative to CompressedOctree with
+// the same interface for adding, moving, removing and searching surfels.
+// 
+// Space is divided into a regular grid of 2^21 cells per axis, and each
+// surfel is assigned the Morton code (Z-order key) of its grid cell. The
+// surfels are stored in a single array sorted by this key. The octree is
+// implicit in this order: the surfels within any octree node form a
+// contiguous range of the array, which can be located by binary search. Thus,
+// there are no per-node allocations and the search traverses memory
+// linearly.
+// 
+// Keeping the array sorted on each change would be expensive. Changes are
+// therefore applied lazily:
+// - Added surfels (and surfels which move to a different grid cell) are
+//   appended to an unsorted list of pending surfels.
+// - Removed surfels are only marked as such in the sorted array.
+// The pending surfels are merged into the sorted array, and the removed
+// surfels are dropped from it, in MergePendingSurfels(). The active search
+// does this automatically once the pending surfels are not few anymore.
+// This makes the linear octree fast for workloads which make many changes
+// between the searches (such as surfel integration followed by meshing), but
+// slower than CompressedOctree for workloads which interleave single changes
+// and searches.
+// 
+// In contrast to CompressedOctree, the node pointers of the surfels are not
+// used. Triangles are not supported.
+class LinearOctree {
+ public:
+  // The finest grid cells have an extent of finest_cell_extent. The grid is
+  // centered on the first surfel that is added. If a surfel is added outside
+  // of the grid later, the cell extent is doubled as often as necessary (and
+  // all surfels are re-sorted). max_surfels_per_node determines when the
+  // search descends into the children of a node instead of scanning all of
+  // the node's surfels. If surfel_arrays is given, the neighbor searches read
+  // the surfel positions and meshing states from it instead of from the
+  // surfels.
+  LinearOctree(usize max_surfels_per_node,
+               std::vector<Surfel>* surfels,
+               const SurfelArrays* surfel_arrays = nullptr,
+               float finest_cell_extent = 0.0005f);
+  
+  
+  // Addition / removal / moving.
+  
+  // Adds the surfel to the list of pending surfels.
+  void AddSurfel(u32 surfel_index, Surfel* surfel);
+  
+  // Removes a surfel which was added before.
+  void RemoveSurfel(u32 surfel_index);
+  
+  // Updates the octree for the surfel's new position. The surfel may already
+  // have its new position assigned when this is called.
+  template <typename Derived>
+  inline void MoveSurfel(u32 surfel_index, Surfel* /*surfel*/, const MatrixBase<Derived>& new_pos) {
+    MoveSurfelImpl(surfel_index, new_pos);
+  }
+  
+  // Merges the pending surfels into the sorted array and drops the removed
+  // surfels from it. Useful before using the passive search variant.
+  void MergePendingSurfels();
+  
+  
+  // Queries.
+  
+  // Calls MergePendingSurfels() before searching if there are more than a few
+  // pending or removed surfels. The results are sorted by increasing distance
+  // if sort_results is true, and in unspecified order otherwise.
+  template <bool include_completed_surfels, bool include_free_surfels>
+  int FindNearestSurfelsWithinRadius(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results = true);
+  
+  // Version of FindNearestSurfelsWithinRadius() which leaves the octree
+  // constant. Pending surfels are searched by brute force. It may be called
+  // from multiple threads concurrently, as long as the octree is not modified
+  // meanwhile.
+  template <bool include_completed_surfels, bool include_free_surfels>
+  int FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results = true) const;
+  
+  
+  // Statistics and debugging.
+  
+  // Number of surfels in the octree (sorted and pending).
+  inline usize surfel_count() const { return keys_.size() - removed_count_ + pending_surfels_.size(); }
+  
+  inline usize pending_surfel_count() const { return pending_surfels_.size(); }
+  
+  inline float finest_cell_extent() const { return cell_extent_; }
+  
+  // Sorted Morton keys and the corresponding surfel indices. Removed entries
+  // have the index kRemovedIndex.
+  inline const vector<u64>& keys() const { return keys_; }
+  inline const vector<u32>& surfel_indices() const { return surfel_indices_; }
+  
+  // Marks removed entries in surfel_indices().
+  static constexpr u32 kRemovedIndex = 0xffffffffu;
+  
+  
+ private:
+  // Number of grid cells per axis is (1 << kLevelCount).
+  static constexpr int kLevelCount = 21;
+  
+  // Surfel-to-entry mapping marker for surfels which are not in the octree.
+  static constexpr u64 kNoKey = 0xffffffffffffffffull;
+  
+  // Surfel-to-entry mapping marker for surfels which are pending.
+  static constexpr u64 kPendingKey = 0xfffffffffffffffeull;
+  
+  // Maximum number of pending or removed surfels for which the active search
+  // does not call MergePendingSurfels().
+  static constexpr usize kMaxLazyChangeCount = 64;
+  
+  void MoveSurfelImpl(u32 surfel_index, const Vec3f& new_pos);
+  
+  // Marks the entry with the given key and surfel index as removed.
+  void RemoveSortedEntry(u64 key, u32 surfel_index);
+  
+  // Removes the surfel from pending_surfels_.
+  void RemovePendingSurfel(u32 surfel_index);
+  
+  // Computes the integer grid coordinates for the position. Returns false if
+  // the position is outside of the grid; in this case, the coordinates are
+  // clamped to the grid.
+  bool ComputeGridCoordinates(const Vec3f& position, u32* x, u32* y, u32* z) const;
+  
+  // Computes the Morton key for the position (clamped to the grid).
+  u64 ComputeKey(const Vec3f& position) const;
+  
+  // Enlarges the grid cells until the position is within the grid. Re-computes
+  // the keys of all sorted surfels.
+  void ExtendGridForPosition(const Vec3f& position);
+  
+  
+  // Sorted Morton keys of the surfels in the sorted array.
+  vector<u64> keys_;
+  
+  // Surfel indices corresponding to keys_, or kRemovedIndex.
+  vector<u32> surfel_indices_;
+  
+  // Number of entries in surfel_indices_ which are kRemovedIndex.
+  usize removed_count_;
+  
+  // Unsorted list of surfels which are not in keys_ / surfel_indices_ yet.
+  vector<u32> pending_surfels_;
+  
+  // For each surfel index: the key with which the surfel is stored in the
+  // sorted array, or kNoKey, or kPendingKey.
+  vector<u64> surfel_keys_;
+  
+  // For each pending surfel index: its index in pending_surfels_.
+  vector<u32> surfel_pending_index_;
+  
+  // Grid definition. The minimum corner of cell (x, y, z) is at
+  // grid_min_ + cell_extent_ * (x, y, z).
+  Vec3f grid_min_;
+  float cell_extent_;
+  bool grid_initialized_;
+  
+  // Maximum number of surfels in a node that are scanned without descending
+  // into the node's children.
+  usize max_surfels_per_node_;
+  
+  // List of surfels. Pointer to external data, not owned.
+  vector<Surfel>* surfels_;
+  
+  // Optional structure-of-arrays copy of the surfel attributes. Pointer to
+  // external data, not owned. May be null.
+  const SurfelArrays* surfel_arrays_;
+  
+  // Are used temporarily only, but cached here to avoid re-allocation.
+  vector<pair<u64, u32>> pending_entries_;
+  vector<u64> merged_keys_;
+  vector<u32> merged_surfel_indices_;
+};
+
+}
@@ -33,10 +33,12 @@
 #include <iomanip>
 #include <unordered_map>
 
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <cuda_runtime.h>
 #include <glog/logging.h>
 #include <libvis/command_line_parser.h>
+#include <libvis/depth_median_filter.h>
 #include <libvis/image_display.h>
 #include <libvis/libvis.h>
 #include <libvis/mesh_opengl.h>
@@ -45,12 +47,13 @@
 #include <libvis/point_cloud.h>
 #include <libvis/point_cloud_opengl.h>
 #include <libvis/render_window.h>
+#include <libvis/rgbd_sequence_file.h>
 #include <libvis/rgbd_video.h>
 #include <libvis/rgbd_video_io_tum_dataset.h>
+#include <libvis/rgbd_video_prefetcher.h>
 #include <libvis/shader_program_opengl.h>
 #include <libvis/sophus.h>
 #include <libvis/timing.h>
-#include <pcl/io/ply_io.h>
 #include <signal.h>
 #include <spline_library/splines/uniform_cr_spline.h>
 #if defined(WIN32) || defined(_Windows) || defined(_WINDOWS) || \
@@ -70,9 +73,12 @@
 #include "surfel_meshing/cuda_depth_processing.cuh"
 #include "surfel_meshing/cuda_surfel_reconstruction.cuh"
 #include "surfel_meshing/cuda_surfel_reconstruction.h"
+#include "surfel_meshing/depth_processing.h"
+#include "surfel_meshing/frame_pipeline.h"
 #include "surfel_meshing/surfel_meshing_render_window.h"
 #include "surfel_meshing/surfel.h"
 #include "surfel_meshing/surfel_meshing.h"
+#include "surfel_meshing/surfel_recording.h"
 
 using namespace vis;
 
@@ -134,20 +140,17 @@ struct FloatForSpline {
 };
 
 
-// Saves the reconstructed mesh as an OBJ file.
-bool SaveMeshAsOBJ(
+// Saves the reconstructed mesh. If the path ends with ".ply", the mesh is
+// streamed to a binary PLY file directly from the SurfelMeshing's surfel and
+// triangle arrays. Otherwise, it is converted to a Mesh3fCu8 and saved as an
+// OBJ file.
+bool SaveMesh(
     CUDASurfelReconstruction& reconstruction,
     SurfelMeshing& surfel_meshing,
     const std::string& export_mesh_path,
     cudaStream_t stream) {
   CHECK_EQ(surfel_meshing.surfels().size(), reconstruction.surfels_size());
   
-  shared_ptr<Mesh3fCu8> mesh(new Mesh3fCu8());
-  
-  // Also use the positions from the surfel_meshing such that positions
-  // and the mesh are from a consistent state.
-  surfel_meshing.ConvertToMesh3fCu8(mesh.get());
-  
   CUDABuffer<float> position_buffer(1, 3 * reconstruction.surfels_size());
   CUDABuffer<u8> color_buffer(1, 3 * reconstruction.surfels_size());
   reconstruction.ExportVertices(stream, &position_buffer, &color_buffer);
@@ -156,114 +159,78 @@ bool SaveMeshAsOBJ(
   position_buffer.DownloadAsync(stream, position_buffer_cpu);
   color_buffer.DownloadAsync(stream, color_buffer_cpu);
   cudaStreamSynchronize(stream);
-  usize index = 0;
-  CHECK_EQ(mesh->vertices()->size(), reconstruction.surfel_count());
-  for (usize i = 0; i < reconstruction.surfels_size(); ++ i) {
-    if (isnan(position_buffer_cpu[3 * i + 0])) {
-      continue;
+  
+  bool success;
+  if (boost::algorithm::ends_with(export_mesh_path, ".ply")) {
+    // The color buffer is indexed by surfel, like the surfels in
+    // surfel_meshing, so it can be passed on directly.
+    success = surfel_meshing.WriteMeshAsPLY(export_mesh_path.c_str(), color_buffer_cpu);
+  } else {
+    shared_ptr<Mesh3fCu8> mesh(new Mesh3fCu8());
+    
+    // Also use the positions from the surfel_meshing such that positions
+    // and the mesh are from a consistent state.
+    surfel_meshing.ConvertToMesh3fCu8(mesh.get());
+    
+    usize index = 0;
+    CHECK_EQ(mesh->vertices()->size(), reconstruction.surfel_count());
+    for (usize i = 0; i < reconstruction.surfels_size(); ++ i) {
+      if (isnan(position_buffer_cpu[3 * i + 0])) {
+        continue;
+      }
+      
+      Point3fC3u8* point = &(*mesh->vertices_mutable())->at(index);
+      point->color() = Vec3u8(color_buffer_cpu[3 * i + 0],
+                              color_buffer_cpu[3 * i + 1],
+                              color_buffer_cpu[3 * i + 2]);
+      ++ index;
     }
+    CHECK_EQ(index, mesh->vertices()->size());
+    
+    // DEBUG:
+    // CHECK(mesh->CheckIndexValidity());
     
-    Point3fC3u8* point = &(*mesh->vertices_mutable())->at(index);
-    point->color() = Vec3u8(color_buffer_cpu[3 * i + 0],
-                            color_buffer_cpu[3 * i + 1],
-                            color_buffer_cpu[3 * i + 2]);
-    ++ index;
+    success = mesh->WriteAsOBJ(export_mesh_path.c_str());
   }
-  CHECK_EQ(index, mesh->vertices()->size());
   delete[] color_buffer_cpu;
   delete[] position_buffer_cpu;
   
-  // DEBUG:
-  // CHECK(mesh->CheckIndexValidity());
-  
-  if (mesh->WriteAsOBJ(export_mesh_path.c_str())) {
+  if (success) {
     LOG(INFO) << "Wrote " << export_mesh_path << ".";
-    return true;
   } else {
     LOG(ERROR) << "Writing the mesh failed.";
-    return false;
   }
+  return success;
 }
 
 
-// Saves the reconstructed surfels as a point cloud in PLY format.
+// Saves the reconstructed surfels as a point cloud with normals in binary PLY
+// format.
 bool SavePointCloudAsPLY(
     CUDASurfelReconstruction& reconstruction,
     SurfelMeshing& surfel_meshing,
     const std::string& export_point_cloud_path) {
   CHECK_EQ(surfel_meshing.surfels().size(), reconstruction.surfels_size());
   
-  Point3fC3u8Cloud cloud;
-  surfel_meshing.ConvertToPoint3fC3u8Cloud(&cloud);
-  
-  pcl::PointCloud<pcl::PointNormal>::Ptr pcl_cloud(new pcl::PointCloud<pcl::PointNormal>());
-  pcl_cloud->resize(cloud.size());
-  usize index = 0;
-  for (usize i = 0; i < cloud.size(); ++ i) {
-    pcl_cloud->at(i).x = cloud[i].position().x();
-    pcl_cloud->at(i).y = cloud[i].position().y();
-    pcl_cloud->at(i).z = cloud[i].position().z();
-    while (surfel_meshing.surfels()[index].node() == nullptr) {
-      ++ index;
-    }
-    pcl_cloud->at(i).normal_x = surfel_meshing.surfels()[index].normal().x();
-    pcl_cloud->at(i).normal_y = surfel_meshing.surfels()[index].normal().y();
-    pcl_cloud->at(i).normal_z = surfel_meshing.surfels()[index].normal().z();
-    ++ index;
+  if (!surfel_meshing.WritePointCloudAsPLY(export_point_cloud_path.c_str())) {
+    LOG(ERROR) << "Writing the point cloud failed.";
+    return false;
   }
-  pcl::io::savePLYFileBinary(export_point_cloud_path, *pcl_cloud);
   LOG(INFO) << "Wrote " << export_point_cloud_path << ".";
   return true;
 }
 
 
-// Runs a median filter on the depth map to perform denoising and fill-in.
-void MedianFilterAndDensifyDepthMap(const Image<u16>& input, Image<u16>* output) {
-  vector<u16> values;
+// Images of a frame, passed from the loading stage to the main loop.
+struct LoadedFrame {
+  usize frame_index;
   
-  constexpr int kRadius = 1;
-  constexpr int kMinNeighbors = 2;
+  // Median-filtered or downscaled, if requested.
+  shared_ptr<Image<u16>> depth_image;
   
-  for (int y = 0; y < static_cast<int>(input.height()); ++ y) {
-    for (int x = 0; x < static_cast<int>(input.width()); ++ x) {
-      values.clear();
-      
-      int dy_end = std::min<int>(input.height() - 1, y + kRadius);
-      for (int dy = std::max<int>(0, static_cast<int>(y) - kRadius);
-           dy <= dy_end;
-           ++ dy) {
-        int dx_end = std::min<int>(input.width() - 1, x + kRadius);
-        for (int dx = std::max<int>(0, static_cast<int>(x) - kRadius);
-             dx <= dx_end;
-             ++ dx) {
-          if (input(dx, dy) != 0) {
-            values.push_back(input(dx, dy));
-          }
-        }
-      }
-      
-      if (values.size() >= kMinNeighbors) {
-        std::sort(values.begin(), values.end());  // NOTE: slow, need to get center element only
-        if (values.size() % 2 == 0) {
-          // Take the element which is closer to the average.
-          float sum = 0;
-          for (u16 value : values) {
-            sum += value;
-          }
-          float average = sum / values.size();
-          
-          float prev_diff = std::fabs(values[values.size() / 2 - 1] - average);
-          float next_diff = std::fabs(values[values.size() / 2] - average);
-          (*output)(x, y) = (prev_diff < next_diff) ? values[values.size() / 2 - 1] : values[values.size() / 2];
-        } else {
-          (*output)(x, y) = values[values.size() / 2];
-        }
-      } else {
-        (*output)(x, y) = input(x, y);
-      }
-    }
-  }
-}
+  // Downscaled, if requested.
+  shared_ptr<Image<Vec3u8>> color_image;
+};
 
 
 int main(int argc, char** argv) {
@@ -324,6 +291,26 @@ int main(int argc, char** argv) {
       "--invert_quaternions",
       "Invert the quaternions loaded from the poses file.");
   
+  int prefetch_frame_count = 8;
+  cmd_parser.NamedParameter(
+      "--prefetch_frame_count", &prefetch_frame_count, /*required*/ false,
+      "Number of frames after the frames required for the current frame whose images are loaded ahead of time in the background.");
+  
+  int prefetch_threads = 2;
+  cmd_parser.NamedParameter(
+      "--prefetch_threads", &prefetch_threads, /*required*/ false,
+      "Number of threads used for loading images in the background. With 0, the images are loaded when they are required.");
+  
+  int prefetch_max_memory_mb = 1024;
+  cmd_parser.NamedParameter(
+      "--prefetch_max_memory_mb", &prefetch_max_memory_mb, /*required*/ false,
+      "Maximum memory in MiB for loaded images. Loading ahead of time stops if this is reached.");
+  
+  int pipeline_queue_size = 2;
+  cmd_parser.NamedParameter(
+      "--pipeline_queue_size", &pipeline_queue_size, /*required*/ false,
+      "Maximum number of frames which are loaded and median-filtered or downscaled on the CPU ahead of the frame which is processed on the GPU.");
+  
   // Surfel reconstruction parameters.
   int max_surfel_count = 20 * 1000 * 1000;  // 20 million.
   cmd_parser.NamedParameter(
@@ -380,6 +367,16 @@ int main(int argc, char** argv) {
       "--surfel_integration_active_window_size", &surfel_integration_active_window_size, /*required*/ false,
       "Number of frames which need to pass before a surfel becomes inactive. If there are no loop closures, set this to a value larger than the dataset frame count to disable surfel deactivation.");
   
+  int compaction_moves_per_frame = 0;
+  cmd_parser.NamedParameter(
+      "--compaction_moves_per_frame", &compaction_moves_per_frame, /*required*/ false,
+      "If positive, reclaims the entries of merged surfels by moving surfels from the end of the surfel buffer into them, with at most this many moves per surfel transfer. Unlike in SurfelMeshingBatch, the triangles are not compacted. With asynchronous meshing, the moves are only done while the meshing thread is idle, and the surfel display pauses until the mesh for the moved surfels is available.");
+  
+  float compaction_min_merged_fraction = 0.1f;
+  cmd_parser.NamedParameter(
+      "--compaction_min_merged_fraction", &compaction_min_merged_fraction, /*required*/ false,
+      "Surfels are only compacted if at least this fraction of the surfel entries belongs to merged surfels.");
+  
   // Meshing parameters.
   float max_angle_between_normals_deg = 90.0f;
   cmd_parser.NamedParameter(
@@ -409,10 +406,24 @@ int main(int argc, char** argv) {
       "--long_edge_tolerance_factor", &long_edge_tolerance_factor, /*required*/ false,
       "Tolerance factor over 'max_neighbor_search_range_increase_factor * surfel_radius' for deciding whether to remesh a triangle with long edges.");
   
+  int triangulation_threads = 1;
+  cmd_parser.NamedParameter(
+      "--triangulation_threads", &triangulation_threads, /*required*/ false,
+      "Number of threads used for triangulation. Should only affect the runtime (and the order in which surfels are triangulated).");
+  
+  float triangulation_budget_ms = 0;
+  cmd_parser.NamedParameter(
+      "--triangulation_budget_ms", &triangulation_budget_ms, /*required*/ false,
+      "If positive, limits the time for triangulating in each meshing iteration, such that meshes are output at a steady rate even after large changes. Queued surfels close to the camera are triangulated first, the rest is carried over to the next iteration.");
+  
   bool asynchronous_triangulation = !cmd_parser.Flag(
       "--synchronous_meshing",
       "Makes the meshing proceed synchronously to the surfel integration (instead of asynchronously).");
   
+  bool incremental_mesh_output = cmd_parser.Flag(
+      "--incremental_mesh_output",
+      "With asynchronous meshing, transfers only the changes to the mesh from the meshing thread to the renderer instead of the full mesh after each meshing iteration.");
+  
   bool full_meshing_every_frame = cmd_parser.Flag(
       "--full_meshing_every_frame",
       "Instead of partial remeshing, performs full meshing in every frame. Only implemented for using together with --synchronous_meshing.");
@@ -487,6 +498,15 @@ int main(int argc, char** argv) {
       "--point_radius_clamp_factor", &point_radius_clamp_factor, /*required*/ false,
       "Factor by which a point's radius can be larger than the distance to its closest neighbor (times sqrt(2)). Larger radii are clamped to this distance.");
   
+  bool cpu_depth_preprocessing = cmd_parser.Flag(
+      "--cpu_depth_preprocessing",
+      "Performs the depth preprocessing on the CPU instead of on the GPU. The results are uploaded to the GPU for surfel integration.");
+  
+  int depth_preprocessing_threads = DefaultDepthProcessingThreadCount();
+  cmd_parser.NamedParameter(
+      "--depth_preprocessing_threads", &depth_preprocessing_threads, /*required*/ false,
+      "Number of threads used for median filtering, and for the other depth preprocessing steps if --cpu_depth_preprocessing is given. Defaults to the number of hardware threads.");
+  
   // Octree parameters.
   int max_surfels_per_node = 50;
   cmd_parser.NamedParameter(
@@ -497,7 +517,9 @@ int main(int argc, char** argv) {
   std::string export_mesh_path;
   cmd_parser.NamedParameter(
       "--export_mesh", &export_mesh_path, /*required*/ false,
-      "Save the final mesh to the given path (as an OBJ file).");
+      "Save the final mesh to the given path. Paths ending in .ply are written as"
+      " binary PLY files, which is much faster than the OBJ format used"
+      " otherwise.");
   
   std::string export_point_cloud_path;
   cmd_parser.NamedParameter(
@@ -602,21 +624,37 @@ int main(int argc, char** argv) {
       "--log_timings", &timings_log_path, /*required*/ false,
       "Log the timings to the given file.");
   
+  std::string record_surfels_path;
+  cmd_parser.NamedParameter(
+      "--record_surfels", &record_surfels_path, /*required*/ false,
+      "Record the surfels which are passed to the meshing to the given file. The"
+      " recording can be replayed with SurfelMeshingReplay to benchmark the"
+      " meshing without a GPU.");
+  
   // Required input paths.
   string dataset_folder_path;
   cmd_parser.SequentialParameter(
       &dataset_folder_path, "dataset_folder_path", true,
-      "Path to the dataset in TUM RGB-D format.");
+      "Path to the dataset in TUM RGB-D format, or to an RGB-D sequence file created with SurfelMeshingConvertDataset.");
   
   string trajectory_filename;
   cmd_parser.SequentialParameter(
-      &trajectory_filename, "trajectory_filename", true,
-      "Filename of the trajectory file in TUM RGB-D format within the dataset_folder_path (for example, 'trajectory.txt').");
+      &trajectory_filename, "trajectory_filename", false,
+      "Filename of the trajectory file in TUM RGB-D format within the dataset_folder_path (for example, 'trajectory.txt'). Required for TUM RGB-D datasets, not used for RGB-D sequence files.");
   
   if (!cmd_parser.CheckParameters()) {
     return EXIT_FAILURE;
   }
   
+  if (pipeline_queue_size < 1) {
+    LOG(ERROR) << "--pipeline_queue_size must be at least 1.";
+    return EXIT_FAILURE;
+  }
+  if (pyramid_level > 0 && median_filter_and_densify_iterations > 0) {
+    LOG(ERROR) << "Simultaneous downscaling and median filtering of depth maps is not implemented.";
+    return EXIT_FAILURE;
+  }
+  
   
   // ### Initialization ###
   
@@ -632,8 +670,17 @@ int main(int argc, char** argv) {
   
   // Load dataset.
   RGBDVideo<Vec3u8, u16> rgbd_video;
+  shared_ptr<RGBDSequenceFile> sequence_file;
   
-  if (!ReadTUMRGBDDatasetAssociatedAndCalibrated(dataset_folder_path.c_str(), trajectory_filename.c_str(), &rgbd_video)) {
+  bool dataset_read = false;
+  if (boost::filesystem::is_regular_file(dataset_folder_path)) {
+    dataset_read = ReadRGBDSequenceFile(dataset_folder_path.c_str(), &rgbd_video, &sequence_file);
+  } else if (trajectory_filename.empty()) {
+    LOG(FATAL) << "The trajectory_filename must be given for TUM RGB-D datasets.";
+  } else {
+    dataset_read = ReadTUMRGBDDatasetAssociatedAndCalibrated(dataset_folder_path.c_str(), trajectory_filename.c_str(), &rgbd_video);
+  }
+  if (!dataset_read) {
     LOG(FATAL) << "Could not read dataset.";
   } else {
     CHECK_EQ(rgbd_video.depth_frames_mutable()->size(), rgbd_video.color_frames_mutable()->size());
@@ -683,6 +730,22 @@ int main(int argc, char** argv) {
     rgbd_video.depth_frames_mutable()->resize(end_frame);
   }
   
+  // Start loading images in the background.
+  RGBDVideoPrefetcher<Vec3u8, u16> prefetcher(
+      &rgbd_video, prefetch_threads, prefetch_max_memory_mb * 1024ull * 1024ull);
+  
+  // If the images are stored raw in an RGB-D sequence file and do not need to
+  // be processed on the CPU, they are copied directly from the file mapping
+  // into the page-locked upload buffers instead of going through the image
+  // caches.
+  bool upload_from_mapping =
+      sequence_file &&
+      pyramid_level == 0 &&
+      median_filter_and_densify_iterations == 0 &&
+      rgbd_video.frame_count() > 0 &&
+      sequence_file->depth_data(0) != nullptr &&
+      sequence_file->color_data(0) != nullptr;
+  
   // Handle keyframe recording or playback.
   std::ofstream keyframes_write_file;
   unique_ptr<UniformCRSpline<FloatForSpline>> offset_x_spline;
@@ -825,6 +888,13 @@ int main(int argc, char** argv) {
   std::vector<u16*> depth_buffers_pagelocked_cache;
   std::vector<CUDABufferPtr<u16>> depth_buffers_cache;
   
+  // Allocate CPU buffers for --cpu_depth_preprocessing.
+  unordered_map<int, shared_ptr<Image<u16>>> frame_index_to_depth_image;
+  Image<u16> cpu_filtered_depth_A(width, height);
+  Image<u16> cpu_filtered_depth_B(width, height);
+  Image<Vec2f> cpu_normals(width, height);
+  Image<float> cpu_radii(width, height);
+  
   // Initialize CUDA-OpenGL interoperation.
   OpenGLContext opengl_context;
   cudaGraphicsResource_t vertex_buffer_resource = nullptr;
@@ -855,6 +925,14 @@ int main(int argc, char** argv) {
       long_edge_tolerance_factor,
       regularization_frame_window_size,
       render_window);
+  surfel_meshing.SetTriangulationThreadCount(triangulation_threads);
+  surfel_meshing.SetTriangulationBudget(0.001 * triangulation_budget_ms);
+  
+  SurfelRecordingWriter surfel_recorder;
+  if (!record_surfels_path.empty() &&
+      !surfel_recorder.Open(record_surfels_path, SurfelRecordingEncoding::kZlib)) {
+    return EXIT_FAILURE;
+  }
   
   // Start background thread if using asynchronous meshing.
   unique_ptr<AsynchronousMeshing> triangulation_thread;
@@ -863,6 +941,8 @@ int main(int argc, char** argv) {
         &surfel_meshing,
         &cuda_surfels_cpu_buffers,
         !timings_log_path.empty(),
+        incremental_mesh_output,
+        surfel_recorder.is_open() ? &surfel_recorder : nullptr,
         render_window));
   }
   
@@ -884,13 +964,62 @@ int main(int argc, char** argv) {
   u32 latest_mesh_frame_index = 0;
   u32 latest_mesh_surfel_count = 0;
   usize latest_mesh_triangle_count = 0;
+  TriangleListDelta output_mesh_delta;  // kept here to re-use its memory
   bool triangulation_in_progress = false;
+  u32 latest_surfel_transfer_frame_index = 0;
+  // Whether surfels were moved by a compaction whose mesh was not received
+  // yet, and the frame index of that compaction.
+  bool awaiting_mesh_after_compaction = false;
+  u32 compaction_frame_index = 0;
   
   ostringstream timings_log;
   ostringstream meshing_timings_log;
   
   constexpr int kStatsLogInterval = 200;
   
+  // Unless the images are copied directly from the sequence file mapping, a
+  // loading stage waits for the images of the frames to be loaded and
+  // median-filters or downscales them. It runs ahead of the main loop on its
+  // own thread, such that this CPU work overlaps with the GPU processing of
+  // the previous frames.
+  FramePipeline input_pipeline;
+  FramePipelineQueue<LoadedFrame>* loaded_frames =
+      input_pipeline.AddQueue<LoadedFrame>("loaded_frames", pipeline_queue_size);
+  if (!upload_from_mapping) {
+    input_pipeline.AddStage("loading", {loaded_frames}, [&](FramePipelineStage* stage) {
+      for (usize frame_index = start_frame; frame_index < rgbd_video.frame_count(); ++ frame_index) {
+        prefetcher.WaitForFrame(frame_index);
+        
+        LoadedFrame frame;
+        frame.frame_index = frame_index;
+        ImageFramePtr<u16, SE3f> depth_frame = rgbd_video.depth_frame_mutable(frame_index);
+        ImageFramePtr<Vec3u8, SE3f> color_frame = rgbd_video.color_frame_mutable(frame_index);
+        if (pyramid_level == 0) {
+          // Perform median filtering and densification.
+          // TODO: Do this on the GPU for better performance.
+          frame.depth_image = depth_frame->GetImage();
+          for (int iteration = 0; iteration < median_filter_and_densify_iterations; ++ iteration) {
+            shared_ptr<Image<u16>> filtered_image(new Image<u16>());
+            MedianFilterAndDensifyDepthMap(*frame.depth_image, filtered_image.get(), depth_preprocessing_threads);
+            frame.depth_image = filtered_image;
+          }
+          frame.color_image = color_frame->GetImage();
+        } else {
+          frame.depth_image.reset(new Image<u16>(width, height));
+          depth_frame->GetImage()->DownscaleUsingMedianWhileExcluding(0, width, height, frame.depth_image.get());
+          frame.color_image = ImagePyramid(color_frame.get(), pyramid_level).GetOrComputeResult();
+        }
+        
+        if (!stage->Push(loaded_frames, std::move(frame))) {
+          return;
+        }
+      }
+    });
+    input_pipeline.Start();
+  }
+  unordered_map<usize, LoadedFrame> frame_index_to_loaded_frame;
+  usize next_loaded_frame_index = start_frame;
+  
   bool quit = false;
   for (usize frame_index = start_frame; frame_index < rgbd_video.frame_count() - outlier_filtering_frame_count / 2 && !quit; ++ frame_index) {
     Timer frame_rate_timer("");  // "Frame rate timer (with I/O!)"
@@ -898,13 +1027,23 @@ int main(int argc, char** argv) {
     
     // ### Input data loading ###
     
-    // Since we do not want to measure the time for disk I/O, pre-load the
-    // new images for this frame from disk here before starting the frame timer.
-    if (frame_index + outlier_filtering_frame_count / 2 + 1 < rgbd_video.frame_count()) {
-      rgbd_video.depth_frame_mutable(frame_index + outlier_filtering_frame_count / 2 + 1)->GetImage();
-    }
-    if (frame_index + 1 < rgbd_video.frame_count()) {
-      rgbd_video.color_frame_mutable(frame_index + 1)->GetImage();
+    // Since we do not want to measure the time for disk I/O, make sure that
+    // the images required for this frame are loaded before starting the frame
+    // timer. Also request the following frames to be loaded in the background.
+    usize last_required_frame_index =
+        std::min(rgbd_video.frame_count() - 1, frame_index + outlier_filtering_frame_count / 2 + 1);
+    if (upload_from_mapping) {
+      sequence_file->Prefetch(frame_index, last_required_frame_index + 1 + prefetch_frame_count);
+    } else {
+      prefetcher.Prefetch(frame_index, last_required_frame_index + 1 + prefetch_frame_count);
+      while (next_loaded_frame_index <= last_required_frame_index) {
+        LoadedFrame frame;
+        if (!loaded_frames->Pop(&frame)) {
+          LOG(FATAL) << "The loading stage stopped unexpectedly.";
+        }
+        next_loaded_frame_index = frame.frame_index + 1;
+        frame_index_to_loaded_frame[frame.frame_index] = std::move(frame);
+      }
     }
     
     ConditionalTimer complete_frame_timer("[Integration frame - measured on CPU]");
@@ -913,7 +1052,7 @@ int main(int argc, char** argv) {
     
     // Upload all frames up to (frame_index + outlier_filtering_frame_count / 2) to the GPU.
     for (usize test_frame_index = frame_index;
-         test_frame_index <= std::min(rgbd_video.frame_count() - 1, frame_index + outlier_filtering_frame_count / 2 + 1);
+         test_frame_index <= last_required_frame_index;
          ++ test_frame_index) {
       if (frame_index_to_depth_buffer.count(test_frame_index)) {
         continue;
@@ -934,59 +1073,48 @@ int main(int argc, char** argv) {
         depth_buffers_cache.pop_back();
       }
       
-      // Perform median filtering and densification.
-      // TODO: Do this on the GPU for better performance.
-      const Image<u16>* depth_map = rgbd_video.depth_frame_mutable(test_frame_index)->GetImage().get();
-      Image<u16> temp_depth_map;
-      Image<u16> temp_depth_map_2;
-      for (int iteration = 0; iteration < median_filter_and_densify_iterations; ++ iteration) {
-        Image<u16>* target_depth_map = (depth_map == &temp_depth_map) ? &temp_depth_map_2 : &temp_depth_map;
-        
-        target_depth_map->SetSize(depth_map->size());
-        MedianFilterAndDensifyDepthMap(*depth_map, target_depth_map);
-        
-        depth_map = target_depth_map;
-      }
-      
-      if (pyramid_level == 0) {
+      if (upload_from_mapping) {
+        const u16* mapped_depth_data = sequence_file->depth_data(test_frame_index);
         memcpy(*pagelocked_ptr,
-               depth_map->data(),
+               mapped_depth_data,
                height * width * sizeof(u16));
-      } else {
-        if (median_filter_and_densify_iterations > 0) {
-          LOG(ERROR) << "Simultaneous downscaling and median filtering of depth maps is not implemented.";
-          return EXIT_FAILURE;
+        if (cpu_depth_preprocessing) {
+          frame_index_to_depth_image[test_frame_index].reset(new Image<u16>(width, height, mapped_depth_data));
         }
-        
-        Image<u16> downscaled_image(width, height);
-        rgbd_video.depth_frame_mutable(test_frame_index)->GetImage()->DownscaleUsingMedianWhileExcluding(0, width, height, &downscaled_image);
+      } else {
+        const shared_ptr<Image<u16>>& depth_image = frame_index_to_loaded_frame.at(test_frame_index).depth_image;
         
         // DEBUG: Show downsampled image.
-        if (debug_depth_preprocessing) {
+        if (pyramid_level > 0 && debug_depth_preprocessing) {
           downscaled_depth_display->Update(
-              downscaled_image, "downscaled depth", static_cast<u16>(0),
+              *depth_image, "downscaled depth", static_cast<u16>(0),
               static_cast<u16>(depth_scaling * max_depth));
         }
         
         memcpy(*pagelocked_ptr,
-               downscaled_image.data(),
+               depth_image->data(),
                height * width * sizeof(u16));
+        if (cpu_depth_preprocessing) {
+          frame_index_to_depth_image[test_frame_index] = depth_image;
+        }
       }
       cudaEventRecord(depth_image_upload_pre_event, upload_stream);
-      (*buffer_ptr)->UploadAsync(upload_stream, *pagelocked_ptr);
+      if (!cpu_depth_preprocessing) {
+        (*buffer_ptr)->UploadAsync(upload_stream, *pagelocked_ptr);
+      }
       cudaEventRecord(depth_image_upload_post_event, upload_stream);
     }
     
     // Swap color image pointers and upload the next color frame to the GPU.
     std::swap(next_color_buffer, color_buffer);
     std::swap(next_color_buffer_pagelocked, color_buffer_pagelocked);
-    if (pyramid_level == 0) {
+    if (upload_from_mapping) {
       memcpy(next_color_buffer_pagelocked,
-             rgbd_video.color_frame_mutable(frame_index + 1)->GetImage()->data(),
+             sequence_file->color_data(frame_index + 1),
              width * height * sizeof(Vec3u8));
     } else {
       memcpy(next_color_buffer_pagelocked,
-             ImagePyramid(rgbd_video.color_frame_mutable(frame_index + 1).get(), pyramid_level).GetOrComputeResult()->data(),
+             frame_index_to_loaded_frame.at(frame_index + 1).color_image->data(),
              width * height * sizeof(Vec3u8));
     }
     cudaEventRecord(color_image_upload_pre_event, upload_stream);
@@ -1019,184 +1147,285 @@ int main(int argc, char** argv) {
     
     cudaEventRecord(frame_start_event, stream);
     
-    CUDABufferPtr<u16> depth_buffer = frame_index_to_depth_buffer.at(frame_index);
-    
-    // Bilateral filtering and depth cutoff.
-    BilateralFilteringAndDepthCutoffCUDA(
-        stream,
-        bilateral_filter_sigma_xy,
-        bilateral_filter_sigma_depth_factor,
-        /*value_to_ignore*/ 0,
-        bilateral_filter_radius_factor,
-        depth_scaling * max_depth,
-        depth_valid_region_radius,
-        *depth_buffer,
-        &filtered_depth_buffer_A);
-    cudaEventRecord(bilateral_filtering_post_event, stream);
-    
-    // DEBUG: Show bilateral filtering result.
-    if (debug_depth_preprocessing) {
-      Image<u16> filtered_depth(width, height);
-      filtered_depth_buffer_A.DownloadAsync(stream, &filtered_depth);
-      cudaStreamSynchronize(stream);
-      static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
-      filtered_depth_display->Update(filtered_depth, "CUDA bilateral filtered and cutoff depth",
-                                     static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
-    }
-    
-    // Depth outlier filtering.
-    // Scale the poses to match the depth scaling. This is faster than scaling the depths of all pixels to match the poses.
-    SE3f input_depth_frame_scaled_frame_T_global = input_depth_frame->frame_T_global();
-    input_depth_frame_scaled_frame_T_global.translation() = depth_scaling * input_depth_frame_scaled_frame_T_global.translation();
+    if (cpu_depth_preprocessing) {
+      // Perform the depth preprocessing on the CPU and upload the results.
+      // The CUDA events of the preprocessing steps are recorded after the
+      // upload, so the GPU timings of these steps are close to zero and
+      // measure the upload. The CPU time is measured separately.
+      ConditionalTimer cpu_preprocessing_timer("Depth preprocessing (CPU)");
+      const Image<u16>& input_depth = *frame_index_to_depth_image.at(frame_index);
+      
+      BilateralFilteringAndDepthCutoff(
+          bilateral_filter_sigma_xy,
+          bilateral_filter_sigma_depth_factor,
+          /*value_to_ignore*/ 0,
+          bilateral_filter_radius_factor,
+          depth_scaling * max_depth,
+          depth_valid_region_radius,
+          input_depth,
+          &cpu_filtered_depth_A,
+          depth_preprocessing_threads);
+      
+      // Scale the poses to match the depth scaling (as for the CUDA version below).
+      SE3f scaled_frame_T_global = input_depth_frame->frame_T_global();
+      scaled_frame_T_global.translation() = depth_scaling * scaled_frame_T_global.translation();
+      vector<const Image<u16>*> other_depth_images(outlier_filtering_frame_count);
+      vector<SE3f, Eigen::aligned_allocator<SE3f>> others_T_reference(outlier_filtering_frame_count);
+      for (int i = 0; i < outlier_filtering_frame_count; ++ i) {
+        int offset = i % (outlier_filtering_frame_count / 2) + 1;
+        int other_frame_index = (i < outlier_filtering_frame_count / 2) ? (frame_index - offset) : (frame_index + offset);
+        
+        other_depth_images[i] = frame_index_to_depth_image.at(other_frame_index).get();
+        SE3f global_T_other = rgbd_video.depth_frame_mutable(other_frame_index)->global_T_frame();
+        global_T_other.translation() = depth_scaling * global_T_other.translation();
+        others_T_reference[i] = (scaled_frame_T_global * global_T_other).inverse();
+      }
+      if (outlier_filtering_required_inliers == -1 ||
+          outlier_filtering_required_inliers == outlier_filtering_frame_count) {
+        OutlierDepthMapFusion(
+            outlier_filtering_depth_tolerance_factor,
+            cpu_filtered_depth_A,
+            depth_camera,
+            outlier_filtering_frame_count,
+            other_depth_images.data(),
+            others_T_reference.data(),
+            &cpu_filtered_depth_B,
+            depth_preprocessing_threads);
+      } else {
+        OutlierDepthMapFusion(
+            outlier_filtering_required_inliers,
+            outlier_filtering_depth_tolerance_factor,
+            cpu_filtered_depth_A,
+            depth_camera,
+            outlier_filtering_frame_count,
+            other_depth_images.data(),
+            others_T_reference.data(),
+            &cpu_filtered_depth_B,
+            depth_preprocessing_threads);
+      }
+      
+      if (depth_erosion_radius > 0) {
+        ErodeDepthMap(depth_erosion_radius, cpu_filtered_depth_B, &cpu_filtered_depth_A, depth_preprocessing_threads);
+      } else {
+        CopyWithoutBorder(cpu_filtered_depth_B, &cpu_filtered_depth_A, depth_preprocessing_threads);
+      }
+      
+      ComputeNormalsAndDropBadPixels(
+          observation_angle_threshold_deg,
+          depth_scaling,
+          depth_camera,
+          cpu_filtered_depth_A,
+          &cpu_filtered_depth_B,
+          &cpu_normals,
+          depth_preprocessing_threads);
+      
+      ComputePointRadiiAndRemoveIsolatedPixels(
+          point_radius_extension_factor,
+          point_radius_clamp_factor,
+          depth_scaling,
+          depth_camera,
+          cpu_filtered_depth_B,
+          &cpu_radii,
+          &cpu_filtered_depth_A,
+          depth_preprocessing_threads);
+      cpu_preprocessing_timer.Stop();
+      
+      // DEBUG: Show the preprocessing result.
+      if (debug_depth_preprocessing) {
+        static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
+        filtered_depth_display->Update(cpu_filtered_depth_A, "CPU preprocessed depth",
+                                       static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
+      }
+      
+      filtered_depth_buffer_A.UploadAsync(stream, cpu_filtered_depth_A);
+      normals_buffer.UploadPitchedAsync(stream, cpu_normals.stride(), reinterpret_cast<const float2*>(cpu_normals.data()));
+      radius_buffer.UploadAsync(stream, cpu_radii);
+      
+      cudaEventRecord(bilateral_filtering_post_event, stream);
+      cudaEventRecord(outlier_filtering_post_event, stream);
+      cudaEventRecord(depth_erosion_post_event, stream);
+      cudaEventRecord(normal_computation_post_event, stream);
+      cudaEventRecord(preprocessing_end_event, stream);
+    } else {
+      CUDABufferPtr<u16> depth_buffer = frame_index_to_depth_buffer.at(frame_index);
+      
+      // Bilateral filtering and depth cutoff.
+      BilateralFilteringAndDepthCutoffCUDA(
+          stream,
+          bilateral_filter_sigma_xy,
+          bilateral_filter_sigma_depth_factor,
+          /*value_to_ignore*/ 0,
+          bilateral_filter_radius_factor,
+          depth_scaling * max_depth,
+          depth_valid_region_radius,
+          *depth_buffer,
+          &filtered_depth_buffer_A);
+      cudaEventRecord(bilateral_filtering_post_event, stream);
+      
+      // DEBUG: Show bilateral filtering result.
+      if (debug_depth_preprocessing) {
+        Image<u16> filtered_depth(width, height);
+        filtered_depth_buffer_A.DownloadAsync(stream, &filtered_depth);
+        cudaStreamSynchronize(stream);
+        static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
+        filtered_depth_display->Update(filtered_depth, "CUDA bilateral filtered and cutoff depth",
+                                       static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
+      }
+      
+      // Depth outlier filtering.
+      // Scale the poses to match the depth scaling. This is faster than scaling the depths of all pixels to match the poses.
+      SE3f input_depth_frame_scaled_frame_T_global = input_depth_frame->frame_T_global();
+      input_depth_frame_scaled_frame_T_global.translation() = depth_scaling * input_depth_frame_scaled_frame_T_global.translation();
 #if defined(WIN32) || defined(_Windows) || defined(_WINDOWS) || \
-    defined(_WIN32) || defined(__WIN32__)
-    //const CUDABuffer<u16>* other_depths[outlier_filtering_frame_count];
-    //const CUDABuffer<u16>** other_depths = ALLOC_ON_STACK(CUDABuffer<u16>*, outlier_filtering_frame_count); //const cast error
-    const CUDABuffer<u16>** other_depths = (const CUDABuffer<u16>**)alloca(sizeof(CUDABuffer<u16>*)*outlier_filtering_frame_count);
-    //SE3f global_TR_others[outlier_filtering_frame_count];
-    SE3f* global_TR_others = ALLOC_ON_STACK(SE3f, outlier_filtering_frame_count);
-    //CUDAMatrix3x4 others_TR_reference[outlier_filtering_frame_count];
-    CUDAMatrix3x4* others_TR_reference = ALLOC_ON_STACK(CUDAMatrix3x4, outlier_filtering_frame_count);
+      defined(_WIN32) || defined(__WIN32__)
+      //const CUDABuffer<u16>* other_depths[outlier_filtering_frame_count];
+      //const CUDABuffer<u16>** other_depths = ALLOC_ON_STACK(CUDABuffer<u16>*, outlier_filtering_frame_count); //const cast error
+      const CUDABuffer<u16>** other_depths = (const CUDABuffer<u16>**)alloca(sizeof(CUDABuffer<u16>*)*outlier_filtering_frame_count);
+      //SE3f global_TR_others[outlier_filtering_frame_count];
+      SE3f* global_TR_others = ALLOC_ON_STACK(SE3f, outlier_filtering_frame_count);
+      //CUDAMatrix3x4 others_TR_reference[outlier_filtering_frame_count];
+      CUDAMatrix3x4* others_TR_reference = ALLOC_ON_STACK(CUDAMatrix3x4, outlier_filtering_frame_count);
 #else //linux
-    const CUDABuffer<u16>* other_depths[outlier_filtering_frame_count];
-    SE3f global_TR_others[outlier_filtering_frame_count];
-    CUDAMatrix3x4 others_TR_reference[outlier_filtering_frame_count];
+      const CUDABuffer<u16>* other_depths[outlier_filtering_frame_count];
+      SE3f global_TR_others[outlier_filtering_frame_count];
+      CUDAMatrix3x4 others_TR_reference[outlier_filtering_frame_count];
 #endif //_WIN32 & linux
-    for (int i = 0; i < outlier_filtering_frame_count / 2; ++ i) {
-      int offset = i + 1;
-      
-      other_depths[i] = frame_index_to_depth_buffer.at(frame_index - offset).get();
-      global_TR_others[i] = rgbd_video.depth_frame_mutable(frame_index - offset)->global_T_frame();
-      global_TR_others[i].translation() = depth_scaling * global_TR_others[i].translation();
-      others_TR_reference[i] = CUDAMatrix3x4((input_depth_frame_scaled_frame_T_global * global_TR_others[i]).inverse().matrix3x4());
+      for (int i = 0; i < outlier_filtering_frame_count / 2; ++ i) {
+        int offset = i + 1;
+        
+        other_depths[i] = frame_index_to_depth_buffer.at(frame_index - offset).get();
+        global_TR_others[i] = rgbd_video.depth_frame_mutable(frame_index - offset)->global_T_frame();
+        global_TR_others[i].translation() = depth_scaling * global_TR_others[i].translation();
+        others_TR_reference[i] = CUDAMatrix3x4((input_depth_frame_scaled_frame_T_global * global_TR_others[i]).inverse().matrix3x4());
+        
+        int k = outlier_filtering_frame_count / 2 + i;
+        other_depths[k] = frame_index_to_depth_buffer.at(frame_index + offset).get();
+        global_TR_others[k] = rgbd_video.depth_frame_mutable(frame_index + offset)->global_T_frame();
+        global_TR_others[k].translation() = depth_scaling * global_TR_others[k].translation();
+        others_TR_reference[k] = CUDAMatrix3x4((input_depth_frame_scaled_frame_T_global * global_TR_others[k]).inverse().matrix3x4());
+      }
       
-      int k = outlier_filtering_frame_count / 2 + i;
-      other_depths[k] = frame_index_to_depth_buffer.at(frame_index + offset).get();
-      global_TR_others[k] = rgbd_video.depth_frame_mutable(frame_index + offset)->global_T_frame();
-      global_TR_others[k].translation() = depth_scaling * global_TR_others[k].translation();
-      others_TR_reference[k] = CUDAMatrix3x4((input_depth_frame_scaled_frame_T_global * global_TR_others[k]).inverse().matrix3x4());
-    }
-    
-    if (outlier_filtering_required_inliers == -1 ||
-        outlier_filtering_required_inliers == outlier_filtering_frame_count) {
-      // Use a macro to pre-compile several versions of the template function.
-      #define CALL_OUTLIER_FUSION(other_frame_count) \
-          OutlierDepthMapFusionCUDA<other_frame_count + 1, u16>( \
-              stream, \
-              outlier_filtering_depth_tolerance_factor, \
-              filtered_depth_buffer_A, \
-              depth_camera, \
-              other_depths, \
-              others_TR_reference, \
-              &filtered_depth_buffer_B)
-      if (outlier_filtering_frame_count == 2) {
-        CALL_OUTLIER_FUSION(2);
-      } else if (outlier_filtering_frame_count == 4) {
-        CALL_OUTLIER_FUSION(4);
-      } else if (outlier_filtering_frame_count == 6) {
-        CALL_OUTLIER_FUSION(6);
-      } else if (outlier_filtering_frame_count == 8) {
-        CALL_OUTLIER_FUSION(8);
+      if (outlier_filtering_required_inliers == -1 ||
+          outlier_filtering_required_inliers == outlier_filtering_frame_count) {
+        // Use a macro to pre-compile several versions of the template function.
+        #define CALL_OUTLIER_FUSION(other_frame_count) \
+            OutlierDepthMapFusionCUDA<other_frame_count + 1, u16>( \
+                stream, \
+                outlier_filtering_depth_tolerance_factor, \
+                filtered_depth_buffer_A, \
+                depth_camera, \
+                other_depths, \
+                others_TR_reference, \
+                &filtered_depth_buffer_B)
+        if (outlier_filtering_frame_count == 2) {
+          CALL_OUTLIER_FUSION(2);
+        } else if (outlier_filtering_frame_count == 4) {
+          CALL_OUTLIER_FUSION(4);
+        } else if (outlier_filtering_frame_count == 6) {
+          CALL_OUTLIER_FUSION(6);
+        } else if (outlier_filtering_frame_count == 8) {
+          CALL_OUTLIER_FUSION(8);
+        } else {
+          LOG(FATAL) << "Unsupported value for outlier_filtering_frame_count: " << outlier_filtering_frame_count;
+        }
+        #undef CALL_OUTLIER_FUSION
       } else {
-        LOG(FATAL) << "Unsupported value for outlier_filtering_frame_count: " << outlier_filtering_frame_count;
+        // Use a macro to pre-compile several versions of the template function.
+        #define CALL_OUTLIER_FUSION(other_frame_count) \
+            OutlierDepthMapFusionCUDA<other_frame_count + 1, u16>( \
+                stream, \
+                outlier_filtering_required_inliers, \
+                outlier_filtering_depth_tolerance_factor, \
+                filtered_depth_buffer_A, \
+                depth_camera, \
+                other_depths, \
+                others_TR_reference, \
+                &filtered_depth_buffer_B)
+        if (outlier_filtering_frame_count == 2) {
+          CALL_OUTLIER_FUSION(2);
+        } else if (outlier_filtering_frame_count == 4) {
+          CALL_OUTLIER_FUSION(4);
+        } else if (outlier_filtering_frame_count == 6) {
+          CALL_OUTLIER_FUSION(6);
+        } else if (outlier_filtering_frame_count == 8) {
+          CALL_OUTLIER_FUSION(8);
+        } else {
+          LOG(FATAL) << "Unsupported value for outlier_filtering_frame_count: " << outlier_filtering_frame_count;
+        }
+        #undef CALL_OUTLIER_FUSION
       }
-      #undef CALL_OUTLIER_FUSION
-    } else {
-      // Use a macro to pre-compile several versions of the template function.
-      #define CALL_OUTLIER_FUSION(other_frame_count) \
-          OutlierDepthMapFusionCUDA<other_frame_count + 1, u16>( \
-              stream, \
-              outlier_filtering_required_inliers, \
-              outlier_filtering_depth_tolerance_factor, \
-              filtered_depth_buffer_A, \
-              depth_camera, \
-              other_depths, \
-              others_TR_reference, \
-              &filtered_depth_buffer_B)
-      if (outlier_filtering_frame_count == 2) {
-        CALL_OUTLIER_FUSION(2);
-      } else if (outlier_filtering_frame_count == 4) {
-        CALL_OUTLIER_FUSION(4);
-      } else if (outlier_filtering_frame_count == 6) {
-        CALL_OUTLIER_FUSION(6);
-      } else if (outlier_filtering_frame_count == 8) {
-        CALL_OUTLIER_FUSION(8);
+      cudaEventRecord(outlier_filtering_post_event, stream);
+      
+      // DEBUG: Show outlier filtering result.
+      if (debug_depth_preprocessing) {
+        Image<u16> filtered_depth(width, height);
+        filtered_depth_buffer_B.DownloadAsync(stream, &filtered_depth);
+        cudaStreamSynchronize(stream);
+        static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
+        filtered_depth_display->Update(filtered_depth, "CUDA outlier filtered depth",
+                                      static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
+      }
+      
+      // Depth map erosion.
+      if (depth_erosion_radius > 0) {
+        ErodeDepthMapCUDA(
+            stream,
+            depth_erosion_radius,
+            filtered_depth_buffer_B,
+            &filtered_depth_buffer_A);
       } else {
-        LOG(FATAL) << "Unsupported value for outlier_filtering_frame_count: " << outlier_filtering_frame_count;
+        CopyWithoutBorderCUDA(
+            stream,
+            filtered_depth_buffer_B,
+            &filtered_depth_buffer_A);
       }
-      #undef CALL_OUTLIER_FUSION
-    }
-    cudaEventRecord(outlier_filtering_post_event, stream);
-    
-    // DEBUG: Show outlier filtering result.
-    if (debug_depth_preprocessing) {
-      Image<u16> filtered_depth(width, height);
-      filtered_depth_buffer_B.DownloadAsync(stream, &filtered_depth);
-      cudaStreamSynchronize(stream);
-      static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
-      filtered_depth_display->Update(filtered_depth, "CUDA outlier filtered depth",
-                                    static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
-    }
-    
-    // Depth map erosion.
-    if (depth_erosion_radius > 0) {
-      ErodeDepthMapCUDA(
+      
+      cudaEventRecord(depth_erosion_post_event, stream);
+      
+      // DEBUG: Show erosion result.
+      if (debug_depth_preprocessing) {
+        Image<u16> filtered_depth(width, height);
+        filtered_depth_buffer_A.DownloadAsync(stream, &filtered_depth);
+        cudaStreamSynchronize(stream);
+        static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
+        filtered_depth_display->Update(filtered_depth, "CUDA eroded depth",
+                                       static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
+      }
+      
+      ComputeNormalsAndDropBadPixelsCUDA(
           stream,
-          depth_erosion_radius,
-          filtered_depth_buffer_B,
-          &filtered_depth_buffer_A);
-    } else {
-      CopyWithoutBorderCUDA(
+          observation_angle_threshold_deg,
+          depth_scaling,
+          depth_camera,
+          filtered_depth_buffer_A,
+          &filtered_depth_buffer_B,
+          &normals_buffer);
+      
+      cudaEventRecord(normal_computation_post_event, stream);
+      
+      // DEBUG: Show current depth map result.
+      if (debug_depth_preprocessing) {
+        Image<u16> filtered_depth(width, height);
+        filtered_depth_buffer_B.DownloadAsync(stream, &filtered_depth);
+        cudaStreamSynchronize(stream);
+        static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
+        filtered_depth_display->Update(filtered_depth, "CUDA bad normal dropped depth",
+                                        static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
+      }
+      
+      cudaEventRecord(preprocessing_end_event, stream);
+      
+      ComputePointRadiiAndRemoveIsolatedPixelsCUDA(
           stream,
+          point_radius_extension_factor,
+          point_radius_clamp_factor,
+          depth_scaling,
+          depth_camera,
           filtered_depth_buffer_B,
+          &radius_buffer,
           &filtered_depth_buffer_A);
     }
     
-    cudaEventRecord(depth_erosion_post_event, stream);
-    
-    // DEBUG: Show erosion result.
-    if (debug_depth_preprocessing) {
-      Image<u16> filtered_depth(width, height);
-      filtered_depth_buffer_A.DownloadAsync(stream, &filtered_depth);
-      cudaStreamSynchronize(stream);
-      static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
-      filtered_depth_display->Update(filtered_depth, "CUDA eroded depth",
-                                     static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
-    }
-    
-    ComputeNormalsAndDropBadPixelsCUDA(
-        stream,
-        observation_angle_threshold_deg,
-        depth_scaling,
-        depth_camera,
-        filtered_depth_buffer_A,
-        &filtered_depth_buffer_B,
-        &normals_buffer);
-    
-    cudaEventRecord(normal_computation_post_event, stream);
-    
-    // DEBUG: Show current depth map result.
-    if (debug_depth_preprocessing) {
-      Image<u16> filtered_depth(width, height);
-      filtered_depth_buffer_B.DownloadAsync(stream, &filtered_depth);
-      cudaStreamSynchronize(stream);
-      static shared_ptr<ImageDisplay> filtered_depth_display(new ImageDisplay());
-      filtered_depth_display->Update(filtered_depth, "CUDA bad normal dropped depth",
-                                      static_cast<u16>(0), static_cast<u16>(depth_scaling * max_depth));
-    }
-    
-    cudaEventRecord(preprocessing_end_event, stream);
-    
-    ComputePointRadiiAndRemoveIsolatedPixelsCUDA(
-        stream,
-        point_radius_extension_factor,
-        point_radius_clamp_factor,
-        depth_scaling,
-        depth_camera,
-        filtered_depth_buffer_B,
-        &radius_buffer,
-        &filtered_depth_buffer_A);
-    
     
     // ### Loop closures ###
     
@@ -1259,37 +1488,43 @@ int main(int argc, char** argv) {
     if (no_meshing_in_progress ||
         next_meshing_expected_soon ||
         (final_result_required && is_last_frame)) {
-      cudaEventRecord(surfel_transfer_start_event, stream);
-      if (asynchronous_triangulation) {
-        triangulation_thread->LockInputData();
+      // With asynchronous meshing, compact the surfels only if the meshing
+      // thread integrated all previous transfers and the displayed mesh was
+      // made for the latest one. The displayed mesh then refers to the surfel
+      // entries before the moves, so the surfel display is not updated until
+      // the mesh for the moved surfels arrives.
+      bool meshing_caught_up =
+          !asynchronous_triangulation ||
+          (triangulation_thread->all_work_done() &&
+           latest_mesh_frame_index == latest_surfel_transfer_frame_index &&
+           !awaiting_mesh_after_compaction);
+      if (compaction_moves_per_frame > 0 && meshing_caught_up &&
+          reconstruction.CompactSurfels(stream, compaction_moves_per_frame, compaction_min_merged_fraction) > 0) {
+        awaiting_mesh_after_compaction = asynchronous_triangulation;
+        compaction_frame_index = frame_index;
       }
-      cuda_surfels_cpu_buffers.LockWriteBuffers();
+      
+      cudaEventRecord(surfel_transfer_start_event, stream);
       
       reconstruction.TransferAllToCPU(
           stream,
           frame_index,
           &cuda_surfels_cpu_buffers);
+      latest_surfel_transfer_frame_index = frame_index;
       
       cudaEventRecord(surfel_transfer_end_event, stream);
       cudaStreamSynchronize(stream);
       
-      // Notify the triangulation thread about new input data.
-      // NOTE: It must be avoided to send this notification after the thread
-      //       has already started working on the input (due to a previous
-      //       notification), so do it while the write buffers are locked.
-      //       Otherwise, the thread might later continue its
-      //       next iteration before the write buffer was updated again,
-      //       resulting in wrong data being used, in particular many surfels
-      //       might be at (0, 0, 0).
+      // Hand the surfels over to the triangulation thread. This never waits
+      // for the thread; if it did not pick up the previous transfer yet, that
+      // one is superseded.
+      cuda_surfels_cpu_buffers.PublishWriteBuffers();
       if (asynchronous_triangulation) {
-        triangulation_thread->NotifyAboutNewInputSurfelsAlreadyLocked();
+        triangulation_thread->SetTriangulationFocus(input_depth_frame->global_T_frame().translation());
+        triangulation_thread->NotifyAboutNewInputSurfels();
       }
       triangulation_in_progress = true;
       
-      cuda_surfels_cpu_buffers.UnlockWriteBuffers();
-      if (asynchronous_triangulation) {
-        triangulation_thread->UnlockInputData();
-      }
       did_surfel_transfer = true;
     }
     cudaStreamSynchronize(stream);
@@ -1298,6 +1533,7 @@ int main(int argc, char** argv) {
     // Update the visualization if a new mesh is available.
     if (asynchronous_triangulation) {
       shared_ptr<Mesh3fCu8> output_mesh;
+      bool have_output_mesh_delta = false;
       
       if (final_result_required && is_last_frame) {
         // No need for efficiency here, use simple polling waiting
@@ -1312,30 +1548,49 @@ int main(int argc, char** argv) {
       // Get new mesh from the triangulation thread?
       u32 output_frame_index;
       u32 output_surfel_count;
-      triangulation_thread->GetOutput(&output_frame_index, &output_surfel_count, &output_mesh);
-      
-      if (output_mesh) {
-        // There is a new mesh.
-        latest_mesh_frame_index = output_frame_index;
-        latest_mesh_surfel_count = output_surfel_count;
-        latest_mesh_triangle_count = output_mesh->triangles().size();
+      if (incremental_mesh_output) {
+        have_output_mesh_delta = triangulation_thread->GetOutputDelta(
+            &output_frame_index, &output_surfel_count, &output_mesh_delta);
+        if (have_output_mesh_delta) {
+          // There are changes to the mesh.
+          latest_mesh_frame_index = output_frame_index;
+          latest_mesh_surfel_count = output_surfel_count;
+          latest_mesh_triangle_count = output_mesh_delta.triangle_count;
+        }
+      } else {
+        triangulation_thread->GetOutput(&output_frame_index, &output_surfel_count, &output_mesh);
+        
+        if (output_mesh) {
+          // There is a new mesh.
+          latest_mesh_frame_index = output_frame_index;
+          latest_mesh_surfel_count = output_surfel_count;
+          latest_mesh_triangle_count = output_mesh->triangles().size();
+        }
       }
       
-      // Update visualization.
+      // Update visualization. After a compaction, keep showing the previous
+      // surfels until the mesh refers to their new entries.
+      if (awaiting_mesh_after_compaction && latest_mesh_frame_index >= compaction_frame_index) {
+        awaiting_mesh_after_compaction = false;
+      }
       unique_lock<mutex> render_mutex_lock(render_window->render_mutex());
-      reconstruction.UpdateVisualizationBuffers(
-          stream,
-          frame_index,
-          latest_mesh_frame_index,
-          latest_mesh_surfel_count,
-          surfel_integration_active_window_size,
-          visualize_last_update_timestamp,
-          visualize_creation_timestamp,
-          visualize_radii,
-          visualize_surfel_normals);
-      render_window->UpdateVisualizationCloudCUDA(reconstruction.surfels_size(), latest_mesh_surfel_count);
+      if (!awaiting_mesh_after_compaction) {
+        reconstruction.UpdateVisualizationBuffers(
+            stream,
+            frame_index,
+            latest_mesh_frame_index,
+            latest_mesh_surfel_count,
+            surfel_integration_active_window_size,
+            visualize_last_update_timestamp,
+            visualize_creation_timestamp,
+            visualize_radii,
+            visualize_surfel_normals);
+        render_window->UpdateVisualizationCloudCUDA(reconstruction.surfels_size(), latest_mesh_surfel_count);
+      }
       if (output_mesh) {
         render_window->UpdateVisualizationMeshCUDA(output_mesh);
+      } else if (have_output_mesh_delta) {
+        render_window->UpdateVisualizationMeshDeltaCUDA(output_mesh_delta);
       }
       cudaStreamSynchronize(stream);
       render_mutex_lock.unlock();
@@ -1345,8 +1600,11 @@ int main(int argc, char** argv) {
       }
     } else {
       // Synchronous triangulation.
-      cuda_surfels_cpu_buffers.WaitForLockAndSwapBuffers();
+      CHECK(cuda_surfels_cpu_buffers.AcquireLatestBuffers());
       surfel_meshing.IntegrateCUDABuffers(frame_index, cuda_surfels_cpu_buffers);
+      if (surfel_recorder.is_open()) {
+        surfel_recorder.WriteSnapshot(cuda_surfels_cpu_buffers.read_buffers());
+      }
       
       if (full_meshing_every_frame) {
         double full_retriangulation_seconds = surfel_meshing.FullRetriangulation();
@@ -1361,6 +1619,7 @@ int main(int argc, char** argv) {
         double remeshing_seconds = check_remeshing_timer.Stop();
         
         ConditionalTimer triangulate_timer("Triangulate()");
+        surfel_meshing.SetTriangulationFocus(input_depth_frame->global_T_frame().translation());
         surfel_meshing.Triangulate();
         double meshing_seconds = triangulate_timer.Stop();
         
@@ -1368,6 +1627,10 @@ int main(int argc, char** argv) {
           timings_log << "frame " << frame_index << std::endl;
           timings_log << "-remeshing " << (1000 * remeshing_seconds) << std::endl;
           timings_log << "-meshing " << (1000 * meshing_seconds) << std::endl;
+          const OctreeNodePool& node_pool = surfel_meshing.octree().node_pool();
+          timings_log << "-octree_live_nodes " << node_pool.live_node_count() << std::endl;
+          timings_log << "-octree_peak_nodes " << node_pool.peak_node_count() << std::endl;
+          timings_log << "-octree_node_bytes " << node_pool.allocated_bytes() << std::endl;
         }
       }
       
@@ -1630,7 +1893,7 @@ int main(int argc, char** argv) {
           render_window->UpdateVisualizationMesh(visualization_mesh);
         } else if (key == 'p' || key == 'P') {
           // Save the mesh.
-          SaveMeshAsOBJ(reconstruction, surfel_meshing, export_mesh_path, stream);
+          SaveMesh(reconstruction, surfel_meshing, export_mesh_path, stream);
         } else if (key == 'k' || key == 'K') {
           // Record keyframe.
           Vec3f camera_free_orbit_offset;
@@ -1661,12 +1924,13 @@ int main(int argc, char** argv) {
     // Release frames which are no longer needed.
     int last_frame_in_window = frame_index - outlier_filtering_frame_count / 2;
     if (last_frame_in_window >= 0) {
-      rgbd_video.color_frame_mutable(last_frame_in_window)->ClearImageAndDerivedData();
-      rgbd_video.depth_frame_mutable(last_frame_in_window)->ClearImageAndDerivedData();
+      prefetcher.Release(last_frame_in_window);
       depth_buffers_pagelocked_cache.push_back(frame_index_to_depth_buffer_pagelocked.at(last_frame_in_window));
       frame_index_to_depth_buffer_pagelocked.erase(last_frame_in_window);
       depth_buffers_cache.push_back(frame_index_to_depth_buffer.at(last_frame_in_window));
       frame_index_to_depth_buffer.erase(last_frame_in_window);
+      frame_index_to_depth_image.erase(last_frame_in_window);
+      frame_index_to_loaded_frame.erase(last_frame_in_window);
     }
     
     // Restrict frame time.
@@ -1691,6 +1955,13 @@ int main(int argc, char** argv) {
     }
   }  // End of main loop
   
+  // Stop the loading stage in case that the loop was exited early.
+  if (!upload_from_mapping) {
+    input_pipeline.CloseQueues();
+    input_pipeline.Wait();
+    input_pipeline.LogStatistics();
+  }
+  
   
   // ### Save results and cleanup ###
   
@@ -1698,6 +1969,15 @@ int main(int argc, char** argv) {
     triangulation_thread->RequestExitAndWaitForIt();
   }
   
+  if (surfel_recorder.is_open() && surfel_recorder.Close()) {
+    LOG(INFO) << "Wrote " << record_surfels_path << ".";
+  }
+  
+  LOG(INFO) << "Surfel hand-off: " << cuda_surfels_cpu_buffers.published_snapshot_count() << " snapshots published, "
+            << cuda_surfels_cpu_buffers.dropped_snapshot_count() << " superseded, handoff latency mean "
+            << cuda_surfels_cpu_buffers.mean_handoff_latency_ms() << " ms, max "
+            << cuda_surfels_cpu_buffers.max_handoff_latency_ms() << " ms";
+  
   if (!timings_log_path.empty()) {
     FILE* file = fopen(timings_log_path.c_str(), "wb");
     string str = timings_log.str();
@@ -1705,6 +1985,13 @@ int main(int argc, char** argv) {
     fclose(file);
   }
   
+  // Finish the triangulation which was left over due to the budget. (The
+  // asynchronous meshing thread already did this if the final mesh is needed.)
+  if (!asynchronous_triangulation && surfel_meshing.remesh_backlog_size() > 0) {
+    surfel_meshing.SetTriangulationBudget(0);
+    surfel_meshing.Triangulate();
+  }
+  
   // Perform retriangulation at end?
   if (full_retriangulation_at_end) {
     surfel_meshing.FullRetriangulation();
@@ -1713,7 +2000,7 @@ int main(int argc, char** argv) {
   // Save the final mesh.
   if (!export_mesh_path.empty()) {
     LOG(INFO) << "Saving the final mesh ...";
-    SaveMeshAsOBJ(reconstruction, surfel_meshing, export_mesh_path, stream);
+    SaveMesh(reconstruction, surfel_meshing, export_mesh_path, stream);
   }
   
   // Save the final point cloud.
@@ -1755,6 +2042,10 @@ int main(int argc, char** argv) {
   
   // Print final timings.
   LOG(INFO) << Timing::print(kSortByTotal);
+  LOG(INFO) << "Image loading: " << prefetcher.hit_count() << " hits, "
+            << prefetcher.miss_count() << " misses, "
+            << prefetcher.eviction_count() << " evictions, peak memory "
+            << (prefetcher.peak_loaded_bytes() / (1024.0 * 1024.0)) << " MiB";
   
   return EXIT_SUCCESS;
 }
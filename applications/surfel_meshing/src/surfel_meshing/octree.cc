@@ -31,9 +31,15 @@
 
 #include "surfel_meshing/octree.h"
 
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
 #include <glog/logging.h>
 #include <libvis/timing.h>
 
+#include "surfel_meshing/octree_leaf_scan.h"
+
 namespace vis {
 
 usize OctreeNode::CountSurfelsRecursive() const {
@@ -47,14 +53,42 @@ usize OctreeNode::CountSurfelsRecursive() const {
 }
 
 
+OctreeNodePool::OctreeNodePool()
+    : used_in_last_block_(0),
+      free_list_(nullptr),
+      live_node_count_(0),
+      peak_node_count_(0) {}
+
+OctreeNodePool::~OctreeNodePool() {
+  if (live_node_count_ != 0) {
+    LOG(ERROR) << "OctreeNodePool destructed while " << live_node_count_ << " nodes are still allocated.";
+  }
+  for (OctreeNode* block : blocks_) {
+    Eigen::internal::aligned_free(block);
+  }
+}
+
+usize OctreeNodePool::allocated_bytes() const {
+  return blocks_.size() * kNodesPerBlock * sizeof(OctreeNode);
+}
+
+void OctreeNodePool::AllocateBlock() {
+  blocks_.push_back(static_cast<OctreeNode*>(
+      Eigen::internal::aligned_malloc(kNodesPerBlock * sizeof(OctreeNode))));
+  used_in_last_block_ = 0;
+}
+
+
 CompressedOctree::CompressedOctree(
     usize max_surfels_per_node,
     std::vector<Surfel>* surfels,
-    vector<SurfelTriangle>* triangles) {
+    vector<SurfelTriangle>* triangles,
+    const SurfelArrays* surfel_arrays) {
   root_ = nullptr;
   max_surfels_per_node_ = max_surfels_per_node;
   surfels_ = surfels;
   triangles_ = triangles;
+  surfel_arrays_ = surfel_arrays;
   
   numerical_issue_counter_ = 0;
 }
@@ -228,7 +262,7 @@ void CompressedOctree::AddSurfelActive(u32 surfel_index, Surfel* surfel) {
             if (level > 0) {
               // Create the new node on the level that was computed.
               int current_node_child_index;
-              current_node = node->CreateChild(level, bbox.min(), &current_node_child_index, /*add_as_child*/ true);
+              current_node = node->CreateChild(&node_pool_, level, bbox.min(), &current_node_child_index, /*add_as_child*/ true);
             }
           }
         }
@@ -252,7 +286,7 @@ void CompressedOctree::AddSurfelActive(u32 surfel_index, Surfel* surfel) {
     }
   } else {
     // Create a new leaf node in a previously unoccupied quarter.
-    OctreeNode* child = new OctreeNode(node->GetQuarterMidpoint(child_index),
+    OctreeNode* child = node_pool_.New(node->GetQuarterMidpoint(child_index),
                                        0.5f * node->half_extent);
     node->AddChild(child, child_index);
     
@@ -309,52 +343,16 @@ void CompressedOctree::RemoveTriangle(u32 triangle_index, const SurfelTriangle&
 #endif
 
 // Returns the next node, or nullptr if the caller should break out of the loop.
-template <bool include_completed_surfels, bool include_free_surfels>
+template <bool include_completed_surfels, bool include_free_surfels, typename SurfelAccess>
 inline OctreeNode* FindNearestSurfelsWithinRadiusImpl(
     OctreeNode* node,
     vector<OctreeNode*>& nodes_to_search,
     const Vec3f& position,
     float radius_squared,
-    int max_result_count,
-    float* result_distances_squared,
-    u32* result_indices,
-    int* result_count,
-    float* max_distance_squared,
-    const Surfel* surfels) {
+    NeighborCollector* results,
+    const SurfelAccess& surfels) {
   // Look for results in the current node.
-  for (usize node_surfel_index = 0, size = node->surfels.size();
-      node_surfel_index < size;
-      ++ node_surfel_index) {
-    u32 surfel_index = node->surfels[node_surfel_index];
-    if (!include_completed_surfels && surfels[surfel_index].meshing_state() == Surfel::MeshingState::kCompleted) {
-      continue;
-    }
-    if (!include_free_surfels && surfels[surfel_index].meshing_state() == Surfel::MeshingState::kFree) {
-      continue;
-    }
-    float distance_squared =
-        (surfels[surfel_index].position() - position).squaredNorm();
-    if (distance_squared <= *max_distance_squared) {
-      // Consider adding this to the results.
-      if (*result_count < max_result_count) {
-        ++ *result_count;
-      }
-      int i;
-      for (i = *result_count - 1; i > 0; -- i) {
-        if (result_distances_squared[i - 1] > distance_squared) {
-          result_distances_squared[i] = result_distances_squared[i - 1];
-          result_indices[i] = result_indices[i - 1];
-        } else {
-          break;
-        }
-      }
-      result_distances_squared[i] = distance_squared;
-      result_indices[i] = node->surfels[node_surfel_index];
-      if (*result_count == max_result_count) {
-        *max_distance_squared = result_distances_squared[max_result_count - 1];
-      }
-    }
-  }
+  AddSurfelsToResults<include_completed_surfels, include_free_surfels>(node->surfels.data(), node->surfels.size(), position, results, surfels);
   
   // Remember relevant child nodes other than the one in the same quarter as
   // the query point.
@@ -428,10 +426,46 @@ inline OctreeNode* FindNearestSurfelsWithinRadiusImpl(
   }
 }
 
+// Passive search within the subtree rooted at start_node. Continues with the
+// given results, which may already contain results from other nodes.
+template <bool include_completed_surfels, bool include_free_surfels, typename SurfelAccess>
+inline void FindNearestSurfelsWithinRadiusInSubtree(
+    OctreeNode* start_node,
+    vector<OctreeNode*>* nodes_to_search,
+    const Vec3f& position,
+    float radius_squared,
+    NeighborCollector* results,
+    const SurfelAccess& surfels) {
+  nodes_to_search->resize(1);
+  nodes_to_search->at(0) = start_node;
+  
+  // Iterate over the work stack.
+  while (!nodes_to_search->empty()) {
+    OctreeNode* node = nodes_to_search->back();
+    nodes_to_search->pop_back();
+    
+    // Can we skip this node?
+    if (results->full()) {
+      float dist_node_squared = (position - node->ClosestPointTo(position)).squaredNorm();
+      if (dist_node_squared >= results->threshold()) {
+        continue;
+      }
+    }
+    
+    // Find the smallest child node closest to the query point in this subtree,
+    // while remembering other nodes if they might contain relevant results.
+    while (true) {
+      node = FindNearestSurfelsWithinRadiusImpl<include_completed_surfels, include_free_surfels>(node, *nodes_to_search, position, radius_squared, results, surfels);
+      if (!node) {
+        break;
+      }
+    }
+  }
+}
+
 template <bool include_completed_surfels, bool include_free_surfels>
-int CompressedOctree::FindNearestSurfelsWithinRadius(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) {
-  int result_count = 0;
-  float max_distance_squared = radius_squared;
+int CompressedOctree::FindNearestSurfelsWithinRadius(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) {
+  NeighborCollector results(max_result_count, radius_squared, result_distances_squared, result_indices, sort_results);
   nodes_to_search_.resize(1);
   nodes_to_search_[0] = root_;
   
@@ -441,9 +475,9 @@ int CompressedOctree::FindNearestSurfelsWithinRadius(const Vec3f& position, floa
     nodes_to_search_.pop_back();
     
     // Can we skip this node?
-    if (result_count == max_result_count) {
+    if (results.full()) {
       float dist_node_squared = (position - node->ClosestPointTo(position)).squaredNorm();
-      if (dist_node_squared >= max_distance_squared) {
+      if (dist_node_squared >= results.threshold()) {
         continue;
       }
     }
@@ -458,63 +492,227 @@ int CompressedOctree::FindNearestSurfelsWithinRadius(const Vec3f& position, floa
         node = SortSurfelsInNodeDownwardsOneStep(node);
       }
       
-      node = FindNearestSurfelsWithinRadiusImpl<include_completed_surfels, include_free_surfels>(node, nodes_to_search_, position, radius_squared, max_result_count, result_distances_squared, result_indices, &result_count, &max_distance_squared, surfels_->data());
+      if (surfel_arrays_) {
+        node = FindNearestSurfelsWithinRadiusImpl<include_completed_surfels, include_free_surfels>(node, nodes_to_search_, position, radius_squared, &results, SurfelArraysAccess(*surfel_arrays_));
+      } else {
+        node = FindNearestSurfelsWithinRadiusImpl<include_completed_surfels, include_free_surfels>(node, nodes_to_search_, position, radius_squared, &results, SurfelObjectAccess(surfels_->data()));
+      }
       if (!node) {
         break;
       }
     }
   }
   
-  return result_count;
+  return results.size();
 }
 
-template int CompressedOctree::FindNearestSurfelsWithinRadius<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices);
-template int CompressedOctree::FindNearestSurfelsWithinRadius<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices);
-template int CompressedOctree::FindNearestSurfelsWithinRadius<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices);
-template int CompressedOctree::FindNearestSurfelsWithinRadius<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices);
+template int CompressedOctree::FindNearestSurfelsWithinRadius<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+template int CompressedOctree::FindNearestSurfelsWithinRadius<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+template int CompressedOctree::FindNearestSurfelsWithinRadius<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+template int CompressedOctree::FindNearestSurfelsWithinRadius<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results);
+
+template <bool include_completed_surfels, bool include_free_surfels>
+int CompressedOctree::FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const {
+  return FindNearestSurfelsWithinRadiusPassive<include_completed_surfels, include_free_surfels>(position, radius_squared, max_result_count, result_distances_squared, result_indices, &nodes_to_search_, sort_results);
+}
 
 template <bool include_completed_surfels, bool include_free_surfels>
-int CompressedOctree::FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) const {
-  int result_count = 0;
-  float max_distance_squared = radius_squared;
+int CompressedOctree::FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, vector<OctreeNode*>* nodes_to_search, bool sort_results) const {
+  if (!root_) {
+    return 0;
+  }
+  NeighborCollector results(max_result_count, radius_squared, result_distances_squared, result_indices, sort_results);
+  
+  if (surfel_arrays_) {
+    FindNearestSurfelsWithinRadiusInSubtree<include_completed_surfels, include_free_surfels>(root_, nodes_to_search, position, radius_squared, &results, SurfelArraysAccess(*surfel_arrays_));
+  } else {
+    FindNearestSurfelsWithinRadiusInSubtree<include_completed_surfels, include_free_surfels>(root_, nodes_to_search, position, radius_squared, &results, SurfelObjectAccess(surfels_->data()));
+  }
+  
+  return results.size();
+}
+
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, vector<OctreeNode*>* nodes_to_search, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, vector<OctreeNode*>* nodes_to_search, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, vector<OctreeNode*>* nodes_to_search, bool sort_results) const;
+template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, vector<OctreeNode*>* nodes_to_search, bool sort_results) const;
+
+// Spreads the lowest 10 bits of x such that there are two zero bits between
+// each pair of consecutive bits.
+inline u32 SpreadMortonBits(u32 x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+template <bool include_completed_surfels, bool include_free_surfels, typename SurfelAccess>
+void FindNearestSurfelsWithinRadiusBatchImpl(
+    OctreeNode* root,
+    usize query_count,
+    const Vec3f* positions,
+    const float* radii_squared,
+    int max_result_count,
+    int* result_counts,
+    float* result_distances_squared,
+    u32* result_indices,
+    int thread_count,
+    bool sort_results,
+    const SurfelAccess& surfels) {
+  // Number of consecutive queries (in Morton order) which are processed as a
+  // group, sharing the descent from the root to their common subtree.
+  constexpr usize kQueryGroupSize = 32;
+  
+  // Sort the queries along a Morton curve through the root node such that
+  // queries which are close in this order are also close in space.
+  constexpr float kMortonGridSize = 1024;
+  const float grid_scale = kMortonGridSize / (2 * root->half_extent);
+  vector<u64> query_order(query_count);
+  for (usize query_index = 0; query_index < query_count; ++ query_index) {
+    const Vec3f& position = positions[query_index];
+    u32 morton_code = 0;
+    for (int d = 0; d < 3; ++ d) {
+      float grid_coord = grid_scale * (position.coeff(d) - root->min.coeff(d));
+      u32 clamped_coord = (grid_coord > 0) ? static_cast<u32>(std::min(grid_coord, kMortonGridSize - 1)) : 0;
+      morton_code |= SpreadMortonBits(clamped_coord) << d;
+    }
+    query_order[query_index] = (static_cast<u64>(morton_code) << 32) | query_index;
+  }
+  std::sort(query_order.begin(), query_order.end());
+  
+  usize group_count = (query_count + kQueryGroupSize - 1) / kQueryGroupSize;
+  std::atomic<usize> next_group(0);
+  
+  auto process_groups = [&]() {
+    vector<OctreeNode*> nodes_to_search;
+    vector<const OctreeNode*> ancestors_with_surfels;
+    
+    while (true) {
+      usize group = next_group++;
+      if (group >= group_count) {
+        break;
+      }
+      usize group_begin = group * kQueryGroupSize;
+      usize group_end = std::min(group_begin + kQueryGroupSize, query_count);
+      
+      // Compute the bounding box of all search spheres in the group.
+      Vec3f box_min = Vec3f::Constant(std::numeric_limits<float>::infinity());
+      Vec3f box_max = Vec3f::Constant(-std::numeric_limits<float>::infinity());
+      for (usize i = group_begin; i < group_end; ++ i) {
+        u32 query_index = query_order[i] & 0xffffffff;
+        float radius = sqrtf(radii_squared[query_index]);
+        box_min = box_min.cwiseMin(positions[query_index] - Vec3f::Constant(radius));
+        box_max = box_max.cwiseMax(positions[query_index] + Vec3f::Constant(radius));
+      }
+      
+      // Descend to the smallest node which strictly contains the box. All
+      // results of the group's queries must be within this node's subtree or
+      // in the surfel lists of its ancestors (which are non-empty only if the
+      // surfels have not been sorted down yet).
+      ancestors_with_surfels.clear();
+      OctreeNode* start_node = root;
+      Vec3f box_center = 0.5f * (box_min + box_max);
+      while (true) {
+        OctreeNode* child = start_node->children[start_node->ComputeChildIndex(box_center)];
+        if (!child ||
+            !(child->min.x() < box_min.x() &&
+              child->min.y() < box_min.y() &&
+              child->min.z() < box_min.z() &&
+              box_max.x() < child->max.x() &&
+              box_max.y() < child->max.y() &&
+              box_max.z() < child->max.z())) {
+          break;
+        }
+        if (!start_node->IsEmpty()) {
+          ancestors_with_surfels.push_back(start_node);
+        }
+        start_node = child;
+      }
+      
+      // Perform the searches within the subtree.
+      for (usize i = group_begin; i < group_end; ++ i) {
+        u32 query_index = query_order[i] & 0xffffffff;
+        const Vec3f& position = positions[query_index];
+        float* query_distances_squared = result_distances_squared + query_index * max_result_count;
+        u32* query_indices = result_indices + query_index * max_result_count;
+        
+        NeighborCollector results(max_result_count, radii_squared[query_index], query_distances_squared, query_indices, sort_results);
+        for (const OctreeNode* ancestor : ancestors_with_surfels) {
+          AddSurfelsToResults<include_completed_surfels, include_free_surfels>(ancestor->surfels.data(), ancestor->surfels.size(), position, &results, surfels);
+        }
+        FindNearestSurfelsWithinRadiusInSubtree<include_completed_surfels, include_free_surfels>(start_node, &nodes_to_search, position, radii_squared[query_index], &results, surfels);
+        result_counts[query_index] = results.size();
+      }
+    }
+  };
+  
+  usize additional_thread_count = std::min<usize>(std::max(thread_count, 1) - 1, (group_count > 0) ? (group_count - 1) : 0);
+  vector<std::thread> threads;
+  threads.reserve(additional_thread_count);
+  for (usize t = 0; t < additional_thread_count; ++ t) {
+    threads.emplace_back(process_groups);
+  }
+  process_groups();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+template <bool include_completed_surfels, bool include_free_surfels>
+void CompressedOctree::FindNearestSurfelsWithinRadiusBatch(usize query_count, const Vec3f* positions, const float* radii_squared, int max_result_count, int* result_counts, float* result_distances_squared, u32* result_indices, int thread_count, bool sort_results) const {
+  if (!root_) {
+    for (usize query_index = 0; query_index < query_count; ++ query_index) {
+      result_counts[query_index] = 0;
+    }
+    return;
+  }
+  
+  if (surfel_arrays_) {
+    FindNearestSurfelsWithinRadiusBatchImpl<include_completed_surfels, include_free_surfels>(root_, query_count, positions, radii_squared, max_result_count, result_counts, result_distances_squared, result_indices, thread_count, sort_results, SurfelArraysAccess(*surfel_arrays_));
+  } else {
+    FindNearestSurfelsWithinRadiusBatchImpl<include_completed_surfels, include_free_surfels>(root_, query_count, positions, radii_squared, max_result_count, result_counts, result_distances_squared, result_indices, thread_count, sort_results, SurfelObjectAccess(surfels_->data()));
+  }
+}
+
+template void CompressedOctree::FindNearestSurfelsWithinRadiusBatch<false, false>(usize query_count, const Vec3f* positions, const float* radii_squared, int max_result_count, int* result_counts, float* result_distances_squared, u32* result_indices, int thread_count, bool sort_results) const;
+template void CompressedOctree::FindNearestSurfelsWithinRadiusBatch<false, true>(usize query_count, const Vec3f* positions, const float* radii_squared, int max_result_count, int* result_counts, float* result_distances_squared, u32* result_indices, int thread_count, bool sort_results) const;
+template void CompressedOctree::FindNearestSurfelsWithinRadiusBatch<true, false>(usize query_count, const Vec3f* positions, const float* radii_squared, int max_result_count, int* result_counts, float* result_distances_squared, u32* result_indices, int thread_count, bool sort_results) const;
+template void CompressedOctree::FindNearestSurfelsWithinRadiusBatch<true, true>(usize query_count, const Vec3f* positions, const float* radii_squared, int max_result_count, int* result_counts, float* result_distances_squared, u32* result_indices, int thread_count, bool sort_results) const;
+
+void CompressedOctree::SortAllSurfelsDownwards() {
+  if (!root_) {
+    return;
+  }
   nodes_to_search_.resize(1);
   nodes_to_search_[0] = root_;
   
-  // Iterate over the work stack.
   while (!nodes_to_search_.empty()) {
     OctreeNode* node = nodes_to_search_.back();
     nodes_to_search_.pop_back();
     
-    // Can we skip this node?
-    if (result_count == max_result_count) {
-      float dist_node_squared = (position - node->ClosestPointTo(position)).squaredNorm();
-      if (dist_node_squared >= max_distance_squared) {
-        continue;
-      }
+    if (node->surfels.size() > max_surfels_per_node_ ||
+        (!node->IsLeaf() && node->surfels.size() > 0)) {
+      node = SortSurfelsInNodeDownwardsOneStep(node);
     }
     
-    // Find the smallest child node closest to the query point in this subtree,
-    // while remembering other nodes if they might contain relevant results.
-    while (true) {
-      node = FindNearestSurfelsWithinRadiusImpl<include_completed_surfels, include_free_surfels>(node, nodes_to_search_, position, radius_squared, max_result_count, result_distances_squared, result_indices, &result_count, &max_distance_squared, surfels_->data());
-      if (!node) {
-        break;
+    for (int i = 0; i < 8; ++ i) {
+      if (node->children[i]) {
+        nodes_to_search_.push_back(node->children[i]);
       }
     }
   }
-  
-  return result_count;
 }
 
-template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<false, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) const;
-template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<false, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) const;
-template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<true, false>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) const;
-template int CompressedOctree::FindNearestSurfelsWithinRadiusPassive<true, true>(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) const;
-
 void CompressedOctree::FindNearestTrianglesViaSurfelsImpl(const Vec3f& position, float radius_squared, int max_surfel_count, vector<u32>* result_indices) {
   surfel_distances_squared_.resize(max_surfel_count);
   surfel_indices_.resize(max_surfel_count);
-  int surfel_count = FindNearestSurfelsWithinRadius<true, false>(position, radius_squared, max_surfel_count, surfel_distances_squared_.data(), surfel_indices_.data());
+  int surfel_count = FindNearestSurfelsWithinRadius<true, false>(position, radius_squared, max_surfel_count, surfel_distances_squared_.data(), surfel_indices_.data(), /*sort_results*/ false);
   
   result_indices->clear();
   result_indices->reserve(2 * surfel_count);
@@ -804,7 +1002,7 @@ void CompressedOctree::SortSurfelDownwards(OctreeNode* node, u32 surfel_index) {
     child_index = node->ComputeChildIndex(surfel->position());
     if (node->children[child_index] == nullptr) {
       // Create a new leaf node for the surfel.
-      OctreeNode* child = new OctreeNode(node->GetQuarterMidpoint(child_index),
+      OctreeNode* child = node_pool_.New(node->GetQuarterMidpoint(child_index),
                                          0.5f * node->half_extent);
       node->AddChild(child, child_index);
       child->AddSurfel(surfel_index, surfel);
@@ -907,7 +1105,7 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
     //   point(s) inside to have them separated from the other children.
     int child_index = node->ComputeChildIndex(bbox.min());
     if (!node->children[child_index]) {
-      OctreeNode* child = new OctreeNode(node->GetQuarterMidpoint(child_index),
+      OctreeNode* child = node_pool_.New(node->GetQuarterMidpoint(child_index),
                                          0.5f * node->half_extent);
       node->AddChild(child, child_index);
       
@@ -934,7 +1132,7 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
     // Create a new quarter leaf in the new intermediate node and insert all
     // surfels there.
     int new_node_child_index = new_node->ComputeChildIndex(bbox.min());
-    OctreeNode* child = new OctreeNode(new_node->GetQuarterMidpoint(new_node_child_index),
+    OctreeNode* child = node_pool_.New(new_node->GetQuarterMidpoint(new_node_child_index),
                                        0.5f * new_node->half_extent);
     // CHECK(new_node->children[new_node_child_index] == nullptr);
     new_node->AddChild(child, new_node_child_index);
@@ -988,7 +1186,7 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
       // Create the new node on the level that was computed.
       int current_node_child_index;
       current_node =
-          node->CreateChild(level, 0.5f * (bbox.min() + bbox.max()),
+          node->CreateChild(&node_pool_, level, 0.5f * (bbox.min() + bbox.max()),
                             &current_node_child_index, /*add_as_child*/ false);
       
       // Robustness check: Due to numerical issues it can happen that this tries
@@ -1000,7 +1198,7 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
       if (difference_factor > 0.75f && existing_child->Contains(current_node->midpoint)) {
         // Emergency handling: use the existing child instead of creating a new
         // one.
-        delete current_node;
+        node_pool_.Delete(current_node);
         current_node = existing_child;
       } else {
 //         node->CheckContains(current_node, 0.001f);
@@ -1047,13 +1245,13 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
               // Error. Give up.
               ++ numerical_issue_counter_;
 //               LOG(WARNING) << "Encountered a case which should not happen: level_difference_plus_one: " << level_difference_plus_one << ", intermediate_level: " << intermediate_level;
-              delete current_node;
+              node_pool_.Delete(current_node);
               return node;
             }
             
             int intermediate_node_child_index;
             OctreeNode* intermediate_node =
-                node->CreateChild(intermediate_level,
+                node->CreateChild(&node_pool_, intermediate_level,
                                   current_node->midpoint,
                                   &intermediate_node_child_index,
                                   /*add_as_child*/ false);
@@ -1068,8 +1266,8 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
               // Error. Give up.
               ++ numerical_issue_counter_;
               // LOG(ERROR) << "Encountered a case which should not happen.";
-              delete current_node;
-              delete intermediate_node;
+              node_pool_.Delete(current_node);
+              node_pool_.Delete(intermediate_node);
               return node;
             }
             intermediate_node->AddChild(current_node, child_index_1);
@@ -1118,7 +1316,7 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
         // Emergency handling: use the existing child instead of creating a new
         // one.
       } else {
-        OctreeNode* child = new OctreeNode(current_node->GetQuarterMidpoint(child_index),
+        OctreeNode* child = node_pool_.New(current_node->GetQuarterMidpoint(child_index),
                                           child_half_extent);
         
         if (existing_child) {
@@ -1159,7 +1357,7 @@ OctreeNode* CompressedOctree::SortSurfelsInNodeDownwardsOneStep(OctreeNode* node
 
 void CompressedOctree::CreateRootForSurfel(u32 surfel_index, Surfel* surfel) {
   // The initial extent is arbitrary, it will be adapted once more surfels are added.
-  root_ = new OctreeNode(surfel->position(), 1.0f);
+  root_ = node_pool_.New(surfel->position(), 1.0f);
   root_->parent = nullptr;
   root_->AddSurfel(surfel_index, surfel);
 }
@@ -1205,7 +1403,7 @@ OctreeNode* CompressedOctree::RemoveSingleChildNode(OctreeNode* node) {
   *child_pointer = *single_child;
   (*single_child)->parent = node->parent;
   OctreeNode* single_child_ptr = *single_child;  // Copy pointer before deleting the object containing it.
-  delete node;
+  node_pool_.Delete(node);
   
   return single_child_ptr;
 }
@@ -1217,7 +1415,7 @@ void CompressedOctree::RemoveEmptyLeaf(OctreeNode* node) {
   
   if (node->parent == nullptr) {
     // The node is the root node.
-    delete node;
+    node_pool_.Delete(node);
     root_ = nullptr;
     return;
   }
@@ -1243,7 +1441,7 @@ void CompressedOctree::RemoveEmptyLeaf(OctreeNode* node) {
   -- parent->child_count;
   parent->CheckChildCount();
   
-  delete node;
+  node_pool_.Delete(node);
   
   // If the parent became a single-child node, remove it.
   if (parent->child_count == 1 && parent->IsEmpty()) {
@@ -1259,7 +1457,7 @@ void CompressedOctree::DeleteNode(OctreeNode* node) {
       }
     }
   }
-  delete node;
+  node_pool_.Delete(node);
 }
 
 }
@@ -36,6 +36,7 @@
 #include <libvis/libvis.h>
 
 #include "surfel_meshing/surfel.h"
+#include "surfel_meshing/surfel_arrays.h"
 
 // Uncomment this to enable storing triangles in the octree. This is very slow.
 // #define KEEP_TRIANGLES_IN_OCTREE
@@ -79,6 +80,66 @@ uint32_t __inline __builtin_clz(uint32_t value)
 
 namespace vis {
 
+struct OctreeNode;
+
+// Allocator for octree nodes. Nodes are placed consecutively in large blocks,
+// such that nodes which are created at similar times are close in memory.
+// Deleted nodes are put on a free list and re-used by the next New() call, so
+// both operations are O(1) and the octree's node churn (due to moving surfels)
+// does not go through the system allocator. The blocks are only freed when the
+// pool is destructed; at this point, all nodes must have been deleted.
+class OctreeNodePool {
+ public:
+  OctreeNodePool();
+  
+  ~OctreeNodePool();
+  
+  OctreeNodePool(const OctreeNodePool& other) = delete;
+  OctreeNodePool& operator=(const OctreeNodePool& other) = delete;
+  
+  // Constructs a new node with the given parameters.
+  template <typename Derived>
+  inline OctreeNode* New(const MatrixBase<Derived>& midpoint, float half_extent);
+  
+  // Destructs the node and puts its memory on the free list. Does not touch
+  // the node's children.
+  inline void Delete(OctreeNode* node);
+  
+  // Number of nodes which are currently allocated.
+  inline usize live_node_count() const { return live_node_count_; }
+  
+  // Maximum number of nodes which were allocated at the same time.
+  inline usize peak_node_count() const { return peak_node_count_; }
+  
+  // Number of bytes reserved for node storage. Does not include the memory
+  // allocated by the nodes themselves (e.g., their surfel lists).
+  usize allocated_bytes() const;
+  
+ private:
+  // Allocates a new block and makes it the current block.
+  void AllocateBlock();
+  
+  // Number of nodes in each block.
+  static constexpr usize kNodesPerBlock = 1024;
+  
+  // Element of the free list, stored in the memory of a deleted node.
+  struct FreeNode {
+    FreeNode* next;
+  };
+
+  // Memory blocks. Pointers owned by this class.
+  vector<OctreeNode*> blocks_;
+
+  // Number of nodes that have been handed out from the last block so far.
+  usize used_in_last_block_;
+
+  // Singly linked list of deleted nodes.
+  FreeNode* free_list_;
+
+  usize live_node_count_;
+  usize peak_node_count_;
+};
+
 // An octree node, containing up to 8 children and a list of surfels.
 struct OctreeNode {
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
@@ -154,10 +215,11 @@ struct OctreeNode {
     CheckChildCount();
   }
   
-  // Creates and adds a child to this node. level must be at least 1: the
-  // child's extent will be pow(2, -level) * this->extent.
+  // Creates and adds a child to this node, allocating it from the given pool.
+  // level must be at least 1: the child's extent will be
+  // pow(2, -level) * this->extent.
   template <typename Derived>
-  inline OctreeNode* CreateChild(int level, const MatrixBase<Derived>& point_in_child, int* new_node_child_index, bool add_as_child) {
+  inline OctreeNode* CreateChild(OctreeNodePool* pool, int level, const MatrixBase<Derived>& point_in_child, int* new_node_child_index, bool add_as_child) {
     unsigned int half_fraction = 1 << (level - 1);
     float new_node_extent = half_extent / half_fraction;
     float new_node_extent_inv = 1.0f / new_node_extent;
@@ -186,8 +248,8 @@ struct OctreeNode {
         min +
         new_node_extent * Vec3f(new_node_x, new_node_y, new_node_z) +
         Vec3f::Constant(new_node_half_extent);
-    OctreeNode* new_node = new OctreeNode(new_node_midpoint,
-                                          new_node_half_extent);
+    OctreeNode* new_node = pool->New(new_node_midpoint,
+                                     new_node_half_extent);
     
     *new_node_child_index =
         ((plus_x == 1) * (1 << 0)) |  // (plus_x == 1) ? (1 << 0) : 0
@@ -349,12 +411,45 @@ inline std::ostream& operator<<(std::ostream& os, const OctreeNode& node) {
 }
 
 
+template <typename Derived>
+inline OctreeNode* OctreeNodePool::New(const MatrixBase<Derived>& midpoint, float half_extent) {
+  void* memory;
+  if (free_list_) {
+    memory = free_list_;
+    free_list_ = free_list_->next;
+  } else {
+    if (blocks_.empty() || used_in_last_block_ == kNodesPerBlock) {
+      AllocateBlock();
+    }
+    memory = blocks_.back() + used_in_last_block_;
+    ++ used_in_last_block_;
+  }
+  
+  ++ live_node_count_;
+  if (live_node_count_ > peak_node_count_) {
+    peak_node_count_ = live_node_count_;
+  }
+  return new(memory) OctreeNode(midpoint, half_extent);
+}
+  
+inline void OctreeNodePool::Delete(OctreeNode* node) {
+  node->~OctreeNode();
+  FreeNode* free_node = reinterpret_cast<FreeNode*>(node);
+  free_node->next = free_list_;
+  free_list_ = free_node;
+  -- live_node_count_;
+}
+
+
 // Manages a compressed octree.
 class CompressedOctree {
  public:
+  // If surfel_arrays is given, the neighbor searches read the surfel
+  // positions and meshing states from it instead of from the surfels.
   CompressedOctree(usize max_surfels_per_node,
                    std::vector<Surfel>* surfels,
-                   vector<SurfelTriangle>* triangles);
+                   vector<SurfelTriangle>* triangles,
+                   const SurfelArrays* surfel_arrays = nullptr);
   
   ~CompressedOctree();
   
@@ -485,6 +580,13 @@ class CompressedOctree {
     }
   }
   
+  // Updates the index under which the octree stores the surfel, for surfels
+  // which were moved to a different index in the surfels vector. The surfel
+  // must be in the octree.
+  inline void RenumberSurfel(u32 new_surfel_index, const Surfel& surfel) {
+    surfel.node()->surfels[surfel.index_in_node()] = new_surfel_index;
+  }
+  
 #ifdef KEEP_TRIANGLES_IN_OCTREE
   void AddTriangle(u32 triangle_index, const SurfelTriangle& triangle);
   
@@ -496,16 +598,39 @@ class CompressedOctree {
   
   // Queries.
   
+  // The surfel searches return the results sorted by increasing distance if
+  // sort_results is true. Otherwise, the order of the results is unspecified,
+  // which saves the final sort for callers which only use the result set.
+  
   // Actively sorts down surfels into new nodes if the maximum surfel count in
   // a node that is searched is violated.
   template <bool include_completed_surfels, bool include_free_surfels>
-  int FindNearestSurfelsWithinRadius(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices);
+  int FindNearestSurfelsWithinRadius(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results = true);
   
   // Version of FindNearestSurfelsWithinRadius() which leaves the octree
   // constant. Only use this if all surfels have been inserted with
   // AddSurfelActive(), otherwise it might be extremely slow.
   template <bool include_completed_surfels, bool include_free_surfels>
-  int FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices) const;
+  int FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, bool sort_results = true) const;
+  
+  // Variant of FindNearestSurfelsWithinRadiusPassive() which uses the given
+  // vector as work stack instead of a member. It may thus be called from
+  // multiple threads concurrently, as long as the octree is not modified
+  // meanwhile. For good performance, call SortAllSurfelsDownwards() before.
+  template <bool include_completed_surfels, bool include_free_surfels>
+  int FindNearestSurfelsWithinRadiusPassive(const Vec3f& position, float radius_squared, int max_result_count, float* result_distances_squared, u32* result_indices, vector<OctreeNode*>* nodes_to_search, bool sort_results = true) const;
+  
+  // Batched version of FindNearestSurfelsWithinRadiusPassive() for query_count
+  // queries with individual search radii. The results of query i are written
+  // to result_distances_squared and result_indices starting at
+  // i * max_result_count, and their count to result_counts[i]. The queries are
+  // sorted spatially and processed in small groups which descend from the root
+  // to their common subtree only once. If thread_count is larger than 1, the
+  // groups are distributed over this many threads. The octree must not be
+  // modified meanwhile. For good performance, call SortAllSurfelsDownwards()
+  // before.
+  template <bool include_completed_surfels, bool include_free_surfels>
+  void FindNearestSurfelsWithinRadiusBatch(usize query_count, const Vec3f* positions, const float* radii_squared, int max_result_count, int* result_counts, float* result_distances_squared, u32* result_indices, int thread_count = 1, bool sort_results = true) const;
   
 #ifdef KEEP_TRIANGLES_IN_OCTREE
   inline void FindNearestTrianglesIntersectingBox(const Vec3f& min, const Vec3f& max, vector<u32>* result_indices) {  // Unlimited result count
@@ -521,10 +646,20 @@ class CompressedOctree {
   //       also be useful.
   
   
+  // Sorts down the surfels in all nodes which violate the maximum surfel
+  // count, or which are non-leaf nodes containing surfels, by one step. This
+  // is the same which FindNearestSurfelsWithinRadius() does lazily for the
+  // nodes it visits. Useful before using the passive search variant.
+  void SortAllSurfelsDownwards();
+  
+  
   // For debugging.
   
   usize numerical_issue_counter() const { return numerical_issue_counter_; }
   
+  // Provides access to the node allocator, e.g., for its statistics.
+  inline const OctreeNodePool& node_pool() const { return node_pool_; }
+  
   usize CountSurfelsSlow();
   
   bool FindSurfelAnywhereSlow(u32 surfel_index, const Surfel& surfel, OctreeNode* start_node, OctreeNode** node, usize* index) const;
@@ -592,7 +727,7 @@ class CompressedOctree {
         plus_z * midpoint_dist);
     
     // Create the new root.
-    OctreeNode* new_root = new OctreeNode(new_root_midpoint, midpoint_dist);
+    OctreeNode* new_root = node_pool_.New(new_root_midpoint, midpoint_dist);
     new_root->parent = nullptr;
     
     // This is flipped because plus_xyz denotes the direction as viewed from
@@ -612,7 +747,7 @@ class CompressedOctree {
     
     float child_half_extent = 0.5f * new_root->half_extent;
     Vec3f child_midpoint = new_root->midpoint + child_half_extent * Vec3f(child_plus_x, child_plus_y, child_plus_z);
-    OctreeNode* child = new OctreeNode(child_midpoint, child_half_extent);
+    OctreeNode* child = node_pool_.New(child_midpoint, child_half_extent);
     child->AddSurfel(surfel_index, &surfels_->at(surfel_index));
     int child_node_child_index = ((child_plus_x == 1) ? (1 << 0) : 0) |
                                 ((child_plus_y == 1) ? (1 << 1) : 0) |
@@ -629,8 +764,8 @@ class CompressedOctree {
       root_ = new_root->children[old_root_child_index];
       root_->parent = nullptr;
       root_->AddSurfel(surfel_index, &surfels_->at(surfel_index));
-      delete new_root;
-      delete child;
+      node_pool_.Delete(new_root);
+      node_pool_.Delete(child);
     } else {
       new_root->AddChild(child, child_node_child_index);
     }
@@ -669,7 +804,7 @@ class CompressedOctree {
         new_node_extent * Vec3f(new_node_x, new_node_y, new_node_z) +
         Vec3f::Constant(new_node_half_extent);
     *new_node =
-        new OctreeNode(new_node_midpoint, new_node_half_extent);
+        node_pool_.New(new_node_midpoint, new_node_half_extent);
     
     // Connect the parent and the new node.
     node->children[existing_child_index] = *new_node;
@@ -730,7 +865,10 @@ class CompressedOctree {
   void FindNearestTrianglesViaSurfelsImpl(const Vec3f& position, float radius_squared, int max_surfel_count, vector<u32>* result_indices);  // Unlimited result count
   
   
-  // Pointer owned by this class.
+  // Allocator for all nodes of this octree.
+  OctreeNodePool node_pool_;
+  
+  // Pointer owned by this class (allocated from node_pool_).
   OctreeNode* root_;
   
   // Maximum number of surfels in a single node. If more surfels fall into the
@@ -743,6 +881,10 @@ class CompressedOctree {
   // List of triangles. Pointer to external data, not owned.
   vector<SurfelTriangle>* triangles_;
   
+  // Optional structure-of-arrays copy of the surfel attributes. Pointer to
+  // external data, not owned. May be null.
+  const SurfelArrays* surfel_arrays_;
+  
   // Is used temporarily only, but cached here to avoid re-allocation.
   mutable vector<OctreeNode*> nodes_to_search_;
   vector<float> surfel_distances_squared_;
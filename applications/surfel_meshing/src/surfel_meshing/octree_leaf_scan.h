@@ -0,0 +1,215 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#pragma once
+
+#include <algorithm>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+
+#include "surfel_meshing/octree.h"
+#include "surfel_meshing/surfel.h"
+#include "surfel_meshing/surfel_arrays.h"
+#include "surfel_meshing/top_k_collector.h"
+
+// Kernels for scanning the surfel lists of octree nodes in the neighbor
+// searches. The surfel attributes are accessed through one of the accessor
+// structs below, which determine the surfel distances for blocks of up to
+// kLeafScanBlockSize surfels at a time. If the surfels are given as
+// SurfelArrays, this is vectorized with AVX2 (using gather instructions) or
+// SSE2, depending on the instruction sets enabled at compile time. Otherwise,
+// a scalar fallback is used.
+
+namespace vis {
+
+// Collects the nearest neighbors as (squared distance, surfel index) pairs.
+typedef TopKCollector<float, u32> NeighborCollector;
+
+// Maximum number of surfels whose distances are computed at once.
+constexpr int kLeafScanBlockSize = 8;
+
+// Returns a bit mask which has bit i set if surfels in the meshing state with
+// value i are accepted by a neighbor search.
+template <bool include_completed_surfels, bool include_free_surfels>
+constexpr u32 AcceptedMeshingStateMask() {
+  return (include_free_surfels ? (1u << static_cast<int>(Surfel::MeshingState::kFree)) : 0u) |
+         (1u << static_cast<int>(Surfel::MeshingState::kFront)) |
+         (include_completed_surfels ? (1u << static_cast<int>(Surfel::MeshingState::kCompleted)) : 0u);
+}
+
+// Provides the surfel attributes required by the neighbor search from the
+// Surfel objects.
+struct SurfelObjectAccess {
+  inline SurfelObjectAccess(const Surfel* surfels)
+      : surfels(surfels) {}
+  
+  // Computes the squared distances of count <= kLeafScanBlockSize surfels to
+  // the position. Returns a bit mask which has bit i set if the i-th distance
+  // is not larger than max_distance_squared.
+  inline u32 ComputeDistancesSquared(const u32* surfel_indices, int count, const Vec3f& position, float max_distance_squared, float* distances_squared) const {
+    u32 mask = 0;
+    for (int i = 0; i < count; ++ i) {
+      distances_squared[i] = (surfels[surfel_indices[i]].position() - position).squaredNorm();
+      mask |= static_cast<u32>(!(distances_squared[i] > max_distance_squared)) << i;
+    }
+    return mask;
+  }
+  
+  inline Surfel::MeshingState meshing_state(u32 surfel_index) const {
+    return surfels[surfel_index].meshing_state();
+  }
+  
+  const Surfel* surfels;
+};
+
+// Provides the surfel attributes required by the neighbor search from
+// SurfelArrays.
+struct SurfelArraysAccess {
+  inline SurfelArraysAccess(const SurfelArrays& arrays)
+      : x(arrays.x()),
+        y(arrays.y()),
+        z(arrays.z()),
+        state(arrays.meshing_state()) {}
+  
+  // See SurfelObjectAccess::ComputeDistancesSquared(). distances_squared must
+  // have space for kLeafScanBlockSize values in any case.
+  inline u32 ComputeDistancesSquared(const u32* surfel_indices, int count, const Vec3f& position, float max_distance_squared, float* distances_squared) const {
+#if defined(__AVX2__) || defined(__SSE2__)
+    // Pad partial blocks with a valid index. The padding lanes are masked out
+    // at the end.
+    u32 padded_indices[kLeafScanBlockSize];
+    if (count < kLeafScanBlockSize) {
+      for (int i = 0; i < kLeafScanBlockSize; ++ i) {
+        padded_indices[i] = surfel_indices[(i < count) ? i : 0];
+      }
+      surfel_indices = padded_indices;
+    }
+    u32 valid_mask = (1u << count) - 1;
+#endif
+    
+#if defined(__AVX2__)
+    __m256i indices = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(surfel_indices));
+    __m256 dx = _mm256_sub_ps(_mm256_i32gather_ps(x, indices, 4), _mm256_set1_ps(position.x()));
+    __m256 dy = _mm256_sub_ps(_mm256_i32gather_ps(y, indices, 4), _mm256_set1_ps(position.y()));
+    __m256 dz = _mm256_sub_ps(_mm256_i32gather_ps(z, indices, 4), _mm256_set1_ps(position.z()));
+    __m256 result = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, dx), _mm256_mul_ps(dy, dy)), _mm256_mul_ps(dz, dz));
+    _mm256_storeu_ps(distances_squared, result);
+    // "Not greater than" to treat NaN distances like the scalar version.
+    __m256 within = _mm256_cmp_ps(result, _mm256_set1_ps(max_distance_squared), _CMP_NGT_UQ);
+    return static_cast<u32>(_mm256_movemask_ps(within)) & valid_mask;
+#elif defined(__SSE2__)
+    __m128 px = _mm_set1_ps(position.x());
+    __m128 py = _mm_set1_ps(position.y());
+    __m128 pz = _mm_set1_ps(position.z());
+    __m128 max = _mm_set1_ps(max_distance_squared);
+    u32 mask = 0;
+    for (int half = 0; half < 2; ++ half) {
+      const u32* i = surfel_indices + 4 * half;
+      __m128 dx = _mm_sub_ps(_mm_set_ps(x[i[3]], x[i[2]], x[i[1]], x[i[0]]), px);
+      __m128 dy = _mm_sub_ps(_mm_set_ps(y[i[3]], y[i[2]], y[i[1]], y[i[0]]), py);
+      __m128 dz = _mm_sub_ps(_mm_set_ps(z[i[3]], z[i[2]], z[i[1]], z[i[0]]), pz);
+      __m128 result = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz));
+      _mm_storeu_ps(distances_squared + 4 * half, result);
+      // "Not greater than" to treat NaN distances like the scalar version.
+      mask |= static_cast<u32>(_mm_movemask_ps(_mm_cmpngt_ps(result, max))) << (4 * half);
+    }
+    return mask & valid_mask;
+#else
+    u32 mask = 0;
+    for (int i = 0; i < count; ++ i) {
+      u32 surfel_index = surfel_indices[i];
+      float dx = x[surfel_index] - position.x();
+      float dy = y[surfel_index] - position.y();
+      float dz = z[surfel_index] - position.z();
+      distances_squared[i] = dx * dx + dy * dy + dz * dz;
+      mask |= static_cast<u32>(!(distances_squared[i] > max_distance_squared)) << i;
+    }
+    return mask;
+#endif
+  }
+  
+  inline Surfel::MeshingState meshing_state(u32 surfel_index) const {
+    return state[surfel_index];
+  }
+  
+  const float* x;
+  const float* y;
+  const float* z;
+  const Surfel::MeshingState* state;
+};
+
+// Adds the given surfels to the results if they are within the current
+// maximum distance and have an accepted meshing state.
+template <bool include_completed_surfels, bool include_free_surfels, typename SurfelAccess>
+inline void AddSurfelsToResults(
+    const u32* surfel_indices,
+    usize surfel_count,
+    const Vec3f& position,
+    NeighborCollector* results,
+    const SurfelAccess& surfels) {
+  constexpr u32 kAcceptedStates = AcceptedMeshingStateMask<include_completed_surfels, include_free_surfels>();
+  float block_distances_squared[kLeafScanBlockSize];
+  
+  for (usize block_start = 0; block_start < surfel_count; block_start += kLeafScanBlockSize) {
+    int block_count = std::min<usize>(kLeafScanBlockSize, surfel_count - block_start);
+    u32 candidates = surfels.ComputeDistancesSquared(
+        surfel_indices + block_start, block_count, position,
+        results->threshold(), block_distances_squared);
+    
+    while (candidates) {
+      int lane = __builtin_ctz(candidates);
+      candidates &= candidates - 1;
+      
+      // The maximum distance may have decreased within the block.
+      float distance_squared = block_distances_squared[lane];
+      if (distance_squared > results->threshold()) {
+        continue;
+      }
+      // The meshing state is only checked for surfels within the search
+      // radius, such that the parallel triangulation does not touch other
+      // surfels.
+      u32 surfel_index = surfel_indices[block_start + lane];
+      if (!((kAcceptedStates >> static_cast<int>(surfels.meshing_state(surfel_index))) & 1)) {
+        continue;
+      }
+      
+      results->Insert(distance_squared, surfel_index);
+    }
+  }
+}
+
+}
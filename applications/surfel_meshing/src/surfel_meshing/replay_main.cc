@@ -0,0 +1,377 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+// Replays a surfel recording, written with --record_surfels by SurfelMeshing or
+// SurfelMeshingBatch, into SurfelMeshing. This allows to benchmark and profile
+// the meshing (surfel update, remeshing check, and triangulation) on its own,
+// without a GPU and without running the surfel reconstruction. The snapshots
+// are processed either as fast as possible or at the cadence at which they
+// were recorded. For each run, the per-snapshot latency percentiles are
+// written in a tab-separated format, and a checksum of the final mesh is
+// computed and compared between the runs.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <libvis/command_line_parser.h>
+#include <libvis/libvis.h>
+#include <libvis/mesh.h>
+
+#include "surfel_meshing/cuda_surfels_cpu.h"
+#include "surfel_meshing/surfel_meshing.h"
+#include "surfel_meshing/surfel_recording.h"
+
+using namespace vis;
+
+
+// Returns the time in milliseconds which passed since start.
+double MillisecondsSince(const chrono::steady_clock::time_point& start) {
+  return 1e-6 * chrono::duration<double, nano>(chrono::steady_clock::now() - start).count();
+}
+
+// Returns the given percentile (in [0, 100]) of the sorted values, using the
+// nearest-rank method.
+double Percentile(const vector<double>& sorted_values, double percentile) {
+  if (sorted_values.empty()) {
+    return 0;
+  }
+  usize rank = static_cast<usize>(std::ceil(percentile / 100.0 * sorted_values.size()));
+  return sorted_values[std::max<usize>(rank, 1) - 1];
+}
+
+// Computes a checksum of the mesh, consisting of the positions of the
+// (non-merged) surfels and the triangles. The result does not depend on the
+// order of the triangles or on which vertex a triangle starts with, which may
+// differ between runs with several triangulation threads.
+u64 ComputeMeshChecksum(SurfelMeshing& surfel_meshing) {
+  constexpr u64 kFNVOffsetBasis = 14695981039346656037ull;
+  constexpr u64 kFNVPrime = 1099511628211ull;
+  auto hash_bytes = [](const void* data, usize size, u64 hash) {
+    const u8* bytes = static_cast<const u8*>(data);
+    for (usize i = 0; i < size; ++ i) {
+      hash = (hash ^ bytes[i]) * kFNVPrime;
+    }
+    return hash;
+  };
+  
+  Mesh3fCu8 mesh;
+  surfel_meshing.ConvertToMesh3fCu8(&mesh);
+  
+  u64 vertex_hash = kFNVOffsetBasis;
+  for (usize i = 0; i < mesh.vertices()->size(); ++ i) {
+    vertex_hash = hash_bytes((*mesh.vertices())[i].position().data(), 3 * sizeof(float), vertex_hash);
+  }
+  
+  // Sum up the hashes of the individual triangles, each rotated to start with
+  // its smallest index, to be independent of their order.
+  u64 triangle_hash_sum = 0;
+  for (const Triangle<u32>& triangle : mesh.triangles()) {
+    u32 indices[3] = {triangle.index(0), triangle.index(1), triangle.index(2)};
+    std::rotate(indices, std::min_element(indices, indices + 3), indices + 3);
+    triangle_hash_sum += hash_bytes(indices, sizeof(indices), kFNVOffsetBasis);
+  }
+  
+  return hash_bytes(&triangle_hash_sum, sizeof(triangle_hash_sum), vertex_hash);
+}
+
+// Returns the checksum formatted as hexadecimal number.
+string ChecksumToString(u64 checksum) {
+  std::ostringstream stream;
+  stream << std::hex << std::setw(16) << std::setfill('0') << checksum;
+  return stream.str();
+}
+
+
+int main(int argc, char** argv) {
+  FLAGS_logtostderr = 1;
+  google::InitGoogleLogging(argv[0]);
+  
+  
+  // ### Parse parameters ###
+  
+  CommandLineParser cmd_parser(argc, argv);
+  
+  // Replay parameters.
+  bool recorded_cadence = cmd_parser.Flag(
+      "--recorded_cadence",
+      "Passes the snapshots to the meshing at the times at which they were recorded (or as soon as the meshing is done with the previous one) instead of as fast as possible.");
+  
+  int run_count = 1;
+  cmd_parser.NamedParameter(
+      "--runs", &run_count, /*required*/ false,
+      "Number of times to replay the recording. The mesh checksums of all runs are compared.");
+  
+  std::string expected_checksum;
+  cmd_parser.NamedParameter(
+      "--expected_checksum", &expected_checksum, /*required*/ false,
+      "Checksum (as printed by a previous replay) that the final mesh must have, for example to compare different builds.");
+  
+  // Meshing parameters. These should be the same as for recording.
+  float max_angle_between_normals_deg = 90.0f;
+  cmd_parser.NamedParameter(
+      "--max_angle_between_normals_deg", &max_angle_between_normals_deg, /*required*/ false,
+      "Maximum angle between normals of surfels that are connected by triangulation.");
+  const float max_angle_between_normals = M_PI / 180.0f * max_angle_between_normals_deg;
+  
+  float min_triangle_angle_deg = 10.0f;
+  cmd_parser.NamedParameter(
+      "--min_triangle_angle_deg", &min_triangle_angle_deg, /*required*/ false,
+      "The meshing algorithm attempts to keep triangle angles larger than this.");
+  const float min_triangle_angle = M_PI / 180.0 * min_triangle_angle_deg;
+  
+  float max_triangle_angle_deg = 170.0f;
+  cmd_parser.NamedParameter(
+      "--max_triangle_angle_deg", &max_triangle_angle_deg, /*required*/ false,
+      "The meshing algorithm attempts to keep triangle angles smaller than this.");
+  const float max_triangle_angle = M_PI / 180.0 * max_triangle_angle_deg;
+  
+  float max_neighbor_search_range_increase_factor = 2.0f;
+  cmd_parser.NamedParameter(
+      "--max_neighbor_search_range_increase_factor", &max_neighbor_search_range_increase_factor, /*required*/ false,
+      "Maximum factor by which the surfel neighbor search range can be increased if the front neighbors are far away.");
+  
+  float long_edge_tolerance_factor = 1.5f;
+  cmd_parser.NamedParameter(
+      "--long_edge_tolerance_factor", &long_edge_tolerance_factor, /*required*/ false,
+      "Tolerance factor over 'max_neighbor_search_range_increase_factor * surfel_radius' for deciding whether to remesh a triangle with long edges.");
+  
+  int regularization_frame_window_size = 30;
+  cmd_parser.NamedParameter(
+      "--regularization_frame_window_size", &regularization_frame_window_size, /*required*/ false,
+      "Number of frames for which the regularization of a surfel is continued after it goes out of view.");
+  
+  int triangulation_threads = 1;
+  cmd_parser.NamedParameter(
+      "--triangulation_threads", &triangulation_threads, /*required*/ false,
+      "Number of threads used for triangulation. Should only affect the runtime (and the order in which surfels are triangulated).");
+  
+  float triangulation_budget_ms = 0;
+  cmd_parser.NamedParameter(
+      "--triangulation_budget_ms", &triangulation_budget_ms, /*required*/ false,
+      "If positive, limits the time for triangulating each snapshot. The most recently updated surfels are triangulated first, the rest is carried over to the next snapshot (and finished after the last one). Makes the mesh checksum depend on the timing.");
+  
+  bool full_retriangulation_at_end = cmd_parser.Flag(
+      "--full_retriangulation_at_end",
+      "Performs a full retriangulation in the end (before the checksum is computed and the mesh is saved).");
+  
+  int triangle_compaction_moves = 0;
+  cmd_parser.NamedParameter(
+      "--triangle_compaction_moves", &triangle_compaction_moves, /*required*/ false,
+      "If positive, reclaims the entries of deleted triangles after triangulating each snapshot, moving at most this many triangles. Should not change the mesh checksum. (Surfels are compacted by the reconstruction, so recordings of runs with surfel compaction replay it in any case.)");
+  
+  // Octree parameters.
+  int max_surfels_per_node = 50;
+  cmd_parser.NamedParameter(
+      "--max_surfels_per_node", &max_surfels_per_node, /*required*/ false,
+      "Maximum number of surfels per octree node. Should only affect the runtime.");
+  
+  // Output parameters.
+  std::string export_mesh_path;
+  cmd_parser.NamedParameter(
+      "--export_mesh", &export_mesh_path, /*required*/ false,
+      "Save the final mesh of the last run to the given path (as a binary PLY file without colors).");
+  
+  std::string timings_path;
+  cmd_parser.NamedParameter(
+      "--write_timings", &timings_path, /*required*/ false,
+      "Write the latency percentiles to the given file instead of to stdout.");
+  
+  // Required input path.
+  string recording_path;
+  cmd_parser.SequentialParameter(
+      &recording_path, "recording_path", true,
+      "Path to the surfel recording.");
+  
+  if (!cmd_parser.CheckParameters()) {
+    return EXIT_FAILURE;
+  }
+  
+  if (run_count < 1) {
+    LOG(ERROR) << "--runs must be at least 1.";
+    return EXIT_FAILURE;
+  }
+  
+  SurfelRecordingReader reader;
+  if (!reader.Open(recording_path)) {
+    return EXIT_FAILURE;
+  }
+  LOG(INFO) << "Recording with " << reader.snapshot_count() << " snapshots and up to "
+            << reader.max_surfel_count() << " surfels.";
+  
+  
+  // ### Replay ###
+  
+  // Per-snapshot latencies of the meshing steps.
+  constexpr int kStepCount = 4;
+  const char* step_names[kStepCount] = {"surfel_update", "remeshing", "triangulation", "total"};
+  
+  std::ostringstream timings;
+  timings << "run\tstep\tcount\tmean_ms\tp50_ms\tp90_ms\tp99_ms\tmax_ms" << std::endl;
+  timings << std::fixed << std::setprecision(3);
+  
+  CUDASurfelsCPU buffers(reader.max_surfel_count());
+  vector<u64> checksums;
+  for (int run = 0; run < run_count; ++ run) {
+    if (run > 0 && !reader.Rewind()) {
+      return EXIT_FAILURE;
+    }
+    
+    SurfelMeshing surfel_meshing(
+        max_surfels_per_node,
+        max_angle_between_normals,
+        min_triangle_angle,
+        max_triangle_angle,
+        max_neighbor_search_range_increase_factor,
+        long_edge_tolerance_factor,
+        regularization_frame_window_size,
+        /*render_window*/ nullptr);
+    surfel_meshing.SetTriangulationThreadCount(triangulation_threads);
+    surfel_meshing.SetTriangulationBudget(0.001 * triangulation_budget_ms);
+    
+    vector<double> latencies[kStepCount];
+    chrono::steady_clock::time_point run_start_time = chrono::steady_clock::now();
+    double first_timestamp = -1;
+    SurfelRecordingSnapshotInfo info;
+    while (reader.ReadSnapshot(&buffers, &info)) {
+      if (recorded_cadence) {
+        if (first_timestamp < 0) {
+          first_timestamp = info.timestamp;
+          run_start_time = chrono::steady_clock::now();
+        }
+        std::this_thread::sleep_until(
+            run_start_time + chrono::duration_cast<chrono::steady_clock::duration>(
+                chrono::duration<double>(info.timestamp - first_timestamp)));
+      }
+      
+      chrono::steady_clock::time_point start_time = chrono::steady_clock::now();
+      CHECK(buffers.AcquireLatestBuffers());
+      surfel_meshing.IntegrateCUDABuffers(info.frame_index, buffers);
+      latencies[0].push_back(MillisecondsSince(start_time));
+      
+      chrono::steady_clock::time_point remeshing_start_time = chrono::steady_clock::now();
+      surfel_meshing.CheckRemeshing();
+      latencies[1].push_back(MillisecondsSince(remeshing_start_time));
+      
+      chrono::steady_clock::time_point triangulation_start_time = chrono::steady_clock::now();
+      surfel_meshing.Triangulate();
+      if (triangle_compaction_moves > 0) {
+        surfel_meshing.CompactTriangles(triangle_compaction_moves);
+      }
+      latencies[2].push_back(MillisecondsSince(triangulation_start_time));
+      
+      latencies[3].push_back(MillisecondsSince(start_time));
+    }
+    if (reader.error()) {
+      return EXIT_FAILURE;
+    }
+    double run_ms = MillisecondsSince(run_start_time);
+    
+    usize remesh_backlog_size = surfel_meshing.remesh_backlog_size();
+    if (remesh_backlog_size > 0) {
+      surfel_meshing.SetTriangulationBudget(0);
+      surfel_meshing.Triangulate();
+    }
+    
+    if (full_retriangulation_at_end) {
+      surfel_meshing.FullRetriangulation();
+    }
+    
+    checksums.push_back(ComputeMeshChecksum(surfel_meshing));
+    LOG(INFO) << "Run " << run << ": " << latencies[3].size() << " snapshots in "
+              << run_ms << " ms, final backlog: " << remesh_backlog_size << " surfels, #triangles: " << surfel_meshing.triangle_count()
+              << ", mesh checksum: " << ChecksumToString(checksums.back());
+    if (triangle_compaction_moves > 0 || surfel_meshing.moved_surfel_count() > 0) {
+      LOG(INFO) << "Run " << run << ": moved " << surfel_meshing.moved_surfel_count() << " surfels, reclaimed "
+                << surfel_meshing.reclaimed_triangle_entry_count() << " triangle entries, "
+                << surfel_meshing.free_triangle_entry_count() << " of " << surfel_meshing.triangle_entry_count()
+                << " triangle entries free";
+    }
+    
+    for (int step = 0; step < kStepCount; ++ step) {
+      vector<double>& values = latencies[step];
+      double total_ms = 0;
+      for (double value : values) {
+        total_ms += value;
+      }
+      std::sort(values.begin(), values.end());
+      timings << run << "\t" << step_names[step] << "\t" << values.size() << "\t"
+              << (values.empty() ? 0 : total_ms / values.size()) << "\t"
+              << Percentile(values, 50) << "\t" << Percentile(values, 90) << "\t"
+              << Percentile(values, 99) << "\t" << Percentile(values, 100) << std::endl;
+    }
+    
+    if (run == run_count - 1 && !export_mesh_path.empty()) {
+      if (surfel_meshing.WriteMeshAsPLY(export_mesh_path.c_str(), /*surfel_colors*/ nullptr)) {
+        LOG(INFO) << "Wrote " << export_mesh_path << ".";
+      } else {
+        LOG(ERROR) << "Writing the mesh failed.";
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  
+  // Write the timings.
+  if (timings_path.empty()) {
+    std::cout << timings.str();
+  } else {
+    std::ofstream timings_file(timings_path, std::ios::out);
+    timings_file << timings.str();
+    if (!timings_file) {
+      LOG(ERROR) << "Writing the timings to " << timings_path << " failed.";
+      return EXIT_FAILURE;
+    }
+  }
+  
+  // Compare the checksums.
+  bool checksums_match = true;
+  for (int run = 1; run < run_count; ++ run) {
+    if (checksums[run] != checksums[0]) {
+      LOG(ERROR) << "The mesh of run " << run << " differs from the mesh of run 0 (checksum "
+                 << ChecksumToString(checksums[run]) << " instead of "
+                 << ChecksumToString(checksums[0]) << ").";
+      checksums_match = false;
+    }
+  }
+  if (!expected_checksum.empty() && ChecksumToString(checksums[0]) != expected_checksum) {
+    LOG(ERROR) << "The mesh checksum " << ChecksumToString(checksums[0])
+               << " differs from the expected checksum " << expected_checksum << ".";
+    checksums_match = false;
+  }
+  
+  return checksums_match ? EXIT_SUCCESS : EXIT_FAILURE;
+}
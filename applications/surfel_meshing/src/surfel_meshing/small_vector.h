@@ -0,0 +1,235 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#include <glog/logging.h>
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// Vector with inline storage for up to N elements. Only if more elements are
+// stored, the elements are moved to heap memory. This avoids heap allocations
+// for the many small per-surfel lists (triangles, fronts) during meshing.
+// 
+// Only suitable for element types which can be copied with memcpy() and
+// whose destructor does nothing, since elements are neither constructed nor
+// destructed individually (except on insertion).
+template <typename T, int N>
+class SmallVector {
+ public:
+  typedef T value_type;
+  typedef T* iterator;
+  typedef const T* const_iterator;
+  
+  inline SmallVector()
+      : size_(0),
+        capacity_(N) {}
+  
+  inline SmallVector(const SmallVector& other)
+      : size_(0),
+        capacity_(N) {
+    *this = other;
+  }
+  
+  inline SmallVector(SmallVector&& other)
+      : size_(0),
+        capacity_(N) {
+    *this = std::move(other);
+  }
+  
+  inline ~SmallVector() {
+    if (is_on_heap()) {
+      free(storage_.heap);
+    }
+  }
+  
+  inline SmallVector& operator= (const SmallVector& other) {
+    if (this != &other) {
+      size_ = 0;
+      reserve(other.size_);
+      memcpy(data(), other.data(), other.size_ * sizeof(T));
+      size_ = other.size_;
+    }
+    return *this;
+  }
+  
+  inline SmallVector& operator= (SmallVector&& other) {
+    if (this == &other) {
+      return *this;
+    }
+    if (other.is_on_heap()) {
+      // Take over the other vector's heap memory.
+      if (is_on_heap()) {
+        free(storage_.heap);
+      }
+      storage_.heap = other.storage_.heap;
+      size_ = other.size_;
+      capacity_ = other.capacity_;
+      other.size_ = 0;
+      other.capacity_ = N;
+    } else {
+      *this = static_cast<const SmallVector&>(other);
+      other.size_ = 0;
+    }
+    return *this;
+  }
+  
+  inline void reserve(u32 capacity) {
+    if (capacity <= capacity_) {
+      return;
+    }
+    T* new_data = static_cast<T*>(malloc(capacity * sizeof(T)));
+    CHECK(new_data) << "SmallVector: allocation failed.";
+    memcpy(new_data, data(), size_ * sizeof(T));
+    if (is_on_heap()) {
+      free(storage_.heap);
+    }
+    storage_.heap = new_data;
+    capacity_ = capacity;
+  }
+  
+  inline void push_back(const T& value) {
+    if (size_ == capacity_) {
+      // Copy the value in case it is an element of this vector.
+      T copy = value;
+      reserve(2 * capacity_);
+      data()[size_] = copy;
+    } else {
+      data()[size_] = value;
+    }
+    ++ size_;
+  }
+  
+  template <typename... Args>
+  inline void emplace_back(Args&&... args) {
+    if (size_ == capacity_) {
+      reserve(2 * capacity_);
+    }
+    new(data() + size_) T(std::forward<Args>(args)...);
+    ++ size_;
+  }
+  
+  inline void pop_back() {
+    -- size_;
+  }
+  
+  // Shrinks the vector, or grows it with default-constructed elements.
+  inline void resize(u32 size) {
+    reserve(size);
+    for (u32 i = size_; i < size; ++ i) {
+      new(data() + i) T();
+    }
+    size_ = size;
+  }
+  
+  inline void clear() {
+    size_ = 0;
+  }
+  
+  // Erases the element at the given position, keeping the order of the
+  // remaining elements.
+  inline iterator erase(iterator position) {
+    memmove(position, position + 1, (end() - (position + 1)) * sizeof(T));
+    -- size_;
+    return position;
+  }
+  
+  // Inserts the range [first, last) before the given position. The range must
+  // not be part of this vector.
+  template <typename InputIt>
+  inline void insert(iterator position, InputIt first, InputIt last) {
+    u32 offset = position - begin();
+    u32 count = std::distance(first, last);
+    if (size_ + count > capacity_) {
+      reserve(std::max<u32>(size_ + count, 2 * capacity_));
+    }
+    T* insert_data = data() + offset;
+    memmove(insert_data + count, insert_data, (size_ - offset) * sizeof(T));
+    for (InputIt it = first; it != last; ++ it) {
+      *insert_data = *it;
+      ++ insert_data;
+    }
+    size_ += count;
+  }
+  
+  inline T& operator[] (u32 index) { return data()[index]; }
+  inline const T& operator[] (u32 index) const { return data()[index]; }
+  
+  inline T& at(u32 index) {
+    CHECK_LT(index, size_) << "SmallVector::at(): index out of range.";
+    return data()[index];
+  }
+  inline const T& at(u32 index) const {
+    CHECK_LT(index, size_) << "SmallVector::at(): index out of range.";
+    return data()[index];
+  }
+  
+  inline T& front() { return data()[0]; }
+  inline const T& front() const { return data()[0]; }
+  inline T& back() { return data()[size_ - 1]; }
+  inline const T& back() const { return data()[size_ - 1]; }
+  
+  inline iterator begin() { return data(); }
+  inline const_iterator begin() const { return data(); }
+  inline iterator end() { return data() + size_; }
+  inline const_iterator end() const { return data() + size_; }
+  
+  inline T* data() { return is_on_heap() ? storage_.heap : reinterpret_cast<T*>(&storage_.inline_data); }
+  inline const T* data() const { return is_on_heap() ? storage_.heap : reinterpret_cast<const T*>(&storage_.inline_data); }
+  
+  inline u32 size() const { return size_; }
+  inline u32 capacity() const { return capacity_; }
+  inline bool empty() const { return size_ == 0; }
+  
+  // Returns whether the elements are stored in heap memory (as opposed to the
+  // inline storage).
+  inline bool is_on_heap() const { return capacity_ > N; }
+  
+ private:
+  union Storage {
+    typename std::aligned_storage<N * sizeof(T), alignof(T)>::type inline_data;
+    T* heap;
+  };
+  
+  Storage storage_;
+  u32 size_;
+  u32 capacity_;
+};
+
+}
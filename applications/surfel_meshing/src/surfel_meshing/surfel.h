@@ -32,6 +32,8 @@
 #include <libvis/eigen.h>
 #include <libvis/libvis.h>
 
+#include "surfel_meshing/small_vector.h"
+
 namespace vis {
 
 struct OctreeNode;
@@ -52,6 +54,14 @@ struct Front {
   u32 right;
 };
 
+// List of fronts of a surfel. Most surfels have at most one front, and
+// completed surfels have none, so few elements are stored inline.
+typedef SmallVector<Front, 2> SurfelFronts;
+
+// List of triangles connected to a surfel. Most surfels have about 6 triangles
+// (if the surrounding mesh is regular).
+typedef SmallVector<u32, 6> SurfelTriangleIndices;
+
 
 // Represents a surfel on the CPU. Only contains attributes which are relevant
 // for meshing.
@@ -101,8 +111,17 @@ class Surfel {
     index_in_node_ = index_in_node;
   }
   
-  inline void AddTriangle(u32 triangle_index) {
+  // Returns the position of the triangle in the surfel's triangle list.
+  inline int AddTriangle(u32 triangle_index) {
     triangles_.emplace_back(triangle_index);
+    return triangles_.size() - 1;
+  }
+  
+  // Removes the triangle at the given position in the surfel's triangle list
+  // by moving the last triangle into its place.
+  inline void RemoveTriangleAt(int position) {
+    triangles_[position] = triangles_[triangles_.size() - 1];
+    triangles_.pop_back();
   }
   
   inline void RemoveTriangle(u32 triangle_index) {
@@ -128,6 +147,12 @@ class Surfel {
     return triangles_[index];
   }
   
+  // Replaces the triangle index at the given position in the surfel's
+  // triangle list, for triangles which were moved to another index.
+  inline void SetTriangle(int position, u32 triangle_index) {
+    triangles_[position] = triangle_index;
+  }
+  
   inline void SetLastUpdateStamp(u32 last_update_stamp) {
     last_update_stamp_ = last_update_stamp;
   }
@@ -152,8 +177,8 @@ class Surfel {
   inline float radius_squared() const { return radius_squared_; }
   inline const Vec3f& normal() const { return normal_; }
   inline OctreeNode* node() const { return node_; }
-  inline vector<Front>& fronts() { return fronts_; }
-  inline const vector<Front>& fronts() const { return fronts_; }
+  inline SurfelFronts& fronts() { return fronts_; }
+  inline const SurfelFronts& fronts() const { return fronts_; }
   inline u32 index_in_node() const { return index_in_node_; }
   inline u32 last_update_stamp() const { return last_update_stamp_; }
   inline MeshingState meshing_state() const { return meshing_state_; }
@@ -168,8 +193,8 @@ class Surfel {
   Vec3f normal_;
   u32 index_in_node_;
   OctreeNode* node_;
-  vector<u32> triangles_;
-  vector<Front> fronts_;
+  SurfelTriangleIndices triangles_;
+  SurfelFronts fronts_;
   u32 last_update_stamp_;
   u8 flags_;
   MeshingState meshing_state_;
@@ -209,18 +234,14 @@ class SurfelTriangle {
     }
   }
   
-  inline void MakeFreeListEntry(u32 next_free_entry_index) {
+  inline void MakeFreeListEntry() {
     // At least two indices must be the same, otherwise this would create
     // artifacts if it gets transferred to the GPU directly.
-    indices_[0] = next_free_entry_index;
+    indices_[0] = 0;
     indices_[1] = 0;
     indices_[2] = kFreeListEntryMark;
   }
   
-  inline u32 free_list_value() const {
-    return indices_[0];
-  }
-  
   inline bool IsValid() const { return indices_[2] != kFreeListEntryMark; }
   
   inline u32 index(int i) const { return indices_[i]; }
@@ -231,4 +252,12 @@ class SurfelTriangle {
   u32 indices_[3];
 };
 
+
+// Positions of a triangle in the triangle lists of its corner surfels, stored
+// alongside the triangles (in the same order as SurfelTriangle::indices_) such
+// that the triangle can be removed from these lists without searching them.
+struct SurfelTriangleCornerSlots {
+  u16 slots[3];
+};
+
 }
@@ -0,0 +1,117 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#pragma once
+
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+
+#include "surfel_meshing/surfel.h"
+
+namespace vis {
+
+// Stores the surfel attributes which are read by the neighbor search (the
+// position and the meshing state) as a structure of arrays, indexed by surfel
+// index. This avoids loading whole Surfel objects, including their rarely used
+// members, into the cache when scanning many surfels. Attributes which the
+// search does not read are deliberately not mirrored, since keeping them in
+// sync would only add writes.
+// 
+// The arrays duplicate the corresponding attributes of the Surfel objects.
+// The owner (SurfelMeshing) is responsible for keeping them in sync.
+class SurfelArrays {
+ public:
+  inline void reserve(usize size) {
+    x_.reserve(size);
+    y_.reserve(size);
+    z_.reserve(size);
+    meshing_state_.reserve(size);
+  }
+  
+  inline void resize(usize size) {
+    x_.resize(size);
+    y_.resize(size);
+    z_.resize(size);
+    meshing_state_.resize(size);
+  }
+  
+  inline void clear() {
+    x_.clear();
+    y_.clear();
+    z_.clear();
+    meshing_state_.clear();
+  }
+  
+  // Appends the attributes of the given surfel.
+  inline void PushBack(const Surfel& surfel) {
+    x_.push_back(surfel.position().x());
+    y_.push_back(surfel.position().y());
+    z_.push_back(surfel.position().z());
+    meshing_state_.push_back(surfel.meshing_state());
+  }
+  
+  // Copies all mirrored attributes from the given surfel.
+  inline void Set(u32 surfel_index, const Surfel& surfel) {
+    SetPosition(surfel_index, surfel.position());
+    meshing_state_[surfel_index] = surfel.meshing_state();
+  }
+  
+  template <typename Derived>
+  inline void SetPosition(u32 surfel_index, const MatrixBase<Derived>& position) {
+    x_[surfel_index] = position.x();
+    y_[surfel_index] = position.y();
+    z_[surfel_index] = position.z();
+  }
+  
+  inline void SetMeshingState(u32 surfel_index, Surfel::MeshingState state) {
+    meshing_state_[surfel_index] = state;
+  }
+  
+  inline Vec3f position(u32 surfel_index) const {
+    return Vec3f(x_[surfel_index], y_[surfel_index], z_[surfel_index]);
+  }
+  inline Surfel::MeshingState meshing_state(u32 surfel_index) const { return meshing_state_[surfel_index]; }
+  
+  // Raw access to the arrays.
+  inline const float* x() const { return x_.data(); }
+  inline const float* y() const { return y_.data(); }
+  inline const float* z() const { return z_.data(); }
+  inline const Surfel::MeshingState* meshing_state() const { return meshing_state_.data(); }
+  
+  inline usize size() const { return x_.size(); }
+  
+ private:
+  vector<float> x_;
+  vector<float> y_;
+  vector<float> z_;
+  vector<Surfel::MeshingState> meshing_state_;
+};
+
+}
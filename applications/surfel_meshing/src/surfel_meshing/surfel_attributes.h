@@ -0,0 +1,79 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+namespace vis {
+
+// The surfel structure is stored in a large buffer. It is organized
+// such that each row stores one attribute and each column stores the
+// attribute values for one surfel.
+
+// TODO: The attributes are quite wasteful memory-wise. I would guess that some
+//       attributes could be packed without any apparent negative consequences.
+//       For example, the normals could be stored with (much) less precision,
+//       perhaps 10 bit per component to fit into a 32 bit value?
+
+// float attributes:
+constexpr int kSurfelX = 0;
+constexpr int kSurfelY = 1;
+constexpr int kSurfelZ = 2;
+constexpr int kSurfelSmoothX = 3;
+constexpr int kSurfelSmoothY = 4;
+constexpr int kSurfelSmoothZ = 5;
+constexpr int kSurfelConfidence = 6;
+constexpr int kSurfelRadiusSquared = 7;
+constexpr int kSurfelNormalX = 8;
+constexpr int kSurfelNormalY = 9;
+constexpr int kSurfelNormalZ = 10;
+constexpr int kSurfelGradientX = 11;
+constexpr int kSurfelGradientY = 12;
+constexpr int kSurfelGradientZ = 13;
+constexpr int kSurfelAccumX = 14;
+constexpr int kSurfelAccumY = 15;
+constexpr int kSurfelAccumZ = 16;
+
+// u32 attributes:
+constexpr int kSurfelCreationStamp = 17;
+constexpr int kSurfelLastUpdateStamp = 18;
+constexpr int kSurfelNeighbor0 = 19;  // and 20, 21, 22 for the other neighbors.
+// (not an attribute itself):
+constexpr int kSurfelNeighborCount = 4;
+constexpr int kSurfelGradientCount = 23;
+
+// Vec4u8 attributes:
+constexpr int kSurfelColor = 24;  // (r, g, b, neighbor detach request flag)
+
+constexpr int kSurfelAttributeCount = 25;
+
+// Number of attributes which are transferred to the CPU per surfel (see
+// CUDASurfelReconstruction::TransferAllToCPU()).
+constexpr int kTransferredSurfelAttributeCount = 8;
+
+}
@@ -0,0 +1,59 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+namespace vis {
+
+// Constants of the surfel fusion which are shared by the CUDA and the CPU
+// implementation (cuda_surfel_reconstruction.cu, cpu_surfel_reconstruction.cc).
+
+// This threshold is not exposed as a program argument since I am not sure
+// whether any other value than 0 would be useful.
+constexpr float kSurfelNormalToViewingDirThreshold = 0;
+
+// For a surfel with a given radius, the observation radius can be up to this
+// factor worse (larger) while the observation is still integrated into the
+// surfel. Observations with larger radii than that are discarded.
+// TODO: Expose as a program argument?
+constexpr float kMaxObservationRadiusFactorForIntegration = 1.5f;
+
+// Not exposed as a program argument since it did not seem to work well.
+constexpr bool kCheckScaleCompatibilityForIntegration = false;
+
+// Not exposed as a program argument since disabling it might not make sense.
+constexpr bool kCheckScaleCompatibilityForNeighborAssignment = true;
+
+// If this is set to true, slightly occluded surfels will be protected better,
+// but the surfel integration will be unable to merge duplicate surfaces after
+// loop closures.
+constexpr bool kProtectSlightlyOccludedSurfels = false;
+constexpr float kOcclusionDepthFactor = 0.01f;
+
+}
@@ -31,10 +31,20 @@
 
 #include "surfel_meshing/surfel_meshing.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+
 #include <libvis/image_display.h>
+#include <libvis/ply_writer.h>
 #include <libvis/timing.h>
 
+#ifdef SURFEL_MESHING_HEADLESS
+#include "surfel_meshing/surfel_meshing_render_window_headless.h"
+#else
 #include "surfel_meshing/surfel_meshing_render_window.h"
+#endif
 
 namespace vis {
 
@@ -156,7 +166,7 @@ SurfelMeshing::SurfelMeshing(
     float long_edge_tolerance_factor,
     int regularization_frame_window_size,
     const shared_ptr<SurfelMeshingRenderWindow>& render_window)
-    : octree_(max_surfels_per_node, &surfels_, &triangles_),
+    : octree_(max_surfels_per_node, &surfels_, &triangles_, &surfel_arrays_),
       render_window_(render_window) {
   cos_max_angle_between_normals_ = cos(max_angle_between_normals);
   min_triangle_angle_ = min_triangle_angle;
@@ -173,8 +183,13 @@ SurfelMeshing::SurfelMeshing(
       max_neighbor_search_range_increase_factor_squared_;
   
   frame_index_ = 0;
-  next_free_triangle_index_ = kNoFreeIndex;
+  free_triangle_count_ = 0;
   merged_surfel_count_ = 0;
+  reclaimed_triangle_entry_count_ = 0;
+  moved_surfel_count_ = 0;
+  
+  track_triangle_changes_ = false;
+  output_triangle_count_ = 0;
   
   front_neighbors_too_far_away_counter_ = 0;
   front_leads_to_completed_surfel_counter_ = 0;
@@ -184,6 +199,12 @@ SurfelMeshing::SurfelMeshing(
   fronts_sharing_edge_counter_ = 0;
   holes_closed_counter_ = 0;
   connected_to_surfel_without_suitable_front_counter_ = 0;
+  
+  triangulation_thread_count_ = 1;
+  triangulating_in_parallel_ = false;
+  
+  triangulation_budget_seconds_ = 0;
+  have_triangulation_focus_ = false;
 }
 
 void SurfelMeshing::IntegrateCUDABuffers(
@@ -195,58 +216,42 @@ void SurfelMeshing::IntegrateCUDABuffers(
   u32 old_frame_index = frame_index_;
   frame_index_ = frame_index;
   
+  // Move the surfels to the entries which the buffers refer to.
+  if (!buffer.surfel_moves.empty() || buffer.surfel_count < surfels_.size()) {
+    ApplySurfelMoves(buffer);
+  }
+  
   // Update surfels which already exist on the CPU side.
-  for (usize surfel_index = 0, size = surfels_.size();
-        surfel_index < size;
-        ++ surfel_index) {
-    Surfel* surfel = &surfels_[surfel_index];
+  if (buffer.all_surfels_changed) {
+    for (usize surfel_index = 0, size = surfels_.size();
+         surfel_index < size;
+         ++ surfel_index) {
+      IntegrateCUDABufferSurfel(surfel_index, old_frame_index, buffer);
+    }
+  } else {
+    // Only the listed surfels can differ from the buffers. The flags of the
+    // others must still be reset if they were changed by the last iteration.
+    for (u32 surfel_index : surfels_with_modified_flags_) {
+      surfels_[surfel_index].SetFlags(true, true);
+    }
+    for (u32 surfel_index : surfels_to_remesh_) {
+      surfels_[surfel_index].SetFlags(true, true);
+    }
     
-    // Was the surfel merged?
-    if (surfel->node() == nullptr && buffer.surfel_radius_squared_buffer[surfel_index] < 0) {
-      continue;  // Zombie surfel
-    } else if (surfel->node() && buffer.surfel_radius_squared_buffer[surfel_index] < 0) {
-      surfels_to_check_.push_back(surfel_index);
-    } else if (surfel->node() == nullptr) {
-      // This previous Zombie surfel was reactivated.
-      LOG(FATAL) << "A merged surfel got reactivated, this is not supposed to happen.";
-      -- merged_surfel_count_;
-      octree_.AddSurfelActive(surfel_index, surfel);
-    }
-    
-    // Did the surfel move?
-    if (surfel->position().x() != buffer.surfel_x_buffer[surfel_index] ||
-        surfel->position().y() != buffer.surfel_y_buffer[surfel_index] ||
-        surfel->position().z() != buffer.surfel_z_buffer[surfel_index]) {
-      Vec3f new_position(buffer.surfel_x_buffer[surfel_index],
-                         buffer.surfel_y_buffer[surfel_index],
-                         buffer.surfel_z_buffer[surfel_index]);
-      octree_.MoveSurfel(surfel_index, surfel, new_position);
-      surfel->SetPosition(new_position);
-      
-      // Only perform meshing / remeshing if the surfel was updated or regularized.
-      // Notably, do not mesh / remesh if the surfel was moved only due to a loop closure.
-      // This improves performance and reduces cracks.
-      if (buffer.surfel_last_update_stamp_buffer[surfel_index] > surfel->last_update_stamp() ||
-          static_cast<int>(old_frame_index) - static_cast<int>(surfel->last_update_stamp()) <= regularization_frame_window_size_) {
-        // If this is a front or free surfel, always try to triangulate.
-        if (surfel->meshing_state() != Surfel::MeshingState::kCompleted) {
-          surfels_to_remesh_.push_back(surfel_index);
-        }
-        
-        // If the surfel is not free, check for remeshing.
-        if (surfel->meshing_state() != Surfel::MeshingState::kFree) {
-          surfels_to_check_.push_back(surfel_index);
-        }
+    for (u32 surfel_index : buffer.changed_surfel_indices) {
+      if (surfel_index >= surfels_.size()) {
+        break;  // New surfels are handled below.
       }
+      IntegrateCUDABufferSurfel(surfel_index, old_frame_index, buffer);
     }
-    
-    // Update remaining surfel attributes.
-    surfel->SetRadiusSquared(buffer.surfel_radius_squared_buffer[surfel_index]);
-    surfel->SetNormal(Vec3f(buffer.surfel_normal_x_buffer[surfel_index],
-                            buffer.surfel_normal_y_buffer[surfel_index],
-                            buffer.surfel_normal_z_buffer[surfel_index]));
-    surfel->SetLastUpdateStamp(buffer.surfel_last_update_stamp_buffer[surfel_index]);
-    surfel->SetFlags(true, true);
+  }
+  surfels_with_modified_flags_.clear();
+  
+  // Surfels which were created in old entries by ApplySurfelMoves() get the
+  // flags of new surfels (see below).
+  for (u32 surfel_index : new_surfels_in_old_entries_) {
+    surfels_[surfel_index].SetFlags(true, false);
+    surfels_with_modified_flags_.push_back(surfel_index);
   }
   
   // Store the index of the first new surfel.
@@ -257,7 +262,9 @@ void SurfelMeshing::IntegrateCUDABuffers(
   if (surfels_.capacity() < buffer.surfel_count) {
     constexpr usize kMinSurfelReserveCount = 3000000;
     surfels_.reserve(std::max(kMinSurfelReserveCount, 2 * buffer.surfel_count));
+    surfel_arrays_.reserve(surfels_.capacity());
     triangles_.reserve(2.1f * surfels_.capacity());
+    triangle_corner_slots_.reserve(triangles_.capacity());
   }
   
   // Create new CPU surfels for new CUDA surfels.
@@ -274,6 +281,8 @@ void SurfelMeshing::IntegrateCUDABuffers(
               buffer.surfel_normal_z_buffer[surfel_index]),
         buffer.surfel_last_update_stamp_buffer[surfel_index]);
     surfels_.back().SetFlags(true, false);
+    surfels_with_modified_flags_.push_back(surfel_index);
+    surfel_arrays_.PushBack(surfels_.back());
     
     if (buffer.surfel_radius_squared_buffer[surfel_index] < 0) {
       // The surfel was already replaced. Do not add it to the octree.
@@ -287,7 +296,247 @@ void SurfelMeshing::IntegrateCUDABuffers(
   }
 }
 
-void SurfelMeshing::TriangulateSurfel(
+void SurfelMeshing::ApplySurfelMoves(const CUDASurfelBuffersCPU& buffer) {
+  const u32 old_size = surfels_.size();
+  const u32 kept_size = std::min<usize>(old_size, buffer.surfel_count);
+  
+  // Determine the new entries of the surfels. Surfels which were moved to
+  // entries that do not exist here yet are dropped from their old entries
+  // like merged surfels, and are created as new surfels in their new entries.
+  // surfel_move_entries_ lists all entries which change, in increasing order.
+  ComposeSurfelMoves(buffer.surfel_moves, &surfel_move_original_entries_);
+  surfel_move_destinations_.clear();
+  surfel_move_entries_.clear();
+  for (const std::pair<const u32, u32>& entry : surfel_move_original_entries_) {
+    if (entry.first < old_size) {
+      surfel_move_entries_.push_back(entry.first);
+    }
+    if (entry.first < kept_size && entry.second < old_size) {
+      surfel_move_destinations_[entry.second] = entry.first;
+    }
+  }
+  for (u32 surfel_index = kept_size; surfel_index < old_size; ++ surfel_index) {
+    if (surfel_move_original_entries_.count(surfel_index) == 0) {
+      surfel_move_entries_.push_back(surfel_index);
+    }
+  }
+  std::sort(surfel_move_entries_.begin(), surfel_move_entries_.end());
+  
+  // Returns the new index of the surfel with the given old index, or
+  // Surfel::kInvalidIndex if the surfel is dropped.
+  auto new_surfel_index = [&](u32 surfel_index) -> u32 {
+    auto it = surfel_move_destinations_.find(surfel_index);
+    if (it != surfel_move_destinations_.end()) {
+      return it->second;
+    } else if (surfel_index >= kept_size ||
+               surfel_move_original_entries_.count(surfel_index) > 0) {
+      return Surfel::kInvalidIndex;
+    }
+    return surfel_index;
+  };
+  
+  usize old_merged_count = 0;
+  for (u32 surfel_index : surfel_move_entries_) {
+    if (surfels_[surfel_index].node() == nullptr) {
+      ++ old_merged_count;
+    }
+  }
+  
+  // Remove the dropped surfels from the octree and mesh, like merged surfels
+  // in CheckRemeshing().
+  for (u32 surfel_index : surfel_move_entries_) {
+    Surfel* surfel = &surfels_[surfel_index];
+    if (surfel->node() && new_surfel_index(surfel_index) == Surfel::kInvalidIndex) {
+      DeleteAllTrianglesConnectedToSurfel(surfel_index);
+      octree_.RemoveSurfel(surfel_index);
+      surfel->SetOctreeNode(nullptr, 0);
+    }
+  }
+  
+  // Update the surfel indices in the triangles of the moved surfels, and in
+  // the fronts of the surfels which are connected to them (fronts only refer
+  // to surfels which share a triangle with the surfel).
+  surfel_move_triangles_.clear();
+  for (u32 surfel_index : surfel_move_entries_) {
+    if (new_surfel_index(surfel_index) != Surfel::kInvalidIndex) {
+      const Surfel& surfel = surfels_[surfel_index];
+      for (int t = 0, triangle_count = surfel.GetTriangleCount(); t < triangle_count; ++ t) {
+        surfel_move_triangles_.push_back(surfel.GetTriangle(t));
+      }
+    }
+  }
+  std::sort(surfel_move_triangles_.begin(), surfel_move_triangles_.end());
+  surfel_move_triangles_.erase(std::unique(surfel_move_triangles_.begin(), surfel_move_triangles_.end()), surfel_move_triangles_.end());
+  
+  surfel_move_front_surfels_.clear();
+  for (u32 triangle_index : surfel_move_triangles_) {
+    for (int corner = 0; corner < 3; ++ corner) {
+      surfel_move_front_surfels_.push_back(triangles_[triangle_index].index(corner));
+    }
+  }
+  std::sort(surfel_move_front_surfels_.begin(), surfel_move_front_surfels_.end());
+  surfel_move_front_surfels_.erase(std::unique(surfel_move_front_surfels_.begin(), surfel_move_front_surfels_.end()), surfel_move_front_surfels_.end());
+  for (u32 surfel_index : surfel_move_front_surfels_) {
+    for (Front& front : surfels_[surfel_index].fronts()) {
+      front.left = new_surfel_index(front.left);
+      front.right = new_surfel_index(front.right);
+    }
+  }
+  
+  for (u32 triangle_index : surfel_move_triangles_) {
+    SurfelTriangle* triangle = &triangles_[triangle_index];
+    *triangle = SurfelTriangle(new_surfel_index(triangle->index(0)),
+                               new_surfel_index(triangle->index(1)),
+                               new_surfel_index(triangle->index(2)));
+    MarkTriangleChanged(triangle_index);
+  }
+  
+  // Update the surfel indices in the queues.
+  auto update_surfel_indices = [&](vector<u32>* surfel_indices) {
+    usize output_index = 0;
+    for (u32 surfel_index : *surfel_indices) {
+      u32 new_index = new_surfel_index(surfel_index);
+      if (new_index != Surfel::kInvalidIndex) {
+        (*surfel_indices)[output_index] = new_index;
+        ++ output_index;
+      }
+    }
+    surfel_indices->resize(output_index);
+  };
+  update_surfel_indices(&surfels_to_remesh_);
+  update_surfel_indices(&surfels_to_check_);
+  update_surfel_indices(&surfels_with_modified_flags_);
+  update_surfel_indices(&new_surfels_in_old_entries_);
+  
+  // Move the surfels. Since the moves may form chains, the moved surfels are
+  // copied out first. All changed entries are reset to merged surfels, and
+  // then receive the moved surfels.
+  surfel_move_surfels_.clear();
+  for (u32 surfel_index : surfel_move_entries_) {
+    u32 new_index = new_surfel_index(surfel_index);
+    if (new_index != Surfel::kInvalidIndex && new_index != surfel_index) {
+      surfel_move_surfels_.push_back(surfels_[surfel_index]);
+    }
+  }
+  Surfel merged_surfel(Vec3f::Zero(), -1, Vec3f::Zero(), 0);
+  merged_surfel.SetOctreeNode(nullptr, 0);
+  merged_surfel.SetFlags(true, true);
+  for (u32 surfel_index : surfel_move_entries_) {
+    if (new_surfel_index(surfel_index) != surfel_index) {
+      surfels_[surfel_index] = merged_surfel;
+    }
+  }
+  usize moved_surfel_index = 0;
+  for (u32 surfel_index : surfel_move_entries_) {
+    u32 new_index = new_surfel_index(surfel_index);
+    if (new_index != Surfel::kInvalidIndex && new_index != surfel_index) {
+      Surfel* surfel = &surfels_[new_index];
+      *surfel = surfel_move_surfels_[moved_surfel_index];
+      ++ moved_surfel_index;
+      if (surfel->node()) {
+        octree_.RenumberSurfel(new_index, *surfel);
+      }
+    }
+  }
+  
+  // Create new surfels in the remaining kept entries.
+  for (u32 surfel_index : surfel_move_entries_) {
+    if (surfel_index >= kept_size ||
+        surfel_move_original_entries_.at(surfel_index) < old_size) {
+      continue;
+    }
+    Surfel new_surfel(
+        Vec3f(buffer.surfel_x_buffer[surfel_index],
+              buffer.surfel_y_buffer[surfel_index],
+              buffer.surfel_z_buffer[surfel_index]),
+        buffer.surfel_radius_squared_buffer[surfel_index],
+        Vec3f(buffer.surfel_normal_x_buffer[surfel_index],
+              buffer.surfel_normal_y_buffer[surfel_index],
+              buffer.surfel_normal_z_buffer[surfel_index]),
+        buffer.surfel_last_update_stamp_buffer[surfel_index]);
+    new_surfel.SetOctreeNode(nullptr, 0);
+    new_surfel.SetFlags(true, false);
+    surfels_[surfel_index] = new_surfel;
+    if (buffer.surfel_radius_squared_buffer[surfel_index] >= 0) {
+      octree_.AddSurfelActive(surfel_index, &surfels_[surfel_index]);
+      new_surfels_in_old_entries_.push_back(surfel_index);
+    }
+  }
+  
+  // Drop the entries beyond the buffer's surfel count, and update the
+  // structure-of-arrays copy of the changed entries.
+  surfels_.erase(surfels_.begin() + kept_size, surfels_.end());
+  surfel_arrays_.resize(kept_size);
+  moved_surfel_count_ += moved_surfel_index;
+  
+  usize new_merged_count = 0;
+  for (u32 surfel_index : surfel_move_entries_) {
+    if (surfel_index < kept_size) {
+      surfel_arrays_.Set(surfel_index, surfels_[surfel_index]);
+      if (surfels_[surfel_index].node() == nullptr) {
+        ++ new_merged_count;
+      }
+    }
+  }
+  merged_surfel_count_ = merged_surfel_count_ + new_merged_count - old_merged_count;
+}
+
+void SurfelMeshing::IntegrateCUDABufferSurfel(
+    u32 surfel_index,
+    u32 old_frame_index,
+    const CUDASurfelBuffersCPU& buffer) {
+  Surfel* surfel = &surfels_[surfel_index];
+  
+  // Was the surfel merged?
+  if (surfel->node() == nullptr && buffer.surfel_radius_squared_buffer[surfel_index] < 0) {
+    return;  // Zombie surfel
+  } else if (surfel->node() && buffer.surfel_radius_squared_buffer[surfel_index] < 0) {
+    surfels_to_check_.push_back(surfel_index);
+  } else if (surfel->node() == nullptr) {
+    // This previous Zombie surfel was reactivated.
+    LOG(FATAL) << "A merged surfel got reactivated, this is not supposed to happen.";
+    -- merged_surfel_count_;
+    octree_.AddSurfelActive(surfel_index, surfel);
+  }
+  
+  // Did the surfel move?
+  if (surfel->position().x() != buffer.surfel_x_buffer[surfel_index] ||
+      surfel->position().y() != buffer.surfel_y_buffer[surfel_index] ||
+      surfel->position().z() != buffer.surfel_z_buffer[surfel_index]) {
+    Vec3f new_position(buffer.surfel_x_buffer[surfel_index],
+                       buffer.surfel_y_buffer[surfel_index],
+                       buffer.surfel_z_buffer[surfel_index]);
+    octree_.MoveSurfel(surfel_index, surfel, new_position);
+    surfel->SetPosition(new_position);
+    surfel_arrays_.SetPosition(surfel_index, new_position);
+    
+    // Only perform meshing / remeshing if the surfel was updated or regularized.
+    // Notably, do not mesh / remesh if the surfel was moved only due to a loop closure.
+    // This improves performance and reduces cracks.
+    if (buffer.surfel_last_update_stamp_buffer[surfel_index] > surfel->last_update_stamp() ||
+        static_cast<int>(old_frame_index) - static_cast<int>(surfel->last_update_stamp()) <= regularization_frame_window_size_) {
+      // If this is a front or free surfel, always try to triangulate.
+      if (surfel->meshing_state() != Surfel::MeshingState::kCompleted) {
+        surfels_to_remesh_.push_back(surfel_index);
+      }
+      
+      // If the surfel is not free, check for remeshing.
+      if (surfel->meshing_state() != Surfel::MeshingState::kFree) {
+        surfels_to_check_.push_back(surfel_index);
+      }
+    }
+  }
+  
+  // Update remaining surfel attributes.
+  surfel->SetRadiusSquared(buffer.surfel_radius_squared_buffer[surfel_index]);
+  surfel->SetNormal(Vec3f(buffer.surfel_normal_x_buffer[surfel_index],
+                          buffer.surfel_normal_y_buffer[surfel_index],
+                          buffer.surfel_normal_z_buffer[surfel_index]));
+  surfel->SetLastUpdateStamp(buffer.surfel_last_update_stamp_buffer[surfel_index]);
+  surfel->SetFlags(true, true);
+}
+
+bool SurfelMeshing::TriangulateSurfel(
     u32 surfel_index,
     int max_neighbors,
     u32* neighbor_indices,
@@ -301,6 +550,8 @@ void SurfelMeshing::TriangulateSurfel(
     int* angle_indices,
     bool* to_erase,
     SkinnySurfel* skinny_surfels,
+    std::vector<Front>* new_fronts,
+    vector<OctreeNode*>* passive_search_stack,
     bool force_debug,
     bool no_surfel_resets) {
   Surfel* surfel = &surfels_[surfel_index];
@@ -314,14 +565,14 @@ void SurfelMeshing::TriangulateSurfel(
   
   // If the surfel is completed, there is nothing left to triangulate.
   if (surfel->meshing_state() == Surfel::MeshingState::kCompleted) {
-    return;
+    return true;
   }
   
   // If this is a front surfel, determine the maximum distance to its
   // front-connected neighbors. If this exceeds the neighbor search radius,
   // enlarge it (up to a maximum factor) to also include those surfels.
   float neighbor_search_radius_squared = surfel->radius_squared();
-  std::vector<Front>* surfel_front = nullptr;
+  SurfelFronts* surfel_front = nullptr;
   if (surfel->meshing_state() == Surfel::MeshingState::kFront) {
     surfel_front = &surfel->fronts();
     
@@ -337,12 +588,15 @@ void SurfelMeshing::TriangulateSurfel(
           right_surfel->meshing_state() == Surfel::MeshingState::kCompleted) {
         ++ front_leads_to_completed_surfel_counter_;
         if (surfel->can_be_reset() && !no_surfel_resets) {
+          if (passive_search_stack) {
+            return false;
+          }
           if (debug) {
             LOG(INFO) << "Calling ResetSurfelToFree().";
           }
           ResetSurfelToFree(surfel_index);
         }
-        return;
+        return true;
       }
       
       float distance_to_left_squared = (surfel->position() - left_surfel->position()).squaredNorm();
@@ -386,24 +640,24 @@ void SurfelMeshing::TriangulateSurfel(
             // TODO: In theory one must ensure here that no surfels are within the triangle
             AddTriangle(surfel_index, front.right, front.left, debug);
             left_surfel->fronts().clear();
-            left_surfel->SetMeshingState(Surfel::MeshingState::kCompleted);
+            SetMeshingState(front.left, Surfel::MeshingState::kCompleted);
             // CheckSurfelState(front.left);
             right_surfel->fronts().clear();
-            right_surfel->SetMeshingState(Surfel::MeshingState::kCompleted);
+            SetMeshingState(front.right, Surfel::MeshingState::kCompleted);
             // CheckSurfelState(front.right);
             surfel_front->erase(surfel_front->begin() + front_index);
           }
         }
       }
       if (surfel_front->empty()) {
-        surfel->SetMeshingState(Surfel::MeshingState::kCompleted);
+        SetMeshingState(surfel_index, Surfel::MeshingState::kCompleted);
         // CheckSurfelState(surfel_index);
       } else {
-        surfel->SetMeshingState(Surfel::MeshingState::kFront);
+        SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
         surfel->SetCanBeRemeshed(false);
       }
       
-      return;
+      return true;
     }
     
     // Enlarge the search radius just enough to find all the front neighbors.
@@ -418,16 +672,29 @@ void SurfelMeshing::TriangulateSurfel(
   // resulting indices will be in the neighbor_indices array,
   // the resulting squared neighbor distances will be in neighbor_distances_squared.
   // Completed surfels are already excluded at this stage to improve performance.
-  int neighbor_count = octree_.FindNearestSurfelsWithinRadius<false, true>(
-      surfel->position(),
-      neighbor_search_radius_squared,
-      max_neighbors,
-      neighbor_distances_squared,
-      neighbor_indices);
+  // In parallel triangulation, the passive search must be used since the
+  // octree must not be modified.
+  int neighbor_count;
+  if (passive_search_stack) {
+    neighbor_count = octree_.FindNearestSurfelsWithinRadiusPassive<false, true>(
+        surfel->position(),
+        neighbor_search_radius_squared,
+        max_neighbors,
+        neighbor_distances_squared,
+        neighbor_indices,
+        passive_search_stack);
+  } else {
+    neighbor_count = octree_.FindNearestSurfelsWithinRadius<false, true>(
+        surfel->position(),
+        neighbor_search_radius_squared,
+        max_neighbors,
+        neighbor_distances_squared,
+        neighbor_indices);
+  }
   if (neighbor_count < 2) {
     // Cannot triangulate with less than 2 neighbors.
     surfel->SetCanBeRemeshed(false);
-    return;
+    return true;
   }
   
   // Ensure that neighbor 0 is the surfel itself (this is assumed by the
@@ -460,7 +727,7 @@ void SurfelMeshing::TriangulateSurfel(
 //         LOG(ERROR) << "Neighbor " << i << ": " << neighbor_indices[i] << " (distance_squared: " << neighbor_distances_squared[i] << ")";
 //       }
       surfel->SetCanBeRemeshed(false);
-      return;
+      return true;
     }
   }
   
@@ -488,7 +755,7 @@ void SurfelMeshing::TriangulateSurfel(
     
     (*visualization_mesh->vertices_mutable())->at(surfel_index).color() = Vec3u8(255, 60, 60);
     if (surfel->meshing_state() == Surfel::MeshingState::kFront) {
-      std::vector<Front>* surfel_front = &surfel->fronts();
+      SurfelFronts* surfel_front = &surfel->fronts();
       for (usize front_index = 0; front_index < surfel_front->size(); ++ front_index) {
         const Front& front = surfel_front->at(front_index);
         LOG(INFO) << "  Initial front neighbors: left: " << front.left << ", right: " << front.right;
@@ -504,11 +771,13 @@ void SurfelMeshing::TriangulateSurfel(
   
   // Try to advance the front if this is a front / boundary surfel now.
   if (surfel->meshing_state() == Surfel::MeshingState::kFront) {
-    TryToAdvanceFront(
+    if (!TryToAdvanceFront(
         surfel_index, surfel_front, neighbor_count, neighbor_indices, neighbors,
         edges, selected_neighbors, gaps, skinny, angle_diff,
-        angle_indices, to_erase, skinny_surfels, max_neighbors,
-        no_surfel_resets, debug);
+        angle_indices, to_erase, skinny_surfels, new_fronts, max_neighbors,
+        no_surfel_resets, passive_search_stack != nullptr, debug)) {
+      return false;
+    }
   }
   
   // DEBUG: code to show the state after processing a specific surfel (marked
@@ -519,7 +788,7 @@ void SurfelMeshing::TriangulateSurfel(
     
     (*visualization_mesh->vertices_mutable())->at(surfel_index).color() = Vec3u8(255, 60, 60);
     if (surfel->meshing_state() == Surfel::MeshingState::kFront) {
-      std::vector<Front>* surfel_front = &surfel->fronts();
+      SurfelFronts* surfel_front = &surfel->fronts();
       for (usize front_index = 0; front_index < surfel_front->size(); ++ front_index) {
         const Front& front = surfel_front->at(front_index);
         (*visualization_mesh->vertices_mutable())->at(front.left).color() = Vec3u8(255, 255, 60);
@@ -532,6 +801,7 @@ void SurfelMeshing::TriangulateSurfel(
   }
   
   surfel->SetCanBeRemeshed(false);
+  return true;
 }
 
 void SurfelMeshing::CheckRemeshing() {
@@ -539,16 +809,7 @@ void SurfelMeshing::CheckRemeshing() {
   
   // Delete old triangles where new surfels were created.
   ConditionalTimer remesh_old_triangles_loop_timer("- CheckRemeshing: Remesh new surfels");
-  for (usize surfel_index = first_new_surfel_index_, size = surfels_.size();
-        surfel_index < size;
-        ++ surfel_index) {
-    Surfel* surfel = &surfels_[surfel_index];
-    if (surfel->node() == nullptr) {
-      continue;
-    }
-    RemeshTrianglesAt(surfel, surfel->radius_squared());
-    surfels_to_remesh_.push_back(surfel_index);
-  }
+  RemeshNewSurfels();
   remesh_old_triangles_loop_timer.Stop();
   
   // Check existing surfels / triangles.
@@ -664,9 +925,41 @@ void SurfelMeshing::CheckRemeshing() {
   surfels_to_check_.clear();
 }
 
-void SurfelMeshing::Triangulate(bool force_debug) {
-  // Maximum number of surfel neighbors to consider.
-  constexpr int kMaxNeighbors = 64;
+// Maximum number of surfel neighbors to consider.
+constexpr int kMaxNeighbors = 64;
+
+// Minimum number of queued surfels for using the parallel triangulation.
+constexpr usize kMinSurfelCountForParallelTriangulation = 1000;
+
+// Number of free entries in the triangles_ vector which are planned per
+// surfel when dividing the parallel triangulation into rounds. Surfels with a
+// single front, which are the vast majority, create at most
+// MaxTrianglesCreatedByTriangulation(1) = kMaxNeighbors - 1 triangles, so this
+// leaves room for some surfels with several fronts in each round.
+constexpr usize kTriangleReservePerSurfel = 2 * kMaxNeighbors;
+
+// Upper bound on the number of triangles created by a single
+// TriangulateSurfel() call with kMaxNeighbors for a surfel with front_count
+// fronts:
+// - For a free surfel, TryToCreateInitialTriangle() creates one triangle,
+//   after which the surfel has a single front.
+// - For each front, TryToAdvanceFront() creates at most one triangle per pair
+//   of consecutive selected neighbors. These are distinct neighbor search
+//   results other than the surfel itself, so there are at most
+//   kMaxNeighbors - 2 triangles per front. Closing holes only determines which
+//   of these pairs get a triangle. Fronts which are split off are only added
+//   after the loop over the fronts, so they do not add triangles.
+// - If the front neighbors are too far away, closing one-triangle holes
+//   creates at most one triangle per front, without advancing any front.
+inline usize MaxTrianglesCreatedByTriangulation(usize front_count) {
+  return 1 + std::max<usize>(1, front_count) * (kMaxNeighbors - 2);
+}
+
+// Temporary storage for the triangulation of a single surfel. One instance is
+// used per triangulation thread.
+struct TriangulationScratch {
+  TriangulationScratch()
+      : edges(4 * kMaxNeighbors) {}
   
   // Global indices of the neighbor points, indexed by neighbor_index.
   u32 neighbor_indices[kMaxNeighbors];
@@ -683,7 +976,7 @@ void SurfelMeshing::Triangulate(bool force_debug) {
   // Double edges in the neighborhood. Uses a separate indexing (edge_index)
   // from the neighbor points. Use edges[...].index to obtain the
   // neighbor_index to which the double edge is associated.
-  std::vector<EdgeData> edges(4 * kMaxNeighbors);
+  std::vector<EdgeData> edges;
   
   // Additional storage for temporary variables used by TryToAdvanceFront().
   bool gaps[kMaxNeighbors];
@@ -692,34 +985,376 @@ void SurfelMeshing::Triangulate(bool force_debug) {
   int angle_indices[kMaxNeighbors];
   bool to_erase[kMaxNeighbors];
   SkinnySurfel skinny_surfels[kMaxNeighbors];
+  std::vector<Front> new_fronts;
   
-  // Triangulate all surfels in surfels_to_remesh_.
-  while (!surfels_to_remesh_.empty()) {
-    u32 surfel_index = surfels_to_remesh_.back();
-    surfels_to_remesh_.pop_back();
+  // Work stack for passive octree searches.
+  vector<OctreeNode*> nodes_to_search;
+};
+
+void SurfelMeshing::SetTriangulationThreadCount(int thread_count) {
+  triangulation_thread_count_ = std::max(1, thread_count);
+  if (triangulation_thread_count_ == 1) {
+    triangulation_thread_pool_.reset();
+  } else if (!triangulation_thread_pool_ ||
+             triangulation_thread_pool_->thread_count() != triangulation_thread_count_) {
+    triangulation_thread_pool_.reset(new ThreadPool(triangulation_thread_count_));
+  }
+}
+
+void SurfelMeshing::SetTriangulationBudget(double seconds) {
+  triangulation_budget_seconds_ = std::max(0.0, seconds);
+}
+
+void SurfelMeshing::SetTriangulationFocus(const Vec3f& position) {
+  have_triangulation_focus_ = true;
+  triangulation_focus_ = position;
+}
+
+void SurfelMeshing::ClearTriangulationFocus() {
+  have_triangulation_focus_ = false;
+}
+
+void SurfelMeshing::PrioritizeSurfelsToRemesh(usize count) {
+  // Remove duplicates, which accumulate if surfels get queued again while
+  // they are carried over. Skipping them does not change the result, since a
+  // surfel is skipped after it was triangulated unless it gets queued again.
+  remesh_queue_marks_.resize(surfels_.size(), 0);
+  remesh_queue_priorities_.clear();
+  for (u32 surfel_index : surfels_to_remesh_) {
+    if (remesh_queue_marks_[surfel_index]) {
+      continue;
+    }
+    remesh_queue_marks_[surfel_index] = 1;
     
-    if (!surfels_[surfel_index].can_be_remeshed() ||
-        surfels_[surfel_index].meshing_state() == Surfel::MeshingState::kCompleted) {
+    const Surfel& surfel = surfels_[surfel_index];
+    float priority = have_triangulation_focus_ ?
+        -(surfel.position() - triangulation_focus_).squaredNorm() :
+        static_cast<float>(surfel.last_update_stamp());
+    remesh_queue_priorities_.emplace_back(priority, surfel_index);
+  }
+  for (const std::pair<float, u32>& entry : remesh_queue_priorities_) {
+    remesh_queue_marks_[entry.second] = 0;
+  }
+  
+  // Select and sort the surfels with the highest priority.
+  count = std::min(count, remesh_queue_priorities_.size());
+  auto prioritized_begin = remesh_queue_priorities_.end() - count;
+  if (count > 0 && count < remesh_queue_priorities_.size()) {
+    std::nth_element(remesh_queue_priorities_.begin(), prioritized_begin, remesh_queue_priorities_.end());
+  }
+  std::sort(prioritized_begin, remesh_queue_priorities_.end());
+  
+  surfels_to_remesh_.resize(remesh_queue_priorities_.size());
+  for (usize i = 0; i < remesh_queue_priorities_.size(); ++ i) {
+    surfels_to_remesh_[i] = remesh_queue_priorities_[i].second;
+  }
+}
+
+void SurfelMeshing::TriangulateInParallel(usize count) {
+  // The triangulation of a surfel only modifies the surfel itself, its
+  // neighbors within the neighbor search radius, and its front neighbors.
+  // Surfels are thus sorted into a grid of cubic cells which are twice as
+  // large as the maximum of this "influence radius". The cells are colored
+  // with 8 colors according to the parity of their coordinates, such that
+  // the influence zones of surfels in different cells of the same color are
+  // disjoint. All cells of one color are processed in parallel, while the
+  // colors are processed one after another. Surfels in one cell are processed
+  // by a single thread in their original queue order.
+  // 
+  // The octree is not modified during this (a passive search is used), and
+  // surfel resets (which can affect large areas) are deferred to be done
+  // serially after each color.
+  
+  vector<u32> batch(surfels_to_remesh_.end() - count, surfels_to_remesh_.end());
+  surfels_to_remesh_.resize(surfels_to_remesh_.size() - count);
+  
+  // Since the passive search does not sort surfels down in the octree, do this
+  // for all nodes beforehand.
+  octree_.SortAllSurfelsDownwards();
+  
+  // Determine the influence radius. Use a safety margin.
+  float max_radius_squared = 0;
+  for (u32 surfel_index : batch) {
+    max_radius_squared = std::max(max_radius_squared, surfels_[surfel_index].radius_squared());
+  }
+  const float influence_radius = 1.05f * sqrtf(max_neighbor_search_range_increase_factor_squared_ * max_radius_squared);
+  const float influence_radius_squared = influence_radius * influence_radius;
+  const float cell_extent = 2 * influence_radius;
+  if (!(cell_extent > 0) || std::isinf(cell_extent)) {
+    surfels_to_remesh_.insert(surfels_to_remesh_.end(), batch.begin(), batch.end());
+    return;
+  }
+  
+  // Assign the surfels to cells. The cell coordinates are packed into 20 bits
+  // each. Surfels which are too far out are left for serial processing.
+  constexpr int kCoordinateBits = 20;
+  constexpr int kMaxCellCoordinate = (1 << (kCoordinateBits - 1)) - 1;
+  struct CellEntry {
+    u64 key;  // Color in the highest bits, followed by the cell coordinates.
+    u32 order;  // Processing order (the queue is processed from the back).
+    u32 surfel_index;
+  };
+  vector<CellEntry> entries;
+  entries.reserve(batch.size());
+  vector<u32> serial_surfels;
+  for (int i = static_cast<int>(batch.size()) - 1; i >= 0; -- i) {
+    u32 surfel_index = batch[i];
+    surfels_with_modified_flags_.push_back(surfel_index);
+    const Surfel& surfel = surfels_[surfel_index];
+    if (!surfel.can_be_remeshed() ||
+        surfel.meshing_state() == Surfel::MeshingState::kCompleted) {
       continue;
     }
     
-    TriangulateSurfel(
-        surfel_index,
-        kMaxNeighbors,
-        neighbor_indices,
-        neighbor_distances_squared,
-        neighbors,
-        selected_neighbors,
-        &edges,
-        gaps,
-        skinny,
-        angle_diff,
-        angle_indices,
-        to_erase,
-        skinny_surfels,
-        force_debug,
-        false);
-    // CheckSurfelState(surfel_index);
+    Vec3f cell_float = surfel.position() / cell_extent;
+    if (!(std::fabs(cell_float.x()) < kMaxCellCoordinate &&
+          std::fabs(cell_float.y()) < kMaxCellCoordinate &&
+          std::fabs(cell_float.z()) < kMaxCellCoordinate)) {
+      serial_surfels.push_back(surfel_index);
+      continue;
+    }
+    
+    u64 key = 0;
+    u64 color = 0;
+    for (int d = 0; d < 3; ++ d) {
+      u64 coordinate = static_cast<u64>(static_cast<int>(std::floor(cell_float(d))) + kMaxCellCoordinate + 1);
+      color |= (coordinate & 1) << d;
+      key |= coordinate << (d * kCoordinateBits);
+    }
+    entries.push_back(CellEntry{key | (color << (3 * kCoordinateBits)), static_cast<u32>(entries.size()), surfel_index});
+  }
+  std::sort(entries.begin(), entries.end(), [](const CellEntry& a, const CellEntry& b) {
+    return (a.key != b.key) ? (a.key < b.key) : (a.order < b.order);
+  });
+  
+  // Determine the cell ranges.
+  vector<usize> cell_starts;
+  vector<usize> color_cell_starts(9, 0);
+  for (usize i = 0; i < entries.size(); ++ i) {
+    if (i == 0 || entries[i].key != entries[i - 1].key) {
+      cell_starts.push_back(i);
+    }
+  }
+  cell_starts.push_back(entries.size());
+  for (usize cell = 0; cell < cell_starts.size() - 1; ++ cell) {
+    int color = entries[cell_starts[cell]].key >> (3 * kCoordinateBits);
+    color_cell_starts[color + 1] = cell + 1;
+  }
+  for (int color = 1; color <= 8; ++ color) {
+    color_cell_starts[color] = std::max(color_cell_starts[color], color_cell_starts[color - 1]);
+  }
+  
+  // Process the colors one after another. No reallocation of the triangles_
+  // vector may happen while the threads are running. Thus, the cells of each
+  // color are split into rounds such that there are kTriangleReservePerSurfel
+  // free entries per surfel in a round. Since a surfel may create more
+  // triangles than this (see MaxTrianglesCreatedByTriangulation()), each
+  // thread claims the upper bound for a surfel from the free entries before
+  // triangulating it, and leaves the surfel for serial processing if there
+  // are not enough free entries left. The bound only depends on the surfel's
+  // fronts, which are not modified by other threads meanwhile. This
+  // guarantees that the capacity check in AddTriangle() holds.
+  int thread_count = triangulation_thread_pool_->thread_count();
+  vector<TriangulationScratch> scratches(thread_count);
+  vector<vector<u32>> deferred_resets(thread_count);
+  vector<vector<u32>> deferred_surfels(thread_count);
+  usize cell_count = cell_starts.size() - 1;
+  usize round_start = 0;
+  while (round_start < cell_count) {
+    int color = entries[cell_starts[round_start]].key >> (3 * kCoordinateBits);
+    usize max_surfel_count = (triangles_.capacity() - triangles_.size()) / kTriangleReservePerSurfel;
+    usize first_cell_surfel_count = cell_starts[round_start + 1] - cell_starts[round_start];
+    if (max_surfel_count < first_cell_surfel_count) {
+      constexpr usize kMinTriangleReserveCount = 1024 * kTriangleReservePerSurfel;
+      triangles_.reserve(std::max(2 * triangles_.capacity(),
+                                  triangles_.size() + kMinTriangleReserveCount + first_cell_surfel_count * kTriangleReservePerSurfel));
+      triangle_corner_slots_.reserve(triangles_.capacity());
+      max_surfel_count = (triangles_.capacity() - triangles_.size()) / kTriangleReservePerSurfel;
+    }
+    usize round_end = round_start + 1;
+    while (round_end < color_cell_starts[color + 1] &&
+           cell_starts[round_end + 1] - cell_starts[round_start] <= max_surfel_count) {
+      ++ round_end;
+    }
+    
+    // Free entries which have not been claimed by a thread yet.
+    std::atomic<usize> unclaimed_triangle_count(triangles_.capacity() - triangles_.size());
+    auto claim_triangles = [&](usize count) {
+      usize unclaimed = unclaimed_triangle_count.load();
+      while (unclaimed >= count) {
+        if (unclaimed_triangle_count.compare_exchange_weak(unclaimed, unclaimed - count)) {
+          return true;
+        }
+      }
+      return false;
+    };
+    
+    triangulating_in_parallel_ = true;
+    triangulation_thread_pool_->ParallelForWithThreadIndex(round_start, round_end, 1, [&](usize cell_begin, usize cell_end, int thread_index) {
+      TriangulationScratch& scratch = scratches[thread_index];
+      for (usize cell = cell_begin; cell < cell_end; ++ cell) {
+        for (usize i = cell_starts[cell]; i < cell_starts[cell + 1]; ++ i) {
+          u32 surfel_index = entries[i].surfel_index;
+          Surfel* surfel = &surfels_[surfel_index];
+          if (!surfel->can_be_remeshed() ||
+              surfel->meshing_state() == Surfel::MeshingState::kCompleted) {
+            continue;
+          }
+          
+          // Front surfels may modify their front neighbors, so these must be
+          // within the influence radius.
+          bool front_within_radius = true;
+          for (const Front& front : surfel->fronts()) {
+            if ((surfels_[front.left].position() - surfel->position()).squaredNorm() > influence_radius_squared ||
+                (surfels_[front.right].position() - surfel->position()).squaredNorm() > influence_radius_squared) {
+              front_within_radius = false;
+              break;
+            }
+          }
+          if (!front_within_radius ||
+              !claim_triangles(MaxTrianglesCreatedByTriangulation(surfel->fronts().size()))) {
+            deferred_surfels[thread_index].push_back(surfel_index);
+            continue;
+          }
+          
+          if (!TriangulateSurfel(
+              surfel_index,
+              kMaxNeighbors,
+              scratch.neighbor_indices,
+              scratch.neighbor_distances_squared,
+              scratch.neighbors,
+              scratch.selected_neighbors,
+              &scratch.edges,
+              scratch.gaps,
+              scratch.skinny,
+              scratch.angle_diff,
+              scratch.angle_indices,
+              scratch.to_erase,
+              scratch.skinny_surfels,
+              &scratch.new_fronts,
+              &scratch.nodes_to_search,
+              false,
+              false)) {
+            deferred_resets[thread_index].push_back(surfel_index);
+          }
+        }
+      }
+    });
+    triangulating_in_parallel_ = false;
+    round_start = round_end;
+    
+    // Perform the deferred surfel resets before continuing with the next
+    // round, since the affected surfels may be in an intermediate state.
+    for (vector<u32>& resets : deferred_resets) {
+      for (u32 surfel_index : resets) {
+        ResetSurfelToFree(surfel_index);
+      }
+      resets.clear();
+    }
+  }
+  
+  // Leave the remaining surfels for serial processing. The serial loop pops
+  // from the back, so the original order is restored by reversing.
+  for (vector<u32>& surfels : deferred_surfels) {
+    serial_surfels.insert(serial_surfels.end(), surfels.begin(), surfels.end());
+  }
+  surfels_to_remesh_.insert(surfels_to_remesh_.end(), serial_surfels.rbegin(), serial_surfels.rend());
+}
+
+void SurfelMeshing::Triangulate(bool force_debug) {
+  // With a budget, work through the queue in chunks in order of priority and
+  // stop once the deadline has passed. The rest of the queue is kept for the
+  // next call. Without a budget, the whole queue is one chunk.
+  const bool budgeted = triangulation_budget_seconds_ > 0 && !force_debug;
+  const bool parallel = triangulation_thread_count_ > 1 && !force_debug;
+  chrono::steady_clock::time_point deadline = chrono::steady_clock::time_point::max();
+  if (budgeted) {
+    deadline = chrono::steady_clock::now() +
+               chrono::duration_cast<chrono::steady_clock::duration>(
+                   chrono::duration<double>(triangulation_budget_seconds_));
+  }
+  
+  // Chunk sizes for budgeted triangulation. In parallel, the deadline is only
+  // checked between chunks, so they must be small enough to not overshoot by
+  // much. Serially, the deadline is checked every few surfels. The first chunk
+  // is always completed such that the triangulation makes progress even with
+  // a tiny budget.
+  constexpr usize kParallelChunkSize = kMinSurfelCountForParallelTriangulation;
+  constexpr usize kSerialChunkSize = 256;
+  constexpr int kDeadlineCheckInterval = 16;
+  const usize budgeted_chunk_size = parallel ? kParallelChunkSize : kSerialChunkSize;
+  usize prioritized_count = 0;
+  bool first_chunk = true;
+  
+  TriangulationScratch scratch;
+  
+  while (!surfels_to_remesh_.empty() &&
+         (first_chunk || chrono::steady_clock::now() < deadline)) {
+    // The chunk is the end of the queue above queue_floor. Surfels which get
+    // queued while processing the chunk are appended and thus processed within
+    // the chunk, while the part of the queue below the floor keeps its order.
+    usize queue_floor = 0;
+    if (budgeted) {
+      if (prioritized_count < budgeted_chunk_size) {
+        prioritized_count = 4 * budgeted_chunk_size;
+        PrioritizeSurfelsToRemesh(prioritized_count);
+      }
+      prioritized_count -= budgeted_chunk_size;
+      if (surfels_to_remesh_.size() > budgeted_chunk_size) {
+        queue_floor = surfels_to_remesh_.size() - budgeted_chunk_size;
+      }
+    }
+    
+    // Triangulate (most of) the chunk in parallel first if enabled. Surfels
+    // which cannot be handled in parallel are left in the queue for the serial
+    // loop below.
+    if (parallel &&
+        surfels_to_remesh_.size() - queue_floor >= kMinSurfelCountForParallelTriangulation) {
+      TriangulateInParallel(surfels_to_remesh_.size() - queue_floor);
+    }
+    
+    // Triangulate all surfels in the chunk (including those which get queued
+    // while doing so), or until the deadline.
+    int surfels_until_deadline_check = kDeadlineCheckInterval;
+    while (surfels_to_remesh_.size() > queue_floor) {
+      if (budgeted && !first_chunk && -- surfels_until_deadline_check == 0) {
+        if (chrono::steady_clock::now() >= deadline) {
+          break;
+        }
+        surfels_until_deadline_check = kDeadlineCheckInterval;
+      }
+      
+      u32 surfel_index = surfels_to_remesh_.back();
+      surfels_to_remesh_.pop_back();
+      surfels_with_modified_flags_.push_back(surfel_index);
+      
+      if (!surfels_[surfel_index].can_be_remeshed() ||
+          surfels_[surfel_index].meshing_state() == Surfel::MeshingState::kCompleted) {
+        continue;
+      }
+      
+      TriangulateSurfel(
+          surfel_index,
+          kMaxNeighbors,
+          scratch.neighbor_indices,
+          scratch.neighbor_distances_squared,
+          scratch.neighbors,
+          scratch.selected_neighbors,
+          &scratch.edges,
+          scratch.gaps,
+          scratch.skinny,
+          scratch.angle_diff,
+          scratch.angle_indices,
+          scratch.to_erase,
+          scratch.skinny_surfels,
+          &scratch.new_fronts,
+          /*passive_search_stack*/ nullptr,
+          force_debug,
+          false);
+      // CheckSurfelState(surfel_index);
+    }
+    
+    first_chunk = false;
   }
   
 //   // DEBUG: Show color-coded surfel states.
@@ -820,25 +1455,119 @@ void SurfelMeshing::RemeshTrianglesAt(
     surfel_indices_.resize(kMaxSurfelCount);
     int surfel_count = octree_.FindNearestSurfelsWithinRadius<true, false>(
         surfel->position(), neighbor_search_radius_squared, kMaxSurfelCount,
-        surfel_distances_squared_.data(), surfel_indices_.data());
+        surfel_distances_squared_.data(), surfel_indices_.data(),
+        /*sort_results*/ false);
     for (int i = 0; i < surfel_count; ++ i) {
-      Surfel* surfel = &surfels_.at(surfel_indices_[i]);
-      for (int t = 0, triangle_count = surfel->GetTriangleCount(); t < triangle_count; ++ t) {
-        u32 triangle_index = surfel->GetTriangle(t);
-        DeleteTriangleForRemeshing(triangle_index, surfel_indices_[i]);
+      ResetSurfelForRemeshing(surfel_indices_[i]);
+    }
+  #endif
+}
+
+void SurfelMeshing::RemeshNewSurfels() {
+  // New surfels in old entries (see ApplySurfelMoves()) are few, so they are
+  // handled individually.
+  for (u32 surfel_index : new_surfels_in_old_entries_) {
+    Surfel* surfel = &surfels_[surfel_index];
+    if (surfel->node() == nullptr) {
+      continue;
+    }
+    RemeshTrianglesAt(surfel, surfel->radius_squared());
+    surfels_to_remesh_.push_back(surfel_index);
+  }
+  new_surfels_in_old_entries_.clear();
+  
+  #ifdef KEEP_TRIANGLES_IN_OCTREE
+    for (usize surfel_index = first_new_surfel_index_, size = surfels_.size();
+         surfel_index < size;
+         ++ surfel_index) {
+      Surfel* surfel = &surfels_[surfel_index];
+      if (surfel->node() == nullptr) {
+        continue;
+      }
+      RemeshTrianglesAt(surfel, surfel->radius_squared());
+      surfels_to_remesh_.push_back(surfel_index);
+    }
+  #else
+    // Must be the same as in RemeshTrianglesAt().
+    constexpr int kMaxSurfelCount = 64;
+    // Number of new surfels whose neighbors are searched at once. Limits the
+    // memory used for the search results.
+    constexpr usize kBatchSize = 4096;
+    
+    // The new surfels were added lazily to the octree. Sort them down such
+    // that the passive batch search does not have to scan them repeatedly.
+    if (first_new_surfel_index_ < surfels_.size()) {
+      octree_.SortAllSurfelsDownwards();
+    }
+    
+    batch_result_counts_.resize(kBatchSize);
+    batch_result_distances_squared_.resize(kBatchSize * kMaxSurfelCount);
+    batch_result_indices_.resize(kBatchSize * kMaxSurfelCount);
+    
+    usize surfel_index = first_new_surfel_index_;
+    while (surfel_index < surfels_.size()) {
+      batch_query_surfels_.clear();
+      batch_query_positions_.clear();
+      batch_query_radii_squared_.clear();
+      for (; surfel_index < surfels_.size() && batch_query_surfels_.size() < kBatchSize; ++ surfel_index) {
+        const Surfel& surfel = surfels_[surfel_index];
+        if (surfel.node() == nullptr) {
+          continue;
+        }
+        batch_query_surfels_.push_back(surfel_index);
+        batch_query_positions_.push_back(surfel.position());
+        batch_query_radii_squared_.push_back(surfel.radius_squared());
       }
       
-      // Reset the surfel.
-      surfel->RemoveAllTriangles();
-      surfel->fronts().clear();
-      surfel->SetMeshingState(Surfel::MeshingState::kFree);
-      surfel->SetCanBeReset(false);  // Avoid remeshing this surfel again in the same iteration if it is free now.
-      surfels_to_remesh_.push_back(surfel_indices_[i]);
-      surfel->SetCanBeRemeshed(true);
+      // The octree is not modified by the resets below, so the neighbors can
+      // be searched for all surfels of the batch upfront.
+      octree_.FindNearestSurfelsWithinRadiusBatch<true, false>(
+          batch_query_surfels_.size(), batch_query_positions_.data(),
+          batch_query_radii_squared_.data(), kMaxSurfelCount,
+          batch_result_counts_.data(), batch_result_distances_squared_.data(),
+          batch_result_indices_.data(), triangulation_thread_count_,
+          /*sort_results*/ false);
+      
+      for (usize query_index = 0; query_index < batch_query_surfels_.size(); ++ query_index) {
+        u32 query_surfel_index = batch_query_surfels_[query_index];
+        int result_count = batch_result_counts_[query_index];
+        if (result_count == kMaxSurfelCount) {
+          // Surfels which have been reset to free by the previous queries in
+          // the batch would be replaced by further surfels in a fresh search.
+          RemeshTrianglesAt(&surfels_[query_surfel_index], surfels_[query_surfel_index].radius_squared());
+        } else {
+          // Skip the surfels which have been reset to free meanwhile, since a
+          // fresh search would not return them. Apart from this, the results
+          // are the same as those of the search in RemeshTrianglesAt().
+          const u32* result_indices = &batch_result_indices_[query_index * kMaxSurfelCount];
+          for (int i = 0; i < result_count; ++ i) {
+            if (surfels_[result_indices[i]].meshing_state() != Surfel::MeshingState::kFree) {
+              ResetSurfelForRemeshing(result_indices[i]);
+            }
+          }
+        }
+        surfels_to_remesh_.push_back(query_surfel_index);
+      }
     }
   #endif
 }
 
+void SurfelMeshing::ResetSurfelForRemeshing(u32 surfel_index) {
+  Surfel* surfel = &surfels_[surfel_index];
+  for (int t = 0, triangle_count = surfel->GetTriangleCount(); t < triangle_count; ++ t) {
+    u32 triangle_index = surfel->GetTriangle(t);
+    DeleteTriangleForRemeshing(triangle_index, surfel_index);
+  }
+  
+  // Reset the surfel.
+  surfel->RemoveAllTriangles();
+  surfel->fronts().clear();
+  SetMeshingState(surfel_index, Surfel::MeshingState::kFree);
+  surfel->SetCanBeReset(false);  // Avoid remeshing this surfel again in the same iteration if it is free now.
+  surfels_to_remesh_.push_back(surfel_index);
+  surfel->SetCanBeRemeshed(true);
+}
+
 void SurfelMeshing::DeleteTriangleForRemeshing(
     u32 triangle_index) {
   SurfelTriangle* triangle = &triangles_[triangle_index];
@@ -856,7 +1585,9 @@ void SurfelMeshing::DeleteTriangleForRemeshing(
   #endif
   
   // Remove it from its corner surfels.
-  triangle->DeleteFromSurfels(triangle_index, &surfels_);
+  for (int index = 0; index < 3; ++ index) {
+    RemoveTriangleFromCornerSurfel(triangle_index, index);
+  }
   
   // Update the meshing fronts.
   bool have_debug = false;
@@ -886,8 +1617,10 @@ void SurfelMeshing::DeleteTriangleForRemeshing(
   }
   
   // Finally, remove the triangle from the triangles list.
-  triangle->MakeFreeListEntry(next_free_triangle_index_);
-  next_free_triangle_index_ = triangle_index;
+  triangle->MakeFreeListEntry();
+  free_triangle_indices_.push_back(triangle_index);
+  ++ free_triangle_count_;
+  MarkTriangleChanged(triangle_index);
   
   if (have_debug) {
     LOG(INFO) << "DEBUG: Showing state after triangle removal. Debug vertex in red and all its front neighbors in yellow.";
@@ -931,7 +1664,7 @@ void SurfelMeshing::DeleteTriangleForRemeshing(
     }
     
     // Remove the triangle from the surfel.
-    surfels_[surfel_index].RemoveTriangle(triangle_index);
+    RemoveTriangleFromCornerSurfel(triangle_index, index);
     
     // Update the meshing fronts.
     // "Left" and "right" here are from the point of view of the vertex index,
@@ -958,8 +1691,10 @@ void SurfelMeshing::DeleteTriangleForRemeshing(
   }
   
   // Finally, remove the triangle from the triangles list.
-  triangle->MakeFreeListEntry(next_free_triangle_index_);
-  next_free_triangle_index_ = triangle_index;
+  triangle->MakeFreeListEntry();
+  free_triangle_indices_.push_back(triangle_index);
+  ++ free_triangle_count_;
+  MarkTriangleChanged(triangle_index);
   
   if (have_debug) {
     LOG(INFO) << "DEBUG: Showing state after triangle removal. Debug vertex in red and all its front neighbors in yellow.";
@@ -982,7 +1717,7 @@ bool SurfelMeshing::UpdateFrontsOnTriangleRemoval(
   Surfel* surfel = &surfels_[surfel_index];
   // Except in error cases, the surfel should either have fronts or get one,
   // so retrieve a pointer to them / create them.
-  vector<Front>* surfel_fronts = &surfel->fronts();
+  SurfelFronts* surfel_fronts = &surfel->fronts();
   
   bool debug = false;
   // Uncomment this to debug this function for a specific surfel:
@@ -998,7 +1733,7 @@ bool SurfelMeshing::UpdateFrontsOnTriangleRemoval(
       surfel_fronts->clear();
     }
     surfel_fronts->emplace_back(left_surfel_index, right_surfel_index);
-    surfel->SetMeshingState(Surfel::MeshingState::kFront);
+    SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
     if (debug) {
       LOG(INFO) << "DEBUG: UpdateFrontsOnTriangleRemoval changed completed surfel to front.";
     }
@@ -1168,7 +1903,7 @@ bool SurfelMeshing::UpdateFrontsOnTriangleRemoval(
         //LOG(ERROR) << "Error: deleted all fronts for a surfel, but it has triangle references left. Not resolved yet.";
         // TODO: Re-build the fronts based on the triangle references (as those are more trustworthy), or reset the surfel?
       }
-      surfel->SetMeshingState(Surfel::MeshingState::kFree);
+      SetMeshingState(surfel_index, Surfel::MeshingState::kFree);
       surfel->SetCanBeReset(false);  // Avoid remeshing this surfel again in the same iteration if it is free now.
       if (debug) {
         LOG(INFO) << "DEBUG: UpdateFrontsOnTriangleRemoval set the state to free.";
@@ -1179,13 +1914,13 @@ bool SurfelMeshing::UpdateFrontsOnTriangleRemoval(
 //         LOG(ERROR) << "Error: have front(s) for a surfel, but it has no triangle references.";
         ++ fronts_triangles_inconsistency_counter_;
         surfel->fronts().clear();
-        surfel->SetMeshingState(Surfel::MeshingState::kFree);
+        SetMeshingState(surfel_index, Surfel::MeshingState::kFree);
         surfel->SetCanBeReset(false);  // Avoid remeshing this surfel again in the same iteration if it is free now.
         if (debug) {
           LOG(INFO) << "DEBUG: UpdateFrontsOnTriangleRemoval set the state to free in an error case (!).";
         }
       } else {
-        surfel->SetMeshingState(Surfel::MeshingState::kFront);
+        SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
         if (debug) {
           LOG(INFO) << "DEBUG: UpdateFrontsOnTriangleRemoval set the state to front. Number of fronts: " << surfel_fronts->size();
         }
@@ -1198,7 +1933,7 @@ bool SurfelMeshing::UpdateFrontsOnTriangleRemoval(
   // The triangle removal creates a new hole since it is not adjacent to an
   // existing front. Create a new front.
   surfel_fronts->emplace_back(left_surfel_index, right_surfel_index);
-  surfel->SetMeshingState(Surfel::MeshingState::kFront);
+  SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
   
   if (debug) {
     LOG(INFO) << "DEBUG: UpdateFrontsOnTriangleRemoval created a new front since no matching front was found, set the state to front. Number of fronts: " << surfel_fronts->size();
@@ -1264,7 +1999,7 @@ void SurfelMeshing::ProjectNeighborsAndTestVisibility(
     if (same_side &&
         (neighbor_surfel.meshing_state() == Surfel::MeshingState::kFront)) {
       // Save the edges for visibility checking.
-      const std::vector<Front>& neighbor_fronts = neighbor_surfel.fronts();
+      const SurfelFronts& neighbor_fronts = neighbor_surfel.fronts();
       bool reference_is_behind_all_fronts = true;  // Only if the reference surfel is behind all of the neighbor's fronts, we can be sure that the neighbor is not visible.
       for (const Front& front : neighbor_fronts) {
         if (edges->size() <= edge_count + 1) {
@@ -1397,11 +2132,11 @@ void SurfelMeshing::ProjectNeighborsAndTestVisibility(
   }
 }
 
-void SurfelMeshing::TryToAdvanceFront(
-    u32 surfel_index, std::vector<Front>* surfel_front, int neighbor_count, u32* neighbor_indices,
+bool SurfelMeshing::TryToAdvanceFront(
+    u32 surfel_index, SurfelFronts* surfel_front, int neighbor_count, u32* neighbor_indices,
     Neighbor* neighbors, std::vector<EdgeData>* edges, Neighbor* selected_neighbors,
     bool* gaps, bool* skinny, float* angle_diff, int* /*angle_indices*/, bool* to_erase, SkinnySurfel* skinny_surfels,
-    int max_neighbor_count, bool no_surfel_resets, bool debug) {
+    std::vector<Front>* new_fronts, int max_neighbor_count, bool no_surfel_resets, bool defer_surfel_resets, bool debug) {
   Surfel* surfel = &surfels_[surfel_index];
   
   // Define a coordinate system on the plane defined by the surfel normal,
@@ -1413,7 +2148,7 @@ void SurfelMeshing::TryToAdvanceFront(
   // Project the surfel onto this plane.
   Vec3f surfel_proj = surfel->position() - normal.dot(surfel->position()) * normal;  // NOTE: "proj_qp_" in PCL code
   
-  new_fronts_.clear();
+  new_fronts->clear();
   for (usize front_index = 0; front_index < surfel_front->size(); ++ front_index) {
     const Front& front = surfel_front->at(front_index);
     
@@ -1538,11 +2273,14 @@ void SurfelMeshing::TryToAdvanceFront(
         //       alternative one could only re-build the fronts instead.
         // Avoid endless loops by checking can_be_reset().
         if (surfel->can_be_reset() && !no_surfel_resets) {
+          if (defer_surfel_resets) {
+            return false;
+          }
           if (debug) {
             LOG(INFO) << "Calling ResetSurfelToFree().";
           }
           ResetSurfelToFree(surfel_index);
-          return;
+          return true;
         } else if (debug) {
           LOG(INFO) << "Not resetting the surfel to free since can_be_reset() returned false.";
         }
@@ -1563,7 +2301,7 @@ void SurfelMeshing::TryToAdvanceFront(
 //         render_window_->UpdateVisualizationMesh(visualization_mesh);
 //         std::getchar();
       }
-      surfel->SetMeshingState(Surfel::MeshingState::kFront);
+      SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
       continue;
     }
 continue_meshing:;
@@ -1974,7 +2712,7 @@ continue_meshing:;
         // Split the front up into two new ones. Split off the left one
         // because it won't be updated again.
         Front left_front(front_mutable->left, selected_neighbors[i].surfel_index);
-        new_fronts_.push_back(left_front);
+        new_fronts->push_back(left_front);
         front_mutable->left = selected_neighbors[i + 1].surfel_index;
         if (debug) {
           LOG(INFO) << "DEBUG: Split off front. front_mutable->left = " << front_mutable->left;
@@ -2019,18 +2757,18 @@ continue_meshing:;
   }
   surfel_front->resize(output_index);
   
-  // Add new_fronts_.
-  if (!new_fronts_.empty()) {
-    surfel_front->insert(surfel_front->end(), new_fronts_.begin(), new_fronts_.end());
+  // Add new_fronts.
+  if (!new_fronts->empty()) {
+    surfel_front->insert(surfel_front->end(), new_fronts->begin(), new_fronts->end());
   }
   
   // Delete vector from front map if empty. Set the surfel's state to boundary
   // if there is still a front remaining for it, otherwise set it to complete.
   if (surfel_front->empty()) {
-    surfel->SetMeshingState(Surfel::MeshingState::kCompleted);
+    SetMeshingState(surfel_index, Surfel::MeshingState::kCompleted);
     // CheckSurfelState(surfel_index);
   } else {
-    surfel->SetMeshingState(Surfel::MeshingState::kFront);
+    SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
   }
   
   if (debug) {
@@ -2053,6 +2791,8 @@ continue_meshing:;
     render_window_->UpdateVisualizationMesh(visualization_mesh);
     std::getchar();
   }
+  
+  return true;
 }
 
 void SurfelMeshing::UpdateSurfelFronts(
@@ -2097,7 +2837,7 @@ void SurfelMeshing::UpdateSurfelFronts(
   // If the corner surfel was free before, add a new front for it and set it
   // to the front meshing state.
   if (corner_surfel->meshing_state() == Surfel::MeshingState::kFree) {
-    corner_surfel->SetMeshingState(Surfel::MeshingState::kFront);
+    SetMeshingState(corner_surfel_index, Surfel::MeshingState::kFront);
     corner_surfel->fronts().push_back(Front(left_surfel_index, right_surfel_index));
     
     // CheckSurfelState(corner_surfel_index);
@@ -2119,7 +2859,7 @@ void SurfelMeshing::UpdateSurfelFronts(
   }
   
   // The corner surfel was not free before, get its fronts.
-  std::vector<Front>* corner_fronts = &corner_surfel->fronts();
+  SurfelFronts* corner_fronts = &corner_surfel->fronts();
   
   // If any front contains the new triangle's left or middle edge, then
   // flip it over to the other of those two.
@@ -2266,11 +3006,11 @@ void SurfelMeshing::UpdateSurfelFronts(
 
 void SurfelMeshing::CloseFront(
     u32 surfel_index,
-    std::vector<Front>* surfel_fronts,
+    SurfelFronts* surfel_fronts,
     usize front_index) {
   if (surfel_fronts->size() == 1) {
     // Mark the surfel complete.
-    surfels_[surfel_index].SetMeshingState(Surfel::MeshingState::kCompleted);
+    SetMeshingState(surfel_index, Surfel::MeshingState::kCompleted);
     // CheckSurfelState(surfel_index);
     surfel_fronts->clear();
   } else {
@@ -2414,7 +3154,7 @@ bool SurfelMeshing::TryToCreateInitialTriangle(
       
       // Adjust the reference surfel's state.
       surfel->fronts().push_back(Front(neighbors[right_neighbor].surfel_index, neighbors[left_neighbor].surfel_index));
-      surfel->SetMeshingState(Surfel::MeshingState::kFront);
+      SetMeshingState(surfel_index, Surfel::MeshingState::kFront);
       
       // Adjust the left neighbor's state.
       UpdateSurfelFronts(neighbors[left_neighbor].surfel_index,
@@ -2464,23 +3204,129 @@ void SurfelMeshing::AddTriangle(u32 a, u32 b, u32 c, bool debug) {
 //     LOG(FATAL) << "Attempting to generate a degenerate triangle: " << a << ", " << b << ", " << c << std::endl << *surfel_a << std::endl << *surfel_b << std::endl << *surfel_c;
 //   }
   
+  // In parallel triangulation, the triangles_ vector and its free list are
+  // shared by all threads. The vector must not be reallocated then.
+  std::unique_lock<std::mutex> lock(triangles_mutex_, std::defer_lock);
+  if (triangulating_in_parallel_) {
+    lock.lock();
+  }
+  
+  // Skip outdated free entries (see free_triangle_indices_).
+  while (!free_triangle_indices_.empty() &&
+         free_triangle_indices_.back() >= triangles_.size()) {
+    free_triangle_indices_.pop_back();
+  }
+  
   u32 triangle_index;
-  if (next_free_triangle_index_ == kNoFreeIndex) {
+  if (free_triangle_indices_.empty()) {
+    if (triangulating_in_parallel_) {
+      // Holds since TriangulateInParallel() only triangulates a surfel after
+      // claiming enough free entries for it.
+      CHECK_LT(triangles_.size(), triangles_.capacity());
+      CHECK_LT(triangle_corner_slots_.size(), triangle_corner_slots_.capacity());
+    }
     triangles_.emplace_back(a, b, c);
+    triangle_corner_slots_.emplace_back();
     triangle_index = triangles_.size() - 1;
   } else {
-    triangle_index = next_free_triangle_index_;
-    next_free_triangle_index_ = triangles_[next_free_triangle_index_].free_list_value();
-    // Use placement new to construct the new triangle over the next free list entry.
+    triangle_index = free_triangle_indices_.back();
+    free_triangle_indices_.pop_back();
+    -- free_triangle_count_;
+    // Use placement new to construct the new triangle over the free entry.
     new(&triangles_[triangle_index]) SurfelTriangle(a, b, c);
   }
-  
-  surfel_a->AddTriangle(triangle_index);
-  surfel_b->AddTriangle(triangle_index);
-  surfel_c->AddTriangle(triangle_index);
+  MarkTriangleChanged(triangle_index);
   #ifdef KEEP_TRIANGLES_IN_OCTREE
     octree_.AddTriangle(triangle_index, triangles_[triangle_index]);
   #endif
+  if (lock.owns_lock()) {
+    lock.unlock();
+  }
+  
+  SurfelTriangleCornerSlots* corner_slots = &triangle_corner_slots_[triangle_index];
+  corner_slots->slots[0] = surfel_a->AddTriangle(triangle_index);
+  corner_slots->slots[1] = surfel_b->AddTriangle(triangle_index);
+  corner_slots->slots[2] = surfel_c->AddTriangle(triangle_index);
+}
+
+void SurfelMeshing::RemoveTriangleFromCornerSurfel(u32 triangle_index, int corner) {
+  u32 surfel_index = triangles_[triangle_index].index(corner);
+  Surfel* surfel = &surfels_[surfel_index];
+  int slot = triangle_corner_slots_[triangle_index].slots[corner];
+  int last_slot = surfel->GetTriangleCount() - 1;
+  surfel->RemoveTriangleAt(slot);
+  if (slot == last_slot) {
+    return;
+  }
+  
+  // The last triangle in the surfel's list was moved into the slot. Find the
+  // corner of it which refers to this surfel. Comparing the slot as well
+  // identifies the corner correctly even if the surfel is at several corners.
+  u32 moved_triangle_index = surfel->GetTriangle(slot);
+  const SurfelTriangle& moved_triangle = triangles_[moved_triangle_index];
+  SurfelTriangleCornerSlots* moved_slots = &triangle_corner_slots_[moved_triangle_index];
+  for (int i = 0; i < 3; ++ i) {
+    if (moved_triangle.index(i) == surfel_index && moved_slots->slots[i] == last_slot) {
+      moved_slots->slots[i] = slot;
+      return;
+    }
+  }
+  LOG(FATAL) << "RemoveTriangleFromCornerSurfel(): inconsistent triangle corner slots.";
+}
+
+usize SurfelMeshing::CompactTriangles(usize max_moved_triangles) {
+  // With few free entries, compaction is not worth it since new triangles
+  // re-use the free entries anyway.
+  constexpr usize kMinFreeEntryFractionInverse = 16;
+  if (free_triangle_count_ == 0 ||
+      free_triangle_count_ * kMinFreeEntryFractionInverse < triangles_.size()) {
+    return 0;
+  }
+  
+  usize old_size = triangles_.size();
+  usize moved_triangle_count = 0;
+  while (free_triangle_count_ > 0 && moved_triangle_count < max_moved_triangles) {
+    u32 free_index = free_triangle_indices_.back();
+    free_triangle_indices_.pop_back();
+    if (free_index >= triangles_.size()) {
+      continue;  // Outdated entry.
+    }
+    
+    u32 last_index = triangles_.size() - 1;
+    if (!triangles_[last_index].IsValid()) {
+      // Drop the free entry at the end. Its entry in free_triangle_indices_
+      // becomes outdated, so the popped one must be kept.
+      if (free_index != last_index) {
+        free_triangle_indices_.push_back(free_index);
+      }
+    } else {
+      // Move the last triangle into the free entry.
+      const SurfelTriangle& triangle = triangles_[last_index];
+      const SurfelTriangleCornerSlots& corner_slots = triangle_corner_slots_[last_index];
+      #ifdef KEEP_TRIANGLES_IN_OCTREE
+        octree_.RemoveTriangle(last_index, triangle);
+      #endif
+      for (int corner = 0; corner < 3; ++ corner) {
+        surfels_[triangle.index(corner)].SetTriangle(corner_slots.slots[corner], free_index);
+      }
+      triangles_[free_index] = triangle;
+      triangle_corner_slots_[free_index] = corner_slots;
+      #ifdef KEEP_TRIANGLES_IN_OCTREE
+        octree_.AddTriangle(free_index, triangles_[free_index]);
+      #endif
+      MarkTriangleChanged(free_index);
+      MarkTriangleChanged(last_index);
+      ++ moved_triangle_count;
+    }
+    
+    triangles_.pop_back();
+    triangle_corner_slots_.pop_back();
+    -- free_triangle_count_;
+  }
+  
+  usize reclaimed_entry_count = old_size - triangles_.size();
+  reclaimed_triangle_entry_count_ += reclaimed_entry_count;
+  return reclaimed_entry_count;
 }
 
 // Variant of IsVisible where the ray starts from the given origin point.
@@ -2515,7 +3361,7 @@ bool SurfelMeshing::IsInFrontOfLine(const MatrixBase<DerivedA>& X, const MatrixB
   return perpendicular.dot(S1 - X) * perpendicular.dot(S1) > 0;
 }
 
-void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
+bool SurfelMeshing::CheckSurfelState(u32 surfel_index) {
   Surfel* surfel = &surfels_[surfel_index];
   
   vector<ConnectedTriangleComponent> components;
@@ -2543,6 +3389,15 @@ void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
       continue;
     }
     
+    // The triangle must know its position in the surfel's triangle list.
+    const SurfelTriangleCornerSlots& corner_slots = triangle_corner_slots_[triangle_index];
+    if (!((triangle->index(0) == surfel_index && corner_slots.slots[0] == t) ||
+          (triangle->index(1) == surfel_index && corner_slots.slots[1] == t) ||
+          (triangle->index(2) == surfel_index && corner_slots.slots[2] == t))) {
+      LOG(FATAL) << "CheckSurfelState(): the corner slots of a triangle referenced in a surfel do not match its position in the surfel's triangle list!";
+      continue;
+    }
+    
     // Does the triangle attach to an existing component?
     bool attached_to_existing = false;
     for (usize c = 0; c < components.size(); ++ c) {
@@ -2664,8 +3519,18 @@ void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
 //     }
 //   }
   
+  bool consistent = true;
+  if (surfel_arrays_.meshing_state(surfel_index) != surfel->meshing_state()) {
+    LOG(ERROR) << "CheckSurfelState found a meshing state mismatch between the surfel and surfel_arrays_.";
+    consistent = false;
+  }
+  if (surfel_arrays_.position(surfel_index) != surfel->position()) {
+    LOG(ERROR) << "CheckSurfelState found a position mismatch between the surfel and surfel_arrays_.";
+    consistent = false;
+  }
   if (has_stray_component) {
     LOG(ERROR) << "CheckSurfelState found a stray component!";
+    consistent = false;
     
 //     shared_ptr<Mesh3fCu8> visualization_mesh(new Mesh3fCu8());
 //     ConvertToMesh3fCu8(visualization_mesh.get());
@@ -2690,6 +3555,7 @@ void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
   if (surfel->meshing_state() != computed_state) {
     LOG(ERROR) << "CheckSurfelState found a mismatch: computed state is " << static_cast<int>(computed_state) << ", saved surfel state is " << static_cast<int>(surfel->meshing_state()) << ".";
     LOG(ERROR) << "  Number of attached triangles: " << surfel->GetTriangleCount();
+    consistent = false;
   
 //     LOG(ERROR) << "  Visualization: all vertices of adjacent triangles are yellow, the surfel " << surfel_index << " with the state mismatch is red.";
 //     
@@ -2714,7 +3580,7 @@ void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
   if (surfel->meshing_state() == Surfel::MeshingState::kFront) {
     bool have_front_mismatch = false;
     
-    std::vector<Front>* surfel_front = &surfel->fronts();
+    SurfelFronts* surfel_front = &surfel->fronts();
     std::vector<bool> front_left_matched(surfel_front->size(), false);
     std::vector<bool> front_right_matched(surfel_front->size(), false);
     for (int c = 0; c < static_cast<int>(components.size()); ++ c) {
@@ -2759,7 +3625,7 @@ void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
       }
     }
     
-    if (have_front_mismatch) {
+    if (have_front_mismatch && render_window_) {
       shared_ptr<Mesh3fCu8> visualization_mesh(new Mesh3fCu8());
       ConvertToMesh3fCu8(visualization_mesh.get());
       
@@ -2769,7 +3635,10 @@ void SurfelMeshing::CheckSurfelState(u32 surfel_index) {
       render_window_->UpdateVisualizationMesh(visualization_mesh);
       std::getchar();
     }
+    consistent &= !have_front_mismatch;
   }
+  
+  return consistent;
 }
 
 void SurfelMeshing::DeleteAllTrianglesConnectedToSurfel(u32 surfel_index) {
@@ -2783,7 +3652,7 @@ void SurfelMeshing::DeleteAllTrianglesConnectedToSurfel(u32 surfel_index) {
   // Reset the surfel.
   surfel->RemoveAllTriangles();
   surfel->fronts().clear();
-  surfel->SetMeshingState(Surfel::MeshingState::kFree);
+  SetMeshingState(surfel_index, Surfel::MeshingState::kFree);
   surfel->SetCanBeReset(false);  // Avoid remeshing this surfel again in the same iteration if it is free now.
   surfels_to_remesh_.push_back(surfel_index);
 }
@@ -2862,4 +3731,160 @@ void SurfelMeshing::ConvertToMesh3fCu8(Mesh3fCu8* output, bool indices_only) {
   }
 }
 
+bool SurfelMeshing::WriteMeshAsPLY(const char* path, const u8* surfel_colors) const {
+  PLYWriter writer;
+  writer.AddVertexProperty<float>("x");
+  writer.AddVertexProperty<float>("y");
+  writer.AddVertexProperty<float>("z");
+  if (surfel_colors) {
+    writer.AddVertexProperty<u8>("red");
+    writer.AddVertexProperty<u8>("green");
+    writer.AddVertexProperty<u8>("blue");
+  }
+  writer.SetFaceCount(triangle_count());
+  if (!writer.Open(path, surfels_.size() - merged_surfel_count_)) {
+    return false;
+  }
+  
+  // Vertices. The remapping skips over the merged surfels.
+  vector<u32> index_remapping(surfels_.size());
+  u32 index = 0;
+  for (usize i = 0, size = surfels_.size(); i < size; ++ i) {
+    const Surfel& surfel = surfels_[i];
+    if (surfel.node() == nullptr) {
+      continue;
+    }
+    
+    writer.Write(surfel.position().x());
+    writer.Write(surfel.position().y());
+    writer.Write(surfel.position().z());
+    if (surfel_colors) {
+      writer.Write(surfel_colors[3 * i + 0]);
+      writer.Write(surfel_colors[3 * i + 1]);
+      writer.Write(surfel_colors[3 * i + 2]);
+    }
+    index_remapping[i] = index;
+    ++ index;
+  }
+  CHECK_EQ(index, surfels_.size() - merged_surfel_count_);
+  
+  // Faces.
+  for (usize i = 0, size = triangles_.size(); i < size; ++ i) {
+    const SurfelTriangle& st = triangles_[i];
+    if (st.IsValid()) {
+      writer.WriteFace(index_remapping[st.index(0)],
+                       index_remapping[st.index(1)],
+                       index_remapping[st.index(2)]);
+    }
+  }
+  
+  return writer.Close();
+}
+
+bool SurfelMeshing::WritePointCloudAsPLY(const char* path) const {
+  PLYWriter writer;
+  writer.AddVertexProperty<float>("x");
+  writer.AddVertexProperty<float>("y");
+  writer.AddVertexProperty<float>("z");
+  writer.AddVertexProperty<float>("normal_x");
+  writer.AddVertexProperty<float>("normal_y");
+  writer.AddVertexProperty<float>("normal_z");
+  if (!writer.Open(path, surfels_.size() - merged_surfel_count_)) {
+    return false;
+  }
+  
+  for (usize i = 0, size = surfels_.size(); i < size; ++ i) {
+    const Surfel& surfel = surfels_[i];
+    if (surfel.node() == nullptr) {
+      continue;
+    }
+    
+    writer.Write(surfel.position().x());
+    writer.Write(surfel.position().y());
+    writer.Write(surfel.position().z());
+    writer.Write(surfel.normal().x());
+    writer.Write(surfel.normal().y());
+    writer.Write(surfel.normal().z());
+  }
+  
+  return writer.Close();
+}
+
+void SurfelMeshing::SetMeshDeltaTracking(bool enable) {
+  track_triangle_changes_ = enable;
+  changed_triangles_.clear();
+  triangle_change_flags_.clear();
+  output_triangle_count_ = 0;
+  
+  if (enable) {
+    triangle_change_flags_.resize(triangles_.size(), 0);
+    for (usize i = 0, size = triangles_.size(); i < size; ++ i) {
+      if (triangles_[i].IsValid()) {
+        MarkTriangleChanged(i);
+      }
+    }
+  }
+}
+
+void SurfelMeshing::MarkTriangleChanged(u32 triangle_index) {
+  if (!track_triangle_changes_) {
+    return;
+  }
+  
+  if (triangle_index >= triangle_change_flags_.size()) {
+    triangle_change_flags_.resize(triangles_.size(), 0);
+  }
+  u8& flags = triangle_change_flags_[triangle_index];
+  if (!(flags & kTriangleChangedFlag)) {
+    flags |= kTriangleChangedFlag;
+    changed_triangles_.push_back(triangle_index);
+  }
+}
+
+void SurfelMeshing::OutputMeshDelta(TriangleListDelta* output) {
+  CHECK(track_triangle_changes_) << "OutputMeshDelta() requires SetMeshDeltaTracking(true)";
+  
+  output->Clear();
+  
+  // Triangles may be added and removed multiple times between two outputs, so
+  // only the difference between the current state and the state at the last
+  // output is relevant.
+  std::sort(changed_triangles_.begin(), changed_triangles_.end());
+  output->slots.reserve(changed_triangles_.size());
+  output->triangles.reserve(changed_triangles_.size());
+  for (u32 triangle_index : changed_triangles_) {
+    u8& flags = triangle_change_flags_[triangle_index];
+    bool was_output = flags & kTriangleOutputFlag;
+    // Slots beyond the end of the triangles vector were dropped by
+    // CompactTriangles(). They are removed by the slot_count of the delta.
+    bool is_dropped = triangle_index >= triangles_.size();
+    bool is_valid = !is_dropped && triangles_[triangle_index].IsValid();
+    
+    flags = is_valid ? static_cast<u8>(kTriangleOutputFlag) : static_cast<u8>(0);
+    if (!was_output && !is_valid) {
+      continue;
+    }
+    
+    if (is_dropped) {
+      -- output_triangle_count_;
+      continue;
+    }
+    const SurfelTriangle& st = triangles_[triangle_index];
+    output->slots.push_back(triangle_index);
+    if (is_valid) {
+      output->triangles.push_back(Triangle<u32>(st.index(0), st.index(1), st.index(2)));
+      if (!was_output) {
+        ++ output_triangle_count_;
+      }
+    } else {
+      output->triangles.push_back(TriangleListDelta::RemovedTriangle());
+      -- output_triangle_count_;
+    }
+  }
+  changed_triangles_.clear();
+  
+  output->slot_count = triangles_.size();
+  output->triangle_count = output_triangle_count_;
+}
+
 }
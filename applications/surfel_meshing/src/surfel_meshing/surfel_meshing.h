@@ -29,8 +29,10 @@
 
 #pragma once
 
+#include <atomic>
 #include <queue>
 #include <memory>
+#include <mutex>
 #include <set>
 #include <unordered_map>
 
@@ -45,6 +47,9 @@
 #include "surfel_meshing/cuda_surfels_cpu.h"
 #include "surfel_meshing/octree.h"
 #include "surfel_meshing/surfel.h"
+#include "surfel_meshing/surfel_arrays.h"
+#include "surfel_meshing/thread_pool.h"
+#include "surfel_meshing/triangle_list_delta.h"
 
 namespace vis {
 
@@ -70,7 +75,11 @@ class SurfelMeshing {
       const shared_ptr<SurfelMeshingRenderWindow>& render_window);
   
   // Updates this SurfelMeshing's CPU surfels to the contents of the buffers
-  // coming from the CUDA surfels.
+  // coming from the CUDA surfels. If the buffers list the changed surfels (see
+  // CUDASurfelsCPU::SetChangedSurfels()), only those are updated instead of
+  // comparing all surfels with the buffers. If the buffers contain surfel
+  // moves (see CUDASurfelsCPU::SetSurfelMoves()), the CPU surfels are moved
+  // accordingly first, together with their triangles and meshing state.
   void IntegrateCUDABuffers(
       int frame_index,
       const CUDASurfelsCPU& buffers);
@@ -79,8 +88,37 @@ class SurfelMeshing {
   void CheckRemeshing();
   
   // Iterates over surfels_to_remesh_ to perform a triangulation iteration.
+  // If more than one triangulation thread is set, most surfels are
+  // triangulated in parallel (unless force_debug is true). If a triangulation
+  // budget is set (see SetTriangulationBudget()), the queued surfels are
+  // triangulated in order of priority until the budget is used up, and the
+  // remaining ones are carried over to the next call.
   void Triangulate(bool force_debug = false);
   
+  // Limits the wall-clock time spent in each Triangulate() call to
+  // approximately the given number of seconds. Zero (the default) disables
+  // the limit. Since the queue is only checked between surfels (or between
+  // chunks of surfels when triangulating in parallel), the budget can be
+  // exceeded slightly. With a budget, the mesh depends on the timing.
+  void SetTriangulationBudget(double seconds);
+  
+  // Sets the position (usually the current camera position) around which
+  // surfels are triangulated first if a triangulation budget is set. Without
+  // a focus position, the most recently updated surfels are triangulated
+  // first.
+  void SetTriangulationFocus(const Vec3f& position);
+  void ClearTriangulationFocus();
+  
+  // Returns the number of queued surfels which were carried over by the last
+  // Triangulate() call (may contain duplicates).
+  inline usize remesh_backlog_size() const { return surfels_to_remesh_.size(); }
+  
+  // Sets the number of threads used by Triangulate() and by the neighbor
+  // searches for new surfels in CheckRemeshing(). The default is 1.
+  void SetTriangulationThreadCount(int thread_count);
+  
+  inline int triangulation_thread_count() const { return triangulation_thread_count_; }
+  
   // Converts the surfels to a point cloud. All colors are set to black.
   void ConvertToPoint3fC3u8Cloud(Point3fC3u8Cloud* output);
   
@@ -88,9 +126,42 @@ class SurfelMeshing {
   // TODO: indices_only has a hidden side effect wrt. including merged vertices in the indexing, document this (or better: split into two functions)
   void ConvertToMesh3fCu8(Mesh3fCu8* output, bool indices_only = false);
   
+  // Writes the mesh as a binary PLY file directly from the surfel and triangle
+  // arrays, without building a Mesh3fCu8 first. Merged surfels are left out
+  // (with the triangle indices adjusted accordingly), like in
+  // ConvertToMesh3fCu8(). If surfel_colors is given, it must contain 3 color
+  // values per surfel, indexed like the surfels vector. Returns false if
+  // writing failed.
+  bool WriteMeshAsPLY(const char* path, const u8* surfel_colors) const;
+  
+  // Writes the surfels as a binary PLY point cloud with positions and normals.
+  // Merged surfels are left out. Returns false if writing failed.
+  bool WritePointCloudAsPLY(const char* path) const;
+  
+  // Enables or disables tracking of the triangles that get added or removed,
+  // which is required for OutputMeshDelta(). When enabling, all existing
+  // triangles are treated as not having been output yet.
+  void SetMeshDeltaTracking(bool enable);
+  
+  // Outputs the changes of the triangle list since the last call (or since
+  // enabling delta tracking) as indices into the surfels vector, like
+  // ConvertToMesh3fCu8() with indices_only set. The delta's slots are the
+  // triangle indices. The cost is proportional to the number of changed
+  // triangles rather than to the size of the mesh.
+  void OutputMeshDelta(TriangleListDelta* output);
+  
+  inline bool mesh_delta_tracking() const { return track_triangle_changes_; }
+  
   // Provides raw (read) access to the surfels.
   inline const vector<Surfel>& surfels() const { return surfels_; }
   
+  // Provides (read) access to the structure-of-arrays copy of the frequently
+  // used surfel attributes.
+  inline const SurfelArrays& surfel_arrays() const { return surfel_arrays_; }
+  
+  // Provides (read) access to the octree, e.g., for its node pool statistics.
+  inline const CompressedOctree& octree() const { return octree_; }
+  
   // Returns the number of valid triangles (which may be smaller than the triangles vector size).
   inline usize triangle_count() const {
     usize count = 0;
@@ -107,6 +178,32 @@ class SurfelMeshing {
   // iteration.
   inline usize deleted_triangle_count() const { return deleted_triangle_count_; }
   
+  // Moves up to max_moved_triangles triangles from the end of the triangles
+  // vector into free entries, and drops the free entries at its end, if at
+  // least a sixteenth of the entries is free. This shortens the scans over
+  // all triangles (for example, for outputting the mesh). Returns the number
+  // of entries by which the triangles vector was shortened. Moved triangles
+  // are reported as changed by OutputMeshDelta() in both slots.
+  usize CompactTriangles(usize max_moved_triangles);
+  
+  // Returns the size of the triangles vector, including the free entries.
+  inline usize triangle_entry_count() const { return triangles_.size(); }
+  
+  // Returns the number of free entries in the triangles vector.
+  inline usize free_triangle_entry_count() const { return free_triangle_count_; }
+  
+  // Returns the number of entries in the surfels vector which are inactive due
+  // to having been merged.
+  inline usize merged_surfel_count() const { return merged_surfel_count_; }
+  
+  // Returns the total number of entries by which the triangles vector was
+  // shortened by CompactTriangles().
+  inline usize reclaimed_triangle_entry_count() const { return reclaimed_triangle_entry_count_; }
+  
+  // Returns the total number of surfels which were moved to other entries
+  // due to surfel moves in the buffers (see CUDASurfelsCPU::SetSurfelMoves()).
+  inline usize moved_surfel_count() const { return moved_surfel_count_; }
+  
   
   // Deletes triangles within (approximately) neighbor_search_radius_squared
   // around the surfel and makes the affected surfels be remeshed later.
@@ -125,14 +222,51 @@ class SurfelMeshing {
   
   // For debugging: Determines the surfel state from its adjacent triangles and
   // checks whether it matches the state stored in the surfel struct.
+  // Returns true if no inconsistency was found.
   // NOTE: Does not check that the triangles have consistent orientations.
-  void CheckSurfelState(u32 surfel_index);
+  bool CheckSurfelState(u32 surfel_index);
   
  private:
-  constexpr static u32 kNoFreeIndex = std::numeric_limits<u32>::max();
-  
-  // Attempts to triangulate the surfel with the given index.
-  void TriangulateSurfel(
+  // Flags for triangle_change_flags_.
+  constexpr static u8 kTriangleChangedFlag = 1 << 0;
+  constexpr static u8 kTriangleOutputFlag = 1 << 1;
+  
+  // Records that the triangle with the given index was added or removed, if
+  // delta tracking is enabled. Must be called with triangles_mutex_ locked
+  // while triangulating in parallel.
+  void MarkTriangleChanged(u32 triangle_index);
+  
+  // Moves the CPU surfels according to the surfel moves in the buffer, and
+  // drops the surfels beyond the buffer's surfel count. Surfels which are
+  // overwritten or dropped are removed from the mesh like merged surfels. Part
+  // of IntegrateCUDABuffers().
+  void ApplySurfelMoves(const CUDASurfelBuffersCPU& buffer);
+  
+  // Updates the existing CPU surfel with the given index to the buffer
+  // contents and queues it for (re)meshing if necessary. Part of
+  // IntegrateCUDABuffers().
+  void IntegrateCUDABufferSurfel(
+      u32 surfel_index,
+      u32 old_frame_index,
+      const CUDASurfelBuffersCPU& buffer);
+  
+  // Removes duplicates from surfels_to_remesh_ and moves the count surfels
+  // with the highest triangulation priority to its end (from where it is
+  // processed), sorted by increasing priority. Takes linear time in the queue
+  // size apart from sorting these surfels.
+  void PrioritizeSurfelsToRemesh(usize count);
+  
+  // Triangulates the last count queued surfels in parallel, as far as
+  // possible. Leaves surfels which must be triangulated serially at the end
+  // of surfels_to_remesh_.
+  void TriangulateInParallel(usize count);
+  
+  // Attempts to triangulate the surfel with the given index. If
+  // passive_search_stack is given, the octree is not modified and the function
+  // is safe to be called in parallel for surfels whose neighborhoods do not
+  // overlap. In this case, surfel resets are not performed; instead, false is
+  // returned and ResetSurfelToFree() must be called for the surfel afterwards.
+  bool TriangulateSurfel(
       u32 surfel_index,
       int max_neighbors,
       u32* neighbor_indices,
@@ -146,9 +280,19 @@ class SurfelMeshing {
       int* angle_indices,
       bool* to_erase,
       SkinnySurfel* skinny_surfels,
+      std::vector<Front>* new_fronts,
+      vector<OctreeNode*>* passive_search_stack,
       bool force_debug = false,
       bool no_surfel_resets = false);
   
+  // Calls RemeshTrianglesAt() for all surfels which were created by the last
+  // call to IntegrateCUDABuffers(), using batched neighbor searches.
+  void RemeshNewSurfels();
+  
+  // Deletes all triangles connected to the surfel, resets it to free and makes
+  // it be remeshed later.
+  void ResetSurfelForRemeshing(u32 surfel_index);
+  
   // Deletes the triangle, adds the adjacent surfels to surfels_to_remesh_.
   void DeleteTriangleForRemeshing(u32 triangle_index);
   
@@ -173,11 +317,13 @@ class SurfelMeshing {
       std::vector<EdgeData>* double_edges,
       bool debug);
   
-  void TryToAdvanceFront(
-      u32 surfel_index, std::vector<Front>* surfel_front, int neighbor_count, u32* neighbor_indices,
+  // Returns false if the surfel should be reset, but defer_surfel_resets was
+  // set.
+  bool TryToAdvanceFront(
+      u32 surfel_index, SurfelFronts* surfel_front, int neighbor_count, u32* neighbor_indices,
       Neighbor* neighbors, std::vector<EdgeData>* double_edges, Neighbor* selected_neighbors,
       bool* gaps, bool* skinny, float* angle_diff, int* /*angle_indices*/, bool* to_erase, SkinnySurfel* skinny_surfels,
-      int max_neighbor_count, bool no_surfel_resets, bool debug);
+      std::vector<Front>* new_fronts, int max_neighbor_count, bool no_surfel_resets, bool defer_surfel_resets, bool debug);
   
   // Left and right are meant from the stand point of the reference surfel,
   // looking outwards for triangulation.
@@ -195,7 +341,7 @@ class SurfelMeshing {
   
   void CloseFront(
       u32 surfel_index,
-      std::vector<Front>* surfel_fronts,
+      SurfelFronts* surfel_fronts,
       usize front_index);
   
   bool TryToCreateInitialTriangle(
@@ -206,6 +352,10 @@ class SurfelMeshing {
   // Does not change any surfel attributes, this must be done separately.
   void AddTriangle(u32 a, u32 b, u32 c, bool debug);
   
+  // Removes the triangle from the triangle list of the surfel at the given
+  // corner of it, using triangle_corner_slots_ instead of searching the list.
+  void RemoveTriangleFromCornerSurfel(u32 triangle_index, int corner);
+  
   // Variant of IsVisible where the ray starts from the given origin point.
   template <typename DerivedA, typename DerivedB, typename DerivedC, typename DerivedD>
   bool IsVisible(const MatrixBase<DerivedA>& X, const MatrixBase<DerivedB>& S1, const MatrixBase<DerivedC>& S2, const MatrixBase<DerivedD>& origin);
@@ -220,6 +370,12 @@ class SurfelMeshing {
   template <typename DerivedA, typename DerivedB, typename DerivedC>
   bool IsInFrontOfLine(const MatrixBase<DerivedA>& X, const MatrixBase<DerivedB>& S1, const MatrixBase<DerivedC>& S2);
   
+  // Sets the meshing state of the surfel and its copy in surfel_arrays_.
+  inline void SetMeshingState(u32 surfel_index, Surfel::MeshingState state) {
+    surfels_[surfel_index].SetMeshingState(state);
+    surfel_arrays_.SetMeshingState(surfel_index, state);
+  }
+  
   // Deletes all triangles connected to a surfel.
   void DeleteAllTrianglesConnectedToSurfel(u32 surfel_index);
   
@@ -231,6 +387,10 @@ class SurfelMeshing {
   // Unordered list of all surfels.
   vector<Surfel> surfels_;
   
+  // Copy of the frequently accessed attributes of surfels_, which is used by
+  // the octree for neighbor searches. Must be kept in sync with surfels_.
+  SurfelArrays surfel_arrays_;
+  
   // Lazy compressed octree containing all surfels.
   CompressedOctree octree_;
   
@@ -240,21 +400,59 @@ class SurfelMeshing {
   // Set by Integrate() such that Triangulate() can run on only the new surfels.
   usize first_new_surfel_index_;
   
+  // New surfels which were created by IntegrateCUDABuffers() in entries below
+  // first_new_surfel_index_, since they were moved there.
+  vector<u32> new_surfels_in_old_entries_;
+  
   // Queue of surfel indices to reconsider in the triangulation algorithm.
   vector<u32> surfels_to_remesh_;
   
   // Set of surfels to check for whether remeshing is necessary.
   vector<u32> surfels_to_check_;
   
+  // Surfels whose flags (can_be_remeshed, can_be_reset) may have been changed
+  // since the last call to IntegrateCUDABuffers(), which resets them. The
+  // flags are only changed for surfels that are being triangulated or that get
+  // queued in surfels_to_remesh_ afterwards. So this lists all surfels which
+  // were taken from surfels_to_remesh_, plus the new surfels (whose flags
+  // differ initially). Surfels that are still queued are not included. May
+  // contain duplicates.
+  vector<u32> surfels_with_modified_flags_;
+  
   // Unordered list of all triangles.
   vector<SurfelTriangle> triangles_;
   
-  // Free list index for the triangles_ vector.
-  u32 next_free_triangle_index_;
+  // For each entry in triangles_, the positions of the triangle in the
+  // triangle lists of its corner surfels. Kept at the same capacity as
+  // triangles_, such that it is not reallocated in parallel triangulation
+  // either. Entries for free list entries are undefined.
+  vector<SurfelTriangleCornerSlots> triangle_corner_slots_;
+  
+  // Stack of the free entries in the triangles_ vector, which are re-used in
+  // LIFO order. CompactTriangles() drops free entries at the end of the vector
+  // without searching for them in the stack, so entries which are not below
+  // triangles_.size() are outdated and skipped. The vector only grows if the
+  // stack is empty, so such entries never become valid again.
+  // free_triangle_count_ is the number of entries which are not outdated.
+  vector<u32> free_triangle_indices_;
+  usize free_triangle_count_;
+  
+  // Delta tracking state for OutputMeshDelta(). changed_triangles_ lists the
+  // triangle indices which were added or removed since the last output, and
+  // triangle_change_flags_ stores for each triangle index whether it is in
+  // this list and whether it was valid at the last output.
+  bool track_triangle_changes_;
+  vector<u32> changed_triangles_;
+  vector<u8> triangle_change_flags_;
+  usize output_triangle_count_;
   
   // Number of surfel entries which are inactive due to having been merged.
   u32 merged_surfel_count_;
   
+  // Statistics for compaction.
+  usize reclaimed_triangle_entry_count_;
+  usize moved_surfel_count_;
+  
   // Settings:
   float cos_max_angle_between_normals_;
   float min_triangle_angle_;
@@ -266,22 +464,51 @@ class SurfelMeshing {
   float max_neighbor_search_range_increase_factor_squared_;
   float long_edge_total_factor_squared_;
   
-  // Debug counters:
-  usize holes_closed_counter_;
-  usize front_neighbors_too_far_away_counter_;
-  usize front_leads_to_completed_surfel_counter_;
-  usize max_neighbor_count_exceeded_counter_;
-  usize front_neighbors_not_visible_counter_;
-  usize fronts_triangles_inconsistency_counter_;
-  usize fronts_sharing_edge_counter_;
-  usize connected_to_surfel_without_suitable_front_counter_;
+  int triangulation_thread_count_;
+  
+  // Worker threads for the parallel triangulation. Only allocated if
+  // triangulation_thread_count_ is larger than one.
+  unique_ptr<ThreadPool> triangulation_thread_pool_;
+  
+  // Triangulation budget in seconds (zero if unlimited) and priority focus.
+  double triangulation_budget_seconds_;
+  bool have_triangulation_focus_;
+  Vec3f triangulation_focus_;
+  
+  // Set while triangulation threads are running. AddTriangle() locks
+  // triangles_mutex_ then.
+  bool triangulating_in_parallel_;
+  std::mutex triangles_mutex_;
+  
+  // Debug counters (atomic since they are also used by triangulation threads):
+  std::atomic<usize> holes_closed_counter_;
+  std::atomic<usize> front_neighbors_too_far_away_counter_;
+  std::atomic<usize> front_leads_to_completed_surfel_counter_;
+  std::atomic<usize> max_neighbor_count_exceeded_counter_;
+  std::atomic<usize> front_neighbors_not_visible_counter_;
+  std::atomic<usize> fronts_triangles_inconsistency_counter_;
+  std::atomic<usize> fronts_sharing_edge_counter_;
+  std::atomic<usize> connected_to_surfel_without_suitable_front_counter_;
   
   usize deleted_triangle_count_;
   
   // Temporary variables, stored here to avoid re-allocation:
   vector<float> surfel_distances_squared_;
   vector<u32> surfel_indices_;
-  vector<Front> new_fronts_;
+  vector<u32> batch_query_surfels_;
+  vector<Vec3f> batch_query_positions_;
+  vector<float> batch_query_radii_squared_;
+  vector<int> batch_result_counts_;
+  vector<float> batch_result_distances_squared_;
+  vector<u32> batch_result_indices_;
+  vector<u8> remesh_queue_marks_;
+  vector<std::pair<float, u32>> remesh_queue_priorities_;
+  unordered_map<u32, u32> surfel_move_original_entries_;
+  unordered_map<u32, u32> surfel_move_destinations_;
+  vector<u32> surfel_move_entries_;
+  vector<u32> surfel_move_triangles_;
+  vector<u32> surfel_move_front_surfels_;
+  vector<Surfel> surfel_move_surfels_;
   
   // For debugging only:
   shared_ptr<SurfelMeshingRenderWindow> render_window_;
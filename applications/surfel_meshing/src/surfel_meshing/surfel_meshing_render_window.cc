@@ -94,6 +94,11 @@ SurfelMeshingRenderWindow::SurfelMeshingRenderWindow(
   new_mesh_surfel_count_ = 0;
   
   neighbor_index_buffer_ = 0;
+  
+  use_visualization_mesh_delta_ = false;
+  have_new_visualization_mesh_delta_ = false;
+  visualization_mesh_delta_index_buffer_ = 0;
+  visualization_mesh_delta_index_buffer_capacity_ = 0;
   normal_vertex_buffer_ = 0;
   
   init_max_point_count_ = 0;
@@ -306,6 +311,15 @@ void SurfelMeshingRenderWindow::RenderMesh(const Mat4f& model_matrix, const Vec3
     
     new_visualization_mesh_.reset();
   }
+  if (have_new_visualization_mesh_delta_) {
+    have_visualization_mesh_ = true;
+    
+    TransferVisualizationMeshDeltaToGPU(new_visualization_mesh_delta_);
+    CHECK_OPENGL_NO_ERROR();
+    
+    new_visualization_mesh_delta_.Clear();
+    have_new_visualization_mesh_delta_ = false;
+  }
   mesh_lock.unlock();
   
   // Render mesh if one is available.
@@ -345,9 +359,15 @@ void SurfelMeshingRenderWindow::RenderMesh(const Mat4f& model_matrix, const Vec3
     if (visualization_cloud_size_ != numeric_limits<usize>::max()) {
       // Render using the mesh's indices, but the vertex buffer from visualization_cloud_.
       visualization_cloud_.SetAttributes(render_program);
-      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, visualization_mesh_.index_buffer_name());
-      glDrawElements(GL_TRIANGLES, visualization_mesh_.index_count(), GL_UNSIGNED_INT,
-                      reinterpret_cast<char*>(0) + 0);
+      if (use_visualization_mesh_delta_) {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, visualization_mesh_delta_index_buffer_);
+        glDrawElements(GL_TRIANGLES, 3 * visualization_mesh_delta_triangles_.size(), GL_UNSIGNED_INT,
+                        reinterpret_cast<char*>(0) + 0);
+      } else {
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, visualization_mesh_.index_buffer_name());
+        glDrawElements(GL_TRIANGLES, visualization_mesh_.index_count(), GL_UNSIGNED_INT,
+                        reinterpret_cast<char*>(0) + 0);
+      }
     } else {
       visualization_mesh_.Render(render_program);
     }
@@ -735,6 +755,7 @@ void SurfelMeshingRenderWindow::UpdateVisualizationCloudCUDA(u32 surfel_count, u
 void SurfelMeshingRenderWindow::UpdateVisualizationMesh(const std::shared_ptr<vis::Mesh3fCu8>& mesh) {
   unique_lock<mutex> lock(visualization_mesh_mutex_);
   new_visualization_mesh_ = mesh;
+  use_visualization_mesh_delta_ = false;
   if (new_visualization_mesh_->vertices()) {
     visualization_cloud_size_ = numeric_limits<usize>::max();
   }
@@ -745,6 +766,57 @@ void SurfelMeshingRenderWindow::UpdateVisualizationMeshCUDA(const std::shared_pt
   UpdateVisualizationMesh(mesh);  // No difference to the non-CUDA variant
 }
 
+void SurfelMeshingRenderWindow::UpdateVisualizationMeshDeltaCUDA(const TriangleListDelta& delta) {
+  unique_lock<mutex> lock(visualization_mesh_mutex_);
+  // If the render thread did not apply the last delta yet, combine them.
+  new_visualization_mesh_delta_.Append(delta);
+  have_new_visualization_mesh_delta_ = true;
+  use_visualization_mesh_delta_ = true;
+  window_->RenderFrame();
+}
+
+void SurfelMeshingRenderWindow::TransferVisualizationMeshDeltaToGPU(const TriangleListDelta& delta) {
+  delta.ApplyTo(&visualization_mesh_delta_triangles_);
+  
+  if (visualization_mesh_delta_index_buffer_ == 0) {
+    glGenBuffers(1, &visualization_mesh_delta_index_buffer_);
+  }
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, visualization_mesh_delta_index_buffer_);
+  
+  if (delta.slot_count > visualization_mesh_delta_index_buffer_capacity_) {
+    // Re-allocate the buffer with some headroom such that this rarely happens
+    // as the mesh grows, and upload all triangles.
+    visualization_mesh_delta_index_buffer_capacity_ =
+        std::max<usize>(delta.slot_count, 3 * visualization_mesh_delta_index_buffer_capacity_ / 2);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER,
+                 visualization_mesh_delta_index_buffer_capacity_ * sizeof(Triangle<u32>),
+                 nullptr, GL_DYNAMIC_DRAW);
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 0,
+                    visualization_mesh_delta_triangles_.size() * sizeof(Triangle<u32>),
+                    visualization_mesh_delta_triangles_.data());
+    return;
+  }
+  
+  // Upload only the changed ranges. Ranges with small gaps in between are
+  // joined (taking the data in the gaps from the CPU copy) to reduce the
+  // number of calls.
+  constexpr u32 kMaxGapToJoin = 64;
+  usize i = 0;
+  while (i < delta.slots.size()) {
+    u32 range_start = delta.slots[i];
+    u32 range_end = range_start + 1;
+    ++ i;
+    while (i < delta.slots.size() && delta.slots[i] <= range_end + kMaxGapToJoin) {
+      range_end = delta.slots[i] + 1;
+      ++ i;
+    }
+    glBufferSubData(GL_ELEMENT_ARRAY_BUFFER,
+                    range_start * sizeof(Triangle<u32>),
+                    (range_end - range_start) * sizeof(Triangle<u32>),
+                    &visualization_mesh_delta_triangles_[range_start]);
+  }
+}
+
 void SurfelMeshingRenderWindow::UpdateVisualizationCloudAndMeshCUDA(u32 surfel_count, const std::shared_ptr<vis::Mesh3fCu8>& mesh) {
   unique_lock<mutex> cloud_lock(visualization_cloud_mutex_);
   unique_lock<mutex> mesh_lock(visualization_mesh_mutex_);
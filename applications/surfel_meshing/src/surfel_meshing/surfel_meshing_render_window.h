@@ -105,6 +105,12 @@ class SurfelMeshingRenderWindow : public RenderWindowCallbacks {
   void UpdateVisualizationMesh(const std::shared_ptr<Mesh3fCu8>& mesh);
   void UpdateVisualizationMeshCUDA(const std::shared_ptr<vis::Mesh3fCu8>& mesh);
   
+  // Intended to be called from outside the Qt thread. Updates the rendered
+  // mesh indices with the changes given by the delta (with respect to the
+  // previous deltas given to this function). The mesh vertices are taken from
+  // the CUDA surfel buffers as for UpdateVisualizationMeshCUDA().
+  void UpdateVisualizationMeshDeltaCUDA(const TriangleListDelta& delta);
+  
   void UpdateVisualizationCloudAndMeshCUDA(u32 surfel_count, const std::shared_ptr<vis::Mesh3fCu8>& mesh);
   
   // Intended to be called from outside the Qt thread.
@@ -160,6 +166,9 @@ class SurfelMeshingRenderWindow : public RenderWindowCallbacks {
  private:
   void RenderPointSplats();
   void RenderMesh(const Mat4f& model_matrix, const Vec3f& viewing_dir);
+  // Applies the delta to visualization_mesh_delta_index_buffer_. Must be
+  // called with visualization_mesh_mutex_ locked.
+  void TransferVisualizationMeshDeltaToGPU(const TriangleListDelta& delta);
   void RenderCameraFrustum(const SE3f& global_T_camera_frustum);
   void RenderNeighbors();
   void RenderNormals();
@@ -239,6 +248,16 @@ class SurfelMeshingRenderWindow : public RenderWindowCallbacks {
   Mesh3fC3u8OpenGL visualization_mesh_;
   std::shared_ptr<Mesh3fCu8> new_visualization_mesh_;
   
+  // Index buffer handling for mesh deltas. The index buffer has one triangle
+  // per slot of the triangle list, with free slots being degenerate triangles.
+  // visualization_mesh_delta_triangles_ is a CPU copy of its content.
+  bool use_visualization_mesh_delta_;
+  bool have_new_visualization_mesh_delta_;
+  TriangleListDelta new_visualization_mesh_delta_;
+  vector<Triangle<u32>> visualization_mesh_delta_triangles_;
+  GLuint visualization_mesh_delta_index_buffer_;
+  usize visualization_mesh_delta_index_buffer_capacity_;
+  
   // Buffers for debugging.
   GLuint neighbor_index_buffer_;
   GLuint normal_vertex_buffer_;
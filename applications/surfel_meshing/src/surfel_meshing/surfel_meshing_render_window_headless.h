@@ -0,0 +1,55 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <memory>
+
+#include <libvis/eigen.h>
+#include <libvis/libvis.h>
+#include <libvis/mesh.h>
+#include <libvis/point_cloud.h>
+
+namespace vis {
+
+// Replacement for SurfelMeshingRenderWindow in headless builds (which define
+// SURFEL_MESHING_HEADLESS), such that SurfelMeshing can be compiled without
+// linking to CUDA, OpenGL, Qt or X11. SurfelMeshing only uses the render
+// window for its debug visualizations, so this class only provides the
+// functions called there, and they do nothing.
+class SurfelMeshingRenderWindow {
+ public:
+  inline void UpdateVisualizationCloud(const std::shared_ptr<Point3fC3u8Cloud>& /*cloud*/) {}
+  
+  inline void UpdateVisualizationMesh(const std::shared_ptr<Mesh3fCu8>& /*mesh*/) {}
+  
+  inline void CenterViewOn(const Vec3f& /*position*/) {}
+};
+
+}
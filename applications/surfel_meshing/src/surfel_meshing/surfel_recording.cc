@@ -0,0 +1,502 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "surfel_meshing/surfel_recording.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#include <glog/logging.h>
+#include <zlib.h>
+
+#include "surfel_meshing/cuda_surfels_cpu.h"
+
+namespace vis {
+
+namespace {
+
+constexpr char kMagic[8] = {'S', 'M', 'S', 'U', 'R', 'F', 'R', 'C'};
+constexpr u32 kVersion = 2;
+
+// Oldest version which can still be read.
+constexpr u32 kMinVersion = 1;
+
+// Number of attribute columns per surfel.
+constexpr int kAttributeCount = 8;
+
+// Number of snapshots for which SurfelRecordingReader keeps the stored surfel
+// indices. Buffers which were filled longer ago are filled completely.
+constexpr usize kRecentSnapshotCount = 4;
+
+static_assert(sizeof(SurfelRecordingHeader) == 24, "Unexpected padding in SurfelRecordingHeader");
+static_assert(sizeof(SurfelRecordingSnapshotHeader) == 40, "Unexpected padding in SurfelRecordingSnapshotHeader");
+
+bool IsLittleEndian() {
+  const u16 value = 1;
+  return *reinterpret_cast<const u8*>(&value) == 1;
+}
+
+// Returns pointers to the attribute columns of the buffer, in the order in
+// which they are stored.
+void GetAttributeColumns(const CUDASurfelBuffersCPU& buffer, void** columns) {
+  columns[0] = buffer.surfel_x_buffer;
+  columns[1] = buffer.surfel_y_buffer;
+  columns[2] = buffer.surfel_z_buffer;
+  columns[3] = buffer.surfel_radius_squared_buffer;
+  columns[4] = buffer.surfel_normal_x_buffer;
+  columns[5] = buffer.surfel_normal_y_buffer;
+  columns[6] = buffer.surfel_normal_z_buffer;
+  columns[7] = buffer.surfel_last_update_stamp_buffer;
+}
+
+// Reads the value with the given index from an attribute column as u32 (all
+// attributes have 4 bytes).
+inline u32 GetAttribute(const void* column, usize index) {
+  u32 value;
+  memcpy(&value, static_cast<const u8*>(column) + 4 * index, 4);
+  return value;
+}
+
+inline void SetAttribute(void* column, usize index, u32 value) {
+  memcpy(static_cast<u8*>(column) + 4 * index, &value, 4);
+}
+
+// Appends the (increasing) indices to the data as varint-encoded differences
+// to the previous index.
+void AppendIndices(const u32* indices, usize count, vector<u8>* data) {
+  u32 previous_index = 0;
+  for (usize i = 0; i < count; ++ i) {
+    u32 difference = indices[i] - previous_index;
+    previous_index = indices[i];
+    while (difference >= 0x80) {
+      data->push_back(static_cast<u8>(difference | 0x80));
+      difference >>= 7;
+    }
+    data->push_back(static_cast<u8>(difference));
+  }
+}
+
+// Reads count indices written by AppendIndices(). Returns false if the data
+// ends early.
+bool ReadIndices(const u8** data, const u8* data_end, usize count, vector<u32>* indices) {
+  indices->resize(count);
+  u32 previous_index = 0;
+  const u8* ptr = *data;
+  for (usize i = 0; i < count; ++ i) {
+    u32 difference = 0;
+    int shift = 0;
+    while (true) {
+      if (ptr == data_end || shift > 28) {
+        return false;
+      }
+      u8 byte = *ptr;
+      ++ ptr;
+      difference |= static_cast<u32>(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+      shift += 7;
+    }
+    previous_index += difference;
+    (*indices)[i] = previous_index;
+  }
+  *data = ptr;
+  return true;
+}
+
+}
+
+
+SurfelRecordingWriter::SurfelRecordingWriter()
+    : file_(nullptr) {}
+
+SurfelRecordingWriter::~SurfelRecordingWriter() {
+  if (file_) {
+    Close();
+  }
+}
+
+bool SurfelRecordingWriter::Open(const string& path, SurfelRecordingEncoding encoding) {
+  CHECK(!file_) << "The file is already open.";
+  if (!IsLittleEndian()) {
+    LOG(ERROR) << "Surfel recordings are only supported on little-endian systems.";
+    return false;
+  }
+  
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    LOG(ERROR) << "Cannot open file for writing: " << path;
+    return false;
+  }
+  
+  memcpy(header_.magic, kMagic, sizeof(kMagic));
+  header_.version = kVersion;
+  header_.encoding = static_cast<u32>(encoding);
+  header_.snapshot_count = 0;
+  header_.max_surfel_count = 0;
+  for (int c = 0; c < kAttributeCount; ++ c) {
+    previous_attributes_[c].clear();
+  }
+  previous_surfel_count_ = 0;
+  open_time_ = chrono::steady_clock::now();
+  
+  // The header is written again with the final counts in Close().
+  if (fwrite(&header_, sizeof(header_), 1, file_) != 1) {
+    LOG(ERROR) << "Cannot write to file: " << path;
+    fclose(file_);
+    file_ = nullptr;
+    return false;
+  }
+  return true;
+}
+
+bool SurfelRecordingWriter::WriteSnapshot(const CUDASurfelBuffersCPU& buffer) {
+  CHECK(file_) << "The file is not open.";
+  
+  SurfelRecordingSnapshotHeader snapshot;
+  snapshot.timestamp = 1e-9 * chrono::duration<double, nano>(chrono::steady_clock::now() - open_time_).count();
+  snapshot.frame_index = buffer.frame_index;
+  snapshot.surfel_count = buffer.surfel_count;
+  snapshot.all_surfels_changed = buffer.all_surfels_changed ? 1 : 0;
+  snapshot.listed_surfel_count = buffer.all_surfels_changed ? 0 : buffer.changed_surfel_indices.size();
+  snapshot.surfel_move_count = buffer.surfel_moves.size();
+  
+  void* columns[kAttributeCount];
+  GetAttributeColumns(buffer, columns);
+  if (previous_attributes_[0].size() < buffer.surfel_count) {
+    for (int c = 0; c < kAttributeCount; ++ c) {
+      previous_attributes_[c].resize(buffer.surfel_count, 0);
+    }
+  }
+  
+  // Find the existing surfels which changed. If the buffers list the changed
+  // surfels, only those need to be compared, plus the destinations of surfel
+  // moves (the reconstruction does not list moved surfels unless their
+  // attributes changed).
+  stored_indices_.clear();
+  usize existing_surfel_count = std::min<usize>(previous_surfel_count_, buffer.surfel_count);
+  auto check_surfel = [&](u32 surfel_index) {
+    for (int c = 0; c < kAttributeCount; ++ c) {
+      if (GetAttribute(columns[c], surfel_index) != previous_attributes_[c][surfel_index]) {
+        stored_indices_.push_back(surfel_index);
+        return;
+      }
+    }
+  };
+  if (buffer.all_surfels_changed) {
+    for (usize surfel_index = 0; surfel_index < existing_surfel_count; ++ surfel_index) {
+      check_surfel(surfel_index);
+    }
+  } else {
+    const vector<u32>* checked_indices = &buffer.changed_surfel_indices;
+    if (!buffer.surfel_moves.empty()) {
+      checked_indices_ = buffer.changed_surfel_indices;
+      for (const SurfelMove& move : buffer.surfel_moves) {
+        checked_indices_.push_back(move.to);
+      }
+      std::sort(checked_indices_.begin(), checked_indices_.end());
+      checked_indices_.erase(std::unique(checked_indices_.begin(), checked_indices_.end()), checked_indices_.end());
+      checked_indices = &checked_indices_;
+    }
+    for (u32 surfel_index : *checked_indices) {
+      if (surfel_index >= existing_surfel_count) {
+        break;
+      }
+      check_surfel(surfel_index);
+    }
+  }
+  
+  // All new surfels are stored.
+  for (usize surfel_index = existing_surfel_count; surfel_index < buffer.surfel_count; ++ surfel_index) {
+    stored_indices_.push_back(surfel_index);
+  }
+  snapshot.stored_surfel_count = stored_indices_.size();
+  
+  // Encode the payload.
+  payload_.clear();
+  if (!buffer.all_surfels_changed) {
+    AppendIndices(buffer.changed_surfel_indices.data(), buffer.changed_surfel_indices.size(), &payload_);
+  }
+  usize moves_offset = payload_.size();
+  payload_.resize(moves_offset + 2 * 4 * buffer.surfel_moves.size());
+  for (usize i = 0; i < buffer.surfel_moves.size(); ++ i) {
+    const SurfelMove& move = buffer.surfel_moves[i];
+    memcpy(payload_.data() + moves_offset + 8 * i, &move.from, 4);
+    memcpy(payload_.data() + moves_offset + 8 * i + 4, &move.to, 4);
+  }
+  AppendIndices(stored_indices_.data(), stored_indices_.size(), &payload_);
+  usize column_offset = payload_.size();
+  payload_.resize(column_offset + kAttributeCount * 4 * stored_indices_.size());
+  for (int c = 0; c < kAttributeCount; ++ c) {
+    u32* previous_column = previous_attributes_[c].data();
+    u8* out = payload_.data() + column_offset + c * 4 * stored_indices_.size();
+    for (u32 surfel_index : stored_indices_) {
+      u32 value = GetAttribute(columns[c], surfel_index);
+      u32 encoded_value = value ^ previous_column[surfel_index];
+      memcpy(out, &encoded_value, 4);
+      out += 4;
+      previous_column[surfel_index] = value;
+    }
+  }
+  previous_surfel_count_ = buffer.surfel_count;
+  snapshot.raw_payload_size = payload_.size();
+  
+  const u8* stored_payload = payload_.data();
+  snapshot.payload_size = payload_.size();
+  if (header_.encoding == static_cast<u32>(SurfelRecordingEncoding::kZlib)) {
+    compressed_payload_.resize(compressBound(payload_.size()));
+    uLongf compressed_size = compressed_payload_.size();
+    if (compress2(compressed_payload_.data(), &compressed_size, payload_.data(), payload_.size(), Z_BEST_SPEED) != Z_OK) {
+      LOG(ERROR) << "zlib compression failed.";
+      return false;
+    }
+    stored_payload = compressed_payload_.data();
+    snapshot.payload_size = compressed_size;
+  }
+  
+  if (fwrite(&snapshot, sizeof(snapshot), 1, file_) != 1 ||
+      fwrite(stored_payload, 1, snapshot.payload_size, file_) != snapshot.payload_size) {
+    LOG(ERROR) << "Cannot write to surfel recording file.";
+    return false;
+  }
+  
+  ++ header_.snapshot_count;
+  header_.max_surfel_count = std::max<u32>(header_.max_surfel_count, buffer.surfel_count);
+  return true;
+}
+
+bool SurfelRecordingWriter::Close() {
+  CHECK(file_) << "The file is not open.";
+  
+  bool success = fseek(file_, 0, SEEK_SET) == 0 &&
+                 fwrite(&header_, sizeof(header_), 1, file_) == 1;
+  success &= fclose(file_) == 0;
+  file_ = nullptr;
+  if (!success) {
+    LOG(ERROR) << "Cannot finish writing the surfel recording file.";
+  }
+  return success;
+}
+
+
+SurfelRecordingReader::SurfelRecordingReader()
+    : file_(nullptr),
+      error_(false) {}
+
+SurfelRecordingReader::~SurfelRecordingReader() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+bool SurfelRecordingReader::Open(const string& path) {
+  if (file_) {
+    fclose(file_);
+  }
+  path_ = path;
+  error_ = true;
+  for (int c = 0; c < kAttributeCount; ++ c) {
+    attributes_[c].clear();
+  }
+  snapshot_index_ = 0;
+  recent_stored_indices_.clear();
+  buffer_snapshot_indices_.clear();
+  
+  if (!IsLittleEndian()) {
+    LOG(ERROR) << "Surfel recordings are only supported on little-endian systems.";
+    return false;
+  }
+  
+  file_ = fopen(path.c_str(), "rb");
+  if (!file_) {
+    LOG(ERROR) << "Cannot open file for reading: " << path;
+    return false;
+  }
+  if (fread(&header_, sizeof(header_), 1, file_) != 1 ||
+      memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0) {
+    LOG(ERROR) << "Not a surfel recording: " << path;
+    return false;
+  }
+  if (header_.version < kMinVersion || header_.version > kVersion) {
+    LOG(ERROR) << "Unsupported surfel recording version " << header_.version << ": " << path;
+    return false;
+  }
+  if (header_.snapshot_count == 0) {
+    LOG(ERROR) << "The surfel recording is empty (possibly, writing it was not completed): " << path;
+    return false;
+  }
+  
+  error_ = false;
+  return true;
+}
+
+bool SurfelRecordingReader::Rewind() {
+  return Open(path_);
+}
+
+bool SurfelRecordingReader::ReadSnapshot(CUDASurfelsCPU* buffers, SurfelRecordingSnapshotInfo* info) {
+  if (!file_ || error_ || snapshot_index_ >= header_.snapshot_count) {
+    return false;
+  }
+  error_ = true;
+  
+  SurfelRecordingSnapshotHeader snapshot;
+  if (fread(&snapshot, sizeof(snapshot), 1, file_) != 1) {
+    LOG(ERROR) << "Unexpected end of surfel recording: " << path_;
+    return false;
+  }
+  if (snapshot.surfel_count > header_.max_surfel_count ||
+      snapshot.stored_surfel_count > snapshot.surfel_count) {
+    LOG(ERROR) << "Invalid snapshot in surfel recording: " << path_;
+    return false;
+  }
+  
+  // Read and decode the payload.
+  payload_.resize(snapshot.raw_payload_size);
+  if (header_.encoding == static_cast<u32>(SurfelRecordingEncoding::kZlib)) {
+    compressed_payload_.resize(snapshot.payload_size);
+    uLongf uncompressed_size = payload_.size();
+    if (fread(compressed_payload_.data(), 1, compressed_payload_.size(), file_) != compressed_payload_.size() ||
+        uncompress(payload_.data(), &uncompressed_size, compressed_payload_.data(), compressed_payload_.size()) != Z_OK ||
+        uncompressed_size != payload_.size()) {
+      LOG(ERROR) << "Cannot read snapshot payload in surfel recording: " << path_;
+      return false;
+    }
+  } else if (snapshot.payload_size != snapshot.raw_payload_size ||
+             fread(payload_.data(), 1, payload_.size(), file_) != payload_.size()) {
+    LOG(ERROR) << "Cannot read snapshot payload in surfel recording: " << path_;
+    return false;
+  }
+  
+  const u8* data = payload_.data();
+  const u8* data_end = data + payload_.size();
+  listed_indices_.clear();
+  if (!snapshot.all_surfels_changed &&
+      !ReadIndices(&data, data_end, snapshot.listed_surfel_count, &listed_indices_)) {
+    LOG(ERROR) << "Invalid snapshot payload in surfel recording: " << path_;
+    return false;
+  }
+  if (static_cast<usize>(data_end - data) < 2 * 4 * static_cast<usize>(snapshot.surfel_move_count)) {
+    LOG(ERROR) << "Invalid snapshot payload in surfel recording: " << path_;
+    return false;
+  }
+  surfel_moves_.resize(snapshot.surfel_move_count);
+  for (SurfelMove& move : surfel_moves_) {
+    memcpy(&move.from, data, 4);
+    memcpy(&move.to, data + 4, 4);
+    data += 8;
+  }
+  if (recent_stored_indices_.size() == kRecentSnapshotCount) {
+    // Re-use the allocation of the oldest index list.
+    recent_stored_indices_.push_back(std::move(recent_stored_indices_.front()));
+    recent_stored_indices_.pop_front();
+  } else {
+    recent_stored_indices_.emplace_back();
+  }
+  vector<u32>* stored_indices = &recent_stored_indices_.back();
+  if (!ReadIndices(&data, data_end, snapshot.stored_surfel_count, stored_indices) ||
+      static_cast<usize>(data_end - data) != kAttributeCount * 4 * stored_indices->size() ||
+      (!stored_indices->empty() && stored_indices->back() >= snapshot.surfel_count)) {
+    LOG(ERROR) << "Invalid snapshot payload in surfel recording: " << path_;
+    return false;
+  }
+  
+  if (attributes_[0].size() < snapshot.surfel_count) {
+    for (int c = 0; c < kAttributeCount; ++ c) {
+      attributes_[c].resize(snapshot.surfel_count, 0);
+    }
+  }
+  for (int c = 0; c < kAttributeCount; ++ c) {
+    u32* column = attributes_[c].data();
+    for (u32 surfel_index : *stored_indices) {
+      u32 encoded_value;
+      memcpy(&encoded_value, data, 4);
+      data += 4;
+      column[surfel_index] ^= encoded_value;
+    }
+  }
+  ++ snapshot_index_;
+  
+  // Transfer the snapshot into the write buffers and publish it.
+  CUDASurfelBuffersCPU* buffer = buffers->write_buffers();
+  FillBuffer(buffer, snapshot.surfel_count);
+  buffer->frame_index = snapshot.frame_index;
+  buffer->surfel_count = snapshot.surfel_count;
+  if (snapshot.all_surfels_changed) {
+    buffers->SetAllSurfelsChanged();
+  } else {
+    buffers->SetChangedSurfels(listed_indices_.data(), listed_indices_.size());
+  }
+  buffers->SetSurfelMoves(surfel_moves_.data(), surfel_moves_.size());
+  buffers->PublishWriteBuffers();
+  
+  info->timestamp = snapshot.timestamp;
+  info->frame_index = snapshot.frame_index;
+  info->surfel_count = snapshot.surfel_count;
+  info->all_surfels_changed = snapshot.all_surfels_changed;
+  info->stored_surfel_count = snapshot.stored_surfel_count;
+  
+  error_ = false;
+  return true;
+}
+
+void SurfelRecordingReader::FillBuffer(CUDASurfelBuffersCPU* buffer, usize surfel_count) {
+  void* columns[kAttributeCount];
+  GetAttributeColumns(*buffer, columns);
+  
+  // Find the number of snapshots that the buffer is behind.
+  usize missed_snapshot_count = snapshot_index_;
+  auto it = buffer_snapshot_indices_.find(buffer);
+  if (it != buffer_snapshot_indices_.end()) {
+    missed_snapshot_count = snapshot_index_ - it->second;
+  }
+  buffer_snapshot_indices_[buffer] = snapshot_index_;
+  
+  if (missed_snapshot_count > recent_stored_indices_.size()) {
+    // Copy all surfels.
+    for (int c = 0; c < kAttributeCount; ++ c) {
+      memcpy(columns[c], attributes_[c].data(), 4 * surfel_count);
+    }
+    return;
+  }
+  
+  // Copy the surfels which were stored in the missed snapshots.
+  for (usize i = recent_stored_indices_.size() - missed_snapshot_count; i < recent_stored_indices_.size(); ++ i) {
+    for (int c = 0; c < kAttributeCount; ++ c) {
+      void* column = columns[c];
+      const u32* values = attributes_[c].data();
+      for (u32 surfel_index : recent_stored_indices_[i]) {
+        SetAttribute(column, surfel_index, values[surfel_index]);
+      }
+    }
+  }
+}
+
+}
@@ -0,0 +1,216 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdio.h>
+
+#include <chrono>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <libvis/libvis.h>
+
+#include "surfel_meshing/cuda_surfels_cpu.h"
+
+namespace vis {
+
+// Surfel recordings store the sequence of surfel buffer snapshots which the
+// meshing received (see CUDASurfelsCPU), such that the meshing can be
+// replayed, benchmarked, and profiled without running the surfel
+// reconstruction. The layout is (all numbers in little-endian byte order):
+// - SurfelRecordingHeader.
+// - One record per snapshot, consisting of a SurfelRecordingSnapshotHeader
+//   followed by its payload. The payload is either raw or compressed with
+//   zlib (deflate) as a whole.
+// 
+// Snapshots are delta-encoded: a snapshot only stores the surfels whose
+// attributes differ from the previous snapshot, plus all surfels which were
+// added. The (uncompressed) payload contains:
+// - If the snapshot does not have all_surfels_changed set: the changed surfel
+//   indices which were given to the meshing (see
+//   CUDASurfelsCPU::SetChangedSurfels()), as varint-encoded differences to the
+//   previous index.
+// - The surfel moves of the snapshot (see CUDASurfelsCPU::SetSurfelMoves()),
+//   as (from, to) pairs of u32 (version 2 and later).
+// - The indices of the stored surfels, encoded in the same way as the changed
+//   surfel indices.
+// - One column per attribute (x, y, z, radius_squared, normal_x, normal_y,
+//   normal_z, last_update_stamp) with the stored surfels' values as u32. Each
+//   value is XOR-ed with the previous value of the same surfel attribute (or
+//   with zero for surfels which did not exist yet), which makes the data
+//   compress better since the high bits rarely change.
+
+enum class SurfelRecordingEncoding {
+  kRaw = 0,
+  kZlib = 1
+};
+
+struct SurfelRecordingHeader {
+  char magic[8];  // "SMSURFRC"
+  u32 version;
+  u32 encoding;  // SurfelRecordingEncoding
+  
+  // Written when the recording is closed.
+  u32 snapshot_count;
+  u32 max_surfel_count;
+};
+
+struct SurfelRecordingSnapshotHeader {
+  // Time at which the snapshot was recorded, in seconds since the recording
+  // was opened.
+  double timestamp;
+  
+  u32 frame_index;
+  u32 surfel_count;
+  u32 all_surfels_changed;
+  
+  // Number of changed surfel indices which were given to the meshing.
+  u32 listed_surfel_count;
+  
+  // Number of surfels whose attributes are stored.
+  u32 stored_surfel_count;
+  
+  // Stored and uncompressed size of the payload, in bytes.
+  u32 payload_size;
+  u32 raw_payload_size;
+  
+  // Number of surfel moves in the payload (always zero in version 1).
+  u32 surfel_move_count;
+};
+
+// Information about a snapshot returned by SurfelRecordingReader.
+struct SurfelRecordingSnapshotInfo {
+  double timestamp;
+  u32 frame_index;
+  u32 surfel_count;
+  bool all_surfels_changed;
+  u32 stored_surfel_count;
+};
+
+// Writes a surfel recording snapshot by snapshot. To record what the meshing
+// receives, WriteSnapshot() is called with the read buffers of the
+// CUDASurfelsCPU after each CUDASurfelsCPU::AcquireLatestBuffers().
+class SurfelRecordingWriter {
+ public:
+  SurfelRecordingWriter();
+  
+  // Closes the file if it is still open.
+  ~SurfelRecordingWriter();
+  
+  // Creates the file. Returns true if successful.
+  bool Open(const string& path, SurfelRecordingEncoding encoding);
+  
+  // Appends a snapshot of the buffers. Returns true if successful.
+  bool WriteSnapshot(const CUDASurfelBuffersCPU& buffer);
+  
+  // Writes the final header values and closes the file. Returns true if
+  // successful.
+  bool Close();
+  
+  inline bool is_open() const { return file_ != nullptr; }
+  
+ private:
+  FILE* file_;
+  SurfelRecordingHeader header_;
+  chrono::steady_clock::time_point open_time_;
+  
+  // The attributes of all surfels in the previous snapshot (as u32), one
+  // vector per attribute column.
+  vector<u32> previous_attributes_[8];
+  usize previous_surfel_count_;
+  
+  vector<u32> checked_indices_;
+  vector<u32> stored_indices_;
+  vector<u8> payload_;
+  vector<u8> compressed_payload_;
+};
+
+// Reads a surfel recording snapshot by snapshot into the write buffers of a
+// CUDASurfelsCPU, in the same way as the surfel reconstruction transfers its
+// surfels to them.
+class SurfelRecordingReader {
+ public:
+  SurfelRecordingReader();
+  
+  ~SurfelRecordingReader();
+  
+  // Opens the file and checks its header. Returns true if successful.
+  bool Open(const string& path);
+  
+  // Reads the next snapshot and publishes it in the given CUDASurfelsCPU,
+  // including the list of changed surfels, such that it can be obtained with
+  // CUDASurfelsCPU::AcquireLatestBuffers(). If the previous snapshot was not
+  // acquired, it is superseded. The CUDASurfelsCPU must be allocated for at least
+  // max_surfel_count() surfels. Returns false at the end of the recording or
+  // if reading failed (which can be distinguished with error()).
+  bool ReadSnapshot(CUDASurfelsCPU* buffers, SurfelRecordingSnapshotInfo* info);
+  
+  // Closes the file and reopens it to read the snapshots from the start.
+  // Returns true if successful.
+  bool Rewind();
+  
+  inline u32 snapshot_count() const { return header_.snapshot_count; }
+  inline u32 max_surfel_count() const { return header_.max_surfel_count; }
+  inline bool error() const { return error_; }
+  
+ private:
+  // Copies the surfel attributes which changed since the given buffer was
+  // last filled by this reader into it.
+  void FillBuffer(CUDASurfelBuffersCPU* buffer, usize surfel_count);
+  
+  string path_;
+  FILE* file_;
+  SurfelRecordingHeader header_;
+  bool error_;
+  
+  // The attributes of all surfels after the latest snapshot (as u32), one
+  // vector per attribute column.
+  vector<u32> attributes_[8];
+  
+  // Number of snapshots read since the file was opened.
+  usize snapshot_index_;
+  
+  // The stored surfel indices of the latest snapshots (the last one is for the
+  // latest snapshot). These are used to update buffers which were filled a
+  // few snapshots ago.
+  deque<vector<u32>> recent_stored_indices_;
+  
+  // Maps buffers to the snapshot_index_ after which they were filled last.
+  unordered_map<const CUDASurfelBuffersCPU*, usize> buffer_snapshot_indices_;
+  
+  vector<u32> listed_indices_;
+  vector<SurfelMove> surfel_moves_;
+  vector<u8> payload_;
+  vector<u8> compressed_payload_;
+};
+
+}
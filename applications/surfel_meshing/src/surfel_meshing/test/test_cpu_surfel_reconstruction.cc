@@ -0,0 +1,471 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <tuple>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <libvis/timing.h>
+
+#include "surfel_meshing/cpu_surfel_reconstruction.h"
+#include "surfel_meshing/surfel.h"
+#include "surfel_meshing/thread_pool.h"
+
+using namespace vis;
+
+namespace {
+constexpr float kDepthScaling = 1000;
+
+// Default parameters of the SurfelMeshing application.
+struct FusionParameters {
+  float sensor_noise_factor = 0.05f;
+  float max_surfel_confidence = 5.0f;
+  float regularizer_weight = 10.0f;
+  int regularization_frame_window_size = 30;
+  bool do_blending = true;
+  int measurement_blending_radius = 12;
+  int regularization_iterations_per_integration_iteration = 1;
+  float radius_factor_for_regularization_neighbors = 2;
+  float normal_compatibility_threshold_deg = 40;
+  int surfel_integration_active_window_size = numeric_limits<int>::max();
+};
+
+PinholeCamera4f CreateTestCamera(int width, int height) {
+  float parameters[4] = {0.8f * width, 0.8f * width, 0.5f * width, 0.5f * height};
+  return PinholeCamera4f(width, height, parameters);
+}
+
+// Input images for CPUSurfelReconstruction::Integrate().
+struct TestFrame {
+  Image<u16> depth;
+  Image<Vec2f> normals;
+  Image<float> radii;
+  Image<Vec3u8> colors;
+};
+
+// Creates a frame of a surface with depth depth_function(x, y) (in meters).
+// The normals face the camera and the squared radii correspond to the pixel
+// footprint, which is sufficient for the fusion.
+template <typename DepthFunction>
+void CreateTestFrame(const PinholeCamera4f& camera, const DepthFunction& depth_function, TestFrame* frame) {
+  const int width = camera.width();
+  const int height = camera.height();
+  const float fx = camera.parameters()[0];
+  frame->depth.SetSize(width, height);
+  frame->normals.SetSize(width, height);
+  frame->radii.SetSize(width, height);
+  frame->colors.SetSize(width, height);
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      float depth = depth_function(x, y);
+      frame->depth(x, y) = kDepthScaling * depth + 0.5f;
+      frame->normals(x, y) = Vec2f(0, 0);
+      float pixel_spacing = depth / fx;
+      frame->radii(x, y) = 2 * pixel_spacing * pixel_spacing;
+      frame->colors(x, y) = Vec3u8(x % 256, y % 256, 128);
+    }
+  }
+}
+
+void IntegrateFrame(
+    u32 frame_index,
+    const TestFrame& frame,
+    const SE3f& global_T_local,
+    const FusionParameters& parameters,
+    CPUSurfelReconstruction* reconstruction) {
+  Image<u16> depth = frame.depth;
+  reconstruction->Integrate(
+      frame_index,
+      kDepthScaling,
+      &depth,
+      frame.normals,
+      frame.radii,
+      frame.colors,
+      global_T_local,
+      parameters.sensor_noise_factor,
+      parameters.max_surfel_confidence,
+      parameters.regularizer_weight,
+      parameters.regularization_frame_window_size,
+      parameters.do_blending,
+      parameters.measurement_blending_radius,
+      parameters.regularization_iterations_per_integration_iteration,
+      parameters.radius_factor_for_regularization_neighbors,
+      parameters.normal_compatibility_threshold_deg,
+      parameters.surfel_integration_active_window_size);
+}
+
+float WavyDepth(int x, int y, float phase) {
+  return 1.5f + 0.002f * x - 0.001f * y + 0.05f * sinf(0.05f * x + phase) * cosf(0.07f * y);
+}
+
+u32 GetU32Attribute(const CPUSurfelReconstruction& reconstruction, int attribute, u32 surfel_index) {
+  u32 value;
+  memcpy(&value, reconstruction.surfel_attribute(attribute) + surfel_index, sizeof(u32));
+  return value;
+}
+}  // namespace
+
+TEST(ThreadPool, ProcessesEachIndexOnce) {
+  ThreadPool pool(4);
+  EXPECT_EQ(4, pool.thread_count());
+  
+  constexpr usize kSize = 1000;
+  vector<std::atomic<int>> counts(kSize);
+  for (int repetition = 0; repetition < 20; ++ repetition) {
+    for (usize i = 0; i < kSize; ++ i) {
+      counts[i] = 0;
+    }
+    pool.ParallelFor(3, kSize - 5, 1 + repetition, [&](usize begin, usize end) {
+      ASSERT_LT(begin, end);
+      for (usize i = begin; i < end; ++ i) {
+        ++ counts[i];
+      }
+    });
+    for (usize i = 0; i < kSize; ++ i) {
+      ASSERT_EQ((i >= 3 && i < kSize - 5) ? 1 : 0, counts[i]) << "index " << i;
+    }
+  }
+  
+  // Empty ranges must not call the function.
+  pool.ParallelFor(5, 5, 1, [&](usize /*begin*/, usize /*end*/) {
+    ADD_FAILURE();
+  });
+}
+
+// Integrates a plane facing the camera and checks the surfel creation,
+// integration, and replacement semantics.
+TEST(CPUSurfelReconstruction, PlaneSemantics) {
+  constexpr int kWidth = 64;
+  constexpr int kHeight = 48;
+  constexpr float kPlaneDepth = 1.0f;
+  
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  FusionParameters parameters;
+  CPUSurfelReconstruction reconstruction(100000, camera, 2);
+  
+  TestFrame plane;
+  CreateTestFrame(camera, [&](int, int) { return kPlaneDepth; }, &plane);
+  
+  // The first frame creates a surfel for each pixel except for the 1-pixel
+  // image border.
+  IntegrateFrame(0, plane, SE3f(), parameters, &reconstruction);
+  const u32 initial_count = (kWidth - 2) * (kHeight - 2);
+  ASSERT_EQ(initial_count, reconstruction.surfels_size());
+  EXPECT_EQ(initial_count, reconstruction.surfel_count());
+  
+  // Surfels are numbered in row-major pixel order.
+  const float fx = camera.parameters()[0];
+  const float cx = camera.parameters()[2];
+  const float cy = camera.parameters()[3];
+  const u32 center_index = (kHeight / 2 - 1) * (kWidth - 2) + (kWidth / 2 - 1);
+  EXPECT_NEAR(kPlaneDepth * (kWidth / 2 + 0.5f - cx) / fx, reconstruction.surfel_attribute(kSurfelX)[center_index], 1e-5f);
+  EXPECT_NEAR(kPlaneDepth * (kHeight / 2 + 0.5f - cy) / fx, reconstruction.surfel_attribute(kSurfelY)[center_index], 1e-5f);
+  EXPECT_NEAR(kPlaneDepth, reconstruction.surfel_attribute(kSurfelZ)[center_index], 1e-5f);
+  EXPECT_NEAR(-1, reconstruction.surfel_attribute(kSurfelNormalZ)[center_index], 1e-5f);
+  EXPECT_EQ(1, reconstruction.surfel_attribute(kSurfelConfidence)[center_index]);
+  
+  // Interior surfels get all four pixel neighbors.
+  EXPECT_EQ(center_index - 1, GetU32Attribute(reconstruction, kSurfelNeighbor0 + 0, center_index));
+  EXPECT_EQ(center_index + 1, GetU32Attribute(reconstruction, kSurfelNeighbor0 + 1, center_index));
+  EXPECT_EQ(center_index - (kWidth - 2), GetU32Attribute(reconstruction, kSurfelNeighbor0 + 2, center_index));
+  EXPECT_EQ(center_index + (kWidth - 2), GetU32Attribute(reconstruction, kSurfelNeighbor0 + 3, center_index));
+  
+  // Observing the same plane again integrates the measurements into the
+  // existing surfels.
+  IntegrateFrame(1, plane, SE3f(), parameters, &reconstruction);
+  ASSERT_EQ(initial_count, reconstruction.surfels_size());
+  EXPECT_GT(reconstruction.surfel_attribute(kSurfelConfidence)[center_index], 1);
+  EXPECT_EQ(1u, GetU32Attribute(reconstruction, kSurfelLastUpdateStamp, center_index));
+  EXPECT_EQ(0u, GetU32Attribute(reconstruction, kSurfelCreationStamp, center_index));
+  EXPECT_NEAR(kPlaneDepth, reconstruction.surfel_attribute(kSurfelZ)[center_index], 1e-5f);
+  
+  // A wall behind the plane conflicts with the surfels, which are eventually
+  // replaced by surfels on the wall.
+  constexpr float kWallDepth = 2 * kPlaneDepth;
+  TestFrame wall;
+  CreateTestFrame(camera, [&](int, int) { return kWallDepth; }, &wall);
+  for (u32 frame_index = 2; frame_index < 10; ++ frame_index) {
+    IntegrateFrame(frame_index, wall, SE3f(), parameters, &reconstruction);
+  }
+  int surfels_on_wall = 0;
+  for (u32 surfel_index = 0; surfel_index < reconstruction.surfels_size(); ++ surfel_index) {
+    if (reconstruction.surfel_attribute(kSurfelRadiusSquared)[surfel_index] < 0) {
+      continue;  // merged surfel
+    }
+    float z = reconstruction.surfel_attribute(kSurfelZ)[surfel_index];
+    EXPECT_NEAR(kWallDepth, z, parameters.sensor_noise_factor * kWallDepth) << "surfel " << surfel_index;
+    surfels_on_wall += (fabs(z - kWallDepth) < 1e-3f) ? 1 : 0;
+  }
+  EXPECT_GE(surfels_on_wall, static_cast<int>(initial_count));
+}
+
+// Without measurement blending, the result must not depend on the thread count.
+TEST(CPUSurfelReconstruction, ThreadCountInvariance) {
+  constexpr int kWidth = 97;
+  constexpr int kHeight = 71;
+  constexpr int kFrameCount = 8;
+  
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  FusionParameters parameters;
+  parameters.do_blending = false;
+  CPUSurfelReconstruction single_threaded(1000000, camera, 1);
+  CPUSurfelReconstruction multi_threaded(1000000, camera, 3);
+  
+  for (int frame_index = 0; frame_index < kFrameCount; ++ frame_index) {
+    TestFrame frame;
+    CreateTestFrame(camera, [&](int x, int y) { return WavyDepth(x, y, 0.3f * frame_index); }, &frame);
+    SE3f global_T_local(Sophus::SO3f::exp(Vec3f(0.01f * frame_index, -0.005f * frame_index, 0)),
+                        Vec3f(0.01f * frame_index, 0, -0.02f * frame_index));
+    IntegrateFrame(frame_index, frame, global_T_local, parameters, &single_threaded);
+    IntegrateFrame(frame_index, frame, global_T_local, parameters, &multi_threaded);
+  }
+  
+  ASSERT_EQ(single_threaded.surfels_size(), multi_threaded.surfels_size());
+  ASSERT_EQ(single_threaded.surfel_count(), multi_threaded.surfel_count());
+  EXPECT_GT(single_threaded.surfels_size(), static_cast<u32>((kWidth - 2) * (kHeight - 2)));
+  for (int attribute = 0; attribute < kSurfelAttributeCount; ++ attribute) {
+    EXPECT_EQ(0, memcmp(single_threaded.surfel_attribute(attribute),
+                        multi_threaded.surfel_attribute(attribute),
+                        single_threaded.surfels_size() * sizeof(float)))
+        << "attribute " << attribute;
+  }
+}
+
+// Checks that the transfer to the CPU buffers reports the changed surfels.
+TEST(CPUSurfelReconstruction, TransferAllToCPU) {
+  constexpr int kWidth = 64;
+  constexpr int kHeight = 48;
+  constexpr usize kMaxSurfelCount = 100000;
+  
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  FusionParameters parameters;
+  CPUSurfelReconstruction reconstruction(kMaxSurfelCount, camera, 2);
+  CUDASurfelsCPU buffers(kMaxSurfelCount);
+  
+  // The first transfer reports all surfels.
+  TestFrame frame;
+  CreateTestFrame(camera, [&](int x, int y) { return WavyDepth(x, y, 0); }, &frame);
+  IntegrateFrame(0, frame, SE3f(), parameters, &reconstruction);
+  reconstruction.TransferAllToCPU(0, &buffers);
+  buffers.PublishWriteBuffers();
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  const CUDASurfelBuffersCPU& read_buffers = buffers.read_buffers();
+  ASSERT_EQ(reconstruction.surfels_size(), read_buffers.surfel_count);
+  ASSERT_FALSE(read_buffers.all_surfels_changed);
+  ASSERT_EQ(reconstruction.surfels_size(), read_buffers.changed_surfel_indices.size());
+  for (u32 surfel_index = 0; surfel_index < reconstruction.surfels_size(); ++ surfel_index) {
+    EXPECT_EQ(surfel_index, read_buffers.changed_surfel_indices[surfel_index]);
+    EXPECT_EQ(reconstruction.surfel_attribute(kSurfelSmoothX)[surfel_index], read_buffers.surfel_x_buffer[surfel_index]);
+    EXPECT_EQ(reconstruction.surfel_attribute(kSurfelNormalZ)[surfel_index], read_buffers.surfel_normal_z_buffer[surfel_index]);
+    EXPECT_EQ(0u, read_buffers.surfel_last_update_stamp_buffer[surfel_index]);
+  }
+  
+  // Transferring again without changes reports no surfels.
+  reconstruction.TransferAllToCPU(0, &buffers);
+  buffers.PublishWriteBuffers();
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_FALSE(buffers.read_buffers().all_surfels_changed);
+  EXPECT_TRUE(buffers.read_buffers().changed_surfel_indices.empty());
+  
+  // After integrating another frame, the integrated surfels are reported in
+  // increasing order.
+  IntegrateFrame(1, frame, SE3f(), parameters, &reconstruction);
+  reconstruction.TransferAllToCPU(1, &buffers);
+  buffers.PublishWriteBuffers();
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  const vector<u32>& changed = buffers.read_buffers().changed_surfel_indices;
+  EXPECT_FALSE(changed.empty());
+  for (usize i = 1; i < changed.size(); ++ i) {
+    EXPECT_LT(changed[i - 1], changed[i]);
+  }
+  for (u32 surfel_index : changed) {
+    EXPECT_EQ(1u, buffers.read_buffers().surfel_last_update_stamp_buffer[surfel_index]);
+  }
+}
+
+// Compacts the surfels while they are replaced, and checks that the compaction
+// keeps the surfels and their neighbors, and that applying the surfel moves
+// and the listed changes on the CPU side reproduces the transferred surfels.
+TEST(CPUSurfelReconstruction, CompactSurfels) {
+  constexpr int kWidth = 64;
+  constexpr int kHeight = 48;
+  constexpr usize kMaxSurfelCount = 100000;
+  
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  FusionParameters parameters;
+  CPUSurfelReconstruction reconstruction(kMaxSurfelCount, camera, 2);
+  CUDASurfelsCPU buffers(kMaxSurfelCount);
+  
+  // The CPU side's copy of the surfel x coordinates and radii.
+  vector<float> received_x;
+  vector<float> received_radius_squared;
+  auto transfer_and_check = [&](u32 frame_index) {
+    reconstruction.TransferAllToCPU(frame_index, &buffers);
+    buffers.PublishWriteBuffers();
+    ASSERT_TRUE(buffers.AcquireLatestBuffers());
+    const CUDASurfelBuffersCPU& buffer = buffers.read_buffers();
+    ASSERT_FALSE(buffer.all_surfels_changed);
+    
+    // Surfels which are moved before the CPU side received them must be
+    // listed in their new entry. Mark them with NaN to check this.
+    for (const SurfelMove& move : buffer.surfel_moves) {
+      bool known = move.from < received_x.size();
+      received_x[move.to] = known ? received_x[move.from] : numeric_limits<float>::quiet_NaN();
+      received_radius_squared[move.to] = known ? received_radius_squared[move.from] : numeric_limits<float>::quiet_NaN();
+    }
+    usize old_size = std::min<usize>(received_x.size(), buffer.surfel_count);
+    received_x.resize(buffer.surfel_count);
+    received_radius_squared.resize(buffer.surfel_count);
+    for (usize surfel_index = old_size; surfel_index < buffer.surfel_count; ++ surfel_index) {
+      received_x[surfel_index] = buffer.surfel_x_buffer[surfel_index];
+      received_radius_squared[surfel_index] = buffer.surfel_radius_squared_buffer[surfel_index];
+    }
+    for (u32 surfel_index : buffer.changed_surfel_indices) {
+      ASSERT_LT(surfel_index, buffer.surfel_count);
+      received_x[surfel_index] = buffer.surfel_x_buffer[surfel_index];
+      received_radius_squared[surfel_index] = buffer.surfel_radius_squared_buffer[surfel_index];
+    }
+    
+    for (usize surfel_index = 0; surfel_index < buffer.surfel_count; ++ surfel_index) {
+      ASSERT_EQ(buffer.surfel_x_buffer[surfel_index], received_x[surfel_index]) << "surfel " << surfel_index;
+      ASSERT_EQ(buffer.surfel_radius_squared_buffer[surfel_index], received_radius_squared[surfel_index]) << "surfel " << surfel_index;
+    }
+  };
+  
+  // Returns the sorted positions of the live surfels.
+  auto live_surfel_positions = [&]() {
+    vector<std::tuple<float, float, float>> positions;
+    for (u32 surfel_index = 0; surfel_index < reconstruction.surfels_size(); ++ surfel_index) {
+      if (reconstruction.surfel_attribute(kSurfelRadiusSquared)[surfel_index] >= 0) {
+        positions.emplace_back(reconstruction.surfel_attribute(kSurfelX)[surfel_index],
+                               reconstruction.surfel_attribute(kSurfelY)[surfel_index],
+                               reconstruction.surfel_attribute(kSurfelZ)[surfel_index]);
+      }
+    }
+    std::sort(positions.begin(), positions.end());
+    return positions;
+  };
+  
+  TestFrame plane;
+  CreateTestFrame(camera, [&](int x, int y) { return WavyDepth(x, y, 0); }, &plane);
+  IntegrateFrame(0, plane, SE3f(), parameters, &reconstruction);
+  transfer_and_check(0);
+  
+  // Without merged surfels, there is nothing to compact.
+  EXPECT_EQ(0u, reconstruction.CompactSurfels(100, 0));
+  
+  // Replace the surfels with ones on a wall behind them. Compact a few surfels
+  // per frame, and sometimes more than once between the transfers.
+  TestFrame wall;
+  CreateTestFrame(camera, [&](int x, int y) { return 2 * WavyDepth(x, y, 1); }, &wall);
+  u32 reclaimed_count = 0;
+  for (u32 frame_index = 1; frame_index < 12; ++ frame_index) {
+    IntegrateFrame(frame_index, wall, SE3f(), parameters, &reconstruction);
+    for (int compaction = 0; compaction < 1 + static_cast<int>(frame_index % 2); ++ compaction) {
+      u32 old_size = reconstruction.surfels_size();
+      u32 old_count = reconstruction.surfel_count();
+      auto old_positions = live_surfel_positions();
+      u32 reclaimed = reconstruction.CompactSurfels(200, 0.01f);
+      EXPECT_EQ(old_size - reclaimed, reconstruction.surfels_size());
+      EXPECT_EQ(old_count, reconstruction.surfel_count());
+      EXPECT_TRUE(old_positions == live_surfel_positions());
+      reclaimed_count += reclaimed;
+    }
+    transfer_and_check(frame_index);
+  }
+  EXPECT_GT(reclaimed_count, 0u);
+  
+  // Compact completely after observing the first surface again, such that
+  // new surfels, which were not transferred yet, are moved as well.
+  // Afterwards, all entries are live and the neighbors refer to live surfels.
+  for (u32 frame_index = 12; frame_index < 16; ++ frame_index) {
+    IntegrateFrame(frame_index, plane, SE3f(), parameters, &reconstruction);
+  }
+  reconstruction.CompactSurfels(kMaxSurfelCount, 0);
+  transfer_and_check(15);
+  EXPECT_EQ(reconstruction.surfel_count(), reconstruction.surfels_size());
+  for (u32 surfel_index = 0; surfel_index < reconstruction.surfels_size(); ++ surfel_index) {
+    EXPECT_GE(reconstruction.surfel_attribute(kSurfelRadiusSquared)[surfel_index], 0);
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      u32 neighbor_index = GetU32Attribute(reconstruction, kSurfelNeighbor0 + n, surfel_index);
+      if (neighbor_index != Surfel::kInvalidIndex) {
+        EXPECT_LT(neighbor_index, reconstruction.surfels_size());
+      }
+    }
+  }
+  LOG(INFO) << "Reclaimed " << reclaimed_count << " surfel entries incrementally, "
+            << reconstruction.surfels_size() << " surfels left";
+  
+  // Integration continues to work on the compacted surfels.
+  IntegrateFrame(16, wall, SE3f(), parameters, &reconstruction);
+  transfer_and_check(16);
+}
+
+// Measures the time per integrated frame.
+TEST(CPUSurfelReconstruction, DISABLED_IntegrationBenchmark) {
+  constexpr int kWidth = 640;
+  constexpr int kHeight = 480;
+  constexpr int kFrameCount = 10;
+  
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  FusionParameters parameters;
+  CPUSurfelReconstruction reconstruction(10 * kWidth * kHeight, camera, /*thread_count*/ 0);
+  
+  vector<TestFrame> frames(kFrameCount);
+  for (int frame_index = 0; frame_index < kFrameCount; ++ frame_index) {
+    CreateTestFrame(camera, [&](int x, int y) { return WavyDepth(x, y, 0.1f * frame_index); }, &frames[frame_index]);
+  }
+  
+  const char* stage_names[7] = {"data association", "surfel merging", "measurement blending", "integration", "neighbor update", "new surfel creation", "regularization"};
+  double stage_milliseconds[7] = {0, 0, 0, 0, 0, 0, 0};
+  double total_seconds = 0;
+  for (int frame_index = 0; frame_index < kFrameCount; ++ frame_index) {
+    SE3f global_T_local(Sophus::SO3f::exp(Vec3f(0, 0.002f * frame_index, 0)), Vec3f(0.005f * frame_index, 0, 0));
+    Timer timer("");
+    IntegrateFrame(frame_index, frames[frame_index], global_T_local, parameters, &reconstruction);
+    total_seconds += timer.Stop(false);
+    
+    float timings[7];
+    reconstruction.GetTimings(&timings[0], &timings[1], &timings[2], &timings[3], &timings[4], &timings[5], &timings[6]);
+    for (int stage = 0; stage < 7; ++ stage) {
+      stage_milliseconds[stage] += timings[stage];
+    }
+  }
+  
+  for (int stage = 0; stage < 7; ++ stage) {
+    LOG(INFO) << kWidth << "x" << kHeight << ", " << reconstruction.thread_count() << " thread(s), "
+              << stage_names[stage] << ": " << (stage_milliseconds[stage] / kFrameCount) << " ms";
+  }
+  LOG(INFO) << kWidth << "x" << kHeight << ", " << reconstruction.thread_count() << " thread(s), total: "
+            << (1000 * total_seconds / kFrameCount) << " ms per frame, "
+            << reconstruction.surfel_count() << " surfels";
+}
@@ -0,0 +1,276 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <cmath>
+#include <memory>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <libvis/timing.h>
+
+#include "surfel_meshing/cpu_surfel_regularization.h"
+#include "surfel_meshing/surfel.h"
+
+using namespace vis;
+
+namespace {
+constexpr float kRadiusFactorForRegularizationNeighbors = 2;
+constexpr float kRegularizerWeight = 10;
+constexpr int kRegularizationFrameWindowSize = 30;
+constexpr u32 kFrameIndex = 100;
+
+// Creates a grid of surfels on a wavy surface with 4-neighborhoods in row-major
+// order, like the surfels created for a depth image. Some neighbors are
+// replaced with random (far) surfels, and some surfels are outside of the
+// regularization window.
+void CreateTestSurfels(int grid_width, int grid_height, unique_ptr<float[]>* data) {
+  const u32 surfel_count = grid_width * grid_height;
+  data->reset(new float[kSurfelAttributeCount * surfel_count]);
+  CPUSurfelBuffer surfels(data->get(), surfel_count);
+  
+  constexpr float kSpacing = 0.01f;
+  for (int y = 0; y < grid_height; ++ y) {
+    for (int x = 0; x < grid_width; ++ x) {
+      u32 surfel_index = x + y * grid_width;
+      float noise = 0.002f * ((rand() % 201) - 100) / 100.f;
+      surfels(kSurfelX, surfel_index) = kSpacing * x;
+      surfels(kSurfelY, surfel_index) = kSpacing * y;
+      surfels(kSurfelZ, surfel_index) = 1 + 0.05f * sinf(0.1f * x) * cosf(0.07f * y) + noise;
+      surfels(kSurfelSmoothX, surfel_index) = surfels(kSurfelX, surfel_index);
+      surfels(kSurfelSmoothY, surfel_index) = surfels(kSurfelY, surfel_index);
+      surfels(kSurfelSmoothZ, surfel_index) = surfels(kSurfelZ, surfel_index);
+      surfels(kSurfelNormalX, surfel_index) = 0;
+      surfels(kSurfelNormalY, surfel_index) = 0;
+      surfels(kSurfelNormalZ, surfel_index) = -1;
+      surfels(kSurfelRadiusSquared, surfel_index) = 2 * kSpacing * kSpacing;
+      surfels.SetU32(kSurfelLastUpdateStamp, surfel_index, (rand() % 20 == 0) ? 0 : kFrameIndex);
+      
+      const int neighbor_x[4] = {x - 1, x + 1, x, x};
+      const int neighbor_y[4] = {y, y, y - 1, y + 1};
+      for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+        u32 neighbor_index = Surfel::kInvalidIndex;
+        if (rand() % 20 == 0) {
+          neighbor_index = rand() % surfel_count;
+        } else if (neighbor_x[n] >= 0 && neighbor_y[n] >= 0 && neighbor_x[n] < grid_width && neighbor_y[n] < grid_height) {
+          neighbor_index = neighbor_x[n] + neighbor_y[n] * grid_width;
+        }
+        surfels.SetU32(kSurfelNeighbor0 + n, surfel_index, neighbor_index);
+      }
+    }
+  }
+}
+
+// Straightforward (single-threaded) transcription of RegularizeSurfelsCUDA(),
+// which serves as reference.
+void ReferenceRegularization(u32 surfel_count, const CPUSurfelBuffer& surfels) {
+  auto in_window = [&](u32 surfel_index) {
+    return !(static_cast<int>(surfels.GetU32(kSurfelLastUpdateStamp, surfel_index)) <
+             static_cast<int>(kFrameIndex - kRegularizationFrameWindowSize));
+  };
+  
+  for (u32 surfel_index = 0; surfel_index < surfel_count; ++ surfel_index) {
+    surfels(kSurfelGradientX, surfel_index) = 0;
+    surfels(kSurfelGradientY, surfel_index) = 0;
+    surfels(kSurfelGradientZ, surfel_index) = 0;
+    surfels(kSurfelGradientCount, surfel_index) = 0;
+  }
+  
+  for (u32 surfel_index = 0; surfel_index < surfel_count; ++ surfel_index) {
+    int neighbor_count = 0;
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      u32 neighbor_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+      neighbor_count += (neighbor_index != Surfel::kInvalidIndex && in_window(neighbor_index)) ? 1 : 0;
+    }
+    if (neighbor_count == 0) {
+      continue;
+    }
+    Vec3f normal = surfels.normal(surfel_index);
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      u32 neighbor_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+      if (neighbor_index == Surfel::kInvalidIndex || !in_window(neighbor_index)) {
+        continue;
+      }
+      Vec3f this_to_neighbor = surfels.smooth_position(neighbor_index) - surfels.smooth_position(surfel_index);
+      Vec3f gradient = (2 * kRegularizerWeight / neighbor_count) * normal.dot(this_to_neighbor) * normal;
+      surfels(kSurfelGradientX, neighbor_index) += gradient.x();
+      surfels(kSurfelGradientY, neighbor_index) += gradient.y();
+      surfels(kSurfelGradientZ, neighbor_index) += gradient.z();
+      surfels(kSurfelGradientCount, neighbor_index) += kRegularizerWeight / neighbor_count;
+      if (this_to_neighbor.squaredNorm() > kRadiusFactorForRegularizationNeighbors * kRadiusFactorForRegularizationNeighbors * surfels(kSurfelRadiusSquared, surfel_index)) {
+        surfels.SetU32(kSurfelNeighbor0 + n, surfel_index, Surfel::kInvalidIndex);
+      }
+    }
+  }
+  
+  vector<Vec3f> new_smooth_positions(surfel_count);
+  for (u32 surfel_index = 0; surfel_index < surfel_count; ++ surfel_index) {
+    if (!in_window(surfel_index)) {
+      continue;
+    }
+    Vec3f smooth_position = surfels.smooth_position(surfel_index);
+    Vec3f normal = surfels.normal(surfel_index);
+    Vec3f gradient = 2 * (smooth_position - surfels.position(surfel_index)) +
+                     Vec3f(surfels(kSurfelGradientX, surfel_index), surfels(kSurfelGradientY, surfel_index), surfels(kSurfelGradientZ, surfel_index));
+    int neighbor_count = 0;
+    Vec3f regularization_gradient = Vec3f::Zero();
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      u32 neighbor_index = surfels.GetU32(kSurfelNeighbor0 + n, surfel_index);
+      if (neighbor_index != Surfel::kInvalidIndex) {
+        ++ neighbor_count;
+        regularization_gradient -= normal.dot(surfels.smooth_position(neighbor_index) - smooth_position) * normal;
+      }
+    }
+    if (neighbor_count > 0) {
+      gradient += (2 * kRegularizerWeight / neighbor_count) * regularization_gradient;
+    }
+    float step_size_factor = 0.5f / (1 + kRegularizerWeight + surfels(kSurfelGradientCount, surfel_index));
+    float max_step_length = sqrtf(surfels(kSurfelRadiusSquared, surfel_index));
+    float step_length = step_size_factor * gradient.norm();
+    if (step_length > max_step_length) {
+      step_size_factor *= max_step_length / step_length;
+    }
+    new_smooth_positions[surfel_index] = smooth_position - step_size_factor * gradient;
+  }
+  for (u32 surfel_index = 0; surfel_index < surfel_count; ++ surfel_index) {
+    if (in_window(surfel_index)) {
+      surfels(kSurfelSmoothX, surfel_index) = new_smooth_positions[surfel_index].x();
+      surfels(kSurfelSmoothY, surfel_index) = new_smooth_positions[surfel_index].y();
+      surfels(kSurfelSmoothZ, surfel_index) = new_smooth_positions[surfel_index].z();
+    }
+  }
+}
+
+void CopySurfels(u32 surfel_count, const unique_ptr<float[]>& source, unique_ptr<float[]>* destination) {
+  destination->reset(new float[kSurfelAttributeCount * surfel_count]);
+  memcpy(destination->get(), source.get(), kSurfelAttributeCount * surfel_count * sizeof(float));
+}
+}  // namespace
+
+// Compares to the reference implementation, with a surfel count which spans
+// several blocks with a partial block at the end.
+TEST(CPUSurfelRegularization, CompareToReference) {
+  constexpr int kGridWidth = 157;
+  constexpr int kGridHeight = 131;
+  constexpr u32 kSurfelCount = kGridWidth * kGridHeight;
+  constexpr int kIterations = 3;
+  
+  srand(0);
+  unique_ptr<float[]> reference_data;
+  CreateTestSurfels(kGridWidth, kGridHeight, &reference_data);
+  unique_ptr<float[]> data;
+  CopySurfels(kSurfelCount, reference_data, &data);
+  CPUSurfelBuffer reference(reference_data.get(), kSurfelCount);
+  CPUSurfelBuffer surfels(data.get(), kSurfelCount);
+  
+  ThreadPool thread_pool(3);
+  CPUSurfelRegularization regularization;
+  for (int iteration = 0; iteration < kIterations; ++ iteration) {
+    ReferenceRegularization(kSurfelCount, reference);
+    regularization.Regularize(
+        /*disable_denoising*/ false, kFrameIndex, kRadiusFactorForRegularizationNeighbors,
+        kRegularizerWeight, kRegularizationFrameWindowSize, kSurfelCount, surfels, &thread_pool);
+  }
+  
+  int moved_surfel_count = 0;
+  for (u32 surfel_index = 0; surfel_index < kSurfelCount; ++ surfel_index) {
+    // The gradients are summed up in a different order, so only the neighbor
+    // entries are required to be identical.
+    for (int n = 0; n < kSurfelNeighborCount; ++ n) {
+      ASSERT_EQ(reference.GetU32(kSurfelNeighbor0 + n, surfel_index),
+                surfels.GetU32(kSurfelNeighbor0 + n, surfel_index)) << "surfel " << surfel_index;
+    }
+    ASSERT_NEAR(reference(kSurfelSmoothZ, surfel_index), surfels(kSurfelSmoothZ, surfel_index), 1e-6f) << "surfel " << surfel_index;
+    ASSERT_NEAR(reference(kSurfelSmoothX, surfel_index), surfels(kSurfelSmoothX, surfel_index), 1e-6f) << "surfel " << surfel_index;
+    ASSERT_NEAR(reference(kSurfelGradientCount, surfel_index), surfels(kSurfelGradientCount, surfel_index), 1e-4f) << "surfel " << surfel_index;
+    moved_surfel_count += (surfels(kSurfelSmoothZ, surfel_index) != surfels(kSurfelZ, surfel_index)) ? 1 : 0;
+  }
+  EXPECT_GT(moved_surfel_count, static_cast<int>(kSurfelCount / 2));
+}
+
+TEST(CPUSurfelRegularization, ThreadCountInvariance) {
+  constexpr int kGridWidth = 211;
+  constexpr int kGridHeight = 97;
+  constexpr u32 kSurfelCount = kGridWidth * kGridHeight;
+  
+  srand(0);
+  unique_ptr<float[]> single_threaded_data;
+  CreateTestSurfels(kGridWidth, kGridHeight, &single_threaded_data);
+  unique_ptr<float[]> multi_threaded_data;
+  CopySurfels(kSurfelCount, single_threaded_data, &multi_threaded_data);
+  
+  ThreadPool single_threaded_pool(1);
+  ThreadPool multi_threaded_pool(4);
+  CPUSurfelRegularization single_threaded;
+  CPUSurfelRegularization multi_threaded;
+  for (int iteration = 0; iteration < 3; ++ iteration) {
+    single_threaded.Regularize(
+        /*disable_denoising*/ false, kFrameIndex, kRadiusFactorForRegularizationNeighbors, kRegularizerWeight,
+        kRegularizationFrameWindowSize, kSurfelCount, CPUSurfelBuffer(single_threaded_data.get(), kSurfelCount), &single_threaded_pool);
+    multi_threaded.Regularize(
+        /*disable_denoising*/ false, kFrameIndex, kRadiusFactorForRegularizationNeighbors, kRegularizerWeight,
+        kRegularizationFrameWindowSize, kSurfelCount, CPUSurfelBuffer(multi_threaded_data.get(), kSurfelCount), &multi_threaded_pool);
+  }
+  
+  EXPECT_EQ(0, memcmp(single_threaded_data.get(), multi_threaded_data.get(), kSurfelAttributeCount * kSurfelCount * sizeof(float)));
+}
+
+// Measures the regularization iterations per second for different surfel
+// counts, to help sizing regularization_iterations_per_integration_iteration.
+TEST(CPUSurfelRegularization, DISABLED_IterationsPerSecondBenchmark) {
+  constexpr int kIterations = 5;
+  
+  vector<int> thread_counts = {1};
+  ThreadPool default_thread_pool(0);
+  if (default_thread_pool.thread_count() > 1) {
+    thread_counts.push_back(default_thread_pool.thread_count());
+  }
+  
+  for (int grid_size : {316, 632, 1264}) {
+    const u32 surfel_count = grid_size * grid_size;
+    srand(0);
+    unique_ptr<float[]> data;
+    CreateTestSurfels(grid_size, grid_size, &data);
+    CPUSurfelBuffer surfels(data.get(), surfel_count);
+    
+    for (int thread_count : thread_counts) {
+      ThreadPool thread_pool(thread_count);
+      CPUSurfelRegularization regularization;
+      Timer timer("");
+      for (int iteration = 0; iteration < kIterations; ++ iteration) {
+        regularization.Regularize(
+            /*disable_denoising*/ false, kFrameIndex, kRadiusFactorForRegularizationNeighbors, kRegularizerWeight,
+            kRegularizationFrameWindowSize, surfel_count, surfels, &thread_pool);
+      }
+      double seconds = timer.Stop(false);
+      LOG(INFO) << surfel_count << " surfels, " << thread_count << " thread(s): "
+                << (kIterations / seconds) << " iterations/s ("
+                << (1e-6 * kIterations * surfel_count / seconds) << " Msurfels/s)";
+    }
+  }
+}
@@ -0,0 +1,362 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "surfel_meshing/cuda_surfels_cpu.h"
+
+using namespace vis;
+
+namespace {
+void PublishSnapshot(u32 frame_index, const vector<u32>* changed_surfels, CUDASurfelsCPU* buffers) {
+  CUDASurfelBuffersCPU* buffer = buffers->write_buffers();
+  buffer->frame_index = frame_index;
+  buffer->surfel_count = 10;
+  if (changed_surfels) {
+    buffers->SetChangedSurfels(changed_surfels->data(), changed_surfels->size());
+  }
+  buffers->PublishWriteBuffers();
+}
+}
+
+// Checks that snapshots which were not acquired are superseded by the
+// following ones, which then also list the surfels changed in them.
+TEST(CUDASurfelsCPU, SupersedesSnapshots) {
+  CUDASurfelsCPU buffers(10);
+  EXPECT_FALSE(buffers.has_new_snapshot());
+  EXPECT_FALSE(buffers.AcquireLatestBuffers());
+  
+  vector<u32> changed_0 = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+  PublishSnapshot(0, &changed_0, &buffers);
+  EXPECT_TRUE(buffers.has_new_snapshot());
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_FALSE(buffers.has_new_snapshot());
+  EXPECT_EQ(0u, buffers.read_buffers().frame_index);
+  EXPECT_EQ(1u, buffers.read_buffers().sequence_number);
+  EXPECT_FALSE(buffers.read_buffers().all_surfels_changed);
+  EXPECT_EQ(changed_0, buffers.read_buffers().changed_surfel_indices);
+  
+  // Publish three snapshots before acquiring again.
+  vector<u32> changed_1 = {1, 5};
+  vector<u32> changed_2 = {5, 8};
+  vector<u32> changed_3 = {3};
+  PublishSnapshot(1, &changed_1, &buffers);
+  PublishSnapshot(2, &changed_2, &buffers);
+  PublishSnapshot(3, &changed_3, &buffers);
+  EXPECT_EQ(4u, buffers.published_snapshot_count());
+  EXPECT_EQ(2u, buffers.dropped_snapshot_count());
+  
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_FALSE(buffers.AcquireLatestBuffers());
+  EXPECT_EQ(3u, buffers.read_buffers().frame_index);
+  EXPECT_EQ(4u, buffers.read_buffers().sequence_number);
+  EXPECT_FALSE(buffers.read_buffers().all_surfels_changed);
+  EXPECT_EQ(vector<u32>({1, 3, 5, 8}), buffers.read_buffers().changed_surfel_indices);
+  
+  // The changes of acquired snapshots are not listed again.
+  vector<u32> changed_4 = {9};
+  PublishSnapshot(4, &changed_4, &buffers);
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_EQ(changed_4, buffers.read_buffers().changed_surfel_indices);
+  
+  // A superseded snapshot without a list of changed surfels makes the
+  // following one report all surfels as changed.
+  PublishSnapshot(5, nullptr, &buffers);
+  PublishSnapshot(6, &changed_4, &buffers);
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_EQ(6u, buffers.read_buffers().frame_index);
+  EXPECT_TRUE(buffers.read_buffers().all_surfels_changed);
+  
+  // Many superseded snapshots are merged conservatively.
+  for (u32 i = 0; i < 10; ++ i) {
+    vector<u32> changed = {i};
+    PublishSnapshot(7 + i, &changed, &buffers);
+  }
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_EQ(changed_0, buffers.read_buffers().changed_surfel_indices);
+  
+  EXPECT_EQ(17u, buffers.published_snapshot_count());
+  EXPECT_EQ(17u, buffers.acquired_snapshot_count() + buffers.dropped_snapshot_count());
+}
+
+// Checks that the surfel moves of superseded snapshots are passed on to the
+// read side, and that the surfels listed as changed in them are renumbered.
+TEST(CUDASurfelsCPU, SupersedesSurfelMoves) {
+  CUDASurfelsCPU buffers(10);
+  vector<u32> changed_0 = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9};
+  PublishSnapshot(0, &changed_0, &buffers);
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_TRUE(buffers.read_buffers().surfel_moves.empty());
+  
+  // Move the surfel in entry 9 into entry 2, then the one in entry 8 into
+  // entry 9 (which was vacated), then the one in entry 9 into entry 3.
+  vector<SurfelMove> moves_1 = {SurfelMove(9, 2), SurfelMove(8, 9)};
+  vector<SurfelMove> moves_2 = {SurfelMove(9, 3)};
+  vector<u32> changed_1 = {4, 9};
+  vector<u32> changed_2 = {1};
+  buffers.SetSurfelMoves(moves_1.data(), moves_1.size());
+  PublishSnapshot(1, &changed_1, &buffers);
+  buffers.write_buffers()->surfel_count = 8;
+  buffers.SetSurfelMoves(moves_2.data(), moves_2.size());
+  buffers.SetChangedSurfels(changed_2.data(), changed_2.size());
+  buffers.PublishWriteBuffers();
+  
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  const CUDASurfelBuffersCPU& buffer = buffers.read_buffers();
+  ASSERT_EQ(3u, buffer.surfel_moves.size());
+  EXPECT_EQ(9u, buffer.surfel_moves[0].from);
+  EXPECT_EQ(2u, buffer.surfel_moves[0].to);
+  EXPECT_EQ(8u, buffer.surfel_moves[1].from);
+  EXPECT_EQ(9u, buffer.surfel_moves[1].to);
+  EXPECT_EQ(9u, buffer.surfel_moves[2].from);
+  EXPECT_EQ(3u, buffer.surfel_moves[2].to);
+  // The surfel which changed in entry 9 is in entry 3 now.
+  EXPECT_EQ(vector<u32>({1, 3, 4}), buffer.changed_surfel_indices);
+  
+  unordered_map<u32, u32> original_entries;
+  ComposeSurfelMoves(buffer.surfel_moves, &original_entries);
+  EXPECT_EQ(4u, original_entries.size());
+  EXPECT_EQ(9u, original_entries.at(2));
+  EXPECT_EQ(8u, original_entries.at(3));
+  EXPECT_EQ(kVacatedSurfelEntry, original_entries.at(8));
+  EXPECT_EQ(kVacatedSurfelEntry, original_entries.at(9));
+  
+  // The moves of acquired snapshots are not passed on again.
+  PublishSnapshot(3, &changed_2, &buffers);
+  ASSERT_TRUE(buffers.AcquireLatestBuffers());
+  EXPECT_TRUE(buffers.read_buffers().surfel_moves.empty());
+}
+
+// Publishes snapshots in one thread and acquires them in another one, which
+// sometimes pauses such that snapshots get superseded. Checks that the
+// acquired snapshots are complete and arrive in order, and that applying only
+// the listed surfel changes reproduces each acquired snapshot.
+TEST(CUDASurfelsCPU, ConcurrentHandOff) {
+  constexpr usize kMaxSurfelCount = 2000;
+  constexpr u32 kSnapshotCount = 5000;
+  
+  CUDASurfelsCPU buffers(kMaxSurfelCount);
+  atomic<bool> producer_done(false);
+  
+  thread producer([&]() {
+    std::mt19937 generator(0);
+    vector<u32> surfel_values;
+    vector<u32> changed_surfels;
+    for (u32 snapshot = 0; snapshot < kSnapshotCount; ++ snapshot) {
+      // Change some surfels and add new ones.
+      usize new_surfel_count = std::min<usize>(kMaxSurfelCount, 100 + snapshot / 4);
+      changed_surfels.clear();
+      for (usize i = 0; i < new_surfel_count; ++ i) {
+        if (i >= surfel_values.size() || generator() % 16 == 0) {
+          changed_surfels.push_back(i);
+        }
+      }
+      surfel_values.resize(new_surfel_count);
+      for (u32 i : changed_surfels) {
+        surfel_values[i] = snapshot;
+      }
+      
+      CUDASurfelBuffersCPU* buffer = buffers.write_buffers();
+      buffer->frame_index = snapshot;
+      buffer->surfel_count = new_surfel_count;
+      for (usize i = 0; i < new_surfel_count; ++ i) {
+        buffer->surfel_x_buffer[i] = surfel_values[i];
+        buffer->surfel_last_update_stamp_buffer[i] = snapshot;
+      }
+      buffers.SetChangedSurfels(changed_surfels.data(), changed_surfels.size());
+      buffers.PublishWriteBuffers();
+      
+      if (snapshot % 4 == 0) {
+        std::this_thread::sleep_for(chrono::microseconds(generator() % 50));
+      }
+    }
+    producer_done = true;
+  });
+  
+  std::mt19937 generator(1);
+  vector<float> received_values(kMaxSurfelCount);
+  u64 previous_sequence_number = 0;
+  u32 last_frame_index = 0;
+  usize acquired_count = 0;
+  usize mismatch_count = 0;
+  while (true) {
+    if (!buffers.AcquireLatestBuffers()) {
+      if (producer_done && !buffers.has_new_snapshot()) {
+        break;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    ++ acquired_count;
+    
+    const CUDASurfelBuffersCPU& buffer = buffers.read_buffers();
+    EXPECT_GT(buffer.sequence_number, previous_sequence_number);
+    EXPECT_EQ(buffer.frame_index + 1, buffer.sequence_number);
+    previous_sequence_number = buffer.sequence_number;
+    last_frame_index = buffer.frame_index;
+    
+    // Apply the listed changes and compare with the complete snapshot.
+    ASSERT_FALSE(buffer.all_surfels_changed);
+    for (u32 i : buffer.changed_surfel_indices) {
+      ASSERT_LT(i, buffer.surfel_count);
+      received_values[i] = buffer.surfel_x_buffer[i];
+    }
+    for (usize i = 0; i < buffer.surfel_count; ++ i) {
+      if (received_values[i] != buffer.surfel_x_buffer[i] ||
+          buffer.surfel_last_update_stamp_buffer[i] != buffer.frame_index) {
+        ++ mismatch_count;
+      }
+    }
+    
+    // Sometimes take a while to get snapshots superseded.
+    if (generator() % 8 == 0) {
+      std::this_thread::sleep_for(chrono::microseconds(generator() % 200));
+    }
+  }
+  producer.join();
+  
+  EXPECT_EQ(0u, mismatch_count);
+  EXPECT_EQ(kSnapshotCount - 1, last_frame_index);
+  EXPECT_EQ(kSnapshotCount, buffers.published_snapshot_count());
+  EXPECT_EQ(acquired_count, buffers.acquired_snapshot_count());
+  EXPECT_EQ(kSnapshotCount, buffers.acquired_snapshot_count() + buffers.dropped_snapshot_count());
+  EXPECT_GE(buffers.max_handoff_latency_ms(), buffers.mean_handoff_latency_ms());
+  LOG(INFO) << "Acquired " << acquired_count << " of " << kSnapshotCount << " snapshots, mean hand-off latency "
+            << buffers.mean_handoff_latency_ms() << " ms, max " << buffers.max_handoff_latency_ms() << " ms";
+}
+
+// Like ConcurrentHandOff, but the producer also moves surfels from the end of
+// the surfel array into the entries of other surfels, which are dropped. The
+// consumer does the moves on its own copy of the surfels, such that it only
+// matches the snapshots if each move is done exactly once.
+TEST(CUDASurfelsCPU, ConcurrentHandOffWithMoves) {
+  constexpr usize kMaxSurfelCount = 2000;
+  constexpr u32 kSnapshotCount = 5000;
+  
+  CUDASurfelsCPU buffers(kMaxSurfelCount);
+  atomic<bool> producer_done(false);
+  
+  thread producer([&]() {
+    std::mt19937 generator(0);
+    u32 next_surfel_value = 0;
+    vector<u32> surfel_values;
+    vector<u32> changed_surfels;
+    vector<SurfelMove> moves;
+    for (u32 snapshot = 0; snapshot < kSnapshotCount; ++ snapshot) {
+      // Overwrite some surfels with the last ones.
+      moves.clear();
+      u32 move_count = (surfel_values.size() > 50 && generator() % 2 == 0) ? (generator() % 8) : 0;
+      for (u32 m = 0; m < move_count; ++ m) {
+        u32 from = surfel_values.size() - 1;
+        u32 to = generator() % from;
+        surfel_values[to] = surfel_values[from];
+        surfel_values.pop_back();
+        moves.emplace_back(from, to);
+      }
+      
+      // Change some surfels and add new ones, such that the vacated entries
+      // get reused.
+      usize new_surfel_count = std::min<usize>(kMaxSurfelCount, surfel_values.size() + generator() % 12);
+      changed_surfels.clear();
+      for (usize i = 0; i < new_surfel_count; ++ i) {
+        if (i >= surfel_values.size() || generator() % 16 == 0) {
+          changed_surfels.push_back(i);
+        }
+      }
+      surfel_values.resize(new_surfel_count);
+      for (u32 i : changed_surfels) {
+        surfel_values[i] = next_surfel_value;
+        ++ next_surfel_value;
+      }
+      
+      CUDASurfelBuffersCPU* buffer = buffers.write_buffers();
+      buffer->frame_index = snapshot;
+      buffer->surfel_count = new_surfel_count;
+      for (usize i = 0; i < new_surfel_count; ++ i) {
+        buffer->surfel_x_buffer[i] = surfel_values[i];
+      }
+      buffers.SetSurfelMoves(moves.data(), moves.size());
+      buffers.SetChangedSurfels(changed_surfels.data(), changed_surfels.size());
+      buffers.PublishWriteBuffers();
+      
+      if (snapshot % 4 == 0) {
+        std::this_thread::sleep_for(chrono::microseconds(generator() % 50));
+      }
+    }
+    producer_done = true;
+  });
+  
+  std::mt19937 generator(1);
+  vector<float> received_values(kMaxSurfelCount);
+  u32 last_frame_index = 0;
+  usize mismatch_count = 0;
+  while (true) {
+    if (!buffers.AcquireLatestBuffers()) {
+      if (producer_done && !buffers.has_new_snapshot()) {
+        break;
+      }
+      std::this_thread::yield();
+      continue;
+    }
+    
+    const CUDASurfelBuffersCPU& buffer = buffers.read_buffers();
+    last_frame_index = buffer.frame_index;
+    for (const SurfelMove& move : buffer.surfel_moves) {
+      ASSERT_LT(move.from, kMaxSurfelCount);
+      ASSERT_LT(move.to, kMaxSurfelCount);
+      received_values[move.to] = received_values[move.from];
+    }
+    ASSERT_FALSE(buffer.all_surfels_changed);
+    for (u32 i : buffer.changed_surfel_indices) {
+      ASSERT_LT(i, buffer.surfel_count);
+      received_values[i] = buffer.surfel_x_buffer[i];
+    }
+    for (usize i = 0; i < buffer.surfel_count; ++ i) {
+      if (received_values[i] != buffer.surfel_x_buffer[i]) {
+        ++ mismatch_count;
+      }
+    }
+    
+    if (generator() % 8 == 0) {
+      std::this_thread::sleep_for(chrono::microseconds(generator() % 200));
+    }
+  }
+  producer.join();
+  
+  EXPECT_EQ(0u, mismatch_count);
+  EXPECT_EQ(kSnapshotCount - 1, last_frame_index);
+}
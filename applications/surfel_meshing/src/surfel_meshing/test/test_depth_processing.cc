@@ -0,0 +1,506 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <thread>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+#include <libvis/timing.h>
+
+#include "surfel_meshing/depth_processing.h"
+
+using namespace vis;
+
+namespace {
+// Straightforward (single-threaded, non-vectorized) transcriptions of the
+// kernels in cuda_depth_processing.cu, which serve as reference for the CPU
+// implementations. Neighbors outside of the image are treated as invalid.
+
+struct ReferenceIntrinsics {
+  explicit ReferenceIntrinsics(const PinholeCamera4f& camera)
+      : fx(camera.parameters()[0]),
+        fy(camera.parameters()[1]),
+        cx(camera.parameters()[2]),
+        cy(camera.parameters()[3]),
+        fx_inv(1.0f / fx),
+        fy_inv(1.0f / fy),
+        cx_inv(-(cx - 0.5f) / fx),
+        cy_inv(-(cy - 0.5f) / fy) {}
+  
+  Vec3f Unproject(int x, int y, float depth) const {
+    return Vec3f(depth * (fx_inv * x + cx_inv), depth * (fy_inv * y + cy_inv), depth);
+  }
+  
+  float fx, fy, cx, cy;
+  float fx_inv, fy_inv, cx_inv, cy_inv;
+};
+
+u16 ReferenceDepth(const Image<u16>& depth, int x, int y) {
+  if (x < 0 || y < 0 || x >= static_cast<int>(depth.width()) || y >= static_cast<int>(depth.height())) {
+    return 0;
+  }
+  return depth(x, y);
+}
+
+void ReferenceBilateralFilteringAndDepthCutoff(
+    float sigma_xy, float sigma_value_factor, u16 value_to_ignore, float radius_factor,
+    u16 max_depth, float depth_valid_region_radius,
+    const Image<u16>& input_depth, Image<u16>* output_depth) {
+  output_depth->SetSize(input_depth.size());
+  int width = input_depth.width();
+  int height = input_depth.height();
+  int radius = radius_factor * sigma_xy + 0.5f;
+  float denom_xy = 2.0f * sigma_xy * sigma_xy;
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      float center_distance_squared = (x - width / 2) * (x - width / 2) + (y - height / 2) * (y - height / 2);
+      u16 center_value = input_depth(x, y);
+      if (center_distance_squared > depth_valid_region_radius * depth_valid_region_radius ||
+          center_value == value_to_ignore || center_value > max_depth) {
+        (*output_depth)(x, y) = value_to_ignore;
+        continue;
+      }
+      
+      float adapted_sigma_value = center_value * sigma_value_factor;
+      float adapted_denom_value = 2.0f * adapted_sigma_value * adapted_sigma_value;
+      float sum = 0;
+      float weight = 0;
+      for (int sample_y = std::max(0, y - radius); sample_y <= std::min(height - 1, y + radius); ++ sample_y) {
+        for (int sample_x = std::max(0, x - radius); sample_x <= std::min(width - 1, x + radius); ++ sample_x) {
+          int grid_distance_squared = (sample_x - x) * (sample_x - x) + (sample_y - y) * (sample_y - y);
+          u16 sample = input_depth(sample_x, sample_y);
+          if (grid_distance_squared > radius * radius || sample == value_to_ignore) {
+            continue;
+          }
+          float value_distance_squared = center_value - sample;
+          value_distance_squared *= value_distance_squared;
+          float w = expf(-grid_distance_squared / denom_xy + -value_distance_squared / adapted_denom_value);
+          sum += w * sample;
+          weight += w;
+        }
+      }
+      (*output_depth)(x, y) = (weight == 0) ? value_to_ignore : (sum / weight + 0.5f);
+    }
+  }
+}
+
+void ReferenceOutlierDepthMapFusion(
+    int required_count, float tolerance, const Image<u16>& input_depth,
+    const PinholeCamera4f& depth_camera, int other_count, const Image<u16>** other_depths,
+    const SE3f* others_T_reference, Image<u16>* output_depth) {
+  output_depth->SetSize(input_depth.size());
+  ReferenceIntrinsics intrinsics(depth_camera);
+  for (u32 y = 0; y < input_depth.height(); ++ y) {
+    for (u32 x = 0; x < input_depth.width(); ++ x) {
+      u16 depth_value = input_depth(x, y);
+      if (depth_value == 0) {
+        (*output_depth)(x, y) = 0;
+        continue;
+      }
+      Vec3f reference_point = intrinsics.Unproject(x, y, depth_value);
+      int ok_count = 0;
+      for (int other_index = 0; other_index < other_count; ++ other_index) {
+        Eigen::Matrix<float, 3, 4> T = others_T_reference[other_index].matrix3x4();
+        Vec3f other_point;
+        for (int row = 0; row < 3; ++ row) {
+          other_point(row) = T(row, 0) * reference_point.x() + T(row, 1) * reference_point.y() + T(row, 2) * reference_point.z() + T(row, 3);
+        }
+        if (other_point.z() <= 0) {
+          continue;
+        }
+        int px = static_cast<int>(intrinsics.fx * (other_point.x() / other_point.z()) + intrinsics.cx);
+        int py = static_cast<int>(intrinsics.fy * (other_point.y() / other_point.z()) + intrinsics.cy);
+        if (px < 0 || py < 0 || px >= static_cast<int>(input_depth.width()) || py >= static_cast<int>(input_depth.height())) {
+          continue;
+        }
+        u16 other_depth_value = (*other_depths[other_index])(px, py);
+        if (other_depth_value <= 0 ||
+            other_depth_value > (1 + tolerance) * other_point.z() ||
+            other_depth_value < (1 - tolerance) * other_point.z()) {
+          continue;
+        }
+        ++ ok_count;
+      }
+      (*output_depth)(x, y) = (ok_count >= required_count) ? depth_value : 0;
+    }
+  }
+}
+
+void ReferenceErodeDepthMap(int radius, const Image<u16>& input_depth, Image<u16>* output_depth) {
+  output_depth->SetSize(input_depth.size());
+  int width = input_depth.width();
+  int height = input_depth.height();
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      bool all_valid = x >= radius && y >= radius && x < width - radius && y < height - radius;
+      for (int dy = y - radius; all_valid && dy <= y + radius; ++ dy) {
+        for (int dx = x - radius; dx <= x + radius; ++ dx) {
+          all_valid &= input_depth(dx, dy) != 0;
+        }
+      }
+      (*output_depth)(x, y) = all_valid ? input_depth(x, y) : 0;
+    }
+  }
+}
+
+void ReferenceComputeNormalsAndDropBadPixels(
+    float observation_angle_threshold_deg, float depth_scaling, const PinholeCamera4f& depth_camera,
+    const Image<u16>& in_depth, Image<u16>* out_depth, Image<Vec2f>* out_normals) {
+  out_depth->SetSize(in_depth.size());
+  out_normals->SetSize(in_depth.size());
+  ReferenceIntrinsics intrinsics(depth_camera);
+  float normal_dot_threshold = -1 * cosf(M_PI / 180.f * observation_angle_threshold_deg);
+  for (int y = 0; y < static_cast<int>(in_depth.height()); ++ y) {
+    for (int x = 0; x < static_cast<int>(in_depth.width()); ++ x) {
+      u16 right_depth = ReferenceDepth(in_depth, x + 1, y);
+      u16 left_depth = ReferenceDepth(in_depth, x - 1, y);
+      u16 bottom_depth = ReferenceDepth(in_depth, x, y + 1);
+      u16 top_depth = ReferenceDepth(in_depth, x, y - 1);
+      if (in_depth(x, y) == 0 || right_depth == 0 || left_depth == 0 || bottom_depth == 0 || top_depth == 0) {
+        (*out_depth)(x, y) = 0;
+        (*out_normals)(x, y) = Vec2f::Zero();
+        continue;
+      }
+      Vec3f left_to_right = intrinsics.Unproject(x + 1, y, (1.0f / depth_scaling) * right_depth) -
+                            intrinsics.Unproject(x - 1, y, (1.0f / depth_scaling) * left_depth);
+      Vec3f bottom_to_top = intrinsics.Unproject(x, y - 1, (1.0f / depth_scaling) * top_depth) -
+                            intrinsics.Unproject(x, y + 1, (1.0f / depth_scaling) * bottom_depth);
+      Vec3f normal = left_to_right.cross(bottom_to_top);
+      float length = normal.norm();
+      if (!(length > 1e-6f)) {
+        normal = Vec3f(0, 0, -1);
+      } else {
+        normal *= ((intrinsics.fy_inv < 0) ? -1.0f : 1.0f) / length;
+      }
+      (*out_normals)(x, y) = Vec2f(normal.x(), normal.y());
+      Vec3f viewing_direction = Vec3f(intrinsics.fx_inv * x + intrinsics.cx_inv, intrinsics.fy_inv * y + intrinsics.cy_inv, 1).normalized();
+      (*out_depth)(x, y) = (viewing_direction.dot(normal) >= normal_dot_threshold) ? 0 : in_depth(x, y);
+    }
+  }
+}
+
+void ReferenceComputePointRadiiAndRemoveIsolatedPixels(
+    float point_radius_extension_factor, float point_radius_clamp_factor, float depth_scaling,
+    const PinholeCamera4f& depth_camera, const Image<u16>& depth_buffer,
+    Image<float>* radius_buffer, Image<u16>* out_depth) {
+  radius_buffer->SetSize(depth_buffer.size());
+  out_depth->SetSize(depth_buffer.size());
+  ReferenceIntrinsics intrinsics(depth_camera);
+  for (int y = 0; y < static_cast<int>(depth_buffer.height()); ++ y) {
+    for (int x = 0; x < static_cast<int>(depth_buffer.width()); ++ x) {
+      if (depth_buffer(x, y) == 0) {
+        (*out_depth)(x, y) = 0;
+        continue;
+      }
+      Vec3f local_position = intrinsics.Unproject(x, y, (1.0f / depth_scaling) * depth_buffer(x, y));
+      int neighbor_count = 0;
+      float radius_squared = 0;
+      float min_neighbor_distance_squared = std::numeric_limits<float>::infinity();
+      for (int dy = y - 1; dy <= y + 1; ++ dy) {
+        for (int dx = x - 1; dx <= x + 1; ++ dx) {
+          u16 neighbor_depth = ReferenceDepth(depth_buffer, dx, dy);
+          if ((dx == x && dy == y) || neighbor_depth == 0) {
+            continue;
+          }
+          ++ neighbor_count;
+          float distance_squared = (intrinsics.Unproject(dx, dy, (1.0f / depth_scaling) * neighbor_depth) - local_position).squaredNorm();
+          radius_squared = std::max(radius_squared, distance_squared);
+          min_neighbor_distance_squared = std::min(min_neighbor_distance_squared, distance_squared);
+        }
+      }
+      radius_squared *= point_radius_extension_factor * point_radius_extension_factor;
+      radius_squared = std::min(radius_squared, 2 * point_radius_clamp_factor * point_radius_clamp_factor * min_neighbor_distance_squared);
+      (*radius_buffer)(x, y) = radius_squared;
+      (*out_depth)(x, y) = (neighbor_count < 8) ? 0 : depth_buffer(x, y);
+    }
+  }
+}
+
+// Creates a depth map of a tilted, wavy surface with noise and some holes.
+void CreateTestDepthMap(int width, int height, float phase, Image<u16>* depth) {
+  depth->SetSize(width, height);
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      float value = 1500 + 2.0f * x - 1.0f * y + 100 * sinf(0.05f * x + phase) * cosf(0.07f * y);
+      value += (rand() % 21) - 10;
+      if (rand() % 50 == 0 ||
+          (x / 16 + y / 16) % 7 == 0) {
+        value = 0;
+      }
+      (*depth)(x, y) = value;
+    }
+  }
+}
+
+PinholeCamera4f CreateTestCamera(int width, int height) {
+  float parameters[4] = {0.8f * width, 0.8f * width, 0.5f * width, 0.5f * height};
+  return PinholeCamera4f(width, height, parameters);
+}
+
+template <typename T>
+int CountDifferences(const Image<T>& a, const Image<T>& b) {
+  int count = 0;
+  for (u32 y = 0; y < a.height(); ++ y) {
+    for (u32 x = 0; x < a.width(); ++ x) {
+      count += (a(x, y) != b(x, y)) ? 1 : 0;
+    }
+  }
+  return count;
+}
+}  // namespace
+
+// Compares the CPU implementations to the reference implementations. The image
+// width is chosen such that the vectorized loops have remainders.
+TEST(DepthProcessing, CompareToReference) {
+  constexpr int kWidth = 83;
+  constexpr int kHeight = 61;
+  constexpr int kOtherCount = 4;
+  
+  srand(0);
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  Image<u16> input;
+  CreateTestDepthMap(kWidth, kHeight, 0, &input);
+  
+  Image<u16> others[kOtherCount];
+  const Image<u16>* other_pointers[kOtherCount];
+  SE3f others_T_reference[kOtherCount];
+  for (int i = 0; i < kOtherCount; ++ i) {
+    CreateTestDepthMap(kWidth, kHeight, 0.02f * (i + 1), &others[i]);
+    other_pointers[i] = &others[i];
+    others_T_reference[i] = SE3f(Sophus::SO3f::exp(0.003f * Vec3f(i, 1, -i)), Vec3f(5.0f * i - 8, 3, 2));
+  }
+  
+  for (int thread_count : {1, 3}) {
+    Image<u16> reference_depth;
+    Image<u16> depth;
+    
+    ReferenceBilateralFilteringAndDepthCutoff(3, 0.05f, 0, 2, 1800, 40, input, &reference_depth);
+    BilateralFilteringAndDepthCutoff(3, 0.05f, 0, 2, 1800, 40, input, &depth, thread_count);
+    int bilateral_differences = 0;
+    for (u32 y = 0; y < input.height(); ++ y) {
+      for (u32 x = 0; x < input.width(); ++ x) {
+        // Allow for differences in the rounding of the result, since the
+        // exponential function is approximated.
+        EXPECT_LE(std::abs(static_cast<int>(depth(x, y)) - static_cast<int>(reference_depth(x, y))), 1);
+        bilateral_differences += (depth(x, y) != reference_depth(x, y)) ? 1 : 0;
+      }
+    }
+    EXPECT_LE(bilateral_differences, 0.001f * kWidth * kHeight);
+    
+    for (int required_count : {kOtherCount, 2}) {
+      ReferenceOutlierDepthMapFusion(required_count, 0.05f, input, camera, kOtherCount, other_pointers, others_T_reference, &reference_depth);
+      if (required_count == kOtherCount) {
+        OutlierDepthMapFusion(0.05f, input, camera, kOtherCount, other_pointers, others_T_reference, &depth, thread_count);
+      } else {
+        OutlierDepthMapFusion(required_count, 0.05f, input, camera, kOtherCount, other_pointers, others_T_reference, &depth, thread_count);
+      }
+      EXPECT_EQ(0, CountDifferences(depth, reference_depth));
+    }
+    
+    for (int radius = 1; radius <= 3; ++ radius) {
+      ReferenceErodeDepthMap(radius, input, &reference_depth);
+      ErodeDepthMap(radius, input, &depth, thread_count);
+      EXPECT_EQ(0, CountDifferences(depth, reference_depth)) << "radius: " << radius;
+    }
+    
+    CopyWithoutBorder(input, &depth, thread_count);
+    for (u32 y = 0; y < input.height(); ++ y) {
+      for (u32 x = 0; x < input.width(); ++ x) {
+        bool border = x == 0 || y == 0 || x == input.width() - 1 || y == input.height() - 1;
+        EXPECT_EQ(border ? 0 : input(x, y), depth(x, y));
+      }
+    }
+    
+    Image<Vec2f> reference_normals;
+    Image<Vec2f> normals;
+    ReferenceComputeNormalsAndDropBadPixels(60, 1000, camera, input, &reference_depth, &reference_normals);
+    ComputeNormalsAndDropBadPixels(60, 1000, camera, input, &depth, &normals, thread_count);
+    EXPECT_EQ(0, CountDifferences(depth, reference_depth));
+    for (u32 y = 0; y < input.height(); ++ y) {
+      for (u32 x = 0; x < input.width(); ++ x) {
+        EXPECT_NEAR(reference_normals(x, y).x(), normals(x, y).x(), 1e-5f);
+        EXPECT_NEAR(reference_normals(x, y).y(), normals(x, y).y(), 1e-5f);
+      }
+    }
+    
+    Image<float> reference_radii;
+    Image<float> radii;
+    ReferenceComputePointRadiiAndRemoveIsolatedPixels(1.5f, 1.0f, 1000, camera, input, &reference_radii, &reference_depth);
+    ComputePointRadiiAndRemoveIsolatedPixels(1.5f, 1.0f, 1000, camera, input, &radii, &depth, thread_count);
+    EXPECT_EQ(0, CountDifferences(depth, reference_depth));
+    for (u32 y = 0; y < input.height(); ++ y) {
+      for (u32 x = 0; x < input.width(); ++ x) {
+        if (input(x, y) != 0) {
+          EXPECT_NEAR(reference_radii(x, y), radii(x, y), 1e-5f * reference_radii(x, y));
+        }
+      }
+    }
+  }
+}
+
+// Checks the documented behavior of the steps on simple inputs.
+TEST(DepthProcessing, Semantics) {
+  constexpr int kWidth = 40;
+  constexpr int kHeight = 30;
+  constexpr u16 kDepth = 2000;
+  constexpr float kDepthScaling = 1000;
+  
+  PinholeCamera4f camera = CreateTestCamera(kWidth, kHeight);
+  Image<u16> plane(kWidth, kHeight);
+  plane.SetTo(kDepth);
+  
+  // Bilateral filtering keeps a constant depth map, but drops depths which are
+  // beyond the cutoff or outside of the valid region around the image center.
+  Image<u16> result;
+  BilateralFilteringAndDepthCutoff(3, 0.05f, 0, 2, kDepth, 10, plane, &result, 2);
+  EXPECT_EQ(kDepth, result(kWidth / 2, kHeight / 2));
+  EXPECT_EQ(kDepth, result(kWidth / 2 + 10, kHeight / 2));
+  EXPECT_EQ(0, result(kWidth / 2 + 8, kHeight / 2 + 7));
+  EXPECT_EQ(0, result(0, 0));
+  BilateralFilteringAndDepthCutoff(3, 0.05f, 0, 2, kDepth - 1, 100, plane, &result, 2);
+  EXPECT_EQ(0, result(kWidth / 2, kHeight / 2));
+  
+  // Outlier filtering with an identity transformation keeps all pixels of an
+  // unchanged depth map, and drops all pixels if the other depth is too far.
+  const Image<u16>* other = &plane;
+  SE3f identity;
+  OutlierDepthMapFusion(0.1f, plane, camera, 1, &other, &identity, &result, 2);
+  EXPECT_EQ(0, CountDifferences(plane, result));
+  Image<u16> far_plane(kWidth, kHeight);
+  far_plane.SetTo(static_cast<u16>(1.2f * kDepth));
+  other = &far_plane;
+  OutlierDepthMapFusion(0.1f, plane, camera, 1, &other, &identity, &result, 2);
+  EXPECT_EQ(0, result(kWidth / 2, kHeight / 2));
+  
+  // A single hole is grown to (2 * radius + 1)^2 pixels by erosion, and the
+  // image border of width radius is removed.
+  Image<u16> holed_plane(plane);
+  holed_plane(20, 15) = 0;
+  ErodeDepthMap(2, holed_plane, &result, 2);
+  int removed_count = 0;
+  for (int y = 2; y < kHeight - 2; ++ y) {
+    for (int x = 2; x < kWidth - 2; ++ x) {
+      removed_count += (result(x, y) == 0) ? 1 : 0;
+    }
+  }
+  EXPECT_EQ(25, removed_count);
+  EXPECT_EQ(0, result(1, 10));
+  EXPECT_EQ(0, result(kWidth - 2, 10));
+  
+  // The normals of a fronto-parallel plane point towards the camera, so
+  // their x and y components are zero and no pixels are dropped except at the
+  // border.
+  Image<Vec2f> normals;
+  ComputeNormalsAndDropBadPixels(80, kDepthScaling, camera, plane, &result, &normals, 2);
+  EXPECT_NEAR(0, normals(10, 10).x(), 1e-6f);
+  EXPECT_NEAR(0, normals(10, 10).y(), 1e-6f);
+  EXPECT_EQ(kDepth, result(10, 10));
+  EXPECT_EQ(0, result(0, 10));
+  
+  // On a fronto-parallel plane, the diagonal neighbors are at sqrt(2) times
+  // the pixel spacing. With a large clamp factor, the radius extends this by
+  // the extension factor. Isolated pixels and pixels at the border are
+  // dropped.
+  Image<float> radii;
+  Image<u16> isolated_plane(plane);
+  isolated_plane(5, 6) = 0;
+  ComputePointRadiiAndRemoveIsolatedPixels(1.5f, 10.0f, kDepthScaling, camera, isolated_plane, &radii, &result, 2);
+  float pixel_spacing = (kDepth / kDepthScaling) / camera.parameters()[0];
+  EXPECT_NEAR(1.5f * 1.5f * 2 * pixel_spacing * pixel_spacing, radii(20, 20), 1e-4f * radii(20, 20));
+  EXPECT_EQ(kDepth, result(20, 20));
+  EXPECT_EQ(0, result(5, 5));
+  EXPECT_EQ(0, result(0, 0));
+  // The clamp limits the squared radius to 2 * clamp_factor^2 times the
+  // squared distance to the closest neighbor.
+  ComputePointRadiiAndRemoveIsolatedPixels(1.5f, 1.0f, kDepthScaling, camera, plane, &radii, &result, 2);
+  EXPECT_NEAR(2 * pixel_spacing * pixel_spacing, radii(20, 20), 1e-4f * radii(20, 20));
+}
+
+// Measures the throughput of the preprocessing steps for common image sizes.
+TEST(DepthProcessing, DISABLED_ThroughputBenchmark) {
+  constexpr int kRepetitions = 5;
+  constexpr int kOtherCount = 4;
+  
+  vector<int> thread_counts = {1};
+  if (DefaultDepthProcessingThreadCount() > 1) {
+    thread_counts.push_back(DefaultDepthProcessingThreadCount());
+  }
+  
+  for (const Vec2i& size : {Vec2i(640, 480), Vec2i(1280, 720)}) {
+    srand(0);
+    PinholeCamera4f camera = CreateTestCamera(size.x(), size.y());
+    Image<u16> input;
+    CreateTestDepthMap(size.x(), size.y(), 0, &input);
+    Image<u16> others[kOtherCount];
+    const Image<u16>* other_pointers[kOtherCount];
+    SE3f others_T_reference[kOtherCount];
+    for (int i = 0; i < kOtherCount; ++ i) {
+      CreateTestDepthMap(size.x(), size.y(), 0.02f * (i + 1), &others[i]);
+      other_pointers[i] = &others[i];
+      others_T_reference[i] = SE3f(Sophus::SO3f::exp(0.003f * Vec3f(i, 1, -i)), Vec3f(5.0f * i - 8, 3, 2));
+    }
+    
+    for (int thread_count : thread_counts) {
+      Image<u16> depth_a;
+      Image<u16> depth_b;
+      Image<Vec2f> normals;
+      Image<float> radii;
+      double seconds[5] = {0, 0, 0, 0, 0};
+      for (int repetition = 0; repetition < kRepetitions; ++ repetition) {
+        Timer timer("");
+        BilateralFilteringAndDepthCutoff(3, 0.05f, 0, 2, 3000, 1e6f, input, &depth_a, thread_count);
+        seconds[0] += timer.Stop(false);
+        timer.Start();
+        OutlierDepthMapFusion(0.1f, depth_a, camera, kOtherCount, other_pointers, others_T_reference, &depth_b, thread_count);
+        seconds[1] += timer.Stop(false);
+        timer.Start();
+        ErodeDepthMap(2, depth_b, &depth_a, thread_count);
+        seconds[2] += timer.Stop(false);
+        timer.Start();
+        ComputeNormalsAndDropBadPixels(85, 1000, camera, depth_a, &depth_b, &normals, thread_count);
+        seconds[3] += timer.Stop(false);
+        timer.Start();
+        ComputePointRadiiAndRemoveIsolatedPixels(1.5f, 1.0f, 1000, camera, depth_b, &radii, &depth_a, thread_count);
+        seconds[4] += timer.Stop(false);
+      }
+      
+      const char* stage_names[5] = {"bilateral filtering", "outlier filtering", "erosion", "normals", "radii"};
+      double total_seconds = 0;
+      for (int stage = 0; stage < 5; ++ stage) {
+        double stage_seconds = seconds[stage] / kRepetitions;
+        total_seconds += stage_seconds;
+        LOG(INFO) << size.x() << "x" << size.y() << ", " << thread_count << " thread(s), "
+                  << stage_names[stage] << ": " << (1000 * stage_seconds) << " ms ("
+                  << (1e-6 * size.x() * size.y() / stage_seconds) << " Mpix/s)";
+      }
+      LOG(INFO) << size.x() << "x" << size.y() << ", " << thread_count << " thread(s), total: "
+                << (1000 * total_seconds) << " ms";
+    }
+  }
+}
@@ -0,0 +1,193 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "surfel_meshing/frame_pipeline.h"
+
+using namespace vis;
+
+// Passes numbers through a chain of three stages with small queues and checks
+// that all of them arrive in order.
+TEST(FramePipeline, PassesItemsInOrder) {
+  constexpr int kItemCount = 1000;
+  constexpr usize kQueueCapacity = 2;
+  
+  FramePipeline pipeline;
+  FramePipelineQueue<int>* numbers = pipeline.AddQueue<int>("numbers", kQueueCapacity);
+  FramePipelineQueue<int>* squares = pipeline.AddQueue<int>("squares", kQueueCapacity);
+  
+  pipeline.AddStage("producer", {numbers}, [&](FramePipelineStage* stage) {
+    for (int i = 0; i < kItemCount; ++ i) {
+      if (!stage->Push(numbers, int(i))) {
+        return;
+      }
+    }
+  });
+  pipeline.AddStage("squaring", {numbers, squares}, [&](FramePipelineStage* stage) {
+    int number;
+    while (stage->Pop(numbers, &number)) {
+      if (!stage->Push(squares, number * number)) {
+        return;
+      }
+    }
+  });
+  vector<int> results;
+  pipeline.AddStage("consumer", {squares}, [&](FramePipelineStage* stage) {
+    int square;
+    while (stage->Pop(squares, &square)) {
+      results.push_back(square);
+    }
+  });
+  pipeline.Start();
+  pipeline.Wait();
+  
+  ASSERT_EQ(static_cast<usize>(kItemCount), results.size());
+  for (int i = 0; i < kItemCount; ++ i) {
+    EXPECT_EQ(i * i, results[i]);
+  }
+  for (const unique_ptr<FramePipelineQueueBase>& queue : pipeline.queues()) {
+    EXPECT_EQ(static_cast<usize>(kItemCount), queue->push_count());
+    EXPECT_GE(queue->max_depth(), 1u);
+    EXPECT_LE(queue->max_depth(), kQueueCapacity);
+    EXPECT_GE(queue->mean_depth(), 1);
+    EXPECT_LE(queue->mean_depth(), kQueueCapacity);
+  }
+  for (const unique_ptr<FramePipelineStage>& stage : pipeline.stages()) {
+    EXPECT_GE(stage->busy_seconds(), 0);
+    EXPECT_LE(stage->busy_seconds(), pipeline.wall_seconds());
+  }
+}
+
+// Lets the consumer stop early and checks that the producer, which would
+// otherwise run forever, stops as well.
+TEST(FramePipeline, StopsWhenAStageReturnsEarly) {
+  constexpr int kConsumedItemCount = 10;
+  
+  FramePipeline pipeline;
+  FramePipelineQueue<int>* numbers = pipeline.AddQueue<int>("numbers", 3);
+  
+  pipeline.AddStage("producer", {numbers}, [&](FramePipelineStage* stage) {
+    for (int i = 0; ; ++ i) {
+      if (!stage->Push(numbers, int(i))) {
+        return;
+      }
+    }
+  });
+  int consumed_item_count = 0;
+  pipeline.AddStage("consumer", {numbers}, [&](FramePipelineStage* stage) {
+    int number;
+    while (consumed_item_count < kConsumedItemCount && stage->Pop(numbers, &number)) {
+      EXPECT_EQ(consumed_item_count, number);
+      ++ consumed_item_count;
+    }
+  });
+  pipeline.Start();
+  pipeline.Wait();
+  
+  EXPECT_EQ(kConsumedItemCount, consumed_item_count);
+}
+
+// Stops a pipeline whose stages would otherwise run forever from the outside.
+TEST(FramePipeline, CloseQueuesStopsStages) {
+  FramePipeline pipeline;
+  FramePipelineQueue<int>* numbers = pipeline.AddQueue<int>("numbers", 1);
+  
+  std::atomic<int> consumed_item_count(0);
+  pipeline.AddStage("producer", {numbers}, [&](FramePipelineStage* stage) {
+    while (stage->Push(numbers, 1)) {}
+  });
+  pipeline.AddStage("consumer", {numbers}, [&](FramePipelineStage* stage) {
+    int number;
+    while (stage->Pop(numbers, &number)) {
+      ++ consumed_item_count;
+    }
+  });
+  pipeline.Start();
+  while (consumed_item_count < 100) {
+    std::this_thread::yield();
+  }
+  pipeline.CloseQueues();
+  pipeline.Wait();
+}
+
+// Returns buffers from the consumer to the producer through a second queue,
+// such that only a fixed number of buffers is ever in use, and checks that
+// their contents are not overwritten while they are being consumed.
+TEST(FramePipeline, RecyclesBuffersThroughBackwardQueue) {
+  constexpr int kItemCount = 500;
+  constexpr int kBufferCount = 2;
+  constexpr int kBufferSize = 64;
+  
+  FramePipeline pipeline;
+  FramePipelineQueue<vector<int>*>* filled_buffers = pipeline.AddQueue<vector<int>*>("filled_buffers", kBufferCount);
+  FramePipelineQueue<vector<int>*>* free_buffers = pipeline.AddQueue<vector<int>*>("free_buffers", kBufferCount);
+  
+  vector<vector<int>> buffers(kBufferCount, vector<int>(kBufferSize));
+  for (vector<int>& buffer : buffers) {
+    vector<int>* buffer_pointer = &buffer;
+    ASSERT_TRUE(free_buffers->Push(std::move(buffer_pointer)));
+  }
+  
+  pipeline.AddStage("producer", {filled_buffers, free_buffers}, [&](FramePipelineStage* stage) {
+    vector<int>* buffer;
+    for (int i = 0; i < kItemCount; ++ i) {
+      if (!stage->Pop(free_buffers, &buffer)) {
+        return;
+      }
+      for (int& value : *buffer) {
+        value = i;
+      }
+      if (!stage->Push(filled_buffers, std::move(buffer))) {
+        return;
+      }
+    }
+  });
+  int consumed_item_count = 0;
+  pipeline.AddStage("consumer", {filled_buffers, free_buffers}, [&](FramePipelineStage* stage) {
+    vector<int>* buffer;
+    while (stage->Pop(filled_buffers, &buffer)) {
+      for (int value : *buffer) {
+        EXPECT_EQ(consumed_item_count, value);
+      }
+      ++ consumed_item_count;
+      // This fails after the producer returned, which does not matter.
+      stage->Push(free_buffers, std::move(buffer));
+    }
+  });
+  pipeline.Start();
+  pipeline.Wait();
+  
+  EXPECT_EQ(kItemCount, consumed_item_count);
+}
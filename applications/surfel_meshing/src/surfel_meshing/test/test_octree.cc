@@ -27,10 +27,15 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <algorithm>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <libvis/timing.h>
 
+#include "surfel_meshing/linear_octree.h"
 #include "surfel_meshing/octree.h"
+#include "surfel_meshing/top_k_collector.h"
 
 using namespace vis;
 
@@ -104,6 +109,85 @@ void VerifySurfels(OctreeNode* node, usize max_surfels_per_node, const Surfel* s
   }
 }
 
+usize CountNodes(const OctreeNode* node) {
+  if (!node) {
+    return 0;
+  }
+  usize count = 1;
+  for (int i = 0; i < 8; ++ i) {
+    count += CountNodes(node->children[i]);
+  }
+  return count;
+}
+
+// Runs the throughput benchmark of the LinearOctree.ThroughputBenchmark test
+// on the given octree. The surfels must not be added to the octree yet.
+// Returns the sum of all result counts.
+template <typename Octree>
+usize RunOctreeThroughputBenchmark(
+    Octree* octree,
+    vector<Surfel>* surfels,
+    int round_count,
+    usize moves_per_round,
+    usize queries_per_round,
+    usize interleaved_count,
+    float query_radius,
+    const vector<u32>& moved_surfels,
+    const vector<Vec3f>& move_offsets,
+    const vector<u32>& query_surfels,
+    const char* name) {
+  constexpr int kMaxResultCount = 64;
+  float result_distances_squared[kMaxResultCount];
+  u32 result_indices[kMaxResultCount];
+  usize result_count_sum = 0;
+  
+  Timer build_timer("");
+  for (usize i = 0; i < surfels->size(); ++ i) {
+    octree->AddSurfel(i, &surfels->at(i));
+  }
+  result_count_sum += octree->template FindNearestSurfelsWithinRadius<false, true>(
+      surfels->at(0).position(), query_radius * query_radius, kMaxResultCount,
+      result_distances_squared, result_indices);
+  double build_seconds = build_timer.Stop(false);
+  
+  Timer rounds_timer("");
+  usize move_index = 0;
+  usize query_index = 0;
+  for (int round = 0; round < round_count; ++ round) {
+    for (usize i = 0; i < moves_per_round; ++ i, ++ move_index) {
+      u32 surfel_index = moved_surfels[move_index];
+      Surfel* surfel = &surfels->at(surfel_index);
+      Vec3f new_position = surfel->position() + move_offsets[move_index];
+      octree->MoveSurfel(surfel_index, surfel, new_position);
+      surfel->SetPosition(new_position);
+    }
+    for (usize i = 0; i < queries_per_round; ++ i, ++ query_index) {
+      result_count_sum += octree->template FindNearestSurfelsWithinRadius<false, true>(
+          surfels->at(query_surfels[query_index]).position(), query_radius * query_radius, kMaxResultCount,
+          result_distances_squared, result_indices);
+    }
+  }
+  double rounds_seconds = rounds_timer.Stop(false);
+  
+  Timer interleaved_timer("");
+  for (usize i = 0; i < interleaved_count; ++ i, ++ move_index, ++ query_index) {
+    u32 surfel_index = moved_surfels[move_index];
+    Surfel* surfel = &surfels->at(surfel_index);
+    Vec3f new_position = surfel->position() + move_offsets[move_index];
+    octree->MoveSurfel(surfel_index, surfel, new_position);
+    surfel->SetPosition(new_position);
+    result_count_sum += octree->template FindNearestSurfelsWithinRadius<false, true>(
+        surfels->at(query_surfels[query_index]).position(), query_radius * query_radius, kMaxResultCount,
+        result_distances_squared, result_indices);
+  }
+  double interleaved_seconds = interleaved_timer.Stop(false);
+  
+  LOG(INFO) << name << ": build: " << (surfels->size() / build_seconds) << " surfels/s"
+            << ", move + search rounds: " << ((round_count * (moves_per_round + queries_per_round)) / rounds_seconds) << " operations/s"
+            << ", interleaved: " << ((2 * interleaved_count) / interleaved_seconds) << " operations/s";
+  return result_count_sum;
+}
+
 struct SurfelSearchResult {
   u32 index;
   float distance_squared;
@@ -142,6 +226,38 @@ int FindNearestSurfelsWithinRadiusBruteForce(
   return result_count;
 }
 
+// Inserts the entry into the sorted result list, as done by the neighbor
+// search before TopKCollector was introduced. Used as reference.
+void InsertIntoSortedResults(
+    float distance_squared,
+    u32 index,
+    int max_result_count,
+    float* result_distances_squared,
+    u32* result_indices,
+    int* result_count,
+    float* max_distance_squared) {
+  if (distance_squared > *max_distance_squared) {
+    return;
+  }
+  if (*result_count < max_result_count) {
+    ++ *result_count;
+  }
+  int i;
+  for (i = *result_count - 1; i > 0; -- i) {
+    if (result_distances_squared[i - 1] > distance_squared) {
+      result_distances_squared[i] = result_distances_squared[i - 1];
+      result_indices[i] = result_indices[i - 1];
+    } else {
+      break;
+    }
+  }
+  result_distances_squared[i] = distance_squared;
+  result_indices[i] = index;
+  if (*result_count == max_result_count) {
+    *max_distance_squared = result_distances_squared[max_result_count - 1];
+  }
+}
+
 // TODO: Needs triangles stored in the octree to work
 // void PerformTriangleBoxQueries(CompressedOctree<true>* octree, usize query_count, vector<Surfel>* surfels, vector<SurfelTriangle>* triangles) {
 //   vector<u32> result_indices_test;
@@ -425,6 +541,27 @@ TEST(CompressedOctree, FindNearestSurfelsWithinRadiusPassive) {
           EXPECT_EQ(result_indices_expected[i], result_indices_test[i]);
         }
       }
+      
+      // Without sorting, the same results must be returned in any order.
+      result_count_test = octree.FindNearestSurfelsWithinRadiusPassive<true, true>(
+          surfels[query_index].position(),
+          kQueryRadius * kQueryRadius,
+          kMaxResultCount,
+          result_distances_squared_test,
+          result_indices_test,
+          /*sort_results*/ false);
+      EXPECT_EQ(result_count_expected, result_count_test);
+      if (result_count_expected == result_count_test) {
+        vector<pair<float, u32>> unsorted_results(result_count_test);
+        for (int i = 0; i < result_count_test; ++ i) {
+          unsorted_results[i] = make_pair(result_distances_squared_test[i], result_indices_test[i]);
+        }
+        std::sort(unsorted_results.begin(), unsorted_results.end());
+        for (int i = 0; i < result_count_test; ++ i) {
+          EXPECT_EQ(result_distances_squared_expected[i], unsorted_results[i].first);
+          EXPECT_EQ(result_indices_expected[i], unsorted_results[i].second);
+        }
+      }
     }
   }
 }
@@ -494,6 +631,441 @@ TEST(CompressedOctree, FindNearestSurfelsWithinRadius) {
   }
 }
 
+namespace {
+// Generates surfel_count random surfels with random meshing states and
+// mirrors them in surfel_arrays.
+void CreateRandomSurfels(usize surfel_count, vector<Surfel>* surfels, SurfelArrays* surfel_arrays) {
+  surfels->reserve(surfel_count);
+  surfel_arrays->reserve(surfel_count);
+  for (usize surfel_index = 0; surfel_index < surfel_count; ++ surfel_index) {
+    surfels->push_back(Surfel(
+        Vec3f::Random(),
+        /*radius_squared*/ 1.0f,
+        /*normal*/ Vec3f(1, 0, 0),
+        0));
+    surfels->back().SetMeshingState(static_cast<Surfel::MeshingState>(rand() % 3));
+    surfel_arrays->PushBack(surfels->back());
+  }
+}
+}  // namespace
+
+// Compares the neighbor search on the Surfel objects to the search on
+// SurfelArrays.
+TEST(CompressedOctree, SurfelArraysSearch) {
+  constexpr usize kSurfelCount = 300000;
+  constexpr usize kQueryCount = 1000;
+  constexpr usize kMaxSurfelsPerNode = 50;
+  constexpr float kQueryRadius = 0.05f;
+  constexpr int kMaxResultCount = 64;
+  
+  float result_distances_squared_objects[kMaxResultCount];
+  u32 result_indices_objects[kMaxResultCount];
+  
+  float result_distances_squared_arrays[kMaxResultCount];
+  u32 result_indices_arrays[kMaxResultCount];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  SurfelArrays surfel_arrays;
+  CreateRandomSurfels(kSurfelCount, &surfels, &surfel_arrays);
+  
+  // Add the surfels to two octrees, which will therefore have the same structure.
+  CompressedOctree octree_objects(kMaxSurfelsPerNode, &surfels, nullptr);
+  CompressedOctree octree_arrays(kMaxSurfelsPerNode, &surfels, nullptr, &surfel_arrays);
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    octree_objects.AddSurfel(i, &surfels[i]);
+    octree_arrays.AddSurfel(i, &surfels[i]);
+  }
+  octree_objects.SortAllSurfelsDownwards();
+  octree_arrays.SortAllSurfelsDownwards();
+  
+  for (usize query_index = 0; query_index < kQueryCount; ++ query_index) {
+    Vec3f query = surfels[rand() % kSurfelCount].position();
+    int result_count_objects = octree_objects.FindNearestSurfelsWithinRadiusPassive<false, true>(
+        query, kQueryRadius * kQueryRadius, kMaxResultCount,
+        result_distances_squared_objects, result_indices_objects);
+    int result_count_arrays = octree_arrays.FindNearestSurfelsWithinRadiusPassive<false, true>(
+        query, kQueryRadius * kQueryRadius, kMaxResultCount,
+        result_distances_squared_arrays, result_indices_arrays);
+    
+    EXPECT_EQ(result_count_objects, result_count_arrays);
+    if (result_count_objects == result_count_arrays) {
+      for (int i = 0; i < result_count_arrays; ++ i) {
+        EXPECT_FLOAT_EQ(result_distances_squared_objects[i], result_distances_squared_arrays[i]);
+        EXPECT_EQ(result_indices_objects[i], result_indices_arrays[i]);
+      }
+    }
+  }
+}
+
+// Benchmarks the neighbor search on the Surfel objects and on SurfelArrays.
+TEST(CompressedOctree, DISABLED_SurfelArraysSearchBenchmark) {
+  constexpr usize kSurfelCount = 300000;
+  constexpr usize kQueryCount = 100000;
+  constexpr usize kMaxSurfelsPerNode = 50;
+  constexpr float kQueryRadius = 0.05f;
+  constexpr int kMaxResultCount = 64;
+  
+  float result_distances_squared[kMaxResultCount];
+  u32 result_indices[kMaxResultCount];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  SurfelArrays surfel_arrays;
+  CreateRandomSurfels(kSurfelCount, &surfels, &surfel_arrays);
+  
+  CompressedOctree octree_objects(kMaxSurfelsPerNode, &surfels, nullptr);
+  CompressedOctree octree_arrays(kMaxSurfelsPerNode, &surfels, nullptr, &surfel_arrays);
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    octree_objects.AddSurfel(i, &surfels[i]);
+    octree_arrays.AddSurfel(i, &surfels[i]);
+  }
+  octree_objects.SortAllSurfelsDownwards();
+  octree_arrays.SortAllSurfelsDownwards();
+  
+  vector<Vec3f> queries(kQueryCount);
+  for (usize query_index = 0; query_index < kQueryCount; ++ query_index) {
+    queries[query_index] = surfels[rand() % kSurfelCount].position();
+  }
+  
+  // The result counts are only accumulated to make sure that the searches are
+  // not optimized away. They may differ slightly due to rounding differences
+  // for surfels at the border of the search radius.
+  usize objects_result_count = 0;
+  Timer objects_timer("Search on Surfel objects");
+  for (const Vec3f& query : queries) {
+    objects_result_count += octree_objects.FindNearestSurfelsWithinRadiusPassive<false, true>(
+        query, kQueryRadius * kQueryRadius, kMaxResultCount,
+        result_distances_squared, result_indices);
+  }
+  double objects_seconds = objects_timer.Stop(false);
+  
+  usize arrays_result_count = 0;
+  Timer arrays_timer("Search on SurfelArrays");
+  for (const Vec3f& query : queries) {
+    arrays_result_count += octree_arrays.FindNearestSurfelsWithinRadiusPassive<false, true>(
+        query, kQueryRadius * kQueryRadius, kMaxResultCount,
+        result_distances_squared, result_indices);
+  }
+  double arrays_seconds = arrays_timer.Stop(false);
+  
+  LOG(INFO) << kQueryCount << " searches on Surfel objects: " << (1000 * objects_seconds)
+            << " ms (" << objects_result_count << " results), on SurfelArrays: "
+            << (1000 * arrays_seconds) << " ms (" << arrays_result_count << " results)";
+}
+
+// Compares the batched search to individual passive searches.
+TEST(CompressedOctree, FindNearestSurfelsWithinRadiusBatch) {
+  constexpr usize kSurfelCount = 300000;
+  constexpr usize kQueryCount = 20000;
+  constexpr usize kMaxSurfelsPerNode = 50;
+  constexpr int kMaxResultCount = 64;
+  constexpr int kThreadCount = 4;
+  
+  float result_distances_squared_single[kMaxResultCount];
+  u32 result_indices_single[kMaxResultCount];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  SurfelArrays surfel_arrays;
+  CreateRandomSurfels(kSurfelCount, &surfels, &surfel_arrays);
+  
+  // Add most surfels actively, and the rest lazily such that they remain in
+  // the root node. This also tests that surfels in ancestors of the subtree
+  // in which a batch group is searched are found.
+  CompressedOctree octree(kMaxSurfelsPerNode, &surfels, nullptr, &surfel_arrays);
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    if (i % 1000 == 0) {
+      octree.AddSurfel(i, &surfels[i]);
+    } else {
+      octree.AddSurfelActive(i, &surfels[i]);
+    }
+  }
+  
+  vector<Vec3f> queries(kQueryCount);
+  vector<float> radii_squared(kQueryCount);
+  for (usize query_index = 0; query_index < kQueryCount; ++ query_index) {
+    queries[query_index] = surfels[rand() % kSurfelCount].position();
+    float radius = 0.01f + 0.04f * (rand() / static_cast<float>(RAND_MAX));
+    radii_squared[query_index] = radius * radius;
+  }
+  
+  vector<int> result_counts(kQueryCount);
+  vector<float> result_distances_squared(kQueryCount * kMaxResultCount);
+  vector<u32> result_indices(kQueryCount * kMaxResultCount);
+  
+  for (int thread_count : {1, kThreadCount}) {
+    octree.FindNearestSurfelsWithinRadiusBatch<false, true>(
+        kQueryCount, queries.data(), radii_squared.data(), kMaxResultCount,
+        result_counts.data(), result_distances_squared.data(),
+        result_indices.data(), thread_count);
+    
+    for (usize query_index = 0; query_index < kQueryCount; query_index += 7) {
+      int result_count_single = octree.FindNearestSurfelsWithinRadiusPassive<false, true>(
+          queries[query_index], radii_squared[query_index], kMaxResultCount,
+          result_distances_squared_single, result_indices_single);
+      
+      ASSERT_EQ(result_count_single, result_counts[query_index]);
+      for (int i = 0; i < result_count_single; ++ i) {
+        EXPECT_EQ(result_distances_squared_single[i], result_distances_squared[query_index * kMaxResultCount + i]);
+        EXPECT_EQ(result_indices_single[i], result_indices[query_index * kMaxResultCount + i]);
+      }
+    }
+  }
+}
+
+// Benchmarks the batched search against individual passive searches.
+TEST(CompressedOctree, DISABLED_FindNearestSurfelsWithinRadiusBatchBenchmark) {
+  constexpr usize kSurfelCount = 300000;
+  constexpr usize kQueryCount = 100000;
+  constexpr usize kMaxSurfelsPerNode = 50;
+  constexpr int kMaxResultCount = 64;
+  constexpr int kThreadCount = 4;
+  
+  float result_distances_squared_single[kMaxResultCount];
+  u32 result_indices_single[kMaxResultCount];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  SurfelArrays surfel_arrays;
+  CreateRandomSurfels(kSurfelCount, &surfels, &surfel_arrays);
+  
+  CompressedOctree octree(kMaxSurfelsPerNode, &surfels, nullptr, &surfel_arrays);
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    octree.AddSurfelActive(i, &surfels[i]);
+  }
+  octree.SortAllSurfelsDownwards();
+  
+  vector<Vec3f> queries(kQueryCount);
+  vector<float> radii_squared(kQueryCount);
+  for (usize query_index = 0; query_index < kQueryCount; ++ query_index) {
+    queries[query_index] = surfels[rand() % kSurfelCount].position();
+    float radius = 0.01f + 0.04f * (rand() / static_cast<float>(RAND_MAX));
+    radii_squared[query_index] = radius * radius;
+  }
+  
+  vector<int> result_counts(kQueryCount);
+  vector<float> result_distances_squared(kQueryCount * kMaxResultCount);
+  vector<u32> result_indices(kQueryCount * kMaxResultCount);
+  
+  usize single_result_count = 0;
+  Timer single_timer("Single searches");
+  for (usize query_index = 0; query_index < kQueryCount; ++ query_index) {
+    single_result_count += octree.FindNearestSurfelsWithinRadiusPassive<false, true>(
+        queries[query_index], radii_squared[query_index], kMaxResultCount,
+        result_distances_squared_single, result_indices_single);
+  }
+  double single_seconds = single_timer.Stop(false);
+  
+  for (int thread_count : {1, kThreadCount}) {
+    Timer batch_timer("Batch search");
+    octree.FindNearestSurfelsWithinRadiusBatch<false, true>(
+        kQueryCount, queries.data(), radii_squared.data(), kMaxResultCount,
+        result_counts.data(), result_distances_squared.data(),
+        result_indices.data(), thread_count);
+    double batch_seconds = batch_timer.Stop(false);
+    
+    usize batch_result_count = 0;
+    for (int count : result_counts) {
+      batch_result_count += count;
+    }
+    EXPECT_EQ(single_result_count, batch_result_count);
+    
+    LOG(INFO) << kQueryCount << " searches: single: " << (1000 * single_seconds)
+              << " ms, batch with " << thread_count << " thread(s): "
+              << (1000 * batch_seconds) << " ms";
+  }
+}
+
+// Benchmarks the leaf scan in the neighbor search for different maximum
+// surfel counts per node, on Surfel objects (scalar) and on SurfelArrays
+// (vectorized if enabled at compile time).
+TEST(CompressedOctree, DISABLED_LeafScanBenchmark) {
+  constexpr usize kSurfelCount = 300000;
+  constexpr usize kQueryCount = 100000;
+  constexpr float kQueryRadius = 0.05f;
+  constexpr int kMaxResultCount = 64;
+  
+  float result_distances_squared[kMaxResultCount];
+  u32 result_indices[kMaxResultCount];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  SurfelArrays surfel_arrays;
+  CreateRandomSurfels(kSurfelCount, &surfels, &surfel_arrays);
+  
+  vector<Vec3f> queries(kQueryCount);
+  for (usize query_index = 0; query_index < kQueryCount; ++ query_index) {
+    queries[query_index] = surfels[rand() % kSurfelCount].position();
+  }
+  
+  for (usize max_surfels_per_node : {10, 25, 50, 75, 100}) {
+    CompressedOctree octree_objects(max_surfels_per_node, &surfels, nullptr);
+    CompressedOctree octree_arrays(max_surfels_per_node, &surfels, nullptr, &surfel_arrays);
+    for (usize i = 0; i < surfels.size(); ++ i) {
+      octree_objects.AddSurfel(i, &surfels[i]);
+      octree_arrays.AddSurfel(i, &surfels[i]);
+    }
+    octree_objects.SortAllSurfelsDownwards();
+    octree_arrays.SortAllSurfelsDownwards();
+    
+    usize objects_result_count = 0;
+    Timer objects_timer("Leaf scan on Surfel objects");
+    for (const Vec3f& query : queries) {
+      objects_result_count += octree_objects.FindNearestSurfelsWithinRadiusPassive<false, true>(
+          query, kQueryRadius * kQueryRadius, kMaxResultCount,
+          result_distances_squared, result_indices);
+    }
+    double objects_seconds = objects_timer.Stop(false);
+    
+    usize arrays_result_count = 0;
+    Timer arrays_timer("Leaf scan on SurfelArrays");
+    for (const Vec3f& query : queries) {
+      arrays_result_count += octree_arrays.FindNearestSurfelsWithinRadiusPassive<false, true>(
+          query, kQueryRadius * kQueryRadius, kMaxResultCount,
+          result_distances_squared, result_indices);
+    }
+    double arrays_seconds = arrays_timer.Stop(false);
+    
+    LOG(INFO) << "max_surfels_per_node " << max_surfels_per_node << ": "
+              << kQueryCount << " searches on Surfel objects: " << (1000 * objects_seconds)
+              << " ms (" << objects_result_count << " results), on SurfelArrays: "
+              << (1000 * arrays_seconds) << " ms (" << arrays_result_count << " results)";
+  }
+}
+
+namespace {
+// Creates candidate streams for the TopKCollector tests: query_count streams
+// with four times as many candidates as k, of which about three quarters are
+// within the search radius (1).
+vector<float> CreateCollectorCandidates(int query_count, int k) {
+  vector<float> candidates(query_count * 4 * k);
+  for (float& candidate : candidates) {
+    candidate = 1.33f * (rand() / static_cast<float>(RAND_MAX));
+  }
+  return candidates;
+}
+}  // namespace
+
+// Compares TopKCollector in both modes to the sorted insertion which the
+// neighbor searches used before.
+TEST(TopKCollector, CompareToSortedInsertion) {
+  constexpr int kQueryCount = 1000;
+  constexpr int kMaxK = 64;
+  
+  float distances_expected[kMaxK];
+  u32 indices_expected[kMaxK];
+  float distances_test[kMaxK];
+  u32 indices_test[kMaxK];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  for (int k : {1, 16, 32, 64}) {
+    int candidate_count = 4 * k;
+    vector<float> candidates = CreateCollectorCandidates(kQueryCount, k);
+    
+    for (int query = 0; query < kQueryCount; ++ query) {
+      const float* query_candidates = &candidates[query * candidate_count];
+      int result_count_expected = 0;
+      float max_distance_squared = 1;
+      for (int i = 0; i < candidate_count; ++ i) {
+        InsertIntoSortedResults(query_candidates[i], i, k, distances_expected, indices_expected, &result_count_expected, &max_distance_squared);
+      }
+      
+      for (bool keep_sorted : {false, true}) {
+        TopKCollector<float, u32> collector(k, 1, distances_test, indices_test, keep_sorted);
+        for (int i = 0; i < candidate_count; ++ i) {
+          collector.Insert(query_candidates[i], i);
+        }
+        collector.Sort();
+        
+        ASSERT_EQ(result_count_expected, collector.size());
+        for (int i = 0; i < result_count_expected; ++ i) {
+          EXPECT_EQ(distances_expected[i], distances_test[i]);
+          EXPECT_EQ(indices_expected[i], indices_test[i]);
+        }
+      }
+    }
+  }
+}
+
+// Benchmarks TopKCollector in both modes against the sorted insertion which
+// the neighbor searches used before.
+TEST(TopKCollector, DISABLED_Benchmark) {
+  constexpr int kQueryCount = 100000;
+  constexpr int kMaxK = 64;
+  
+  float distances[kMaxK];
+  u32 indices[kMaxK];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  for (int k : {16, 32, 64}) {
+    int candidate_count = 4 * k;
+    vector<float> candidates = CreateCollectorCandidates(kQueryCount, k);
+    
+    // The checksums only ensure that the work is not optimized away.
+    u32 checksum_expected = 0;
+    Timer sorted_insertion_timer("Sorted insertion");
+    for (int query = 0; query < kQueryCount; ++ query) {
+      const float* query_candidates = &candidates[query * candidate_count];
+      int result_count = 0;
+      float max_distance_squared = 1;
+      for (int i = 0; i < candidate_count; ++ i) {
+        InsertIntoSortedResults(query_candidates[i], i, k, distances, indices, &result_count, &max_distance_squared);
+      }
+      checksum_expected += indices[0];
+    }
+    double sorted_insertion_seconds = sorted_insertion_timer.Stop(false);
+    
+    // Runs the collector on all queries, optionally calling Sort() at the end.
+    auto run_collector = [&](bool keep_sorted, bool sort, u32* checksum) {
+      *checksum = 0;
+      Timer timer("TopKCollector");
+      for (int query = 0; query < kQueryCount; ++ query) {
+        const float* query_candidates = &candidates[query * candidate_count];
+        TopKCollector<float, u32> collector(k, 1, distances, indices, keep_sorted);
+        for (int i = 0; i < candidate_count; ++ i) {
+          collector.Insert(query_candidates[i], i);
+        }
+        if (sort) {
+          collector.Sort();
+          *checksum += indices[0];
+        } else {
+          *checksum += collector.size();
+        }
+      }
+      return timer.Stop(false);
+    };
+    
+    u32 checksum_test;
+    double sorted_seconds = run_collector(/*keep_sorted*/ true, /*sort*/ true, &checksum_test);
+    EXPECT_EQ(checksum_expected, checksum_test);
+    double heap_sort_seconds = run_collector(/*keep_sorted*/ false, /*sort*/ true, &checksum_test);
+    EXPECT_EQ(checksum_expected, checksum_test);
+    double heap_seconds = run_collector(/*keep_sorted*/ false, /*sort*/ false, &checksum_test);
+    EXPECT_EQ(static_cast<u32>(kQueryCount * k), checksum_test);
+    
+    LOG(INFO) << "k = " << k << ", " << candidate_count << " candidates, " << kQueryCount
+              << " queries: sorted insertion: " << (1000 * sorted_insertion_seconds)
+              << " ms, TopKCollector sorted: " << (1000 * sorted_seconds)
+              << " ms, heap + Sort(): " << (1000 * heap_sort_seconds)
+              << " ms, heap unsorted: " << (1000 * heap_seconds) << " ms";
+  }
+}
+
 // Tests removing all surfels.
 TEST(CompressedOctree, RemoveAllSurfels) {
   constexpr usize kTestCount = 100;
@@ -717,6 +1289,237 @@ TEST(CompressedOctree, AddActiveAndMove) {
   }
 }
 
+// Checks the node pool statistics while the octree churns nodes, and that
+// the memory of deleted nodes gets re-used.
+TEST(CompressedOctree, NodePool) {
+  constexpr int kPointCount = 100000;
+  constexpr int kMoveCount = 300000;
+  constexpr usize kMaxSurfelsPerNode = 15;
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  CompressedOctree octree(kMaxSurfelsPerNode, &surfels, nullptr);
+  const OctreeNodePool& pool = octree.node_pool();
+  EXPECT_EQ(0u, pool.live_node_count());
+  EXPECT_EQ(0u, pool.allocated_bytes());
+  
+  surfels.reserve(kPointCount);
+  for (usize i = 0; i < kPointCount; ++ i) {
+    surfels.push_back(Surfel(
+        10.0f * Vec3f::Random(),
+        /*radius_squared*/ 1.0f,
+        /*normal*/ Vec3f(1, 0, 0),
+        0));
+    octree.AddSurfelActive(surfels.size() - 1, &surfels.back());
+  }
+  EXPECT_EQ(CountNodes(octree.root()), pool.live_node_count());
+  EXPECT_EQ(pool.live_node_count(), pool.peak_node_count());
+  EXPECT_GE(pool.allocated_bytes(), pool.live_node_count() * sizeof(OctreeNode));
+  
+  // Move surfels around. Use large steps such that nodes get deleted and
+  // created frequently.
+  Timer move_timer("");
+  for (usize i = 0; i < kMoveCount; ++ i) {
+    usize k = rand() % surfels.size();
+    Surfel* surfel = &surfels[k];
+    Vec3f new_position = surfel->position() + 0.5f * Vec3f::Random();
+    octree.MoveSurfel(k, surfel, new_position);
+    surfel->SetPosition(new_position);
+    if (i % 10 == 0) {
+      octree.FindNearestSurfelsWithinRadius<true, true>(new_position, 0.01f, 0, nullptr, nullptr);
+    }
+  }
+  double move_seconds = move_timer.Stop(false);
+  EXPECT_EQ(CountNodes(octree.root()), pool.live_node_count());
+  EXPECT_GE(pool.peak_node_count(), pool.live_node_count());
+  LOG(INFO) << "Node pool: live nodes: " << pool.live_node_count()
+            << ", peak nodes: " << pool.peak_node_count()
+            << ", bytes: " << pool.allocated_bytes()
+            << ", time for " << kMoveCount << " moves: " << (1000 * move_seconds) << " ms";
+  
+  // Remove all surfels. This must return all nodes to the pool without
+  // releasing its memory.
+  usize allocated_bytes = pool.allocated_bytes();
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    octree.RemoveSurfel(i);
+  }
+  ASSERT_EQ(nullptr, octree.root());
+  EXPECT_EQ(0u, pool.live_node_count());
+  EXPECT_EQ(allocated_bytes, pool.allocated_bytes());
+  
+  // Adding the surfels again must re-use the nodes.
+  for (usize i = 0; i < surfels.size(); ++ i) {
+    octree.AddSurfelActive(i, &surfels[i]);
+  }
+  EXPECT_EQ(CountNodes(octree.root()), pool.live_node_count());
+  EXPECT_EQ(allocated_bytes, pool.allocated_bytes());
+}
+
+// A/B test of LinearOctree against CompressedOctree: applies the same random
+// sequence of additions, removals, moves and searches to both and compares
+// the search results.
+TEST(LinearOctree, CompareToCompressedOctree) {
+  constexpr int kOperationCount = 60000;
+  constexpr usize kMaxSurfelsPerNode = 15;
+  constexpr int kMaxResultCount = 16;
+  
+  float result_distances_squared_expected[kMaxResultCount];
+  u32 result_indices_expected[kMaxResultCount];
+  
+  float result_distances_squared_test[kMaxResultCount];
+  u32 result_indices_test[kMaxResultCount];
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> surfels;
+  surfels.reserve(kOperationCount);
+  vector<u32> alive_surfels;
+  CompressedOctree compressed_octree(kMaxSurfelsPerNode, &surfels, nullptr);
+  // Use a small cell extent to also test the grid extension.
+  LinearOctree linear_octree(kMaxSurfelsPerNode, &surfels, nullptr, /*finest_cell_extent*/ 1e-6f);
+  
+  for (int operation_index = 0; operation_index < kOperationCount; ++ operation_index) {
+    int operation = rand() % 16;
+    
+    if (alive_surfels.size() < 100 || operation < 6) {
+      // Add a surfel. The scene extent grows over time.
+      float scene_extent = 1.0f + 20.0f * operation_index / kOperationCount;
+      surfels.push_back(Surfel(
+          scene_extent * Vec3f::Random(),
+          /*radius_squared*/ 1.0f,
+          /*normal*/ Vec3f(1, 0, 0),
+          0));
+      surfels.back().SetMeshingState(static_cast<Surfel::MeshingState>(rand() % 3));
+      u32 surfel_index = surfels.size() - 1;
+      compressed_octree.AddSurfel(surfel_index, &surfels.back());
+      linear_octree.AddSurfel(surfel_index, &surfels.back());
+      alive_surfels.push_back(surfel_index);
+    } else if (operation < 8) {
+      // Remove a surfel.
+      usize alive_index = rand() % alive_surfels.size();
+      u32 surfel_index = alive_surfels[alive_index];
+      compressed_octree.RemoveSurfel(surfel_index);
+      linear_octree.RemoveSurfel(surfel_index);
+      alive_surfels[alive_index] = alive_surfels.back();
+      alive_surfels.pop_back();
+    } else if (operation < 12) {
+      // Move a surfel, either slightly or far.
+      u32 surfel_index = alive_surfels[rand() % alive_surfels.size()];
+      Surfel* surfel = &surfels[surfel_index];
+      Vec3f new_position = surfel->position() + ((operation < 11) ? 0.01f : 2.0f) * Vec3f::Random();
+      compressed_octree.MoveSurfel(surfel_index, surfel, new_position);
+      linear_octree.MoveSurfel(surfel_index, surfel, new_position);
+      surfel->SetPosition(new_position);
+    } else {
+      // Search.
+      Vec3f query = surfels[alive_surfels[rand() % alive_surfels.size()]].position() + 0.1f * Vec3f::Random();
+      float radius_squared = 0.5f * (rand() / static_cast<float>(RAND_MAX));
+      bool include_completed = operation < 14;
+      
+      int result_count_expected = include_completed ?
+          compressed_octree.FindNearestSurfelsWithinRadius<true, false>(
+              query, radius_squared, kMaxResultCount,
+              result_distances_squared_expected, result_indices_expected) :
+          compressed_octree.FindNearestSurfelsWithinRadius<false, true>(
+              query, radius_squared, kMaxResultCount,
+              result_distances_squared_expected, result_indices_expected);
+      int result_count_test = include_completed ?
+          linear_octree.FindNearestSurfelsWithinRadius<true, false>(
+              query, radius_squared, kMaxResultCount,
+              result_distances_squared_test, result_indices_test) :
+          linear_octree.FindNearestSurfelsWithinRadius<false, true>(
+              query, radius_squared, kMaxResultCount,
+              result_distances_squared_test, result_indices_test);
+      
+      // The order of results with equal distances is unspecified, so only
+      // the distances are compared.
+      ASSERT_EQ(result_count_expected, result_count_test) << "Operation " << operation_index;
+      for (int i = 0; i < result_count_test; ++ i) {
+        EXPECT_EQ(result_distances_squared_expected[i], result_distances_squared_test[i]);
+      }
+    }
+    
+    EXPECT_EQ(alive_surfels.size(), linear_octree.surfel_count());
+  }
+  
+  // The passive search must give the same results after merging.
+  linear_octree.MergePendingSurfels();
+  EXPECT_EQ(0u, linear_octree.pending_surfel_count());
+  EXPECT_TRUE(std::is_sorted(linear_octree.keys().begin(), linear_octree.keys().end()));
+  EXPECT_GT(linear_octree.finest_cell_extent(), 1e-6f);
+  for (int query_index = 0; query_index < 1000; ++ query_index) {
+    Vec3f query = surfels[alive_surfels[rand() % alive_surfels.size()]].position();
+    int result_count_expected = compressed_octree.FindNearestSurfelsWithinRadius<true, true>(
+        query, 0.1f, kMaxResultCount,
+        result_distances_squared_expected, result_indices_expected);
+    int result_count_test = linear_octree.FindNearestSurfelsWithinRadiusPassive<true, true>(
+        query, 0.1f, kMaxResultCount,
+        result_distances_squared_test, result_indices_test);
+    ASSERT_EQ(result_count_expected, result_count_test);
+    for (int i = 0; i < result_count_test; ++ i) {
+      EXPECT_EQ(result_distances_squared_expected[i], result_distances_squared_test[i]);
+    }
+  }
+}
+
+// Throughput benchmark of LinearOctree versus CompressedOctree for building
+// the octree, for rounds of moving a fraction of the surfels followed by
+// neighbor searches (as done by the surfel meshing per frame), and for
+// interleaved single moves and searches.
+TEST(LinearOctree, DISABLED_ThroughputBenchmark) {
+  constexpr usize kSurfelCount = 300000;
+  constexpr usize kMaxSurfelsPerNode = 50;
+  constexpr int kRoundCount = 5;
+  constexpr usize kMovesPerRound = kSurfelCount / 10;
+  constexpr usize kQueriesPerRound = 50000;
+  constexpr usize kInterleavedCount = 20000;
+  constexpr float kQueryRadius = 0.02f;
+  
+  // Start with a consistent state for the random number generator.
+  srand(0);
+  
+  vector<Surfel> initial_surfels;
+  initial_surfels.reserve(kSurfelCount);
+  for (usize surfel_index = 0; surfel_index < kSurfelCount; ++ surfel_index) {
+    initial_surfels.push_back(Surfel(
+        Vec3f::Random(),
+        /*radius_squared*/ 1.0f,
+        /*normal*/ Vec3f(1, 0, 0),
+        0));
+    initial_surfels.back().SetMeshingState(static_cast<Surfel::MeshingState>(rand() % 3));
+  }
+  vector<u32> moved_surfels(kRoundCount * kMovesPerRound + kInterleavedCount);
+  vector<Vec3f> move_offsets(moved_surfels.size());
+  for (usize i = 0; i < moved_surfels.size(); ++ i) {
+    moved_surfels[i] = rand() % kSurfelCount;
+    move_offsets[i] = 0.005f * Vec3f::Random();
+  }
+  vector<u32> query_surfels(kRoundCount * kQueriesPerRound + kInterleavedCount);
+  for (usize i = 0; i < query_surfels.size(); ++ i) {
+    query_surfels[i] = rand() % kSurfelCount;
+  }
+  
+  
+  vector<Surfel> compressed_surfels = initial_surfels;
+  CompressedOctree compressed_octree(kMaxSurfelsPerNode, &compressed_surfels, nullptr);
+  usize compressed_result_count = RunOctreeThroughputBenchmark(
+      &compressed_octree, &compressed_surfels, kRoundCount, kMovesPerRound,
+      kQueriesPerRound, kInterleavedCount, kQueryRadius, moved_surfels,
+      move_offsets, query_surfels, "CompressedOctree");
+  
+  vector<Surfel> linear_surfels = initial_surfels;
+  LinearOctree linear_octree(kMaxSurfelsPerNode, &linear_surfels, nullptr);
+  usize linear_result_count = RunOctreeThroughputBenchmark(
+      &linear_octree, &linear_surfels, kRoundCount, kMovesPerRound,
+      kQueriesPerRound, kInterleavedCount, kQueryRadius, moved_surfels,
+      move_offsets, query_surfels, "LinearOctree");
+  
+  EXPECT_EQ(compressed_result_count, linear_result_count);
+}
+
 // TODO: This test only works if triangles are stored in the octree.
 // TEST(CompressedOctree, Triangles) {
 //   constexpr usize kTestCount = 100;
@@ -0,0 +1,245 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "surfel_meshing/cuda_surfels_cpu.h"
+#include "surfel_meshing/surfel_recording.h"
+
+using namespace vis;
+
+namespace {
+
+// Copies the attributes of the first surfel_count surfels.
+void CopySurfels(const CUDASurfelBuffersCPU& source, usize surfel_count, CUDASurfelBuffersCPU* dest) {
+  memcpy(dest->surfel_x_buffer, source.surfel_x_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_y_buffer, source.surfel_y_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_z_buffer, source.surfel_z_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_radius_squared_buffer, source.surfel_radius_squared_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_normal_x_buffer, source.surfel_normal_x_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_normal_y_buffer, source.surfel_normal_y_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_normal_z_buffer, source.surfel_normal_z_buffer, surfel_count * sizeof(float));
+  memcpy(dest->surfel_last_update_stamp_buffer, source.surfel_last_update_stamp_buffer, surfel_count * sizeof(u32));
+}
+
+// Copies the attributes of the surfel with index from to the one with index to.
+void MoveSurfel(u32 from, u32 to, CUDASurfelBuffersCPU* surfels) {
+  surfels->surfel_x_buffer[to] = surfels->surfel_x_buffer[from];
+  surfels->surfel_y_buffer[to] = surfels->surfel_y_buffer[from];
+  surfels->surfel_z_buffer[to] = surfels->surfel_z_buffer[from];
+  surfels->surfel_radius_squared_buffer[to] = surfels->surfel_radius_squared_buffer[from];
+  surfels->surfel_normal_x_buffer[to] = surfels->surfel_normal_x_buffer[from];
+  surfels->surfel_normal_y_buffer[to] = surfels->surfel_normal_y_buffer[from];
+  surfels->surfel_normal_z_buffer[to] = surfels->surfel_normal_z_buffer[from];
+  surfels->surfel_last_update_stamp_buffer[to] = surfels->surfel_last_update_stamp_buffer[from];
+}
+
+// Expects that the first surfel_count surfels and the metadata of the two
+// buffers are equal.
+void ExpectBuffersEqual(const CUDASurfelBuffersCPU& expected, const CUDASurfelBuffersCPU& actual) {
+  ASSERT_EQ(expected.frame_index, actual.frame_index);
+  ASSERT_EQ(expected.surfel_count, actual.surfel_count);
+  ASSERT_EQ(expected.all_surfels_changed, actual.all_surfels_changed);
+  if (!expected.all_surfels_changed) {
+    ASSERT_EQ(expected.changed_surfel_indices, actual.changed_surfel_indices);
+  }
+  ASSERT_EQ(expected.surfel_moves.size(), actual.surfel_moves.size());
+  for (usize i = 0; i < expected.surfel_moves.size(); ++ i) {
+    ASSERT_EQ(expected.surfel_moves[i].from, actual.surfel_moves[i].from);
+    ASSERT_EQ(expected.surfel_moves[i].to, actual.surfel_moves[i].to);
+  }
+  for (usize i = 0; i < expected.surfel_count; ++ i) {
+    ASSERT_EQ(expected.surfel_x_buffer[i], actual.surfel_x_buffer[i]);
+    ASSERT_EQ(expected.surfel_y_buffer[i], actual.surfel_y_buffer[i]);
+    ASSERT_EQ(expected.surfel_z_buffer[i], actual.surfel_z_buffer[i]);
+    ASSERT_EQ(expected.surfel_radius_squared_buffer[i], actual.surfel_radius_squared_buffer[i]);
+    ASSERT_EQ(expected.surfel_normal_x_buffer[i], actual.surfel_normal_x_buffer[i]);
+    ASSERT_EQ(expected.surfel_normal_y_buffer[i], actual.surfel_normal_y_buffer[i]);
+    ASSERT_EQ(expected.surfel_normal_z_buffer[i], actual.surfel_normal_z_buffer[i]);
+    ASSERT_EQ(expected.surfel_last_update_stamp_buffer[i], actual.surfel_last_update_stamp_buffer[i]);
+  }
+}
+
+// Records a sequence of random surfel updates, transferred to a CUDASurfelsCPU
+// like by the surfel reconstruction, and checks that reading the recording
+// gives the same buffers as the meshing received during recording.
+void TestRoundTrip(SurfelRecordingEncoding encoding) {
+  constexpr usize kMaxSurfelCount = 5000;
+  constexpr int kSnapshotCount = 30;
+  const string path = (boost::filesystem::temp_directory_path() /
+                       boost::filesystem::unique_path("surfel_recording_test_%%%%%%%%")).string();
+  
+  std::mt19937 generator(0);
+  std::uniform_real_distribution<float> value_distribution(-1.f, 1.f);
+  
+  // The surfels of the simulated reconstruction.
+  CUDASurfelBuffersCPU surfels(kMaxSurfelCount);
+  usize surfel_count = 0;
+  usize max_surfel_count = 0;
+  usize move_count = 0;
+  
+  CUDASurfelsCPU recorded_buffers(kMaxSurfelCount);
+  vector<unique_ptr<CUDASurfelBuffersCPU>> received(kSnapshotCount);
+  SurfelRecordingWriter writer;
+  ASSERT_TRUE(writer.Open(path, encoding));
+  for (int snapshot = 0; snapshot < kSnapshotCount; ++ snapshot) {
+    // Sometimes compact the surfels like
+    // CPUSurfelReconstruction::CompactSurfels(), which does not list the moved
+    // surfels as changed.
+    vector<SurfelMove> moves;
+    if (snapshot % 3 == 1) {
+      u32 hole = 0;
+      while (moves.size() < 20) {
+        while (surfel_count > 0 && surfels.surfel_radius_squared_buffer[surfel_count - 1] < 0) {
+          -- surfel_count;
+        }
+        while (hole < surfel_count && surfels.surfel_radius_squared_buffer[hole] >= 0) {
+          ++ hole;
+        }
+        if (hole >= surfel_count) {
+          break;
+        }
+        -- surfel_count;
+        moves.emplace_back(surfel_count, hole);
+        MoveSurfel(surfel_count, hole, &surfels);
+      }
+      move_count += moves.size();
+    }
+    
+    // Change some existing surfels and add new ones.
+    vector<u32> changed_indices;
+    for (usize i = 0; i < surfel_count; ++ i) {
+      if (generator() % 10 == 0) {
+        surfels.surfel_x_buffer[i] += value_distribution(generator);
+        surfels.surfel_radius_squared_buffer[i] = (generator() % 5 == 0) ? -1 : 0.01f;
+        surfels.surfel_last_update_stamp_buffer[i] = snapshot;
+        changed_indices.push_back(i);
+      }
+    }
+    usize new_surfel_count = std::min(kMaxSurfelCount, surfel_count + generator() % 300);
+    for (usize i = surfel_count; i < new_surfel_count; ++ i) {
+      surfels.surfel_x_buffer[i] = value_distribution(generator);
+      surfels.surfel_y_buffer[i] = value_distribution(generator);
+      surfels.surfel_z_buffer[i] = value_distribution(generator);
+      surfels.surfel_radius_squared_buffer[i] = 0.01f;
+      surfels.surfel_normal_x_buffer[i] = value_distribution(generator);
+      surfels.surfel_normal_y_buffer[i] = value_distribution(generator);
+      surfels.surfel_normal_z_buffer[i] = value_distribution(generator);
+      surfels.surfel_last_update_stamp_buffer[i] = snapshot;
+      changed_indices.push_back(i);
+    }
+    surfel_count = new_surfel_count;
+    max_surfel_count = std::max(max_surfel_count, surfel_count);
+    
+    // Transfer them (sometimes twice before the meshing takes them, and
+    // sometimes without listing the changed surfels).
+    int transfer_count = (snapshot % 4 == 3) ? 2 : 1;
+    for (int transfer = 0; transfer < transfer_count; ++ transfer) {
+      CUDASurfelBuffersCPU* buffer = recorded_buffers.write_buffers();
+      buffer->frame_index = snapshot;
+      buffer->surfel_count = surfel_count;
+      CopySurfels(surfels, surfel_count, buffer);
+      if (snapshot % 5 != 2) {
+        recorded_buffers.SetChangedSurfels(changed_indices.data(), changed_indices.size());
+      }
+      if (transfer == 0) {
+        recorded_buffers.SetSurfelMoves(moves.data(), moves.size());
+      }
+      recorded_buffers.PublishWriteBuffers();
+    }
+    
+    ASSERT_TRUE(recorded_buffers.AcquireLatestBuffers());
+    ASSERT_TRUE(writer.WriteSnapshot(recorded_buffers.read_buffers()));
+    
+    // Remember what the meshing received.
+    received[snapshot].reset(new CUDASurfelBuffersCPU(kMaxSurfelCount));
+    const CUDASurfelBuffersCPU& read_buffers = recorded_buffers.read_buffers();
+    received[snapshot]->frame_index = read_buffers.frame_index;
+    received[snapshot]->surfel_count = read_buffers.surfel_count;
+    received[snapshot]->all_surfels_changed = read_buffers.all_surfels_changed;
+    received[snapshot]->changed_surfel_indices = read_buffers.changed_surfel_indices;
+    received[snapshot]->surfel_moves = read_buffers.surfel_moves;
+    CopySurfels(read_buffers, read_buffers.surfel_count, received[snapshot].get());
+  }
+  ASSERT_TRUE(writer.Close());
+  EXPECT_GT(move_count, 0u);
+  
+  // Read the recording twice to also test rewinding.
+  SurfelRecordingReader reader;
+  ASSERT_TRUE(reader.Open(path));
+  EXPECT_EQ(static_cast<u32>(kSnapshotCount), reader.snapshot_count());
+  EXPECT_EQ(max_surfel_count, reader.max_surfel_count());
+  for (int pass = 0; pass < 2; ++ pass) {
+    CUDASurfelsCPU replayed_buffers(reader.max_surfel_count());
+    SurfelRecordingSnapshotInfo info;
+    for (int snapshot = 0; snapshot < kSnapshotCount; ++ snapshot) {
+      ASSERT_TRUE(reader.ReadSnapshot(&replayed_buffers, &info));
+      ASSERT_TRUE(replayed_buffers.AcquireLatestBuffers());
+      EXPECT_EQ(static_cast<u32>(snapshot), info.frame_index);
+      ExpectBuffersEqual(*received[snapshot], replayed_buffers.read_buffers());
+    }
+    EXPECT_FALSE(reader.ReadSnapshot(&replayed_buffers, &info));
+    EXPECT_FALSE(reader.error());
+    ASSERT_TRUE(reader.Rewind());
+  }
+  
+  boost::filesystem::remove(path);
+}
+
+}
+
+TEST(SurfelRecording, RoundTripRaw) {
+  TestRoundTrip(SurfelRecordingEncoding::kRaw);
+}
+
+TEST(SurfelRecording, RoundTripZlib) {
+  TestRoundTrip(SurfelRecordingEncoding::kZlib);
+}
+
+TEST(SurfelRecording, RejectsInvalidFiles) {
+  SurfelRecordingReader reader;
+  EXPECT_FALSE(reader.Open("/nonexistent_directory/recording.smrec"));
+  
+  // A recording which was not closed has no snapshot count in its header.
+  const string path = (boost::filesystem::temp_directory_path() /
+                       boost::filesystem::unique_path("surfel_recording_test_%%%%%%%%")).string();
+  FILE* file = fopen(path.c_str(), "wb");
+  ASSERT_TRUE(file != nullptr);
+  fputs("not a surfel recording", file);
+  fclose(file);
+  EXPECT_FALSE(reader.Open(path));
+  boost::filesystem::remove(path);
+}
@@ -27,8 +27,13 @@
 // POSSIBILITY OF SUCH DAMAGE.
 
 
+#include <algorithm>
+#include <array>
+#include <thread>
+
 #include <glog/logging.h>
 #include <gtest/gtest.h>
+#include <libvis/timing.h>
 
 #include "surfel_meshing/surfel_meshing_render_window.h"
 #include "surfel_meshing/surfel_meshing.h"
@@ -75,7 +80,6 @@ TEST(Triangulation, CheckSurfelState) {
   
   srand(0);
   
-  input.LockWriteBuffers();
   b->frame_index = 1;
   b->surfel_count = kSurfelCount;
   for (usize i = 0; i < kSurfelCount; ++ i) {
@@ -91,9 +95,9 @@ TEST(Triangulation, CheckSurfelState) {
     b->surfel_normal_z_buffer[i] = surfel_normal.z();
     b->surfel_last_update_stamp_buffer[i] = 1;
   }
-  input.UnlockWriteBuffers();
+  input.PublishWriteBuffers();
   
-  input.WaitForLockAndSwapBuffers();
+  ASSERT_TRUE(input.AcquireLatestBuffers());
   reconstruction.IntegrateCUDABuffers(
       input.read_buffers().frame_index,
       input);
@@ -145,3 +149,891 @@ TEST(Triangulation, CheckSurfelState) {
     std::getchar();
   }
 }
+
+namespace {
+// Writes surfels on a slightly curved surface with a jittered grid layout to
+// the input's write buffers, publishes and acquires them.
+void CreateCurvedSurfaceSurfels(int grid_size, float surfel_spacing, CUDASurfelsCPU* input) {
+  const float surfel_radius = 1.5f * surfel_spacing;
+  CUDASurfelBuffersCPU* b = input->write_buffers();
+  
+  srand(0);
+  
+  b->frame_index = 1;
+  b->surfel_count = grid_size * grid_size;
+  for (int y = 0; y < grid_size; ++ y) {
+    for (int x = 0; x < grid_size; ++ x) {
+      usize i = x + grid_size * y;
+      Vec2f jitter = 0.3f * surfel_spacing * Vec2f::Random();
+      float u = surfel_spacing * x + jitter.x();
+      float v = surfel_spacing * y + jitter.y();
+      Vec3f surfel_position = Vec3f(0.1f * sinf(2 * u), u, v);
+      Vec3f surfel_normal = Vec3f(1, -0.2f * cosf(2 * u), 0).normalized();
+      
+      b->surfel_x_buffer[i] = surfel_position.x();
+      b->surfel_y_buffer[i] = surfel_position.y();
+      b->surfel_z_buffer[i] = surfel_position.z();
+      b->surfel_radius_squared_buffer[i] = surfel_radius * surfel_radius;
+      b->surfel_normal_x_buffer[i] = surfel_normal.x();
+      b->surfel_normal_y_buffer[i] = surfel_normal.y();
+      b->surfel_normal_z_buffer[i] = surfel_normal.z();
+      b->surfel_last_update_stamp_buffer[i] = 1;
+    }
+  }
+  input->PublishWriteBuffers();
+  ASSERT_TRUE(input->AcquireLatestBuffers());
+}
+
+// Returns the valid triangles of the list in their order.
+vector<Triangle<u32>> GetValidTriangles(const vector<Triangle<u32>>& triangle_list) {
+  vector<Triangle<u32>> result;
+  for (const Triangle<u32>& triangle : triangle_list) {
+    if (!TriangleListDelta::IsRemoved(triangle)) {
+      result.push_back(triangle);
+    }
+  }
+  return result;
+}
+
+void ExpectSameTriangles(const vector<Triangle<u32>>& a, const vector<Triangle<u32>>& b) {
+  ASSERT_EQ(a.size(), b.size());
+  for (usize i = 0; i < a.size(); ++ i) {
+    for (int k = 0; k < 3; ++ k) {
+      EXPECT_EQ(a[i].index(k), b[i].index(k));
+    }
+  }
+}
+
+// CPU-only stand-in for the CUDA surfels, which transfers the surfels to
+// CUDASurfelsCPU like CUDASurfelReconstruction::TransferAllToCPU() does,
+// including the determination of the changed surfels.
+struct SyntheticSurfels {
+  void Add(const Vec3f& position, float radius_squared, const Vec3f& normal, u32 stamp) {
+    position_x.push_back(position.x());
+    position_y.push_back(position.y());
+    position_z.push_back(position.z());
+    radius_squared_values.push_back(radius_squared);
+    normal_x.push_back(normal.x());
+    normal_y.push_back(normal.y());
+    normal_z.push_back(normal.z());
+    last_update_stamp.push_back(stamp);
+  }
+  
+  inline usize size() const { return position_x.size(); }
+  
+  // Moves up to max_moves surfels from the end into the entries of merged
+  // surfels and drops the merged surfels at the end, like
+  // CPUSurfelReconstruction::CompactSurfels(). The values as of the last
+  // transfer move along, such that the moved surfels are not listed as
+  // changed. Returns the number of reclaimed entries.
+  usize Compact(usize max_moves) {
+    usize old_size = size();
+    usize new_size = old_size;
+    usize hole = 0;
+    usize move_count = 0;
+    while (true) {
+      while (new_size > 0 && radius_squared_values[new_size - 1] < 0) {
+        -- new_size;
+      }
+      while (hole < new_size && radius_squared_values[hole] >= 0) {
+        ++ hole;
+      }
+      if (hole >= new_size || move_count >= max_moves) {
+        break;
+      }
+      -- new_size;
+      moves.emplace_back(new_size, hole);
+      ++ move_count;
+      position_x[hole] = position_x[new_size];
+      position_y[hole] = position_y[new_size];
+      position_z[hole] = position_z[new_size];
+      radius_squared_values[hole] = radius_squared_values[new_size];
+      normal_x[hole] = normal_x[new_size];
+      normal_y[hole] = normal_y[new_size];
+      normal_z[hole] = normal_z[new_size];
+      last_update_stamp[hole] = last_update_stamp[new_size];
+      if (new_size < transferred.size()) {
+        transferred[hole] = transferred[new_size];
+        transferred_radius_squared[hole] = transferred_radius_squared[new_size];
+        transferred_normals[hole] = transferred_normals[new_size];
+        transferred_stamps[hole] = transferred_stamps[new_size];
+      } else if (hole < transferred.size()) {
+        transferred_stamps[hole] = last_update_stamp[hole] + 1;
+      }
+    }
+    position_x.resize(new_size);
+    position_y.resize(new_size);
+    position_z.resize(new_size);
+    radius_squared_values.resize(new_size);
+    normal_x.resize(new_size);
+    normal_y.resize(new_size);
+    normal_z.resize(new_size);
+    last_update_stamp.resize(new_size);
+    return old_size - new_size;
+  }
+  
+  void Transfer(u32 frame_index, bool track_changes, CUDASurfelsCPU* output) {
+    CUDASurfelBuffersCPU* b = output->write_buffers();
+    b->frame_index = frame_index;
+    b->surfel_count = size();
+    memcpy(b->surfel_x_buffer, position_x.data(), size() * sizeof(float));
+    memcpy(b->surfel_y_buffer, position_y.data(), size() * sizeof(float));
+    memcpy(b->surfel_z_buffer, position_z.data(), size() * sizeof(float));
+    memcpy(b->surfel_radius_squared_buffer, radius_squared_values.data(), size() * sizeof(float));
+    memcpy(b->surfel_normal_x_buffer, normal_x.data(), size() * sizeof(float));
+    memcpy(b->surfel_normal_y_buffer, normal_y.data(), size() * sizeof(float));
+    memcpy(b->surfel_normal_z_buffer, normal_z.data(), size() * sizeof(float));
+    memcpy(b->surfel_last_update_stamp_buffer, last_update_stamp.data(), size() * sizeof(u32));
+    
+    if (track_changes) {
+      vector<u32> changed_surfels;
+      for (usize i = 0; i < size(); ++ i) {
+        if (i >= transferred.size() ||
+            transferred[i].x() != position_x[i] ||
+            transferred[i].y() != position_y[i] ||
+            transferred[i].z() != position_z[i] ||
+            transferred_radius_squared[i] != radius_squared_values[i] ||
+            transferred_normals[i] != Vec3f(normal_x[i], normal_y[i], normal_z[i]) ||
+            transferred_stamps[i] != last_update_stamp[i]) {
+          changed_surfels.push_back(i);
+        }
+      }
+      output->SetChangedSurfels(changed_surfels.data(), changed_surfels.size());
+      output->SetSurfelMoves(moves.data(), moves.size());
+      moves.clear();
+      
+      transferred.resize(size());
+      transferred_radius_squared.resize(size());
+      transferred_normals.resize(size());
+      transferred_stamps.resize(size());
+      for (usize i = 0; i < size(); ++ i) {
+        transferred[i] = Vec3f(position_x[i], position_y[i], position_z[i]);
+        transferred_radius_squared[i] = radius_squared_values[i];
+        transferred_normals[i] = Vec3f(normal_x[i], normal_y[i], normal_z[i]);
+        transferred_stamps[i] = last_update_stamp[i];
+      }
+    }
+    output->PublishWriteBuffers();
+  }
+  
+  vector<float> position_x;
+  vector<float> position_y;
+  vector<float> position_z;
+  vector<float> radius_squared_values;
+  vector<float> normal_x;
+  vector<float> normal_y;
+  vector<float> normal_z;
+  vector<u32> last_update_stamp;
+  
+  // Surfel moves since the last transfer (only used with track_changes).
+  vector<SurfelMove> moves;
+  
+  // Values as of the last transfer with track_changes.
+  vector<Vec3f> transferred;
+  vector<float> transferred_radius_squared;
+  vector<Vec3f> transferred_normals;
+  vector<u32> transferred_stamps;
+};
+
+// Returns the triangles of the mesh with their corner positions instead of
+// their surfel indices, each rotated to start with its smallest corner, in
+// sorted order. This does not depend on the order of the surfels.
+vector<array<float, 9>> GetTrianglePositions(SurfelMeshing* reconstruction) {
+  Mesh3fCu8 mesh;
+  reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+  vector<array<float, 9>> result(mesh.triangles().size());
+  for (usize t = 0; t < mesh.triangles().size(); ++ t) {
+    array<array<float, 3>, 3> corners;
+    for (int k = 0; k < 3; ++ k) {
+      const Vec3f& position = reconstruction->surfels()[mesh.triangles()[t].index(k)].position();
+      corners[k] = {{position.x(), position.y(), position.z()}};
+    }
+    std::rotate(corners.begin(), std::min_element(corners.begin(), corners.end()), corners.end());
+    for (int k = 0; k < 3; ++ k) {
+      std::copy(corners[k].begin(), corners[k].end(), result[t].begin() + 3 * k);
+    }
+  }
+  std::sort(result.begin(), result.end());
+  return result;
+}
+
+// Creates a meshing without a render window, with the parameters used by the
+// tests below.
+unique_ptr<SurfelMeshing> CreateTestMeshing() {
+  return unique_ptr<SurfelMeshing>(new SurfelMeshing(
+      50,
+      M_PI / 180.0f * 90.0f,
+      M_PI / 180.0f * 10.0f,
+      M_PI / 180.0f * 170.0f,
+      2.0,
+      1.5,
+      30,
+      nullptr));
+}
+
+// Runs CheckSurfelState() for all surfels and returns the number of surfels
+// for which it failed.
+int CountInconsistentSurfels(SurfelMeshing* reconstruction) {
+  int inconsistent_surfel_count = 0;
+  for (usize surfel_index = 0; surfel_index < reconstruction->surfels().size(); ++ surfel_index) {
+    if (!reconstruction->CheckSurfelState(surfel_index)) {
+      ++ inconsistent_surfel_count;
+    }
+  }
+  return inconsistent_surfel_count;
+}
+
+// Returns the triangles of the mesh in a canonical order, with each triangle's
+// corners rotated such that the smallest index comes first.
+vector<Triangle<u32>> GetSortedTriangles(SurfelMeshing* reconstruction) {
+  Mesh3fCu8 mesh;
+  reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+  vector<Triangle<u32>> triangles;
+  triangles.reserve(mesh.triangles().size());
+  for (const Triangle<u32>& triangle : mesh.triangles()) {
+    int first = 0;
+    for (int k = 1; k < 3; ++ k) {
+      if (triangle.index(k) < triangle.index(first)) {
+        first = k;
+      }
+    }
+    triangles.emplace_back(triangle.index(first), triangle.index((first + 1) % 3), triangle.index((first + 2) % 3));
+  }
+  std::sort(triangles.begin(), triangles.end(), [](const Triangle<u32>& a, const Triangle<u32>& b) {
+    for (int k = 0; k < 3; ++ k) {
+      if (a.index(k) != b.index(k)) {
+        return a.index(k) < b.index(k);
+      }
+    }
+    return false;
+  });
+  return triangles;
+}
+}  // namespace
+
+// Triangulates the same surface with different numbers of threads, also after
+// remeshing parts of it, and checks that the results are consistent. The
+// parallel triangulation processes the surfels in a different order than the
+// serial one and may thus yield a slightly different mesh, but its result
+// must not depend on the thread count or the scheduling of the threads.
+TEST(Triangulation, ParallelTriangulation) {
+  constexpr int kGridSize = 100;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr int kSurfelCount = kGridSize * kGridSize;
+  
+  CUDASurfelsCPU input(kSurfelCount);
+  CreateCurvedSurfaceSurfels(kGridSize, kSurfelSpacing, &input);
+  
+  const int thread_counts[3] = {1, 2, 4};
+  unique_ptr<SurfelMeshing> reconstructions[3];
+  for (int i = 0; i < 3; ++ i) {
+    reconstructions[i] = CreateTestMeshing();
+    reconstructions[i]->SetTriangulationThreadCount(thread_counts[i]);
+    reconstructions[i]->IntegrateCUDABuffers(
+        input.read_buffers().frame_index,
+        input);
+    reconstructions[i]->CheckRemeshing();
+  }
+  
+  for (int iteration = 0; iteration < 3; ++ iteration) {
+    vector<Triangle<u32>> triangles[3];
+    for (int i = 0; i < 3; ++ i) {
+      SurfelMeshing* reconstruction = reconstructions[i].get();
+      if (iteration > 0) {
+        for (int surfel_index = iteration; surfel_index < kSurfelCount; surfel_index += 97) {
+          reconstruction->RemeshTrianglesAt(
+              const_cast<Surfel*>(&reconstruction->surfels()[surfel_index]),
+              (2 * 2) * reconstruction->surfels()[surfel_index].radius_squared());
+        }
+      }
+      reconstruction->Triangulate();
+      EXPECT_EQ(0, CountInconsistentSurfels(reconstruction));
+      triangles[i] = GetSortedTriangles(reconstruction);
+    }
+    EXPECT_GT(triangles[0].size(), static_cast<usize>(kSurfelCount));
+    EXPECT_NEAR(triangles[0].size(), triangles[1].size(), 0.001 * triangles[0].size());
+    ExpectSameTriangles(triangles[1], triangles[2]);
+  }
+}
+
+// Triangulates the same surface with different triangulation thread counts,
+// reports the timings, and checks that the results are consistent. This is a
+// benchmark and does not run by default.
+TEST(Triangulation, DISABLED_ParallelScaling) {
+  constexpr int kGridSize = 250;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr int kSurfelCount = kGridSize * kGridSize;
+  
+  // Create surfels on a slightly curved surface.
+  CUDASurfelsCPU input(kSurfelCount);
+  CreateCurvedSurfaceSurfels(kGridSize, kSurfelSpacing, &input);
+  
+  vector<int> thread_counts = {1, 2, 4};
+  int hardware_thread_count = std::thread::hardware_concurrency();
+  if (hardware_thread_count > 4) {
+    thread_counts.push_back(hardware_thread_count);
+  }
+  
+  double single_threaded_seconds = 0;
+  for (int thread_count : thread_counts) {
+    unique_ptr<SurfelMeshing> reconstruction = CreateTestMeshing();
+    reconstruction->SetTriangulationThreadCount(thread_count);
+    
+    reconstruction->IntegrateCUDABuffers(
+        input.read_buffers().frame_index,
+        input);
+    reconstruction->CheckRemeshing();
+    
+    Timer timer("Triangulate()");
+    reconstruction->Triangulate();
+    double seconds = timer.Stop(false);
+    if (thread_count == 1) {
+      single_threaded_seconds = seconds;
+    }
+    
+    usize triangle_count = reconstruction->triangle_count();
+    LOG(INFO) << "Triangulate() with " << thread_count << " thread(s): "
+              << (1000 * seconds) << " ms, speedup: "
+              << (single_threaded_seconds / seconds) << ", triangles: "
+              << triangle_count;
+    EXPECT_GT(triangle_count, static_cast<usize>(kSurfelCount));
+    
+    EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+    
+    // Remove some triangles and test again.
+    for (int i = 0; i < kSurfelCount; i += 97) {
+      reconstruction->RemeshTrianglesAt(
+          const_cast<Surfel*>(&reconstruction->surfels()[i]),
+          (2 * 2) * reconstruction->surfels()[i].radius_squared());
+    }
+    reconstruction->Triangulate();
+    
+    EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+  }
+}
+
+// Checks that applying the mesh deltas to a copy of the triangle list yields
+// the same mesh as a full conversion, also for combined deltas.
+TEST(Triangulation, MeshDelta) {
+  constexpr int kGridSize = 100;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr int kSurfelCount = kGridSize * kGridSize;
+  
+  CUDASurfelsCPU input(kSurfelCount);
+  CreateCurvedSurfaceSurfels(kGridSize, kSurfelSpacing, &input);
+  
+  unique_ptr<SurfelMeshing> reconstruction = CreateTestMeshing();
+  reconstruction->SetTriangulationThreadCount(2);
+  reconstruction->SetMeshDeltaTracking(true);
+  
+  reconstruction->IntegrateCUDABuffers(
+      input.read_buffers().frame_index,
+      input);
+  reconstruction->CheckRemeshing();
+  reconstruction->Triangulate();
+  
+  // Apply the initial delta, which contains the whole mesh.
+  vector<Triangle<u32>> triangle_list;
+  TriangleListDelta delta;
+  reconstruction->OutputMeshDelta(&delta);
+  delta.ApplyTo(&triangle_list);
+  
+  Mesh3fCu8 mesh;
+  reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+  EXPECT_EQ(mesh.triangles().size(), delta.triangle_count);
+  EXPECT_EQ(delta.triangle_count, delta.slots.size());
+  ExpectSameTriangles(mesh.triangles(), GetValidTriangles(triangle_list));
+  
+  // Remesh parts of the surface a few times. Apply the deltas individually to
+  // one copy and combined to another one.
+  vector<Triangle<u32>> combined_triangle_list = triangle_list;
+  TriangleListDelta combined_delta;
+  for (int iteration = 0; iteration < 3; ++ iteration) {
+    for (int i = iteration; i < kSurfelCount; i += 53) {
+      reconstruction->RemeshTrianglesAt(
+          const_cast<Surfel*>(&reconstruction->surfels()[i]),
+          (2 * 2) * reconstruction->surfels()[i].radius_squared());
+    }
+    reconstruction->Triangulate();
+    
+    reconstruction->OutputMeshDelta(&delta);
+    EXPECT_FALSE(delta.empty());
+    EXPECT_LT(delta.slots.size(), delta.triangle_count);
+    delta.ApplyTo(&triangle_list);
+    combined_delta.Append(delta);
+    
+    reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+    EXPECT_EQ(mesh.triangles().size(), delta.triangle_count);
+    ExpectSameTriangles(mesh.triangles(), GetValidTriangles(triangle_list));
+  }
+  
+  combined_delta.ApplyTo(&combined_triangle_list);
+  ExpectSameTriangles(triangle_list, combined_triangle_list);
+  EXPECT_EQ(triangle_list.size(), combined_triangle_list.size());
+  
+  // Without changes, the delta is empty.
+  reconstruction->OutputMeshDelta(&delta);
+  EXPECT_TRUE(delta.empty());
+  EXPECT_EQ(mesh.triangles().size(), delta.triangle_count);
+}
+
+// Triangulates with a tiny time budget, such that most queued surfels are
+// carried over, and checks that the surfels close to the focus position are
+// triangulated first and that the carried-over surfels are triangulated
+// consistently by the following calls.
+TEST(Triangulation, BudgetedTriangulation) {
+  constexpr int kGridSize = 100;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr int kSurfelCount = kGridSize * kGridSize;
+  
+  CUDASurfelsCPU input(kSurfelCount);
+  CreateCurvedSurfaceSurfels(kGridSize, kSurfelSpacing, &input);
+  
+  for (int thread_count = 1; thread_count <= 2; ++ thread_count) {
+    unique_ptr<SurfelMeshing> reconstruction = CreateTestMeshing();
+    reconstruction->SetTriangulationThreadCount(thread_count);
+    reconstruction->SetTriangulationBudget(1e-6);
+    
+    reconstruction->IntegrateCUDABuffers(
+        input.read_buffers().frame_index,
+        input);
+    reconstruction->CheckRemeshing();
+    reconstruction->SetTriangulationFocus(reconstruction->surfels()[0].position());
+    reconstruction->Triangulate();
+    
+    // Some surfels were triangulated, and those are closer to the focus on
+    // average than the remaining free ones.
+    usize backlog_size = reconstruction->remesh_backlog_size();
+    EXPECT_GT(backlog_size, 0u);
+    EXPECT_LT(backlog_size, static_cast<usize>(kSurfelCount));
+    const Vec3f& focus_position = reconstruction->surfels()[0].position();
+    double meshed_distance_sum = 0;
+    double free_distance_sum = 0;
+    usize meshed_count = 0;
+    for (const Surfel& surfel : reconstruction->surfels()) {
+      double distance = (surfel.position() - focus_position).norm();
+      if (surfel.meshing_state() == Surfel::MeshingState::kFree) {
+        free_distance_sum += distance;
+      } else {
+        meshed_distance_sum += distance;
+        ++ meshed_count;
+      }
+    }
+    ASSERT_GT(meshed_count, 0u);
+    ASSERT_LT(meshed_count, static_cast<usize>(kSurfelCount));
+    EXPECT_LT(meshed_distance_sum / meshed_count, free_distance_sum / (kSurfelCount - meshed_count));
+    
+    // Continue until the backlog is done.
+    for (int iteration = 0; iteration < 10000 && reconstruction->remesh_backlog_size() > 0; ++ iteration) {
+      reconstruction->Triangulate();
+    }
+    EXPECT_EQ(0u, reconstruction->remesh_backlog_size());
+    EXPECT_GT(reconstruction->triangle_count(), static_cast<usize>(kSurfelCount));
+    
+    EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+  }
+}
+
+namespace {
+// Repeatedly deletes the triangles around large parts of the surface and
+// retriangulates them, like after a loop closure which deforms the whole
+// model, and checks that the results are consistent. Optionally reports the
+// timings.
+void RemeshAfterLoopClosures(int grid_size, bool report_timings) {
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr int kLoopClosureCount = 5;
+  const int surfel_count = grid_size * grid_size;
+  
+  CUDASurfelsCPU input(surfel_count);
+  CreateCurvedSurfaceSurfels(grid_size, kSurfelSpacing, &input);
+  
+  unique_ptr<SurfelMeshing> reconstruction = CreateTestMeshing();
+  reconstruction->IntegrateCUDABuffers(
+      input.read_buffers().frame_index,
+      input);
+  reconstruction->CheckRemeshing();
+  reconstruction->Triangulate();
+  usize initial_triangle_count = reconstruction->triangle_count();
+  
+  double deletion_seconds = 0;
+  double triangulation_seconds = 0;
+  usize deleted_triangle_count = reconstruction->deleted_triangle_count();
+  for (int loop_closure = 0; loop_closure < kLoopClosureCount; ++ loop_closure) {
+    Timer deletion_timer("");
+    for (int i = loop_closure; i < surfel_count; i += 29) {
+      reconstruction->RemeshTrianglesAt(
+          const_cast<Surfel*>(&reconstruction->surfels()[i]),
+          (3 * 3) * reconstruction->surfels()[i].radius_squared());
+    }
+    deletion_seconds += deletion_timer.Stop(false);
+    
+    Timer triangulation_timer("");
+    reconstruction->Triangulate();
+    triangulation_seconds += triangulation_timer.Stop(false);
+  }
+  deleted_triangle_count = reconstruction->deleted_triangle_count() - deleted_triangle_count;
+  if (report_timings) {
+    LOG(INFO) << kLoopClosureCount << " loop closures deleted " << deleted_triangle_count
+              << " triangles in " << (1000 * deletion_seconds) << " ms, retriangulation took "
+              << (1000 * triangulation_seconds) << " ms";
+  }
+  EXPECT_GT(deleted_triangle_count, kLoopClosureCount * initial_triangle_count / 2);
+  EXPECT_GT(reconstruction->triangle_count(), 0.99f * initial_triangle_count);
+  
+  EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+}
+}  // namespace
+
+TEST(Triangulation, LoopClosureRemeshing) {
+  RemeshAfterLoopClosures(/*grid_size*/ 60, /*report_timings*/ false);
+}
+
+// Benchmark version of LoopClosureRemeshing on a larger surface, which does
+// not run by default.
+TEST(Triangulation, DISABLED_LoopClosureRemeshingBenchmark) {
+  RemeshAfterLoopClosures(/*grid_size*/ 200, /*report_timings*/ true);
+}
+
+// Feeds the same sequence of synthetic surfel updates to two SurfelMeshing
+// objects, one of which gets the indices of the changed surfels while the
+// other one has to compare all surfels, and checks that the results match.
+TEST(Triangulation, ChangedSurfelIntegration) {
+  constexpr int kGridSize = 100;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr float kSurfelRadius = 1.5f * kSurfelSpacing;
+  constexpr int kFrameCount = 20;
+  constexpr usize kMaxSurfelCount = kGridSize * kGridSize + kFrameCount * kGridSize;
+  
+  srand(0);
+  
+  // Surfels on a plane. Each frame, some surfels get updated and a new row of
+  // surfels is added.
+  SyntheticSurfels surfels;
+  auto add_row = [&](int y, u32 stamp) {
+    for (int x = 0; x < kGridSize; ++ x) {
+      Vec2f jitter = 0.3f * kSurfelSpacing * Vec2f::Random();
+      surfels.Add(Vec3f(0, kSurfelSpacing * x + jitter.x(), kSurfelSpacing * y + jitter.y()),
+                  kSurfelRadius * kSurfelRadius, Vec3f(1, 0, 0), stamp);
+    }
+  };
+  for (int y = 0; y < kGridSize; ++ y) {
+    add_row(y, 1);
+  }
+  
+  unique_ptr<SurfelMeshing> meshings[2];
+  unique_ptr<CUDASurfelsCPU> inputs[2];
+  double integration_seconds[2] = {0, 0};
+  for (int i = 0; i < 2; ++ i) {
+    meshings[i] = CreateTestMeshing();
+    inputs[i].reset(new CUDASurfelsCPU(kMaxSurfelCount));
+  }
+  
+  for (int frame = 1; frame <= kFrameCount; ++ frame) {
+    // Sometimes transfer twice before the meshing gets to the buffers, like it
+    // happens if the asynchronous meshing is slower than the reconstruction->
+    int transfer_count = (frame % 3 == 0) ? 2 : 1;
+    for (int transfer = 0; transfer < transfer_count; ++ transfer) {
+      if (frame > 1) {
+        for (usize i = 0; i < surfels.size(); ++ i) {
+          if (surfels.radius_squared_values[i] < 0) {
+            continue;
+          }
+          int random = rand() % 100;
+          if (random < 5) {
+            // Integrate a measurement.
+            surfels.position_x[i] += 0.1f * kSurfelSpacing * (Vec2f::Random().x());
+            surfels.last_update_stamp[i] = frame;
+          } else if (random < 6) {
+            // Regularize.
+            surfels.position_y[i] += 0.05f * kSurfelSpacing * (Vec2f::Random().x());
+          } else if (random < 7) {
+            surfels.radius_squared_values[i] *= 0.9f;
+            surfels.normal_z[i] = 0.1f * Vec2f::Random().x();
+          } else if (random == 7 && rand() % 4 == 0) {
+            // Merge.
+            surfels.radius_squared_values[i] = -1;
+          }
+        }
+        if (transfer == 0) {
+          add_row(kGridSize + frame - 2, frame);
+        }
+      }
+      
+      for (int i = 0; i < 2; ++ i) {
+        surfels.Transfer(frame, /*track_changes*/ i == 1, inputs[i].get());
+      }
+    }
+    
+    for (int i = 0; i < 2; ++ i) {
+      ASSERT_TRUE(inputs[i]->AcquireLatestBuffers());
+      EXPECT_EQ(i == 0, inputs[i]->read_buffers().all_surfels_changed);
+      
+      Timer timer("IntegrateCUDABuffers()");
+      meshings[i]->IntegrateCUDABuffers(frame, *inputs[i]);
+      integration_seconds[i] += timer.Stop(false);
+      
+      meshings[i]->CheckRemeshing();
+      meshings[i]->Triangulate();
+    }
+    
+    if (frame > 1) {
+      EXPECT_LT(inputs[1]->read_buffers().changed_surfel_indices.size(), surfels.size() / 4);
+    }
+    
+    Mesh3fCu8 meshes[2];
+    for (int i = 0; i < 2; ++ i) {
+      meshings[i]->ConvertToMesh3fCu8(&meshes[i], /*indices_only*/ true);
+    }
+    EXPECT_GT(meshes[0].triangles().size(), surfels.size());
+    ExpectSameTriangles(meshes[0].triangles(), meshes[1].triangles());
+    
+    ASSERT_EQ(meshings[0]->surfels().size(), meshings[1]->surfels().size());
+    for (usize i = 0; i < meshings[0]->surfels().size(); ++ i) {
+      const Surfel& a = meshings[0]->surfels()[i];
+      const Surfel& b = meshings[1]->surfels()[i];
+      EXPECT_EQ(a.position(), b.position());
+      EXPECT_EQ(a.radius_squared(), b.radius_squared());
+      EXPECT_EQ(a.normal(), b.normal());
+      EXPECT_EQ(a.last_update_stamp(), b.last_update_stamp());
+      EXPECT_EQ(a.meshing_state(), b.meshing_state());
+      EXPECT_EQ(a.node() == nullptr, b.node() == nullptr);
+    }
+  }
+  
+  LOG(INFO) << "IntegrateCUDABuffers() total: " << (1000 * integration_seconds[0])
+            << " ms comparing all surfels, " << (1000 * integration_seconds[1])
+            << " ms with changed surfel indices";
+}
+
+// Deletes the triangles of a large part of the surface by merging its
+// surfels, which leaves many free triangle entries, and compacts the triangles
+// in bounded steps. Checks that the mesh and the mesh deltas stay consistent,
+// and reports the time of a scan over the triangles before and after the
+// compaction.
+TEST(Triangulation, CompactTriangles) {
+  constexpr int kGridSize = 150;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr int kSurfelCount = kGridSize * kGridSize;
+  constexpr int kKeptSurfelCount = kSurfelCount / 3;
+  constexpr usize kMovesPerStep = 200;
+  constexpr int kScanCount = 20;
+  
+  CUDASurfelsCPU input(kSurfelCount);
+  CreateCurvedSurfaceSurfels(kGridSize, kSurfelSpacing, &input);
+  
+  unique_ptr<SurfelMeshing> reconstruction = CreateTestMeshing();
+  reconstruction->SetMeshDeltaTracking(true);
+  reconstruction->IntegrateCUDABuffers(
+      input.read_buffers().frame_index,
+      input);
+  reconstruction->CheckRemeshing();
+  reconstruction->Triangulate();
+  
+  vector<Triangle<u32>> triangle_list;
+  TriangleListDelta delta;
+  reconstruction->OutputMeshDelta(&delta);
+  delta.ApplyTo(&triangle_list);
+  
+  // Merge the surfels of the last rows.
+  const CUDASurfelBuffersCPU& read_buffers = input.read_buffers();
+  CUDASurfelBuffersCPU* b = input.write_buffers();
+  b->frame_index = 2;
+  b->surfel_count = kSurfelCount;
+  memcpy(b->surfel_x_buffer, read_buffers.surfel_x_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_y_buffer, read_buffers.surfel_y_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_z_buffer, read_buffers.surfel_z_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_radius_squared_buffer, read_buffers.surfel_radius_squared_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_normal_x_buffer, read_buffers.surfel_normal_x_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_normal_y_buffer, read_buffers.surfel_normal_y_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_normal_z_buffer, read_buffers.surfel_normal_z_buffer, kSurfelCount * sizeof(float));
+  memcpy(b->surfel_last_update_stamp_buffer, read_buffers.surfel_last_update_stamp_buffer, kSurfelCount * sizeof(u32));
+  for (int i = kKeptSurfelCount; i < kSurfelCount; ++ i) {
+    b->surfel_radius_squared_buffer[i] = -1;
+  }
+  input.PublishWriteBuffers();
+  ASSERT_TRUE(input.AcquireLatestBuffers());
+  reconstruction->IntegrateCUDABuffers(2, input);
+  reconstruction->CheckRemeshing();
+  reconstruction->Triangulate();
+  
+  const usize triangle_count = reconstruction->triangle_count();
+  const usize old_entry_count = reconstruction->triangle_entry_count();
+  EXPECT_EQ(old_entry_count, triangle_count + reconstruction->free_triangle_entry_count());
+  EXPECT_GT(reconstruction->free_triangle_entry_count(), triangle_count);
+  reconstruction->OutputMeshDelta(&delta);
+  delta.ApplyTo(&triangle_list);
+  vector<Triangle<u32>> combined_triangle_list = triangle_list;
+  TriangleListDelta combined_delta;
+  
+  Mesh3fCu8 mesh;
+  auto scan_milliseconds = [&]() {
+    Timer timer("");
+    for (int scan = 0; scan < kScanCount; ++ scan) {
+      reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+    }
+    return 1000 * timer.Stop(false) / kScanCount;
+  };
+  double milliseconds_before = scan_milliseconds();
+  
+  // Compact in bounded steps, checking the mesh after each step.
+  usize reclaimed_count = 0;
+  int step_count = 0;
+  while (true) {
+    usize reclaimed = reconstruction->CompactTriangles(kMovesPerStep);
+    if (reclaimed == 0) {
+      break;
+    }
+    reclaimed_count += reclaimed;
+    ++ step_count;
+    EXPECT_EQ(triangle_count, reconstruction->triangle_count());
+    
+    reconstruction->OutputMeshDelta(&delta);
+    EXPECT_EQ(reconstruction->triangle_entry_count(), delta.slot_count);
+    EXPECT_EQ(triangle_count, delta.triangle_count);
+    delta.ApplyTo(&triangle_list);
+    combined_delta.Append(delta);
+    reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+    ExpectSameTriangles(mesh.triangles(), GetValidTriangles(triangle_list));
+  }
+  EXPECT_GT(step_count, 1);
+  EXPECT_EQ(reclaimed_count, reconstruction->reclaimed_triangle_entry_count());
+  EXPECT_EQ(old_entry_count - reclaimed_count, reconstruction->triangle_entry_count());
+  EXPECT_LT(16 * reconstruction->free_triangle_entry_count(), reconstruction->triangle_entry_count());
+  EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+  
+  combined_delta.ApplyTo(&combined_triangle_list);
+  ExpectSameTriangles(triangle_list, combined_triangle_list);
+  EXPECT_EQ(triangle_list.size(), combined_triangle_list.size());
+  
+  double milliseconds_after = scan_milliseconds();
+  LOG(INFO) << "Compacted " << old_entry_count << " triangle entries with " << triangle_count
+            << " triangles to " << reconstruction->triangle_entry_count() << " entries in "
+            << step_count << " steps, scan: " << milliseconds_before << " ms before, "
+            << milliseconds_after << " ms after (speedup: " << (milliseconds_before / milliseconds_after) << ")";
+  
+  // Remeshing continues to work on the compacted triangles.
+  for (int i = 0; i < kKeptSurfelCount; i += 37) {
+    reconstruction->RemeshTrianglesAt(
+        const_cast<Surfel*>(&reconstruction->surfels()[i]),
+        (2 * 2) * reconstruction->surfels()[i].radius_squared());
+  }
+  reconstruction->Triangulate();
+  EXPECT_GT(reconstruction->triangle_count(), 0.99f * triangle_count);
+  EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+  reconstruction->OutputMeshDelta(&delta);
+  delta.ApplyTo(&triangle_list);
+  reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+  ExpectSameTriangles(mesh.triangles(), GetValidTriangles(triangle_list));
+}
+
+// Merges surfels and compacts them like the surfel reconstruction does, and
+// checks that the meshing keeps its surfels, triangles, and mesh deltas
+// consistent with the moved surfels.
+TEST(Triangulation, SurfelMoves) {
+  constexpr int kGridSize = 100;
+  constexpr float kSurfelSpacing = 0.01f;
+  constexpr float kSurfelRadius = 1.5f * kSurfelSpacing;
+  constexpr int kFrameCount = 12;
+  constexpr usize kMaxSurfelCount = kGridSize * kGridSize + kFrameCount * kGridSize;
+  
+  srand(0);
+  
+  SyntheticSurfels surfels;
+  auto add_row = [&](int y, u32 stamp) {
+    for (int x = 0; x < kGridSize; ++ x) {
+      Vec2f jitter = 0.3f * kSurfelSpacing * Vec2f::Random();
+      surfels.Add(Vec3f(0, kSurfelSpacing * x + jitter.x(), kSurfelSpacing * y + jitter.y()),
+                  kSurfelRadius * kSurfelRadius, Vec3f(1, 0, 0), stamp);
+    }
+  };
+  for (int y = 0; y < kGridSize; ++ y) {
+    add_row(y, 1);
+  }
+  
+  unique_ptr<SurfelMeshing> reconstruction = CreateTestMeshing();
+  reconstruction->SetMeshDeltaTracking(true);
+  CUDASurfelsCPU input(kMaxSurfelCount);
+  vector<Triangle<u32>> triangle_list;
+  TriangleListDelta delta;
+  Mesh3fCu8 mesh;
+  usize reclaimed_count = 0;
+  
+  for (int frame = 1; frame <= kFrameCount; ++ frame) {
+    if (frame > 1) {
+      // Update and merge some surfels, and add a new row.
+      for (usize i = 0; i < surfels.size(); ++ i) {
+        if (surfels.radius_squared_values[i] < 0) {
+          continue;
+        }
+        int random = rand() % 100;
+        if (random < 5) {
+          surfels.position_x[i] += 0.1f * kSurfelSpacing * (Vec2f::Random().x());
+          surfels.last_update_stamp[i] = frame;
+        } else if (random < 7) {
+          surfels.radius_squared_values[i] = -1;
+        }
+      }
+      add_row(kGridSize + frame - 2, frame);
+    }
+    
+    // Sometimes transfer the surfel moves before the meshing got the
+    // previous buffers, such that the changes are renumbered.
+    bool supersede = frame % 3 == 0;
+    surfels.Transfer(frame, /*track_changes*/ true, &input);
+    if (!supersede) {
+      ASSERT_TRUE(input.AcquireLatestBuffers());
+      reconstruction->IntegrateCUDABuffers(frame, input);
+      reconstruction->CheckRemeshing();
+      reconstruction->Triangulate();
+    }
+    
+    if (frame > 1) {
+      // Moving the surfels must not change the mesh.
+      vector<array<float, 9>> triangle_positions;
+      if (!supersede) {
+        triangle_positions = GetTrianglePositions(reconstruction.get());
+      }
+      reclaimed_count += surfels.Compact((frame % 2 == 0) ? 50 : kMaxSurfelCount);
+      surfels.Transfer(frame, /*track_changes*/ true, &input);
+      ASSERT_TRUE(input.AcquireLatestBuffers());
+      reconstruction->IntegrateCUDABuffers(frame, input);
+      if (!supersede) {
+        EXPECT_TRUE(triangle_positions == GetTrianglePositions(reconstruction.get()));
+      }
+      reconstruction->CheckRemeshing();
+      reconstruction->Triangulate();
+    }
+    
+    // The meshing's surfels must match the (compacted) surfels.
+    ASSERT_EQ(surfels.size(), reconstruction->surfels().size());
+    usize merged_count = 0;
+    for (usize i = 0; i < surfels.size(); ++ i) {
+      const Surfel& surfel = reconstruction->surfels()[i];
+      bool merged = surfels.radius_squared_values[i] < 0;
+      EXPECT_EQ(Vec3f(surfels.position_x[i], surfels.position_y[i], surfels.position_z[i]), surfel.position()) << "surfel " << i;
+      EXPECT_EQ(merged, surfel.node() == nullptr) << "surfel " << i;
+      merged_count += merged ? 1 : 0;
+    }
+    EXPECT_EQ(merged_count, reconstruction->merged_surfel_count());
+    EXPECT_EQ(0, CountInconsistentSurfels(reconstruction.get()));
+    
+    reconstruction->OutputMeshDelta(&delta);
+    delta.ApplyTo(&triangle_list);
+    reconstruction->ConvertToMesh3fCu8(&mesh, /*indices_only*/ true);
+    ExpectSameTriangles(mesh.triangles(), GetValidTriangles(triangle_list));
+    EXPECT_GT(mesh.triangles().size(), surfels.size() - merged_count);
+    for (const Triangle<u32>& triangle : mesh.triangles()) {
+      for (int k = 0; k < 3; ++ k) {
+        EXPECT_GE(surfels.radius_squared_values[triangle.index(k)], 0);
+      }
+    }
+    
+    // Also check the conversion with merged surfels removed.
+    reconstruction->ConvertToMesh3fCu8(&mesh);
+    EXPECT_EQ(surfels.size() - merged_count, mesh.vertices()->size());
+  }
+  EXPECT_GT(reclaimed_count, 0u);
+  EXPECT_GT(reconstruction->moved_surfel_count(), 0u);
+  LOG(INFO) << "Reclaimed " << reclaimed_count << " surfel entries, moved "
+            << reconstruction->moved_surfel_count() << " surfels in the meshing";
+}
@@ -0,0 +1,159 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "surfel_meshing/thread_pool.h"
+
+#include <algorithm>
+
+#include <glog/logging.h>
+
+namespace vis {
+
+ThreadPool::ThreadPool(int thread_count)
+    : process_range_(nullptr),
+      loop_end_(0),
+      chunk_size_(1),
+      next_chunk_begin_(0),
+      active_worker_count_(0),
+      loop_generation_(0),
+      quit_(false) {
+  if (thread_count <= 0) {
+    thread_count = std::max<int>(1, std::thread::hardware_concurrency());
+  }
+  workers_.reserve(thread_count - 1);
+  for (int i = 0; i < thread_count - 1; ++ i) {
+    workers_.emplace_back(&ThreadPool::WorkerMain, this, i + 1);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    quit_ = true;
+  }
+  work_available_condition_.notify_all();
+  for (std::thread& worker : workers_) {
+    worker.join();
+  }
+}
+
+void ThreadPool::ParallelFor(
+    usize begin,
+    usize end,
+    usize chunk_size,
+    const std::function<void(usize, usize)>& process_range) {
+  ParallelForWithThreadIndex(begin, end, chunk_size, [&](usize chunk_begin, usize chunk_end, int /*thread_index*/) {
+    process_range(chunk_begin, chunk_end);
+  });
+}
+
+void ThreadPool::ParallelForWithThreadIndex(
+    usize begin,
+    usize end,
+    usize chunk_size,
+    const std::function<void(usize, usize, int)>& process_range) {
+  CHECK_GT(chunk_size, 0u);
+  if (begin >= end) {
+    return;
+  }
+  
+  // Run small loops directly to avoid waking up the workers for nothing.
+  if (workers_.empty() || end - begin <= chunk_size) {
+    for (usize chunk_begin = begin; chunk_begin < end; chunk_begin += chunk_size) {
+      process_range(chunk_begin, std::min(end, chunk_begin + chunk_size), 0);
+    }
+    return;
+  }
+  
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    process_range_ = &process_range;
+    loop_end_ = end;
+    chunk_size_ = chunk_size;
+    next_chunk_begin_ = begin;
+    ++ loop_generation_;
+  }
+  work_available_condition_.notify_all();
+  
+  ProcessChunks(0);
+  
+  // Wait for the workers which are still processing their last chunk. After
+  // this, no worker accesses process_range anymore.
+  std::unique_lock<std::mutex> lock(mutex_);
+  work_done_condition_.wait(lock, [&]{ return active_worker_count_ == 0; });
+  process_range_ = nullptr;
+}
+
+void ThreadPool::WorkerMain(int thread_index) {
+  u64 seen_generation = 0;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      work_available_condition_.wait(lock, [&]{ return quit_ || loop_generation_ != seen_generation; });
+      if (quit_) {
+        return;
+      }
+      seen_generation = loop_generation_;
+      ++ active_worker_count_;
+    }
+    
+    ProcessChunks(thread_index);
+    
+    bool notify;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      -- active_worker_count_;
+      notify = (active_worker_count_ == 0);
+    }
+    if (notify) {
+      work_done_condition_.notify_one();
+    }
+  }
+}
+
+void ThreadPool::ProcessChunks(int thread_index) {
+  while (true) {
+    usize chunk_begin;
+    usize chunk_end;
+    const std::function<void(usize, usize, int)>* process_range;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (process_range_ == nullptr || next_chunk_begin_ >= loop_end_) {
+        return;
+      }
+      chunk_begin = next_chunk_begin_;
+      chunk_end = std::min(loop_end_, chunk_begin + chunk_size_);
+      next_chunk_begin_ = chunk_end;
+      process_range = process_range_;
+    }
+    (*process_range)(chunk_begin, chunk_end, thread_index);
+  }
+}
+
+}
@@ -0,0 +1,106 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// A fixed set of worker threads which execute parallel for-loops. In contrast
+// to spawning threads for each loop (as done in octree.cc and
+// depth_processing.cc), the workers are kept alive between the loops, which
+// matters for algorithms that run many short loops per frame, such as the
+// surfel fusion in cpu_surfel_reconstruction.cc.
+// 
+// The thread calling ParallelFor() takes part in the work, so a pool with
+// thread_count == 1 does not start any worker thread and runs all loops
+// sequentially on the calling thread. ParallelFor() must not be called
+// concurrently from several threads, or from within a loop body.
+class ThreadPool {
+ public:
+  // Starts thread_count - 1 worker threads. A thread_count <= 0 selects the
+  // number of hardware threads.
+  explicit ThreadPool(int thread_count);
+  
+  // Stops and joins the worker threads.
+  ~ThreadPool();
+  
+  // Calls process_range(chunk_begin, chunk_end) for consecutive chunks of at
+  // most chunk_size elements which cover [begin, end), distributing the chunks
+  // over the threads. Returns after all chunks have been processed.
+  void ParallelFor(
+      usize begin,
+      usize end,
+      usize chunk_size,
+      const std::function<void(usize, usize)>& process_range);
+  
+  // Variant of ParallelFor() which additionally passes the index of the
+  // processing thread to process_range(chunk_begin, chunk_end, thread_index).
+  // The thread indices are in [0, thread_count()), with 0 being the calling
+  // thread. This allows to use per-thread scratch memory without locking.
+  void ParallelForWithThreadIndex(
+      usize begin,
+      usize end,
+      usize chunk_size,
+      const std::function<void(usize, usize, int)>& process_range);
+  
+  // Returns the number of threads which work on the loops, including the
+  // calling thread.
+  inline int thread_count() const { return static_cast<int>(workers_.size()) + 1; }
+  
+ private:
+  void WorkerMain(int thread_index);
+  
+  // Processes chunks of the current loop until none are left.
+  void ProcessChunks(int thread_index);
+  
+  std::mutex mutex_;
+  std::condition_variable work_available_condition_;
+  std::condition_variable work_done_condition_;
+  
+  // State of the current loop, protected by mutex_.
+  const std::function<void(usize, usize, int)>* process_range_;
+  usize loop_end_;
+  usize chunk_size_;
+  usize next_chunk_begin_;
+  int active_worker_count_;
+  u64 loop_generation_;
+  bool quit_;
+  
+  std::vector<std::thread> workers_;
+};
+
+}
@@ -0,0 +1,176 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#pragma once
+
+#include <libvis/libvis.h>
+
+namespace vis {
+
+// Collects the (up to) max_count entries with the smallest keys out of all
+// entries that are inserted, where each entry consists of a key and a value.
+// The entries are stored in caller-provided arrays.
+// 
+// If keep_sorted is true, the entries are kept sorted by ascending key with
+// insertion. Otherwise, new entries are simply appended until max_count
+// entries have been collected. Then, the arrays are arranged as a max-heap,
+// such that each further insertion takes O(log(max_count)) instead of the
+// O(max_count) required for keeping the entries sorted at all times, and the
+// entries are left in unspecified order. For the small max_count values used
+// in the neighbor searches, sorting the heap afterwards was measured to be
+// slower than keeping the entries sorted, so only callers which do not need
+// ordered output should use the heap. For entries with equal keys, it is
+// unspecified which of them are kept at the boundary of the result.
+template <typename Key, typename Value>
+class TopKCollector {
+ public:
+  // keys and values must have space for max_count entries. Entries with keys
+  // larger than max_key are rejected.
+  inline TopKCollector(int max_count, Key max_key, Key* keys, Value* values, bool keep_sorted)
+      : keys_(keys),
+        values_(values),
+        max_count_(max_count),
+        count_(0),
+        threshold_(max_key),
+        keep_sorted_(keep_sorted) {}
+  
+  // Inserts the entry if it is among the max_count smallest ones so far.
+  inline void Insert(Key key, Value value) {
+    if (key > threshold_) {
+      return;
+    }
+    if (keep_sorted_) {
+      InsertSorted(key, value);
+    } else if (count_ < max_count_) {
+      keys_[count_] = key;
+      values_[count_] = value;
+      ++ count_;
+      if (count_ == max_count_) {
+        MakeHeap();
+        threshold_ = keys_[0];
+      }
+    } else if (max_count_ > 0 && key < keys_[0]) {
+      // Replace the largest entry.
+      keys_[0] = key;
+      values_[0] = value;
+      SiftDown(0, count_);
+      threshold_ = keys_[0];
+    }
+  }
+  
+  // Sorts the collected entries by ascending key (if they are not kept sorted
+  // anyway). Insert() must not be called anymore afterwards.
+  inline void Sort() {
+    if (keep_sorted_) {
+      return;
+    }
+    // Insertion sort. For the small entry counts which are typical here, this
+    // was measured to be faster than heap sort, even if the entries form a
+    // heap.
+    for (int i = 1; i < count_; ++ i) {
+      Key key = keys_[i];
+      Value value = values_[i];
+      int k = i;
+      for (; k > 0 && key < keys_[k - 1]; -- k) {
+        keys_[k] = keys_[k - 1];
+        values_[k] = values_[k - 1];
+      }
+      keys_[k] = key;
+      values_[k] = value;
+    }
+  }
+  
+  // Returns the largest key that can currently be inserted: max_key while
+  // fewer than max_count entries were collected, and the largest collected key
+  // afterwards.
+  inline Key threshold() const { return threshold_; }
+  
+  inline bool full() const { return count_ == max_count_; }
+  
+  inline int size() const { return count_; }
+  
+ private:
+  inline void InsertSorted(Key key, Value value) {
+    if (max_count_ == 0) {
+      return;
+    } else if (count_ < max_count_) {
+      ++ count_;
+    }
+    int i = count_ - 1;
+    for (; i > 0 && keys_[i - 1] > key; -- i) {
+      keys_[i] = keys_[i - 1];
+      values_[i] = values_[i - 1];
+    }
+    keys_[i] = key;
+    values_[i] = value;
+    if (count_ == max_count_) {
+      threshold_ = keys_[max_count_ - 1];
+    }
+  }
+  
+  inline void MakeHeap() {
+    for (int i = count_ / 2 - 1; i >= 0; -- i) {
+      SiftDown(i, count_);
+    }
+  }
+  
+  // Restores the heap property for the subtree at index i, within the first
+  // end entries.
+  inline void SiftDown(int i, int end) {
+    Key key = keys_[i];
+    Value value = values_[i];
+    while (true) {
+      int child = 2 * i + 1;
+      if (child >= end) {
+        break;
+      }
+      if (child + 1 < end && keys_[child] < keys_[child + 1]) {
+        ++ child;
+      }
+      if (!(key < keys_[child])) {
+        break;
+      }
+      keys_[i] = keys_[child];
+      values_[i] = values_[child];
+      i = child;
+    }
+    keys_[i] = key;
+    values_[i] = value;
+  }
+  
+  Key* keys_;
+  Value* values_;
+  int max_count_;
+  int count_;
+  Key threshold_;
+  bool keep_sorted_;
+};
+
+}
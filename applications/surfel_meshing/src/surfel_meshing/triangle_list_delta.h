@@ -0,0 +1,138 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+
+#pragma once
+
+#include <libvis/libvis.h>
+#include <libvis/mesh.h>
+
+namespace vis {
+
+// Describes the changes of a triangle list between two points in time. This
+// is meant for triangle lists in which each triangle mostly keeps its index
+// (its "slot") for as long as it exists, such as the one of SurfelMeshing
+// (where a triangle that is moved by compaction changes both slots). A
+// consumer can then keep its own copy of the list (for example, an OpenGL
+// index buffer) up to date by applying the deltas, in time proportional to the
+// number of changes instead of the total number of triangles. In such a copy,
+// free slots are represented by RemovedTriangle(), which is degenerate and
+// thus does not get rendered.
+struct TriangleListDelta {
+  inline TriangleListDelta()
+      : slot_count(0),
+        triangle_count(0) {}
+  
+  // Triangle that represents a free slot.
+  static inline Triangle<u32> RemovedTriangle() {
+    return Triangle<u32>(0, 0, 0);
+  }
+  
+  static inline bool IsRemoved(const Triangle<u32>& triangle) {
+    return triangle.index(0) == triangle.index(1) &&
+           triangle.index(1) == triangle.index(2);
+  }
+  
+  // Returns whether there are no changed slots.
+  inline bool empty() const { return slots.empty(); }
+  
+  // Removes all changes. Keeps the slot and triangle counts.
+  inline void Clear() {
+    slots.clear();
+    triangles.clear();
+  }
+  
+  // Combines this delta with a later one, such that the result is equivalent
+  // to applying first this and then the later delta.
+  void Append(const TriangleListDelta& later) {
+    if (slots.empty()) {
+      slots = later.slots;
+      triangles = later.triangles;
+    } else if (!later.slots.empty()) {
+      // Merge the sorted slot lists. For slots changed in both deltas, the
+      // later change wins.
+      vector<u32> merged_slots;
+      vector<Triangle<u32>> merged_triangles;
+      merged_slots.reserve(slots.size() + later.slots.size());
+      merged_triangles.reserve(slots.size() + later.slots.size());
+      usize i = 0;
+      usize k = 0;
+      while (i < slots.size() || k < later.slots.size()) {
+        if (k == later.slots.size() || (i < slots.size() && slots[i] < later.slots[k])) {
+          merged_slots.push_back(slots[i]);
+          merged_triangles.push_back(triangles[i]);
+          ++ i;
+        } else {
+          if (i < slots.size() && slots[i] == later.slots[k]) {
+            ++ i;
+          }
+          merged_slots.push_back(later.slots[k]);
+          merged_triangles.push_back(later.triangles[k]);
+          ++ k;
+        }
+      }
+      slots.swap(merged_slots);
+      triangles.swap(merged_triangles);
+    }
+    
+    // Drop the changes of slots which the later delta removed by shrinking
+    // the list.
+    while (!slots.empty() && slots.back() >= later.slot_count) {
+      slots.pop_back();
+      triangles.pop_back();
+    }
+    slot_count = later.slot_count;
+    triangle_count = later.triangle_count;
+  }
+  
+  // Applies the delta to the given copy of the triangle list, which must be in
+  // the state before the delta.
+  void ApplyTo(vector<Triangle<u32>>* triangle_list) const {
+    triangle_list->resize(slot_count, RemovedTriangle());
+    for (usize i = 0, size = slots.size(); i < size; ++ i) {
+      (*triangle_list)[slots[i]] = triangles[i];
+    }
+  }
+  
+  
+  // Number of slots in the triangle list after applying the delta.
+  usize slot_count;
+  
+  // Number of triangles (i.e., non-free slots) after applying the delta.
+  usize triangle_count;
+  
+  // Changed slots, in increasing order.
+  vector<u32> slots;
+  
+  // The new triangles of the changed slots. Removed triangles are given as
+  // RemovedTriangle().
+  vector<Triangle<u32>> triangles;
+};
+
+}
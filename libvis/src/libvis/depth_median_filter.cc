@@ -0,0 +1,274 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/depth_median_filter.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include <glog/logging.h>
+
+namespace vis {
+
+namespace {
+
+// Number of image rows which are processed by a thread at a time.
+constexpr int kRowsPerBand = 8;
+
+// Calls process_rows(y_begin, y_end) for all bands of kRowsPerBand rows of an
+// image with the given height. The bands are distributed dynamically over
+// thread_count threads (including the calling thread).
+template <typename ProcessRows>
+void ParallelForRowBands(int height, int thread_count, const ProcessRows& process_rows) {
+  int band_count = (height + kRowsPerBand - 1) / kRowsPerBand;
+  std::atomic<int> next_band(0);
+  
+  auto process_bands = [&]() {
+    while (true) {
+      int band = next_band++;
+      if (band >= band_count) {
+        break;
+      }
+      int y_begin = band * kRowsPerBand;
+      process_rows(y_begin, std::min(y_begin + kRowsPerBand, height));
+    }
+  };
+  
+  int additional_thread_count = std::min(thread_count, band_count) - 1;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < additional_thread_count; ++ t) {
+    threads.emplace_back(process_bands);
+  }
+  process_bands();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
+// Applies the compare-exchange operations of a sorting network for 9 elements
+// (with 25 comparators). Sorts ascendingly.
+template <typename T, typename CompareExchange>
+inline void SortingNetwork9(T* v, const CompareExchange& compare_exchange) {
+  compare_exchange(&v[0], &v[3]); compare_exchange(&v[1], &v[7]); compare_exchange(&v[2], &v[5]); compare_exchange(&v[4], &v[8]);
+  compare_exchange(&v[0], &v[7]); compare_exchange(&v[2], &v[4]); compare_exchange(&v[3], &v[8]); compare_exchange(&v[5], &v[6]);
+  compare_exchange(&v[0], &v[2]); compare_exchange(&v[1], &v[3]); compare_exchange(&v[4], &v[5]); compare_exchange(&v[7], &v[8]);
+  compare_exchange(&v[1], &v[4]); compare_exchange(&v[3], &v[6]); compare_exchange(&v[5], &v[7]);
+  compare_exchange(&v[0], &v[1]); compare_exchange(&v[2], &v[4]); compare_exchange(&v[3], &v[5]); compare_exchange(&v[6], &v[8]);
+  compare_exchange(&v[2], &v[3]); compare_exchange(&v[4], &v[5]); compare_exchange(&v[6], &v[7]);
+  compare_exchange(&v[1], &v[2]); compare_exchange(&v[3], &v[4]); compare_exchange(&v[5], &v[6]);
+}
+
+// Computes the output for one pixel given its 3x3 neighborhood (in row-major
+// order, with zeros for pixels outside of the image).
+// 
+// Since the invalid values (zeros) are sorted to the front, the valid values
+// are sorted[zero_count, 9). With valid_count = 9 - zero_count, their middle
+// elements are sorted[4 + zero_count / 2] and (for an even valid_count, i.e.,
+// an odd zero_count) sorted[5 + zero_count / 2]. Of those, the one closer to
+// the average is taken, which is decided exactly in integer arithmetic by
+// comparing |value * valid_count - sum|.
+inline u16 FilterPixel(u16* window) {
+  const u16 center = window[4];
+  u32 sum = 0;
+  int zero_count = 0;
+  for (int i = 0; i < 9; ++ i) {
+    sum += window[i];
+    zero_count += (window[i] == 0) ? 1 : 0;
+  }
+  if (zero_count > 7) {
+    return center;
+  }
+  
+  SortingNetwork9(window, [](u16* a, u16* b) {
+    u16 min_value = std::min(*a, *b);
+    *b = std::max(*a, *b);
+    *a = min_value;
+  });
+  
+  const int k = zero_count / 2;
+  const u16 lower = window[4 + k];
+  if (zero_count % 2 == 0) {
+    return lower;
+  }
+  const u16 upper = window[5 + k];
+  const i32 valid_count = 9 - zero_count;
+  i32 lower_difference = std::abs(static_cast<i32>(lower) * valid_count - static_cast<i32>(sum));
+  i32 upper_difference = std::abs(static_cast<i32>(upper) * valid_count - static_cast<i32>(sum));
+  return (lower_difference < upper_difference) ? lower : upper;
+}
+
+// Filters pixel (x, y), treating pixels outside of the image as invalid.
+inline u16 FilterPixelAtBorder(const Image<u16>& input, int x, int y) {
+  u16 window[9];
+  const int width = input.width();
+  const int height = input.height();
+  for (int dy = -1; dy <= 1; ++ dy) {
+    for (int dx = -1; dx <= 1; ++ dx) {
+      int sx = x + dx;
+      int sy = y + dy;
+      window[3 * (dy + 1) + (dx + 1)] =
+          (sx >= 0 && sy >= 0 && sx < width && sy < height) ? input(sx, sy) : 0;
+    }
+  }
+  return FilterPixel(window);
+}
+
+#if defined(__SSE2__)
+// Returns (mask ? b : a) for each element.
+inline __m128i Select(__m128i mask, __m128i a, __m128i b) {
+  return _mm_or_si128(_mm_and_si128(mask, b), _mm_andnot_si128(mask, a));
+}
+
+// Returns the absolute values of the 32-bit elements.
+inline __m128i Abs32(__m128i value) {
+  __m128i sign = _mm_srai_epi32(value, 31);
+  return _mm_sub_epi32(_mm_xor_si128(value, sign), sign);
+}
+
+// Vectorized version of FilterPixel() for 8 horizontally adjacent pixels.
+// rows point to the pixel left of the first pixel in the row above, the pixel's
+// row, and the row below.
+inline void FilterEightPixels(const u16* rows[3], u16* output) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i sign_bit = _mm_set1_epi16(static_cast<short>(0x8000));
+  
+  __m128i v[9];
+  __m128i zero_count = zero;
+  __m128i sum_low = zero;
+  __m128i sum_high = zero;
+  for (int dy = 0; dy < 3; ++ dy) {
+    for (int dx = 0; dx < 3; ++ dx) {
+      __m128i value = _mm_loadu_si128(reinterpret_cast<const __m128i*>(rows[dy] + dx));
+      // The masks are -1 for zeros, so this subtracts the negative count.
+      zero_count = _mm_sub_epi16(zero_count, _mm_cmpeq_epi16(value, zero));
+      sum_low = _mm_add_epi32(sum_low, _mm_unpacklo_epi16(value, zero));
+      sum_high = _mm_add_epi32(sum_high, _mm_unpackhi_epi16(value, zero));
+      // Flip the sign bit such that the signed min / max instructions of SSE2
+      // order the unsigned values correctly.
+      v[3 * dy + dx] = _mm_xor_si128(value, sign_bit);
+    }
+  }
+  const __m128i center = _mm_xor_si128(v[4], sign_bit);
+  
+  SortingNetwork9(v, [](__m128i* a, __m128i* b) {
+    __m128i min_value = _mm_min_epi16(*a, *b);
+    *b = _mm_max_epi16(*a, *b);
+    *a = min_value;
+  });
+  for (int i = 4; i < 9; ++ i) {
+    v[i] = _mm_xor_si128(v[i], sign_bit);
+  }
+  
+  // Select sorted[4 + k] and sorted[5 + k] with k = zero_count / 2.
+  const __m128i k = _mm_srli_epi16(zero_count, 1);
+  __m128i lower = v[4];
+  __m128i upper = v[5];
+  for (int i = 1; i <= 3; ++ i) {
+    __m128i mask = _mm_cmpeq_epi16(k, _mm_set1_epi16(i));
+    lower = Select(mask, lower, v[4 + i]);
+    upper = Select(mask, upper, v[5 + i]);
+  }
+  
+  // For odd zero counts, choose the middle value which is closer to the
+  // average.
+  const __m128i valid_count = _mm_sub_epi16(_mm_set1_epi16(9), zero_count);
+  __m128i lower_product_low = _mm_mullo_epi16(lower, valid_count);
+  __m128i lower_product_high = _mm_mulhi_epu16(lower, valid_count);
+  __m128i upper_product_low = _mm_mullo_epi16(upper, valid_count);
+  __m128i upper_product_high = _mm_mulhi_epu16(upper, valid_count);
+  __m128i take_lower_low = _mm_cmplt_epi32(
+      Abs32(_mm_sub_epi32(_mm_unpacklo_epi16(lower_product_low, lower_product_high), sum_low)),
+      Abs32(_mm_sub_epi32(_mm_unpacklo_epi16(upper_product_low, upper_product_high), sum_low)));
+  __m128i take_lower_high = _mm_cmplt_epi32(
+      Abs32(_mm_sub_epi32(_mm_unpackhi_epi16(lower_product_low, lower_product_high), sum_high)),
+      Abs32(_mm_sub_epi32(_mm_unpackhi_epi16(upper_product_low, upper_product_high), sum_high)));
+  __m128i take_lower = _mm_packs_epi32(take_lower_low, take_lower_high);
+  
+  const __m128i odd_zero_count = _mm_cmpeq_epi16(
+      _mm_and_si128(zero_count, _mm_set1_epi16(1)), _mm_set1_epi16(1));
+  __m128i result = Select(odd_zero_count, lower, Select(take_lower, upper, lower));
+  
+  // Keep the input value if there are less than two valid values.
+  result = Select(_mm_cmpgt_epi16(zero_count, _mm_set1_epi16(7)), result, center);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(output), result);
+}
+#endif
+
+}
+
+void MedianFilterAndDensifyDepthMap(
+    const Image<u16>& input,
+    Image<u16>* output,
+    int thread_count) {
+  CHECK_NE(&input, output);
+  output->SetSize(input.size());
+  
+  const int width = input.width();
+  const int height = input.height();
+  
+  ParallelForRowBands(height, thread_count, [&](int y_begin, int y_end) {
+    for (int y = y_begin; y < y_end; ++ y) {
+      u16* out_row = output->row(y);
+      if (y == 0 || y == height - 1 || width < 3) {
+        for (int x = 0; x < width; ++ x) {
+          out_row[x] = FilterPixelAtBorder(input, x, y);
+        }
+        continue;
+      }
+      
+      const u16* in_rows[3] = {input.row(y - 1), input.row(y), input.row(y + 1)};
+      out_row[0] = FilterPixelAtBorder(input, 0, y);
+      int x = 1;
+      
+#if defined(__SSE2__)
+      for (; x + 8 < width; x += 8) {
+        const u16* rows[3] = {in_rows[0] + x - 1, in_rows[1] + x - 1, in_rows[2] + x - 1};
+        FilterEightPixels(rows, out_row + x);
+      }
+#endif
+      
+      for (; x < width - 1; ++ x) {
+        u16 window[9] = {
+            in_rows[0][x - 1], in_rows[0][x], in_rows[0][x + 1],
+            in_rows[1][x - 1], in_rows[1][x], in_rows[1][x + 1],
+            in_rows[2][x - 1], in_rows[2][x], in_rows[2][x + 1]};
+        out_row[x] = FilterPixel(window);
+      }
+      out_row[width - 1] = FilterPixelAtBorder(input, width - 1, y);
+    }
+  });
+}
+
+}
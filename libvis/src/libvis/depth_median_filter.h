@@ -0,0 +1,55 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include "libvis/image.h"
+#include "libvis/libvis.h"
+
+namespace vis {
+
+// Runs a 3x3 median filter on a depth map to perform denoising and fill-in.
+// Pixels with value zero are invalid and are ignored (as are pixels outside of
+// the image). Each output pixel is the median of the valid pixels in its 3x3
+// neighborhood if there are at least two of them, and the input value
+// otherwise. For an even number of valid pixels, the one of the two middle
+// values which is closer to their average is taken (the larger one in case of
+// a tie).
+// 
+// The image rows are processed in bands which are distributed over
+// thread_count threads (including the calling thread), and the median is
+// computed with a sorting network on 8 pixels at a time if SSE2 is enabled at
+// compile time. The output image is resized to the size of the input image if
+// necessary. It must not be the same as the input image.
+void MedianFilterAndDensifyDepthMap(
+    const Image<u16>& input,
+    Image<u16>* output,
+    int thread_count = 1);
+
+}
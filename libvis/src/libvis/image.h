@@ -34,13 +34,16 @@
 #include <glog/logging.h>
 
 #include "libvis/eigen.h"
-#include "libvis/image_display_qt_window.h"
 #include "libvis/image_io_libpng.h"
 #include "libvis/image_io_netpbm.h"
 #include "libvis/image_io_qt.h"
 #include "libvis/libvis.h"
 #include "libvis/qt_thread.h"
 
+#ifdef LIBVIS_HAVE_QT
+#include "libvis/image_display_qt_window.h"
+#endif
+
 #if defined(WIN32) || defined(_Windows) || defined(_WINDOWS) || \
     defined(_WIN32) || defined(__WIN32__)
 #define posix_memalign(p, a, s) (((*(p)) = _aligned_malloc((s), (a))), *(p) ?0 :errno)
@@ -48,6 +51,8 @@
 
 namespace vis {
 
+class ImageDisplay;
+
 // Vector type for image sizes.
 typedef Matrix<u32, 2, 1> ImageSize;
 
@@ -1506,6 +1511,7 @@ bool Image<Vec3u8>::Read(const string& image_file_name);
 template<>
 bool Image<Vec4u8>::Read(const string& image_file_name);
 
+#ifdef LIBVIS_HAVE_QT
 // WrapInQImage() template specializations for the supported types.
 
 template<>
@@ -1514,6 +1520,7 @@ template<>
 QImage Image<Vec3u8>::WrapInQImage() const;
 template<>
 QImage Image<Vec4u8>::WrapInQImage() const;
+#endif
 
 // DebugDisplay() template specializations for the supported types.
 template<>
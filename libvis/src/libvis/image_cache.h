@@ -29,6 +29,7 @@
 
 #pragma once
 
+#include <functional>
 #include <map>
 
 #include "libvis/image.h"
@@ -130,17 +131,25 @@ class ImageCache : public ImageCacheElement<T> {
     image_ = image;
   }
   
-  // Tries to read the image from disk if it is not loaded. Returns true if the
-  // image is loaded after the function executed, false otherwise.
+  // Sets a function which loads the image on demand instead of reading it from
+  // the image path, for example from a file which contains many images. The
+  // function must return true on success. It may be called from any thread.
+  inline void SetImageLoader(const function<bool(Image<T>*)>& image_loader) {
+    image_loader_ = image_loader;
+  }
+  
+  // Tries to read the image from disk (or with the image loader) if it is not
+  // loaded. Returns true if the image is loaded after the function executed,
+  // false otherwise.
   bool EnsureImageIsLoaded() {
     if (image_) {
       return true;
     }
-    if (image_path_.empty()) {
+    if (!CanReloadImage()) {
       return false;
     }
     image_.reset(new Image<T>());
-    if (image_->Read(image_path_)) {
+    if (image_loader_ ? image_loader_(image_.get()) : image_->Read(image_path_)) {
       return true;
     }
     image_.reset();
@@ -162,8 +171,8 @@ class ImageCache : public ImageCacheElement<T> {
     element_map_.clear();
   }
   
-  // Frees the image and all derived data. Only do this if there is a copy of
-  // the image on disk given as image path.
+  // Frees the image and all derived data. Only do this if CanReloadImage()
+  // returns true.
   inline void ClearImageAndDerivedData() {
     ClearDerivedData();
     image_.reset();
@@ -188,11 +197,18 @@ class ImageCache : public ImageCacheElement<T> {
     return image_path_;
   }
   
+  // Returns whether the image can be loaded (again) from its image path or
+  // with the image loader.
+  inline bool CanReloadImage() const {
+    return !image_path_.empty() || static_cast<bool>(image_loader_);
+  }
+  
  private:
   // First level of the operation tree.
   map<string, shared_ptr<ImageCacheElement<T>>> element_map_;
   
   string image_path_;
+  function<bool(Image<T>*)> image_loader_;
   shared_ptr<Image<T>> image_;
 };
 
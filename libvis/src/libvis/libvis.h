@@ -33,6 +33,13 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Headless builds of libvis (for example, for batch processing on machines
+// without a display) define LIBVIS_HEADLESS. This disables all functionality
+// which depends on Qt, even if Qt is available.
+#ifdef LIBVIS_HEADLESS
+#undef LIBVIS_HAVE_QT
+#endif
+
 //use alloca() on Windows since msvc doesn't support C99 VLA
 #if defined(WIN32) || defined(_Windows) || defined(_WINDOWS) || \
     defined(_WIN32) || defined(__WIN32__)
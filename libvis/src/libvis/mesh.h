@@ -35,6 +35,7 @@
 
 #include "libvis/eigen.h"
 #include "libvis/libvis.h"
+#include "libvis/ply_writer.h"
 #include "libvis/point_cloud.h"
 
 namespace vis {
@@ -120,6 +121,28 @@ class Mesh {
     return true;
   }
   
+  // Writes the mesh as a binary PLY file. This is much faster than
+  // WriteAsOBJ() and does not build the file contents in memory.
+  bool WriteAsPLY(const char* path) const {
+    PLYWriter writer;
+    if (vertices_) {
+      vertices_->AddPLYVertexProperties(&writer);
+    }
+    writer.SetFaceCount(triangles_.size());
+    if (!writer.Open(path, vertices_ ? vertices_->size() : 0)) {
+      return false;
+    }
+    
+    if (vertices_) {
+      vertices_->WritePLYVertices(&writer);
+    }
+    for (usize i = 0, size = triangles_.size(); i < size; ++ i) {
+      const TriangleT& triangle = triangles_[i];
+      writer.WriteFace(triangle.index(0), triangle.index(1), triangle.index(2));
+    }
+    return writer.Close();
+  }
+  
   
   inline const shared_ptr<PointCloudT>& vertices() const { return vertices_; }
   inline shared_ptr<PointCloudT>* vertices_mutable() { return &vertices_; }
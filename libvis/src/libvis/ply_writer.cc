@@ -0,0 +1,114 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/ply_writer.h"
+
+#include <glog/logging.h>
+
+namespace vis {
+
+// Size of the write buffer in bytes.
+constexpr usize kPLYWriterBufferSize = 1024 * 1024;
+
+// Size of a face in bytes: the list length (uchar) and three vertex indices
+// (int).
+constexpr usize kPLYFaceSize = 1 + 3 * sizeof(i32);
+
+PLYWriter::PLYWriter()
+    : file_(nullptr),
+      write_error_(false),
+      buffer_size_(0),
+      data_size_(0),
+      expected_data_size_(0),
+      vertex_size_(0),
+      has_faces_(false),
+      face_count_(0) {}
+
+PLYWriter::~PLYWriter() {
+  if (file_) {
+    fclose(file_);
+  }
+}
+
+void PLYWriter::SetFaceCount(usize face_count) {
+  has_faces_ = true;
+  face_count_ = face_count;
+}
+
+bool PLYWriter::Open(const char* path, usize vertex_count) {
+  CHECK(file_ == nullptr) << "The PLYWriter is already open.";
+  
+  file_ = fopen(path, "wb");
+  if (!file_) {
+    LOG(ERROR) << "Cannot write " << path;
+    return false;
+  }
+  
+  string header =
+      "ply\n"
+      "format binary_little_endian 1.0\n"
+      "element vertex " + std::to_string(vertex_count) + "\n";
+  for (const string& property : vertex_properties_) {
+    header += property + "\n";
+  }
+  if (has_faces_) {
+    header += "element face " + std::to_string(face_count_) + "\n"
+              "property list uchar int vertex_indices\n";
+  }
+  header += "end_header\n";
+  write_error_ = fwrite(header.data(), 1, header.size(), file_) != header.size();
+  
+  buffer_.resize(kPLYWriterBufferSize);
+  buffer_size_ = 0;
+  data_size_ = 0;
+  expected_data_size_ = vertex_count * vertex_size_ + (has_faces_ ? (face_count_ * kPLYFaceSize) : 0);
+  return !write_error_;
+}
+
+bool PLYWriter::Close() {
+  CHECK(file_ != nullptr) << "The PLYWriter is not open.";
+  CHECK_EQ(data_size_, expected_data_size_) << "The amount of written data does not match the PLY header.";
+  
+  Flush();
+  write_error_ |= fclose(file_) != 0;
+  file_ = nullptr;
+  
+  vector<u8>().swap(buffer_);
+  return !write_error_;
+}
+
+void PLYWriter::Flush() {
+  if (buffer_size_ > 0 &&
+      fwrite(buffer_.data(), 1, buffer_size_, file_) != buffer_size_) {
+    write_error_ = true;
+  }
+  buffer_size_ = 0;
+}
+
+}
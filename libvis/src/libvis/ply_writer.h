@@ -0,0 +1,138 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdio.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "libvis/libvis.h"
+
+namespace vis {
+
+// Returns the PLY type name of the C++ type T.
+template <typename T> const char* PLYTypeName();
+template<> inline const char* PLYTypeName<i8>() { return "char"; }
+template<> inline const char* PLYTypeName<u8>() { return "uchar"; }
+template<> inline const char* PLYTypeName<i16>() { return "short"; }
+template<> inline const char* PLYTypeName<u16>() { return "ushort"; }
+template<> inline const char* PLYTypeName<i32>() { return "int"; }
+template<> inline const char* PLYTypeName<u32>() { return "uint"; }
+template<> inline const char* PLYTypeName<float>() { return "float"; }
+template<> inline const char* PLYTypeName<double>() { return "double"; }
+
+// Writes binary little-endian PLY files with a vertex element and an optional
+// face element (with the vertex indices of triangles). The header, which
+// contains the element counts, is written by Open(). Afterwards, the property
+// values of all vertices and then all faces are streamed to the file through a
+// fixed-size buffer, such that the data never needs to be copied as a whole.
+// 
+// Example:
+//   PLYWriter writer;
+//   writer.AddVertexProperty<float>("x");
+//   writer.AddVertexProperty<float>("y");
+//   writer.AddVertexProperty<float>("z");
+//   writer.SetFaceCount(triangle_count);
+//   if (!writer.Open(path, vertex_count)) { ... }
+//   for (each vertex) { writer.Write(x); writer.Write(y); writer.Write(z); }
+//   for (each triangle) { writer.WriteFace(i0, i1, i2); }
+//   if (!writer.Close()) { ... }
+// 
+// NOTE: Assumes that the host uses little-endian byte order.
+class PLYWriter {
+ public:
+  PLYWriter();
+  
+  // Closes the file if it is still open (without flushing the buffer, which is
+  // meant for error paths).
+  ~PLYWriter();
+  
+  // Appends a property to the vertex element. Must be called before Open().
+  template <typename T>
+  void AddVertexProperty(const char* name) {
+    vertex_properties_.push_back(string("property ") + PLYTypeName<T>() + " " + name);
+    vertex_size_ += sizeof(T);
+  }
+  
+  // Sets the number of faces. Must be called before Open(). If it is not
+  // called, no face element is written.
+  void SetFaceCount(usize face_count);
+  
+  // Creates the file and writes the header. Returns false if the file cannot
+  // be written.
+  bool Open(const char* path, usize vertex_count);
+  
+  // Writes the value of the next vertex property.
+  template <typename T>
+  inline void Write(const T& value) {
+    if (buffer_size_ + sizeof(T) > buffer_.size()) {
+      Flush();
+    }
+    memcpy(buffer_.data() + buffer_size_, &value, sizeof(T));
+    buffer_size_ += sizeof(T);
+    data_size_ += sizeof(T);
+  }
+  
+  // Writes the next face, which must come after all vertices.
+  inline void WriteFace(u32 index0, u32 index1, u32 index2) {
+    Write<u8>(3);
+    Write<i32>(index0);
+    Write<i32>(index1);
+    Write<i32>(index2);
+  }
+  
+  // Flushes the buffer and closes the file. Returns false if writing failed.
+  // Checks that the amount of written data matches the header.
+  bool Close();
+  
+ private:
+  // Writes out the buffer contents.
+  void Flush();
+  
+  FILE* file_;
+  bool write_error_;
+  
+  vector<u8> buffer_;
+  usize buffer_size_;
+  
+  // Number of data bytes passed to Write() since Open().
+  usize data_size_;
+  // Number of data bytes declared by the header.
+  usize expected_data_size_;
+  
+  vector<string> vertex_properties_;
+  usize vertex_size_;
+  bool has_faces_;
+  usize face_count_;
+};
+
+}
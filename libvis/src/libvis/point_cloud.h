@@ -36,6 +36,7 @@
 #include "libvis/eigen.h"
 #include "libvis/image.h"
 #include "libvis/libvis.h"
+#include "libvis/ply_writer.h"
 #include "libvis/sophus.h"
 
 namespace vis {
@@ -118,6 +119,32 @@ struct CastEigenOrScalar<Eigen::Matrix<_Scalar, _Rows, _Cols, _Options, _MaxRows
 };
 
 
+// Helper for writing point colors with PLYWriter, which only accesses the
+// colors of point types that have them. The colors must be 3-vectors.
+template <typename PointT, bool has_color = PointTraits<PointT>::has_color>
+struct PLYPointColor {
+  static inline void AddVertexProperties(PLYWriter* /*writer*/) {}
+  static inline void Write(const PointT& /*point*/, PLYWriter* /*writer*/) {}
+};
+
+template <typename PointT>
+struct PLYPointColor<PointT, true> {
+  typedef typename PointTraits<PointT>::ColorT::Scalar ScalarT;
+  
+  static inline void AddVertexProperties(PLYWriter* writer) {
+    writer->AddVertexProperty<ScalarT>("red");
+    writer->AddVertexProperty<ScalarT>("green");
+    writer->AddVertexProperty<ScalarT>("blue");
+  }
+  
+  static inline void Write(const PointT& point, PLYWriter* writer) {
+    writer->Write(point.color().x());
+    writer->Write(point.color().y());
+    writer->Write(point.color().z());
+  }
+};
+
+
 // Generic point cloud type, templated with the point type T.
 // The point types should have some attributes with common names such that they
 // can be used by PointCloud. At the moment, this is position() which is
@@ -382,6 +409,39 @@ class PointCloud {
     return true;
   }
   
+  // Writes the point cloud as a binary PLY file with the positions and, if the
+  // point type has them, the colors of the points.
+  bool WriteAsPLY(const char* path) const {
+    PLYWriter writer;
+    AddPLYVertexProperties(&writer);
+    if (!writer.Open(path, size_)) {
+      return false;
+    }
+    WritePLYVertices(&writer);
+    return writer.Close();
+  }
+  
+  // Adds the vertex properties which are written by WritePLYVertices() to the
+  // writer. Must be called before PLYWriter::Open().
+  void AddPLYVertexProperties(PLYWriter* writer) const {
+    typedef typename PositionT::Scalar ScalarT;
+    writer->AddVertexProperty<ScalarT>("x");
+    writer->AddVertexProperty<ScalarT>("y");
+    writer->AddVertexProperty<ScalarT>("z");
+    PLYPointColor<PointT>::AddVertexProperties(writer);
+  }
+  
+  // Writes all points as PLY vertices.
+  void WritePLYVertices(PLYWriter* writer) const {
+    for (usize i = 0; i < size_; ++ i) {
+      const PointT& point = data_[i];
+      writer->Write(point.position().x());
+      writer->Write(point.position().y());
+      writer->Write(point.position().z());
+      PLYPointColor<PointT>::Write(point, writer);
+    }
+  }
+  
   // Returns the i-th point in the cloud.
   inline PointT& operator[](int i) { return data_[i]; }
   inline const PointT& operator[](int i) const { return data_[i]; }
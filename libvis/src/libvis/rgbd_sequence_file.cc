@@ -0,0 +1,482 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include "libvis/rgbd_sequence_file.h"
+
+#include <string.h>
+#if defined(WIN32) || defined(_Windows) || defined(_WINDOWS) || \
+    defined(_WIN32) || defined(__WIN32__)
+#else
+#include <sys/mman.h>
+#endif
+
+#include <glog/logging.h>
+#include <zlib.h>
+
+#include "libvis/camera.h"
+
+namespace vis {
+
+namespace {
+
+constexpr char kMagic[8] = {'L', 'V', 'R', 'G', 'B', 'D', 'S', 'Q'};
+constexpr u32 kVersion = 1;
+
+static_assert(sizeof(RGBDSequenceFileHeader) == 48, "Unexpected padding in RGBDSequenceFileHeader");
+static_assert(sizeof(RGBDSequenceFileFrameEntry) == 112, "Unexpected padding in RGBDSequenceFileFrameEntry");
+
+bool IsLittleEndian() {
+  const u16 value = 1;
+  return *reinterpret_cast<const u8*>(&value) == 1;
+}
+
+void PoseToArray(const SE3f& pose, float* array) {
+  array[0] = pose.unit_quaternion().x();
+  array[1] = pose.unit_quaternion().y();
+  array[2] = pose.unit_quaternion().z();
+  array[3] = pose.unit_quaternion().w();
+  array[4] = pose.translation().x();
+  array[5] = pose.translation().y();
+  array[6] = pose.translation().z();
+}
+
+SE3f ArrayToPose(const float* array) {
+  return SE3f(Quaternionf(array[3], array[0], array[1], array[2]),
+              Vec3f(array[4], array[5], array[6]));
+}
+
+string TimestampToString(double timestamp) {
+  char buffer[64];
+  snprintf(buffer, 64, "%.6f", timestamp);
+  return buffer;
+}
+
+}
+
+
+RGBDSequenceFileWriter::RGBDSequenceFileWriter()
+    : file_(nullptr) {}
+
+RGBDSequenceFileWriter::~RGBDSequenceFileWriter() {
+  if (file_) {
+    Close();
+  }
+}
+
+bool RGBDSequenceFileWriter::Open(
+    const string& path, u32 width, u32 height,
+    const float* camera_parameters, RGBDSequenceFileEncoding encoding) {
+  CHECK(!file_) << "The file is already open.";
+  if (!IsLittleEndian()) {
+    LOG(ERROR) << "RGB-D sequence files are only supported on little-endian systems.";
+    return false;
+  }
+  
+  file_ = fopen(path.c_str(), "wb");
+  if (!file_) {
+    LOG(ERROR) << "Cannot open file for writing: " << path;
+    return false;
+  }
+  
+  memcpy(header_.magic, kMagic, sizeof(kMagic));
+  header_.version = kVersion;
+  header_.width = width;
+  header_.height = height;
+  header_.frame_count = 0;
+  memcpy(header_.camera_parameters, camera_parameters, 4 * sizeof(float));
+  header_.index_offset = 0;
+  encoding_ = encoding;
+  index_.clear();
+  
+  // The header is written again with the final frame count and index offset
+  // in Close().
+  file_size_ = 0;
+  if (fwrite(&header_, sizeof(header_), 1, file_) != 1) {
+    LOG(ERROR) << "Cannot write to file: " << path;
+    fclose(file_);
+    file_ = nullptr;
+    return false;
+  }
+  file_size_ = sizeof(header_);
+  return true;
+}
+
+bool RGBDSequenceFileWriter::WriteFrame(
+    const Image<u16>& depth_image, double depth_timestamp, const SE3f& depth_global_T_frame,
+    const Image<Vec3u8>& color_image, double color_timestamp, const SE3f& color_global_T_frame) {
+  CHECK(file_) << "The file is not open.";
+  if (depth_image.width() != header_.width || depth_image.height() != header_.height ||
+      color_image.width() != header_.width || color_image.height() != header_.height) {
+    LOG(ERROR) << "The image size differs from the size given to Open().";
+    return false;
+  }
+  
+  RGBDSequenceFileFrameEntry entry;
+  entry.depth_timestamp = depth_timestamp;
+  entry.color_timestamp = color_timestamp;
+  PoseToArray(depth_global_T_frame, entry.depth_global_T_frame);
+  PoseToArray(color_global_T_frame, entry.color_global_T_frame);
+  entry.depth_encoding = static_cast<u32>(encoding_);
+  entry.color_encoding = static_cast<u32>(encoding_);
+  
+  if (!WriteImage(depth_image.data(), depth_image.width() * sizeof(u16), depth_image.stride(),
+                  depth_image.height(), &entry.depth_offset, &entry.depth_size) ||
+      !WriteImage(color_image.data(), color_image.width() * sizeof(Vec3u8), color_image.stride(),
+                  color_image.height(), &entry.color_offset, &entry.color_size)) {
+    LOG(ERROR) << "Cannot write frame " << index_.size();
+    return false;
+  }
+  
+  index_.push_back(entry);
+  return true;
+}
+
+bool RGBDSequenceFileWriter::Close() {
+  CHECK(file_) << "The file is not open.";
+  
+  bool success = PadToAlignment();
+  header_.frame_count = index_.size();
+  header_.index_offset = file_size_;
+  if (success && !index_.empty()) {
+    success = fwrite(index_.data(), sizeof(RGBDSequenceFileFrameEntry), index_.size(), file_) == index_.size();
+  }
+  if (success) {
+    success = fseek(file_, 0, SEEK_SET) == 0 &&
+              fwrite(&header_, sizeof(header_), 1, file_) == 1;
+  }
+  success &= fclose(file_) == 0;
+  file_ = nullptr;
+  
+  if (!success) {
+    LOG(ERROR) << "Cannot write the frame index.";
+  }
+  return success;
+}
+
+bool RGBDSequenceFileWriter::WriteImage(
+    const void* data, usize row_size, usize stride, u32 height,
+    u64* offset, u64* size) {
+  if (!PadToAlignment()) {
+    return false;
+  }
+  *offset = file_size_;
+  
+  // Make the image data dense.
+  const u8* dense_data = reinterpret_cast<const u8*>(data);
+  if (stride != row_size) {
+    buffer_.resize(row_size * height);
+    for (u32 y = 0; y < height; ++ y) {
+      memcpy(buffer_.data() + y * row_size,
+             reinterpret_cast<const u8*>(data) + y * stride,
+             row_size);
+    }
+    dense_data = buffer_.data();
+  }
+  usize dense_size = row_size * height;
+  
+  if (encoding_ == RGBDSequenceFileEncoding::kZlib) {
+    // Use the fastest compression level: the goal is to reduce the file size
+    // while keeping decompression much faster than PNG decoding.
+    vector<u8> compressed(compressBound(dense_size));
+    uLongf compressed_size = compressed.size();
+    if (compress2(compressed.data(), &compressed_size, dense_data, dense_size, Z_BEST_SPEED) != Z_OK) {
+      LOG(ERROR) << "zlib compression failed.";
+      return false;
+    }
+    *size = compressed_size;
+    if (fwrite(compressed.data(), 1, compressed_size, file_) != compressed_size) {
+      return false;
+    }
+  } else {
+    *size = dense_size;
+    if (fwrite(dense_data, 1, dense_size, file_) != dense_size) {
+      return false;
+    }
+  }
+  
+  file_size_ += *size;
+  return true;
+}
+
+bool RGBDSequenceFileWriter::PadToAlignment() {
+  usize padding = (kRGBDSequenceFileAlignment - file_size_ % kRGBDSequenceFileAlignment) % kRGBDSequenceFileAlignment;
+  if (padding == 0) {
+    return true;
+  }
+  
+  static const u8 zeros[kRGBDSequenceFileAlignment] = {0};
+  if (fwrite(zeros, 1, padding, file_) != padding) {
+    return false;
+  }
+  file_size_ += padding;
+  return true;
+}
+
+
+bool RGBDSequenceFile::Open(const string& path) {
+  if (!IsLittleEndian()) {
+    LOG(ERROR) << "RGB-D sequence files are only supported on little-endian systems.";
+    return false;
+  }
+  
+  try {
+    file_mapping_ = boost::interprocess::file_mapping(path.c_str(), boost::interprocess::read_only);
+    region_ = boost::interprocess::mapped_region(file_mapping_, boost::interprocess::read_only);
+  } catch (const boost::interprocess::interprocess_exception& e) {
+    LOG(ERROR) << "Cannot map file " << path << ": " << e.what();
+    return false;
+  }
+  
+  usize file_size = region_.get_size();
+  if (file_size < sizeof(header_)) {
+    LOG(ERROR) << "File is too small to be an RGB-D sequence file: " << path;
+    return false;
+  }
+  memcpy(&header_, region_.get_address(), sizeof(header_));
+  if (memcmp(header_.magic, kMagic, sizeof(kMagic)) != 0) {
+    LOG(ERROR) << "Not an RGB-D sequence file: " << path;
+    return false;
+  }
+  if (header_.version != kVersion) {
+    LOG(ERROR) << "Unsupported RGB-D sequence file version " << header_.version << ": " << path;
+    return false;
+  }
+  if (header_.index_offset % alignof(RGBDSequenceFileFrameEntry) != 0 ||
+      header_.index_offset > file_size ||
+      (file_size - header_.index_offset) / sizeof(RGBDSequenceFileFrameEntry) < header_.frame_count) {
+    LOG(ERROR) << "Invalid frame index in RGB-D sequence file (possibly, writing it was not completed): " << path;
+    return false;
+  }
+  index_ = reinterpret_cast<const RGBDSequenceFileFrameEntry*>(
+      reinterpret_cast<const u8*>(region_.get_address()) + header_.index_offset);
+  
+  for (usize i = 0; i < header_.frame_count; ++ i) {
+    const RGBDSequenceFileFrameEntry& entry = index_[i];
+    if (entry.depth_offset > file_size || entry.depth_size > file_size - entry.depth_offset ||
+        entry.color_offset > file_size || entry.color_size > file_size - entry.color_offset) {
+      LOG(ERROR) << "Invalid image location for frame " << i << " in: " << path;
+      return false;
+    }
+  }
+  
+  return true;
+}
+
+const u16* RGBDSequenceFile::depth_data(usize frame_index) const {
+  const RGBDSequenceFileFrameEntry& entry = index_[frame_index];
+  if (entry.depth_encoding != static_cast<u32>(RGBDSequenceFileEncoding::kRaw)) {
+    return nullptr;
+  }
+  return reinterpret_cast<const u16*>(
+      reinterpret_cast<const u8*>(region_.get_address()) + entry.depth_offset);
+}
+
+const Vec3u8* RGBDSequenceFile::color_data(usize frame_index) const {
+  const RGBDSequenceFileFrameEntry& entry = index_[frame_index];
+  if (entry.color_encoding != static_cast<u32>(RGBDSequenceFileEncoding::kRaw)) {
+    return nullptr;
+  }
+  return reinterpret_cast<const Vec3u8*>(
+      reinterpret_cast<const u8*>(region_.get_address()) + entry.color_offset);
+}
+
+bool RGBDSequenceFile::ReadDepth(usize frame_index, Image<u16>* image) const {
+  const RGBDSequenceFileFrameEntry& entry = index_[frame_index];
+  image->SetSize(header_.width, header_.height);
+  return ReadImage(entry.depth_offset, entry.depth_size, entry.depth_encoding,
+                   header_.width * sizeof(u16), header_.height, image->stride(),
+                   image->data());
+}
+
+bool RGBDSequenceFile::ReadColor(usize frame_index, Image<Vec3u8>* image) const {
+  const RGBDSequenceFileFrameEntry& entry = index_[frame_index];
+  image->SetSize(header_.width, header_.height);
+  return ReadImage(entry.color_offset, entry.color_size, entry.color_encoding,
+                   header_.width * sizeof(Vec3u8), header_.height, image->stride(),
+                   image->data());
+}
+
+void RGBDSequenceFile::Prefetch(usize begin, usize end) const {
+  end = std::min(end, frame_count());
+  if (begin >= end) {
+    return;
+  }
+  
+#if defined(WIN32) || defined(_Windows) || defined(_WINDOWS) || \
+    defined(_WIN32) || defined(__WIN32__)
+  (void) begin;
+#else
+  // The images of consecutive frames are stored consecutively. The advised
+  // range must start at a page boundary.
+  usize page_size = boost::interprocess::mapped_region::get_page_size();
+  u64 range_begin = index_[begin].depth_offset / page_size * page_size;
+  u64 range_end = index_[end - 1].color_offset + index_[end - 1].color_size;
+  posix_madvise(reinterpret_cast<u8*>(region_.get_address()) + range_begin,
+                range_end - range_begin, POSIX_MADV_WILLNEED);
+#endif
+}
+
+bool RGBDSequenceFile::ReadImage(
+    u64 offset, u64 size, u32 encoding, usize row_size,
+    u32 height, usize stride, void* data) const {
+  const u8* stored_data = reinterpret_cast<const u8*>(region_.get_address()) + offset;
+  usize dense_size = row_size * height;
+  
+  if (encoding == static_cast<u32>(RGBDSequenceFileEncoding::kRaw)) {
+    if (size != dense_size) {
+      LOG(ERROR) << "Unexpected raw image size in RGB-D sequence file.";
+      return false;
+    }
+    if (stride == row_size) {
+      memcpy(data, stored_data, dense_size);
+    } else {
+      for (u32 y = 0; y < height; ++ y) {
+        memcpy(reinterpret_cast<u8*>(data) + y * stride, stored_data + y * row_size, row_size);
+      }
+    }
+    return true;
+  } else if (encoding == static_cast<u32>(RGBDSequenceFileEncoding::kZlib)) {
+    vector<u8> buffer;
+    u8* dense_data = reinterpret_cast<u8*>(data);
+    if (stride != row_size) {
+      buffer.resize(dense_size);
+      dense_data = buffer.data();
+    }
+    uLongf uncompressed_size = dense_size;
+    if (uncompress(dense_data, &uncompressed_size, stored_data, size) != Z_OK ||
+        uncompressed_size != dense_size) {
+      LOG(ERROR) << "Cannot decompress image in RGB-D sequence file.";
+      return false;
+    }
+    if (stride != row_size) {
+      for (u32 y = 0; y < height; ++ y) {
+        memcpy(reinterpret_cast<u8*>(data) + y * stride, dense_data + y * row_size, row_size);
+      }
+    }
+    return true;
+  }
+  
+  LOG(ERROR) << "Unknown image encoding in RGB-D sequence file: " << encoding;
+  return false;
+}
+
+
+bool ReadRGBDSequenceFile(
+    const char* path,
+    RGBDVideo<Vec3u8, u16>* rgbd_video,
+    shared_ptr<RGBDSequenceFile>* sequence_file) {
+  rgbd_video->color_frames_mutable()->clear();
+  rgbd_video->depth_frames_mutable()->clear();
+  
+  shared_ptr<RGBDSequenceFile> file(new RGBDSequenceFile());
+  if (!file->Open(path)) {
+    return false;
+  }
+  
+  for (usize frame_index = 0; frame_index < file->frame_count(); ++ frame_index) {
+    const RGBDSequenceFileFrameEntry& entry = file->frame(frame_index);
+    
+    ImageFramePtr<Vec3u8, SE3f> color_frame(new ImageFrame<Vec3u8, SE3f>(
+        "", entry.color_timestamp, TimestampToString(entry.color_timestamp)));
+    color_frame->SetGlobalTFrame(ArrayToPose(entry.color_global_T_frame));
+    color_frame->SetImageLoader([file, frame_index](Image<Vec3u8>* image) {
+      return file->ReadColor(frame_index, image);
+    });
+    rgbd_video->color_frames_mutable()->push_back(color_frame);
+    
+    ImageFramePtr<u16, SE3f> depth_frame(new ImageFrame<u16, SE3f>(
+        "", entry.depth_timestamp, TimestampToString(entry.depth_timestamp)));
+    depth_frame->SetGlobalTFrame(ArrayToPose(entry.depth_global_T_frame));
+    depth_frame->SetImageLoader([file, frame_index](Image<u16>* image) {
+      return file->ReadDepth(frame_index, image);
+    });
+    rgbd_video->depth_frames_mutable()->push_back(depth_frame);
+  }
+  
+  rgbd_video->color_camera_mutable()->reset(
+      new PinholeCamera4f(file->width(), file->height(), file->camera_parameters()));
+  rgbd_video->depth_camera_mutable()->reset(
+      new PinholeCamera4f(file->width(), file->height(), file->camera_parameters()));
+  
+  if (sequence_file) {
+    *sequence_file = file;
+  }
+  return true;
+}
+
+bool WriteRGBDSequenceFile(
+    const char* path,
+    RGBDSequenceFileEncoding encoding,
+    RGBDVideo<Vec3u8, u16>* rgbd_video) {
+  const Camera& camera = *rgbd_video->depth_camera();
+  if (camera.type() != Camera::Type::kPinholeCamera4f ||
+      !AreCamerasEqual(*rgbd_video->color_camera(), camera)) {
+    LOG(ERROR) << "RGB-D sequence files require the same PinholeCamera4f for color and depth.";
+    return false;
+  }
+  
+  RGBDSequenceFileWriter writer;
+  if (!writer.Open(path, camera.width(), camera.height(),
+                   reinterpret_cast<const float*>(camera.parameters()), encoding)) {
+    return false;
+  }
+  
+  for (usize frame_index = 0; frame_index < rgbd_video->frame_count(); ++ frame_index) {
+    const ImageFramePtr<u16, SE3f>& depth_frame = rgbd_video->depth_frame_mutable(frame_index);
+    const ImageFramePtr<Vec3u8, SE3f>& color_frame = rgbd_video->color_frame_mutable(frame_index);
+    bool depth_was_loaded = depth_frame->IsImageLoaded();
+    bool color_was_loaded = color_frame->IsImageLoaded();
+    
+    const shared_ptr<Image<u16>>& depth_image = depth_frame->GetImage();
+    const shared_ptr<Image<Vec3u8>>& color_image = color_frame->GetImage();
+    if (!depth_image || !color_image) {
+      LOG(ERROR) << "Cannot load the images of frame " << frame_index;
+      writer.Close();
+      return false;
+    }
+    
+    if (!writer.WriteFrame(
+        *depth_image, depth_frame->timestamp(), depth_frame->global_T_frame(),
+        *color_image, color_frame->timestamp(), color_frame->global_T_frame())) {
+      writer.Close();
+      return false;
+    }
+    
+    if (!depth_was_loaded) {
+      depth_frame->ClearImageAndDerivedData();
+    }
+    if (!color_was_loaded) {
+      color_frame->ClearImageAndDerivedData();
+    }
+  }
+  
+  return writer.Close();
+}
+
+}
@@ -0,0 +1,204 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include "libvis/image.h"
+#include "libvis/libvis.h"
+#include "libvis/rgbd_video.h"
+#include "libvis/sophus.h"
+
+namespace vis {
+
+// RGB-D sequence files store a complete RGB-D video (images, poses, timestamps,
+// and the pinhole camera intrinsics) in a single binary file, which can be read
+// much faster than a dataset consisting of a PNG file per image and text files
+// for the metadata. The layout is (all numbers in little-endian byte order):
+// - RGBDSequenceFileHeader.
+// - One chunk per frame, containing the frame's depth image followed by its
+//   color image. Each image starts at a multiple of kRGBDSequenceFileAlignment
+//   bytes, such that raw images in a memory mapping of the file are page
+//   aligned.
+// - The frame index, consisting of one RGBDSequenceFileFrameEntry per frame,
+//   starting at RGBDSequenceFileHeader::index_offset.
+// Depth images are stored as u16 and color images as Vec3u8, densely laid out
+// (without row padding), either raw or compressed with zlib (deflate).
+
+constexpr usize kRGBDSequenceFileAlignment = 4096;
+
+enum class RGBDSequenceFileEncoding {
+  kRaw = 0,
+  kZlib = 1
+};
+
+struct RGBDSequenceFileHeader {
+  char magic[8];  // "LVRGBDSQ"
+  u32 version;
+  u32 width;
+  u32 height;
+  u32 frame_count;
+  
+  // Parameters of the PinholeCamera4f used for color and depth: fx, fy, cx, cy
+  // (in libvis's pixel-corner origin convention).
+  float camera_parameters[4];
+  
+  // File offset of the frame index.
+  u64 index_offset;
+};
+
+struct RGBDSequenceFileFrameEntry {
+  double depth_timestamp;
+  double color_timestamp;
+  
+  // Poses as qx, qy, qz, qw, tx, ty, tz.
+  float depth_global_T_frame[7];
+  float color_global_T_frame[7];
+  
+  // File offsets and stored sizes of the images, in bytes.
+  u64 depth_offset;
+  u64 depth_size;
+  u64 color_offset;
+  u64 color_size;
+  
+  // RGBDSequenceFileEncoding of the images.
+  u32 depth_encoding;
+  u32 color_encoding;
+};
+
+// Writes an RGB-D sequence file frame by frame.
+class RGBDSequenceFileWriter {
+ public:
+  RGBDSequenceFileWriter();
+  
+  // Closes the file if it is still open.
+  ~RGBDSequenceFileWriter();
+  
+  // Creates the file. The camera parameters are those of a PinholeCamera4f
+  // (fx, fy, cx, cy). Returns true if successful.
+  bool Open(const string& path, u32 width, u32 height,
+            const float* camera_parameters, RGBDSequenceFileEncoding encoding);
+  
+  // Appends a frame to the file. The images must have the size given to
+  // Open(). Returns true if successful.
+  bool WriteFrame(
+      const Image<u16>& depth_image, double depth_timestamp, const SE3f& depth_global_T_frame,
+      const Image<Vec3u8>& color_image, double color_timestamp, const SE3f& color_global_T_frame);
+  
+  // Writes the frame index and closes the file. Returns true if successful.
+  bool Close();
+  
+ private:
+  bool WriteImage(const void* data, usize row_size, usize stride, u32 height,
+                  u64* offset, u64* size);
+  bool PadToAlignment();
+  
+  FILE* file_;
+  RGBDSequenceFileHeader header_;
+  RGBDSequenceFileEncoding encoding_;
+  vector<RGBDSequenceFileFrameEntry> index_;
+  vector<u8> buffer_;
+  u64 file_size_;
+};
+
+// Reads an RGB-D sequence file through a read-only memory mapping. Reading
+// raw images does not involve any decoding: depth_data() and color_data()
+// return pointers into the mapping, from which the data can for example be
+// copied directly into page-locked buffers for uploading to the GPU. All const
+// functions may be called from multiple threads concurrently.
+class RGBDSequenceFile {
+ public:
+  // Maps the file and checks its header and frame index. Returns true if
+  // successful.
+  bool Open(const string& path);
+  
+  // Returns a pointer to the raw depth image of the given frame within the
+  // mapping, or nullptr if the image is compressed.
+  const u16* depth_data(usize frame_index) const;
+  
+  // Returns a pointer to the raw color image of the given frame within the
+  // mapping, or nullptr if the image is compressed.
+  const Vec3u8* color_data(usize frame_index) const;
+  
+  // Reads (and decompresses if necessary) the depth image of the given frame.
+  // Returns true if successful.
+  bool ReadDepth(usize frame_index, Image<u16>* image) const;
+  
+  // Reads (and decompresses if necessary) the color image of the given frame.
+  // Returns true if successful.
+  bool ReadColor(usize frame_index, Image<Vec3u8>* image) const;
+  
+  // Hints to the operating system that the frames in [begin, end) will be
+  // accessed soon, such that it can start reading them from disk.
+  void Prefetch(usize begin, usize end) const;
+  
+  inline u32 width() const { return header_.width; }
+  inline u32 height() const { return header_.height; }
+  inline usize frame_count() const { return header_.frame_count; }
+  inline const float* camera_parameters() const { return header_.camera_parameters; }
+  inline const RGBDSequenceFileFrameEntry& frame(usize frame_index) const { return index_[frame_index]; }
+  
+ private:
+  bool ReadImage(u64 offset, u64 size, u32 encoding, usize row_size,
+                 u32 height, usize stride, void* data) const;
+  
+  boost::interprocess::file_mapping file_mapping_;
+  boost::interprocess::mapped_region region_;
+  RGBDSequenceFileHeader header_;
+  const RGBDSequenceFileFrameEntry* index_;
+};
+
+// Reads an RGB-D sequence file into an RGBDVideo. The images are loaded on
+// demand from the file (which stays mapped as long as any of the video's
+// frames exists), so they can be freed with ClearImageAndDerivedData(). If
+// sequence_file is non-null, it is set to the opened file to allow direct
+// access to the mapped images. Returns true if successful.
+bool ReadRGBDSequenceFile(
+    const char* path,
+    RGBDVideo<Vec3u8, u16>* rgbd_video,
+    shared_ptr<RGBDSequenceFile>* sequence_file = nullptr);
+
+// Writes all frames of an RGBDVideo, which must use the same PinholeCamera4f
+// for color and depth, to an RGB-D sequence file. Images which are not loaded
+// are loaded for writing and freed again afterwards. Returns true if
+// successful.
+bool WriteRGBDSequenceFile(
+    const char* path,
+    RGBDSequenceFileEncoding encoding,
+    RGBDVideo<Vec3u8, u16>* rgbd_video);
+
+}
@@ -0,0 +1,463 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+
+#include "libvis/libvis.h"
+#include "libvis/rgbd_video.h"
+
+namespace vis {
+
+// Manages which images of an RGBDVideo are loaded. Loads the images ahead of
+// time in a fixed number of background threads, such that reading and
+// decoding the image files does not block the thread which processes the
+// video, and frees images to stay within a memory budget. Usage:
+// - Prefetch(begin, end) sets the window of frames [begin, end) which are
+//   currently needed or will be needed soon, and requests them to be loaded.
+// - WaitForFrame(i) must be called before accessing the images of frame i. If
+//   the frame has not been loaded yet, it is loaded in the calling thread.
+// - Release(i) frees the images of frame i (and their derived data) once they
+//   are no longer needed.
+// A frame's color and depth image are always loaded and freed together.
+// 
+// Loading only starts for as many requested frames as fit into the memory
+// budget, together with the frames that are already loaded. Since the size of
+// a frame is only known after loading it, the size of the latest loaded frame
+// is used as an estimate. To make room for requested frames, loaded frames
+// outside of the window are evicted in least-recently-used order (where a use
+// is a WaitForFrame() call). They are loaded again if they are accessed later.
+// Frames whose images cannot be reloaded (see ImageCache::CanReloadImage()) are
+// never evicted. WaitForFrame() ignores the budget.
+// 
+// The images of frames within the window stay loaded until they are released.
+// The images of other frames may be evicted in the next call to Prefetch() or
+// WaitForFrame(), which therefore must all be called from the thread which
+// accesses the images (as well as Release()). Since the image caches are not
+// thread-safe, the images of a frame must not be accessed between requesting
+// it and calling WaitForFrame() for it. The video's frame vectors must not be
+// modified while the prefetcher exists.
+template<typename ColorT, typename DepthT>
+class RGBDVideoPrefetcher {
+ public:
+  // Creates the prefetcher and starts thread_count loading threads. With a
+  // thread_count of zero, all frames are loaded in WaitForFrame().
+  RGBDVideoPrefetcher(
+      RGBDVideo<ColorT, DepthT>* video,
+      int thread_count,
+      usize max_bytes)
+      : video_(video),
+        states_(video->frame_count(), State::kNotLoaded),
+        release_after_loading_(video->frame_count(), false),
+        frame_bytes_(video->frame_count(), 0),
+        lru_positions_(video->frame_count()),
+        window_begin_(0),
+        window_end_(0),
+        max_bytes_(max_bytes),
+        committed_bytes_(0),
+        pending_count_(0),
+        loaded_bytes_(0),
+        peak_loaded_bytes_(0),
+        frame_bytes_estimate_(0),
+        hit_count_(0),
+        miss_count_(0),
+        eviction_count_(0),
+        exit_(false) {
+    CHECK_EQ(video->color_frames_mutable()->size(), video->depth_frames_mutable()->size());
+    for (int i = 0; i < thread_count; ++ i) {
+      threads_.emplace_back(&RGBDVideoPrefetcher<ColorT, DepthT>::ThreadMain, this);
+    }
+  }
+  
+  // Waits for frames which are being loaded and stops the loading threads.
+  // Loaded images stay in the video's image caches.
+  ~RGBDVideoPrefetcher() {
+    unique_lock<mutex> lock(mutex_);
+    exit_ = true;
+    lock.unlock();
+    queue_condition_.notify_all();
+    for (thread& t : threads_) {
+      t.join();
+    }
+  }
+  
+  // Sets the window of needed frames to [begin, end) and requests these frames
+  // to be loaded in the background. Frames which are already requested or
+  // loaded are skipped. Requests for frames outside of the new window which
+  // did not start loading yet are dropped.
+  void Prefetch(usize begin, usize end) {
+    end = std::min(end, states_.size());
+    
+    unique_lock<mutex> lock(mutex_);
+    window_begin_ = begin;
+    window_end_ = end;
+    DropRequestsOutsideWindow();
+    for (usize frame_index = begin; frame_index < end; ++ frame_index) {
+      if (states_[frame_index] == State::kNotLoaded) {
+        states_[frame_index] = State::kRequested;
+        requested_.push_back(frame_index);
+      }
+    }
+    EvictWhileOverBudget(numeric_limits<usize>::max());
+    StartLoadingWithinBudget();
+    lock.unlock();
+    queue_condition_.notify_all();
+  }
+  
+  // Returns once the images of the given frame are loaded.
+  void WaitForFrame(usize frame_index) {
+    unique_lock<mutex> lock(mutex_);
+    State state = states_.at(frame_index);
+    if (state == State::kLoaded) {
+      ++ hit_count_;
+      lru_.splice(lru_.end(), lru_, lru_positions_[frame_index]);
+      return;
+    }
+    ++ miss_count_;
+    
+    if (state == State::kLoading) {
+      loaded_condition_.wait(lock, [&]{ return states_[frame_index] != State::kLoading; });
+      state = states_[frame_index];
+    }
+    
+    if (state != State::kLoaded) {
+      // Load the frame in this thread. If it is queued, the loading threads
+      // will skip it since its state changes.
+      if (state == State::kNotLoaded || state == State::kRequested) {
+        frame_bytes_[frame_index] = frame_bytes_estimate_;
+        committed_bytes_ += frame_bytes_estimate_;
+        ++ pending_count_;
+      }
+      states_[frame_index] = State::kLoading;
+      lock.unlock();
+      
+      usize bytes = LoadFrame(frame_index);
+      
+      lock.lock();
+      FinishLoading(frame_index, bytes);
+    }
+    
+    EvictWhileOverBudget(frame_index);
+  }
+  
+  // Frees the images of the given frame and all data derived from them. If the
+  // frame is currently being loaded, it is freed after loading finishes.
+  void Release(usize frame_index) {
+    unique_lock<mutex> lock(mutex_);
+    if (states_.at(frame_index) == State::kLoading) {
+      release_after_loading_[frame_index] = true;
+      return;
+    }
+    
+    Unload(frame_index);
+    
+    StartLoadingWithinBudget();
+    lock.unlock();
+    queue_condition_.notify_all();
+  }
+  
+  // Returns the number of bytes of the images which are currently loaded.
+  inline usize loaded_bytes() const {
+    unique_lock<mutex> lock(mutex_);
+    return loaded_bytes_;
+  }
+  
+  // Returns the maximum of loaded_bytes() so far.
+  inline usize peak_loaded_bytes() const {
+    unique_lock<mutex> lock(mutex_);
+    return peak_loaded_bytes_;
+  }
+  
+  // Returns the number of WaitForFrame() calls for which the frame was loaded
+  // already.
+  inline usize hit_count() const {
+    unique_lock<mutex> lock(mutex_);
+    return hit_count_;
+  }
+  
+  // Returns the number of WaitForFrame() calls which had to wait for a frame
+  // or load it.
+  inline usize miss_count() const {
+    unique_lock<mutex> lock(mutex_);
+    return miss_count_;
+  }
+  
+  // Returns the number of frames which were evicted to stay within the memory
+  // budget.
+  inline usize eviction_count() const {
+    unique_lock<mutex> lock(mutex_);
+    return eviction_count_;
+  }
+  
+ private:
+  enum class State {
+    // The images are not loaded by the prefetcher.
+    kNotLoaded = 0,
+    
+    // The frame was requested, but loading is deferred because of the memory
+    // budget.
+    kRequested,
+    
+    // The frame is in the queue of the loading threads.
+    kQueued,
+    
+    // The images are being loaded.
+    kLoading,
+    
+    // The images are loaded.
+    kLoaded
+  };
+  
+  void ThreadMain() {
+    unique_lock<mutex> lock(mutex_);
+    while (true) {
+      queue_condition_.wait(lock, [&]{ return exit_ || !queue_.empty(); });
+      if (exit_) {
+        return;
+      }
+      
+      usize frame_index = queue_.front();
+      queue_.pop_front();
+      if (states_[frame_index] != State::kQueued) {
+        // The frame was dropped or loaded by WaitForFrame() in the meantime.
+        continue;
+      }
+      states_[frame_index] = State::kLoading;
+      lock.unlock();
+      
+      usize bytes = LoadFrame(frame_index);
+      
+      lock.lock();
+      FinishLoading(frame_index, bytes);
+    }
+  }
+  
+  // Moves requested frames into the loading queue (in the order in which they
+  // were requested) while they fit into the memory budget. A frame which does
+  // not fit is still loaded if nothing else is, such that progress is made with
+  // frames that are larger than the budget. As long as the size of a frame is
+  // not known, only one frame is loaded at a time. Must be called with mutex_
+  // locked.
+  void StartLoadingWithinBudget() {
+    while (!requested_.empty()) {
+      usize frame_index = requested_.front();
+      if (states_[frame_index] != State::kRequested) {
+        requested_.pop_front();
+        continue;
+      }
+      
+      bool over_budget = committed_bytes_ + frame_bytes_estimate_ > max_bytes_;
+      bool size_unknown = frame_bytes_estimate_ == 0;
+      if ((over_budget && committed_bytes_ > 0) ||
+          (size_unknown && pending_count_ > 0)) {
+        return;
+      }
+      
+      requested_.pop_front();
+      states_[frame_index] = State::kQueued;
+      frame_bytes_[frame_index] = frame_bytes_estimate_;
+      committed_bytes_ += frame_bytes_estimate_;
+      ++ pending_count_;
+      queue_.push_back(frame_index);
+    }
+  }
+  
+  // Resets requested and queued frames outside of the window to the
+  // kNotLoaded state. Must be called with mutex_ locked.
+  void DropRequestsOutsideWindow() {
+    for (usize frame_index : requested_) {
+      if (states_[frame_index] == State::kRequested && !IsInWindow(frame_index)) {
+        states_[frame_index] = State::kNotLoaded;
+      }
+    }
+    for (usize frame_index : queue_) {
+      if (states_[frame_index] == State::kQueued && !IsInWindow(frame_index)) {
+        Unload(frame_index);
+      }
+    }
+  }
+  
+  // Evicts loaded frames outside of the window, except protected_frame_index,
+  // in least-recently-used order while the loaded and requested frames do not
+  // fit into the memory budget. Must be called with mutex_ locked, from the
+  // thread which accesses the images.
+  void EvictWhileOverBudget(usize protected_frame_index) {
+    usize required_bytes = committed_bytes_;
+    for (usize frame_index : requested_) {
+      if (states_[frame_index] == State::kRequested) {
+        required_bytes += frame_bytes_estimate_;
+      }
+    }
+    
+    auto it = lru_.begin();
+    while (required_bytes > max_bytes_ && it != lru_.end()) {
+      usize frame_index = *it;
+      ++ it;
+      if (IsInWindow(frame_index) ||
+          frame_index == protected_frame_index ||
+          !video_->color_frame_mutable(frame_index)->CanReloadImage() ||
+          !video_->depth_frame_mutable(frame_index)->CanReloadImage()) {
+        continue;
+      }
+      
+      required_bytes -= frame_bytes_[frame_index];
+      Unload(frame_index);
+      ++ eviction_count_;
+    }
+  }
+  
+  // Updates the state of a frame after LoadFrame(). Must be called with mutex_
+  // locked.
+  void FinishLoading(usize frame_index, usize bytes) {
+    committed_bytes_ -= frame_bytes_[frame_index];
+    -- pending_count_;
+    frame_bytes_estimate_ = bytes;
+    
+    if (release_after_loading_[frame_index]) {
+      release_after_loading_[frame_index] = false;
+      frame_bytes_[frame_index] = 0;
+      states_[frame_index] = State::kNotLoaded;
+      ClearFrame(frame_index);
+    } else {
+      frame_bytes_[frame_index] = bytes;
+      committed_bytes_ += bytes;
+      loaded_bytes_ += bytes;
+      peak_loaded_bytes_ = std::max(peak_loaded_bytes_, loaded_bytes_);
+      states_[frame_index] = State::kLoaded;
+      lru_positions_[frame_index] = lru_.insert(lru_.end(), frame_index);
+    }
+    
+    StartLoadingWithinBudget();
+    loaded_condition_.notify_all();
+    queue_condition_.notify_all();
+  }
+  
+  // Frees the images of a frame which is not being loaded and resets it to the
+  // kNotLoaded state. Must be called with mutex_ locked.
+  void Unload(usize frame_index) {
+    State state = states_[frame_index];
+    committed_bytes_ -= frame_bytes_[frame_index];
+    if (state == State::kQueued) {
+      -- pending_count_;
+    } else if (state == State::kLoaded) {
+      loaded_bytes_ -= frame_bytes_[frame_index];
+      lru_.erase(lru_positions_[frame_index]);
+    }
+    frame_bytes_[frame_index] = 0;
+    states_[frame_index] = State::kNotLoaded;
+    ClearFrame(frame_index);
+  }
+  
+  // Loads the color and depth image of the frame and returns their size in
+  // bytes. Called without mutex_ being locked.
+  usize LoadFrame(usize frame_index) {
+    usize bytes = 0;
+    
+    const shared_ptr<Image<ColorT>>& color_image = video_->color_frame_mutable(frame_index)->GetImage();
+    if (color_image) {
+      bytes += color_image->height() * color_image->stride();
+    } else {
+      LOG(ERROR) << "Cannot load color image of frame " << frame_index;
+    }
+    
+    const shared_ptr<Image<DepthT>>& depth_image = video_->depth_frame_mutable(frame_index)->GetImage();
+    if (depth_image) {
+      bytes += depth_image->height() * depth_image->stride();
+    } else {
+      LOG(ERROR) << "Cannot load depth image of frame " << frame_index;
+    }
+    
+    return bytes;
+  }
+  
+  void ClearFrame(usize frame_index) {
+    video_->color_frame_mutable(frame_index)->ClearImageAndDerivedData();
+    video_->depth_frame_mutable(frame_index)->ClearImageAndDerivedData();
+  }
+  
+  inline bool IsInWindow(usize frame_index) const {
+    return frame_index >= window_begin_ && frame_index < window_end_;
+  }
+  
+  RGBDVideo<ColorT, DepthT>* video_;
+  
+  // Per-frame state, protected by mutex_.
+  vector<State> states_;
+  vector<bool> release_after_loading_;
+  
+  // Number of bytes that are accounted for each frame in committed_bytes_.
+  vector<usize> frame_bytes_;
+  
+  // Frames in the kRequested state, in the order of the requests.
+  deque<usize> requested_;
+  
+  // Frames in the kQueued state, in the order of the requests.
+  deque<usize> queue_;
+  
+  // Frames in the kLoaded state, from the least recently to the most recently
+  // used one, and the position of each loaded frame in this list.
+  list<usize> lru_;
+  vector<list<usize>::iterator> lru_positions_;
+  
+  // The window set by the latest Prefetch() call.
+  usize window_begin_;
+  usize window_end_;
+  
+  // The memory budget, and the (estimated) number of bytes of the frames that
+  // are queued, being loaded, or loaded.
+  usize max_bytes_;
+  usize committed_bytes_;
+  
+  // Number of frames in the kQueued or kLoading state.
+  usize pending_count_;
+  
+  usize loaded_bytes_;
+  usize peak_loaded_bytes_;
+  usize frame_bytes_estimate_;
+  
+  usize hit_count_;
+  usize miss_count_;
+  usize eviction_count_;
+  
+  bool exit_;
+  mutable mutex mutex_;
+  condition_variable queue_condition_;
+  condition_variable loaded_condition_;
+  vector<thread> threads_;
+};
+
+}
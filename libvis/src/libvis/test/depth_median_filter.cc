@@ -0,0 +1,175 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <algorithm>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "libvis/depth_median_filter.h"
+#include "libvis/image.h"
+#include "libvis/timing.h"
+
+using namespace vis;
+
+namespace {
+
+// Straightforward implementation of MedianFilterAndDensifyDepthMap(), as it
+// was used in the SurfelMeshing application before.
+void MedianFilterAndDensifyDepthMapReference(const Image<u16>& input, Image<u16>* output) {
+  vector<u16> values;
+  
+  constexpr int kRadius = 1;
+  constexpr int kMinNeighbors = 2;
+  
+  for (int y = 0; y < static_cast<int>(input.height()); ++ y) {
+    for (int x = 0; x < static_cast<int>(input.width()); ++ x) {
+      values.clear();
+      
+      int dy_end = std::min<int>(input.height() - 1, y + kRadius);
+      for (int dy = std::max<int>(0, static_cast<int>(y) - kRadius);
+           dy <= dy_end;
+           ++ dy) {
+        int dx_end = std::min<int>(input.width() - 1, x + kRadius);
+        for (int dx = std::max<int>(0, static_cast<int>(x) - kRadius);
+             dx <= dx_end;
+             ++ dx) {
+          if (input(dx, dy) != 0) {
+            values.push_back(input(dx, dy));
+          }
+        }
+      }
+      
+      if (values.size() >= kMinNeighbors) {
+        std::sort(values.begin(), values.end());
+        if (values.size() % 2 == 0) {
+          // Take the element which is closer to the average.
+          float sum = 0;
+          for (u16 value : values) {
+            sum += value;
+          }
+          float average = sum / values.size();
+          
+          float prev_diff = std::fabs(values[values.size() / 2 - 1] - average);
+          float next_diff = std::fabs(values[values.size() / 2] - average);
+          (*output)(x, y) = (prev_diff < next_diff) ? values[values.size() / 2 - 1] : values[values.size() / 2];
+        } else {
+          (*output)(x, y) = values[values.size() / 2];
+        }
+      } else {
+        (*output)(x, y) = input(x, y);
+      }
+    }
+  }
+}
+
+// Creates a noisy depth map in which a fraction of the pixels is invalid.
+// Small value ranges make ties between the two middle values likely.
+void CreateTestDepthMap(int width, int height, float invalid_fraction, int value_range, Image<u16>* depth) {
+  depth->SetSize(width, height);
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      bool invalid = rand() < invalid_fraction * RAND_MAX;
+      (*depth)(x, y) = invalid ? 0 : (1 + (3 * x + 2 * y) % 5000 + rand() % value_range);
+    }
+  }
+}
+
+}
+
+// Compares the result to the reference implementation for various image sizes
+// (including sizes which are not multiples of the vector width), fractions of
+// invalid pixels, and thread counts.
+TEST(DepthMedianFilter, MatchesReference) {
+  srand(0);
+  const int sizes[][2] = {{1, 1}, {2, 5}, {3, 3}, {9, 4}, {17, 9}, {64, 48}, {641, 37}};
+  for (const auto& size : sizes) {
+    for (float invalid_fraction : {0.f, 0.3f, 0.7f, 0.95f}) {
+      for (int value_range : {4, 60000}) {
+        Image<u16> input;
+        CreateTestDepthMap(size[0], size[1], invalid_fraction, value_range, &input);
+        Image<u16> expected(input.size());
+        MedianFilterAndDensifyDepthMapReference(input, &expected);
+        
+        for (int thread_count : {1, 3}) {
+          Image<u16> output;
+          MedianFilterAndDensifyDepthMap(input, &output, thread_count);
+          ASSERT_EQ(expected.size(), output.size());
+          for (u32 y = 0; y < input.height(); ++ y) {
+            for (u32 x = 0; x < input.width(); ++ x) {
+              ASSERT_EQ(expected(x, y), output(x, y))
+                  << "at (" << x << ", " << y << ") for size " << size[0] << "x" << size[1]
+                  << ", invalid_fraction " << invalid_fraction << ", value_range " << value_range;
+            }
+          }
+        }
+      }
+    }
+  }
+}
+
+// Measures the throughput of the filter for common image sizes, compared to
+// the reference implementation.
+TEST(DepthMedianFilter, DISABLED_ThroughputBenchmark) {
+  constexpr int kRepetitions = 5;
+  
+  vector<int> thread_counts = {1};
+  int hardware_thread_count = std::max<int>(1, std::thread::hardware_concurrency());
+  if (hardware_thread_count > 1) {
+    thread_counts.push_back(hardware_thread_count);
+  }
+  
+  srand(0);
+  for (const Vec2i& size : {Vec2i(640, 480), Vec2i(1280, 720)}) {
+    Image<u16> input;
+    CreateTestDepthMap(size.x(), size.y(), 0.2f, 20, &input);
+    Image<u16> output(input.size());
+    
+    Timer timer("");
+    for (int repetition = 0; repetition < kRepetitions; ++ repetition) {
+      MedianFilterAndDensifyDepthMapReference(input, &output);
+    }
+    double seconds = timer.Stop(false) / kRepetitions;
+    LOG(INFO) << size.x() << "x" << size.y() << ", reference: " << (1000 * seconds) << " ms ("
+              << (1e-6 * size.x() * size.y() / seconds) << " Mpix/s)";
+    
+    for (int thread_count : thread_counts) {
+      timer.Start();
+      for (int repetition = 0; repetition < kRepetitions; ++ repetition) {
+        MedianFilterAndDensifyDepthMap(input, &output, thread_count);
+      }
+      seconds = timer.Stop(false) / kRepetitions;
+      LOG(INFO) << size.x() << "x" << size.y() << ", " << thread_count << " thread(s): "
+                << (1000 * seconds) << " ms (" << (1e-6 * size.x() * size.y() / seconds) << " Mpix/s)";
+    }
+  }
+}
@@ -0,0 +1,224 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <stdio.h>
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "libvis/mesh.h"
+#include "libvis/ply_writer.h"
+#include "libvis/point_cloud.h"
+#include "libvis/timing.h"
+
+using namespace vis;
+
+namespace {
+
+// Creates a temporary directory and deletes it including its contents again.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    path_ = boost::filesystem::temp_directory_path() /
+            boost::filesystem::unique_path("libvis_ply_writer_test_%%%%%%%%");
+    boost::filesystem::create_directories(path_);
+  }
+  
+  ~TemporaryDirectory() {
+    boost::filesystem::remove_all(path_);
+  }
+  
+  inline string File(const string& filename) const {
+    return (path_ / filename).string();
+  }
+  
+ private:
+  boost::filesystem::path path_;
+};
+
+// Reads a file into a string.
+string ReadFile(const string& path) {
+  string contents;
+  FILE* file = fopen(path.c_str(), "rb");
+  CHECK(file);
+  char buffer[4096];
+  usize read_size;
+  while ((read_size = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    contents.append(buffer, read_size);
+  }
+  fclose(file);
+  return contents;
+}
+
+// Reads a value of type T at the offset and advances the offset.
+template <typename T>
+T ReadValue(const string& contents, usize* offset) {
+  T value;
+  CHECK_LE(*offset + sizeof(T), contents.size());
+  memcpy(&value, contents.data() + *offset, sizeof(T));
+  *offset += sizeof(T);
+  return value;
+}
+
+// Creates a grid mesh with the given number of vertices per side and two
+// triangles per grid cell.
+void CreateGridMesh(int side_length, Mesh3fCu8* mesh) {
+  mesh->vertices_mutable()->reset(new Point3fC3u8Cloud(side_length * side_length));
+  Point3fC3u8Cloud* vertices = mesh->vertices_mutable()->get();
+  for (int y = 0; y < side_length; ++ y) {
+    for (int x = 0; x < side_length; ++ x) {
+      (*vertices)[x + side_length * y] = Point3fC3u8(
+          Vec3f(0.01f * x, 0.02f * y, 0.001f * ((x * y) % 97)),
+          Vec3u8(x % 256, y % 256, (x + y) % 256));
+    }
+  }
+  
+  mesh->triangles_mutable()->clear();
+  for (int y = 0; y < side_length - 1; ++ y) {
+    for (int x = 0; x < side_length - 1; ++ x) {
+      u32 index = x + side_length * y;
+      mesh->AddTriangle(Triangle<u32>(index, index + 1, index + side_length));
+      mesh->AddTriangle(Triangle<u32>(index + 1, index + side_length + 1, index + side_length));
+    }
+  }
+}
+
+}
+
+// Writes a colored mesh and checks the header and all values in the file.
+TEST(PLYWriter, WritesMesh) {
+  Mesh3fCu8 mesh;
+  CreateGridMesh(5, &mesh);
+  
+  TemporaryDirectory directory;
+  string path = directory.File("mesh.ply");
+  ASSERT_TRUE(mesh.WriteAsPLY(path.c_str()));
+  
+  const string expected_header =
+      "ply\n"
+      "format binary_little_endian 1.0\n"
+      "element vertex 25\n"
+      "property float x\n"
+      "property float y\n"
+      "property float z\n"
+      "property uchar red\n"
+      "property uchar green\n"
+      "property uchar blue\n"
+      "element face 32\n"
+      "property list uchar int vertex_indices\n"
+      "end_header\n";
+  string contents = ReadFile(path);
+  ASSERT_EQ(expected_header.size() + 25 * 15 + 32 * 13, contents.size());
+  EXPECT_EQ(expected_header, contents.substr(0, expected_header.size()));
+  
+  usize offset = expected_header.size();
+  for (usize i = 0; i < mesh.vertices()->size(); ++ i) {
+    const Point3fC3u8& point = (*mesh.vertices())[i];
+    EXPECT_EQ(point.position().x(), ReadValue<float>(contents, &offset));
+    EXPECT_EQ(point.position().y(), ReadValue<float>(contents, &offset));
+    EXPECT_EQ(point.position().z(), ReadValue<float>(contents, &offset));
+    EXPECT_EQ(point.color().x(), ReadValue<u8>(contents, &offset));
+    EXPECT_EQ(point.color().y(), ReadValue<u8>(contents, &offset));
+    EXPECT_EQ(point.color().z(), ReadValue<u8>(contents, &offset));
+  }
+  for (const Triangle<u32>& triangle : mesh.triangles()) {
+    EXPECT_EQ(3, ReadValue<u8>(contents, &offset));
+    EXPECT_EQ(static_cast<i32>(triangle.index(0)), ReadValue<i32>(contents, &offset));
+    EXPECT_EQ(static_cast<i32>(triangle.index(1)), ReadValue<i32>(contents, &offset));
+    EXPECT_EQ(static_cast<i32>(triangle.index(2)), ReadValue<i32>(contents, &offset));
+  }
+  EXPECT_EQ(contents.size(), offset);
+}
+
+// Writes a point cloud without colors and checks that there is no face element
+// and no color property.
+TEST(PLYWriter, WritesPointCloud) {
+  Point3fCloud cloud(3);
+  for (int i = 0; i < 3; ++ i) {
+    cloud[i] = Point3f(Vec3f(i, 2 * i, 3 * i));
+  }
+  
+  TemporaryDirectory directory;
+  string path = directory.File("cloud.ply");
+  ASSERT_TRUE(cloud.WriteAsPLY(path.c_str()));
+  
+  const string expected_header =
+      "ply\n"
+      "format binary_little_endian 1.0\n"
+      "element vertex 3\n"
+      "property float x\n"
+      "property float y\n"
+      "property float z\n"
+      "end_header\n";
+  string contents = ReadFile(path);
+  ASSERT_EQ(expected_header.size() + 3 * 3 * sizeof(float), contents.size());
+  EXPECT_EQ(expected_header, contents.substr(0, expected_header.size()));
+  usize offset = expected_header.size();
+  for (int i = 0; i < 3; ++ i) {
+    EXPECT_EQ(i, ReadValue<float>(contents, &offset));
+    EXPECT_EQ(2 * i, ReadValue<float>(contents, &offset));
+    EXPECT_EQ(3 * i, ReadValue<float>(contents, &offset));
+  }
+}
+
+TEST(PLYWriter, FailsForInvalidPath) {
+  Point3fCloud cloud(1);
+  EXPECT_FALSE(cloud.WriteAsPLY("/nonexistent_directory/cloud.ply"));
+}
+
+// Compares the time for writing a mesh with 4 million vertices and about 8
+// million triangles as PLY and as OBJ.
+TEST(PLYWriter, DISABLED_ThroughputBenchmark) {
+  constexpr int kSideLength = 2000;
+  Mesh3fCu8 mesh;
+  CreateGridMesh(kSideLength, &mesh);
+  
+  TemporaryDirectory directory;
+  string ply_path = directory.File("mesh.ply");
+  string obj_path = directory.File("mesh.obj");
+  
+  Timer ply_timer("");
+  ASSERT_TRUE(mesh.WriteAsPLY(ply_path.c_str()));
+  double ply_seconds = ply_timer.Stop(false);
+  
+  Timer obj_timer("");
+  ASSERT_TRUE(mesh.WriteAsOBJ(obj_path.c_str()));
+  double obj_seconds = obj_timer.Stop(false);
+  
+  const double triangle_millions = mesh.triangles().size() / (1000.0 * 1000.0);
+  LOG(INFO) << "Mesh with " << mesh.vertices()->size() << " vertices and "
+            << mesh.triangles().size() << " triangles:";
+  LOG(INFO) << "PLY (binary): " << (1000 * ply_seconds) << " ms, "
+            << (triangle_millions / ply_seconds) << " M triangles/s, file size "
+            << (boost::filesystem::file_size(ply_path) / (1024.0 * 1024.0)) << " MiB";
+  LOG(INFO) << "OBJ (text): " << (1000 * obj_seconds) << " ms, "
+            << (triangle_millions / obj_seconds) << " M triangles/s, file size "
+            << (boost::filesystem::file_size(obj_path) / (1024.0 * 1024.0)) << " MiB";
+}
@@ -0,0 +1,278 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "libvis/image.h"
+#include "libvis/rgbd_sequence_file.h"
+#include "libvis/rgbd_video.h"
+#include "libvis/timing.h"
+
+using namespace vis;
+
+namespace {
+
+// Creates a temporary directory and deletes it including its contents again.
+class TemporaryDirectory {
+ public:
+  TemporaryDirectory() {
+    path_ = boost::filesystem::temp_directory_path() /
+            boost::filesystem::unique_path("libvis_sequence_file_test_%%%%%%%%");
+    boost::filesystem::create_directories(path_);
+  }
+  
+  ~TemporaryDirectory() {
+    boost::filesystem::remove_all(path_);
+  }
+  
+  inline string File(const string& filename) const {
+    return (path_ / filename).string();
+  }
+  
+ private:
+  boost::filesystem::path path_;
+};
+
+// Fills the images with smooth content plus some noise, which roughly
+// resembles real RGB-D data regarding compressibility.
+void CreateTestImages(int width, int height, int frame_index, Image<u16>* depth, Image<Vec3u8>* color) {
+  depth->SetSize(width, height);
+  color->SetSize(width, height);
+  for (int y = 0; y < height; ++ y) {
+    for (int x = 0; x < width; ++ x) {
+      int noise = rand() % 8;
+      (*depth)(x, y) = (x + y + 10 * frame_index) % 10 == 0 ? 0 : (4000 + 5 * x + 3 * y + 7 * frame_index + noise);
+      (*color)(x, y) = Vec3u8((x + frame_index) % 256, y % 256, (x + y + noise) % 256);
+    }
+  }
+}
+
+// Creates a video with frame_count frames whose images are kept in memory.
+void CreateTestVideo(int width, int height, int frame_count, RGBDVideo<Vec3u8, u16>* video) {
+  srand(0);
+  for (int i = 0; i < frame_count; ++ i) {
+    shared_ptr<Image<u16>> depth(new Image<u16>());
+    shared_ptr<Image<Vec3u8>> color(new Image<Vec3u8>());
+    CreateTestImages(width, height, i, depth.get(), color.get());
+    
+    ImageFramePtr<u16, SE3f> depth_frame(new ImageFrame<u16, SE3f>(depth));
+    depth_frame->SetTimestamp(1000.5 + 0.1 * i);
+    depth_frame->SetGlobalTFrame(SE3f(Sophus::SO3f::exp(Vec3f(0.1f * i, 0.2f, -0.3f)), Vec3f(i, 2, 3)));
+    video->depth_frames_mutable()->push_back(depth_frame);
+    
+    ImageFramePtr<Vec3u8, SE3f> color_frame(new ImageFrame<Vec3u8, SE3f>(color));
+    color_frame->SetTimestamp(1000.55 + 0.1 * i);
+    color_frame->SetGlobalTFrame(SE3f(Sophus::SO3f::exp(Vec3f(-0.1f * i, 0.2f, 0.3f)), Vec3f(1, i, 3)));
+    video->color_frames_mutable()->push_back(color_frame);
+  }
+  
+  float parameters[4] = {0.8f * width, 0.8f * width, 0.5f * width, 0.5f * height};
+  video->depth_camera_mutable()->reset(new PinholeCamera4f(width, height, parameters));
+  video->color_camera_mutable()->reset(new PinholeCamera4f(width, height, parameters));
+}
+
+template<typename T>
+void ExpectImagesEqual(const Image<T>& expected, const Image<T>& actual) {
+  ASSERT_EQ(expected.width(), actual.width());
+  ASSERT_EQ(expected.height(), actual.height());
+  for (u32 y = 0; y < expected.height(); ++ y) {
+    for (u32 x = 0; x < expected.width(); ++ x) {
+      ASSERT_EQ(expected(x, y), actual(x, y)) << "at (" << x << ", " << y << ")";
+    }
+  }
+}
+
+void ExpectPosesNear(const SE3f& expected, const SE3f& actual) {
+  EXPECT_LT((expected.inverse() * actual).log().norm(), 1e-5f);
+}
+
+void TestRoundTrip(RGBDSequenceFileEncoding encoding) {
+  constexpr int kWidth = 67;
+  constexpr int kHeight = 41;
+  constexpr int kFrameCount = 5;
+  
+  RGBDVideo<Vec3u8, u16> video;
+  CreateTestVideo(kWidth, kHeight, kFrameCount, &video);
+  
+  TemporaryDirectory directory;
+  string path = directory.File("sequence.lvrgbd");
+  ASSERT_TRUE(WriteRGBDSequenceFile(path.c_str(), encoding, &video));
+  
+  RGBDVideo<Vec3u8, u16> read_video;
+  shared_ptr<RGBDSequenceFile> sequence_file;
+  ASSERT_TRUE(ReadRGBDSequenceFile(path.c_str(), &read_video, &sequence_file));
+  ASSERT_EQ(video.frame_count(), read_video.frame_count());
+  EXPECT_TRUE(AreCamerasEqual(*video.depth_camera(), *read_video.depth_camera()));
+  EXPECT_TRUE(AreCamerasEqual(*video.color_camera(), *read_video.color_camera()));
+  
+  for (usize i = 0; i < video.frame_count(); ++ i) {
+    const ImageFramePtr<u16, SE3f>& depth_frame = read_video.depth_frame_mutable(i);
+    const ImageFramePtr<Vec3u8, SE3f>& color_frame = read_video.color_frame_mutable(i);
+    EXPECT_FALSE(depth_frame->IsImageLoaded());
+    EXPECT_TRUE(depth_frame->CanReloadImage());
+    
+    ExpectImagesEqual(*video.depth_frame_mutable(i)->GetImage(), *depth_frame->GetImage());
+    ExpectImagesEqual(*video.color_frame_mutable(i)->GetImage(), *color_frame->GetImage());
+    EXPECT_DOUBLE_EQ(video.depth_frame_mutable(i)->timestamp(), depth_frame->timestamp());
+    EXPECT_DOUBLE_EQ(video.color_frame_mutable(i)->timestamp(), color_frame->timestamp());
+    ExpectPosesNear(video.depth_frame_mutable(i)->global_T_frame(), depth_frame->global_T_frame());
+    ExpectPosesNear(video.color_frame_mutable(i)->global_T_frame(), color_frame->global_T_frame());
+    
+    // Images can be freed and loaded again.
+    depth_frame->ClearImageAndDerivedData();
+    EXPECT_FALSE(depth_frame->IsImageLoaded());
+    ExpectImagesEqual(*video.depth_frame_mutable(i)->GetImage(), *depth_frame->GetImage());
+    
+    // Raw images are accessible directly in the mapping.
+    if (encoding == RGBDSequenceFileEncoding::kRaw) {
+      const u16* depth_data = sequence_file->depth_data(i);
+      ASSERT_TRUE(depth_data != nullptr);
+      EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(depth_data) % kRGBDSequenceFileAlignment);
+      EXPECT_EQ(video.depth_frame_mutable(i)->GetImage()->operator()(kWidth - 1, kHeight - 1),
+                depth_data[kWidth * kHeight - 1]);
+      ASSERT_TRUE(sequence_file->color_data(i) != nullptr);
+    } else {
+      EXPECT_TRUE(sequence_file->depth_data(i) == nullptr);
+      EXPECT_TRUE(sequence_file->color_data(i) == nullptr);
+    }
+  }
+}
+
+}
+
+TEST(RGBDSequenceFile, RoundTripRaw) {
+  TestRoundTrip(RGBDSequenceFileEncoding::kRaw);
+}
+
+TEST(RGBDSequenceFile, RoundTripZlib) {
+  TestRoundTrip(RGBDSequenceFileEncoding::kZlib);
+}
+
+TEST(RGBDSequenceFile, RejectsInvalidFiles) {
+  TemporaryDirectory directory;
+  RGBDVideo<Vec3u8, u16> video;
+  EXPECT_FALSE(ReadRGBDSequenceFile(directory.File("missing.lvrgbd").c_str(), &video));
+  
+  string path = directory.File("invalid.lvrgbd");
+  FILE* file = fopen(path.c_str(), "wb");
+  ASSERT_TRUE(file != nullptr);
+  fprintf(file, "This is not an RGB-D sequence file, but it is long enough to contain a header.");
+  fclose(file);
+  EXPECT_FALSE(ReadRGBDSequenceFile(path.c_str(), &video));
+}
+
+// Compares the throughput of loading all images of a video from PNG files and
+// from sequence files. The files are in the page cache after writing them, so
+// this measures the decoding and copying cost rather than disk I/O.
+TEST(RGBDSequenceFile, DISABLED_IngestionBenchmark) {
+  constexpr int kWidth = 640;
+  constexpr int kHeight = 480;
+  constexpr int kFrameCount = 30;
+  
+  RGBDVideo<Vec3u8, u16> video;
+  CreateTestVideo(kWidth, kHeight, kFrameCount, &video);
+  
+  TemporaryDirectory directory;
+  RGBDVideo<Vec3u8, u16> png_video;
+  for (int i = 0; i < kFrameCount; ++ i) {
+    string depth_path = directory.File(std::to_string(i) + "_depth.png");
+    string color_path = directory.File(std::to_string(i) + "_color.png");
+    ASSERT_TRUE(video.depth_frame_mutable(i)->GetImage()->Write(depth_path));
+    ASSERT_TRUE(video.color_frame_mutable(i)->GetImage()->Write(color_path));
+    png_video.depth_frames_mutable()->push_back(ImageFramePtr<u16, SE3f>(new ImageFrame<u16, SE3f>(depth_path)));
+    png_video.color_frames_mutable()->push_back(ImageFramePtr<Vec3u8, SE3f>(new ImageFrame<Vec3u8, SE3f>(color_path)));
+  }
+  
+  string raw_path = directory.File("raw.lvrgbd");
+  string zlib_path = directory.File("zlib.lvrgbd");
+  ASSERT_TRUE(WriteRGBDSequenceFile(raw_path.c_str(), RGBDSequenceFileEncoding::kRaw, &video));
+  ASSERT_TRUE(WriteRGBDSequenceFile(zlib_path.c_str(), RGBDSequenceFileEncoding::kZlib, &video));
+  
+  RGBDVideo<Vec3u8, u16> raw_video;
+  shared_ptr<RGBDSequenceFile> raw_file;
+  ASSERT_TRUE(ReadRGBDSequenceFile(raw_path.c_str(), &raw_video, &raw_file));
+  RGBDVideo<Vec3u8, u16> zlib_video;
+  ASSERT_TRUE(ReadRGBDSequenceFile(zlib_path.c_str(), &zlib_video));
+  
+  // Loads all images through the image caches and returns the time in seconds.
+  auto load_all = [&](RGBDVideo<Vec3u8, u16>* loaded_video) {
+    Timer timer("");
+    for (int i = 0; i < kFrameCount; ++ i) {
+      CHECK(loaded_video->depth_frame_mutable(i)->GetImage());
+      CHECK(loaded_video->color_frame_mutable(i)->GetImage());
+    }
+    double seconds = timer.Stop(false);
+    for (int i = 0; i < kFrameCount; ++ i) {
+      loaded_video->depth_frame_mutable(i)->ClearImageAndDerivedData();
+      loaded_video->color_frame_mutable(i)->ClearImageAndDerivedData();
+    }
+    return seconds;
+  };
+  
+  // Copies the mapped raw images into a buffer, as for a page-locked upload
+  // buffer, and returns the time in seconds.
+  auto copy_mapped = [&]() {
+    vector<u16> depth_buffer(kWidth * kHeight);
+    vector<u8> color_buffer(kWidth * kHeight * sizeof(Vec3u8));
+    Timer timer("");
+    raw_file->Prefetch(0, kFrameCount);
+    for (int i = 0; i < kFrameCount; ++ i) {
+      memcpy(depth_buffer.data(), raw_file->depth_data(i), kWidth * kHeight * sizeof(u16));
+      memcpy(color_buffer.data(), raw_file->color_data(i), kWidth * kHeight * sizeof(Vec3u8));
+    }
+    return timer.Stop(false);
+  };
+  
+  usize png_bytes = 0;
+  for (int i = 0; i < kFrameCount; ++ i) {
+    png_bytes += boost::filesystem::file_size(png_video.depth_frame_mutable(i)->image_path());
+    png_bytes += boost::filesystem::file_size(png_video.color_frame_mutable(i)->image_path());
+  }
+  
+  struct Result {
+    const char* name;
+    double seconds;
+    usize file_bytes;
+  };
+  Result results[4] = {
+      {"PNG files", load_all(&png_video), png_bytes},
+      {"sequence file (raw)", load_all(&raw_video), static_cast<usize>(boost::filesystem::file_size(raw_path))},
+      {"sequence file (zlib)", load_all(&zlib_video), static_cast<usize>(boost::filesystem::file_size(zlib_path))},
+      {"sequence file (raw, mapped copy)", copy_mapped(), static_cast<usize>(boost::filesystem::file_size(raw_path))}};
+  
+  const double megabytes = kFrameCount * kWidth * kHeight * (sizeof(u16) + sizeof(Vec3u8)) / (1024.0 * 1024.0);
+  for (const Result& result : results) {
+    LOG(INFO) << result.name << ": " << (1000 * result.seconds / kFrameCount) << " ms/frame, "
+              << (kFrameCount / result.seconds) << " frames/s, "
+              << (megabytes / result.seconds) << " MiB/s of image data, file size "
+              << (result.file_bytes / (1024.0 * 1024.0)) << " MiB";
+  }
+}
@@ -0,0 +1,203 @@
+// Copyright 2018 ETH Zürich, Thomas Schöps
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+//
+// 1. Redistributions of source code must retain the above copyright notice,
+//    this list of conditions and the following disclaimer.
+//
+// 2. Redistributions in binary form must reproduce the above copyright notice,
+//    this list of conditions and the following disclaimer in the documentation
+//    and/or other materials provided with the distribution.
+//
+// 3. Neither the name of the copyright holder nor the names of its contributors
+//    may be used to endorse or promote products derived from this software
+//    without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+// IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+// ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+// LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+// CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+// SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+// INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+// CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+// ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+// POSSIBILITY OF SUCH DAMAGE.
+
+
+#include <boost/filesystem.hpp>
+#include <glog/logging.h>
+#include <gtest/gtest.h>
+
+#include "libvis/image.h"
+#include "libvis/rgbd_video.h"
+#include "libvis/rgbd_video_prefetcher.h"
+
+using namespace vis;
+
+namespace {
+
+constexpr int kWidth = 64;
+constexpr int kHeight = 48;
+
+// Writes frame_count color and depth images to a temporary directory, in which
+// each image is filled with a value depending on its frame index, and returns
+// a video referencing them.
+class TestVideo {
+ public:
+  explicit TestVideo(int frame_count) {
+    directory_ = boost::filesystem::temp_directory_path() /
+                 boost::filesystem::unique_path("libvis_prefetcher_test_%%%%%%%%");
+    boost::filesystem::create_directories(directory_);
+    
+    for (int i = 0; i < frame_count; ++ i) {
+      Image<Vec3u8> color(kWidth, kHeight);
+      for (int y = 0; y < kHeight; ++ y) {
+        for (int x = 0; x < kWidth; ++ x) {
+          color(x, y) = Vec3u8(i, 2 * i, 3 * i);
+        }
+      }
+      string color_path = (directory_ / (std::to_string(i) + "_color.png")).string();
+      CHECK(color.Write(color_path));
+      video_.color_frames_mutable()->push_back(
+          ImageFramePtr<Vec3u8, SE3f>(new ImageFrame<Vec3u8, SE3f>(color_path)));
+      
+      Image<u16> depth(kWidth, kHeight);
+      depth.SetTo(static_cast<u16>(1000 + i));
+      string depth_path = (directory_ / (std::to_string(i) + "_depth.png")).string();
+      CHECK(depth.Write(depth_path));
+      video_.depth_frames_mutable()->push_back(
+          ImageFramePtr<u16, SE3f>(new ImageFrame<u16, SE3f>(depth_path)));
+    }
+  }
+  
+  ~TestVideo() {
+    boost::filesystem::remove_all(directory_);
+  }
+  
+  // Checks that the images of the frame are loaded and have the right content.
+  void ExpectFrameLoaded(int i) {
+    ASSERT_TRUE(video_.color_frame_mutable(i)->IsImageLoaded());
+    ASSERT_TRUE(video_.depth_frame_mutable(i)->IsImageLoaded());
+    EXPECT_EQ(Vec3u8(i, 2 * i, 3 * i), (*video_.color_frame_mutable(i)->GetImage())(kWidth - 1, kHeight - 1));
+    EXPECT_EQ(1000 + i, (*video_.depth_frame_mutable(i)->GetImage())(kWidth - 1, kHeight - 1));
+  }
+  
+  bool IsFrameLoaded(int i) {
+    return video_.color_frame_mutable(i)->IsImageLoaded() ||
+           video_.depth_frame_mutable(i)->IsImageLoaded();
+  }
+  
+  inline RGBDVideo<Vec3u8, u16>* video() { return &video_; }
+  
+ private:
+  boost::filesystem::path directory_;
+  RGBDVideo<Vec3u8, u16> video_;
+};
+
+}
+
+// Loads all frames with a large budget and checks their content.
+TEST(RGBDVideoPrefetcher, LoadsFrames) {
+  constexpr int kFrameCount = 12;
+  TestVideo test_video(kFrameCount);
+  
+  for (int thread_count = 0; thread_count <= 3; ++ thread_count) {
+    RGBDVideoPrefetcher<Vec3u8, u16> prefetcher(test_video.video(), thread_count, 1024 * 1024 * 1024);
+    prefetcher.Prefetch(0, kFrameCount);
+    for (int i = 0; i < kFrameCount; ++ i) {
+      prefetcher.WaitForFrame(i);
+      test_video.ExpectFrameLoaded(i);
+    }
+    EXPECT_GT(prefetcher.loaded_bytes(), 0u);
+    
+    for (int i = 0; i < kFrameCount; ++ i) {
+      prefetcher.Release(i);
+      EXPECT_FALSE(test_video.IsFrameLoaded(i));
+    }
+    EXPECT_EQ(0u, prefetcher.loaded_bytes());
+  }
+}
+
+// Processes the video with a sliding window like the SurfelMeshing main loop
+// and checks that the loaded images never exceed the memory budget.
+TEST(RGBDVideoPrefetcher, RespectsMemoryBudget) {
+  constexpr int kFrameCount = 30;
+  constexpr int kWindowSize = 10;
+  TestVideo test_video(kFrameCount);
+  
+  const usize frame_bytes =
+      kHeight * Image<Vec3u8>(kWidth, kHeight).stride() +
+      kHeight * Image<u16>(kWidth, kHeight).stride();
+  const usize max_bytes = 3 * frame_bytes;
+  
+  RGBDVideoPrefetcher<Vec3u8, u16> prefetcher(test_video.video(), 2, max_bytes);
+  for (int i = 0; i < kFrameCount; ++ i) {
+    prefetcher.Prefetch(i, i + kWindowSize);
+    prefetcher.WaitForFrame(i);
+    test_video.ExpectFrameLoaded(i);
+    prefetcher.Release(i);
+  }
+  
+  EXPECT_GE(prefetcher.peak_loaded_bytes(), frame_bytes);
+  EXPECT_LE(prefetcher.peak_loaded_bytes(), max_bytes);
+}
+
+// Releases frames while they may be loading and checks that no images remain
+// loaded.
+TEST(RGBDVideoPrefetcher, ReleaseWhileLoading) {
+  constexpr int kFrameCount = 20;
+  TestVideo test_video(kFrameCount);
+  
+  {
+    RGBDVideoPrefetcher<Vec3u8, u16> prefetcher(test_video.video(), 3, 1024 * 1024 * 1024);
+    prefetcher.Prefetch(0, kFrameCount);
+    for (int i = 0; i < kFrameCount; ++ i) {
+      prefetcher.Release(i);
+    }
+  }
+  
+  for (int i = 0; i < kFrameCount; ++ i) {
+    EXPECT_FALSE(test_video.IsFrameLoaded(i)) << "Frame " << i;
+  }
+}
+
+// Accesses frames outside of the prefetch window with a budget of three frames
+// and checks that the least recently used frames are evicted and reloaded.
+TEST(RGBDVideoPrefetcher, EvictsLeastRecentlyUsedFrames) {
+  constexpr int kFrameCount = 5;
+  TestVideo test_video(kFrameCount);
+  
+  const usize frame_bytes =
+      kHeight * Image<Vec3u8>(kWidth, kHeight).stride() +
+      kHeight * Image<u16>(kWidth, kHeight).stride();
+  
+  RGBDVideoPrefetcher<Vec3u8, u16> prefetcher(test_video.video(), 0, 3 * frame_bytes);
+  for (int i = 0; i < 3; ++ i) {
+    prefetcher.Prefetch(i, i + 1);
+    prefetcher.WaitForFrame(i);
+  }
+  prefetcher.WaitForFrame(0);
+  EXPECT_EQ(1u, prefetcher.hit_count());
+  EXPECT_EQ(3u, prefetcher.miss_count());
+  EXPECT_EQ(0u, prefetcher.eviction_count());
+  
+  // Frame 1 is the least recently used one.
+  prefetcher.Prefetch(3, 4);
+  prefetcher.WaitForFrame(3);
+  EXPECT_FALSE(test_video.IsFrameLoaded(1));
+  EXPECT_EQ(1u, prefetcher.eviction_count());
+  
+  // Frame 1 is reloaded, and frame 2 is evicted.
+  prefetcher.WaitForFrame(1);
+  test_video.ExpectFrameLoaded(1);
+  EXPECT_FALSE(test_video.IsFrameLoaded(2));
+  test_video.ExpectFrameLoaded(0);
+  test_video.ExpectFrameLoaded(3);
+  EXPECT_EQ(1u, prefetcher.hit_count());
+  EXPECT_EQ(5u, prefetcher.miss_count());
+  EXPECT_EQ(2u, prefetcher.eviction_count());
+  EXPECT_EQ(3 * frame_bytes, prefetcher.loaded_bytes());
+}